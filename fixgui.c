@@ -160,6 +160,22 @@ static __thread WorkerCommon *cur_thread_worker = NULL;
 #endif
 #endif
 
+#ifndef __EMSCRIPTEN__
+typedef struct PooledHeap {
+   Heap *heap;
+   Script *script;
+   char *script_name;
+   uint32_t release_time;
+   struct PooledHeap *next;
+} PooledHeap;
+
+static Worker *volatile worker_pool_reaper = NULL;
+static PooledHeap *worker_pool = NULL;
+static int worker_pool_count = 0;
+static int worker_pool_max_idle = 0;
+static int worker_pool_idle_timeout = 0;
+#endif
+
 static Heap *gui_heap;
 static Heap *fixio_heap;
 static void (*fixio_process_func)(Heap *);
@@ -2527,6 +2543,154 @@ error:
 
 #ifndef __EMSCRIPTEN__
 
+static int worker_pool_lock()
+{
+   Worker *reaper = worker_pool_reaper;
+
+   if (!reaper) {
+      return 0;
+   }
+   worker_lock(reaper);
+   return 1;
+}
+
+
+static void worker_pool_unlock()
+{
+   worker_unlock(worker_pool_reaper);
+}
+
+
+static PooledHeap *worker_pool_reap(uint32_t time, int *next_timeout)
+{
+   PooledHeap *ph, **prev, *expired = NULL;
+   int cnt = 0, remaining;
+
+   *next_timeout = -1;
+   prev = &worker_pool;
+   while ((ph = *prev)) {
+      remaining = worker_pool_idle_timeout - (int)(time - ph->release_time);
+      if (++cnt > worker_pool_max_idle || remaining <= 0) {
+         *prev = ph->next;
+         ph->next = expired;
+         expired = ph;
+         worker_pool_count--;
+         continue;
+      }
+      if (*next_timeout < 0 || remaining < *next_timeout) {
+         *next_timeout = remaining;
+      }
+      prev = &ph->next;
+   }
+   return expired;
+}
+
+
+static void worker_pool_free(PooledHeap *ph)
+{
+   PooledHeap *next;
+
+   for (; ph; ph = next) {
+      next = ph->next;
+      fixscript_free_heap(ph->heap);
+      free(ph->script_name);
+      free(ph);
+   }
+}
+
+
+// frees the expired heaps in the background, it's woken up on every change of the pool:
+static void worker_pool_reaper_func(void *data)
+{
+   Worker *reaper = data;
+   PooledHeap *expired;
+   int timeout;
+
+   worker_lock(reaper);
+   for (;;) {
+      expired = worker_pool_reap(timer_get_time(), &timeout);
+      if (expired) {
+         worker_unlock(reaper);
+         worker_pool_free(expired);
+         worker_lock(reaper);
+         continue;
+      }
+      worker_wait(reaper, timeout);
+   }
+}
+
+
+static Script *worker_pool_acquire(Heap **heap, const char *script_name)
+{
+   PooledHeap *ph, **prev;
+   Script *script = NULL;
+
+   if (!worker_pool_lock()) {
+      return NULL;
+   }
+   for (prev = &worker_pool; (ph = *prev); prev = &ph->next) {
+      if (strcmp(ph->script_name, script_name) == 0) {
+         *prev = ph->next;
+         worker_pool_count--;
+         *heap = ph->heap;
+         script = ph->script;
+         free(ph->script_name);
+         free(ph);
+         break;
+      }
+   }
+   worker_pool_unlock();
+   return script;
+}
+
+
+static int worker_pool_has_space()
+{
+   int ret;
+
+   if (!worker_pool_lock()) {
+      return 0;
+   }
+   ret = (worker_pool_count < worker_pool_max_idle);
+   worker_pool_unlock();
+   return ret;
+}
+
+
+// only freshly loaded heaps can be put into the pool, the scripts may keep any state in global
+// variables once a function is run:
+static int worker_pool_release(Heap *heap, Script *script, const char *script_name)
+{
+   PooledHeap *ph;
+
+   if (!worker_pool_has_space()) {
+      return 0;
+   }
+
+   ph = calloc(1, sizeof(PooledHeap));
+   if (!ph) {
+      return 0;
+   }
+   ph->script_name = strdup(script_name);
+   if (!ph->script_name) {
+      free(ph);
+      return 0;
+   }
+   ph->heap = heap;
+   ph->script = script;
+
+   fixscript_collect_heap(heap);
+   ph->release_time = timer_get_time();
+
+   worker_pool_lock();
+   ph->next = worker_pool;
+   worker_pool = ph;
+   worker_pool_count++;
+   worker_pool_unlock();
+   return 1;
+}
+
+
 static void worker_free(void *data)
 {
    WorkerCommon *worker = data;
@@ -2559,9 +2723,12 @@ static void worker_main_func(void *data)
    Script *script;
    Value params, error, *values = NULL, func_val;
    char buf[128];
-   int err, num_params;
+   int err, num_params, reuse_heap = 0, refill_pool = 0;
 
-   script = worker->load.func(&heap, worker->script_name, &error, worker->load.data);
+   script = worker_pool_acquire(&heap, worker->script_name);
+   if (!script) {
+      script = worker->load.func(&heap, worker->script_name, &error, worker->load.data);
+   }
    if (!script) {
       if (heap) {
          fprintf(stderr, "%s\n", fixscript_get_compiler_error(heap, error));
@@ -2584,6 +2751,12 @@ static void worker_main_func(void *data)
 
    fixscript_unref(worker->comm_heap, worker->params);
 
+   if (!worker->func_name) {
+      // preloading only:
+      reuse_heap = 1;
+      goto error;
+   }
+
    err = fixscript_get_array_length(heap, params, &num_params);
    if (err) {
       fixscript_error(heap, &error, err);
@@ -2614,6 +2787,7 @@ static void worker_main_func(void *data)
    cur_thread_worker = worker;
 #endif
 
+   refill_pool = 1;
    fixscript_call_args(heap, func_val, num_params, &error, values);
    if (error.value) {
       fixscript_dump_value(heap, error, 1);
@@ -2635,10 +2809,26 @@ error:
    __sync_add_and_fetch(&worker->refcnt, 1);
    worker_notify((Worker *)worker);
 
-   worker_free(worker);
+   if (heap && reuse_heap && worker_pool_release(heap, script, worker->script_name)) {
+      heap = NULL;
+   }
    if (heap) {
       fixscript_free_heap(heap);
+      heap = NULL;
    }
+
+   // prepare a fresh heap for the next worker in place of the used one:
+   if (refill_pool && worker_pool_has_space()) {
+      script = worker->load.func(&heap, worker->script_name, &error, worker->load.data);
+      if (script && worker_pool_release(heap, script, worker->script_name)) {
+         heap = NULL;
+      }
+      if (heap) {
+         fixscript_free_heap(heap);
+      }
+   }
+
+   worker_free(worker);
 }
 
 
@@ -2715,6 +2905,7 @@ static Value func_worker_create(Heap *heap, Value *error, int num_params, Value
 {
    WorkerLoad *wl = data;
    WorkerCommon *worker = NULL;
+   int preload = (num_params == 1);
    int err;
 
    if (!wl->func) {
@@ -2751,11 +2942,11 @@ static Value func_worker_create(Heap *heap, Value *error, int num_params, Value
    fixscript_ref(worker->comm_heap, worker->comm_output);
 
    err = fixscript_get_string(heap, params[0], 0, -1, &worker->script_name, NULL);
-   if (!err) {
+   if (!err && !preload) {
       err = fixscript_get_string(heap, params[1], 0, -1, &worker->func_name, NULL);
    }
    if (!err) {
-      err = fixscript_clone_between(worker->comm_heap, heap, params[2], &worker->params, NULL, NULL, NULL);
+      err = fixscript_clone_between(worker->comm_heap, heap, preload? fixscript_int(0) : params[2], &worker->params, NULL, NULL, NULL);
    }
    if (err) {
       return fixscript_error(heap, error, err);
@@ -2763,9 +2954,11 @@ static Value func_worker_create(Heap *heap, Value *error, int num_params, Value
 
    fixscript_ref(heap, worker->params);
 
-   worker->callback_func = params[3];
-   worker->callback_data = params[4];
-   fixscript_ref(heap, worker->callback_data);
+   if (!preload) {
+      worker->callback_func = params[3];
+      worker->callback_data = params[4];
+      fixscript_ref(heap, worker->callback_data);
+   }
 
    worker->refcnt++;
    if (!worker_start((Worker *)worker)) {
@@ -2778,10 +2971,43 @@ static Value func_worker_create(Heap *heap, Value *error, int num_params, Value
 
    worker->main_heap = heap;
    fixscript_ref(heap, worker->handle);
+   if (preload) {
+      return fixscript_int(0);
+   }
    return worker->handle;
 }
 
 
+static Value func_worker_set_pool_limits(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+   Worker *reaper;
+
+   if (!worker_pool_reaper) {
+      if (params[0].value <= 0) {
+         return fixscript_int(0);
+      }
+      reaper = worker_create();
+      if (!reaper) {
+         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      }
+      ((WorkerCommon *)reaper)->main_func = worker_pool_reaper_func;
+      if (!worker_start(reaper)) {
+         worker_destroy(reaper);
+         *error = fixscript_create_error_string(heap, "can't start worker pool reaper");
+         return fixscript_int(0);
+      }
+      __sync_synchronize();
+      worker_pool_reaper = reaper;
+   }
+
+   worker_pool_lock();
+   worker_pool_max_idle = params[0].value;
+   worker_pool_idle_timeout = params[1].value;
+   worker_pool_unlock();
+   return fixscript_int(0);
+}
+
+
 static Value func_worker_send(Heap *heap, Value *error, int num_params, Value *params, void *data)
 {
    int inside = (num_params == 1);
@@ -3597,6 +3823,8 @@ void fixgui_register_functions(Heap *heap, WorkerLoadFunc load_func, void *load_
    fixscript_register_native_func(heap, "show_message#4", func_show_message, NULL);
 #ifndef __EMSCRIPTEN__
    fixscript_register_native_func(heap, "worker_create#5", func_worker_create, wl);
+   fixscript_register_native_func(heap, "worker_preload#1", func_worker_create, wl);
+   fixscript_register_native_func(heap, "worker_set_pool_limits#2", func_worker_set_pool_limits, NULL);
    fixscript_register_native_func(heap, "worker_send#2", func_worker_send, NULL);
 #endif
    fixscript_register_native_func(heap, "timer_get_time#0", func_timer_get_time, NULL);
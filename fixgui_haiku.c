@@ -2012,7 +2012,7 @@ void system_font_draw_string(SystemFont *font, int x, int y, plat_char *text, ui
    int offset, width, height, ascent, descent, off_x, off_y;
    int i, j;
    int a, r, g, b;
-   uint32_t p;
+   uint32_t p, *row;
    rgb_color rgb_color;
    BRect rect;
    BPoint point;
@@ -2053,6 +2053,9 @@ void system_font_draw_string(SystemFont *font, int x, int y, plat_char *text, ui
       if (height <= 0) return;
    }
 
+   row = malloc(width * sizeof(uint32_t));
+   if (!row) return;
+
    bitmap = new(BBITMAP_SIZE);
    rect.left = 0;
    rect.top = 0;
@@ -2067,19 +2070,7 @@ void system_font_draw_string(SystemFont *font, int x, int y, plat_char *text, ui
    int stride = BBitmap_BytesPerRow(bitmap)/4;
 
    for (i=0; i<height; i++) {
-      for (j=0; j<width; j++) {
-         p = pixels[(y+i)*dest_stride+(x+j)];
-         a = (p >> 24) & 0xFF;
-         r = (p >> 16) & 0xFF;
-         g = (p >>  8) & 0xFF;
-         b = (p >>  0) & 0xFF;
-         if (a != 0 && a != 255) {
-            r = r * 255 / a;
-            g = g * 255 / a;
-            b = b * 255 / a;
-         }
-         bits[i*stride+j] = (a << 24) | (r << 16) | (g << 8) | b;
-      }
+      fiximage_unpremultiply(bits+i*stride, pixels+(y+i)*dest_stride+x, width);
    }
 
    rgb_color.alpha = (color >> 24) & 0xFF;
@@ -2103,23 +2094,13 @@ void system_font_draw_string(SystemFont *font, int x, int y, plat_char *text, ui
    BBitmap_RemoveChild(bitmap, view);
    BBitmap_Unlock(bitmap);
 
-   delete_virtual(view);
-   delete_virtual(bitmap);
-
+   // only the pixels changed by the drawing are written back (compared with the same conversion as used
+   // for the upload to the bitmap):
    for (i=0; i<height; i++) {
+      fiximage_unpremultiply(row, pixels+(y+i)*dest_stride+x, width);
       for (j=0; j<width; j++) {
-         p = pixels[(y+i)*dest_stride+(x+j)];
-         a = (p >> 24) & 0xFF;
-         r = (p >> 16) & 0xFF;
-         g = (p >>  8) & 0xFF;
-         b = (p >>  0) & 0xFF;
-         if (a != 0 && a != 255) {
-            r = r * 255 / a;
-            g = g * 255 / a;
-            b = b * 255 / a;
-         }
          p = bits[i*stride+j];
-         if (p != (uint32_t)((a << 24) | (r << 16) | (g << 8) | b)) {
+         if (p != row[j]) {
             a = (p >> 24) & 0xFF;
             r = (p >> 16) & 0xFF;
             g = (p >>  8) & 0xFF;
@@ -2131,6 +2112,10 @@ void system_font_draw_string(SystemFont *font, int x, int y, plat_char *text, ui
          }
       }
    }
+
+   delete_virtual(view);
+   delete_virtual(bitmap);
+   free(row);
 }
 
 
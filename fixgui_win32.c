@@ -2129,10 +2129,9 @@ static HICON create_icon(Heap *heap, Value image)
    HICON icon = NULL;
    ICONINFO ii;
    int width, height, stride;
-   uint32_t *pixels, *bits, p;
+   uint32_t *pixels, *bits;
    char *mask_bits;
-   int i, j;
-   int a, r, g, b;
+   int i;
 
    if (!fiximage_get_data(heap, image, &width, &height, &stride, &pixels, NULL, NULL)) {
       return NULL;
@@ -2145,19 +2144,7 @@ static HICON create_icon(Heap *heap, Value image)
       mask_bits = calloc(1, (width*height+7)/8);
       if (mask_bits) {
          for (i=0; i<height; i++) {
-            for (j=0; j<width; j++) {
-               p = pixels[i*stride+j];
-               a = (p >> 24) & 0xFF;
-               r = (p >> 16) & 0xFF;
-               g = (p >>  8) & 0xFF;
-               b = (p >>  0) & 0xFF;
-               if (a != 0) {
-                  r = r*255/a;
-                  g = g*255/a;
-                  b = b*255/a;
-               }
-               bits[i*width+j] = (a << 24) | (r << 16) | (g << 8) | b;
-            }
+            fiximage_unpremultiply(bits+i*width, pixels+i*stride, width);
          }
          ii.hbmColor = CreateBitmap(width, height, 1, 32, bits);
          if (ii.hbmColor) {
@@ -32,6 +32,7 @@
 #else
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
 #include <errno.h>
 #endif
 #ifdef __APPLE__
@@ -43,6 +44,11 @@
 #include <xmmintrin.h>
 #include <emmintrin.h>
 #endif
+#if defined(__SSE2__) && defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define FIXIMAGE_AVX2
+#include <immintrin.h>
+#define AVX2_FUNC __attribute__((target("avx2")))
+#endif
 
 #define MIN(a, b) ((a)<(b)? (a):(b))
 #define MAX(a, b) ((a)>(b)? (a):(b))
@@ -53,6 +59,17 @@
 #define MAX_RECURSION   10
 #define MAX_DIST_SQR    (0.1*0.1)
 #define BATCH_TILE_SIZE 256
+#define ATLAS_WIDTH      1024
+#define ATLAS_MAX_HEIGHT 1024
+
+#define DOWNSCALE_LANCZOS       0x01
+#define DOWNSCALE_GAMMA_CORRECT 0x02
+#define LINEAR_TABLE_SIZE       16384
+
+#define ZFAST_BITS          10
+#define ZCOMP_NUM_BUCKETS   4096 // 4096*16*2 = 128KB (at most)
+#define ZCOMP_DEFAULT_LEVEL 4
+#define ZCOMP_HASH(c1, c2, c3) (((((uint32_t)(c1) << 16) | ((c2) << 8) | (c3)) * 0x9E3779B1U) >> 20)
 
 #define REFCNT_LIMIT ((1<<30)-1)
 
@@ -127,6 +144,7 @@ typedef struct ImageData {
    ImageFreeFunc free_func;
    void *free_data;
    int type;
+   int serial;
 } ImageData;
 
 typedef struct {
@@ -203,6 +221,7 @@ enum {
 
 typedef struct BatchOp {
    int type;
+   uint64_t hash;
    union {
       struct {
          FillRectData data;
@@ -226,7 +245,8 @@ typedef struct BatchTile {
    int x1, y1, x2, y2;
    BatchOp **ops;
    int cnt, cap;
-   struct BatchTile *cur_next;
+   uint64_t hash, prev_hash;
+   int prev_valid, dirty;
 } BatchTile;
 
 struct CoreThread;
@@ -238,12 +258,33 @@ typedef struct {
    BatchOp *ops;
    pthread_mutex_t mutex;
    pthread_cond_t *conds;
-   BatchTile *cur_tiles;
    struct CoreThread **geom_threads;
    BatchGeom *geoms;
    int geom_done;
+   int track_changes;
+   Rect *damaged;
+   int damaged_cnt, damaged_cap;
 } Painter;
 
+typedef struct {
+   int font, key;
+   int x, y, width, height;
+   int off_x, off_y;
+} AtlasGlyph;
+
+// the coverage is stored as bytes, subpixel glyphs use 3 bytes per pixel:
+typedef struct {
+   Heap *heap;
+   int size;
+   uint8_t *pixels;
+   int height;
+   int shelf_x, shelf_y, shelf_height;
+   AtlasGlyph *glyphs;
+   int glyphs_cnt, glyphs_cap;
+   int *hash;
+   int hash_size;
+} GlyphAtlas;
+
 typedef struct {
    Heap *heap;
    Value array;
@@ -266,7 +307,9 @@ enum {
 
    // internal:
    BC_OUTPUT_BLEND_SUBPIXEL,
-   BC_OUTPUT_REPLACE_SUBPIXEL
+   BC_OUTPUT_REPLACE_SUBPIXEL,
+   BC_SAMPLE_NEAREST_SPAN,
+   BC_MUL_COLOR
 };
 
 enum {
@@ -375,6 +418,16 @@ static inline int x__sync_sub_and_fetch(volatile int *ptr, int amount)
    return *ptr;
 }
 
+#define __sync_bool_compare_and_swap x__sync_bool_compare_and_swap
+static inline int x__sync_bool_compare_and_swap(volatile int *ptr, int old_value, int new_value)
+{
+   if (*ptr == old_value) {
+      *ptr = new_value;
+      return 1;
+   }
+   return 0;
+}
+
 #define __sync_val_compare_and_swap(ptr,old,new) x__sync_val_compare_and_swap((void **)(ptr),old,new)
 static inline void *x__sync_val_compare_and_swap(void **ptr, void *old_value, void *new_value)
 {
@@ -386,11 +439,25 @@ static inline void *x__sync_val_compare_and_swap(void **ptr, void *old_value, vo
 }
 #endif
 
-#define NUM_HANDLE_TYPES 2
-#define HANDLE_TYPE_IMAGE_DATA (handles_offset+0)
-#define HANDLE_TYPE_PAINTER    (handles_offset+1)
+#define NUM_HANDLE_TYPES 3
+#define HANDLE_TYPE_IMAGE_DATA  (handles_offset+0)
+#define HANDLE_TYPE_PAINTER     (handles_offset+1)
+#define HANDLE_TYPE_GLYPH_ATLAS (handles_offset+2)
 
 static volatile int handles_offset;
+static volatile int image_data_serial;
+enum {
+   SIMD_SCALAR,
+   SIMD_SSE2,
+   SIMD_AVX2
+};
+
+#ifdef __SSE2__
+static int simd_sse2 = 1;
+#endif
+#ifdef FIXIMAGE_AVX2
+static int simd_avx2, simd_avx2_supported;
+#endif
 
 typedef struct CoreThread {
    pthread_mutex_t mutex;
@@ -403,12 +470,72 @@ typedef struct CoreThread {
    char padding[128];
 } CoreThread;
 
+enum {
+   JOB_FREE,
+   JOB_INIT,
+   JOB_ACTIVE,
+   JOB_CLOSING
+};
+
+#define MAX_JOBS    64
+#define MAX_WORKERS 63
+
+typedef struct {
+   volatile int state;
+   volatile int users;
+   volatile int next;
+   volatile int done;
+   volatile int helpers;
+   volatile int waiting;
+   MulticoreFunc func;
+   void *data;
+   int from, to, chunk;
+   int max_helpers;
+   int limit;
+   pthread_mutex_t mutex;
+   pthread_cond_t cond;
+   char padding[128];
+} MulticoreJob;
+
+typedef struct {
+   pthread_mutex_t mutex;
+   pthread_cond_t cond;
+   volatile int sleeping;
+   int idx;
+   char padding[128];
+} MulticoreWorker;
+
+typedef struct BackgroundTask {
+   BackgroundFunc func;
+   void *data;
+   struct BackgroundTask *next;
+} BackgroundTask;
+
 static volatile int multicore_num_cores;
-static pthread_mutex_t *multicore_mutex;
-static CoreThread *multicore_threads;
+static volatile int multicore_init_state;
+static MulticoreJob multicore_jobs[MAX_JOBS];
+static MulticoreWorker multicore_workers[MAX_WORKERS];
+static int multicore_num_workers;
+static volatile int multicore_work_seq;
+static pthread_mutex_t core_threads_mutex;
+static CoreThread *core_threads;
+static pthread_cond_t background_cond;
+static int background_available;
+static BackgroundTask *background_first, *background_last;
+static int background_num_threads, background_idle_threads;
+
+#if defined(__APPLE__) || defined(__HAIKU__) || defined(__SYMBIAN32__)
+static pthread_key_t thread_limit_key;
+#define get_thread_limit() ((int)(intptr_t)pthread_getspecific(thread_limit_key))
+#define set_thread_limit(limit) pthread_setspecific(thread_limit_key, (void *)(intptr_t)(limit))
+#else
+static __thread int thread_limit;
+#define get_thread_limit() (thread_limit)
+#define set_thread_limit(limit) (thread_limit = (limit))
+#endif
 
 static uint32_t *load_png(const unsigned char *buf, int len, int *width, int *height);
-static int save_png(const uint32_t *pixels, int stride, int width, int height, unsigned char **dest_out, int *dest_len_out);
+static int save_png(const uint32_t *pixels, int stride, int width, int height, int level, unsigned char **dest_out, int *dest_len_out);
 
 
 #if defined(_WIN32)
@@ -423,20 +550,20 @@ static void *thread_main(void *data)
    for (;;) {
       while (!thread->func) {
          if (pthread_cond_timedwait_relative(&thread->cond, &thread->mutex, 5000*1000000LL) == ETIMEDOUT && !thread->func) {
-            pthread_mutex_lock(multicore_mutex);
-            if (thread == multicore_threads) {
-               multicore_threads = thread->next;
-               pthread_mutex_unlock(multicore_mutex);
+            pthread_mutex_lock(&core_threads_mutex);
+            if (thread == core_threads) {
+               core_threads = thread->next;
+               pthread_mutex_unlock(&core_threads_mutex);
                goto end;
             }
-            for (th = multicore_threads; th; th = th->next) {
+            for (th = core_threads; th; th = th->next) {
                if (th->next == thread) {
                   th->next = thread->next;
-                  pthread_mutex_unlock(multicore_mutex);
+                  pthread_mutex_unlock(&core_threads_mutex);
                   goto end;
                }
             }
-            pthread_mutex_unlock(multicore_mutex);
+            pthread_mutex_unlock(&core_threads_mutex);
          }
       }
       pthread_mutex_unlock(&thread->mutex);
@@ -470,19 +597,80 @@ end:
 }
 
 
-static CoreThread *acquire_thread()
+static int start_thread(void *func, void *data)
 {
-   CoreThread *thread;
 #if defined(_WIN32)
    HANDLE handle;
+
+   handle = CreateThread(NULL, 0, func, data, 0, NULL);
+   if (!handle) {
+      return 0;
+   }
+   CloseHandle(handle);
 #else
    pthread_t handle;
+
+   if (pthread_create(&handle, NULL, func, data) != 0) {
+      return 0;
+   }
+   pthread_detach(handle);
+#endif
+   return 1;
+}
+
+
+#if defined(_WIN32)
+static DWORD WINAPI background_thread_main(void *data)
+#else
+static void *background_thread_main(void *data)
+#endif
+{
+   BackgroundTask *task;
+   int timeout;
+
+   pthread_mutex_lock(&core_threads_mutex);
+   for (;;) {
+      while (!background_first) {
+         background_idle_threads++;
+         timeout = pthread_cond_timedwait_relative(&background_cond, &core_threads_mutex, 5000*1000000LL) == ETIMEDOUT;
+         background_idle_threads--;
+         if (timeout && !background_first) {
+            background_num_threads--;
+            pthread_mutex_unlock(&core_threads_mutex);
+#if defined(_WIN32)
+            return 0;
+#else
+            return NULL;
 #endif
+         }
+      }
+      task = background_first;
+      background_first = task->next;
+      if (!background_first) {
+         background_last = NULL;
+      }
+      pthread_mutex_unlock(&core_threads_mutex);
+
+      task->func(task->data);
+      free(task);
+
+      pthread_mutex_lock(&core_threads_mutex);
+   }
+}
+
+
+static CoreThread *acquire_thread()
+{
+   CoreThread *thread;
    int init = 0;
 
-   if (multicore_threads) {
-      thread = multicore_threads;
-      multicore_threads = thread->next;
+   pthread_mutex_lock(&core_threads_mutex);
+   thread = core_threads;
+   if (thread) {
+      core_threads = thread->next;
+   }
+   pthread_mutex_unlock(&core_threads_mutex);
+   if (thread) {
       return thread;
    }
 
@@ -498,19 +686,9 @@ static CoreThread *acquire_thread()
    if (pthread_cond_init(&thread->cond2, NULL) != 0) goto error;
    init = 3;
 
-#if defined(_WIN32)
-   handle = CreateThread(NULL, 0, thread_main, thread, 0, NULL);
-   if (!handle) {
+   if (!start_thread(thread_main, thread)) {
       goto error;
    }
-   CloseHandle(handle);
-#else
-   if (pthread_create(&handle, NULL, thread_main, thread) != 0) {
-      goto error;
-   }
-   pthread_detach(handle);
-#endif
-
    return thread;
 
 error:
@@ -524,8 +702,10 @@ error:
 
 static void release_thread(CoreThread *thread)
 {
-   thread->next = multicore_threads;
-   multicore_threads = thread;
+   pthread_mutex_lock(&core_threads_mutex);
+   thread->next = core_threads;
+   core_threads = thread;
+   pthread_mutex_unlock(&core_threads_mutex);
 }
 
 
@@ -559,134 +739,359 @@ static void finish_in_thread(CoreThread *thread)
 }
 
 
-static void dummy_multicore_func(int from, int to, void *data)
+static void multicore_yield()
 {
+#if defined(_WIN32)
+   SwitchToThread();
+#else
+   sched_yield();
+#endif
 }
 
 
-int fiximage_get_core_count()
+// processes chunks of the job until all of them are claimed, returns non-zero when some work was done:
+static int run_job(MulticoreJob *job, int helper)
 {
-   if (multicore_num_cores == 0) {
-      fiximage_multicore_run(0, 1, 0, dummy_multicore_func, NULL);
+   int start, end, prev_limit, worked = 0;
+
+   if (helper) {
+      if (__sync_add_and_fetch(&job->helpers, 1) > job->max_helpers) {
+         __sync_sub_and_fetch(&job->helpers, 1);
+         return 0;
+      }
    }
-   return multicore_num_cores;
+
+   prev_limit = get_thread_limit();
+   set_thread_limit(job->limit);
+
+   for (;;) {
+      start = __sync_add_and_fetch(&job->next, job->chunk) - job->chunk;
+      if (start >= job->to) break;
+      end = start + job->chunk;
+      if (end > job->to) {
+         end = job->to;
+      }
+      job->func(start, end, job->data);
+      worked = 1;
+
+      if (__sync_add_and_fetch(&job->done, end - start) == job->to - job->from && job->waiting) {
+         pthread_mutex_lock(&job->mutex);
+         pthread_cond_signal(&job->cond);
+         pthread_mutex_unlock(&job->mutex);
+      }
+   }
+
+   set_thread_limit(prev_limit);
+
+   if (helper) {
+      __sync_sub_and_fetch(&job->helpers, 1);
+   }
+   return worked;
 }
 
 
-void fiximage_multicore_run(int from, int to, int min_iters, MulticoreFunc func, void *data)
+static int help_with_jobs(int start_idx)
 {
-   int i, cores, iters_per_core;
-#ifdef _WIN32
-   SYSTEM_INFO si;
-#endif
-   pthread_mutex_t *mutex, *cur_mutex;
-   CoreThread *threads[64];
-   int thread_from, thread_to;
+   MulticoreJob *job;
+   int i, worked = 0;
 
-   if (from >= to) return;
+   for (i=0; i<MAX_JOBS; i++) {
+      job = &multicore_jobs[(start_idx + i) % MAX_JOBS];
+      if (job->state != JOB_ACTIVE || job->next >= job->to) continue;
 
-   if (to - from <= min_iters || multicore_num_cores == 1) {
-      func(from, to, data);
-      return;
+      __sync_add_and_fetch(&job->users, 1);
+      if (job->state == JOB_ACTIVE) {
+         worked |= run_job(job, 1);
+      }
+      __sync_sub_and_fetch(&job->users, 1);
    }
+   return worked;
+}
+
+
+#if defined(_WIN32)
+static DWORD WINAPI worker_main(void *data)
+#else
+static void *worker_main(void *data)
+#endif
+{
+   MulticoreWorker *worker = data;
+   int i, seq;
 
-   mutex = multicore_mutex;
-   if (!mutex) {
-      mutex = calloc(1, sizeof(pthread_mutex_t));
-      if (!mutex) goto failure;
-      if (pthread_mutex_init(mutex, NULL) != 0) {
-         free(mutex);
-         goto failure;
+   for (;;) {
+      seq = multicore_work_seq;
+      if (help_with_jobs(worker->idx)) continue;
+
+      for (i=0; i<100 && multicore_work_seq == seq; i++) {
+         multicore_yield();
       }
-      cur_mutex = __sync_val_compare_and_swap(&multicore_mutex, NULL, mutex);
-      if (cur_mutex) {
-         pthread_mutex_destroy(mutex);
-         free(mutex);
-         mutex = cur_mutex;
+      if (multicore_work_seq != seq) continue;
+
+      pthread_mutex_lock(&worker->mutex);
+      __sync_add_and_fetch(&worker->sleeping, 1);
+      while (multicore_work_seq == seq) {
+         pthread_cond_wait(&worker->cond, &worker->mutex);
       }
+      __sync_sub_and_fetch(&worker->sleeping, 1);
+      pthread_mutex_unlock(&worker->mutex);
+   }
+
+#if defined(_WIN32)
+   return 0;
+#else
+   return NULL;
+#endif
+}
+
+
+static void wake_workers(int count)
+{
+   MulticoreWorker *worker;
+   int i;
+
+   __sync_add_and_fetch(&multicore_work_seq, 1);
+
+   for (i=0; i<multicore_num_workers && count > 0; i++) {
+      worker = &multicore_workers[i];
+      if (worker->sleeping) {
+         pthread_mutex_lock(&worker->mutex);
+         pthread_cond_signal(&worker->cond);
+         pthread_mutex_unlock(&worker->mutex);
+         count--;
+      }
+   }
+}
+
+
+static void multicore_init()
+{
+   MulticoreJob *job;
+   MulticoreWorker *worker;
+   int i, cores;
+#ifdef _WIN32
+   SYSTEM_INFO si;
+#endif
+
+   for (;;) {
+      i = multicore_init_state;
+      if (i == 2) return;
+      if (i == 0 && __sync_bool_compare_and_swap(&multicore_init_state, 0, 1)) break;
+      multicore_yield();
    }
-   
-   pthread_mutex_lock(mutex);
 
-   if (multicore_num_cores == 0) {
 #if defined(_WIN32)
-      GetSystemInfo(&si);
-      multicore_num_cores = si.dwNumberOfProcessors;
+   GetSystemInfo(&si);
+   cores = si.dwNumberOfProcessors;
 #elif defined(__EMSCRIPTEN__)
-      multicore_num_cores = 1;
+   cores = 1;
 #else
-      multicore_num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+   cores = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+   if (cores < 1) {
+      cores = 1;
+   }
+   if (cores > MAX_WORKERS+1) {
+      cores = MAX_WORKERS+1;
+   }
+
+   if (pthread_mutex_init(&core_threads_mutex, NULL) != 0) {
+      cores = 1;
+   }
+   else if (pthread_cond_init(&background_cond, NULL) == 0) {
+      background_available = 1;
+   }
+#if defined(__APPLE__) || defined(__HAIKU__) || defined(__SYMBIAN32__)
+   if (pthread_key_create(&thread_limit_key, NULL) != 0) {
+      cores = 1;
+   }
 #endif
-      if (multicore_num_cores < 1) {
-         multicore_num_cores = 1;
+
+   for (i=0; i<MAX_JOBS && cores > 1; i++) {
+      job = &multicore_jobs[i];
+      if (pthread_mutex_init(&job->mutex, NULL) != 0) {
+         cores = 1;
+         break;
+      }
+      if (pthread_cond_init(&job->cond, NULL) != 0) {
+         pthread_mutex_destroy(&job->mutex);
+         cores = 1;
+         break;
+      }
+   }
+   if (cores == 1) {
+      // the job slots are never claimed when running on single core:
+      for (i--; i>=0; i--) {
+         pthread_cond_destroy(&multicore_jobs[i].cond);
+         pthread_mutex_destroy(&multicore_jobs[i].mutex);
+      }
+   }
+
+   for (i=0; i<cores-1; i++) {
+      worker = &multicore_workers[i];
+      worker->idx = i;
+      if (pthread_mutex_init(&worker->mutex, NULL) != 0) break;
+      if (pthread_cond_init(&worker->cond, NULL) != 0) {
+         pthread_mutex_destroy(&worker->mutex);
+         break;
+      }
+      if (!start_thread(worker_main, worker)) {
+         pthread_cond_destroy(&worker->cond);
+         pthread_mutex_destroy(&worker->mutex);
+         break;
+      }
+   }
+   multicore_num_workers = i;
+   multicore_num_cores = cores;
+
+   __sync_add_and_fetch(&multicore_init_state, 1);
+}
+
+
+int fiximage_get_core_count()
+{
+   multicore_init();
+   return multicore_num_cores;
+}
+
+
+void fiximage_set_thread_limit(int limit)
+{
+   multicore_init();
+   set_thread_limit(limit > 0? limit : 0);
+}
+
+
+int fiximage_get_thread_limit()
+{
+   multicore_init();
+   return get_thread_limit();
+}
+
+
+int fiximage_run_in_background(BackgroundFunc func, void *data)
+{
+   BackgroundTask *task;
+
+   multicore_init();
+   if (!background_available) {
+      return 0;
+   }
+
+   task = malloc(sizeof(BackgroundTask));
+   if (!task) {
+      return 0;
+   }
+   task->func = func;
+   task->data = data;
+   task->next = NULL;
+
+   pthread_mutex_lock(&core_threads_mutex);
+   if (background_idle_threads == 0 && background_num_threads < multicore_num_cores) {
+      if (start_thread(background_thread_main, NULL)) {
+         background_num_threads++;
       }
-      if (multicore_num_cores > sizeof(threads)/sizeof(CoreThread *)) {
-         multicore_num_cores = sizeof(threads)/sizeof(CoreThread *);
+      else if (background_num_threads == 0) {
+         pthread_mutex_unlock(&core_threads_mutex);
+         free(task);
+         return 0;
       }
    }
+   if (background_last) {
+      background_last->next = task;
+   }
+   else {
+      background_first = task;
+   }
+   background_last = task;
+   pthread_cond_signal(&background_cond);
+   pthread_mutex_unlock(&core_threads_mutex);
+   return 1;
+}
+
+
+void fiximage_multicore_run(int from, int to, int min_iters, MulticoreFunc func, void *data)
+{
+   MulticoreJob *job = NULL;
+   int i, threads, chunk, limit;
+
+   if (from >= to) return;
 
-   if (multicore_num_cores == 1) {
-      pthread_mutex_unlock(mutex);
+   if (to - from <= min_iters) {
       func(from, to, data);
       return;
    }
 
+   multicore_init();
+
+   limit = get_thread_limit();
+   threads = multicore_num_workers + 1;
+   if (limit > 0 && limit < threads) {
+      threads = limit;
+   }
    if (min_iters < 1) {
       min_iters = 1;
    }
-   cores = multicore_num_cores;
-   if (to - from < min_iters * cores) {
-      cores = (to - from) / min_iters;
-      min_iters = (to - from + cores - 1) / cores;
+   if ((to - from) / min_iters < threads) {
+      threads = (to - from) / min_iters;
+   }
+
+   // the claimed positions can go past the end by one chunk per thread:
+   if (threads <= 1 || to > INT_MAX - (to - from)) {
+      func(from, to, data);
+      return;
    }
-   iters_per_core = (to - from) / cores;
-   if (iters_per_core < min_iters) {
-      iters_per_core = min_iters;
+
+   chunk = (to - from) / (threads * 8);
+   if (chunk < min_iters) {
+      chunk = min_iters;
    }
 
-   for (i=0; i<cores; i++) {
-      threads[i] = acquire_thread();
-      if (!threads[i]) {
-         cores = i;
-         iters_per_core = (to - from) / cores;
+   for (i=0; i<MAX_JOBS; i++) {
+      if (multicore_jobs[i].state == JOB_FREE && __sync_bool_compare_and_swap(&multicore_jobs[i].state, JOB_FREE, JOB_INIT)) {
+         job = &multicore_jobs[i];
          break;
       }
    }
-
-   pthread_mutex_unlock(mutex);
-
-   if (cores == 0) {
+   if (!job) {
       func(from, to, data);
       return;
    }
-   
-   for (i=0; i<cores; i++) {
-      thread_from = from + iters_per_core * i;
-      thread_to = thread_from + iters_per_core;
-      if (i == cores-1 && thread_to < to) {
-         thread_to = to;
-      }
-      if (thread_to > to) {
-         thread_to = to;
-      }
-      start_in_thread(threads[i], thread_from, thread_to, func, data);
-   }
 
-   for (i=0; i<cores; i++) {
-      finish_in_thread(threads[i]);
-   }
+   job->func = func;
+   job->data = data;
+   job->from = from;
+   job->to = to;
+   job->chunk = chunk;
+   job->max_helpers = threads - 1;
+   job->limit = limit;
+   job->next = from;
+   job->done = 0;
+   job->helpers = 0;
+   job->waiting = 0;
+   __sync_bool_compare_and_swap(&job->state, JOB_INIT, JOB_ACTIVE);
 
-   pthread_mutex_lock(mutex);
-   for (i=cores-1; i>=0; i--) {
-      release_thread(threads[i]);
+   wake_workers(threads - 1);
+   run_job(job, 0);
+
+   // other threads may still work on the last chunks:
+   for (i=0; i<100 && job->done != to - from; i++) {
+      multicore_yield();
+   }
+   if (job->done != to - from) {
+      pthread_mutex_lock(&job->mutex);
+      __sync_add_and_fetch(&job->waiting, 1);
+      while (job->done != to - from) {
+         pthread_cond_wait(&job->cond, &job->mutex);
+      }
+      __sync_sub_and_fetch(&job->waiting, 1);
+      pthread_mutex_unlock(&job->mutex);
    }
-   pthread_mutex_unlock(mutex);
-   return;
 
-failure:
-   multicore_num_cores = 1;
-   func(from, to, data);
-   return;
+   __sync_bool_compare_and_swap(&job->state, JOB_ACTIVE, JOB_CLOSING);
+   while (job->users > 0) {
+      multicore_yield();
+   }
+   __sync_bool_compare_and_swap(&job->state, JOB_CLOSING, JOB_FREE);
 }
 
 
@@ -983,46 +1388,732 @@ static FORCE_INLINE __m128i interpolate_color_bicubic_sse2(__m128i c0_1, __m128i
 #endif /* __SSE2__ */
 
 
-static FORCE_INLINE void rect_translate(Rect *rect, int off_x, int off_y)
+static FORCE_INLINE uint32_t sample_bilinear(ImageData *img, int flags, int tx, int ty)
 {
-   rect->x1 += off_x;
-   rect->y1 += off_y;
-   rect->x2 += off_x;
-   rect->y2 += off_y;
+   int px = tx >> 16;
+   int py = ty >> 16;
+   uint32_t frac_x = (tx >> 8) & 0xFF;
+   uint32_t frac_y = (ty >> 8) & 0xFF;
+   if ((flags & TEX_CLAMP_X) && px < 0) { px = 0; frac_x = 0; }
+   if ((flags & TEX_CLAMP_Y) && py < 0) { py = 0; frac_y = 0; }
+   #ifdef __SSE2__
+   if (simd_sse2 && px >= 0 && py >= 0 && px+1 < img->width && py+1 < img->height) {
+      uint32_t *p = &img->pixels[py * img->stride + px];
+      union {
+         __m128i m128;
+         uint32_t u32[4];
+      } u;
+      u.m128 = interpolate_color_sse2(p, p + img->stride, frac_x, frac_y);
+      return u.u32[0];
+   }
+   else
+   #endif
+   {
+      uint32_t c0, c1, c2, c3;
+      uint32_t px2 = px+1;
+      uint32_t py2 = py+1;
+      if ((flags & TEX_CLAMP_X) && px > img->width-1) { px = img->width-1; frac_x = 0; }
+      if ((flags & TEX_CLAMP_Y) && py > img->height-1) { py = img->height-1; frac_y = 0; }
+      if (px2 >= img->width) px2 = flags & TEX_CLAMP_X? img->width-1 : 0;
+      if (py2 >= img->height) py2 = flags & TEX_CLAMP_Y? img->height-1 : 0;
+      c0 = img->pixels[py * img->stride + px];
+      c1 = img->pixels[py * img->stride + px2];
+      c2 = img->pixels[py2 * img->stride + px];
+      c3 = img->pixels[py2 * img->stride + px2];
+      return interpolate_color(
+         interpolate_color(c0, c1, frac_x),
+         interpolate_color(c2, c3, frac_x),
+         frac_y
+      );
+   }
 }
 
 
-static FORCE_INLINE int rect_clip(Rect *rect, Rect *clip)
+static FORCE_INLINE uint32_t sample_bicubic(ImageData *img, int flags, int tx, int ty)
 {
-   rect->x1 = MAX(rect->x1, clip->x1);
-   rect->y1 = MAX(rect->y1, clip->y1);
-   rect->x2 = MIN(rect->x2, clip->x2);
-   rect->y2 = MIN(rect->y2, clip->y2);
-   return (rect->x1 < rect->x2 && rect->y1 < rect->y2);
+   int px1 = tx >> 16;
+   int py1 = ty >> 16;
+   uint32_t frac_x = (tx >> 8) & 0xFF;
+   uint32_t frac_y = (ty >> 8) & 0xFF;
+   if (px1 > 0 && py1 > 0 && px1+2 < img->width && py1+2 < img->height) {
+      uint32_t *p = &img->pixels[(py1-1) * img->stride + (px1-1)];
+      #ifdef __SSE2__
+      if (simd_sse2) {
+         __m128i c0_1, c2_3;
+         __m128i tmp0, tmp1, r0_1, r2_3;
+         union {
+            __m128i m128;
+            uint32_t u32[4];
+         } u;
+
+         c0_1 = _mm_loadl_epi64((__m128i *)(p+0));
+         c2_3 = _mm_loadl_epi64((__m128i *)(p+2));
+         tmp0 = interpolate_color_bicubic_sse2(c0_1, c2_3, frac_x);
+
+         p += img->stride;
+         c0_1 = _mm_loadl_epi64((__m128i *)(p+0));
+         c2_3 = _mm_loadl_epi64((__m128i *)(p+2));
+         tmp1 = interpolate_color_bicubic_sse2(c0_1, c2_3, frac_x);
+
+         r0_1 = _mm_unpacklo_epi32(tmp0, tmp1);
+
+         p += img->stride;
+         c0_1 = _mm_loadl_epi64((__m128i *)(p+0));
+         c2_3 = _mm_loadl_epi64((__m128i *)(p+2));
+         tmp0 = interpolate_color_bicubic_sse2(c0_1, c2_3, frac_x);
+         
+         p += img->stride;
+         c0_1 = _mm_loadl_epi64((__m128i *)(p+0));
+         c2_3 = _mm_loadl_epi64((__m128i *)(p+2));
+         tmp1 = interpolate_color_bicubic_sse2(c0_1, c2_3, frac_x);
+
+         r2_3 = _mm_unpacklo_epi32(tmp0, tmp1);
+
+         u.m128 = interpolate_color_bicubic_sse2(r0_1, r2_3, frac_y);
+         return u.u32[0];
+      }
+      #endif
+      {
+         uint32_t r0, r1, r2, r3;
+         r0 = interpolate_color_bicubic(p[0], p[1], p[2], p[3], frac_x); p += img->stride;
+         r1 = interpolate_color_bicubic(p[0], p[1], p[2], p[3], frac_x); p += img->stride;
+         r2 = interpolate_color_bicubic(p[0], p[1], p[2], p[3], frac_x); p += img->stride;
+         r3 = interpolate_color_bicubic(p[0], p[1], p[2], p[3], frac_x);
+         return interpolate_color_bicubic(r0, r1, r2, r3, frac_y);
+      }
+   }
+   else {
+      uint32_t c0, c1, c2, c3, r0, r1, r2, r3;
+      if (flags & TEX_CLAMP_X) {
+         if (px1 < 0) { px1 = 0; frac_x = 0; }
+         if (px1 >= img->width) px1 = img->width-1;
+      }
+      if (flags & TEX_CLAMP_Y) {
+         if (py1 < 0) { py1 = 0; frac_y = 0; }
+         if (py1 >= img->height) py1 = img->height-1;
+      }
+      int px0 = px1-1;
+      int py0 = py1-1;
+      int px2 = px1+1;
+      int py2 = py1+1;
+      if (px0 < 0) px0 = flags & TEX_CLAMP_X? 0 : img->width-1;
+      if (py0 < 0) py0 = flags & TEX_CLAMP_Y? 0 : img->height-1;
+      if (px2 >= img->width) px2 = flags & TEX_CLAMP_X? img->width-1 : 0;
+      if (py2 >= img->height) py2 = flags & TEX_CLAMP_Y? img->height-1 : 0;
+      uint32_t px3 = px2+1;
+      uint32_t py3 = py2+1;
+      if (px3 >= img->width) px3 = flags & TEX_CLAMP_X? img->width-1 : 0;
+      if (py3 >= img->height) py3 = flags & TEX_CLAMP_Y? img->height-1 : 0;
+
+      c0 = img->pixels[py0 * img->stride + px0];
+      c1 = img->pixels[py0 * img->stride + px1];
+      c2 = img->pixels[py0 * img->stride + px2];
+      c3 = img->pixels[py0 * img->stride + px3];
+      r0 = interpolate_color_bicubic(c0, c1, c2, c3, frac_x);
+
+      c0 = img->pixels[py1 * img->stride + px0];
+      c1 = img->pixels[py1 * img->stride + px1];
+      c2 = img->pixels[py1 * img->stride + px2];
+      c3 = img->pixels[py1 * img->stride + px3];
+      r1 = interpolate_color_bicubic(c0, c1, c2, c3, frac_x);
+
+      c0 = img->pixels[py2 * img->stride + px0];
+      c1 = img->pixels[py2 * img->stride + px1];
+      c2 = img->pixels[py2 * img->stride + px2];
+      c3 = img->pixels[py2 * img->stride + px3];
+      r2 = interpolate_color_bicubic(c0, c1, c2, c3, frac_x);
+
+      c0 = img->pixels[py3 * img->stride + px0];
+      c1 = img->pixels[py3 * img->stride + px1];
+      c2 = img->pixels[py3 * img->stride + px2];
+      c3 = img->pixels[py3 * img->stride + px3];
+      r3 = interpolate_color_bicubic(c0, c1, c2, c3, frac_x);
+
+      return interpolate_color_bicubic(r0, r1, r2, r3, frac_y);
+   }
 }
 
 
-static FORCE_INLINE float transform_x(Transform *tr, float x, float y)
+#ifdef FIXIMAGE_AVX2
+static FORCE_INLINE AVX2_FUNC __m256i div255_avx2(__m256i a)
 {
-   return x * tr->m00 + y * tr->m01 + tr->m02;
+   // equal to div255 for all products of two 8-bit values:
+   return _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(a, _mm256_set1_epi16(1)), _mm256_srli_epi16(a, 8)), 8);
 }
 
 
-static FORCE_INLINE float transform_y(Transform *tr, float x, float y)
+static FORCE_INLINE AVX2_FUNC __m256i blend_avx2(__m256i p, __m256i c)
 {
-   return x * tr->m10 + y * tr->m11 + tr->m12;
+   __m256i inv_ca;
+
+   inv_ca = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(c, 0xFF), 0xFF);
+   inv_ca = _mm256_sub_epi16(_mm256_set1_epi16(255), inv_ca);
+   return _mm256_add_epi16(c, div255_avx2(_mm256_mullo_epi16(p, inv_ca)));
 }
 
 
-static void free_image_data(void *user_data)
+static FORCE_INLINE AVX2_FUNC __m256i blend8_avx2(__m256i p, __m256i c, const uint8_t *coverage)
 {
-   ImageData *data = user_data;
-   
-   if (data->refcnt < REFCNT_LIMIT && __sync_sub_and_fetch(&data->refcnt, 1) == 0) {
-      if (data->parent) {
-         free_image_data(data->parent);
-      }
-      if (data->own_data) {
+   __m256i zero = _mm256_setzero_si256();
+   __m256i lo, hi, cov;
+
+   lo = _mm256_unpacklo_epi8(c, zero);
+   hi = _mm256_unpackhi_epi8(c, zero);
+   if (coverage) {
+      cov = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *)coverage));
+      cov = _mm256_or_si256(cov, _mm256_slli_epi32(cov, 16));
+      lo = div255_avx2(_mm256_mullo_epi16(lo, _mm256_unpacklo_epi32(cov, cov)));
+      hi = div255_avx2(_mm256_mullo_epi16(hi, _mm256_unpackhi_epi32(cov, cov)));
+   }
+   lo = blend_avx2(_mm256_unpacklo_epi8(p, zero), lo);
+   hi = blend_avx2(_mm256_unpackhi_epi8(p, zero), hi);
+   return _mm256_packus_epi16(lo, hi);
+}
+
+
+// blends either the source pixels or a single color (when src is NULL) with optional coverage,
+// matches the scalar blending without blend table:
+static AVX2_FUNC void blend_line_avx2(uint32_t *dest, uint32_t *src, uint32_t color, uint8_t *coverage, int len)
+{
+   __m256i c = _mm256_set1_epi32(color), p;
+   uint32_t tmp_dest[8], tmp_src[8];
+   uint8_t tmp_coverage[8];
+   int i, rem;
+
+   for (i=0; i+8<=len; i+=8) {
+      if (src) {
+         c = _mm256_loadu_si256((__m256i *)(src+i));
+      }
+      p = blend8_avx2(_mm256_loadu_si256((__m256i *)(dest+i)), c, coverage? coverage+i : NULL);
+      _mm256_storeu_si256((__m256i *)(dest+i), p);
+   }
+
+   rem = len - i;
+   if (rem > 0) {
+      memcpy(tmp_dest, dest+i, rem*4);
+      if (src) {
+         memcpy(tmp_src, src+i, rem*4);
+         c = _mm256_loadu_si256((__m256i *)tmp_src);
+      }
+      if (coverage) {
+         memcpy(tmp_coverage, coverage+i, rem);
+      }
+      p = blend8_avx2(_mm256_loadu_si256((__m256i *)tmp_dest), c, coverage? tmp_coverage : NULL);
+      _mm256_storeu_si256((__m256i *)tmp_dest, p);
+      memcpy(dest+i, tmp_dest, rem*4);
+   }
+}
+
+
+static FORCE_INLINE AVX2_FUNC __m256i shader_op_avx2(int op, __m256i a, __m256i b, int alpha)
+{
+   __m256i zero = _mm256_setzero_si256();
+   __m256i lo, hi, ia, ib;
+
+   switch (op) {
+      case BC_ADD:
+         return _mm256_adds_epu8(a, b);
+
+      case BC_SUB:
+         return _mm256_subs_epu8(a, b);
+
+      case BC_MUL:
+         lo = div255_avx2(_mm256_mullo_epi16(_mm256_unpacklo_epi8(a, zero), _mm256_unpacklo_epi8(b, zero)));
+         hi = div255_avx2(_mm256_mullo_epi16(_mm256_unpackhi_epi8(a, zero), _mm256_unpackhi_epi8(b, zero)));
+         return _mm256_packus_epi16(lo, hi);
+
+      default:
+         ia = _mm256_set1_epi16(256-alpha);
+         ib = _mm256_set1_epi16(alpha);
+         lo = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(a, zero), ia), _mm256_mullo_epi16(_mm256_unpacklo_epi8(b, zero), ib));
+         hi = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(a, zero), ia), _mm256_mullo_epi16(_mm256_unpackhi_epi8(b, zero), ib));
+         return _mm256_packus_epi16(_mm256_srli_epi16(lo, 8), _mm256_srli_epi16(hi, 8));
+   }
+}
+
+
+static AVX2_FUNC void shader_bytes_avx2(int op, uint8_t *dest, uint8_t *src1, uint8_t *src2, int alpha, int len)
+{
+   uint8_t tmp1[32], tmp2[32];
+   __m256i c;
+   int i, rem;
+
+   for (i=0; i+32<=len; i+=32) {
+      c = shader_op_avx2(op, _mm256_loadu_si256((__m256i *)(src1+i)), _mm256_loadu_si256((__m256i *)(src2+i)), alpha);
+      _mm256_storeu_si256((__m256i *)(dest+i), c);
+   }
+
+   rem = len - i;
+   if (rem > 0) {
+      memcpy(tmp1, src1+i, rem);
+      memcpy(tmp2, src2+i, rem);
+      c = shader_op_avx2(op, _mm256_loadu_si256((__m256i *)tmp1), _mm256_loadu_si256((__m256i *)tmp2), alpha);
+      _mm256_storeu_si256((__m256i *)tmp1, c);
+      memcpy(dest+i, tmp1, rem);
+   }
+}
+
+
+static AVX2_FUNC void mul_color_avx2(uint32_t *dest, uint32_t *src, uint32_t color, int len)
+{
+   uint32_t tmp[8];
+   __m256i c = _mm256_set1_epi32(color);
+   int i, rem;
+
+   for (i=0; i+8<=len; i+=8) {
+      _mm256_storeu_si256((__m256i *)(dest+i), shader_op_avx2(BC_MUL, _mm256_loadu_si256((__m256i *)(src+i)), c, 0));
+   }
+
+   rem = len - i;
+   if (rem > 0) {
+      memcpy(tmp, src+i, rem*4);
+      _mm256_storeu_si256((__m256i *)tmp, shader_op_avx2(BC_MUL, _mm256_loadu_si256((__m256i *)tmp), c, 0));
+      memcpy(dest+i, tmp, rem*4);
+   }
+}
+
+
+static FORCE_INLINE AVX2_FUNC __m256i lerp_avx2(__m256i a, __m256i b, __m256i fract)
+{
+   return _mm256_add_epi16(a, _mm256_srai_epi16(_mm256_mullo_epi16(_mm256_sub_epi16(b, a), fract), 7));
+}
+
+
+static AVX2_FUNC void sample_bilinear_avx2(uint32_t *dest, ImageData *img, int flags, int *sample_x, int *sample_y, int len)
+{
+   __m256i zero = _mm256_setzero_si256();
+   __m256i tx, ty, px, py, inside, idx, c00, c01, c10, c11, fx, fy, fx_lo, fx_hi, fy_lo, fy_hi, lo, hi;
+   __m256i max_x = _mm256_set1_epi32(img->width-1);
+   __m256i max_y = _mm256_set1_epi32(img->height-1);
+   int *pixels = (int *)img->pixels;
+   int i, j;
+
+   for (i=0; i+8<=len; i+=8) {
+      tx = _mm256_loadu_si256((__m256i *)(sample_x+i));
+      ty = _mm256_loadu_si256((__m256i *)(sample_y+i));
+      px = _mm256_srai_epi32(tx, 16);
+      py = _mm256_srai_epi32(ty, 16);
+
+      inside = _mm256_and_si256(_mm256_cmpgt_epi32(max_x, px), _mm256_cmpgt_epi32(max_y, py));
+      inside = _mm256_andnot_si256(_mm256_or_si256(px, py), inside);
+      if (_mm256_movemask_epi8(_mm256_srai_epi32(inside, 31)) != -1) {
+         for (j=0; j<8; j++) {
+            dest[i+j] = sample_bilinear(img, flags, sample_x[i+j], sample_y[i+j]);
+         }
+         continue;
+      }
+
+      idx = _mm256_add_epi32(_mm256_mullo_epi32(py, _mm256_set1_epi32(img->stride)), px);
+      c00 = _mm256_i32gather_epi32(pixels, idx, 4);
+      c01 = _mm256_i32gather_epi32(pixels+1, idx, 4);
+      c10 = _mm256_i32gather_epi32(pixels+img->stride, idx, 4);
+      c11 = _mm256_i32gather_epi32(pixels+img->stride+1, idx, 4);
+
+      fx = _mm256_and_si256(_mm256_srli_epi32(tx, 9), _mm256_set1_epi32(0x7F));
+      fy = _mm256_and_si256(_mm256_srli_epi32(ty, 9), _mm256_set1_epi32(0x7F));
+      fx = _mm256_or_si256(fx, _mm256_slli_epi32(fx, 16));
+      fy = _mm256_or_si256(fy, _mm256_slli_epi32(fy, 16));
+      fx_lo = _mm256_unpacklo_epi32(fx, fx);
+      fx_hi = _mm256_unpackhi_epi32(fx, fx);
+      fy_lo = _mm256_unpacklo_epi32(fy, fy);
+      fy_hi = _mm256_unpackhi_epi32(fy, fy);
+
+      lo = lerp_avx2(
+         lerp_avx2(_mm256_unpacklo_epi8(c00, zero), _mm256_unpacklo_epi8(c10, zero), fy_lo),
+         lerp_avx2(_mm256_unpacklo_epi8(c01, zero), _mm256_unpacklo_epi8(c11, zero), fy_lo),
+         fx_lo
+      );
+      hi = lerp_avx2(
+         lerp_avx2(_mm256_unpackhi_epi8(c00, zero), _mm256_unpackhi_epi8(c10, zero), fy_hi),
+         lerp_avx2(_mm256_unpackhi_epi8(c01, zero), _mm256_unpackhi_epi8(c11, zero), fy_hi),
+         fx_hi
+      );
+      _mm256_storeu_si256((__m256i *)(dest+i), _mm256_packus_epi16(lo, hi));
+   }
+
+   for (; i<len; i++) {
+      dest[i] = sample_bilinear(img, flags, sample_x[i], sample_y[i]);
+   }
+}
+
+
+static FORCE_INLINE AVX2_FUNC __m128i interpolate_rows_bicubic_avx2(uint32_t *p0, uint32_t *p1, __m256i weights0_1, __m256i weights2_3)
+{
+   __m256i zero = _mm256_setzero_si256();
+   __m256i c, c0_1, c2_3;
+
+   c = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((__m128i *)p0)), _mm_loadu_si128((__m128i *)p1), 1);
+
+   c0_1 = _mm256_slli_epi16(_mm256_unpacklo_epi8(c, zero), 2);
+   c0_1 = _mm256_add_epi16(c0_1, _mm256_set1_epi16(5));
+   c0_1 = _mm256_mulhi_epi16(c0_1, weights0_1);
+
+   c2_3 = _mm256_slli_epi16(_mm256_unpackhi_epi8(c, zero), 2);
+   c2_3 = _mm256_add_epi16(c2_3, _mm256_set1_epi16(5));
+   c2_3 = _mm256_mulhi_epi16(c2_3, weights2_3);
+
+   c = _mm256_add_epi16(c0_1, c2_3);
+   c = _mm256_add_epi16(c, _mm256_unpackhi_epi64(c, c));
+   c = _mm256_packus_epi16(c, c);
+   return _mm_unpacklo_epi32(_mm256_castsi256_si128(c), _mm256_extracti128_si256(c, 1));
+}
+
+
+static AVX2_FUNC void sample_bicubic_avx2(uint32_t *dest, ImageData *img, int flags, int *sample_x, int *sample_y, int len)
+{
+   __m256i weights, weights0_1, weights2_3;
+   __m128i r0_1, r2_3;
+   uint32_t *p;
+   int i, px1, py1, stride = img->stride;
+
+   for (i=0; i<len; i++) {
+      px1 = sample_x[i] >> 16;
+      py1 = sample_y[i] >> 16;
+      if (px1 > 0 && py1 > 0 && px1+2 < img->width && py1+2 < img->height) {
+         p = &img->pixels[(py1-1) * stride + (px1-1)];
+
+         weights = _mm256_broadcastq_epi64(_mm_loadl_epi64((__m128i *)&bicubic_weights[((sample_x[i] >> 8) & 0xFF)*4]));
+         weights = _mm256_unpacklo_epi16(weights, weights);
+         weights0_1 = _mm256_unpacklo_epi32(weights, weights);
+         weights2_3 = _mm256_unpackhi_epi32(weights, weights);
+
+         r0_1 = interpolate_rows_bicubic_avx2(p, p + stride, weights0_1, weights2_3);
+         r2_3 = interpolate_rows_bicubic_avx2(p + stride*2, p + stride*3, weights0_1, weights2_3);
+         dest[i] = _mm_cvtsi128_si32(interpolate_color_bicubic_sse2(r0_1, r2_3, (sample_y[i] >> 8) & 0xFF));
+      }
+      else {
+         dest[i] = sample_bicubic(img, flags, sample_x[i], sample_y[i]);
+      }
+   }
+}
+#endif /* FIXIMAGE_AVX2 */
+
+
+static FORCE_INLINE uint32_t premultiply_rgba(const uint8_t *src)
+{
+   uint32_t r, g, b, a;
+
+   r = src[0];
+   g = src[1];
+   b = src[2];
+   a = src[3];
+   r = div255(r * a);
+   g = div255(g * a);
+   b = div255(b * a);
+   return (a << 24) | (r << 16) | (g << 8) | b;
+}
+
+
+static FORCE_INLINE uint32_t unpremultiply(uint32_t c)
+{
+   uint32_t r, g, b, a;
+
+   a = (c >> 24) & 0xFF;
+   if (a == 0 || a == 255) return c;
+
+   r = ((c >> 16) & 0xFF) * 255 / a;
+   g = ((c >>  8) & 0xFF) * 255 / a;
+   b = ((c >>  0) & 0xFF) * 255 / a;
+   if (r > 255) r = 255;
+   if (g > 255) g = 255;
+   if (b > 255) b = 255;
+   return (a << 24) | (r << 16) | (g << 8) | b;
+}
+
+
+static FORCE_INLINE uint32_t swap_rb(uint32_t c)
+{
+   return (c & 0xFF00FF00) | ((c >> 16) & 0xFF) | ((c & 0xFF) << 16);
+}
+
+
+#ifdef __SSE2__
+static FORCE_INLINE __m128i div255_sse2(__m128i a)
+{
+   return _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(a, _mm_set1_epi16(1)), _mm_srli_epi16(a, 8)), 8);
+}
+
+
+static FORCE_INLINE __m128i premultiply_rgba_sse2(__m128i c)
+{
+   __m128i zero = _mm_setzero_si128();
+   __m128i alpha_mask = _mm_set_epi16(0xFF, 0, 0, 0, 0xFF, 0, 0, 0);
+   __m128i lo, hi, a;
+
+   lo = _mm_unpacklo_epi8(c, zero);
+   lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, _MM_SHUFFLE(3,0,1,2)), _MM_SHUFFLE(3,0,1,2));
+   a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, 0xFF), 0xFF);
+   lo = div255_sse2(_mm_mullo_epi16(lo, _mm_or_si128(a, alpha_mask)));
+
+   hi = _mm_unpackhi_epi8(c, zero);
+   hi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, _MM_SHUFFLE(3,0,1,2)), _MM_SHUFFLE(3,0,1,2));
+   a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, 0xFF), 0xFF);
+   hi = div255_sse2(_mm_mullo_epi16(hi, _mm_or_si128(a, alpha_mask)));
+
+   return _mm_packus_epi16(lo, hi);
+}
+
+
+static FORCE_INLINE __m128i unpremultiply_pixel_sse2(__m128i c)
+{
+   __m128i a;
+
+   // the float division is exact after truncation for all the values that are not clamped,
+   // zero alpha divides by 255 to keep the color as it is:
+   a = _mm_shuffle_epi32(c, 0xFF);
+   a = _mm_add_epi32(a, _mm_and_si128(_mm_cmpeq_epi32(a, _mm_setzero_si128()), _mm_set1_epi32(255)));
+   return _mm_cvttps_epi32(_mm_div_ps(_mm_mul_ps(_mm_cvtepi32_ps(c), _mm_set1_ps(255.0f)), _mm_cvtepi32_ps(a)));
+}
+
+
+static FORCE_INLINE __m128i unpremultiply_sse2(__m128i c)
+{
+   __m128i zero = _mm_setzero_si128();
+   __m128i lo, hi, p0, p1, p2, p3;
+
+   lo = _mm_unpacklo_epi8(c, zero);
+   hi = _mm_unpackhi_epi8(c, zero);
+   p0 = unpremultiply_pixel_sse2(_mm_unpacklo_epi16(lo, zero));
+   p1 = unpremultiply_pixel_sse2(_mm_unpackhi_epi16(lo, zero));
+   p2 = unpremultiply_pixel_sse2(_mm_unpacklo_epi16(hi, zero));
+   p3 = unpremultiply_pixel_sse2(_mm_unpackhi_epi16(hi, zero));
+   c = _mm_and_si128(c, _mm_set1_epi32(0xFF000000));
+   lo = _mm_packus_epi16(_mm_packs_epi32(p0, p1), _mm_packs_epi32(p2, p3));
+   return _mm_or_si128(_mm_and_si128(lo, _mm_set1_epi32(0x00FFFFFF)), c);
+}
+
+
+static FORCE_INLINE __m128i swap_rb_sse2(__m128i c)
+{
+   __m128i rb = _mm_and_si128(c, _mm_set1_epi32(0x00FF00FF));
+   rb = _mm_or_si128(_mm_srli_epi32(rb, 16), _mm_slli_epi32(rb, 16));
+   return _mm_or_si128(_mm_and_si128(c, _mm_set1_epi32(0xFF00FF00)), rb);
+}
+#endif /* __SSE2__ */
+
+
+#ifdef FIXIMAGE_AVX2
+static AVX2_FUNC int premultiply_rgba_avx2(uint32_t *dest, const uint8_t *src, int count)
+{
+   __m256i zero = _mm256_setzero_si256();
+   __m256i swap = _mm256_setr_epi8(2,1,0,3, 6,5,4,7, 10,9,8,11, 14,13,12,15, 2,1,0,3, 6,5,4,7, 10,9,8,11, 14,13,12,15);
+   __m256i alpha_mask = _mm256_set1_epi64x(0x00FF000000000000LL);
+   __m256i c, lo, hi, a;
+   int i;
+
+   for (i=0; i+8<=count; i+=8) {
+      c = _mm256_shuffle_epi8(_mm256_loadu_si256((__m256i *)(src+i*4)), swap);
+      lo = _mm256_unpacklo_epi8(c, zero);
+      hi = _mm256_unpackhi_epi8(c, zero);
+      a = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(lo, 0xFF), 0xFF);
+      lo = div255_avx2(_mm256_mullo_epi16(lo, _mm256_or_si256(a, alpha_mask)));
+      a = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(hi, 0xFF), 0xFF);
+      hi = div255_avx2(_mm256_mullo_epi16(hi, _mm256_or_si256(a, alpha_mask)));
+      _mm256_storeu_si256((__m256i *)(dest+i), _mm256_packus_epi16(lo, hi));
+   }
+   return i;
+}
+
+
+static FORCE_INLINE AVX2_FUNC __m256i unpremultiply_pixel_avx2(__m256i c)
+{
+   __m256i a;
+
+   a = _mm256_shuffle_epi32(c, 0xFF);
+   a = _mm256_add_epi32(a, _mm256_and_si256(_mm256_cmpeq_epi32(a, _mm256_setzero_si256()), _mm256_set1_epi32(255)));
+   return _mm256_cvttps_epi32(_mm256_div_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(c), _mm256_set1_ps(255.0f)), _mm256_cvtepi32_ps(a)));
+}
+
+
+static AVX2_FUNC int unpremultiply_avx2(uint32_t *dest, const uint32_t *src, int count)
+{
+   __m256i zero = _mm256_setzero_si256();
+   __m256i c, lo, hi, p0, p1, p2, p3;
+   int i;
+
+   for (i=0; i+8<=count; i+=8) {
+      c = _mm256_loadu_si256((__m256i *)(src+i));
+      lo = _mm256_unpacklo_epi8(c, zero);
+      hi = _mm256_unpackhi_epi8(c, zero);
+      p0 = unpremultiply_pixel_avx2(_mm256_unpacklo_epi16(lo, zero));
+      p1 = unpremultiply_pixel_avx2(_mm256_unpackhi_epi16(lo, zero));
+      p2 = unpremultiply_pixel_avx2(_mm256_unpacklo_epi16(hi, zero));
+      p3 = unpremultiply_pixel_avx2(_mm256_unpackhi_epi16(hi, zero));
+      lo = _mm256_packus_epi16(_mm256_packs_epi32(p0, p1), _mm256_packs_epi32(p2, p3));
+      lo = _mm256_and_si256(lo, _mm256_set1_epi32(0x00FFFFFF));
+      _mm256_storeu_si256((__m256i *)(dest+i), _mm256_or_si256(lo, _mm256_and_si256(c, _mm256_set1_epi32(0xFF000000))));
+   }
+   return i;
+}
+
+
+static AVX2_FUNC int swap_rb_avx2(uint32_t *dest, const uint32_t *src, int count)
+{
+   __m256i swap = _mm256_setr_epi8(2,1,0,3, 6,5,4,7, 10,9,8,11, 14,13,12,15, 2,1,0,3, 6,5,4,7, 10,9,8,11, 14,13,12,15);
+   int i;
+
+   for (i=0; i+8<=count; i+=8) {
+      _mm256_storeu_si256((__m256i *)(dest+i), _mm256_shuffle_epi8(_mm256_loadu_si256((__m256i *)(src+i)), swap));
+   }
+   return i;
+}
+
+
+static AVX2_FUNC int gray_to_argb_avx2(uint32_t *dest, const uint8_t *src, int count)
+{
+   __m256i c;
+   int i;
+
+   for (i=0; i+8<=count; i+=8) {
+      c = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *)(src+i)));
+      c = _mm256_or_si256(_mm256_mullo_epi32(c, _mm256_set1_epi32(0x010101)), _mm256_set1_epi32(0xFF000000));
+      _mm256_storeu_si256((__m256i *)(dest+i), c);
+   }
+   return i;
+}
+#endif /* FIXIMAGE_AVX2 */
+
+
+// the destination can point to the same memory as the source:
+void fiximage_premultiply_rgba(uint32_t *dest, const uint8_t *src, int count)
+{
+   int i = 0;
+
+#ifdef FIXIMAGE_AVX2
+   if (simd_avx2) {
+      i = premultiply_rgba_avx2(dest, src, count);
+   }
+#endif
+#ifdef __SSE2__
+   if (simd_sse2) {
+      for (; i+4<=count; i+=4) {
+         _mm_storeu_si128((__m128i *)(dest+i), premultiply_rgba_sse2(_mm_loadu_si128((__m128i *)(src+i*4))));
+      }
+   }
+#endif
+   for (; i<count; i++) {
+      dest[i] = premultiply_rgba(src+i*4);
+   }
+}
+
+
+void fiximage_unpremultiply(uint32_t *dest, const uint32_t *src, int count)
+{
+   int i = 0;
+
+#ifdef FIXIMAGE_AVX2
+   if (simd_avx2) {
+      i = unpremultiply_avx2(dest, src, count);
+   }
+#endif
+#ifdef __SSE2__
+   if (simd_sse2) {
+      for (; i+4<=count; i+=4) {
+         _mm_storeu_si128((__m128i *)(dest+i), unpremultiply_sse2(_mm_loadu_si128((__m128i *)(src+i))));
+      }
+   }
+#endif
+   for (; i<count; i++) {
+      dest[i] = unpremultiply(src[i]);
+   }
+}
+
+
+void fiximage_swap_rb(uint32_t *dest, const uint32_t *src, int count)
+{
+   int i = 0;
+
+#ifdef FIXIMAGE_AVX2
+   if (simd_avx2) {
+      i = swap_rb_avx2(dest, src, count);
+   }
+#endif
+#ifdef __SSE2__
+   if (simd_sse2) {
+      for (; i+4<=count; i+=4) {
+         _mm_storeu_si128((__m128i *)(dest+i), swap_rb_sse2(_mm_loadu_si128((__m128i *)(src+i))));
+      }
+   }
+#endif
+   for (; i<count; i++) {
+      dest[i] = swap_rb(src[i]);
+   }
+}
+
+
+void fiximage_gray_to_argb(uint32_t *dest, const uint8_t *src, int count)
+{
+   int i = 0;
+#ifdef __SSE2__
+   __m128i c, lo, hi, ones = _mm_set1_epi8(0xFF);
+#endif
+
+#ifdef FIXIMAGE_AVX2
+   if (simd_avx2) {
+      i = gray_to_argb_avx2(dest, src, count);
+   }
+#endif
+#ifdef __SSE2__
+   if (simd_sse2) {
+      for (; i+16<=count; i+=16) {
+         c = _mm_loadu_si128((__m128i *)(src+i));
+         lo = _mm_unpacklo_epi8(c, c);
+         hi = _mm_unpacklo_epi8(c, ones);
+         _mm_storeu_si128((__m128i *)(dest+i+0), _mm_unpacklo_epi16(lo, hi));
+         _mm_storeu_si128((__m128i *)(dest+i+4), _mm_unpackhi_epi16(lo, hi));
+         lo = _mm_unpackhi_epi8(c, c);
+         hi = _mm_unpackhi_epi8(c, ones);
+         _mm_storeu_si128((__m128i *)(dest+i+8), _mm_unpacklo_epi16(lo, hi));
+         _mm_storeu_si128((__m128i *)(dest+i+12), _mm_unpackhi_epi16(lo, hi));
+      }
+   }
+#endif
+   for (; i<count; i++) {
+      dest[i] = 0xFF000000 | (src[i] * 0x010101);
+   }
+}
+
+
+static FORCE_INLINE void rect_translate(Rect *rect, int off_x, int off_y)
+{
+   rect->x1 += off_x;
+   rect->y1 += off_y;
+   rect->x2 += off_x;
+   rect->y2 += off_y;
+}
+
+
+static FORCE_INLINE int rect_clip(Rect *rect, Rect *clip)
+{
+   rect->x1 = MAX(rect->x1, clip->x1);
+   rect->y1 = MAX(rect->y1, clip->y1);
+   rect->x2 = MIN(rect->x2, clip->x2);
+   rect->y2 = MIN(rect->y2, clip->y2);
+   return (rect->x1 < rect->x2 && rect->y1 < rect->y2);
+}
+
+
+static FORCE_INLINE float transform_x(Transform *tr, float x, float y)
+{
+   return x * tr->m00 + y * tr->m01 + tr->m02;
+}
+
+
+static FORCE_INLINE float transform_y(Transform *tr, float x, float y)
+{
+   return x * tr->m10 + y * tr->m11 + tr->m12;
+}
+
+
+static void free_image_data(void *user_data)
+{
+   ImageData *data = user_data;
+   
+   if (data->refcnt < REFCNT_LIMIT && __sync_sub_and_fetch(&data->refcnt, 1) == 0) {
+      if (data->parent) {
+         free_image_data(data->parent);
+      }
+      if (data->own_data) {
          free(data->pixels);
       }
       if (data->free_func) {
@@ -1091,6 +2182,7 @@ static void free_painter(void *ptr)
       free_batch_op(op);
       op = next_op;
    }
+   free(p->damaged);
    free_image_data(p->data);
    free(p);
 }
@@ -1153,23 +2245,125 @@ static int get_transform(Transform *tr, Heap *heap, Value value, Transform *base
 }
 
 
-static int init_shader(Shader *shader, Heap *heap, Value shader_val, Value inputs_val, Transform *tr, int subpixel)
+static int get_shader_op_length(int bc)
 {
-   #define MARK_REG(reg) written_regs[(reg) >> 5] |= 1 << ((reg)&31)
-   #define VALID_REG(reg) (written_regs[(reg) >> 5] & (1 << ((reg)&31)))
-
-   Value *values = NULL, error;
-   int i, err, len, idx, val, dest_reg, src1_reg, src2_reg, flags, has_output=0;
-   int retval = 0;
-   uint32_t written_regs[8];
+   switch (bc) {
+      case BC_COLOR:
+      case BC_COPY:
+         return 3;
+
+      case BC_ADD:
+      case BC_SUB:
+      case BC_MUL:
+      case BC_MUL_COLOR:
+         return 4;
+
+      case BC_SAMPLE_NEAREST:
+      case BC_SAMPLE_BILINEAR:
+      case BC_SAMPLE_BICUBIC:
+      case BC_SAMPLE_NEAREST_SPAN:
+      case BC_MIX:
+         return 5;
+
+      default:
+         return 2;
+   }
+}
 
-   memset(written_regs, 0, sizeof(written_regs));
 
-   err = fixscript_get_array_length(heap, shader_val, &len);
-   if (err || len == 0) goto error;
+static int is_shader_reg_read(uint8_t *bytecode, int start, int len, int reg)
+{
+   int i, bc;
 
-   err = fixscript_get_array_length(heap, inputs_val, &shader->num_inputs);
-   if (err) goto error;
+   for (i=start; i<len; i+=get_shader_op_length(bc)) {
+      bc = bytecode[i];
+      switch (bc) {
+         case BC_COPY:
+            if (bytecode[i+2] == reg) return 1;
+            break;
+
+         case BC_ADD:
+         case BC_SUB:
+         case BC_MUL:
+         case BC_MIX:
+            if (bytecode[i+2] == reg || bytecode[i+3] == reg) return 1;
+            break;
+
+         case BC_MUL_COLOR:
+            if (bytecode[i+2] == reg) return 1;
+            break;
+
+         case BC_OUTPUT_BLEND:
+         case BC_OUTPUT_REPLACE:
+         case BC_OUTPUT_BLEND_SUBPIXEL:
+         case BC_OUTPUT_REPLACE_SUBPIXEL:
+            if (bytecode[i+1] == reg) return 1;
+            break;
+      }
+   }
+   return 0;
+}
+
+
+// replaces common op sequences with specialized ops, the bytecode must be already validated:
+static void optimize_shader(Shader *shader, int len)
+{
+   uint8_t *bc = shader->bytecode;
+   Transform *tr;
+   int i, j, next, color_reg, other_reg, dest_reg, idx;
+
+   for (i=0, j=0; i<len; i=next) {
+      next = i + get_shader_op_length(bc[i]);
+
+      // sampling with unscaled and unrotated transform reads whole runs of pixels from a single row:
+      if (bc[i] == BC_SAMPLE_NEAREST) {
+         tr = &shader->transforms[bc[i+3]];
+         if (tr->dx == 65536 && tr->dy == 0) {
+            bc[i] = BC_SAMPLE_NEAREST_SPAN;
+         }
+      }
+
+      // multiplication with a constant color doesn't need to fill the register:
+      if (bc[i] == BC_COLOR && next < len && bc[next] == BC_MUL && bc[next+2] != bc[next+3]) {
+         color_reg = bc[i+1];
+         other_reg = -1;
+         if (bc[next+2] == color_reg) other_reg = bc[next+3];
+         if (bc[next+3] == color_reg) other_reg = bc[next+2];
+         if (other_reg >= 0 && !is_shader_reg_read(bc, next + get_shader_op_length(BC_MUL), len, color_reg)) {
+            dest_reg = bc[next+1];
+            idx = bc[i+2];
+            bc[j++] = BC_MUL_COLOR;
+            bc[j++] = dest_reg;
+            bc[j++] = other_reg;
+            bc[j++] = idx;
+            next += get_shader_op_length(BC_MUL);
+            continue;
+         }
+      }
+
+      memmove(&bc[j], &bc[i], next - i);
+      j += next - i;
+   }
+}
+
+
+static int init_shader(Shader *shader, Heap *heap, Value shader_val, Value inputs_val, Transform *tr, int subpixel)
+{
+   #define MARK_REG(reg) written_regs[(reg) >> 5] |= 1 << ((reg)&31)
+   #define VALID_REG(reg) (written_regs[(reg) >> 5] & (1 << ((reg)&31)))
+
+   Value *values = NULL, error;
+   int i, err, len, idx, val, dest_reg, src1_reg, src2_reg, flags, has_output=0;
+   int retval = 0;
+   uint32_t written_regs[8];
+
+   memset(written_regs, 0, sizeof(written_regs));
+
+   err = fixscript_get_array_length(heap, shader_val, &len);
+   if (err || len == 0) goto error;
+
+   err = fixscript_get_array_length(heap, inputs_val, &shader->num_inputs);
+   if (err) goto error;
 
    values = malloc(shader->num_inputs * sizeof(Value));
    shader->bytecode = malloc(len);
@@ -1272,6 +2466,7 @@ static int init_shader(Shader *shader, Heap *heap, Value shader_val, Value input
       goto error;
    }
 
+   optimize_shader(shader, len);
    retval = 1;
 
 error:
@@ -1320,7 +2515,7 @@ static void run_shader(Shader *shader, uint32_t *dest, uint8_t *coverage, int le
 {
    #define RUN_LENGTH 32
 
-   static void *dispatch[13] = {
+   static void *dispatch[15] = {
       &&op_color,
       &&op_sample_nearest,
       &&op_sample_bilinear,
@@ -1333,7 +2528,9 @@ static void run_shader(Shader *shader, uint32_t *dest, uint8_t *coverage, int le
       &&op_output_blend,
       &&op_output_replace,
       &&op_output_blend_subpixel,
-      &&op_output_replace_subpixel
+      &&op_output_replace_subpixel,
+      &&op_sample_nearest_span,
+      &&op_mul_color
    };
    
    uint32_t pixel, color;
@@ -1350,6 +2547,9 @@ static void run_shader(Shader *shader, uint32_t *dest, uint8_t *coverage, int le
    #else
    } regs[256];
    #endif
+   #ifdef FIXIMAGE_AVX2
+   int sample_x[RUN_LENGTH], sample_y[RUN_LENGTH];
+   #endif
 
    #define DISPATCH() goto *dispatch[bc = *bytecode++];
 
@@ -1446,43 +2646,20 @@ static void run_shader(Shader *shader, uint32_t *dest, uint8_t *coverage, int le
                   while (ty < 0) ty += img->height << 16;
                   while (ty >= (img->height<<16)) ty -= img->height << 16;
                }
-               int px = tx >> 16;
-               int py = ty >> 16;
-               uint32_t frac_x = (tx >> 8) & 0xFF;
-               uint32_t frac_y = (ty >> 8) & 0xFF;
-               if ((flags & TEX_CLAMP_X) && px < 0) { px = 0; frac_x = 0; }
-               if ((flags & TEX_CLAMP_Y) && py < 0) { py = 0; frac_y = 0; }
-               #ifdef __SSE2__
-               if (px >= 0 && py >= 0 && px+1 < img->width && py+1 < img->height) {
-                  uint32_t *p = &img->pixels[py * img->stride + px];
-                  union {
-                     __m128i m128;
-                     uint32_t u32[4];
-                  } u;
-                  u.m128 = interpolate_color_sse2(p, p + img->stride, frac_x, frac_y);
-                  *rdest++ = u.u32[0];
+               #ifdef FIXIMAGE_AVX2
+               if (simd_avx2) {
+                  sample_x[i] = tx;
+                  sample_y[i] = ty;
+                  continue;
                }
-               else
                #endif
-               {
-                  uint32_t c0, c1, c2, c3;
-                  uint32_t px2 = px+1;
-                  uint32_t py2 = py+1;
-                  if ((flags & TEX_CLAMP_X) && px > img->width-1) { px = img->width-1; frac_x = 0; }
-                  if ((flags & TEX_CLAMP_Y) && py > img->height-1) { py = img->height-1; frac_y = 0; }
-                  if (px2 >= img->width) px2 = flags & TEX_CLAMP_X? img->width-1 : 0;
-                  if (py2 >= img->height) py2 = flags & TEX_CLAMP_Y? img->height-1 : 0;
-                  c0 = img->pixels[py * img->stride + px];
-                  c1 = img->pixels[py * img->stride + px2];
-                  c2 = img->pixels[py2 * img->stride + px];
-                  c3 = img->pixels[py2 * img->stride + px2];
-                  *rdest++ = interpolate_color(
-                     interpolate_color(c0, c1, frac_x),
-                     interpolate_color(c2, c3, frac_x),
-                     frac_y
-                  );
-               }
+               *rdest++ = sample_bilinear(img, flags, tx, ty);
             }
+            #ifdef FIXIMAGE_AVX2
+            if (simd_avx2) {
+               sample_bilinear_avx2(rdest, img, flags, sample_x, sample_y, amount);
+            }
+            #endif
             DISPATCH();
          }
 
@@ -1516,104 +2693,103 @@ static void run_shader(Shader *shader, uint32_t *dest, uint8_t *coverage, int le
                   while (ty < 0) ty += img->height << 16;
                   while (ty >= (img->height<<16)) ty -= img->height << 16;
                }
-               int px1 = tx >> 16;
-               int py1 = ty >> 16;
-               uint32_t frac_x = (tx >> 8) & 0xFF;
-               uint32_t frac_y = (ty >> 8) & 0xFF;
-               if (px1 > 0 && py1 > 0 && px1+2 < img->width && py1+2 < img->height) {
-                  uint32_t *p = &img->pixels[(py1-1) * img->stride + (px1-1)];
-                  #ifdef __SSE2__
-                     __m128i c0_1, c2_3;
-                     __m128i tmp0, tmp1, r0_1, r2_3;
-                     union {
-                        __m128i m128;
-                        uint32_t u32[4];
-                     } u;
-
-                     c0_1 = _mm_loadl_epi64((__m128i *)(p+0));
-                     c2_3 = _mm_loadl_epi64((__m128i *)(p+2));
-                     tmp0 = interpolate_color_bicubic_sse2(c0_1, c2_3, frac_x);
-
-                     p += img->stride;
-                     c0_1 = _mm_loadl_epi64((__m128i *)(p+0));
-                     c2_3 = _mm_loadl_epi64((__m128i *)(p+2));
-                     tmp1 = interpolate_color_bicubic_sse2(c0_1, c2_3, frac_x);
-
-                     r0_1 = _mm_unpacklo_epi32(tmp0, tmp1);
-
-                     p += img->stride;
-                     c0_1 = _mm_loadl_epi64((__m128i *)(p+0));
-                     c2_3 = _mm_loadl_epi64((__m128i *)(p+2));
-                     tmp0 = interpolate_color_bicubic_sse2(c0_1, c2_3, frac_x);
-                     
-                     p += img->stride;
-                     c0_1 = _mm_loadl_epi64((__m128i *)(p+0));
-                     c2_3 = _mm_loadl_epi64((__m128i *)(p+2));
-                     tmp1 = interpolate_color_bicubic_sse2(c0_1, c2_3, frac_x);
-
-                     r2_3 = _mm_unpacklo_epi32(tmp0, tmp1);
-
-                     u.m128 = interpolate_color_bicubic_sse2(r0_1, r2_3, frac_y);
-                     *rdest++ = u.u32[0];
-                  #else
-                     uint32_t r0, r1, r2, r3;
-                     r0 = interpolate_color_bicubic(p[0], p[1], p[2], p[3], frac_x); p += img->stride;
-                     r1 = interpolate_color_bicubic(p[0], p[1], p[2], p[3], frac_x); p += img->stride;
-                     r2 = interpolate_color_bicubic(p[0], p[1], p[2], p[3], frac_x); p += img->stride;
-                     r3 = interpolate_color_bicubic(p[0], p[1], p[2], p[3], frac_x);
-                     *rdest++ = interpolate_color_bicubic(r0, r1, r2, r3, frac_y);
-                  #endif
+               #ifdef FIXIMAGE_AVX2
+               if (simd_avx2) {
+                  sample_x[i] = tx;
+                  sample_y[i] = ty;
+                  continue;
                }
-               else {
-                  uint32_t c0, c1, c2, c3, r0, r1, r2, r3;
-                  if (flags & TEX_CLAMP_X) {
-                     if (px1 < 0) { px1 = 0; frac_x = 0; }
-                     if (px1 >= img->width) px1 = img->width-1;
-                  }
-                  if (flags & TEX_CLAMP_Y) {
-                     if (py1 < 0) { py1 = 0; frac_y = 0; }
-                     if (py1 >= img->height) py1 = img->height-1;
-                  }
-                  int px0 = px1-1;
-                  int py0 = py1-1;
-                  int px2 = px1+1;
-                  int py2 = py1+1;
-                  if (px0 < 0) px0 = flags & TEX_CLAMP_X? 0 : img->width-1;
-                  if (py0 < 0) py0 = flags & TEX_CLAMP_Y? 0 : img->height-1;
-                  if (px2 >= img->width) px2 = flags & TEX_CLAMP_X? img->width-1 : 0;
-                  if (py2 >= img->height) py2 = flags & TEX_CLAMP_Y? img->height-1 : 0;
-                  uint32_t px3 = px2+1;
-                  uint32_t py3 = py2+1;
-                  if (px3 >= img->width) px3 = flags & TEX_CLAMP_X? img->width-1 : 0;
-                  if (py3 >= img->height) py3 = flags & TEX_CLAMP_Y? img->height-1 : 0;
-
-                  c0 = img->pixels[py0 * img->stride + px0];
-                  c1 = img->pixels[py0 * img->stride + px1];
-                  c2 = img->pixels[py0 * img->stride + px2];
-                  c3 = img->pixels[py0 * img->stride + px3];
-                  r0 = interpolate_color_bicubic(c0, c1, c2, c3, frac_x);
-
-                  c0 = img->pixels[py1 * img->stride + px0];
-                  c1 = img->pixels[py1 * img->stride + px1];
-                  c2 = img->pixels[py1 * img->stride + px2];
-                  c3 = img->pixels[py1 * img->stride + px3];
-                  r1 = interpolate_color_bicubic(c0, c1, c2, c3, frac_x);
-
-                  c0 = img->pixels[py2 * img->stride + px0];
-                  c1 = img->pixels[py2 * img->stride + px1];
-                  c2 = img->pixels[py2 * img->stride + px2];
-                  c3 = img->pixels[py2 * img->stride + px3];
-                  r2 = interpolate_color_bicubic(c0, c1, c2, c3, frac_x);
-
-                  c0 = img->pixels[py3 * img->stride + px0];
-                  c1 = img->pixels[py3 * img->stride + px1];
-                  c2 = img->pixels[py3 * img->stride + px2];
-                  c3 = img->pixels[py3 * img->stride + px3];
-                  r3 = interpolate_color_bicubic(c0, c1, c2, c3, frac_x);
-
-                  *rdest++ = interpolate_color_bicubic(r0, r1, r2, r3, frac_y);
+               #endif
+               *rdest++ = sample_bicubic(img, flags, tx, ty);
+            }
+            #ifdef FIXIMAGE_AVX2
+            if (simd_avx2) {
+               sample_bicubic_avx2(rdest, img, flags, sample_x, sample_y, amount);
+            }
+            #endif
+            DISPATCH();
+         }
+
+         op_sample_nearest_span: {
+            uint32_t *rdest = regs[*bytecode++].u32;
+            ImageData *img = shader->images[*bytecode++];
+            Transform *tr = &shader->transforms[*bytecode++];
+            int flags = *bytecode++;
+            float fx = transform_x(tr, sx+0.5f, sy+0.5f);
+            float fy = transform_y(tr, sx+0.5f, sy+0.5f);
+            if ((flags & TEX_CLAMP_X) == 0) {
+               fx /= img->width;
+               fx = (fx - fast_floor(fx)) * img->width;
+            }
+            if ((flags & TEX_CLAMP_Y) == 0) {
+               fy /= img->height;
+               fy = (fy - fast_floor(fy)) * img->height;
+            }
+            int tx = (int)(fx * 65536.0f);
+            int ty = (int)(fy * 65536.0f);
+            if ((flags & TEX_CLAMP_X) == 0) {
+               while (tx < 0) tx += img->width << 16;
+               while (tx >= (img->width<<16)) tx -= img->width << 16;
+            }
+            if ((flags & TEX_CLAMP_Y) == 0) {
+               while (ty < 0) ty += img->height << 16;
+               while (ty >= (img->height<<16)) ty -= img->height << 16;
+            }
+            int px = tx >> 16;
+            int py = ty >> 16;
+            if (flags & TEX_CLAMP_Y) {
+               if (py < 0) py = 0;
+               if (py > img->height-1) py = img->height-1;
+            }
+            uint32_t *src = img->pixels + py * img->stride;
+            int cnt;
+            i = 0;
+            if (flags & TEX_CLAMP_X) {
+               for (; i<amount && px < 0; i++, px++) {
+                  rdest[i] = src[0];
+               }
+               cnt = MIN(amount - i, img->width - px);
+               if (cnt > 0) {
+                  memcpy(rdest + i, src + px, cnt * sizeof(uint32_t));
+                  i += cnt;
+               }
+               for (; i<amount; i++) {
+                  rdest[i] = src[img->width-1];
                }
             }
+            else {
+               while (i < amount) {
+                  cnt = MIN(amount - i, img->width - px);
+                  memcpy(rdest + i, src + px, cnt * sizeof(uint32_t));
+                  i += cnt;
+                  px = 0;
+               }
+            }
+            DISPATCH();
+         }
+
+         op_mul_color: {
+            uint32_t *rdest = regs[*bytecode++].u32;
+            uint32_t *rsrc = regs[*bytecode++].u32;
+            color = shader->inputs[*bytecode++];
+            #ifdef FIXIMAGE_AVX2
+            if (simd_avx2) {
+               mul_color_avx2(rdest, rsrc, color, amount);
+               DISPATCH();
+            }
+            #endif
+            ca = (color >> 24) & 0xFF;
+            cr = (color >> 16) & 0xFF;
+            cg = (color >>  8) & 0xFF;
+            cb = (color >>  0) & 0xFF;
+            for (i=0; i<amount; i++) {
+               pixel = *rsrc++;
+               pa = div255(((pixel >> 24) & 0xFF) * ca);
+               pr = div255(((pixel >> 16) & 0xFF) * cr);
+               pg = div255(((pixel >>  8) & 0xFF) * cg);
+               pb = div255(((pixel >>  0) & 0xFF) * cb);
+               *rdest++ = (pa << 24) | (pr << 16) | (pg << 8) | pb;
+            }
             DISPATCH();
          }
 
@@ -1630,6 +2806,12 @@ static void run_shader(Shader *shader, uint32_t *dest, uint8_t *coverage, int le
             uint8_t *rdest = regs[*bytecode++].u8;
             uint8_t *rsrc1 = regs[*bytecode++].u8;
             uint8_t *rsrc2 = regs[*bytecode++].u8;
+            #ifdef FIXIMAGE_AVX2
+            if (simd_avx2) {
+               shader_bytes_avx2(BC_ADD, rdest, rsrc1, rsrc2, 0, amount*4);
+               DISPATCH();
+            }
+            #endif
             for (i=0; i<amount*4; i++) {
                int c = (*rsrc1++) + (*rsrc2++);
                if (c > 255) c = 255;
@@ -1642,6 +2824,12 @@ static void run_shader(Shader *shader, uint32_t *dest, uint8_t *coverage, int le
             uint8_t *rdest = regs[*bytecode++].u8;
             uint8_t *rsrc1 = regs[*bytecode++].u8;
             uint8_t *rsrc2 = regs[*bytecode++].u8;
+            #ifdef FIXIMAGE_AVX2
+            if (simd_avx2) {
+               shader_bytes_avx2(BC_SUB, rdest, rsrc1, rsrc2, 0, amount*4);
+               DISPATCH();
+            }
+            #endif
             for (i=0; i<amount*4; i++) {
                int c = (*rsrc1++) - (*rsrc2++);
                if (c < 0) c = 0;
@@ -1654,6 +2842,12 @@ static void run_shader(Shader *shader, uint32_t *dest, uint8_t *coverage, int le
             uint8_t *rdest = regs[*bytecode++].u8;
             uint8_t *rsrc1 = regs[*bytecode++].u8;
             uint8_t *rsrc2 = regs[*bytecode++].u8;
+            #ifdef FIXIMAGE_AVX2
+            if (simd_avx2) {
+               shader_bytes_avx2(BC_MUL, rdest, rsrc1, rsrc2, 0, amount*4);
+               DISPATCH();
+            }
+            #endif
             for (i=0; i<amount*4; i++) {
                int c = div255((*rsrc1++) * (*rsrc2++));
                *rdest++ = c;
@@ -1666,6 +2860,12 @@ static void run_shader(Shader *shader, uint32_t *dest, uint8_t *coverage, int le
             uint8_t *rsrc1 = regs[*bytecode++].u8;
             uint8_t *rsrc2 = regs[*bytecode++].u8;
             int alpha = shader->inputs[*bytecode++];
+            #ifdef FIXIMAGE_AVX2
+            if (simd_avx2 && alpha >= 0 && alpha <= 256) {
+               shader_bytes_avx2(BC_MIX, rdest, rsrc1, rsrc2, alpha, amount*4);
+               DISPATCH();
+            }
+            #endif
             for (i=0; i<amount*4; i++) {
                int a = *rsrc1++;
                int b = *rsrc2++;
@@ -1678,6 +2878,12 @@ static void run_shader(Shader *shader, uint32_t *dest, uint8_t *coverage, int le
          op_output_blend: {
             uint32_t *rsrc = regs[*bytecode++].u32;
 
+            #ifdef FIXIMAGE_AVX2
+            if (simd_avx2 && (!coverage || !blend_table)) {
+               blend_line_avx2(dest, rsrc, 0, coverage, amount);
+               break;
+            }
+            #endif
             if (coverage) {
                for (i=0; i<amount; i++) {
                   color = *rsrc++;
@@ -1951,6 +3157,7 @@ static Value image_create_internal(Heap *heap, Value *error, int width, int heig
    data->free_func = free_func;
    data->free_data = free_data;
    data->type = type;
+   data->serial = __sync_add_and_fetch(&image_data_serial, 1);
 
    if (parent) {
       if (parent->refcnt < REFCNT_LIMIT) {
@@ -2365,6 +3572,110 @@ static int painter_get(Heap *heap, Value *error, Value painter_val, ImageData **
 }
 
 
+static FORCE_INLINE uint32_t hash_value(uint32_t hash, uint32_t value)
+{
+   value *= 0xCC9E2D51;
+   value = (value << 15) | (value >> 17);
+   value *= 0x1B873593;
+   hash ^= value;
+   hash = (hash << 13) | (hash >> 19);
+   return hash * 5 + 0xE6546B64;
+}
+
+
+// the batch operations are compared by their hashes only, 64 bits make the collisions unlikely
+// enough that a tile is never left with stale pixels in practice:
+static FORCE_INLINE uint64_t hash_value64(uint64_t hash, uint64_t value)
+{
+   value *= 0x87C37B91114253D5ULL;
+   value = (value << 31) | (value >> 33);
+   value *= 0x4CF5AD432745937FULL;
+   hash ^= value;
+   hash = (hash << 27) | (hash >> 37);
+   return hash * 5 + 0x52DCE729;
+}
+
+
+static uint64_t hash_pointer(uint64_t hash, void *ptr)
+{
+   return hash_value64(hash, (uintptr_t)ptr);
+}
+
+
+static uint64_t hash_floats(uint64_t hash, float *values, int cnt)
+{
+   union {
+      float f;
+      uint32_t i;
+   } u;
+   int i;
+
+   for (i=0; i<cnt; i++) {
+      u.f = values[i];
+      hash = hash_value64(hash, u.i);
+   }
+   return hash;
+}
+
+
+static uint64_t hash_values(uint64_t hash, Value *values, int cnt)
+{
+   int i;
+
+   for (i=0; i<cnt; i++) {
+      hash = hash_value64(hash, values[i].value);
+      hash = hash_value64(hash, values[i].is_array);
+   }
+   return hash;
+}
+
+
+// the source images are identified by their serial number only (addresses can be reused after
+// the image is freed), changes of their pixels are not detected:
+static uint64_t hash_shader(uint64_t hash, Shader *shader)
+{
+   uint8_t *bc = shader->bytecode;
+   Transform *tr;
+   int i, len;
+
+   for (;;) {
+      len = get_shader_op_length(bc[0]);
+      for (i=0; i<len; i++) {
+         hash = hash_value64(hash, bc[i]);
+      }
+      switch (bc[0]) {
+         case BC_COLOR:
+            hash = hash_value64(hash, shader->inputs[bc[2]]);
+            break;
+
+         case BC_SAMPLE_NEAREST:
+         case BC_SAMPLE_BILINEAR:
+         case BC_SAMPLE_BICUBIC:
+         case BC_SAMPLE_NEAREST_SPAN:
+            hash = hash_value64(hash, shader->images[bc[2]]->serial);
+            tr = &shader->transforms[bc[3]];
+            hash = hash_floats(hash, tr->m, 6);
+            break;
+
+         case BC_MUL_COLOR:
+            hash = hash_value64(hash, shader->inputs[bc[3]]);
+            break;
+
+         case BC_MIX:
+            hash = hash_value64(hash, shader->inputs[bc[4]]);
+            break;
+
+         case BC_OUTPUT_BLEND:
+         case BC_OUTPUT_REPLACE:
+         case BC_OUTPUT_BLEND_SUBPIXEL:
+         case BC_OUTPUT_REPLACE_SUBPIXEL:
+            return hash;
+      }
+      bc += len;
+   }
+}
+
+
 static void painter_add_batch_op(Painter *p, BatchOp *op, int x1, int y1, int x2, int y2)
 {
    BatchTile *tile;
@@ -2392,6 +3703,7 @@ static void painter_add_batch_op(Painter *p, BatchOp *op, int x1, int y1, int x2
             tile->ops = new_ops;
          }
          tile->ops[tile->cnt++] = op;
+         tile->hash = hash_value64(tile->hash, op->hash);
       }
    }
 }
@@ -2420,6 +3732,12 @@ static void fill_rect(int from, int to, void *data)
       inv_ca = 255 - ca;
 
       for (i=from; i<to; i++) {
+         #ifdef FIXIMAGE_AVX2
+         if (simd_avx2) {
+            blend_line_avx2(&fr->pixels[i*fr->stride+fr->x1], NULL, fr->color, NULL, fr->x2 - fr->x1);
+            continue;
+         }
+         #endif
          for (j=fr->x1; j<fr->x2; j++) {
             pixel = fr->pixels[i*fr->stride+j];
 
@@ -2506,6 +3824,19 @@ static Value painter_fill_rect(Heap *heap, Value *error, int num_params, Value *
       if (fr.type == 2) {
          shader_ref_data(&fr.shader);
       }
+      if (p->track_changes) {
+         op->hash = hash_value64(op->type, fr.type);
+         op->hash = hash_value64(op->hash, rect.x1);
+         op->hash = hash_value64(op->hash, rect.y1);
+         op->hash = hash_value64(op->hash, rect.x2);
+         op->hash = hash_value64(op->hash, rect.y2);
+         if (fr.type == 2) {
+            op->hash = hash_shader(op->hash, &fr.shader);
+         }
+         else {
+            op->hash = hash_value64(op->hash, fr.color);
+         }
+      }
       painter_add_batch_op(p, op, rect.x1, rect.y1, rect.x2, rect.y2);
    }
    else {
@@ -2912,6 +4243,7 @@ static void fill_shape_color(int from, int to, void *data)
    int ca, cr, cg, cb, inv_ca, pa, pr, pg, pb;
    float *accum = NULL, *clip_accum = NULL, accum_value, clip_accum_value;
    int value, clip_value;
+   uint8_t *coverage = NULL;
 
    ca = (fs->color >> 24) & 0xFF;
    cr = (fs->color >> 16) & 0xFF;
@@ -2934,6 +4266,11 @@ static void fill_shape_color(int from, int to, void *data)
    if (fs->clip_positions) {
       clip_accum = calloc(fs->clip.x2 - fs->clip.x1 + 1, sizeof(float));
    }
+#ifdef FIXIMAGE_AVX2
+   if (simd_avx2 && !fs->blend_table) {
+      coverage = calloc(fs->clip.x2 - fs->clip.x1, sizeof(uint8_t));
+   }
+#endif
 
    pixels = fs->pixels + from * fs->stride;
 
@@ -2969,6 +4306,10 @@ static void fill_shape_color(int from, int to, void *data)
             if (clip_value > 256) clip_value = 256;
             value = (value * clip_value) >> 8;
          }
+         if (coverage) {
+            coverage[j] = value;
+            continue;
+         }
          if (value > 0) {
             pixel = pixels[j];
             pa = (pixel >> 24) & 0xFF;
@@ -3005,12 +4346,18 @@ static void fill_shape_color(int from, int to, void *data)
       if (clip_accum) {
          clip_accum[max_x+1] = 0;
       }
+#ifdef FIXIMAGE_AVX2
+      if (coverage) {
+         blend_line_avx2(pixels + min_x, NULL, fs->color, coverage + min_x, max_x - min_x + 1);
+      }
+#endif
       
       pixels += fs->stride;
    }
 
    free(accum);
    free(clip_accum);
+   free(coverage);
 }
 
 
@@ -3695,6 +5042,25 @@ static Value painter_fill_shape(Heap *heap, Value *error, int num_params, Value
          if (fs.use_shader) {
             shader_ref_data(&fs.shader);
          }
+         if (p->track_changes) {
+            op->hash = hash_value64(op->type, fs.flags);
+            op->hash = hash_pointer(op->hash, fs.blend_table);
+            op->hash = hash_value64(op->hash, sg.clip.x1);
+            op->hash = hash_value64(op->hash, sg.clip.y1);
+            op->hash = hash_value64(op->hash, sg.clip.x2);
+            op->hash = hash_value64(op->hash, sg.clip.y2);
+            op->hash = hash_floats(op->hash, sg.tr.m, 6);
+            op->hash = hash_values(op->hash, sg.coords, sg.coords_len);
+            op->hash = hash_value64(op->hash, sg.coords_len);
+            op->hash = hash_values(op->hash, sg.clip_coords, sg.clip_coords_len);
+            op->hash = hash_value64(op->hash, sg.clip_coords_len);
+            if (fs.use_shader) {
+               op->hash = hash_shader(op->hash, &fs.shader);
+            }
+            else {
+               op->hash = hash_value64(op->hash, fs.color);
+            }
+         }
 
          geom->sg = sg;
          geom->op = op;
@@ -3769,9 +5135,8 @@ static Value painter_batch_begin(Heap *heap, Value *error, int num_params, Value
       return fixscript_int(0);
    }
 
-   if (multicore_num_cores == 0) {
-      fiximage_multicore_run(0, 1, 0, dummy_multicore_func, NULL);
-   }
+   multicore_init();
+   p->track_changes = num_params > 1 && params[1].value;
 
    p->tile_width = (p->data->width + BATCH_TILE_SIZE - 1) / BATCH_TILE_SIZE;
    p->tile_height = (p->data->height + BATCH_TILE_SIZE - 1) / BATCH_TILE_SIZE;
@@ -3780,6 +5145,16 @@ static Value painter_batch_begin(Heap *heap, Value *error, int num_params, Value
       return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
    }
 
+   if (!p->damaged) {
+      p->damaged = malloc(16 * sizeof(Rect));
+      if (!p->damaged) {
+         free(p->tiles);
+         p->tiles = NULL;
+         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      }
+      p->damaged_cap = 16;
+   }
+
    p->conds = calloc(multicore_num_cores, sizeof(pthread_cond_t));
    if (!p->conds) {
       free(p->tiles);
@@ -3832,6 +5207,8 @@ static void draw_tile(BatchTile *tile)
    BatchOp *op;
    int i, y1, y2;
 
+   if (!tile->dirty) return;
+
    for (i=0; i<tile->cnt; i++) {
       op = tile->ops[i];
       if (op->type == BATCH_OP_FILL_RECT) {
@@ -3866,18 +5243,10 @@ static void draw_tile(BatchTile *tile)
 static void draw_tiles(int from, int to, void *data)
 {
    Painter *p = data;
-   BatchTile *tile;
-
-   for (;;) {
-      pthread_mutex_lock(&p->mutex);
-      tile = p->cur_tiles;
-      if (tile) {
-         p->cur_tiles = tile->cur_next;
-      }
-      pthread_mutex_unlock(&p->mutex);
+   int i;
 
-      if (!tile) break;
-      draw_tile(tile);
+   for (i=from; i<to; i++) {
+      draw_tile(&p->tiles[i]);
    }
 }
 
@@ -3886,7 +5255,8 @@ static void flush_batch(Painter *p)
 {
    BatchOp *op, *next_op;
    BatchTile *tile;
-   int i;
+   Rect *rect, *new_damaged;
+   int i, j, new_cap;
 
    if (p->geom_threads) {
       pthread_mutex_lock(&p->mutex);
@@ -3905,16 +5275,55 @@ static void flush_batch(Painter *p)
       p->geom_done = 0;
    }
 
-   p->cur_tiles = NULL;
-   for (i=p->tile_width*p->tile_height-1; i>=0; i--) {
+   // with change tracking the tiles with the same operations as in the previous flush are skipped:
+   for (i=0; i<p->tile_width*p->tile_height; i++) {
       tile = &p->tiles[i];
-      tile->cur_next = p->cur_tiles;
-      p->cur_tiles = tile;
+      tile->dirty = !p->track_changes || !tile->prev_valid || tile->hash != tile->prev_hash;
+   }
+
+   fiximage_multicore_run(0, p->tile_width*p->tile_height, 0, draw_tiles, p);
+
+   p->damaged_cnt = 0;
+   for (i=0; i<p->tile_height; i++) {
+      for (j=0; j<p->tile_width; j++) {
+         tile = &p->tiles[i*p->tile_width+j];
+         if (!tile->dirty) continue;
+
+         if (p->damaged_cnt == p->damaged_cap) {
+            new_cap = p->damaged_cap*2;
+            new_damaged = realloc(p->damaged, new_cap*sizeof(Rect));
+            if (!new_damaged) {
+               // report the whole image when out of memory:
+               p->damaged_cnt = 1;
+               p->damaged[0].x1 = 0;
+               p->damaged[0].y1 = 0;
+               p->damaged[0].x2 = p->data->width;
+               p->damaged[0].y2 = p->data->height;
+               i = p->tile_height;
+               break;
+            }
+            p->damaged = new_damaged;
+            p->damaged_cap = new_cap;
+         }
+
+         rect = &p->damaged[p->damaged_cnt++];
+         rect->x1 = tile->x1;
+         rect->y1 = tile->y1;
+         while (j+1 < p->tile_width && tile[1].dirty) {
+            tile++;
+            j++;
+         }
+         rect->x2 = tile->x2;
+         rect->y2 = tile->y2;
+      }
    }
-   fiximage_multicore_run(0, 1000, 0, draw_tiles, p);
 
    for (i=0; i<p->tile_width*p->tile_height; i++) {
-      p->tiles[i].cnt = 0;
+      tile = &p->tiles[i];
+      tile->cnt = 0;
+      tile->prev_hash = tile->hash;
+      tile->prev_valid = 1;
+      tile->hash = 0;
    }
 
    op = p->ops;
@@ -3923,48 +5332,733 @@ static void flush_batch(Painter *p)
       free_batch_op(op);
       op = next_op;
    }
-   p->ops = NULL;
+   p->ops = NULL;
+}
+
+
+static Value painter_batch_flush(Heap *heap, Value *error, int num_params, Value *params, void *func_data)
+{
+   Painter *p;
+
+   p = get_painter(heap, error, params[0]);
+   if (!p || !p->tiles) {
+      return fixscript_int(0);
+   }
+
+   flush_batch(p);
+
+   return fixscript_int(0);
+}
+
+
+static Value painter_batch_end(Heap *heap, Value *error, int num_params, Value *params, void *func_data)
+{
+   Painter *p;
+   int i;
+
+   p = get_painter(heap, error, params[0]);
+   if (!p || !p->tiles) {
+      return fixscript_int(0);
+   }
+
+   flush_batch(p);
+
+   for (i=0; i<p->tile_width*p->tile_height; i++) {
+      free(p->tiles[i].ops);
+   }
+   free(p->tiles);
+   p->tiles = NULL;
+   for (i=0; i<multicore_num_cores; i++) {
+      pthread_cond_destroy(&p->conds[i]);
+   }
+   pthread_mutex_destroy(&p->mutex);
+
+   return fixscript_int(0);
+}
+
+
+static Value painter_batch_invalidate(Heap *heap, Value *error, int num_params, Value *params, void *func_data)
+{
+   Painter *p;
+   int i;
+
+   p = get_painter(heap, error, params[0]);
+   if (!p || !p->tiles) {
+      return fixscript_int(0);
+   }
+
+   for (i=0; i<p->tile_width*p->tile_height; i++) {
+      p->tiles[i].prev_valid = 0;
+   }
+   return fixscript_int(0);
+}
+
+
+static Value painter_batch_get_damaged_rects(Heap *heap, Value *error, int num_params, Value *params, void *func_data)
+{
+   Painter *p;
+   Value arr, rect, values[4];
+   int i, err;
+
+   p = get_painter(heap, error, params[0]);
+   if (!p) {
+      return fixscript_int(0);
+   }
+
+   arr = fixscript_create_array(heap, p->damaged_cnt);
+   if (!arr.value) {
+      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+   }
+
+   for (i=0; i<p->damaged_cnt; i++) {
+      rect = fixscript_create_array(heap, 4);
+      if (!rect.value) {
+         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      }
+      values[0] = fixscript_int(p->damaged[i].x1);
+      values[1] = fixscript_int(p->damaged[i].y1);
+      values[2] = fixscript_int(p->damaged[i].x2);
+      values[3] = fixscript_int(p->damaged[i].y2);
+      err = fixscript_set_array_range(heap, rect, 0, 4, values);
+      if (!err) {
+         err = fixscript_set_array_elem(heap, arr, i, rect);
+      }
+      if (err) {
+         return fixscript_error(heap, error, err);
+      }
+   }
+   return arr;
+}
+
+
+static Value painter_set_thread_limit(Heap *heap, Value *error, int num_params, Value *params, void *func_data)
+{
+   fiximage_set_thread_limit(fixscript_get_int(params[0]));
+   return fixscript_int(0);
+}
+
+
+static Value painter_get_thread_limit(Heap *heap, Value *error, int num_params, Value *params, void *func_data)
+{
+   return fixscript_int(fiximage_get_thread_limit());
+}
+
+
+static int get_simd_level()
+{
+#ifdef FIXIMAGE_AVX2
+   if (simd_avx2) return SIMD_AVX2;
+#endif
+#ifdef __SSE2__
+   if (simd_sse2) return SIMD_SSE2;
+#endif
+   return SIMD_SCALAR;
+}
+
+
+// the level is changed for the whole process and must not be changed while drawing:
+static Value painter_set_simd_level(Heap *heap, Value *error, int num_params, Value *params, void *func_data)
+{
+   int level = fixscript_get_int(params[0]);
+
+#ifdef __SSE2__
+   simd_sse2 = (level >= SIMD_SSE2);
+#endif
+#ifdef FIXIMAGE_AVX2
+   simd_avx2 = (level >= SIMD_AVX2 && simd_avx2_supported);
+#endif
+   return fixscript_int(get_simd_level());
+}
+
+
+static Value painter_get_simd_level(Heap *heap, Value *error, int num_params, Value *params, void *func_data)
+{
+   return fixscript_int(get_simd_level());
+}
+
+
+static void free_glyph_atlas(void *ptr)
+{
+   GlyphAtlas *atlas = ptr;
+
+   fixscript_adjust_heap_size(atlas->heap, -atlas->size);
+   free(atlas->pixels);
+   free(atlas->glyphs);
+   free(atlas->hash);
+   free(atlas);
+}
+
+
+// reports the memory used by the atlas to the heap:
+static void glyph_atlas_update_size(GlyphAtlas *atlas)
+{
+   int size;
+
+   size = atlas->height * ATLAS_WIDTH + atlas->glyphs_cap * sizeof(AtlasGlyph) + atlas->hash_size * sizeof(int);
+   fixscript_adjust_heap_size(atlas->heap, size - atlas->size);
+   atlas->size = size;
+}
+
+
+static void glyph_atlas_reset(GlyphAtlas *atlas)
+{
+   memset(atlas->pixels, 0, (atlas->shelf_y + atlas->shelf_height) * ATLAS_WIDTH);
+   memset(atlas->hash, 0, atlas->hash_size * sizeof(int));
+   atlas->glyphs_cnt = 0;
+   atlas->shelf_x = 0;
+   atlas->shelf_y = 0;
+   atlas->shelf_height = 0;
+}
+
+
+static AtlasGlyph *glyph_atlas_find(GlyphAtlas *atlas, int font, int key)
+{
+   AtlasGlyph *glyph;
+   int idx = hash_value(hash_value(0, font), key) & (atlas->hash_size-1);
+
+   while (atlas->hash[idx]) {
+      glyph = &atlas->glyphs[atlas->hash[idx]-1];
+      if (glyph->key == key && glyph->font == font) {
+         return glyph;
+      }
+      idx = (idx+1) & (atlas->hash_size-1);
+   }
+   return NULL;
+}
+
+
+static AtlasGlyph *glyph_atlas_insert(GlyphAtlas *atlas, int font, int key)
+{
+   AtlasGlyph *new_glyphs;
+   int *new_hash;
+   int i, idx, new_size;
+
+   if (atlas->glyphs_cnt == atlas->glyphs_cap) {
+      new_glyphs = realloc(atlas->glyphs, atlas->glyphs_cap * 2 * sizeof(AtlasGlyph));
+      if (!new_glyphs) return NULL;
+      atlas->glyphs = new_glyphs;
+      atlas->glyphs_cap *= 2;
+      glyph_atlas_update_size(atlas);
+   }
+
+   if ((atlas->glyphs_cnt+1)*2 > atlas->hash_size) {
+      new_size = atlas->hash_size * 2;
+      new_hash = calloc(new_size, sizeof(int));
+      if (!new_hash) return NULL;
+      free(atlas->hash);
+      atlas->hash = new_hash;
+      atlas->hash_size = new_size;
+      for (i=0; i<atlas->glyphs_cnt; i++) {
+         idx = hash_value(hash_value(0, atlas->glyphs[i].font), atlas->glyphs[i].key) & (new_size-1);
+         while (new_hash[idx]) {
+            idx = (idx+1) & (new_size-1);
+         }
+         new_hash[idx] = i+1;
+      }
+      glyph_atlas_update_size(atlas);
+   }
+
+   idx = hash_value(hash_value(0, font), key) & (atlas->hash_size-1);
+   while (atlas->hash[idx]) {
+      idx = (idx+1) & (atlas->hash_size-1);
+   }
+   atlas->hash[idx] = ++atlas->glyphs_cnt;
+   atlas->glyphs[atlas->glyphs_cnt-1].font = font;
+   atlas->glyphs[atlas->glyphs_cnt-1].key = key;
+   return &atlas->glyphs[atlas->glyphs_cnt-1];
+}
+
+
+// the width is in bytes:
+static int glyph_atlas_alloc(GlyphAtlas *atlas, int width, int height, int *x, int *y)
+{
+   uint8_t *new_pixels;
+   int new_height;
+
+   if (atlas->shelf_x + width > ATLAS_WIDTH) {
+      atlas->shelf_x = 0;
+      atlas->shelf_y += atlas->shelf_height;
+      atlas->shelf_height = 0;
+   }
+
+   if (atlas->shelf_y + height > atlas->height) {
+      new_height = atlas->height;
+      while (new_height < atlas->shelf_y + height && new_height < ATLAS_MAX_HEIGHT) {
+         new_height *= 2;
+      }
+      if (atlas->shelf_y + height > new_height) {
+         return 0;
+      }
+      new_pixels = realloc(atlas->pixels, new_height * ATLAS_WIDTH);
+      if (!new_pixels) {
+         return 0;
+      }
+      memset(new_pixels + atlas->height * ATLAS_WIDTH, 0, (new_height - atlas->height) * ATLAS_WIDTH);
+      atlas->pixels = new_pixels;
+      atlas->height = new_height;
+      glyph_atlas_update_size(atlas);
+   }
+
+   *x = atlas->shelf_x;
+   *y = atlas->shelf_y;
+   atlas->shelf_x += width;
+   atlas->shelf_height = MAX(atlas->shelf_height, height);
+   return 1;
+}
+
+
+static int get_glyph_run_entry(Value *values, Transform *tr, int flags, int *key, int *x, int *y)
+{
+   float fx, fy;
+   int c, qx, qy;
+
+   c = fixscript_get_int(values[0]);
+   fx = (fixscript_is_float(values[1])? fixscript_get_float(values[1]) : fixscript_get_int(values[1])) + tr->m02;
+   fy = (fixscript_is_float(values[2])? fixscript_get_float(values[2]) : fixscript_get_int(values[2])) + tr->m12;
+   if (c < 0 || c > 0x1FFFFF) {
+      return 0;
+   }
+   if (!(fx > -1000000.0f && fx < 1000000.0f && fy > -1000000.0f && fy < 1000000.0f)) {
+      fx = -1000000.0f;
+      fy = -1000000.0f;
+   }
+
+   // positions are quantized to quarter pixels, each phase is cached separately:
+   qx = fast_floor(fx * 4.0f + 0.5f);
+   qy = fast_floor(fy * 4.0f + 0.5f);
+   *key = (c << 6) | ((qx & 3) << 4) | ((qy & 3) << 2) | (flags & (FLAGS_SUBPIXEL_RENDERING | FLAGS_SUBPIXEL_REVERSED));
+   if (!(flags & FLAGS_SUBPIXEL_RENDERING)) {
+      *key &= ~FLAGS_SUBPIXEL_REVERSED;
+   }
+   *x = qx >> 2;
+   *y = qy >> 2;
+   return 1;
+}
+
+
+static Value glyph_atlas_create(Heap *heap, Value *error, int num_params, Value *params, void *func_data)
+{
+   GlyphAtlas *atlas;
+   Value handle;
+
+   atlas = calloc(1, sizeof(GlyphAtlas));
+   if (!atlas) {
+      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+   }
+
+   atlas->heap = heap;
+   atlas->height = 128;
+   atlas->pixels = calloc(atlas->height, ATLAS_WIDTH);
+   atlas->glyphs_cap = 64;
+   atlas->glyphs = malloc(atlas->glyphs_cap * sizeof(AtlasGlyph));
+   atlas->hash_size = 128;
+   atlas->hash = calloc(atlas->hash_size, sizeof(int));
+   if (!atlas->pixels || !atlas->glyphs || !atlas->hash) {
+      free_glyph_atlas(atlas);
+      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+   }
+   glyph_atlas_update_size(atlas);
+
+   handle = fixscript_create_handle(heap, HANDLE_TYPE_GLYPH_ATLAS, atlas, free_glyph_atlas);
+   if (!handle.value) {
+      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+   }
+   return handle;
+}
+
+
+static Value glyph_atlas_add(Heap *heap, Value *error, int num_params, Value *params, void *func_data)
+{
+   GlyphAtlas *atlas;
+   AtlasGlyph *glyph;
+   ImageData *data;
+   Value entry[3];
+   Rect clip;
+   Transform tr;
+   FillShapeGeometry sg;
+   FillShapeData fs;
+   uint32_t *mask = NULL, m;
+   uint8_t *dest;
+   float min_x, min_y, max_x, max_y;
+   int i, j, err, font, flags, key, pos_x, pos_y, x1, y1, x2, y2, x, y, bpp;
+   int ret = 0;
+
+   memset(&sg, 0, sizeof(FillShapeGeometry));
+   memset(&fs, 0, sizeof(FillShapeData));
+
+   atlas = fixscript_get_handle(heap, params[0], HANDLE_TYPE_GLYPH_ATLAS, NULL);
+   if (!atlas) {
+      *error = fixscript_create_error_string(heap, "invalid glyph atlas handle");
+      return fixscript_int(0);
+   }
+
+   font = fixscript_get_int(params[1]);
+
+   if (!painter_get(heap, error, params[2], &data, &clip, NULL, NULL, NULL, &tr, &flags, NULL, NULL)) {
+      return fixscript_int(0);
+   }
+   bpp = (flags & FLAGS_SUBPIXEL_RENDERING)? 3 : 1;
+
+   err = fixscript_get_array_range(heap, params[3], fixscript_get_int(params[4])*3, 3, entry);
+   if (err) {
+      return fixscript_error(heap, error, err);
+   }
+
+   if (!get_glyph_run_entry(entry, &tr, flags, &key, &pos_x, &pos_y)) {
+      *error = fixscript_create_error_string(heap, "invalid character");
+      return fixscript_int(0);
+   }
+
+   if (glyph_atlas_find(atlas, font, key)) {
+      return fixscript_int(1);
+   }
+
+   err = fixscript_get_array_length(heap, params[5], &sg.coords_len);
+   if (!err) {
+      sg.coords = malloc(sg.coords_len * sizeof(Value));
+      if (!sg.coords && sg.coords_len > 0) {
+         err = FIXSCRIPT_ERR_OUT_OF_MEMORY;
+      }
+   }
+   if (!err) {
+      err = fixscript_get_array_range(heap, params[5], 0, sg.coords_len, sg.coords);
+   }
+   if (err) {
+      fixscript_error(heap, error, err);
+      goto error;
+   }
+
+   // the glyph is rasterized at the quantized phase of the position:
+   memset(&tr, 0, sizeof(Transform));
+   tr.m00 = (flags & FLAGS_SUBPIXEL_RENDERING)? 3.0f : 1.0f;
+   tr.m11 = 1.0f;
+   tr.m02 = ((key >> 4) & 3) * 0.25f * tr.m00;
+   tr.m12 = ((key >> 2) & 3) * 0.25f;
+
+   min_x = +FLT_MAX;
+   min_y = +FLT_MAX;
+   max_x = -FLT_MAX;
+   max_y = -FLT_MAX;
+
+   if (!pre_scan_coords(sg.coords, sg.coords_len, &tr, &min_x, &min_y, &max_x, &max_y)) {
+      *error = fixscript_create_error_string(heap, "garbled coordinate values");
+      goto error;
+   }
+
+   if (flags & FLAGS_SUBPIXEL_RENDERING) {
+      min_x *= 0.3333f;
+      max_x *= 0.3333f;
+   }
+
+   if (min_x > max_x || min_y > max_y) {
+      x1 = y1 = x2 = y2 = 0;
+   }
+   else {
+      if (!(min_x > -ATLAS_WIDTH && max_x < ATLAS_WIDTH && min_y > -ATLAS_MAX_HEIGHT && max_y < ATLAS_MAX_HEIGHT)) {
+         goto error;
+      }
+      x1 = fast_floor(min_x) - 1;
+      y1 = fast_floor(min_y);
+      x2 = fast_floor(max_x) + 2;
+      y2 = fast_floor(max_y) + 1;
+      if ((x2 - x1) * bpp > ATLAS_WIDTH || y2 - y1 > ATLAS_MAX_HEIGHT) {
+         goto error;
+      }
+   }
+
+   if (!glyph_atlas_alloc(atlas, (x2 - x1) * bpp, y2 - y1, &x, &y)) {
+      glyph_atlas_reset(atlas);
+      if (!glyph_atlas_alloc(atlas, (x2 - x1) * bpp, y2 - y1, &x, &y)) {
+         goto error;
+      }
+   }
+
+   glyph = glyph_atlas_insert(atlas, font, key);
+   if (!glyph) {
+      fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      goto error;
+   }
+   glyph->x = x;
+   glyph->y = y;
+   glyph->width = x2 - x1;
+   glyph->height = y2 - y1;
+   glyph->off_x = x1;
+   glyph->off_y = y1;
+
+   if (glyph->width > 0 && glyph->height > 0) {
+      memset(&tr, 0, sizeof(Transform));
+      tr.m00 = 1.0f;
+      tr.m11 = 1.0f;
+      tr.m02 = -x1 * ((flags & FLAGS_SUBPIXEL_RENDERING)? 3.0f : 1.0f);
+      tr.m12 = -y1;
+      pre_scan_coords(sg.coords, sg.coords_len, &tr, &min_x, &min_y, &max_x, &max_y);
+
+      mask = calloc(glyph->width * glyph->height, sizeof(uint32_t));
+      if (!mask) {
+         glyph_atlas_reset(atlas);
+         fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+         goto error;
+      }
+
+      // white color on the cleared area produces the coverage values directly:
+      sg.clip.x1 = 0;
+      sg.clip.y1 = 0;
+      sg.clip.x2 = glyph->width;
+      sg.clip.y2 = glyph->height;
+      fs.clip = sg.clip;
+      fs.pixels = mask;
+      fs.stride = glyph->width;
+      fs.color = 0xFFFFFFFF;
+      fs.flags = flags & (FLAGS_SUBPIXEL_RENDERING | FLAGS_SUBPIXEL_REVERSED);
+      fs.func = (flags & FLAGS_SUBPIXEL_RENDERING)? fill_shape_color_subpixel : fill_shape_color;
+
+      if (!process_shape_geometry(&sg, &fs)) {
+         glyph_atlas_reset(atlas);
+         fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+         goto error;
+      }
+      fs.func(0, glyph->height, &fs);
+
+      // only the alpha is kept for grayscale glyphs, the color channels for subpixel glyphs:
+      for (i=0; i<glyph->height; i++) {
+         dest = atlas->pixels + (y + i) * ATLAS_WIDTH + x;
+         for (j=0; j<glyph->width; j++) {
+            m = mask[i * glyph->width + j];
+            if (bpp == 3) {
+               dest[j*3+0] = m >> 16;
+               dest[j*3+1] = m >> 8;
+               dest[j*3+2] = m;
+            }
+            else {
+               dest[j] = m >> 24;
+            }
+         }
+      }
+   }
+   ret = 1;
+
+error:
+   free(sg.coords);
+   free(mask);
+   free_fill_shape_data(&fs);
+   return fixscript_int(ret);
+}
+
+
+static void blit_glyph_color(uint32_t *pixels, int stride, uint8_t *mask, int width, int height, uint32_t color, int ca, int cr, int cg, int cb, uint8_t *blend_table)
+{
+   uint32_t pixel;
+   int i, j, value, inv_ca, pa, pr, pg, pb;
+
+   for (i=0; i<height; i++) {
+#ifdef FIXIMAGE_AVX2
+      if (simd_avx2 && !blend_table) {
+         blend_line_avx2(pixels, NULL, color, mask, width);
+         pixels += stride;
+         mask += ATLAS_WIDTH;
+         continue;
+      }
+#endif
+      for (j=0; j<width; j++) {
+         value = mask[j];
+         if (value > 0) {
+            pixel = pixels[j];
+            pa = (pixel >> 24) & 0xFF;
+            pr = (pixel >> 16) & 0xFF;
+            pg = (pixel >>  8) & 0xFF;
+            pb = (pixel >>  0) & 0xFF;
+
+            inv_ca = 255 - div255(ca * value);
+            pa = div255(ca * value) + div255(pa * inv_ca);
+            if (blend_table) {
+               pr = div255(cr * value) + div255(blend_table[pr] * inv_ca);
+               pg = div255(cg * value) + div255(blend_table[pg] * inv_ca);
+               pb = div255(cb * value) + div255(blend_table[pb] * inv_ca);
+            }
+            else {
+               pr = div255(cr * value) + div255(pr * inv_ca);
+               pg = div255(cg * value) + div255(pg * inv_ca);
+               pb = div255(cb * value) + div255(pb * inv_ca);
+            }
+
+            if (pr > 255) pr = 255;
+            if (pg > 255) pg = 255;
+            if (pb > 255) pb = 255;
+
+            if (blend_table) {
+               pr = blend_table[pr+256];
+               pg = blend_table[pg+256];
+               pb = blend_table[pb+256];
+            }
+            pixels[j] = (pa << 24) | (pr << 16) | (pg << 8) | pb;
+         }
+      }
+      pixels += stride;
+      mask += ATLAS_WIDTH;
+   }
+}
+
+
+static void blit_glyph_color_subpixel(uint32_t *pixels, int stride, uint8_t *mask, int width, int height, int ca, int cr, int cg, int cb, uint8_t *blend_table)
+{
+   uint32_t pixel;
+   int i, j, pa, pr, pg, pb, ma, mr, mg, mb, inv_ma, inv_mr, inv_mg, inv_mb;
+
+   for (i=0; i<height; i++) {
+      for (j=0; j<width; j++) {
+         mr = mask[j*3+0];
+         mg = mask[j*3+1];
+         mb = mask[j*3+2];
+         if (mr | mg | mb) {
+            ma = MAX(MAX(mr, mg), mb);
+
+            pixel = pixels[j];
+            pa = (pixel >> 24) & 0xFF;
+            pr = (pixel >> 16) & 0xFF;
+            pg = (pixel >>  8) & 0xFF;
+            pb = (pixel >>  0) & 0xFF;
+
+            inv_ma = 255 - div255(ma * ca);
+            inv_mr = 255 - div255(mr * ca);
+            inv_mg = 255 - div255(mg * ca);
+            inv_mb = 255 - div255(mb * ca);
+
+            pa = div255(ca * ma) + div255(pa * inv_ma);
+            if (blend_table) {
+               pr = div255(cr * mr) + div255(blend_table[pr] * inv_mr);
+               pg = div255(cg * mg) + div255(blend_table[pg] * inv_mg);
+               pb = div255(cb * mb) + div255(blend_table[pb] * inv_mb);
+            }
+            else {
+               pr = div255(cr * mr) + div255(pr * inv_mr);
+               pg = div255(cg * mg) + div255(pg * inv_mg);
+               pb = div255(cb * mb) + div255(pb * inv_mb);
+            }
+
+            if (pr > 255) pr = 255;
+            if (pg > 255) pg = 255;
+            if (pb > 255) pb = 255;
+
+            if (blend_table) {
+               pr = blend_table[pr+256];
+               pg = blend_table[pg+256];
+               pb = blend_table[pb+256];
+            }
+            pixels[j] = (pa << 24) | (pr << 16) | (pg << 8) | pb;
+         }
+      }
+      pixels += stride;
+      mask += ATLAS_WIDTH;
+   }
 }
 
 
-static Value painter_batch_flush(Heap *heap, Value *error, int num_params, Value *params, void *func_data)
+static Value glyph_atlas_draw(Heap *heap, Value *error, int num_params, Value *params, void *func_data)
 {
+   GlyphAtlas *atlas;
+   AtlasGlyph *glyph;
+   ImageData *data;
    Painter *p;
+   Value *values;
+   Rect clip;
+   Transform tr;
+   Value *clip_coords;
+   uint8_t *blend_table;
+   uint32_t color;
+   int i, err, off, len, clip_coords_len, clip_count, font, flags, key, x, y, x1, y1, x2, y2;
+   int ca, cr, cg, cb;
+   int ret = -1;
 
-   p = get_painter(heap, error, params[0]);
-   if (!p || !p->tiles) {
+   atlas = fixscript_get_handle(heap, params[0], HANDLE_TYPE_GLYPH_ATLAS, NULL);
+   if (!atlas) {
+      *error = fixscript_create_error_string(heap, "invalid glyph atlas handle");
       return fixscript_int(0);
    }
 
-   flush_batch(p);
+   font = fixscript_get_int(params[1]);
 
-   return fixscript_int(0);
-}
+   if (!painter_get(heap, error, params[2], &data, &clip, &clip_coords, &clip_coords_len, &clip_count, &tr, &flags, &blend_table, &p)) {
+      return fixscript_int(-1);
+   }
+   free(clip_coords);
 
+   // only integer scale of 1 without any clip shapes is supported, batched painting too:
+   if (clip_count > 0 || p->tiles || tr.m00 != 1.0f || tr.m01 != 0.0f || tr.m10 != 0.0f || tr.m11 != 1.0f) {
+      return fixscript_int(-2);
+   }
 
-static Value painter_batch_end(Heap *heap, Value *error, int num_params, Value *params, void *func_data)
-{
-   Painter *p;
-   int i;
+   off = fixscript_get_int(params[4]);
+   len = fixscript_get_int(params[5]);
+   color = fixscript_get_int(params[6]);
+   if (off < 0 || len < 0 || off > INT_MAX/3 || len > INT_MAX/3 - off) {
+      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_BOUNDS);
+   }
 
-   p = get_painter(heap, error, params[0]);
-   if (!p || !p->tiles) {
-      return fixscript_int(0);
+   values = malloc(len*3*sizeof(Value));
+   if (!values && len > 0) {
+      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
    }
 
-   flush_batch(p);
+   err = fixscript_get_array_range(heap, params[3], off*3, len*3, values);
+   if (err) {
+      fixscript_error(heap, error, err);
+      goto error;
+   }
 
-   for (i=0; i<p->tile_width*p->tile_height; i++) {
-      free(p->tiles[i].ops);
+   ca = (color >> 24) & 0xFF;
+   cr = (color >> 16) & 0xFF;
+   cg = (color >>  8) & 0xFF;
+   cb = (color >>  0) & 0xFF;
+
+   if (blend_table && ca != 0) {
+      cr = cr * 255 / ca;
+      cg = cg * 255 / ca;
+      cb = cb * 255 / ca;
+      if (cr > 255) cr = 255;
+      if (cg > 255) cg = 255;
+      if (cb > 255) cb = 255;
+      cr = div255(blend_table[cr] * ca);
+      cg = div255(blend_table[cg] * ca);
+      cb = div255(blend_table[cb] * ca);
    }
-   free(p->tiles);
-   p->tiles = NULL;
-   for (i=0; i<multicore_num_cores; i++) {
-      pthread_cond_destroy(&p->conds[i]);
+
+   for (i=0; i<len; i++) {
+      if (!get_glyph_run_entry(&values[i*3], &tr, flags, &key, &x, &y)) {
+         *error = fixscript_create_error_string(heap, "invalid character");
+         goto error;
+      }
+
+      glyph = glyph_atlas_find(atlas, font, key);
+      if (!glyph) {
+         ret = off + i;
+         break;
+      }
+
+      x1 = MAX(clip.x1, x + glyph->off_x);
+      y1 = MAX(clip.y1, y + glyph->off_y);
+      x2 = MIN(clip.x2, x + glyph->off_x + glyph->width);
+      y2 = MIN(clip.y2, y + glyph->off_y + glyph->height);
+      if (x1 >= x2 || y1 >= y2) continue;
+
+      if (flags & FLAGS_SUBPIXEL_RENDERING) {
+         blit_glyph_color_subpixel(
+            data->pixels + y1 * data->stride + x1, data->stride,
+            atlas->pixels + (glyph->y + y1 - y - glyph->off_y) * ATLAS_WIDTH + glyph->x + (x1 - x - glyph->off_x) * 3,
+            x2 - x1, y2 - y1, ca, cr, cg, cb, blend_table
+         );
+      }
+      else {
+         blit_glyph_color(
+            data->pixels + y1 * data->stride + x1, data->stride,
+            atlas->pixels + (glyph->y + y1 - y - glyph->off_y) * ATLAS_WIDTH + (glyph->x + x1 - x - glyph->off_x),
+            x2 - x1, y2 - y1, color, ca, cr, cg, cb, blend_table
+         );
+      }
    }
-   pthread_mutex_destroy(&p->mutex);
 
-   return fixscript_int(0);
+error:
+   free(values);
+   return fixscript_int(ret);
 }
 
 
@@ -4790,14 +6884,22 @@ static Value image_to_png(Heap *heap, Value *error, int num_params, Value *param
    ImageData *data;
    Value ret;
    unsigned char *dest;
-   int dest_len;
+   int dest_len, level = ZCOMP_DEFAULT_LEVEL;
 
    data = get_image_data(heap, error, params[0]);
    if (!data) {
       return fixscript_int(0);
    }
 
-   if (!save_png(data->pixels, data->stride, data->width, data->height, &dest, &dest_len)) {
+   if (num_params == 2) {
+      level = fixscript_get_int(params[1]);
+      if (level < 1 || level > 9) {
+         *error = fixscript_create_error_string(heap, "invalid compression level");
+         return fixscript_int(0);
+      }
+   }
+
+   if (!save_png(data->pixels, data->stride, data->width, data->height, level, &dest, &dest_len)) {
       return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
    }
 
@@ -5366,9 +7468,444 @@ static Value image_remap_color_ramps(Heap *heap, Value *error, int num_params, V
 }
 
 
+
+typedef struct {
+   int *start;
+   int *count;
+   float *weights;
+   int max_count;
+} ResampleAxis;
+
+typedef struct {
+   uint32_t *src;
+   int src_width, src_height, src_stride;
+   uint32_t *dest;
+   int dest_width, dest_height;
+   ResampleAxis ax, ay;
+   int gamma_correct;
+   volatile int failed;
+} ResampleData;
+
+static volatile int gamma_tables_state;
+static float srgb_to_linear_table[256];
+static float recip_alpha_table[256];
+static uint8_t linear_to_srgb_table[LINEAR_TABLE_SIZE];
+
+
+static double srgb_to_linear(double v)
+{
+   return v <= 0.04045? v / 12.92 : pow((v + 0.055) / 1.055, 2.4);
+}
+
+
+static double linear_to_srgb(double v)
+{
+   return v <= 0.0031308? v * 12.92 : 1.055 * pow(v, 1.0 / 2.4) - 0.055;
+}
+
+
+static void init_gamma_tables()
+{
+   int i;
+
+   for (;;) {
+      i = gamma_tables_state;
+      if (i == 2) return;
+      if (i == 0 && __sync_bool_compare_and_swap(&gamma_tables_state, 0, 1)) break;
+      multicore_yield();
+   }
+
+   for (i=0; i<256; i++) {
+      srgb_to_linear_table[i] = srgb_to_linear(i / 255.0);
+      recip_alpha_table[i] = i > 0? 255.0f / i : 0.0f;
+   }
+   for (i=0; i<LINEAR_TABLE_SIZE; i++) {
+      linear_to_srgb_table[i] = (int)(linear_to_srgb(i / (double)(LINEAR_TABLE_SIZE-1)) * 255.0 + 0.5);
+   }
+
+   __sync_add_and_fetch(&gamma_tables_state, 1);
+}
+
+
+static float lanczos3(float x)
+{
+   if (x < 0.0f) x = -x;
+   if (x < 0.000001f) return 1.0f;
+   if (x >= 3.0f) return 0.0f;
+   x *= 3.14159265f;
+   return 3.0f * sinf(x) * sinf(x * (1.0f/3.0f)) / (x * x);
+}
+
+
+static void free_resample_axis(ResampleAxis *ax)
+{
+   free(ax->start);
+   free(ax->count);
+   free(ax->weights);
+}
+
+
+static int init_resample_axis(ResampleAxis *ax, int src_len, int dest_len, int lanczos)
+{
+   double scale, fscale, support, center, s, e, w, sum;
+   float *weights;
+   int i, j, idx, first, last;
+
+   scale = src_len / (double)dest_len;
+   if (lanczos) {
+      fscale = scale > 1.0? scale : 1.0;
+      support = 3.0 * fscale;
+      ax->max_count = (int)ceil(support*2.0) + 3;
+   }
+   else {
+      ax->max_count = (int)ceil(scale) + 2;
+   }
+   if (ax->max_count > src_len) {
+      ax->max_count = src_len;
+   }
+
+   ax->start = malloc(dest_len * sizeof(int));
+   ax->count = malloc(dest_len * sizeof(int));
+   ax->weights = calloc(dest_len, ax->max_count * sizeof(float));
+   if (!ax->start || !ax->count || !ax->weights) {
+      free_resample_axis(ax);
+      return 0;
+   }
+
+   for (i=0; i<dest_len; i++) {
+      weights = ax->weights + i*ax->max_count;
+      if (lanczos) {
+         // the taps outside of the image are folded into the edge pixels:
+         center = (i + 0.5) * scale;
+         first = (int)floor(center - support);
+         last = (int)ceil(center + support);
+         ax->start[i] = MAX(0, first);
+         ax->count[i] = MIN(MIN(src_len-1, last) - ax->start[i] + 1, ax->max_count);
+         sum = 0.0;
+         for (j=first; j<=last; j++) {
+            w = lanczos3((j + 0.5 - center) / fscale);
+            idx = MIN(MAX(0, j - ax->start[i]), ax->count[i]-1);
+            weights[idx] += w;
+            sum += w;
+         }
+      }
+      else {
+         // the weights are the covered areas of the source pixels:
+         s = i * scale;
+         e = (i + 1) * scale;
+         ax->start[i] = MIN((int)s, src_len-1);
+         ax->count[i] = MIN(MIN((int)ceil(e), src_len) - ax->start[i], ax->max_count);
+         sum = 0.0;
+         for (j=0; j<ax->count[i]; j++) {
+            w = MIN(ax->start[i]+j+1, e) - MAX(ax->start[i]+j, s);
+            weights[j] = w;
+            sum += w;
+         }
+      }
+      for (j=0; j<ax->count[i]; j++) {
+         weights[j] /= sum;
+      }
+   }
+   return 1;
+}
+
+
+static void load_resample_row(ResampleData *rd, float *row, int y)
+{
+   uint32_t *src = rd->src + y*rd->src_stride;
+   uint32_t c;
+   int i, j, a;
+   float fa, ra;
+#ifdef __SSE2__
+   __m128i zero = _mm_setzero_si128();
+   __m128i p, lo, hi;
+#endif
+
+   i = 0;
+   if (rd->gamma_correct) {
+      // the colors are converted to premultiplied linear values:
+      for (; i<rd->src_width; i++) {
+         c = src[i];
+         a = c >> 24;
+         fa = a;
+         ra = recip_alpha_table[a];
+         for (j=0; j<3; j++) {
+            row[i*4+j] = srgb_to_linear_table[MIN(255, (int)(((c >> (j*8)) & 0xFF) * ra + 0.5f))] * fa;
+         }
+         row[i*4+3] = fa;
+      }
+      return;
+   }
+
+#ifdef __SSE2__
+   for (; i+4<=rd->src_width; i+=4) {
+      p = _mm_loadu_si128((__m128i *)(src+i));
+      lo = _mm_unpacklo_epi8(p, zero);
+      hi = _mm_unpackhi_epi8(p, zero);
+      _mm_storeu_ps(row+i*4+0, _mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero)));
+      _mm_storeu_ps(row+i*4+4, _mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero)));
+      _mm_storeu_ps(row+i*4+8, _mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero)));
+      _mm_storeu_ps(row+i*4+12, _mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero)));
+   }
+#endif
+   for (; i<rd->src_width; i++) {
+      c = src[i];
+      for (j=0; j<4; j++) {
+         row[i*4+j] = (c >> (j*8)) & 0xFF;
+      }
+   }
+}
+
+
+static void store_resample_row(ResampleData *rd, float *row, int y)
+{
+   uint32_t *dest = rd->dest + y*rd->dest_width;
+   int i, j, a, c[3];
+   float inv_a;
+
+   for (i=0; i<rd->dest_width; i++) {
+      a = MIN(MAX(0, (int)(row[i*4+3] + 0.5f)), 255);
+      if (a == 0) {
+         dest[i] = 0;
+         continue;
+      }
+      if (rd->gamma_correct) {
+         inv_a = (LINEAR_TABLE_SIZE-1) / row[i*4+3];
+         for (j=0; j<3; j++) {
+            c[j] = div255(linear_to_srgb_table[MIN(MAX(0, (int)(row[i*4+j] * inv_a + 0.5f)), LINEAR_TABLE_SIZE-1)] * a);
+         }
+      }
+      else {
+         // the negative lobes of the filter can produce colors outside of the valid range:
+         for (j=0; j<3; j++) {
+            c[j] = MIN(MAX(0, (int)(row[i*4+j] + 0.5f)), a);
+         }
+      }
+      dest[i] = (a << 24) | (c[2] << 16) | (c[1] << 8) | c[0];
+   }
+}
+
+
+static void resample_rows(int from, int to, void *data)
+{
+   ResampleData *rd = data;
+   ResampleAxis *ax = &rd->ax, *ay = &rd->ay;
+   float *row, *ring, *acc, *p, *src, *weights, w;
+   int *ring_rows;
+   int i, j, k, x, y, sy, slot, row_size = rd->dest_width*4;
+#ifdef __SSE2__
+   __m128 sum, wv;
+#endif
+
+   row = malloc(rd->src_width*4*sizeof(float));
+   ring = malloc(ay->max_count*row_size*sizeof(float));
+   acc = malloc(row_size*sizeof(float));
+   ring_rows = malloc(ay->max_count*sizeof(int));
+   if (!row || !ring || !acc || !ring_rows) {
+      rd->failed = 1;
+      goto error;
+   }
+
+   // horizontally filtered source rows are kept in a ring buffer indexed by the source row:
+   for (i=0; i<ay->max_count; i++) {
+      ring_rows[i] = -1;
+   }
+
+   for (y=from; y<to; y++) {
+      memset(acc, 0, row_size*sizeof(float));
+      for (i=0; i<ay->count[y]; i++) {
+         sy = ay->start[y] + i;
+         slot = sy % ay->max_count;
+         p = ring + slot*row_size;
+         if (ring_rows[slot] != sy) {
+            load_resample_row(rd, row, sy);
+            for (x=0; x<rd->dest_width; x++) {
+               src = row + ax->start[x]*4;
+               weights = ax->weights + x*ax->max_count;
+#ifdef __SSE2__
+               sum = _mm_setzero_ps();
+               for (j=0; j<ax->count[x]; j++) {
+                  sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(src+j*4), _mm_set1_ps(weights[j])));
+               }
+               _mm_storeu_ps(p+x*4, sum);
+#else
+               p[x*4+0] = p[x*4+1] = p[x*4+2] = p[x*4+3] = 0.0f;
+               for (j=0; j<ax->count[x]; j++) {
+                  for (k=0; k<4; k++) {
+                     p[x*4+k] += src[j*4+k] * weights[j];
+                  }
+               }
+#endif
+            }
+            ring_rows[slot] = sy;
+         }
+         w = ay->weights[y*ay->max_count+i];
+#ifdef __SSE2__
+         wv = _mm_set1_ps(w);
+         for (k=0; k<row_size; k+=4) {
+            _mm_storeu_ps(acc+k, _mm_add_ps(_mm_loadu_ps(acc+k), _mm_mul_ps(_mm_loadu_ps(p+k), wv)));
+         }
+#else
+         for (k=0; k<row_size; k++) {
+            acc[k] += p[k] * w;
+         }
+#endif
+      }
+      store_resample_row(rd, acc, y);
+   }
+
+error:
+   free(row);
+   free(ring);
+   free(acc);
+   free(ring_rows);
+}
+
+
+static uint32_t *resample_image(uint32_t *src, int src_width, int src_height, int src_stride, int dest_width, int dest_height, int flags)
+{
+   ResampleData rd;
+
+   memset(&rd, 0, sizeof(ResampleData));
+   rd.src = src;
+   rd.src_width = src_width;
+   rd.src_height = src_height;
+   rd.src_stride = src_stride;
+   rd.dest_width = dest_width;
+   rd.dest_height = dest_height;
+
+   if (flags & DOWNSCALE_GAMMA_CORRECT) {
+      init_gamma_tables();
+      rd.gamma_correct = 1;
+   }
+
+   rd.dest = malloc(dest_width*dest_height*sizeof(uint32_t));
+   if (!rd.dest) {
+      return NULL;
+   }
+   if (!init_resample_axis(&rd.ax, src_width, dest_width, flags & DOWNSCALE_LANCZOS)) {
+      free(rd.dest);
+      return NULL;
+   }
+   if (!init_resample_axis(&rd.ay, src_height, dest_height, flags & DOWNSCALE_LANCZOS)) {
+      free_resample_axis(&rd.ax);
+      free(rd.dest);
+      return NULL;
+   }
+
+   // the source rows at the boundaries of the parts are filtered twice so the parts shouldn't be too small:
+   fiximage_multicore_run(0, dest_height, MAX(16, 100000/dest_width), resample_rows, &rd);
+
+   free_resample_axis(&rd.ax);
+   free_resample_axis(&rd.ay);
+   if (rd.failed) {
+      free(rd.dest);
+      return NULL;
+   }
+   return rd.dest;
+}
+
+
+static Value image_create_mipmaps(Heap *heap, Value *error, int num_params, Value *params, void *func_data)
+{
+   ImageData *data;
+   Value arr, img;
+   uint32_t *levels[32], *src;
+   int i, err, flags, cnt, width, height, src_width, src_height, src_stride;
+
+   data = get_image_data(heap, error, params[0]);
+   if (!data) {
+      return fixscript_int(0);
+   }
+
+   flags = fixscript_get_int(params[1]);
+
+   // each level is half the size of the previous one (rounded up) down to 1x1:
+   cnt = 0;
+   src = data->pixels;
+   width = src_width = data->width;
+   height = src_height = data->height;
+   src_stride = data->stride;
+   while (width > 1 || height > 1) {
+      width = (width+1)/2;
+      height = (height+1)/2;
+      levels[cnt] = resample_image(src, src_width, src_height, src_stride, width, height, flags);
+      if (!levels[cnt]) {
+         for (i=0; i<cnt; i++) {
+            free(levels[i]);
+         }
+         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      }
+      src = levels[cnt++];
+      src_width = src_stride = width;
+      src_height = height;
+   }
+
+   arr = fixscript_create_array(heap, cnt);
+   if (!arr.value) {
+      fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      goto error;
+   }
+
+   width = data->width;
+   height = data->height;
+   for (i=0; i<cnt; i++) {
+      width = (width+1)/2;
+      height = (height+1)/2;
+      img = image_create_internal(heap, error, width, height, width, levels[i], 1, NULL, NULL, NULL, -1);
+      levels[i] = NULL;
+      if (!img.value) {
+         goto error;
+      }
+      err = fixscript_set_array_elem(heap, arr, i, img);
+      if (err) {
+         fixscript_error(heap, error, err);
+         goto error;
+      }
+   }
+   return arr;
+
+error:
+   for (i=0; i<cnt; i++) {
+      free(levels[i]);
+   }
+   return fixscript_int(0);
+}
+
+
+static Value image_downscale(Heap *heap, Value *error, int num_params, Value *params, void *func_data)
+{
+   ImageData *data;
+   uint32_t *pixels;
+   int width, height;
+
+   data = get_image_data(heap, error, params[0]);
+   if (!data) {
+      return fixscript_int(0);
+   }
+
+   width = fixscript_get_int(params[1]);
+   height = fixscript_get_int(params[2]);
+   if (width < 1 || height < 1 || width > MAX_IMAGE_DIM || height > MAX_IMAGE_DIM) {
+      *error = fixscript_create_error_string(heap, "invalid image dimensions");
+      return fixscript_int(0);
+   }
+
+   pixels = resample_image(data->pixels, data->width, data->height, data->stride, width, height, fixscript_get_int(params[3]));
+   if (!pixels) {
+      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+   }
+   return image_create_internal(heap, error, width, height, width, pixels, 1, NULL, NULL, NULL, -1);
+}
+
 void fiximage_register_functions(Heap *heap)
 {
    fixscript_register_handle_types(&handles_offset, NUM_HANDLE_TYPES);
+#ifdef FIXIMAGE_AVX2
+   __builtin_cpu_init();
+   simd_avx2_supported = __builtin_cpu_supports("avx2");
+   simd_avx2 = simd_avx2_supported;
+#endif
    
    fixscript_register_native_func(heap, "image_create#2", image_create, NULL);
    fixscript_register_native_func(heap, "image_clone#1", image_clone, NULL);
@@ -5380,15 +7917,28 @@ void fiximage_register_functions(Heap *heap)
    fixscript_register_native_func(heap, "painter_fill_shape#3", painter_fill_shape, NULL);
    fixscript_register_native_func(heap, "painter_fill_shape#4", painter_fill_shape, NULL);
    fixscript_register_native_func(heap, "painter_batch_begin#1", painter_batch_begin, NULL);
+   fixscript_register_native_func(heap, "painter_batch_begin#2", painter_batch_begin, NULL);
    fixscript_register_native_func(heap, "painter_batch_flush#1", painter_batch_flush, NULL);
    fixscript_register_native_func(heap, "painter_batch_end#1", painter_batch_end, NULL);
+   fixscript_register_native_func(heap, "painter_batch_invalidate#1", painter_batch_invalidate, NULL);
+   fixscript_register_native_func(heap, "painter_batch_get_damaged_rects#1", painter_batch_get_damaged_rects, NULL);
+   fixscript_register_native_func(heap, "painter_set_thread_limit#1", painter_set_thread_limit, NULL);
+   fixscript_register_native_func(heap, "painter_get_thread_limit#0", painter_get_thread_limit, NULL);
+   fixscript_register_native_func(heap, "painter_set_simd_level#1", painter_set_simd_level, NULL);
+   fixscript_register_native_func(heap, "painter_get_simd_level#0", painter_get_simd_level, NULL);
+   fixscript_register_native_func(heap, "glyph_atlas_create#0", glyph_atlas_create, NULL);
+   fixscript_register_native_func(heap, "glyph_atlas_add#6", glyph_atlas_add, NULL);
+   fixscript_register_native_func(heap, "glyph_atlas_draw#7", glyph_atlas_draw, NULL);
    fixscript_register_native_func(heap, "shape_hit_test#3", shape_hit_test, NULL);
    fixscript_register_native_func(heap, "shape_offset_subdivide#3", shape_offset_subdivide, NULL);
    fixscript_register_native_func(heap, "shape_reverse#3", shape_reverse, NULL);
    fixscript_register_native_func(heap, "image_to_png#1", image_to_png, NULL);
+   fixscript_register_native_func(heap, "image_to_png#2", image_to_png, NULL);
    fixscript_register_native_func(heap, "image_load#1", image_load, NULL);
    fixscript_register_native_func(heap, "image_blur_box#4", image_blur_box, NULL);
    fixscript_register_native_func(heap, "image_remap_color_ramps#2", image_remap_color_ramps, NULL);
+   fixscript_register_native_func(heap, "image_create_mipmaps#2", image_create_mipmaps, NULL);
+   fixscript_register_native_func(heap, "image_downscale#4", image_downscale, NULL);
 }
 
 
@@ -5404,13 +7954,53 @@ The Canonical Huffman decompression works as follow:
    c) the index to the sorted table is simply incremented by the count of symbols for given code length
 */
 
+// builds lookup table for decoding of codes up to ZFAST_BITS long in a single step,
+// each entry contains the symbol and the code length (zero when not found):
+static void zhuff_build_table(uint16_t *table, const uint8_t *lengths, int num_symbols)
+{
+   int counts[16], next_code[16];
+   int i, j, len, code, rev;
+
+   memset(counts, 0, sizeof(counts));
+   for (i=0; i<num_symbols; i++) {
+      counts[lengths[i]]++;
+   }
+   counts[0] = 0;
+
+   code = 0;
+   for (i=1; i<16; i++) {
+      code = (code + counts[i-1]) << 1;
+      next_code[i] = code;
+   }
+
+   // shorter codes are filled last to take precedence in the case of invalid (oversubscribed) codes:
+   memset(table, 0, sizeof(uint16_t) << ZFAST_BITS);
+   for (len=ZFAST_BITS; len>=1; len--) {
+      code = next_code[len];
+      for (i=0; i<num_symbols; i++) {
+         if (lengths[i] != len) continue;
+         if (code < (1 << len)) {
+            rev = 0;
+            for (j=0; j<len; j++) {
+               rev |= ((code >> j) & 1) << (len-1-j);
+            }
+            for (j=rev; j<(1 << ZFAST_BITS); j += 1 << len) {
+               table[j] = (i << 4) | len;
+            }
+         }
+         code++;
+      }
+   }
+}
+
+
 static int zlib_uncompress(const unsigned char *src, int src_len, unsigned char **dest_out, int *dest_len_out, int init_len, int max_dest_len)
 {
    #define GET_BITS(dest, nb)                                         \
    {                                                                  \
       while (num_bits < nb) {                                         \
          if (src == end) goto error;                                  \
-         bits |= (*src++) << num_bits;                                \
+         bits |= (uint32_t)(*src++) << num_bits;                      \
          num_bits += 8;                                               \
       }                                                               \
       dest = bits & ((1 << (nb))-1);                                  \
@@ -5452,22 +8042,52 @@ static int zlib_uncompress(const unsigned char *src, int src_len, unsigned char
          }                                                            \
          idx += counts[i];                                            \
       }                                                               \
-      if (sym == -1) goto error;                                      \
+      if (sym == -1) goto error;                                      \
+   }
+
+   #define HUFF_DECODE_FAST(sym, table, symbols, counts, max_len)     \
+   {                                                                  \
+      int entry;                                                      \
+      if (num_bits <= 24 && end - src >= 4) {                         \
+         bits |= (src[0] | (src[1] << 8) | (src[2] << 16) | ((uint32_t)src[3] << 24)) << num_bits; \
+         src += (32 - num_bits) >> 3;                                 \
+         num_bits += (32 - num_bits) & ~7;                            \
+      }                                                               \
+      while (num_bits <= 24 && src < end) {                           \
+         bits |= (uint32_t)(*src++) << num_bits;                      \
+         num_bits += 8;                                               \
+      }                                                               \
+      entry = table[bits & ((1 << ZFAST_BITS)-1)];                    \
+      if (entry && (entry & 15) <= num_bits) {                        \
+         sym = entry >> 4;                                            \
+         bits >>= entry & 15;                                         \
+         num_bits -= entry & 15;                                      \
+      }                                                               \
+      else {                                                          \
+         HUFF_DECODE(sym, symbols, counts, max_len);                  \
+      }                                                               \
    }
 
-   #define PUT_BYTE(val)                                              \
+   // the buffer has 8 extra bytes past the capacity for the chunked copying of matches:
+   #define RESERVE(amount)                                            \
    {                                                                  \
-      if (out_len == out_cap) {                                       \
+      if ((amount) > max_dest_len - out_len) goto error;              \
+      while (out_cap - out_len < (amount)) {                          \
          if (out_cap >= (1<<29)) goto error;                          \
          out_cap <<= 1;                                               \
          if (out_cap > max_dest_len) {                                \
             out_cap = max_dest_len;                                   \
-            if (out_len >= out_cap) goto error;                       \
          }                                                            \
-         new_out = realloc(out, out_cap);                             \
+         new_out = realloc(out, out_cap+8);                           \
          if (!new_out) goto error;                                    \
          out = new_out;                                               \
       }                                                               \
+   }
+
+   #define PUT_BYTE(value)                                            \
+   {                                                                  \
+      int val = value;                                                \
+      RESERVE(1);                                                     \
       out[out_len++] = val;                                           \
    }
 
@@ -5492,11 +8112,14 @@ static int zlib_uncompress(const unsigned char *src, int src_len, unsigned char
    uint8_t lengths[320];
    uint16_t lit_symbols[288], lit_counts[16];
    uint8_t dist_symbols[32], dist_counts[16];
+   uint16_t lit_table[1 << ZFAST_BITS];
+   uint16_t dist_table[1 << ZFAST_BITS];
 
+   unsigned char *d, *s;
    int i, sym, dist;
 
    out_cap = init_len;
-   out = malloc(out_cap);
+   out = malloc(out_cap+8);
    if (!out) goto error;
 
    for (;;) {
@@ -5507,6 +8130,7 @@ static int zlib_uncompress(const unsigned char *src, int src_len, unsigned char
       if (type == 0) {
          // no compression:
 
+         src -= num_bits >> 3;
          bits = 0;
          num_bits = 0;
 
@@ -5516,9 +8140,10 @@ static int zlib_uncompress(const unsigned char *src, int src_len, unsigned char
          if (len != ((~nlen) & 0xFFFF)) goto error;
          src += 4;
          if (end - src < len) goto error;
-         for (i=0; i<len; i++) {
-            PUT_BYTE(*src++);
-         }
+         RESERVE(len);
+         memcpy(out + out_len, src, len);
+         out_len += len;
+         src += len;
          if (final) break;
          continue;
       }
@@ -5600,9 +8225,11 @@ static int zlib_uncompress(const unsigned char *src, int src_len, unsigned char
 
       HUFF_BUILD(lengths, 257+hlit, 16, lit_symbols, lit_counts);
       HUFF_BUILD(lengths+(257+hlit), 1+hdist, 16, dist_symbols, dist_counts);
+      zhuff_build_table(lit_table, lengths, 257+hlit);
+      zhuff_build_table(dist_table, lengths+(257+hlit), 1+hdist);
 
       for (;;) {
-         HUFF_DECODE(sym, lit_symbols, lit_counts, 16);
+         HUFF_DECODE_FAST(sym, lit_table, lit_symbols, lit_counts, 16);
          if (sym < 256) {
             PUT_BYTE(sym);
             continue;
@@ -5617,7 +8244,7 @@ static int zlib_uncompress(const unsigned char *src, int src_len, unsigned char
          GET_BITS(len, len_bits[sym-257]);
          len += len_base[sym-257];
 
-         HUFF_DECODE(sym, dist_symbols, dist_counts, 16);
+         HUFF_DECODE_FAST(sym, dist_table, dist_symbols, dist_counts, 16);
          if (sym > 29) goto error;
 
          GET_BITS(dist, dist_bits[sym]);
@@ -5625,10 +8252,23 @@ static int zlib_uncompress(const unsigned char *src, int src_len, unsigned char
 
          if (out_len - dist < 0) goto error;
 
-         for (i=0; i<len; i++) {
-            unsigned char b = out[out_len-dist];
-            PUT_BYTE(b);
+         RESERVE(len);
+         d = out + out_len;
+         s = d - dist;
+         if (dist >= 8) {
+            for (i=0; i<len; i+=8) {
+               memcpy(d+i, s+i, 8);
+            }
          }
+         else if (dist == 1) {
+            memset(d, s[0], len);
+         }
+         else {
+            for (i=0; i<len; i++) {
+               d[i] = s[i];
+            }
+         }
+         out_len += len;
       }
 
       if (final) break;
@@ -5645,11 +8285,29 @@ error:
    #undef GET_BITS
    #undef HUFF_BUILD
    #undef HUFF_DECODE
+   #undef HUFF_DECODE_FAST
+   #undef RESERVE
    #undef PUT_BYTE
 }
 
 
-static int zlib_compress(const unsigned char *src, int src_len, unsigned char **dest_out, int *dest_len_out)
+// number of hash slots, lazy matching, nice length, insert positions inside matches
+// (the default level matches the speed and ratio of the original greedy matching):
+static const uint16_t zcomp_levels[10][4] = {
+   {  0, 0,   0, 0 },
+   {  1, 0,  16, 0 },
+   {  2, 0,  32, 0 },
+   {  4, 0,  64, 0 },
+   {  8, 0, 258, 0 },
+   {  8, 1,  32, 1 },
+   {  8, 1, 128, 1 },
+   { 16, 1,  64, 1 },
+   { 16, 1, 128, 1 },
+   { 16, 1, 258, 1 }
+};
+
+
+static int zlib_compress(const unsigned char *src, int src_len, int level, unsigned char **dest_out, int *dest_len_out)
 {
    #define PUT_BYTE(val)                                              \
    {                                                                  \
@@ -5726,14 +8384,7 @@ static int zlib_compress(const unsigned char *src, int src_len, unsigned char **
 
    #define SELECT_BUCKET(c1, c2, c3)                                  \
    {                                                                  \
-      uint32_t idx = ((c1) << 16) | ((c2) << 8) | (c3);               \
-      idx = (idx+0x7ed55d16) + (idx<<12);                             \
-      idx = (idx^0xc761c23c) ^ (idx>>19);                             \
-      idx = (idx+0x165667b1) + (idx<<5);                              \
-      idx = (idx+0xd3a2646c) ^ (idx<<9);                              \
-      idx = (idx+0xfd7046c5) + (idx<<3);                              \
-      idx = (idx^0xb55a4f09) ^ (idx>>16);                             \
-      bucket = hash + (idx & (num_buckets-1)) * num_slots;            \
+      bucket = hash + ZCOMP_HASH(c1, c2, c3) * num_slots;             \
    }
 
    #define GET_INDEX(i, val)                                          \
@@ -5741,6 +8392,59 @@ static int zlib_compress(const unsigned char *src, int src_len, unsigned char **
       ((i) & ~32767) + (val) - ((val) >= ((i) & 32767)? 32768 : 0)    \
    )
 
+   // finds the best match for given position and inserts the position
+   // into the hash, replacing either an unrelated or the oldest entry:
+   #define FIND_MATCH(pos)                                            \
+   {                                                                  \
+      const unsigned char *s = src + (pos);                           \
+      SELECT_BUCKET(s[0], s[1], s[2]);                                \
+      best_len = 0;                                                   \
+      slot = -1;                                                      \
+      worst_slot = 0;                                                 \
+      worst_dist = 0;                                                 \
+      for (j=0; j<num_slots; j++) {                                   \
+         idx = GET_INDEX(pos, bucket[j]);                             \
+         if (idx >= 0 && idx < (pos) && s[0] == src[idx+0] && s[1] == src[idx+1] && s[2] == src[idx+2]) { \
+            dist = (pos) - idx;                                       \
+            if (best_len < nice_len) {                                \
+               max_len = src_len - (pos);                             \
+               if (max_len > 258) max_len = 258;                      \
+               for (len=3; len+8 <= max_len; len+=8) {                \
+                  memcpy(&w1, s+len, 8);                              \
+                  memcpy(&w2, src+idx+len, 8);                        \
+                  if (w1 != w2) break;                                \
+               }                                                      \
+               while (len < max_len && s[len] == src[idx+len]) {      \
+                  len++;                                              \
+               }                                                      \
+               if (len > best_len || (len == best_len && dist < best_dist)) { \
+                  best_len = len;                                     \
+                  best_dist = dist;                                   \
+               }                                                      \
+            }                                                         \
+            if (dist > worst_dist) {                                  \
+               worst_slot = j;                                        \
+               worst_dist = dist;                                     \
+            }                                                         \
+         }                                                            \
+         else if (slot < 0) {                                         \
+            slot = j;                                                 \
+         }                                                            \
+      }                                                               \
+      if (slot < 0) {                                                 \
+         slot = worst_slot;                                           \
+      }                                                               \
+      bucket[slot] = (pos) & 32767;                                   \
+   }
+
+   // inserts the position into the hash without searching:
+   #define INSERT(pos)                                                \
+   {                                                                  \
+      const unsigned char *s = src + (pos);                           \
+      SELECT_BUCKET(s[0], s[1], s[2]);                                \
+      bucket[(pos) & (num_slots-1)] = (pos) & 32767;                  \
+   }
+
    const uint8_t syms[288] = {
       0x0c, 0x8c, 0x4c, 0xcc, 0x2c, 0xac, 0x6c, 0xec, 0x1c, 0x9c, 0x5c, 0xdc, 0x3c, 0xbc, 0x7c, 0xfc,
       0x02, 0x82, 0x42, 0xc2, 0x22, 0xa2, 0x62, 0xe2, 0x12, 0x92, 0x52, 0xd2, 0x32, 0xb2, 0x72, 0xf2,
@@ -5768,8 +8472,7 @@ static int zlib_compress(const unsigned char *src, int src_len, unsigned char **
    const uint16_t len_base[7] = { 3, 11, 19, 35, 67, 131, 258 };
    const uint16_t dist_base[15] = { 1, 5, 9, 17, 33, 65, 129, 257, 513, 1025, 2049, 4097, 8193, 16385, 32769 };
 
-   int num_buckets = 4096; // 4096*8*2 = 64KB
-   int num_slots = 8;
+   int num_slots, lazy, nice_len, insert_all;
 
    unsigned char *out = NULL, *new_out;
    int out_len=0, out_cap=0;
@@ -5777,61 +8480,71 @@ static int zlib_compress(const unsigned char *src, int src_len, unsigned char **
    uint32_t bits = 0;
    int num_bits = 0;
 
-   int i, j, k, idx, len, dist, best_len, best_dist=0, slot, worst_slot, worst_dist;
+   int i, j, k, idx, len, max_len, dist, best_len, best_dist=0, slot, worst_slot, worst_dist;
+   int match_len, match_dist, next_len=0, next_dist=0, have_next=0, end;
    unsigned short *hash = NULL, *bucket;
+   uint64_t w1, w2;
+
+   if (level < 1 || level > 9) goto error;
+   num_slots = zcomp_levels[level][0];
+   lazy = zcomp_levels[level][1];
+   nice_len = zcomp_levels[level][2];
+   insert_all = zcomp_levels[level][3];
 
    out_cap = 4096;
    out = malloc(out_cap);
    if (!out) goto error;
 
-   hash = calloc(num_buckets * num_slots, sizeof(unsigned short));
+   hash = calloc(ZCOMP_NUM_BUCKETS * num_slots, sizeof(unsigned short));
    if (!hash) goto error;
 
    PUT_BITS(1, 1); // final block
    PUT_BITS(1, 2); // fixed Huffman codes
 
-   for (i=0; i<src_len-2; i++) {
-      SELECT_BUCKET(src[i], src[i+1], src[i+2]);
-      best_len = 0;
-      slot = -1;
-      worst_slot = 0;
-      worst_dist = 0;
-      for (j=0; j<num_slots; j++) {
-         idx = GET_INDEX(i, bucket[j]);
-         if (idx >= 0 && idx+2 < i && src[i+0] == src[idx+0] && src[i+1] == src[idx+1] && src[i+2] == src[idx+2]) {
-            len = 3;
-            for (k=3; k<(src_len-i) && k<258; k++) {
-               if (src[i+k] != src[idx+k]) break;
-               len++;
-            }
-            dist = i - idx;
-            if (len > best_len || (len == best_len && dist < best_dist)) {
-               best_len = len;
-               best_dist = dist;
-            }
-            if (dist > worst_dist) {
-               worst_slot = j;
-               worst_dist = dist;
-            }
-         }
-         else if (slot < 0) {
-            slot = j;
-         }
+   i = 0;
+   while (i < src_len-2) {
+      if (have_next) {
+         best_len = next_len;
+         best_dist = next_dist;
+         have_next = 0;
+      }
+      else {
+         FIND_MATCH(i);
       }
 
-      if (slot < 0) {
-         slot = worst_slot;
+      if (best_len < 3) {
+         PUT_SYM(src[i]);
+         i++;
+         continue;
       }
-      bucket[slot] = i & 32767;
 
-      if (best_len >= 3) {
-         PUT_LEN(best_len);
-         PUT_DIST(best_dist);
-         i += best_len-1;
+      match_len = best_len;
+      match_dist = best_dist;
+      end = i+1;
+
+      // lazy matching: emit a literal instead when the next position has a longer match:
+      if (lazy && match_len < nice_len && i+1 < src_len-2) {
+         FIND_MATCH(i+1);
+         if (best_len > match_len) {
+            PUT_SYM(src[i]);
+            next_len = best_len;
+            next_dist = best_dist;
+            have_next = 1;
+            i++;
+            continue;
+         }
+         end = i+2;
       }
-      else {
-         PUT_SYM(src[i]);
+
+      PUT_LEN(match_len);
+      PUT_DIST(match_dist);
+
+      if (insert_all) {
+         for (k=end, end=i+match_len; k<end && k<src_len-2; k++) {
+            INSERT(k);
+         }
       }
+      i += match_len;
    }
    for (; i<src_len; i++) {
       PUT_SYM(src[i]);
@@ -5860,55 +8573,395 @@ error:
    #undef PUT_DIST
    #undef SELECT_BUCKET
    #undef GET_INDEX
+   #undef FIND_MATCH
+   #undef INSERT
+}
+
+
+static uint32_t crc32_tables[8][256];
+static volatile int crc32_tables_state;
+
+static void init_crc32_tables()
+{
+   uint32_t c;
+   int i, j;
+
+   for (;;) {
+      i = crc32_tables_state;
+      if (i == 2) return;
+      if (i == 0 && __sync_bool_compare_and_swap(&crc32_tables_state, 0, 1)) break;
+      multicore_yield();
+   }
+
+   for (i=0; i<256; i++) {
+      c = i;
+      for (j=0; j<8; j++) {
+         c = (c & 1)? 0xEDB88320 ^ (c >> 1) : c >> 1;
+      }
+      crc32_tables[0][i] = c;
+   }
+
+   // the other tables advance the CRC of given byte by another 1-7 zero bytes:
+   for (i=0; i<256; i++) {
+      c = crc32_tables[0][i];
+      for (j=1; j<8; j++) {
+         c = crc32_tables[0][c & 0xFF] ^ (c >> 8);
+         crc32_tables[j][i] = c;
+      }
+   }
+
+   __sync_add_and_fetch(&crc32_tables_state, 1);
 }
 
 
 static uint32_t calc_crc32(const unsigned char *buf, int len)
 {
-   static uint32_t table[256] = {
-      0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f, 0xe963a535, 0x9e6495a3,
-      0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988, 0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91,
-      0x1db71064, 0x6ab020f2, 0xf3b97148, 0x84be41de, 0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
-      0x136c9856, 0x646ba8c0, 0xfd62f97a, 0x8a65c9ec, 0x14015c4f, 0x63066cd9, 0xfa0f3d63, 0x8d080df5,
-      0x3b6e20c8, 0x4c69105e, 0xd56041e4, 0xa2677172, 0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b,
-      0x35b5a8fa, 0x42b2986c, 0xdbbbc9d6, 0xacbcf940, 0x32d86ce3, 0x45df5c75, 0xdcd60dcf, 0xabd13d59,
-      0x26d930ac, 0x51de003a, 0xc8d75180, 0xbfd06116, 0x21b4f4b5, 0x56b3c423, 0xcfba9599, 0xb8bda50f,
-      0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924, 0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d,
-      0x76dc4190, 0x01db7106, 0x98d220bc, 0xefd5102a, 0x71b18589, 0x06b6b51f, 0x9fbfe4a5, 0xe8b8d433,
-      0x7807c9a2, 0x0f00f934, 0x9609a88e, 0xe10e9818, 0x7f6a0dbb, 0x086d3d2d, 0x91646c97, 0xe6635c01,
-      0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e, 0x6c0695ed, 0x1b01a57b, 0x8208f4c1, 0xf50fc457,
-      0x65b0d9c6, 0x12b7e950, 0x8bbeb8ea, 0xfcb9887c, 0x62dd1ddf, 0x15da2d49, 0x8cd37cf3, 0xfbd44c65,
-      0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2, 0x4adfa541, 0x3dd895d7, 0xa4d1c46d, 0xd3d6f4fb,
-      0x4369e96a, 0x346ed9fc, 0xad678846, 0xda60b8d0, 0x44042d73, 0x33031de5, 0xaa0a4c5f, 0xdd0d7cc9,
-      0x5005713c, 0x270241aa, 0xbe0b1010, 0xc90c2086, 0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
-      0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4, 0x59b33d17, 0x2eb40d81, 0xb7bd5c3b, 0xc0ba6cad,
-      0xedb88320, 0x9abfb3b6, 0x03b6e20c, 0x74b1d29a, 0xead54739, 0x9dd277af, 0x04db2615, 0x73dc1683,
-      0xe3630b12, 0x94643b84, 0x0d6d6a3e, 0x7a6a5aa8, 0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1,
-      0xf00f9344, 0x8708a3d2, 0x1e01f268, 0x6906c2fe, 0xf762575d, 0x806567cb, 0x196c3671, 0x6e6b06e7,
-      0xfed41b76, 0x89d32be0, 0x10da7a5a, 0x67dd4acc, 0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5,
-      0xd6d6a3e8, 0xa1d1937e, 0x38d8c2c4, 0x4fdff252, 0xd1bb67f1, 0xa6bc5767, 0x3fb506dd, 0x48b2364b,
-      0xd80d2bda, 0xaf0a1b4c, 0x36034af6, 0x41047a60, 0xdf60efc3, 0xa867df55, 0x316e8eef, 0x4669be79,
-      0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236, 0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f,
-      0xc5ba3bbe, 0xb2bd0b28, 0x2bb45a92, 0x5cb36a04, 0xc2d7ffa7, 0xb5d0cf31, 0x2cd99e8b, 0x5bdeae1d,
-      0x9b64c2b0, 0xec63f226, 0x756aa39c, 0x026d930a, 0x9c0906a9, 0xeb0e363f, 0x72076785, 0x05005713,
-      0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38, 0x92d28e9b, 0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21,
-      0x86d3d2d4, 0xf1d4e242, 0x68ddb3f8, 0x1fda836e, 0x81be16cd, 0xf6b9265b, 0x6fb077e1, 0x18b74777,
-      0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c, 0x8f659eff, 0xf862ae69, 0x616bffd3, 0x166ccf45,
-      0xa00ae278, 0xd70dd2ee, 0x4e048354, 0x3903b3c2, 0xa7672661, 0xd06016f7, 0x4969474d, 0x3e6e77db,
-      0xaed16a4a, 0xd9d65adc, 0x40df0b66, 0x37d83bf0, 0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
-      0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6, 0xbad03605, 0xcdd70693, 0x54de5729, 0x23d967bf,
-      0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94, 0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
-   };
-   uint32_t crc = 0xFFFFFFFF;
-   int i;
-   
-   for (i=0; i<len; i++) {
-      crc = table[(crc ^ buf[i]) & 0xFF] ^ (crc >> 8);
+   const uint32_t (*t)[256] = crc32_tables;
+   uint32_t crc = 0xFFFFFFFF, lo, hi;
+
+   init_crc32_tables();
+
+   // slicing-by-8:
+   while (len >= 8) {
+      lo = crc ^ (buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24));
+      hi = buf[4] | (buf[5] << 8) | (buf[6] << 16) | ((uint32_t)buf[7] << 24);
+      crc =
+         t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+         t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+      buf += 8;
+      len -= 8;
+   }
+
+   while (len > 0) {
+      crc = t[0][(crc ^ *buf++) & 0xFF] ^ (crc >> 8);
+      len--;
    }
    return crc ^ 0xFFFFFFFF;
 }
 
 
+static uint32_t calc_adler32(const unsigned char *buf, int len)
+{
+   uint32_t s1 = 1, s2 = 0;
+   int n;
+#ifdef __SSE2__
+   __m128i zero = _mm_setzero_si128();
+   __m128i weights_lo = _mm_setr_epi16(16, 15, 14, 13, 12, 11, 10, 9);
+   __m128i weights_hi = _mm_setr_epi16(8, 7, 6, 5, 4, 3, 2, 1);
+   __m128i v, vs1, vs2, vprev;
+   uint32_t sum1, sum2, prev;
+   int i, cnt;
+#endif
+
+   // the sums can't overflow for blocks up to 5552 bytes:
+   while (len > 0) {
+      n = len < 5552? len : 5552;
+      len -= n;
+
+#ifdef __SSE2__
+      // for each 16 bytes the second sum is increased by 16 times the first sum before them
+      // and by the bytes multiplied by their distance from the end:
+      cnt = n >> 4;
+      if (cnt > 0) {
+         vs1 = zero;
+         vs2 = zero;
+         vprev = zero;
+         for (i=0; i<cnt; i++) {
+            v = _mm_loadu_si128((__m128i *)buf);
+            vprev = _mm_add_epi32(vprev, vs1);
+            vs1 = _mm_add_epi32(vs1, _mm_sad_epu8(v, zero));
+            vs2 = _mm_add_epi32(vs2, _mm_madd_epi16(_mm_unpacklo_epi8(v, zero), weights_lo));
+            vs2 = _mm_add_epi32(vs2, _mm_madd_epi16(_mm_unpackhi_epi8(v, zero), weights_hi));
+            buf += 16;
+         }
+         vs2 = _mm_add_epi32(vs2, _mm_shuffle_epi32(vs2, _MM_SHUFFLE(1, 0, 3, 2)));
+         vs2 = _mm_add_epi32(vs2, _mm_shuffle_epi32(vs2, _MM_SHUFFLE(2, 3, 0, 1)));
+         sum1 = _mm_cvtsi128_si32(vs1) + _mm_cvtsi128_si32(_mm_srli_si128(vs1, 8));
+         prev = _mm_cvtsi128_si32(vprev) + _mm_cvtsi128_si32(_mm_srli_si128(vprev, 8));
+         sum2 = _mm_cvtsi128_si32(vs2);
+         s2 += s1 * (cnt << 4) + (prev % 65521) * 16 + sum2;
+         s1 += sum1;
+         n -= cnt << 4;
+      }
+#endif
+
+      while (n >= 8) {
+         s1 += buf[0]; s2 += s1;
+         s1 += buf[1]; s2 += s1;
+         s1 += buf[2]; s2 += s1;
+         s1 += buf[3]; s2 += s1;
+         s1 += buf[4]; s2 += s1;
+         s1 += buf[5]; s2 += s1;
+         s1 += buf[6]; s2 += s1;
+         s1 += buf[7]; s2 += s1;
+         buf += 8;
+         n -= 8;
+      }
+      while (n > 0) {
+         s1 += *buf++;
+         s2 += s1;
+         n--;
+      }
+      s1 %= 65521;
+      s2 %= 65521;
+   }
+   return (s2 << 16) | s1;
+}
+
+
+#ifdef __SSE2__
+static FORCE_INLINE __m128i load_pixel_sse2(const unsigned char *p, int bpp)
+{
+   uint32_t value;
+
+   if (bpp == 3) {
+      return _mm_cvtsi32_si128(p[0] | (p[1] << 8) | (p[2] << 16));
+   }
+   memcpy(&value, p, 4);
+   return _mm_cvtsi32_si128(value);
+}
+
+
+static FORCE_INLINE void store_pixel_sse2(unsigned char *p, __m128i v, int bpp)
+{
+   uint32_t value = _mm_cvtsi128_si32(v);
+
+   if (bpp == 3) {
+      p[0] = value;
+      p[1] = value >> 8;
+      p[2] = value >> 16;
+      return;
+   }
+   memcpy(p, &value, 4);
+}
+
+
+// processes a whole pixel (3 or 4 bytes) at once, the pixels still depend on each other:
+static FORCE_INLINE void unfilter_row_sse2(int type, unsigned char *cur, const unsigned char *prev, int len, int bpp)
+{
+   __m128i zero = _mm_setzero_si128();
+   __m128i one = _mm_set1_epi8(1);
+   __m128i a, b, c, x, avg, pa, pb, pc, smallest, sel_a, sel_b;
+   int i;
+
+   a = zero;
+   c = zero;
+   switch (type) {
+      case 1: // sub
+         for (i=0; i<len; i+=bpp) {
+            a = _mm_add_epi8(a, load_pixel_sse2(cur+i, bpp));
+            store_pixel_sse2(cur+i, a, bpp);
+         }
+         break;
+
+      case 3: // average
+         for (i=0; i<len; i+=bpp) {
+            b = load_pixel_sse2(prev+i, bpp);
+            avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+            a = _mm_add_epi8(avg, load_pixel_sse2(cur+i, bpp));
+            store_pixel_sse2(cur+i, a, bpp);
+         }
+         break;
+
+      case 4: // paeth
+         for (i=0; i<len; i+=bpp) {
+            b = _mm_unpacklo_epi8(load_pixel_sse2(prev+i, bpp), zero);
+            x = _mm_unpacklo_epi8(load_pixel_sse2(cur+i, bpp), zero);
+            pa = _mm_sub_epi16(b, c);
+            pb = _mm_sub_epi16(a, c);
+            pc = _mm_add_epi16(pa, pb);
+            pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+            pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+            pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+            smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+            sel_a = _mm_cmpeq_epi16(pa, smallest);
+            sel_b = _mm_cmpeq_epi16(pb, smallest);
+            x = _mm_add_epi8(x, _mm_or_si128(_mm_and_si128(sel_a, a), _mm_andnot_si128(sel_a, _mm_or_si128(_mm_and_si128(sel_b, b), _mm_andnot_si128(sel_b, c)))));
+            store_pixel_sse2(cur+i, _mm_packus_epi16(x, x), bpp);
+            a = x;
+            c = b;
+         }
+         break;
+   }
+}
+#endif
+
+
+// reverses the filtering of the scanline in place, the previous scanline must be already unfiltered:
+static int unfilter_row(int type, unsigned char *cur, const unsigned char *prev, int len, int bpp)
+{
+   int i, a, b, c, p, pa, pb, pc;
+
+   switch (type) {
+      case 0: // none
+         break;
+
+      case 2: // up
+         i = 0;
+#ifdef __SSE2__
+         for (; i+16<=len; i+=16) {
+            _mm_storeu_si128((__m128i *)(cur+i), _mm_add_epi8(_mm_loadu_si128((__m128i *)(cur+i)), _mm_loadu_si128((__m128i *)(prev+i))));
+         }
+#endif
+         for (; i<len; i++) {
+            cur[i] += prev[i];
+         }
+         break;
+
+      case 1: // sub
+      case 3: // average
+      case 4: // paeth
+#ifdef __SSE2__
+         // the pixel size is passed as a constant to get specialized versions:
+         if (bpp == 3) {
+            unfilter_row_sse2(type, cur, prev, len, 3);
+            break;
+         }
+         if (bpp == 4) {
+            unfilter_row_sse2(type, cur, prev, len, 4);
+            break;
+         }
+#endif
+         if (type == 1) {
+            for (i=bpp; i<len; i++) {
+               cur[i] += cur[i-bpp];
+            }
+         }
+         else if (type == 3) {
+            for (i=0; i<bpp; i++) {
+               cur[i] += prev[i] >> 1;
+            }
+            for (i=bpp; i<len; i++) {
+               cur[i] += (cur[i-bpp] + prev[i]) >> 1;
+            }
+         }
+         else {
+            for (i=0; i<bpp; i++) {
+               cur[i] += prev[i];
+            }
+            for (i=bpp; i<len; i++) {
+               a = cur[i-bpp];
+               b = prev[i];
+               c = prev[i-bpp];
+               p = a + b - c;
+               pa = abs(p - a);
+               pb = abs(p - b);
+               pc = abs(p - c);
+               if (pa <= pb && pa <= pc) {
+                  cur[i] += a;
+               }
+               else if (pb <= pc) {
+                  cur[i] += b;
+               }
+               else {
+                  cur[i] += c;
+               }
+            }
+         }
+         break;
+
+      default:
+         return 0;
+   }
+   return 1;
+}
+
+
+// computes all filters of the scanline and returns the one with the smallest sum of absolute values,
+// the scanlines must be preceded by bpp zero bytes:
+static int filter_row(unsigned char **filter, const unsigned char *cur, const unsigned char *prev, int len, int bpp)
+{
+   int score[5] = { 0, 0, 0, 0, 0 };
+   int i, j, a, b, c, p, pa, pb, pc, best;
+#ifdef __SSE2__
+   __m128i zero = _mm_setzero_si128();
+   __m128i one = _mm_set1_epi8(1);
+   __m128i vscore[5], va, vb, vc, vx, vf[5];
+   __m128i lo, hi, pa_lo, pa_hi, pb_lo, pb_hi, pc_lo, pc_hi, not_a, not_b;
+#endif
+
+   i = 0;
+#ifdef __SSE2__
+   for (j=0; j<5; j++) {
+      vscore[j] = zero;
+   }
+   for (; i+16<=len; i+=16) {
+      vx = _mm_loadu_si128((__m128i *)(cur+i));
+      va = _mm_loadu_si128((__m128i *)(cur+i-bpp));
+      vb = _mm_loadu_si128((__m128i *)(prev+i));
+      vc = _mm_loadu_si128((__m128i *)(prev+i-bpp));
+
+      // paeth: pa = |b-c|, pb = |a-c|, pc = |a+b-2c|
+      lo = _mm_sub_epi16(_mm_unpacklo_epi8(vb, zero), _mm_unpacklo_epi8(vc, zero));
+      hi = _mm_sub_epi16(_mm_unpackhi_epi8(vb, zero), _mm_unpackhi_epi8(vc, zero));
+      pb_lo = _mm_sub_epi16(_mm_unpacklo_epi8(va, zero), _mm_unpacklo_epi8(vc, zero));
+      pb_hi = _mm_sub_epi16(_mm_unpackhi_epi8(va, zero), _mm_unpackhi_epi8(vc, zero));
+      pc_lo = _mm_add_epi16(lo, pb_lo);
+      pc_hi = _mm_add_epi16(hi, pb_hi);
+      pa_lo = _mm_max_epi16(lo, _mm_sub_epi16(zero, lo));
+      pa_hi = _mm_max_epi16(hi, _mm_sub_epi16(zero, hi));
+      pb_lo = _mm_max_epi16(pb_lo, _mm_sub_epi16(zero, pb_lo));
+      pb_hi = _mm_max_epi16(pb_hi, _mm_sub_epi16(zero, pb_hi));
+      pc_lo = _mm_max_epi16(pc_lo, _mm_sub_epi16(zero, pc_lo));
+      pc_hi = _mm_max_epi16(pc_hi, _mm_sub_epi16(zero, pc_hi));
+      not_a = _mm_packs_epi16(
+         _mm_or_si128(_mm_cmpgt_epi16(pa_lo, pb_lo), _mm_cmpgt_epi16(pa_lo, pc_lo)),
+         _mm_or_si128(_mm_cmpgt_epi16(pa_hi, pb_hi), _mm_cmpgt_epi16(pa_hi, pc_hi))
+      );
+      not_b = _mm_packs_epi16(_mm_cmpgt_epi16(pb_lo, pc_lo), _mm_cmpgt_epi16(pb_hi, pc_hi));
+
+      vf[0] = vx;
+      vf[1] = _mm_sub_epi8(vx, va);
+      vf[2] = _mm_sub_epi8(vx, vb);
+      vf[3] = _mm_sub_epi8(vx, _mm_sub_epi8(_mm_avg_epu8(va, vb), _mm_and_si128(_mm_xor_si128(va, vb), one)));
+      vf[4] = _mm_sub_epi8(vx, _mm_or_si128(_mm_andnot_si128(not_a, va), _mm_and_si128(not_a, _mm_or_si128(_mm_andnot_si128(not_b, vb), _mm_and_si128(not_b, vc)))));
+
+      for (j=0; j<5; j++) {
+         _mm_storeu_si128((__m128i *)(filter[j]+i), vf[j]);
+         vscore[j] = _mm_add_epi32(vscore[j], _mm_sad_epu8(_mm_min_epu8(vf[j], _mm_sub_epi8(zero, vf[j])), zero));
+      }
+   }
+   for (j=0; j<5; j++) {
+      score[j] = _mm_cvtsi128_si32(vscore[j]) + _mm_cvtsi128_si32(_mm_srli_si128(vscore[j], 8));
+   }
+#endif
+
+   for (; i<len; i++) {
+      a = cur[i-bpp];
+      b = prev[i];
+      c = prev[i-bpp];
+      filter[0][i] = cur[i];
+      filter[1][i] = cur[i] - a;
+      filter[2][i] = cur[i] - b;
+      filter[3][i] = cur[i] - ((a + b) >> 1);
+      p = a + b - c;
+      pa = abs(p - a);
+      pb = abs(p - b);
+      pc = abs(p - c);
+      if (pa <= pb && pa <= pc) {
+         filter[4][i] = cur[i] - a;
+      }
+      else if (pb <= pc) {
+         filter[4][i] = cur[i] - b;
+      }
+      else {
+         filter[4][i] = cur[i] - c;
+      }
+      for (j=0; j<5; j++) {
+         score[j] += abs((signed char)filter[j][i]);
+      }
+   }
+
+   best = 0;
+   for (j=1; j<5; j++) {
+      if (score[j] < score[best]) {
+         best = j;
+      }
+   }
+   return best;
+}
+
+
 static uint32_t *load_png(const unsigned char *buf, int len, int *width_out, int *height_out)
 {
    #define CHUNK_NAME(c0,c1,c2,c3) ((c0 << 24) | (c1 << 16) | (c2 << 8) | c3)
@@ -5921,10 +8974,10 @@ static uint32_t *load_png(const unsigned char *buf, int len, int *width_out, int
    int palette_len = 0;
    int done = 0, first = 1;
    int i, j;
-   uint32_t s1, s2;
+   uint32_t adler;
    uint32_t *pixels = NULL, *retval = NULL;
    unsigned char *scanlines = NULL, *cur, *prev, *tmp;
-   int a, b, c, pp, pa, pb, pc, r, g;
+   int a, b, r, g;
 
    comp = malloc(len);
    if (!comp) goto error;
@@ -5939,6 +8992,7 @@ static uint32_t *load_png(const unsigned char *buf, int len, int *width_out, int
       chunk_len = (buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
       chunk_type = (buf[4] << 24) | (buf[5] << 16) | (buf[6] << 8) | buf[7];
       if (chunk_len > (1<<30)) goto error;
+      if (chunk_len > len-8) goto error;
       crc = calc_crc32(buf+4, 4+chunk_len);
       buf += 8;
       len -= 8;
@@ -6028,94 +9082,28 @@ static uint32_t *load_png(const unsigned char *buf, int len, int *width_out, int
    if (!zlib_uncompress(comp+2, comp_len-6, &data, &data_len, data_size, data_size)) goto error;
    if (data_len != data_size) goto error;
 
-   s1 = 1;
-   s2 = 0;
-   for (i=0; i<data_len; i++) {
-      s1 += data[i];
-      s2 += s1;
-      if ((i & 4095) == 4095) {
-         s1 %= 65521;
-         s2 %= 65521;
-      }
-   }
-   s1 %= 65521;
-   s2 %= 65521;
-   if (comp[comp_len-4] != (s2 >> 8)) goto error;
-   if (comp[comp_len-3] != (s2 & 0xFF)) goto error;
-   if (comp[comp_len-2] != (s1 >> 8)) goto error;
-   if (comp[comp_len-1] != (s1 & 0xFF)) goto error;
+   adler = calc_adler32(data, data_len);
+   if (comp[comp_len-4] != (adler >> 24)) goto error;
+   if (comp[comp_len-3] != ((adler >> 16) & 0xFF)) goto error;
+   if (comp[comp_len-2] != ((adler >> 8) & 0xFF)) goto error;
+   if (comp[comp_len-1] != (adler & 0xFF)) goto error;
 
    pixels = malloc(width*height*4);
    if (!pixels) goto error;
 
-   scanlines = calloc(1, 2*scanline_bytes+width);
+   // the scanlines are unfiltered in place, the first one uses a zeroed previous scanline:
+   scanlines = calloc(1, scanline_bytes+width);
    if (!scanlines) goto error;
-   cur = scanlines;
-   prev = scanlines + scanline_bytes;
+   prev = scanlines;
 
    p = data;
    for (i=0; i<height; i++) {
-      switch (*p++) {
-         case 0: // none
-            for (j=0; j<scanline_bytes; j++) {
-               cur[j] = *p++;
-            }
-            break;
-
-         case 1: // sub
-            for (j=0; j<bpp; j++) {
-               cur[j] = *p++;
-            }
-            for (j=bpp; j<scanline_bytes; j++) {
-               cur[j] = cur[j-bpp] + *p++;
-            }
-            break;
-
-         case 2: // up
-            for (j=0; j<scanline_bytes; j++) {
-               cur[j] = prev[j] + *p++;
-            }
-            break;
-
-         case 3: // average
-            for (j=0; j<bpp; j++) {
-               cur[j] = (prev[j] >> 1) + *p++;
-            }
-            for (j=bpp; j<scanline_bytes; j++) {
-               cur[j] = ((cur[j-bpp] + prev[j]) >> 1) + *p++;
-            }
-            break;
-
-         case 4: // paeth
-            for (j=0; j<bpp; j++) {
-               cur[j] = prev[j] + *p++;
-            }
-            for (j=bpp; j<scanline_bytes; j++) {
-               a = cur[j-bpp];
-               b = prev[j];
-               c = prev[j-bpp];
-               pp = a + b - c;
-               pa = abs(pp - a);
-               pb = abs(pp - b);
-               pc = abs(pp - c);
-               if (pa <= pb && pa <= pc) {
-                  cur[j] = a + *p++;
-               }
-               else if (pb <= pc) {
-                  cur[j] = b + *p++;
-               }
-               else {
-                  cur[j] = c + *p++;
-               }
-            }
-            break;
-
-         default:
-            goto error;
-      }
+      cur = p+1;
+      if (!unfilter_row(*p, cur, prev, scanline_bytes, bpp)) goto error;
+      p += 1 + scanline_bytes;
 
       if (bit_depth < 8) {
-         tmp = scanlines + 2*scanline_bytes;
+         tmp = scanlines + scanline_bytes;
          for (j=0; j<width; j++) {
             tmp[j] = cur[(j*bit_depth) >> 3];
             tmp[j] >>= (8 - bit_depth) - ((j*bit_depth) & 7);
@@ -6140,10 +9128,7 @@ static uint32_t *load_png(const unsigned char *buf, int len, int *width_out, int
       else if (bit_depth == 8) {
          switch (color_type) {
             case 0: // gray
-               for (j=0; j<width; j++) {
-                  r = cur[j];
-                  pixels[i*width+j] = 0xFF000000 | (r << 16) | (r << 8) | r;
-               }
+               fiximage_gray_to_argb(pixels+i*width, cur, width);
                break;
 
             case 2: // rgb
@@ -6173,16 +9158,7 @@ static uint32_t *load_png(const unsigned char *buf, int len, int *width_out, int
                break;
 
             case 6: // rgba
-               for (j=0; j<width; j++) {
-                  r = cur[j*4+0];
-                  g = cur[j*4+1];
-                  b = cur[j*4+2];
-                  a = cur[j*4+3];
-                  r = div255(r * a);
-                  g = div255(g * a);
-                  b = div255(b * a);
-                  pixels[i*width+j] = (a << 24) | (r << 16) | (g << 8) | b;
-               }
+               fiximage_premultiply_rgba(pixels+i*width, cur, width);
                break;
          }
       }
@@ -6228,9 +9204,7 @@ static uint32_t *load_png(const unsigned char *buf, int len, int *width_out, int
          }
       }
 
-      tmp = prev;
       prev = cur;
-      cur = tmp;
    }
 
    *width_out = width;
@@ -6249,15 +9223,14 @@ error:
 }
 
 
-static int save_png(const uint32_t *pixels, int stride, int width, int height, unsigned char **dest_out, int *dest_len_out)
+static int save_png(const uint32_t *pixels, int stride, int width, int height, int level, unsigned char **dest_out, int *dest_len_out)
 {
    unsigned char *data = NULL, *comp = NULL, *dest = NULL, *p, *s;
-   uint32_t crc;
-   uint32_t s1, s2;
+   uint32_t crc, adler;
    unsigned char *scanlines = NULL, *cur, *prev, *tmp, *filter[5], *sp;
-   int score[5];
-   int samples, color_mask, alpha_mask;
-   int i, j, k, r, g, b, a, c, pp, pa, pb, pc, data_len, comp_len, dest_len, retval=0;
+   uint32_t *row = NULL;
+   int samples, color_mask, alpha_mask, row_len;
+   int i, j, k, r, g, b, a, c, header, data_len, comp_len, dest_len, retval=0;
 
    color_mask = 0;
    alpha_mask = 0xFF;
@@ -6274,13 +9247,17 @@ static int save_png(const uint32_t *pixels, int stride, int width, int height, u
    }
 
    samples = (color_mask? 3 : 1) + (alpha_mask != 0xFF? 1 : 0);
+   row_len = width*samples;
 
-   scanlines = calloc(1, width*samples*(2+5));
+   // the current and previous scanlines are preceded by zero bytes for the filters:
+   scanlines = calloc(1, (samples+row_len)*2 + row_len*5);
    if (!scanlines) goto error;
-   cur = scanlines;
-   prev = scanlines + (width*samples);
+   row = malloc(width*sizeof(uint32_t));
+   if (!row) goto error;
+   cur = scanlines + samples;
+   prev = cur + row_len + samples;
    for (i=0; i<5; i++) {
-      filter[i] = scanlines + (width*samples)*(2+i);
+      filter[i] = scanlines + (samples+row_len)*2 + row_len*i;
    }
 
    data_len = (width*samples+1)*height;
@@ -6289,99 +9266,39 @@ static int save_png(const uint32_t *pixels, int stride, int width, int height, u
 
    p = data;
    for (i=0; i<height; i++) {
-      sp = cur;
-      for (j=0; j<width; j++) {
-         c = pixels[i*stride+j];
-         a = (c >> 24) & 0xFF;
-         r = (c >> 16) & 0xFF;
-         g = (c >>  8) & 0xFF;
-         b = (c >>  0) & 0xFF;
-         if (a != 0) {
-            r = (r*255) / a;
-            g = (g*255) / a;
-            b = (b*255) / a;
-            if (r > 255) r = 255;
-            if (g > 255) g = 255;
-            if (b > 255) b = 255;
-         }
-         *sp++ = r;
-         if (samples >= 3) {
-            *sp++ = g;
-            *sp++ = b;
-         }
-         if ((samples & 1) == 0) {
-            *sp++ = a;
-         }
-      }
-
-      for (j=0; j<samples; j++) {
-         filter[0][j] = cur[j];
-         filter[1][j] = cur[j];
-         filter[2][j] = cur[j] - prev[j];
-         filter[3][j] = cur[j] - (prev[j] >> 1);
-         filter[4][j] = cur[j] - prev[j];
-      }
-      for (j=samples; j<width*samples; j++) {
-         filter[0][j] = cur[j];
-         filter[1][j] = cur[j] - cur[j-samples];
-         filter[2][j] = cur[j] - prev[j];
-         filter[3][j] = cur[j] - ((cur[j-samples] + prev[j]) >> 1);
-         a = cur[j-samples];
-         b = prev[j];
-         c = prev[j-samples];
-         pp = a + b - c;
-         pa = abs(pp - a);
-         pb = abs(pp - b);
-         pc = abs(pp - c);
-         if (pa <= pb && pa <= pc) {
-            filter[4][j] = cur[j] - a;
-         }
-         else if (pb <= pc) {
-            filter[4][j] = cur[j] - b;
-         }
-         else {
-            filter[4][j] = cur[j] - c;
-         }
-      }
-
-      for (j=0; j<5; j++) {
-         score[j] = 0;
-         for (k=0; k<width*samples; k++) {
-            score[j] += abs((signed char)filter[j][k]);
-         }
+      fiximage_unpremultiply(row, pixels+i*stride, width);
+      if (samples == 4) {
+         fiximage_swap_rb(row, row, width);
+         memcpy(cur, row, width*4);
       }
-
-      k = 0;
-      for (j=1; j<5; j++) {
-         if (score[j] < score[k]) {
-            k = j;
+      else {
+         sp = cur;
+         for (j=0; j<width; j++) {
+            c = row[j];
+            *sp++ = (c >> 16) & 0xFF;
+            if (samples == 3) {
+               *sp++ = (c >> 8) & 0xFF;
+               *sp++ = c & 0xFF;
+            }
+            if (samples == 2) {
+               *sp++ = (c >> 24) & 0xFF;
+            }
          }
       }
 
+      k = filter_row(filter, cur, prev, row_len, samples);
       *p++ = k;
-      for (j=0; j<width*samples; j++) {
-         *p++ = filter[k][j];
-      }
+      memcpy(p, filter[k], row_len);
+      p += row_len;
 
       tmp = prev;
       prev = cur;
       cur = tmp;
    }
 
-   s1 = 1;
-   s2 = 0;
-   for (i=0; i<data_len; i++) {
-      s1 += data[i];
-      s2 += s1;
-      if ((i & 4095) == 4095) {
-         s1 %= 65521;
-         s2 %= 65521;
-      }
-   }
-   s1 %= 65521;
-   s2 %= 65521;
+   adler = calc_adler32(data, data_len);
 
-   if (!zlib_compress(data, data_len, &comp, &comp_len)) goto error;
+   if (!zlib_compress(data, data_len, level, &comp, &comp_len)) goto error;
 
    dest_len = 8 + 3*(4+4+4) + 13 + (2+comp_len+4) + 0;
    dest = malloc(dest_len);
@@ -6419,14 +9336,16 @@ static int save_png(const uint32_t *pixels, int stride, int width, int height, u
    *p++ = (2+comp_len+4);
    s = p;
    *p++ = 'I'; *p++ = 'D'; *p++ = 'A'; *p++ = 'T'; // chunk type
-   *p++ = 0x78; // deflate + 32K window
-   *p++ = (1 << 6) | 30; // fcheck + fast
+   header = (0x78 << 8) | ((level < 2? 0 : level < 6? 1 : level < 7? 2 : 3) << 6); // deflate + 32K window + compression level
+   header += 31 - (header % 31); // fcheck
+   *p++ = header >> 8;
+   *p++ = header;
    memcpy(p, comp, comp_len);
    p += comp_len;
-   *p++ = s2 >> 8;
-   *p++ = s2;
-   *p++ = s1 >> 8;
-   *p++ = s1;
+   *p++ = adler >> 24;
+   *p++ = adler >> 16;
+   *p++ = adler >> 8;
+   *p++ = adler;
    crc = calc_crc32(s, p-s);
    *p++ = crc >> 24;
    *p++ = crc >> 16;
@@ -6452,5 +9371,6 @@ error:
    free(comp);
    free(dest);
    free(scanlines);
+   free(row);
    return retval;
 }
@@ -31,6 +31,7 @@ extern "C" {
 
 typedef void (*ImageFreeFunc)(void *data);
 typedef void (*MulticoreFunc)(int from, int to, void *data);
+typedef void (*BackgroundFunc)(void *data);
 
 Value fiximage_create(Heap *heap, int width, int height);
 Value fiximage_create_from_pixels(Heap *heap, int width, int height, int stride, uint32_t *pixels, ImageFreeFunc free_func, void *user_data, int type);
@@ -42,6 +43,15 @@ void fiximage_register_functions(Heap *heap);
 
 int fiximage_get_core_count();
 void fiximage_multicore_run(int from, int to, int min_iters, MulticoreFunc func, void *data);
+void fiximage_set_thread_limit(int limit);
+int fiximage_get_thread_limit();
+int fiximage_run_in_background(BackgroundFunc func, void *data);
+
+// conversions from/to the native premultiplied ARGB format, dest can be the same as src (except for gray):
+void fiximage_premultiply_rgba(uint32_t *dest, const uint8_t *src, int count);
+void fiximage_unpremultiply(uint32_t *dest, const uint32_t *src, int count);
+void fiximage_swap_rb(uint32_t *dest, const uint32_t *src, int count);
+void fiximage_gray_to_argb(uint32_t *dest, const uint8_t *src, int count);
 
 #ifdef __cplusplus
 }
@@ -50,9 +50,11 @@
 #include <sys/socket.h>
 #include <sys/poll.h>
 #include <sys/file.h>
+#include <sys/mman.h>
 #include <netinet/tcp.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <arpa/inet.h>
 #include <unistd.h>
 #endif
 #include <errno.h>
@@ -64,6 +66,7 @@
 #include <signal.h>
 #ifdef __linux__
 #include <sys/epoll.h>
+#include <sys/sendfile.h>
 #else
 #include <sys/poll.h>
 #endif
@@ -118,14 +121,442 @@ enum {
 #define USE_POLL
 #endif
 
+#if defined(USE_EPOLL) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define USE_IO_URING
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+#endif
+
 #if defined(USE_EPOLL)
 
+#if defined(USE_IO_URING)
+
+#define URING_ENTRIES      256
+#define URING_TIMEOUT_DATA 1
+
+typedef struct UringEntry {
+   int fd;
+   void *data;
+   int mode;
+   int armed_mode;
+   int armed;
+   int queued;
+   int buffered;
+   int removed;
+} UringEntry;
+
+typedef struct {
+   int fd;
+   unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+   unsigned int *cq_head, *cq_tail, *cq_mask;
+   struct io_uring_sqe *sqes;
+   struct io_uring_cqe *cqes;
+   void *sq_ptr, *cq_ptr;
+   size_t sq_size, cq_size, sqes_size;
+   unsigned int sq_entries;
+   int to_submit;
+   UringEntry **fd_entries;
+   int fd_entries_cap;
+   UringEntry **dirty;
+   int dirty_cnt, dirty_cap;
+   struct __kernel_timespec timeout;
+   UringEntry *events[32];
+   int event_flags[32];
+   int cur, cnt;
+} Uring;
+
+static volatile int use_io_uring = 0;
+
+
+static void uring_destroy(Uring *uring)
+{
+   int i;
+
+   for (i=0; i<uring->fd_entries_cap; i++) {
+      free(uring->fd_entries[i]);
+   }
+   free(uring->fd_entries);
+   free(uring->dirty);
+   if (uring->sqes) munmap(uring->sqes, uring->sqes_size);
+   if (uring->cq_ptr && uring->cq_ptr != uring->sq_ptr) munmap(uring->cq_ptr, uring->cq_size);
+   if (uring->sq_ptr) munmap(uring->sq_ptr, uring->sq_size);
+   close(uring->fd);
+   free(uring);
+}
+
+
+static Uring *uring_create()
+{
+   Uring *uring;
+   struct io_uring_params params;
+
+   uring = calloc(1, sizeof(Uring));
+   if (!uring) {
+      return NULL;
+   }
+
+   memset(&params, 0, sizeof(params));
+   uring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+   if (uring->fd < 0) {
+      free(uring);
+      return NULL;
+   }
+
+   uring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+   uring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+   if (params.features & IORING_FEAT_SINGLE_MMAP) {
+      if (uring->cq_size > uring->sq_size) {
+         uring->sq_size = uring->cq_size;
+      }
+      uring->cq_size = uring->sq_size;
+   }
+
+   uring->sq_ptr = mmap(NULL, uring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+   if (uring->sq_ptr == MAP_FAILED) {
+      uring->sq_ptr = NULL;
+      uring_destroy(uring);
+      return NULL;
+   }
+
+   if (params.features & IORING_FEAT_SINGLE_MMAP) {
+      uring->cq_ptr = uring->sq_ptr;
+   }
+   else {
+      uring->cq_ptr = mmap(NULL, uring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_CQ_RING);
+      if (uring->cq_ptr == MAP_FAILED) {
+         uring->cq_ptr = NULL;
+         uring_destroy(uring);
+         return NULL;
+      }
+   }
+
+   uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+   uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+   if (uring->sqes == MAP_FAILED) {
+      uring->sqes = NULL;
+      uring_destroy(uring);
+      return NULL;
+   }
+
+   uring->sq_head = (unsigned int *)((char *)uring->sq_ptr + params.sq_off.head);
+   uring->sq_tail = (unsigned int *)((char *)uring->sq_ptr + params.sq_off.tail);
+   uring->sq_mask = (unsigned int *)((char *)uring->sq_ptr + params.sq_off.ring_mask);
+   uring->sq_array = (unsigned int *)((char *)uring->sq_ptr + params.sq_off.array);
+   uring->cq_head = (unsigned int *)((char *)uring->cq_ptr + params.cq_off.head);
+   uring->cq_tail = (unsigned int *)((char *)uring->cq_ptr + params.cq_off.tail);
+   uring->cq_mask = (unsigned int *)((char *)uring->cq_ptr + params.cq_off.ring_mask);
+   uring->cqes = (struct io_uring_cqe *)((char *)uring->cq_ptr + params.cq_off.cqes);
+   uring->sq_entries = params.sq_entries;
+   return uring;
+}
+
+
+static int uring_enter(Uring *uring, int min_complete, int flags)
+{
+   int ret;
+
+   do {
+      ret = syscall(__NR_io_uring_enter, uring->fd, uring->to_submit, min_complete, flags, NULL, 0);
+   }
+   while (ret < 0 && errno == EINTR);
+
+   if (ret >= 0) {
+      uring->to_submit -= ret;
+      if (uring->to_submit < 0) uring->to_submit = 0;
+   }
+   return ret >= 0 || errno == EBUSY || errno == ETIME;
+}
+
+
+static struct io_uring_sqe *uring_get_sqe(Uring *uring)
+{
+   struct io_uring_sqe *sqe;
+   unsigned int tail, idx;
+
+   tail = *uring->sq_tail;
+   if (tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) >= uring->sq_entries) {
+      // submission queue is full, submit what is pending so far:
+      uring_enter(uring, 0, 0);
+      if (tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) >= uring->sq_entries) {
+         return NULL;
+      }
+   }
+
+   idx = tail & *uring->sq_mask;
+   sqe = &uring->sqes[idx];
+   memset(sqe, 0, sizeof(struct io_uring_sqe));
+   uring->sq_array[idx] = idx;
+   __atomic_store_n(uring->sq_tail, tail+1, __ATOMIC_RELEASE);
+   uring->to_submit++;
+   return sqe;
+}
+
+
+static void uring_free_entry_if_unused(UringEntry *entry)
+{
+   if (entry->removed && !entry->armed && !entry->queued && !entry->buffered) {
+      free(entry);
+   }
+}
+
+
+static void uring_mark_dirty(Uring *uring, UringEntry *entry)
+{
+   UringEntry **new_dirty;
+   int new_cap;
+
+   if (entry->queued) return;
+
+   if (uring->dirty_cnt == uring->dirty_cap) {
+      new_cap = uring->dirty_cap? uring->dirty_cap*2 : 16;
+      new_dirty = realloc(uring->dirty, new_cap * sizeof(UringEntry *));
+      if (!new_dirty) return;
+      uring->dirty = new_dirty;
+      uring->dirty_cap = new_cap;
+   }
+   uring->dirty[uring->dirty_cnt++] = entry;
+   entry->queued = 1;
+}
+
+
+static int uring_add_socket(Uring *uring, int fd, void *data, int mode)
+{
+   UringEntry *entry, **new_entries;
+   int new_cap;
+
+   if (fd < 0) return 0;
+
+   if (fd >= uring->fd_entries_cap) {
+      new_cap = uring->fd_entries_cap? uring->fd_entries_cap : 64;
+      while (new_cap <= fd) new_cap *= 2;
+      new_entries = realloc(uring->fd_entries, new_cap * sizeof(UringEntry *));
+      if (!new_entries) return 0;
+      memset(new_entries + uring->fd_entries_cap, 0, (new_cap - uring->fd_entries_cap) * sizeof(UringEntry *));
+      uring->fd_entries = new_entries;
+      uring->fd_entries_cap = new_cap;
+   }
+
+   if (uring->fd_entries[fd]) {
+      return 0;
+   }
+
+   entry = calloc(1, sizeof(UringEntry));
+   if (!entry) return 0;
+   entry->fd = fd;
+   entry->data = data;
+   entry->mode = mode;
+   uring->fd_entries[fd] = entry;
+   if (mode) {
+      uring_mark_dirty(uring, entry);
+   }
+   return 1;
+}
+
+
+static void uring_cancel(Uring *uring, UringEntry *entry)
+{
+   struct io_uring_sqe *sqe;
+
+   sqe = uring_get_sqe(uring);
+   if (!sqe) return;
+   sqe->opcode = IORING_OP_POLL_REMOVE;
+   sqe->fd = -1;
+   sqe->addr = (uintptr_t)entry;
+   sqe->user_data = 0;
+}
+
+
+static int uring_remove_socket(Uring *uring, int fd)
+{
+   UringEntry *entry;
+
+   if (fd < 0 || fd >= uring->fd_entries_cap || !uring->fd_entries[fd]) {
+      return 0;
+   }
+   entry = uring->fd_entries[fd];
+   uring->fd_entries[fd] = NULL;
+   entry->removed = 1;
+   if (entry->armed) {
+      uring_cancel(uring, entry);
+   }
+   uring_free_entry_if_unused(entry);
+   return 1;
+}
+
+
+static int uring_update_socket(Uring *uring, int fd, void *data, int mode)
+{
+   UringEntry *entry;
+
+   if (fd < 0 || fd >= uring->fd_entries_cap || !uring->fd_entries[fd]) {
+      return 0;
+   }
+   entry = uring->fd_entries[fd];
+   entry->data = data;
+   entry->mode = mode;
+   if (entry->armed) {
+      if (entry->armed_mode != mode) {
+         uring_cancel(uring, entry);
+      }
+   }
+   else if (mode) {
+      uring_mark_dirty(uring, entry);
+   }
+   return 1;
+}
+
+
+static void uring_arm(Uring *uring, UringEntry *entry)
+{
+   struct io_uring_sqe *sqe;
+   int events = 0;
+
+   sqe = uring_get_sqe(uring);
+   if (!sqe) return;
+
+   if (entry->mode & ASYNC_READ) events |= POLLIN;
+   if (entry->mode & ASYNC_WRITE) events |= POLLOUT;
+   sqe->opcode = IORING_OP_POLL_ADD;
+   sqe->fd = entry->fd;
+   sqe->poll32_events = events;
+   sqe->user_data = (uintptr_t)entry;
+   entry->armed = 1;
+   entry->armed_mode = entry->mode;
+}
+
+
+static void uring_reap(Uring *uring)
+{
+   struct io_uring_cqe *cqe;
+   UringEntry *entry;
+   unsigned int head, tail;
+   int flags, revents;
+
+   head = *uring->cq_head;
+   tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+   while (head != tail && uring->cnt < sizeof(uring->events)/sizeof(UringEntry *)) {
+      cqe = &uring->cqes[head & *uring->cq_mask];
+      head++;
+
+      if (cqe->user_data == 0 || cqe->user_data == URING_TIMEOUT_DATA) {
+         continue;
+      }
+
+      entry = (UringEntry *)(uintptr_t)cqe->user_data;
+      entry->armed = 0;
+      revents = cqe->res > 0? cqe->res : 0;
+
+      flags = 0;
+      if ((entry->mode & ASYNC_READ) && (revents & (POLLIN | POLLERR | POLLHUP))) flags |= ASYNC_READ;
+      if ((entry->mode & ASYNC_WRITE) && (revents & (POLLOUT | POLLERR | POLLHUP))) flags |= ASYNC_WRITE;
+
+      if (entry->removed) {
+         uring_free_entry_if_unused(entry);
+         continue;
+      }
+
+      if (!entry->data && revents) {
+         // interrupt pipe
+         char c;
+         while (read(entry->fd, &c, 1) == 1);
+      }
+      else if (flags) {
+         uring->events[uring->cnt] = entry;
+         uring->event_flags[uring->cnt] = flags;
+         uring->cnt++;
+         entry->buffered++;
+      }
+
+      if (entry->mode) {
+         uring_mark_dirty(uring, entry);
+      }
+   }
+   __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+
+static void uring_wait(Uring *uring, int timeout)
+{
+   struct io_uring_sqe *sqe;
+   UringEntry *entry;
+   int i;
+
+   if (uring->cur < uring->cnt) return;
+   uring->cur = 0;
+   uring->cnt = 0;
+
+   // process the completions left over from the previous call first:
+   uring_reap(uring);
+   if (uring->cnt > 0) {
+      timeout = 0;
+   }
+
+   for (i=0; i<uring->dirty_cnt; i++) {
+      entry = uring->dirty[i];
+      entry->queued = 0;
+      if (!entry->removed && !entry->armed && entry->mode) {
+         uring_arm(uring, entry);
+      }
+      uring_free_entry_if_unused(entry);
+   }
+   uring->dirty_cnt = 0;
+
+   if (timeout == 0) {
+      uring_enter(uring, 0, 0);
+   }
+   else {
+      if (timeout > 0) {
+         sqe = uring_get_sqe(uring);
+         if (sqe) {
+            uring->timeout.tv_sec = timeout / 1000;
+            uring->timeout.tv_nsec = (timeout % 1000) * 1000000;
+            sqe->opcode = IORING_OP_TIMEOUT;
+            sqe->fd = -1;
+            sqe->addr = (uintptr_t)&uring->timeout;
+            sqe->len = 1;
+            sqe->off = 1;
+            sqe->user_data = URING_TIMEOUT_DATA;
+         }
+      }
+      uring_enter(uring, 1, IORING_ENTER_GETEVENTS);
+   }
+
+   uring_reap(uring);
+}
+
+
+static void *uring_get_event(Uring *uring, int *flags)
+{
+   UringEntry *entry;
+
+   while (uring->cur < uring->cnt) {
+      entry = uring->events[uring->cur];
+      *flags = uring->event_flags[uring->cur];
+      uring->cur++;
+      entry->buffered--;
+      if (entry->removed) {
+         uring_free_entry_if_unused(entry);
+         continue;
+      }
+      return entry->data;
+   }
+   return NULL;
+}
+
+#endif /* USE_IO_URING */
+
+
 typedef struct {
    int epoll_fd;
    int pipe_read_fd;
    int pipe_write_fd;
    struct epoll_event events[32];
    int cur, cnt;
+#ifdef USE_IO_URING
+   Uring *uring;
+#endif
 } Poll;
 
 static Poll *poll_create()
@@ -135,6 +566,32 @@ static Poll *poll_create()
    int fds[2], flags;
 
    poll = calloc(1, sizeof(Poll));
+#ifdef USE_IO_URING
+   if (use_io_uring) {
+      poll->uring = uring_create();
+   }
+   if (poll->uring) {
+      if (pipe(fds) != 0) {
+         uring_destroy(poll->uring);
+         free(poll);
+         return NULL;
+      }
+      poll->epoll_fd = -1;
+      poll->pipe_read_fd = fds[0];
+      poll->pipe_write_fd = fds[1];
+      flags = fcntl(poll->pipe_read_fd, F_GETFL);
+      flags |= O_NONBLOCK;
+      fcntl(poll->pipe_read_fd, F_SETFL, flags);
+      if (!uring_add_socket(poll->uring, poll->pipe_read_fd, NULL, ASYNC_READ)) {
+         close(poll->pipe_read_fd);
+         close(poll->pipe_write_fd);
+         uring_destroy(poll->uring);
+         free(poll);
+         return NULL;
+      }
+      return poll;
+   }
+#endif
    poll->epoll_fd = epoll_create(4);
    if (poll->epoll_fd == -1) {
       free(poll);
@@ -168,13 +625,63 @@ static void poll_destroy(Poll *poll)
 {
    close(poll->pipe_read_fd);
    close(poll->pipe_write_fd);
+#ifdef USE_IO_URING
+   if (poll->uring) {
+      uring_destroy(poll->uring);
+      free(poll);
+      return;
+   }
+#endif
    close(poll->epoll_fd);
    free(poll);
 }
 
+#ifdef USE_IO_URING
+// switches the poll from io_uring to epoll and moves the already added sockets, the submission
+// queue and the dirty list are not safe to change from other threads while another thread waits:
+static int poll_use_epoll(Poll *poll)
+{
+   Uring *uring = poll->uring;
+   UringEntry *entry;
+   struct epoll_event event;
+   int i;
+
+   if (!uring) return 1;
+
+   poll->epoll_fd = epoll_create(4);
+   if (poll->epoll_fd == -1) {
+      return 0;
+   }
+
+   for (i=0; i<uring->fd_entries_cap; i++) {
+      entry = uring->fd_entries[i];
+      if (!entry) continue;
+      event.events = 0;
+      if (entry->mode & ASYNC_READ) event.events |= EPOLLIN;
+      if (entry->mode & ASYNC_WRITE) event.events |= EPOLLOUT;
+      event.data.ptr = entry->data;
+      if (epoll_ctl(poll->epoll_fd, EPOLL_CTL_ADD, entry->fd, &event) != 0) {
+         close(poll->epoll_fd);
+         poll->epoll_fd = -1;
+         return 0;
+      }
+   }
+
+   poll->uring = NULL;
+   uring_destroy(uring);
+   return 1;
+}
+#endif
+
 static int poll_add_socket(Poll *poll, int fd, void *data, int mode)
 {
    struct epoll_event event;
+
+#ifdef USE_IO_URING
+   if (poll->uring) {
+      return uring_add_socket(poll->uring, fd, data, mode);
+   }
+#endif
    
    event.events = 0;
    if (mode & ASYNC_READ) event.events |= EPOLLIN;
@@ -186,6 +693,12 @@ static int poll_add_socket(Poll *poll, int fd, void *data, int mode)
 static int poll_remove_socket(Poll *poll, int fd)
 {
    struct epoll_event event;
+
+#ifdef USE_IO_URING
+   if (poll->uring) {
+      return uring_remove_socket(poll->uring, fd);
+   }
+#endif
    
    return epoll_ctl(poll->epoll_fd, EPOLL_CTL_DEL, fd, &event) == 0;
 }
@@ -193,6 +706,12 @@ static int poll_remove_socket(Poll *poll, int fd)
 static int poll_update_socket(Poll *poll, int fd, void *data, int mode)
 {
    struct epoll_event event;
+
+#ifdef USE_IO_URING
+   if (poll->uring) {
+      return uring_update_socket(poll->uring, fd, data, mode);
+   }
+#endif
    
    event.events = 0;
    if (mode & ASYNC_READ) event.events |= EPOLLIN;
@@ -210,6 +729,13 @@ static void poll_interrupt(Poll *poll)
 
 static void poll_wait(Poll *poll, int timeout)
 {
+#ifdef USE_IO_URING
+   if (poll->uring) {
+      uring_wait(poll->uring, timeout);
+      return;
+   }
+#endif
+
    if (poll->cur < poll->cnt) return;
 
    poll->cur = 0;
@@ -223,6 +749,12 @@ static void *poll_get_event(Poll *poll, int *flags)
 {
    struct epoll_event *event;
    char c;
+
+#ifdef USE_IO_URING
+   if (poll->uring) {
+      return uring_get_event(poll->uring, flags);
+   }
+#endif
    
    for (;;) {
       if (poll->cur >= poll->cnt) return NULL;
@@ -416,7 +948,11 @@ typedef int pid_t;
 #ifdef _WIN32
 #define ETIMEDOUT -1000
 typedef CRITICAL_SECTION pthread_mutex_t;
-typedef HANDLE pthread_cond_t;
+typedef struct {
+   HANDLE event;
+   int waiters;
+   int to_wake;
+} pthread_cond_t;
 #endif
 
 enum {
@@ -446,6 +982,14 @@ enum {
    TYPE_SYMLINK   = 0x80
 };
 
+enum {
+   MAP_ADVICE_NORMAL,
+   MAP_ADVICE_RANDOM,
+   MAP_ADVICE_SEQUENTIAL,
+   MAP_ADVICE_WILLNEED,
+   MAP_ADVICE_DONTNEED
+};
+
 enum {
    SCRIPT_FILE_READ     = 0x01,
    SCRIPT_FILE_WRITE    = 0x02,
@@ -461,7 +1005,14 @@ enum {
 
 enum {
    ASYNC_TCP_CONNECTION,
-   ASYNC_TCP_SERVER
+   ASYNC_TCP_SERVER,
+   ASYNC_FILE_OP
+};
+
+enum {
+   FILE_OP_READ,
+   FILE_OP_WRITE,
+   FILE_OP_SYNC
 };
 
 enum {
@@ -623,20 +1174,25 @@ typedef struct {
    unsigned char *dest, *dest_end;
 } ZCommon;
 
-// note: the source buffer (not the current pointers) must be able to store at least 258 bytes
-#define ZCOMP_NUM_BUCKETS 4096 // 4096*8*2 = 64KB
-#define ZCOMP_NUM_SLOTS   8
+// note: the source buffer (not the current pointers) must be able to store at least 259 bytes
+#define ZCOMP_NUM_BUCKETS   4096 // 4096*16*2 = 128KB
+#define ZCOMP_NUM_SLOTS     16
+#define ZCOMP_DEFAULT_LEVEL 4
+#define ZCOMP_HASH(c1, c2, c3) (((((uint32_t)(c1) << 16) | ((c2) << 8) | (c3)) * 0x9E3779B1U) >> 20)
 typedef struct {
    const unsigned char *src, *src_end;
    unsigned char *dest, *dest_end;
    int src_final, src_flush;
    int flushable;
+   int level;
 
    int state;
    uint32_t bits;
    int num_bits;
    unsigned char extra[7];
    int extra_len;
+   int pending_len, pending_dist;
+   unsigned char pending_char;
 
    unsigned char circular[32768];
    int circular_pos, circular_written;
@@ -644,6 +1200,7 @@ typedef struct {
 } ZCompress;
 
 // note: the source buffer (not the current pointers) must be able to store at least 570 bytes
+#define ZFAST_BITS 10
 typedef struct {
    const unsigned char *src, *src_end;
    unsigned char *dest, *dest_end;
@@ -656,6 +1213,8 @@ typedef struct {
 
    uint16_t lit_symbols[288], lit_counts[16];
    uint8_t dist_symbols[32], dist_counts[16];
+   uint16_t lit_table[1 << ZFAST_BITS];
+   uint16_t dist_table[1 << ZFAST_BITS];
 
    char circular[32768];
    int circular_pos, circular_written;
@@ -730,17 +1289,29 @@ typedef struct AsyncThreadResult {
 #else
    int fd;
 #endif
+   struct AsyncFileOp *file_op;
    struct AsyncThreadResult *next;
 } AsyncThreadResult;
 
 typedef struct AsyncTimer {
    int immediate;
+   int cancelled;
    uint32_t time;
+   uint32_t seq;
+   int id;
+   int heap_idx;
    Value callback;
    Value data;
    struct AsyncTimer *next;
 } AsyncTimer;
 
+#define MAX_TIMERS (1<<20)
+
+// the timer clock and the timer ids of each process start shortly before they wrap around (like
+// the jiffies in Linux) so the wrap-around handling is exercised in every run:
+#define TIMER_CLOCK_START ((uint32_t)-1000)
+#define TIMER_SEQ_START   0x7FFFF000
+
 #ifdef _WIN32
 typedef struct {
    DWORD transferred;
@@ -764,7 +1335,12 @@ typedef struct {
 #endif
    int quit;
    Value quit_value;
-   AsyncTimer *timers;
+   AsyncTimer **timers;
+   int timers_cnt, timers_cap;
+   AsyncTimer **timer_ids;
+   int timer_ids_cnt, timer_ids_cap;
+   uint32_t timer_seq;
+   uint32_t timer_time_offset;
 
    pthread_mutex_t foreign_mutex;
    pthread_cond_t foreign_cond;
@@ -773,6 +1349,24 @@ typedef struct {
    int foreign_processed;
 } AsyncProcess;
 
+typedef struct AsyncFileOp {
+   AsyncProcess *proc;
+   AsyncThreadResult *atr;
+   int type;
+#if defined(_WIN32)
+   HANDLE handle;
+#else
+   int fd;
+#endif
+   int64_t pos;
+   char *buf;
+   int len;
+   int result;
+   int failed;
+   Value array;
+   int off;
+} AsyncFileOp;
+
 typedef struct {
    Value callback;
    Value data;
@@ -787,6 +1381,10 @@ typedef struct {
 typedef struct {
    Value callback;
    Value data;
+   FileHandle *file;
+   int64_t file_off;
+   int file_remaining, file_sent;
+   char *file_buf;
 #if defined(_WIN32)
    char buf[1024];
    WSAOVERLAPPED overlapped;
@@ -868,7 +1466,7 @@ typedef struct {
 
 typedef int (*CompressFunc)(void *st);
 
-#define NUM_HANDLE_TYPES 11
+#define NUM_HANDLE_TYPES 14
 #define HANDLE_TYPE_ZCOMPRESS       (handles_offset+0)
 #define HANDLE_TYPE_ZUNCOMPRESS     (handles_offset+1)
 #define HANDLE_TYPE_GZIP_COMPRESS   (handles_offset+2)
@@ -880,6 +1478,9 @@ typedef int (*CompressFunc)(void *st);
 #define HANDLE_TYPE_PROCESS         (handles_offset+8)
 #define HANDLE_TYPE_SQLITE          (handles_offset+9)
 #define HANDLE_TYPE_SQLITE_STMT     (handles_offset+10)
+#define HANDLE_TYPE_FILE_MAPPING    (handles_offset+11)
+#define HANDLE_TYPE_KV_STORE        (handles_offset+12)
+#define HANDLE_TYPE_READ_BUFFER     (handles_offset+13)
 
 static volatile int handles_offset;
 static volatile int async_process_key;
@@ -887,17 +1488,39 @@ static volatile int global_initialized;
 
 typedef void (*ThreadFunc)(void *data);
 
-typedef struct Thread {
-   pthread_mutex_t mutex;
-   pthread_cond_t cond;
+typedef struct ThreadTask {
    ThreadFunc func;
    void *data;
-   struct Thread *next;
-} Thread;
+   struct ThreadTask *next;
+} ThreadTask;
+
+enum {
+   THREAD_POOL_STATS_threads,
+   THREAD_POOL_STATS_idle_threads,
+   THREAD_POOL_STATS_queue_length,
+   THREAD_POOL_STATS_peak_threads,
+   THREAD_POOL_STATS_peak_queue_length,
+   THREAD_POOL_STATS_completed_tasks,
+   THREAD_POOL_STATS_rejected_tasks,
+   THREAD_POOL_STATS_SIZE
+};
 
 #ifndef __wasm__
 static volatile pthread_mutex_t *threads_mutex;
-static Thread *threads_pool;
+static volatile pthread_cond_t *threads_cond;
+static ThreadTask *threads_queue;
+static ThreadTask *threads_queue_last;
+static int threads_min = 0;
+static int threads_max = 256;
+static int threads_max_queued = 16384;
+static int threads_idle_timeout = 5000;
+static int threads_cnt = 0;
+static int threads_idle_cnt = 0;
+static int threads_queue_len = 0;
+static int threads_peak = 0;
+static int threads_peak_queue_len = 0;
+static uint64_t threads_completed = 0;
+static uint64_t threads_rejected = 0;
 #endif
 
 static volatile pthread_mutex_t *console_mutex;
@@ -966,52 +1589,75 @@ static int pthread_mutex_unlock(pthread_mutex_t *mutex)
    return 0;
 }
 
+// the condition is an auto-reset event, the waiters and broadcasts are counted under the mutex
+// and each thread woken by a broadcast passes the signal further until all waiters are woken:
 static int pthread_cond_init(pthread_cond_t *cond, void *attr)
 {
-   *cond = CreateEvent(NULL, FALSE, FALSE, NULL);
-   if (!(*cond)) {
+   cond->event = CreateEvent(NULL, FALSE, FALSE, NULL);
+   if (!cond->event) {
       return -1;
    }
+   cond->waiters = 0;
+   cond->to_wake = 0;
    return 0;
 }
 
 static int pthread_cond_destroy(pthread_cond_t *cond)
 {
-   CloseHandle(*cond);
-   *cond = NULL;
-   return 0;
-}
-
-static int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex)
-{
-   LeaveCriticalSection(mutex);
-   WaitForSingleObject(*cond, INFINITE);
-   EnterCriticalSection(mutex);
+   CloseHandle(cond->event);
+   cond->event = NULL;
    return 0;
 }
 
 static int pthread_cond_timedwait_relative(pthread_cond_t *cond, pthread_mutex_t *mutex, int64_t timeout)
 {
    int ret = 0;
+   cond->waiters++;
    LeaveCriticalSection(mutex);
-   if (WaitForSingleObject(*cond, timeout/1000000) == WAIT_TIMEOUT) {
+   if (WaitForSingleObject(cond->event, timeout < 0? INFINITE : (DWORD)(timeout/1000000)) == WAIT_TIMEOUT) {
       ret = ETIMEDOUT;
    }
    EnterCriticalSection(mutex);
+   cond->waiters--;
+   if (ret == ETIMEDOUT) {
+      if (cond->to_wake > cond->waiters) {
+         cond->to_wake = cond->waiters;
+      }
+   }
+   else if (cond->to_wake > 0) {
+      if (--cond->to_wake > 0) {
+         SetEvent(cond->event);
+      }
+   }
    return ret;
 }
 
+static int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex)
+{
+   return pthread_cond_timedwait_relative(cond, mutex, -1);
+}
+
 static int pthread_cond_signal(pthread_cond_t *cond)
 {
-   SetEvent(*cond);
+   SetEvent(cond->event);
    return 0;
 }
 
-#elif !defined(__wasm__)
-
-static int pthread_cond_timedwait_relative(pthread_cond_t *cond, pthread_mutex_t *mutex, int64_t timeout)
+// must be called with the mutex locked:
+static int pthread_cond_broadcast(pthread_cond_t *cond)
 {
-   struct timespec ts;
+   if (cond->waiters > 0) {
+      cond->to_wake = cond->waiters;
+      SetEvent(cond->event);
+   }
+   return 0;
+}
+
+#elif !defined(__wasm__)
+
+static int pthread_cond_timedwait_relative(pthread_cond_t *cond, pthread_mutex_t *mutex, int64_t timeout)
+{
+   struct timespec ts;
 #if defined(__APPLE__)
    struct timeval tv;
    gettimeofday(&tv, NULL);
@@ -1020,14 +1666,30 @@ static int pthread_cond_timedwait_relative(pthread_cond_t *cond, pthread_mutex_t
 #else
    clock_gettime(CLOCK_REALTIME, &ts);
 #endif
-   ts.tv_nsec += timeout % 1000000;
-   ts.tv_sec += ts.tv_nsec / 1000000 + timeout / 1000000;
-   ts.tv_nsec %= 1000000;
+   ts.tv_nsec += timeout % 1000000000;
+   ts.tv_sec += ts.tv_nsec / 1000000000 + timeout / 1000000000;
+   ts.tv_nsec %= 1000000000;
    return pthread_cond_timedwait(cond, mutex, &ts);
 }
 #endif
 
 
+// number of hash slots, lazy matching, nice length, insert positions inside matches
+// (the default level matches the speed and ratio of the original greedy matching):
+static const uint16_t zcomp_levels[10][4] = {
+   {  0, 0,   0, 0 },
+   {  1, 0,  16, 0 },
+   {  2, 0,  32, 0 },
+   {  4, 0,  64, 0 },
+   {  8, 0, 258, 0 },
+   {  8, 1,  32, 1 },
+   {  8, 1, 128, 1 },
+   { 16, 1,  64, 1 },
+   { 16, 1, 128, 1 },
+   { 16, 1, 258, 1 }
+};
+
+
 static int zcompress(ZCompress *st)
 {
    #define PUT_BYTE(val)                                              \
@@ -1111,14 +1773,7 @@ static int zcompress(ZCompress *st)
 
    #define SELECT_BUCKET(c1, c2, c3)                                  \
    {                                                                  \
-      uint32_t idx = ((c1) << 16) | ((c2) << 8) | (c3);               \
-      idx = (idx+0x7ed55d16) + (idx<<12);                             \
-      idx = (idx^0xc761c23c) ^ (idx>>19);                             \
-      idx = (idx+0x165667b1) + (idx<<5);                              \
-      idx = (idx+0xd3a2646c) ^ (idx<<9);                              \
-      idx = (idx+0xfd7046c5) + (idx<<3);                              \
-      idx = (idx^0xb55a4f09) ^ (idx>>16);                             \
-      bucket = st->hash + (idx & (num_buckets-1)) * num_slots;        \
+      bucket = st->hash + ZCOMP_HASH(c1, c2, c3) * num_slots;         \
    }
 
    #define GET_DIST(val)                                              \
@@ -1133,6 +1788,66 @@ static int zcompress(ZCompress *st)
       (c3)==st->circular[(st->circular_pos+32768-(dist)+2)&32767]     \
    )
 
+   // finds the best match for the current position and inserts the position
+   // into the hash, replacing either an unrelated or the oldest entry:
+   #define FIND_MATCH()                                               \
+   {                                                                  \
+      SELECT_BUCKET(st->src[0], st->src[1], st->src[2]);              \
+      best_len = 0;                                                   \
+      slot = -1;                                                      \
+      worst_slot = 0;                                                 \
+      worst_dist = 0;                                                 \
+      for (i=0; i<num_slots; i++) {                                   \
+         dist = GET_DIST(bucket[i]);                                  \
+         if (dist <= st->circular_written && dist >= 3 && CIRCULAR_MATCH(dist, st->src[0], st->src[1], st->src[2])) { \
+            if (best_len < nice_len) {                                \
+               len = 3;                                               \
+               for (j=3, k=dist-3; st->src+j < st->src_end && j<258; j++, k--) { \
+                  if (st->src[j] != (k > 0? st->circular[(st->circular_pos+32768-k) & 32767] : st->src[-k])) break; \
+                  len++;                                              \
+               }                                                      \
+               if (len > best_len || (len == best_len && dist < best_dist)) { \
+                  best_len = len;                                     \
+                  best_dist = dist;                                   \
+               }                                                      \
+            }                                                         \
+            if (dist > worst_dist) {                                  \
+               worst_slot = i;                                        \
+               worst_dist = dist;                                     \
+            }                                                         \
+         }                                                            \
+         else if (slot < 0) {                                         \
+            slot = i;                                                 \
+         }                                                            \
+      }                                                               \
+      if (slot < 0) {                                                 \
+         slot = worst_slot;                                           \
+      }                                                               \
+      bucket[slot] = st->circular_pos;                                \
+   }
+
+   // inserts the current position into the hash without searching:
+   #define INSERT()                                                   \
+   {                                                                  \
+      SELECT_BUCKET(st->src[0], st->src[1], st->src[2]);              \
+      bucket[st->circular_pos & (num_slots-1)] = st->circular_pos;    \
+   }
+
+   // outputs the match and moves the source past it, the first skip bytes are already consumed:
+   #define PUT_MATCH(match_len, match_dist, skip)                     \
+   {                                                                  \
+      int total = (match_len) - (skip), remaining = total;            \
+      PUT_LEN(match_len);                                             \
+      PUT_DIST(match_dist);                                           \
+      while (remaining > 0) {                                         \
+         if (insert_all && remaining < total && st->src_end - st->src >= 3) { \
+            INSERT();                                                 \
+         }                                                            \
+         PUT_CIRCULAR(*st->src++);                                    \
+         remaining--;                                                 \
+      }                                                               \
+   }
+
    enum {
       STATE_INIT,
       STATE_MAIN,
@@ -1168,8 +1883,11 @@ static int zcompress(ZCompress *st)
    const uint16_t len_base[7] = { 3, 11, 19, 35, 67, 131, 258 };
    const uint16_t dist_base[15] = { 1, 5, 9, 17, 33, 65, 129, 257, 513, 1025, 2049, 4097, 8193, 16385, 32769 };
 
-   int num_buckets = ZCOMP_NUM_BUCKETS;
-   int num_slots = ZCOMP_NUM_SLOTS;
+   int level = st->level > 0? st->level : ZCOMP_DEFAULT_LEVEL;
+   int num_slots = zcomp_levels[level][0];
+   int lazy = zcomp_levels[level][1];
+   int nice_len = zcomp_levels[level][2];
+   int insert_all = zcomp_levels[level][3];
 
    int i, j, k, dist, len, best_len, best_dist=0, slot, worst_slot, worst_dist;
    unsigned short *bucket;
@@ -1213,10 +1931,15 @@ again:
          if (st->dest == st->dest_end) {
             return COMP_FLUSH;
          }
-         if (!st->src_final && !st->src_flush && st->src_end - st->src < 258) {
+         if (!st->src_final && !st->src_flush && st->src_end - st->src < 259) {
             return COMP_MORE;
          }
          if (st->src_end - st->src < 3) {
+            if (st->pending_len) {
+               PUT_MATCH(st->pending_len, st->pending_dist, 1);
+               st->pending_len = 0;
+               goto again;
+            }
             while (st->src < st->src_end) {
                c = *st->src++;
                PUT_SYM(c);
@@ -1227,45 +1950,31 @@ again:
             goto again;
          }
 
-         SELECT_BUCKET(st->src[0], st->src[1], st->src[2]);
-         best_len = 0;
-         slot = -1;
-         worst_slot = 0;
-         worst_dist = 0;
-         for (i=0; i<num_slots; i++) {
-            dist = GET_DIST(bucket[i]);
-            if (dist <= st->circular_written && dist >= 3 && CIRCULAR_MATCH(dist, st->src[0], st->src[1], st->src[2])) {
-               len = 3;
-               for (j=3, k=dist-3; st->src+j < st->src_end && j<258; j++, k--) {
-                  if (st->src[j] != (k > 0? st->circular[(st->circular_pos+32768-k) & 32767] : st->src[-k])) break;
-                  len++;
-               }
-               if (len > best_len || (len == best_len && dist < best_dist)) {
-                  best_len = len;
-                  best_dist = dist;
-               }
-               if (dist > worst_dist) {
-                  worst_slot = i;
-                  worst_dist = dist;
-               }
+         FIND_MATCH();
+
+         if (st->pending_len) {
+            // lazy matching: the previous position is emitted as a literal when a longer match follows:
+            if (best_len > st->pending_len) {
+               PUT_SYM(st->pending_char);
+               st->pending_len = best_len;
+               st->pending_dist = best_dist;
+               st->pending_char = *st->src;
+               PUT_CIRCULAR(*st->src++);
             }
-            else if (slot < 0) {
-               slot = i;
+            else {
+               PUT_MATCH(st->pending_len, st->pending_dist, 1);
+               st->pending_len = 0;
             }
          }
-
-         if (slot < 0) {
-            slot = worst_slot;
-         }
-         bucket[slot] = st->circular_pos;
-
-         if (best_len >= 3) {
-            PUT_LEN(best_len);
-            PUT_DIST(best_dist);
-
-            while (best_len > 0) {
+         else if (best_len >= 3) {
+            if (lazy && best_len < nice_len) {
+               st->pending_len = best_len;
+               st->pending_dist = best_dist;
+               st->pending_char = *st->src;
                PUT_CIRCULAR(*st->src++);
-               best_len--;
+            }
+            else {
+               PUT_MATCH(best_len, best_dist, 0);
             }
          }
          else {
@@ -1329,10 +2038,13 @@ error:
    #undef SELECT_BUCKET
    #undef GET_DIST
    #undef CIRCULAR_MATCH
+   #undef FIND_MATCH
+   #undef INSERT
+   #undef PUT_MATCH
 }
 
 
-static int zcompress_memory(const unsigned char *src, int src_len, unsigned char **dest_out, int *dest_len_out)
+static int zcompress_memory(const unsigned char *src, int src_len, int level, unsigned char **dest_out, int *dest_len_out)
 {
    #define PUT_BYTE(val)                                              \
    {                                                                  \
@@ -1409,14 +2121,7 @@ static int zcompress_memory(const unsigned char *src, int src_len, unsigned char
 
    #define SELECT_BUCKET(c1, c2, c3)                                  \
    {                                                                  \
-      uint32_t idx = ((c1) << 16) | ((c2) << 8) | (c3);               \
-      idx = (idx+0x7ed55d16) + (idx<<12);                             \
-      idx = (idx^0xc761c23c) ^ (idx>>19);                             \
-      idx = (idx+0x165667b1) + (idx<<5);                              \
-      idx = (idx+0xd3a2646c) ^ (idx<<9);                              \
-      idx = (idx+0xfd7046c5) + (idx<<3);                              \
-      idx = (idx^0xb55a4f09) ^ (idx>>16);                             \
-      bucket = hash + (idx & (num_buckets-1)) * num_slots;            \
+      bucket = hash + ZCOMP_HASH(c1, c2, c3) * num_slots;             \
    }
 
    #define GET_INDEX(i, val)                                          \
@@ -1424,6 +2129,59 @@ static int zcompress_memory(const unsigned char *src, int src_len, unsigned char
       ((i) & ~32767) + (val) - ((val) >= ((i) & 32767)? 32768 : 0)    \
    )
 
+   // finds the best match for given position and inserts the position
+   // into the hash, replacing either an unrelated or the oldest entry:
+   #define FIND_MATCH(pos)                                            \
+   {                                                                  \
+      const unsigned char *s = src + (pos);                           \
+      SELECT_BUCKET(s[0], s[1], s[2]);                                \
+      best_len = 0;                                                   \
+      slot = -1;                                                      \
+      worst_slot = 0;                                                 \
+      worst_dist = 0;                                                 \
+      for (j=0; j<num_slots; j++) {                                   \
+         idx = GET_INDEX(pos, bucket[j]);                             \
+         if (idx >= 0 && idx < (pos) && s[0] == src[idx+0] && s[1] == src[idx+1] && s[2] == src[idx+2]) { \
+            dist = (pos) - idx;                                       \
+            if (best_len < nice_len) {                                \
+               max_len = src_len - (pos);                             \
+               if (max_len > 258) max_len = 258;                      \
+               for (len=3; len+8 <= max_len; len+=8) {                \
+                  memcpy(&w1, s+len, 8);                              \
+                  memcpy(&w2, src+idx+len, 8);                        \
+                  if (w1 != w2) break;                                \
+               }                                                      \
+               while (len < max_len && s[len] == src[idx+len]) {      \
+                  len++;                                              \
+               }                                                      \
+               if (len > best_len || (len == best_len && dist < best_dist)) { \
+                  best_len = len;                                     \
+                  best_dist = dist;                                   \
+               }                                                      \
+            }                                                         \
+            if (dist > worst_dist) {                                  \
+               worst_slot = j;                                        \
+               worst_dist = dist;                                     \
+            }                                                         \
+         }                                                            \
+         else if (slot < 0) {                                         \
+            slot = j;                                                 \
+         }                                                            \
+      }                                                               \
+      if (slot < 0) {                                                 \
+         slot = worst_slot;                                           \
+      }                                                               \
+      bucket[slot] = (pos) & 32767;                                   \
+   }
+
+   // inserts the position into the hash without searching:
+   #define INSERT(pos)                                                \
+   {                                                                  \
+      const unsigned char *s = src + (pos);                           \
+      SELECT_BUCKET(s[0], s[1], s[2]);                                \
+      bucket[(pos) & (num_slots-1)] = (pos) & 32767;                  \
+   }
+
    const uint8_t syms[288] = {
       0x0c, 0x8c, 0x4c, 0xcc, 0x2c, 0xac, 0x6c, 0xec, 0x1c, 0x9c, 0x5c, 0xdc, 0x3c, 0xbc, 0x7c, 0xfc,
       0x02, 0x82, 0x42, 0xc2, 0x22, 0xa2, 0x62, 0xe2, 0x12, 0x92, 0x52, 0xd2, 0x32, 0xb2, 0x72, 0xf2,
@@ -1451,8 +2209,7 @@ static int zcompress_memory(const unsigned char *src, int src_len, unsigned char
    const uint16_t len_base[7] = { 3, 11, 19, 35, 67, 131, 258 };
    const uint16_t dist_base[15] = { 1, 5, 9, 17, 33, 65, 129, 257, 513, 1025, 2049, 4097, 8193, 16385, 32769 };
 
-   int num_buckets = 4096; // 4096*8*2 = 64KB
-   int num_slots = 8;
+   int num_slots, lazy, nice_len, insert_all;
 
    unsigned char *out = NULL, *new_out;
    int out_len=0, out_cap=0;
@@ -1460,61 +2217,71 @@ static int zcompress_memory(const unsigned char *src, int src_len, unsigned char
    uint32_t bits = 0;
    int num_bits = 0;
 
-   int i, j, k, idx, len, dist, best_len, best_dist=0, slot, worst_slot, worst_dist;
+   int i, j, k, idx, len, max_len, dist, best_len, best_dist=0, slot, worst_slot, worst_dist;
+   int match_len, match_dist, next_len=0, next_dist=0, have_next=0, end;
    unsigned short *hash = NULL, *bucket;
+   uint64_t w1, w2;
+
+   if (level < 1 || level > 9) goto error;
+   num_slots = zcomp_levels[level][0];
+   lazy = zcomp_levels[level][1];
+   nice_len = zcomp_levels[level][2];
+   insert_all = zcomp_levels[level][3];
 
    out_cap = 4096;
    out = malloc(out_cap);
    if (!out) goto error;
 
-   hash = calloc(num_buckets * num_slots, sizeof(unsigned short));
+   hash = calloc(ZCOMP_NUM_BUCKETS * num_slots, sizeof(unsigned short));
    if (!hash) goto error;
 
    PUT_BITS(1, 1); // final block
    PUT_BITS(1, 2); // fixed Huffman codes
 
-   for (i=0; i<src_len-2; i++) {
-      SELECT_BUCKET(src[i], src[i+1], src[i+2]);
-      best_len = 0;
-      slot = -1;
-      worst_slot = 0;
-      worst_dist = 0;
-      for (j=0; j<num_slots; j++) {
-         idx = GET_INDEX(i, bucket[j]);
-         if (idx >= 0 && idx+2 < i && src[i+0] == src[idx+0] && src[i+1] == src[idx+1] && src[i+2] == src[idx+2]) {
-            len = 3;
-            for (k=3; k<(src_len-i) && k<258; k++) {
-               if (src[i+k] != src[idx+k]) break;
-               len++;
-            }
-            dist = i - idx;
-            if (len > best_len || (len == best_len && dist < best_dist)) {
-               best_len = len;
-               best_dist = dist;
-            }
-            if (dist > worst_dist) {
-               worst_slot = j;
-               worst_dist = dist;
-            }
-         }
-         else if (slot < 0) {
-            slot = j;
-         }
+   i = 0;
+   while (i < src_len-2) {
+      if (have_next) {
+         best_len = next_len;
+         best_dist = next_dist;
+         have_next = 0;
+      }
+      else {
+         FIND_MATCH(i);
       }
 
-      if (slot < 0) {
-         slot = worst_slot;
+      if (best_len < 3) {
+         PUT_SYM(src[i]);
+         i++;
+         continue;
       }
-      bucket[slot] = i & 32767;
 
-      if (best_len >= 3) {
-         PUT_LEN(best_len);
-         PUT_DIST(best_dist);
-         i += best_len-1;
+      match_len = best_len;
+      match_dist = best_dist;
+      end = i+1;
+
+      // lazy matching: emit a literal instead when the next position has a longer match:
+      if (lazy && match_len < nice_len && i+1 < src_len-2) {
+         FIND_MATCH(i+1);
+         if (best_len > match_len) {
+            PUT_SYM(src[i]);
+            next_len = best_len;
+            next_dist = best_dist;
+            have_next = 1;
+            i++;
+            continue;
+         }
+         end = i+2;
       }
-      else {
-         PUT_SYM(src[i]);
+
+      PUT_LEN(match_len);
+      PUT_DIST(match_dist);
+
+      if (insert_all) {
+         for (k=end, end=i+match_len; k<end && k<src_len-2; k++) {
+            INSERT(k);
+         }
       }
+      i += match_len;
    }
    for (; i<src_len; i++) {
       PUT_SYM(src[i]);
@@ -1543,6 +2310,8 @@ error:
    #undef PUT_DIST
    #undef SELECT_BUCKET
    #undef GET_INDEX
+   #undef FIND_MATCH
+   #undef INSERT
 }
 
 
@@ -1558,13 +2327,53 @@ The Canonical Huffman decompression works as follow:
    c) the index to the sorted table is simply incremented by the count of symbols for given code length
 */
 
-static int zuncompress(ZUncompress *st)
+// builds lookup table for decoding of codes up to ZFAST_BITS long in a single step,
+// each entry contains the symbol and the code length (zero when not found):
+static void zhuff_build_table(uint16_t *table, const uint8_t *lengths, int num_symbols)
+{
+   int counts[16], next_code[16];
+   int i, j, len, code, rev;
+
+   memset(counts, 0, sizeof(counts));
+   for (i=0; i<num_symbols; i++) {
+      counts[lengths[i]]++;
+   }
+   counts[0] = 0;
+
+   code = 0;
+   for (i=1; i<16; i++) {
+      code = (code + counts[i-1]) << 1;
+      next_code[i] = code;
+   }
+
+   // shorter codes are filled last to take precedence in the case of invalid (oversubscribed) codes:
+   memset(table, 0, sizeof(uint16_t) << ZFAST_BITS);
+   for (len=ZFAST_BITS; len>=1; len--) {
+      code = next_code[len];
+      for (i=0; i<num_symbols; i++) {
+         if (lengths[i] != len) continue;
+         if (code < (1 << len)) {
+            rev = 0;
+            for (j=0; j<len; j++) {
+               rev |= ((code >> j) & 1) << (len-1-j);
+            }
+            for (j=rev; j<(1 << ZFAST_BITS); j += 1 << len) {
+               table[j] = (i << 4) | len;
+            }
+         }
+         code++;
+      }
+   }
+}
+
+
+static int zuncompress_inner(ZUncompress *st)
 {
    #define GET_BITS(dest, nb)                                         \
    {                                                                  \
       while (st->num_bits < nb) {                                     \
          if (st->src == st->src_end) goto retry;                      \
-         st->bits |= (*st->src++) << st->num_bits;                    \
+         st->bits |= (uint32_t)(*st->src++) << st->num_bits;          \
          st->num_bits += 8;                                           \
       }                                                               \
       dest = st->bits & ((1 << (nb))-1);                              \
@@ -1609,6 +2418,24 @@ static int zuncompress(ZUncompress *st)
       if (sym == -1) goto error;                                      \
    }
 
+   #define HUFF_DECODE_FAST(sym, table, symbols, counts, max_len)     \
+   {                                                                  \
+      int entry;                                                      \
+      while (st->num_bits <= 24 && st->src < st->src_end) {           \
+         st->bits |= (uint32_t)(*st->src++) << st->num_bits;          \
+         st->num_bits += 8;                                           \
+      }                                                               \
+      entry = table[st->bits & ((1 << ZFAST_BITS)-1)];                \
+      if (entry && (entry & 15) <= st->num_bits) {                    \
+         sym = entry >> 4;                                            \
+         st->bits >>= entry & 15;                                     \
+         st->num_bits -= entry & 15;                                  \
+      }                                                               \
+      else {                                                          \
+         HUFF_DECODE(sym, symbols, counts, max_len);                  \
+      }                                                               \
+   }
+
    #define PUT_BYTE(val)                                              \
    {                                                                  \
       int value = val;                                                \
@@ -1618,6 +2445,25 @@ static int zuncompress(ZUncompress *st)
       if (st->circular_written < 32768) st->circular_written++;       \
    }
 
+   #define PUT_BYTES(ptr, count)                                      \
+   {                                                                  \
+      const char *p = (const char *)(ptr);                            \
+      int cnt = count, n;                                             \
+      memcpy(st->dest, p, cnt);                                       \
+      p = (const char *)st->dest;                                     \
+      st->dest += cnt;                                                \
+      while (cnt > 0) {                                               \
+         n = 32768 - st->circular_pos;                                \
+         if (n > cnt) n = cnt;                                        \
+         memcpy(st->circular + st->circular_pos, p, n);               \
+         st->circular_pos = (st->circular_pos + n) & 32767;           \
+         st->circular_written += n;                                   \
+         if (st->circular_written > 32768) st->circular_written = 32768; \
+         p += n;                                                      \
+         cnt -= n;                                                    \
+      }                                                               \
+   }
+
    enum {
       STATE_READ_HEADER,
       STATE_UNCOMPRESSED,
@@ -1639,7 +2485,7 @@ static int zuncompress(ZUncompress *st)
    uint8_t prelengths[19], precounts[8], presymbols[19];
    uint8_t lengths[320];
 
-   int i, sym;
+   int i, sym, n;
 
    const unsigned char *start_src;
    uint32_t start_bits;
@@ -1675,6 +2521,7 @@ again:
          if (type == 0) {
             // no compression:
 
+            st->src -= st->num_bits >> 3;
             st->bits = 0;
             st->num_bits = 0;
 
@@ -1766,11 +2613,18 @@ again:
 
          HUFF_BUILD(lengths, 257+hlit, 16, st->lit_symbols, st->lit_counts);
          HUFF_BUILD(lengths+(257+hlit), 1+hdist, 16, st->dist_symbols, st->dist_counts);
+         zhuff_build_table(st->lit_table, lengths, 257+hlit);
+         zhuff_build_table(st->dist_table, lengths+(257+hlit), 1+hdist);
 
          st->state = STATE_COMPRESSED;
          goto again;
 
       case STATE_UNCOMPRESSED:
+         if (st->remaining == 0) {
+            // empty stored blocks (eg. from sync flushes) don't need any input:
+            st->state = STATE_READ_HEADER;
+            goto again;
+         }
          if (st->src == st->src_end) {
             return COMP_MORE;
          }
@@ -1783,9 +2637,12 @@ again:
             len = st->dest_end - st->dest;
          }
 
-         for (i=0; i<len; i++) {
-            PUT_BYTE(*st->src++);
+         if (len > st->src_end - st->src) {
+            len = st->src_end - st->src;
          }
+
+         PUT_BYTES(st->src, len);
+         st->src += len;
          st->remaining -= len;
          
          if (st->remaining == 0) {
@@ -1798,7 +2655,7 @@ again:
             return COMP_FLUSH;
          }
 
-         HUFF_DECODE(sym, st->lit_symbols, st->lit_counts, 16);
+         HUFF_DECODE_FAST(sym, st->lit_table, st->lit_symbols, st->lit_counts, 16);
          if (sym < 256) {
             PUT_BYTE(sym);
             goto again;
@@ -1814,7 +2671,7 @@ again:
          GET_BITS(len, len_bits[sym-257]);
          len += len_base[sym-257];
 
-         HUFF_DECODE(sym, st->dist_symbols, st->dist_counts, 16);
+         HUFF_DECODE_FAST(sym, st->dist_table, st->dist_symbols, st->dist_counts, 16);
          if (sym > 29) goto error;
 
          GET_BITS(st->dist, dist_bits[sym]);
@@ -1836,10 +2693,16 @@ again:
             len = st->dest_end - st->dest;
          }
 
-         for (i=0; i<len; i++) {
-            PUT_BYTE(st->circular[(st->circular_pos + 32768 - st->dist) & 32767]);
-         }
+         // copy in chunks that don't overlap the written data and don't wrap around:
          st->remaining -= len;
+         while (len > 0) {
+            pos = (st->circular_pos + 32768 - st->dist) & 32767;
+            n = len;
+            if (n > st->dist) n = st->dist;
+            if (n > 32768 - pos) n = 32768 - pos;
+            PUT_BYTES(st->circular + pos, n);
+            len -= n;
+         }
 
          if (st->remaining == 0) {
             st->state = STATE_COMPRESSED;
@@ -1863,7 +2726,23 @@ retry:
    #undef GET_BITS
    #undef HUFF_BUILD
    #undef HUFF_DECODE
+   #undef HUFF_DECODE_FAST
    #undef PUT_BYTE
+   #undef PUT_BYTES
+}
+
+
+static int zuncompress(ZUncompress *st)
+{
+   int ret;
+
+   ret = zuncompress_inner(st);
+
+   // return the whole bytes that were read ahead back to the source:
+   st->src -= st->num_bits >> 3;
+   st->num_bits &= 7;
+   st->bits &= (1 << st->num_bits) - 1;
+   return ret;
 }
 
 
@@ -1873,7 +2752,7 @@ static int zuncompress_memory(const unsigned char *src, int src_len, unsigned ch
    {                                                                  \
       while (num_bits < nb) {                                         \
          if (src == end) goto error;                                  \
-         bits |= (*src++) << num_bits;                                \
+         bits |= (uint32_t)(*src++) << num_bits;                      \
          num_bits += 8;                                               \
       }                                                               \
       dest = bits & ((1 << (nb))-1);                                  \
@@ -1918,16 +2797,39 @@ static int zuncompress_memory(const unsigned char *src, int src_len, unsigned ch
       if (sym == -1) goto error;                                      \
    }
 
-   #define PUT_BYTE(value)                                            \
+   #define HUFF_DECODE_FAST(sym, table, symbols, counts, max_len)     \
    {                                                                  \
-      int val = value;                                                \
-      if (out_len == out_cap) {                                       \
+      int entry;                                                      \
+      while (num_bits <= 24 && src < end) {                           \
+         bits |= (uint32_t)(*src++) << num_bits;                      \
+         num_bits += 8;                                               \
+      }                                                               \
+      entry = table[bits & ((1 << ZFAST_BITS)-1)];                    \
+      if (entry && (entry & 15) <= num_bits) {                        \
+         sym = entry >> 4;                                            \
+         bits >>= entry & 15;                                         \
+         num_bits -= entry & 15;                                      \
+      }                                                               \
+      else {                                                          \
+         HUFF_DECODE(sym, symbols, counts, max_len);                  \
+      }                                                               \
+   }
+
+   #define RESERVE(amount)                                            \
+   {                                                                  \
+      while (out_cap - out_len < (amount)) {                          \
          if (out_cap >= (1<<29)) goto error;                          \
          out_cap <<= 1;                                               \
          new_out = realloc(out, out_cap);                             \
          if (!new_out) goto error;                                    \
          out = new_out;                                               \
       }                                                               \
+   }
+
+   #define PUT_BYTE(value)                                            \
+   {                                                                  \
+      int val = value;                                                \
+      RESERVE(1);                                                     \
       out[out_len++] = val;                                           \
    }
 
@@ -1952,7 +2854,10 @@ static int zuncompress_memory(const unsigned char *src, int src_len, unsigned ch
    uint8_t lengths[320];
    uint16_t lit_symbols[288], lit_counts[16];
    uint8_t dist_symbols[32], dist_counts[16];
+   uint16_t lit_table[1 << ZFAST_BITS];
+   uint16_t dist_table[1 << ZFAST_BITS];
 
+   unsigned char *d, *s;
    int i, sym, dist;
 
    out_cap = 4096;
@@ -1967,6 +2872,7 @@ static int zuncompress_memory(const unsigned char *src, int src_len, unsigned ch
       if (type == 0) {
          // no compression:
 
+         src -= num_bits >> 3;
          bits = 0;
          num_bits = 0;
 
@@ -1976,9 +2882,10 @@ static int zuncompress_memory(const unsigned char *src, int src_len, unsigned ch
          if (len != ((~nlen) & 0xFFFF)) goto error;
          src += 4;
          if (end - src < len) goto error;
-         for (i=0; i<len; i++) {
-            PUT_BYTE(*src++);
-         }
+         RESERVE(len);
+         memcpy(out + out_len, src, len);
+         out_len += len;
+         src += len;
          if (final) break;
          continue;
       }
@@ -2060,9 +2967,11 @@ static int zuncompress_memory(const unsigned char *src, int src_len, unsigned ch
 
       HUFF_BUILD(lengths, 257+hlit, 16, lit_symbols, lit_counts);
       HUFF_BUILD(lengths+(257+hlit), 1+hdist, 16, dist_symbols, dist_counts);
+      zhuff_build_table(lit_table, lengths, 257+hlit);
+      zhuff_build_table(dist_table, lengths+(257+hlit), 1+hdist);
 
       for (;;) {
-         HUFF_DECODE(sym, lit_symbols, lit_counts, 16);
+         HUFF_DECODE_FAST(sym, lit_table, lit_symbols, lit_counts, 16);
          if (sym < 256) {
             PUT_BYTE(sym);
             continue;
@@ -2077,7 +2986,7 @@ static int zuncompress_memory(const unsigned char *src, int src_len, unsigned ch
          GET_BITS(len, len_bits[sym-257]);
          len += len_base[sym-257];
 
-         HUFF_DECODE(sym, dist_symbols, dist_counts, 16);
+         HUFF_DECODE_FAST(sym, dist_table, dist_symbols, dist_counts, 16);
          if (sym > 29) goto error;
 
          GET_BITS(dist, dist_bits[sym]);
@@ -2085,9 +2994,24 @@ static int zuncompress_memory(const unsigned char *src, int src_len, unsigned ch
 
          if (out_len - dist < 0) goto error;
 
-         for (i=0; i<len; i++) {
-            PUT_BYTE(out[out_len-dist]);
+         // the copy can write up to 8 bytes past the length:
+         RESERVE(len+8);
+         d = out + out_len;
+         s = d - dist;
+         if (dist >= 8) {
+            for (i=0; i<len; i+=8) {
+               memcpy(d+i, s+i, 8);
+            }
+         }
+         else if (dist == 1) {
+            memset(d, s[0], len);
          }
+         else {
+            for (i=0; i<len; i++) {
+               d[i] = s[i];
+            }
+         }
+         out_len += len;
       }
 
       if (final) break;
@@ -2104,6 +3028,8 @@ error:
    #undef GET_BITS
    #undef HUFF_BUILD
    #undef HUFF_DECODE
+   #undef HUFF_DECODE_FAST
+   #undef RESERVE
    #undef PUT_BYTE
 }
 
@@ -2249,13 +3175,13 @@ again:
 }
 
 
-static int gzip_compress_memory(const unsigned char *src, int src_len, unsigned char **dest_out, int *dest_len_out)
+static int gzip_compress_memory(const unsigned char *src, int src_len, int level, unsigned char **dest_out, int *dest_len_out)
 {
    unsigned char *dest = NULL, *comp = NULL, *p;
    uint32_t crc;
    int dest_len, comp_len, retval=0;
 
-   if (!zcompress_memory(src, src_len, &comp, &comp_len)) goto error;
+   if (!zcompress_memory(src, src_len, level, &comp, &comp_len)) goto error;
 
    dest_len = 10 + comp_len + 8;
    dest = malloc(dest_len);
@@ -2552,10 +3478,18 @@ static Value native_zcompress_memory(Heap *heap, Value *error, int num_params, V
 {
    int flags = (intptr_t)data;
    Value ret;
-   int err, ok, off, len, out_len;
+   int err, ok, off, len, out_len, level = ZCOMP_DEFAULT_LEVEL;
    unsigned char *in, *out;
 
-   if (num_params == 3) {
+   if ((flags & ZC_COMPRESS) && (num_params == 2 || num_params == 4)) {
+      level = fixscript_get_int(params[num_params-1]);
+      if (level < 1 || level > 9) {
+         *error = fixscript_create_error_string(heap, "invalid compression level");
+         return fixscript_int(0);
+      }
+   }
+
+   if (num_params >= 3) {
       off = fixscript_get_int(params[1]);
       len = fixscript_get_int(params[2]);
    }
@@ -2574,10 +3508,10 @@ static Value native_zcompress_memory(Heap *heap, Value *error, int num_params, V
 
    if (flags & ZC_COMPRESS) {
       if (flags & ZC_GZIP) {
-         ok = gzip_compress_memory(in, len, &out, &out_len);
+         ok = gzip_compress_memory(in, len, level, &out, &out_len);
       }
       else {
-         ok = zcompress_memory(in, len, &out, &out_len);
+         ok = zcompress_memory(in, len, level, &out, &out_len);
       }
    }
    else {
@@ -2617,7 +3551,15 @@ static Value native_zcompress_create(Heap *heap, Value *error, int num_params, V
    int flags = (intptr_t)data;
    CompressHandle *ch;
    Value ret;
-   int size, type;
+   int size, type, level = ZCOMP_DEFAULT_LEVEL;
+
+   if (num_params == 2) {
+      level = fixscript_get_int(params[1]);
+      if (level < 1 || level > 9) {
+         *error = fixscript_create_error_string(heap, "invalid compression level");
+         return fixscript_int(0);
+      }
+   }
    
    if (flags & ZC_COMPRESS) {
       if (flags & ZC_GZIP) {
@@ -2653,6 +3595,7 @@ static Value native_zcompress_create(Heap *heap, Value *error, int num_params, V
    
    if (flags & ZC_COMPRESS) {
       ((ZCompress *)ch->state)->flushable = params[0].value;
+      ((ZCompress *)ch->state)->level = level;
    }
 
    ch->heap = heap;
@@ -5840,511 +6783,392 @@ static Value native_file_exists(Heap *heap, Value *error, int num_params, Value
 
 
 #ifndef __wasm__
-static void *tcp_connection_handle_func(Heap *heap, int op, void *p1, void *p2)
+typedef struct {
+   void *base;
+   size_t size;
+   int writable;
+   int unmapped;
+#if defined(_WIN32)
+   HANDLE map;
+   int64_t offset;
+#endif
+} FileMapping;
+
+#if defined(_WIN32)
+#ifndef MEM_RESERVE_PLACEHOLDER
+#define MEM_RESERVE_PLACEHOLDER 0x00040000
+#endif
+#ifndef MEM_REPLACE_PLACEHOLDER
+#define MEM_REPLACE_PLACEHOLDER 0x00004000
+#endif
+#ifndef MEM_PRESERVE_PLACEHOLDER
+#define MEM_PRESERVE_PLACEHOLDER 0x00000002
+#endif
+
+typedef void *(WINAPI *VirtualAlloc2Func)(HANDLE, void *, SIZE_T, ULONG, ULONG, void *, ULONG);
+typedef void *(WINAPI *MapViewOfFile3Func)(HANDLE, HANDLE, void *, ULONG64, SIZE_T, ULONG, ULONG, void *, ULONG);
+typedef BOOL (WINAPI *UnmapViewOfFile2Func)(HANDLE, void *, ULONG);
+
+static volatile int placeholders_init = 0;
+static VirtualAlloc2Func func_VirtualAlloc2;
+static MapViewOfFile3Func func_MapViewOfFile3;
+static UnmapViewOfFile2Func func_UnmapViewOfFile2;
+
+// placeholders (Windows 10 1803+) keep the address range reserved while the view
+// is swapped for anonymous memory so that no other allocation can take it:
+static int has_placeholders()
 {
-   TCPConnectionHandle *handle = p1;
-   switch (op) {
-      case HANDLE_OP_FREE:
-         if (__sync_sub_and_fetch(&handle->refcnt, 1) == 0) {
-            if (!handle->closed) {
-               #if defined(_WIN32)
-                  closesocket(handle->socket);
-               #elif defined(__wasm__)
-               #else
-                  close(handle->fd);
-               #endif
-            }
-            free(handle);
-         }
-         break;
+   HMODULE lib;
 
-      case HANDLE_OP_COPY:
-         __sync_add_and_fetch(&handle->refcnt, 1);
-         return handle;
+   if (placeholders_init == 0) {
+      lib = LoadLibrary(L"kernelbase.dll");
+      if (lib) {
+         func_VirtualAlloc2 = (void *)GetProcAddress(lib, "VirtualAlloc2");
+         func_MapViewOfFile3 = (void *)GetProcAddress(lib, "MapViewOfFile3");
+         func_UnmapViewOfFile2 = (void *)GetProcAddress(lib, "UnmapViewOfFile2");
+      }
+      placeholders_init = (func_VirtualAlloc2 && func_MapViewOfFile3 && func_UnmapViewOfFile2)? 1 : -1;
    }
-   return NULL;
+   return placeholders_init > 0;
 }
 #endif
 
-
-static TCPConnectionHandle *get_tcp_connection_handle(Heap *heap, Value *error, Value handle_val)
+static void free_file_mapping(void *data)
 {
-   TCPConnectionHandle *handle;
+   FileMapping *mapping = data;
 
-   handle = fixscript_get_handle(heap, handle_val, HANDLE_TYPE_TCP_CONNECTION, NULL);
-   if (!handle) {
-      *error = fixscript_create_error_string(heap, "invalid TCP connection handle");
-      return NULL;
+#if defined(_WIN32)
+   if (mapping->unmapped) {
+      VirtualFree(mapping->base, 0, MEM_RELEASE);
+   }
+   else {
+      UnmapViewOfFile(mapping->base);
+   }
+   if (mapping->map) {
+      CloseHandle(mapping->map);
    }
+#else
+   munmap(mapping->base, mapping->size);
+#endif
+   free(mapping);
+}
 
-   if (handle->closed) {
-      *error = fixscript_create_error_string(heap, "TCP connection is already closed");
+
+static FileMapping *get_file_mapping(Heap *heap, Value *error, Value arr, char **ptr, int *len)
+{
+   FileMapping *mapping;
+   
+   *ptr = fixscript_get_shared_array_data(heap, arr, len, NULL, (void **)&mapping, HANDLE_TYPE_FILE_MAPPING, NULL);
+   if (!*ptr) {
+      *error = fixscript_create_error_string(heap, "invalid file mapping");
       return NULL;
    }
-
-   return handle;
+   return mapping;
 }
 
 
-#ifndef __wasm__
-static int update_nonblocking(TCPConnectionHandle *handle)
+static size_t get_map_granularity()
 {
 #if defined(_WIN32)
-   u_long arg;
-#elif defined(__wasm__)
+   SYSTEM_INFO info;
+
+   GetSystemInfo(&info);
+   return info.dwAllocationGranularity;
 #else
-   int flags;
+   return sysconf(_SC_PAGESIZE);
 #endif
-
-   if (handle->in_nonblocking != handle->want_nonblocking) {
-      #if defined(_WIN32)
-         arg = handle->want_nonblocking;
-         if (ioctlsocket(handle->socket, FIONBIO, &arg) != 0) {
-            return 0;
-         }
-      #elif defined(__wasm__)
-      #else
-         flags = fcntl(handle->fd, F_GETFL);
-         if (flags == -1) {
-            return 0;
-         }
-         if (handle->want_nonblocking) {
-            flags |= O_NONBLOCK;
-         }
-         else {
-            flags &= ~O_NONBLOCK;
-         }
-         if (fcntl(handle->fd, F_SETFL, flags) == -1) {
-            return 0;
-         }
-      #endif
-      handle->in_nonblocking = handle->want_nonblocking;
-   }
-   return 1;
 }
 #endif
 
 
-#ifndef __wasm__
-#if defined(_WIN32)
-static int tcp_connect(const char *hostname, int port, SOCKET *ret, int overlapped)
-#else
-static int tcp_connect(const char *hostname, int port, int *ret)
-#endif
+static Value native_file_map(Heap *heap, Value *error, int num_params, Value *params, void *data)
 {
+#if defined(__wasm__)
+   *error = fixscript_create_error_string(heap, "not supported");
+   return fixscript_int(0);
+#else
+   FileHandle *handle;
+   FileMapping *mapping;
+   Value ret;
+   int64_t off, aligned_off, file_size;
+   size_t delta;
+   int len, writable;
 #if defined(_WIN32)
-   LPHOSTENT host_ent;
-   SOCKADDR_IN sock_addr;
-   SOCKET sock = INVALID_SOCKET;
+   LARGE_INTEGER size;
+   HANDLE map;
+   void *placeholder;
 #else
-   struct addrinfo *addrinfo = NULL, *ai, hints;
-   int fd = -1;
-   char buf[16];
-   int err;
+   struct stat st;
+   void *base;
 #endif
-   int flag;
 
-#if defined(_WIN32)
-   host_ent = gethostbyname(hostname);
-   if (!host_ent || !host_ent->h_addr_list[0]) {
-      goto error;
-   }
-
-   if (overlapped) {
-      sock = WSASocket(PF_INET, SOCK_STREAM, IPPROTO_TCP, NULL, 0, WSA_FLAG_OVERLAPPED);
-   }
-   else {
-      sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
-   }
-   if (sock == INVALID_SOCKET) {
-      goto error;
+   handle = get_file_handle(heap, error, params[0]);
+   if (!handle) {
+      return fixscript_int(0);
    }
 
-   memset(&sock_addr, 0, sizeof(SOCKADDR_IN));
-   sock_addr.sin_family = PF_INET;
-   sock_addr.sin_addr = *((LPIN_ADDR)host_ent->h_addr_list[0]);
-   sock_addr.sin_port = htons(port);
+   off = ((uint32_t)params[1].value) | (((uint64_t)params[2].value) << 32);
+   len = fixscript_get_int(params[3]);
+   writable = params[4].value != 0;
 
-   if (connect(sock, (LPSOCKADDR)&sock_addr, sizeof(SOCKADDR_IN)) != 0) {
-      goto error;
+   if (off < 0 || len <= 0) {
+      *error = fixscript_create_error_string(heap, "invalid offset or length");
+      return fixscript_int(0);
    }
 
-   flag = 1;
-   setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(int));
-
-   *ret = sock;
-#else
-   memset(&hints, 0, sizeof(struct addrinfo));
-   hints.ai_family = AF_UNSPEC;
-   hints.ai_socktype = SOCK_STREAM;
-
-   snprintf(buf, sizeof(buf), "%d", port);
-   err = getaddrinfo(hostname, buf, &hints, &addrinfo);
-   if (err != 0) {
-      goto error;
+   if ((handle->mode & SCRIPT_FILE_READ) == 0 || (writable && (handle->mode & SCRIPT_FILE_WRITE) == 0)) {
+      *error = fixscript_create_error_string(heap, writable? "file not opened for reading and writing" : "file not opened for reading");
+      return fixscript_int(0);
    }
 
-   for (ai = addrinfo; ai; ai = ai->ai_next) {
-      fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
-      if (fd == -1) {
-         continue;
-      }
-
-      if (connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
-         close(fd);
-         fd = -1;
-         continue;
-      }
-
-      break;
+#if defined(_WIN32)
+   if (!GetFileSizeEx(handle->handle, &size)) {
+      *error = fixscript_create_error_string(heap, "I/O error");
+      return fixscript_int(0);
    }
-
-   if (fd == -1) {
-      goto error;
+   file_size = size.QuadPart;
+#else
+   if (fstat(handle->fd, &st) != 0) {
+      *error = fixscript_create_error_string(heap, "I/O error");
+      return fixscript_int(0);
    }
+   file_size = st.st_size;
+#endif
 
-   flag = 1;
-   setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(int));
+   if (off + len > file_size) {
+      *error = fixscript_create_error_string(heap, "mapping is past the end of file");
+      return fixscript_int(0);
+   }
 
-   *ret = fd;
-#endif
+   // script arrays are always writable, read-only mappings are therefore mapped
+   // as copy-on-write so that stray stores never reach the file:
+   aligned_off = off & ~((int64_t)get_map_granularity() - 1);
+   delta = off - aligned_off;
 
-   return 1;
+   mapping = calloc(1, sizeof(FileMapping));
+   if (!mapping) {
+      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+   }
+   mapping->size = delta + len;
+   mapping->writable = writable;
 
-error:
 #if defined(_WIN32)
-   if (sock != INVALID_SOCKET) {
-      closesocket(sock);
+   map = CreateFileMapping(handle->handle, NULL, writable? PAGE_READWRITE : PAGE_READONLY, 0, 0, NULL);
+   if (!map) {
+      free(mapping);
+      *error = fixscript_create_error_string(heap, "I/O error");
+      return fixscript_int(0);
    }
-#else
-   if (addrinfo) {
-      freeaddrinfo(addrinfo);
+   if (has_placeholders()) {
+      placeholder = func_VirtualAlloc2(NULL, NULL, mapping->size, MEM_RESERVE | MEM_RESERVE_PLACEHOLDER, PAGE_NOACCESS, NULL, 0);
+      if (placeholder) {
+         mapping->base = func_MapViewOfFile3(map, NULL, placeholder, aligned_off, mapping->size, MEM_REPLACE_PLACEHOLDER, writable? PAGE_READWRITE : PAGE_WRITECOPY, NULL, 0);
+         if (!mapping->base) {
+            VirtualFree(placeholder, 0, MEM_RELEASE);
+         }
+      }
+      mapping->map = map;
+      mapping->offset = aligned_off;
    }
-   if (fd != -1) {
-      close(fd);
+   else {
+      mapping->base = MapViewOfFile(map, writable? FILE_MAP_WRITE : FILE_MAP_COPY, (DWORD)(aligned_off >> 32), (DWORD)aligned_off, mapping->size);
+      CloseHandle(map);
    }
+   if (!mapping->base) {
+      if (mapping->map) {
+         CloseHandle(mapping->map);
+      }
+      free(mapping);
+      *error = fixscript_create_error_string(heap, "I/O error");
+      return fixscript_int(0);
+   }
+#else
+   base = mmap(NULL, mapping->size, PROT_READ | PROT_WRITE, writable? MAP_SHARED : MAP_PRIVATE, handle->fd, aligned_off);
+   if (base == MAP_FAILED) {
+      free(mapping);
+      *error = fixscript_create_error_string(heap, "I/O error");
+      return fixscript_int(0);
+   }
+   mapping->base = base;
 #endif
-   return 0;
-}
+
+   ret = fixscript_create_or_get_shared_array(heap, HANDLE_TYPE_FILE_MAPPING, (char *)mapping->base + delta, len, 1, free_file_mapping, mapping, NULL);
+   if (!ret.value) {
+      free_file_mapping(mapping);
+      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+   }
+   return ret;
 #endif /* __wasm__ */
- 
+}
 
-static Value native_tcp_connection_open(Heap *heap, Value *error, int num_params, Value *params, void *data)
+
+static Value native_file_unmap(Heap *heap, Value *error, int num_params, Value *params, void *data)
 {
 #if defined(__wasm__)
    *error = fixscript_create_error_string(heap, "not supported");
    return fixscript_int(0);
 #else
-   TCPConnectionHandle *handle;
-   char *hostname = NULL;
-   char buf[128];
-   int err;
-   Value retval = fixscript_int(0);
-#if defined(_WIN32)
-   SOCKET sock = INVALID_SOCKET;
-#else
-   int fd = -1;
-#endif
-
-   err = fixscript_get_string(heap, params[0], 0, -1, &hostname, NULL);
-   if (err) {
-      fixscript_error(heap, error, err);
-      goto error;
-   }
+   FileMapping *mapping;
+   char *ptr;
+   int len;
 
-#if defined(_WIN32)
-   if (!tcp_connect(hostname, params[1].value, &sock, 0))
-#else
-   if (!tcp_connect(hostname, params[1].value, &fd))
-#endif
-   {
-      snprintf(buf, sizeof(buf), "can't connect to %s:%d", hostname, params[1].value);
-      *error = fixscript_create_error_string(heap, buf);
-      goto error;
+   mapping = get_file_mapping(heap, error, params[0], &ptr, &len);
+   if (!mapping) {
+      return fixscript_int(0);
    }
 
-   handle = calloc(1, sizeof(TCPConnectionHandle));
-   if (!handle) {
-      fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
-      goto error;
+   if (mapping->unmapped) {
+      return fixscript_int(0);
    }
 
-   handle->refcnt = 1;
-#if defined(_WIN32)
-   handle->socket = sock;
-#else
-   handle->fd = fd;
-#endif
-
-   retval = fixscript_create_value_handle(heap, HANDLE_TYPE_TCP_CONNECTION, handle, tcp_connection_handle_func);
+   // the array (and any views of it) stays alive until collected, replace the pages
+   // with anonymous memory so that stale accesses read zeros instead of crashing:
 #if defined(_WIN32)
-   sock = INVALID_SOCKET;
-#else
-   fd = -1;
-#endif
-   if (!retval.value) {
-      fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
-      goto error;
+   if (!mapping->map) {
+      // without placeholders the range can't be replaced atomically, keep the view
+      // until the array is collected instead of risking another allocation there:
+      if (mapping->writable && !FlushViewOfFile(mapping->base, 0)) {
+         *error = fixscript_create_error_string(heap, "I/O error");
+      }
+      return fixscript_int(0);
    }
-
-error:
-   free(hostname);
-#if defined(_WIN32)
-   if (!retval.value && sock != INVALID_SOCKET) {
-      closesocket(sock);
+   if (!func_UnmapViewOfFile2(GetCurrentProcess(), mapping->base, MEM_PRESERVE_PLACEHOLDER)) {
+      *error = fixscript_create_error_string(heap, "I/O error");
+      return fixscript_int(0);
+   }
+   if (func_VirtualAlloc2(NULL, mapping->base, mapping->size, MEM_RESERVE | MEM_COMMIT | MEM_REPLACE_PLACEHOLDER, PAGE_READWRITE, NULL, 0) != mapping->base) {
+      // put the view back so that the array doesn't point to an inaccessible range:
+      if (func_MapViewOfFile3(mapping->map, NULL, mapping->base, mapping->offset, mapping->size, MEM_REPLACE_PLACEHOLDER, mapping->writable? PAGE_READWRITE : PAGE_WRITECOPY, NULL, 0) != mapping->base) {
+         mapping->unmapped = 1;
+      }
+      *error = fixscript_create_error_string(heap, "I/O error");
+      return fixscript_int(0);
    }
+   CloseHandle(mapping->map);
+   mapping->map = NULL;
 #else
-   if (!retval.value && fd != -1) {
-      close(fd);
+   if (mmap(mapping->base, mapping->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+      *error = fixscript_create_error_string(heap, "I/O error");
+      return fixscript_int(0);
    }
 #endif
-   return retval;
+   mapping->unmapped = 1;
+   return fixscript_int(0);
 #endif /* __wasm__ */
 }
 
 
-static Value native_tcp_connection_close(Heap *heap, Value *error, int num_params, Value *params, void *data)
+#ifndef __wasm__
+static FileMapping *get_file_mapping_range(Heap *heap, Value *error, Value *params, char **start, size_t *size)
 {
-   TCPConnectionHandle *handle;
+   FileMapping *mapping;
+   char *ptr;
+   uintptr_t page_mask;
+   int len, off, range_len;
 
-   handle = get_tcp_connection_handle(heap, error, params[0]);
-   if (!handle) {
-      return fixscript_int(0);
+   mapping = get_file_mapping(heap, error, params[0], &ptr, &len);
+   if (!mapping) {
+      return NULL;
    }
 
-   handle->closed = 1;
-#if defined(_WIN32)
-   if (closesocket(handle->socket) != 0) {
-      *error = fixscript_create_error_string(heap, "I/O error");
-      return fixscript_int(0);
+   off = params[1].value;
+   range_len = params[2].value;
+   if (off < 0 || range_len < 0 || (int64_t)off + (int64_t)range_len > len) {
+      fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_BOUNDS);
+      return NULL;
    }
-#elif defined(__wasm__)
+
+   page_mask = get_map_granularity() - 1;
+   ptr += off;
+   *start = (char *)((uintptr_t)ptr & ~page_mask);
+   *size = range_len + (ptr - *start);
+   return mapping;
+}
+#endif
+
+
+static Value native_file_map_advise(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+#if defined(__wasm__)
    *error = fixscript_create_error_string(heap, "not supported");
+   return fixscript_int(0);
 #else
-   if (close(handle->fd) == -1) {
+   FileMapping *mapping;
+   char *start;
+   size_t size;
+#if !defined(_WIN32)
+   int advice;
+#endif
+
+   mapping = get_file_mapping_range(heap, error, params, &start, &size);
+   if (!mapping) {
+      return fixscript_int(0);
+   }
+
+   if (params[3].value < MAP_ADVICE_NORMAL || params[3].value > MAP_ADVICE_DONTNEED) {
+      *error = fixscript_create_error_string(heap, "invalid advice");
+      return fixscript_int(0);
+   }
+
+   if (mapping->unmapped || size == 0) {
+      return fixscript_int(0);
+   }
+
+#if !defined(_WIN32)
+   switch (params[3].value) {
+      default:
+      case MAP_ADVICE_NORMAL:     advice = MADV_NORMAL; break;
+      case MAP_ADVICE_RANDOM:     advice = MADV_RANDOM; break;
+      case MAP_ADVICE_SEQUENTIAL: advice = MADV_SEQUENTIAL; break;
+      case MAP_ADVICE_WILLNEED:   advice = MADV_WILLNEED; break;
+      case MAP_ADVICE_DONTNEED:   advice = MADV_DONTNEED; break;
+   }
+   if (madvise(start, size, advice) != 0) {
       *error = fixscript_create_error_string(heap, "I/O error");
       return fixscript_int(0);
    }
 #endif
    return fixscript_int(0);
+#endif /* __wasm__ */
 }
 
 
-static Value native_tcp_connection_read(Heap *heap, Value *error, int num_params, Value *params, void *data)
+static Value native_file_map_sync(Heap *heap, Value *error, int num_params, Value *params, void *data)
 {
 #if defined(__wasm__)
    *error = fixscript_create_error_string(heap, "not supported");
    return fixscript_int(0);
 #else
-   TCPConnectionHandle *handle;
-   char *buf;
-   int timeout = fixscript_get_int(params[4]);
-#if defined(_WIN32)
-   fd_set readfds;
-   TIMEVAL timeval;
-   int ret;
-#else
-   struct pollfd pfd;
-   ssize_t ret;
-#endif
-   int err, len;
+   FileMapping *mapping;
+   char *start;
+   size_t size;
 
-   handle = get_tcp_connection_handle(heap, error, params[0]);
-   if (!handle) {
+   mapping = get_file_mapping_range(heap, error, params, &start, &size);
+   if (!mapping) {
       return fixscript_int(0);
    }
 
-#if defined(_WIN32)
-   if (timeout >= 0) {
-      FD_ZERO(&readfds);
-      FD_SET(handle->socket, &readfds);
-      timeval.tv_sec = timeout / 1000;
-      timeval.tv_usec = (timeout % 1000) * 1000;
-      ret = select(1, &readfds, NULL, NULL, &timeval);
-      if (ret == SOCKET_ERROR) {
-         *error = fixscript_create_error_string(heap, "I/O error");
-         return fixscript_int(0);
-      }
-      if (ret == 0) {
-         return fixscript_int(0);
-      }
-      handle->want_nonblocking = 1;
+   if (!mapping->writable || mapping->unmapped || size == 0) {
+      return fixscript_int(0);
    }
+
+#if defined(_WIN32)
+   if (!FlushViewOfFile(start, size)) {
 #else
-   if (timeout >= 0) {
-      pfd.fd = handle->fd;
-      pfd.events = POLLIN;
-      ret = poll(&pfd, 1, timeout);
-      if (ret < 0) {
-         *error = fixscript_create_error_string(heap, "I/O error");
-         return fixscript_int(0);
-      }
-      if (ret == 1) {
-         ret = 0;
-         if (pfd.revents & POLLIN) ret = 1;
-      }
-      if (ret == 0) {
-         return fixscript_int(0);
-      }
-      handle->want_nonblocking = 1;
-   }
+   if (msync(start, size, MS_SYNC) != 0) {
 #endif
-
-   if (!update_nonblocking(handle)) {
       *error = fixscript_create_error_string(heap, "I/O error");
       return fixscript_int(0);
    }
-   handle->want_nonblocking = 0;
-
-   len = params[3].value;
-   err = fixscript_lock_array(heap, params[1], params[2].value, len, (void **)&buf, 1, ACCESS_WRITE_ONLY);
-   if (err) {
-      fixscript_error(heap, error, err);
-      return fixscript_int(0);
-   }
-
-#if defined(_WIN32)
-   ret = recv(handle->socket, buf, len, 0);
-   if (ret == SOCKET_ERROR) {
-      len = 0;
-      ret = -1;
-   }
-   else if (ret < len) {
-      len = ret;
-   }
-#else
-   ret = read(handle->fd, buf, len);
-   if (ret < 0) {
-      len = 0;
-   }
-   else if (ret < len) {
-      len = ret;
-   }
-#endif
-
-   fixscript_unlock_array(heap, params[1], params[2].value, len, (void **)&buf, 1, ACCESS_WRITE_ONLY);
-
-   if (ret == 0) {
-      return fixscript_int(-1);
-   }
-   if (ret < 0) {
-      #if !defined(_WIN32)
-      if (errno == EAGAIN) {
-         return fixscript_int(0);
-      }
-      #endif
-      *error = fixscript_create_error_string(heap, "I/O error");
-      return fixscript_int(0);
-   }
-   return fixscript_int((int)ret);
-#endif /* __wasm__ */
-}
-
-
-static Value native_tcp_connection_write(Heap *heap, Value *error, int num_params, Value *params, void *data)
-{
-#if defined(__wasm__)
-   *error = fixscript_create_error_string(heap, "not supported");
-   return fixscript_int(0);
-#else
-   TCPConnectionHandle *handle;
-   char *buf;
-   int timeout = fixscript_get_int(params[4]);
-#if defined(_WIN32)
-   fd_set writefds;
-   TIMEVAL timeval;
-   int ret;
-#else
-   struct pollfd pfd;
-   ssize_t ret;
-#endif
-   int err;
-
-   handle = get_tcp_connection_handle(heap, error, params[0]);
-   if (!handle) {
-      return fixscript_int(0);
-   }
-
-#if defined(_WIN32)
-   if (timeout >= 0) {
-      FD_ZERO(&writefds);
-      FD_SET(handle->socket, &writefds);
-      timeval.tv_sec = timeout / 1000;
-      timeval.tv_usec = (timeout % 1000) * 1000;
-      ret = select(1, NULL, &writefds, NULL, &timeval);
-      if (ret == SOCKET_ERROR) {
-         *error = fixscript_create_error_string(heap, "I/O error");
-         return fixscript_int(0);
-      }
-      if (ret == 0) {
-         return fixscript_int(0);
-      }
-      handle->want_nonblocking = 1;
-   }
-#else
-   if (timeout >= 0) {
-      pfd.fd = handle->fd;
-      pfd.events = POLLOUT;
-      ret = poll(&pfd, 1, timeout);
-      if (ret < 0) {
-         *error = fixscript_create_error_string(heap, "I/O error");
-         return fixscript_int(0);
-      }
-      if (ret == 1) {
-         ret = 0;
-         if (pfd.revents & POLLOUT) ret = 1;
-      }
-      if (ret == 0) {
-         return fixscript_int(0);
-      }
-      handle->want_nonblocking = 1;
-   }
-#endif
-
-   if (!update_nonblocking(handle)) {
-      *error = fixscript_create_error_string(heap, "I/O error");
-      return fixscript_int(0);
-   }
-   handle->want_nonblocking = 0;
-
-   err = fixscript_lock_array(heap, params[1], params[2].value, params[3].value, (void **)&buf, 1, ACCESS_READ_ONLY);
-   if (err) {
-      fixscript_error(heap, error, err);
-      return fixscript_int(0);
-   }
-
-#if defined(_WIN32)
-   ret = send(handle->socket, buf, params[3].value, 0);
-   if (ret == SOCKET_ERROR) {
-      if (WSAGetLastError() == WSAEWOULDBLOCK) {
-         ret = 0;
-      }
-      else {
-         ret = -1;
-      }
-   }
-#else
-   ret = write(handle->fd, buf, params[3].value);
-   if (ret < 0 && errno == EAGAIN) {
-      ret = 0;
-   }
-#endif
-
-   fixscript_unlock_array(heap, params[1], params[2].value, params[3].value, (void **)&buf, 1, ACCESS_READ_ONLY);
-
-   if (ret < 0) {
-      *error = fixscript_create_error_string(heap, "I/O error");
-      return fixscript_int(0);
-   }
-   return fixscript_int(ret);
-#endif /* __wasm__ */
-}
+   return fixscript_int(0);
+#endif /* __wasm__ */
+}
 
 
 #ifndef __wasm__
-static void *tcp_server_handle_func(Heap *heap, int op, void *p1, void *p2)
+static void *tcp_connection_handle_func(Heap *heap, int op, void *p1, void *p2)
 {
-   TCPServerHandle *handle = p1;
+   TCPConnectionHandle *handle = p1;
    switch (op) {
       case HANDLE_OP_FREE:
          if (__sync_sub_and_fetch(&handle->refcnt, 1) == 0) {
@@ -6369,18 +7193,18 @@ static void *tcp_server_handle_func(Heap *heap, int op, void *p1, void *p2)
 #endif
 
 
-static TCPServerHandle *get_tcp_server_handle(Heap *heap, Value *error, Value handle_val)
+static TCPConnectionHandle *get_tcp_connection_handle(Heap *heap, Value *error, Value handle_val)
 {
-   TCPServerHandle *handle;
+   TCPConnectionHandle *handle;
 
-   handle = fixscript_get_handle(heap, handle_val, HANDLE_TYPE_TCP_SERVER, NULL);
+   handle = fixscript_get_handle(heap, handle_val, HANDLE_TYPE_TCP_CONNECTION, NULL);
    if (!handle) {
-      *error = fixscript_create_error_string(heap, "invalid TCP server handle");
+      *error = fixscript_create_error_string(heap, "invalid TCP connection handle");
       return NULL;
    }
 
    if (handle->closed) {
-      *error = fixscript_create_error_string(heap, "TCP server is already closed");
+      *error = fixscript_create_error_string(heap, "TCP connection is already closed");
       return NULL;
    }
 
@@ -6388,974 +7212,836 @@ static TCPServerHandle *get_tcp_server_handle(Heap *heap, Value *error, Value ha
 }
 
 
-static Value native_tcp_server_create(Heap *heap, Value *error, int num_params, Value *params, void *data)
+#ifndef __wasm__
+static int update_nonblocking(TCPConnectionHandle *handle)
 {
-#if defined(__wasm__)
-   *error = fixscript_create_error_string(heap, "not supported");
-   return fixscript_int(0);
-#else
-   int local_only = data == (void *)1;
-   TCPServerHandle *handle;
-   struct sockaddr_in server;
 #if defined(_WIN32)
-   SOCKET sock = INVALID_SOCKET;
+   u_long arg;
+#elif defined(__wasm__)
 #else
-   int fd = -1;
+   int flags;
 #endif
-   int reuse;
-   Value retval = fixscript_int(0);
 
-#if defined(_WIN32)
-   sock = socket(AF_INET, SOCK_STREAM, 0);
-   if (sock == INVALID_SOCKET) {
-      goto io_error;
+   if (handle->in_nonblocking != handle->want_nonblocking) {
+      #if defined(_WIN32)
+         arg = handle->want_nonblocking;
+         if (ioctlsocket(handle->socket, FIONBIO, &arg) != 0) {
+            return 0;
+         }
+      #elif defined(__wasm__)
+      #else
+         flags = fcntl(handle->fd, F_GETFL);
+         if (flags == -1) {
+            return 0;
+         }
+         if (handle->want_nonblocking) {
+            flags |= O_NONBLOCK;
+         }
+         else {
+            flags &= ~O_NONBLOCK;
+         }
+         if (fcntl(handle->fd, F_SETFL, flags) == -1) {
+            return 0;
+         }
+      #endif
+      handle->in_nonblocking = handle->want_nonblocking;
    }
+   return 1;
+}
+#endif
 
-   reuse = 1;
-   if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuse, sizeof(reuse)) < 0) {
-      goto io_error;
-   }
 
-   server.sin_family = AF_INET;
-   server.sin_addr.s_addr = htonl(local_only? INADDR_LOOPBACK : INADDR_ANY);
-   server.sin_port = htons(params[0].value);
+#ifndef __wasm__
+#define DNS_CACHE_BUCKETS     256
+#define DNS_CACHE_MAX_ENTRIES 4096
+#define DNS_MAX_ADDRS         16
+#define DNS_CONNECT_DELAY     250
 
-   if (bind(sock, (struct sockaddr *)&server, sizeof(server)) == SOCKET_ERROR) {
-      goto io_error;
-   }
+typedef struct {
+   struct sockaddr_storage addr;
+   int len;
+} ResolvedAddr;
 
-   if (listen(sock, 5) == SOCKET_ERROR) {
-      goto io_error;
-   }
-#else
-   fd = socket(AF_INET, SOCK_STREAM, 0);
-   if (fd == -1) {
-      goto io_error;
-   }
+typedef struct DNSEntry {
+   char *hostname;
+   uint32_t hash;
+   ResolvedAddr *addrs;
+   int num_addrs;
+   uint32_t expires;
+   int resolving;
+   int waiters;
+   pthread_cond_t cond;
+   struct DNSEntry *next;
+} DNSEntry;
 
-   reuse = 1;
-   if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuse, sizeof(reuse)) < 0) {
-      goto io_error;
+static volatile pthread_mutex_t *dns_mutex;
+static DNSEntry *dns_cache[DNS_CACHE_BUCKETS];
+static int dns_cache_cnt = 0;
+static DNSEntry *dns_hosts = NULL;
+static int dns_positive_ttl = 60000;
+static int dns_negative_ttl = 5000;
+static int dns_system_resolver = 1;
+
+static uint32_t get_time();
+static pthread_mutex_t *get_mutex(volatile pthread_mutex_t **mutex_ptr);
+
+
+static uint32_t dns_hash(const char *hostname)
+{
+   uint32_t hash = 2166136261U;
+   const unsigned char *s;
+   int c;
+
+   for (s=(const unsigned char *)hostname; *s; s++) {
+      c = *s;
+      if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+      hash = (hash ^ c) * 16777619U;
    }
+   return hash;
+}
 
-   server.sin_family = AF_INET;
-   server.sin_addr.s_addr = htonl(local_only? INADDR_LOOPBACK : INADDR_ANY);
-   server.sin_port = htons(params[0].value);
 
-   if (bind(fd, (struct sockaddr *)&server, sizeof(server)) < 0) {
-      goto io_error;
+static int dns_parse_address(const char *str, ResolvedAddr *ra)
+{
+#if defined(_WIN32)
+   struct sockaddr_in *in4 = (struct sockaddr_in *)&ra->addr;
+   unsigned long addr;
+
+   memset(ra, 0, sizeof(ResolvedAddr));
+   addr = inet_addr(str);
+   if (addr == INADDR_NONE && strcmp(str, "255.255.255.255") != 0) {
+      return 0;
    }
+   in4->sin_family = AF_INET;
+   in4->sin_addr.s_addr = addr;
+   ra->len = sizeof(struct sockaddr_in);
+   return 1;
+#else
+   struct sockaddr_in *in4 = (struct sockaddr_in *)&ra->addr;
+   struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&ra->addr;
 
-   if (listen(fd, 5) < 0) {
-      goto io_error;
+   memset(ra, 0, sizeof(ResolvedAddr));
+   if (inet_pton(AF_INET, str, &in4->sin_addr) == 1) {
+      in4->sin_family = AF_INET;
+      ra->len = sizeof(struct sockaddr_in);
+      return 1;
+   }
+   if (inet_pton(AF_INET6, str, &in6->sin6_addr) == 1) {
+      in6->sin6_family = AF_INET6;
+      ra->len = sizeof(struct sockaddr_in6);
+      return 1;
    }
+   return 0;
 #endif
+}
 
-   handle = calloc(1, sizeof(TCPServerHandle));
-   if (!handle) {
-      fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
-      goto error;
-   }
 
-   handle->refcnt = 1;
+static void dns_format_address(ResolvedAddr *ra, char *buf, int size)
+{
 #if defined(_WIN32)
-   handle->socket = sock;
+   snprintf(buf, size, "%s", inet_ntoa(((struct sockaddr_in *)&ra->addr)->sin_addr));
 #else
-   handle->fd = fd;
-#endif
+   const char *ret = NULL;
 
-   retval = fixscript_create_value_handle(heap, HANDLE_TYPE_TCP_SERVER, handle, tcp_server_handle_func);
-#if defined(_WIN32)
-   sock = INVALID_SOCKET;
-#else
-   fd = -1;
-#endif
-   if (!retval.value) {
-      fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
-      goto error;
+   if (ra->addr.ss_family == AF_INET) {
+      ret = inet_ntop(AF_INET, &((struct sockaddr_in *)&ra->addr)->sin_addr, buf, size);
    }
-
-error:
-#if defined(_WIN32)
-   if (!retval.value && sock != INVALID_SOCKET) {
-      closesocket(sock);
+   else if (ra->addr.ss_family == AF_INET6) {
+      ret = inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&ra->addr)->sin6_addr, buf, size);
    }
-#else
-   if (!retval.value && fd != -1) {
-      close(fd);
+   if (!ret) {
+      snprintf(buf, size, "?");
    }
 #endif
-   return retval;
-
-io_error:
-   *error = fixscript_create_error_string(heap, "I/O error");
-   goto error;
-#endif /* __wasm__ */
 }
 
 
-static Value native_tcp_server_close(Heap *heap, Value *error, int num_params, Value *params, void *data)
+static void dns_set_port(ResolvedAddr *ra, int port)
 {
-   TCPServerHandle *handle;
-
-   handle = get_tcp_server_handle(heap, error, params[0]);
-   if (!handle) {
-      return fixscript_int(0);
-   }
-
-   handle->closed = 1;
-#if defined(_WIN32)
-   if (closesocket(handle->socket) != 0) {
-      *error = fixscript_create_error_string(heap, "I/O error");
-      return fixscript_int(0);
+   if (ra->addr.ss_family == AF_INET) {
+      ((struct sockaddr_in *)&ra->addr)->sin_port = htons(port);
    }
-#elif defined(__wasm__)
-   *error = fixscript_create_error_string(heap, "not supported");
-#else
-   if (close(handle->fd) == -1) {
-      *error = fixscript_create_error_string(heap, "I/O error");
-      return fixscript_int(0);
+#ifndef _WIN32
+   else if (ra->addr.ss_family == AF_INET6) {
+      ((struct sockaddr_in6 *)&ra->addr)->sin6_port = htons(port);
    }
 #endif
-   return fixscript_int(0);
 }
 
 
-static Value native_tcp_server_accept(Heap *heap, Value *error, int num_params, Value *params, void *data)
+static int dns_system_lookup(const char *hostname, ResolvedAddr **addrs_out)
 {
-#if defined(__wasm__)
-   *error = fixscript_create_error_string(heap, "not supported");
-   return fixscript_int(0);
-#else
-   TCPServerHandle *handle;
-   TCPConnectionHandle *conn_handle;
-   Value retval;
-   int timeout = fixscript_get_int(params[1]);
 #if defined(_WIN32)
-   fd_set readfds;
-   TIMEVAL timeval;
-   SOCKET sock;
-#else
-   struct pollfd pfd;
-   int fd;
-#endif
-   int ret, flag;
+   LPHOSTENT host_ent;
+   ResolvedAddr *addrs;
+   int i, cnt = 0;
 
-   handle = get_tcp_server_handle(heap, error, params[0]);
-   if (!handle) {
-      return fixscript_int(0);
+   *addrs_out = NULL;
+   host_ent = gethostbyname(hostname);
+   if (!host_ent || host_ent->h_addrtype != AF_INET) {
+      return 0;
    }
-
-#if defined(_WIN32)
-   if (timeout >= 0) {
-      FD_ZERO(&readfds);
-      FD_SET(handle->socket, &readfds);
-      timeval.tv_sec = timeout / 1000;
-      timeval.tv_usec = (timeout % 1000) * 1000;
-      ret = select(1, &readfds, NULL, NULL, &timeval);
-      if (ret == SOCKET_ERROR) {
-         *error = fixscript_create_error_string(heap, "I/O error");
-         return fixscript_int(0);
-      }
-      if (ret == 0) {
-         return fixscript_int(0);
-      }
+   while (cnt < DNS_MAX_ADDRS && host_ent->h_addr_list[cnt]) {
+      cnt++;
    }
-   sock = accept(handle->socket, NULL, NULL);
-   if (sock == INVALID_SOCKET) {
-      if (WSAGetLastError() == WSAEWOULDBLOCK) {
-         return fixscript_int(0);
-      }
-      *error = fixscript_create_error_string(heap, "I/O error");
-      return fixscript_int(0);
+   if (cnt == 0) {
+      return 0;
    }
-
-   flag = 1;
-   setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(int));
-#else
-   if (timeout >= 0) {
-      pfd.fd = handle->fd;
-      pfd.events = POLLIN;
-      ret = poll(&pfd, 1, timeout);
-      if (ret < 0) {
-         *error = fixscript_create_error_string(heap, "I/O error");
-         return fixscript_int(0);
-      }
-      if (ret == 1) {
-         ret = 0;
-         if (pfd.revents & POLLIN) ret = 1;
-      }
-      if (ret == 0) {
-         return fixscript_int(0);
-      }
+   addrs = calloc(cnt, sizeof(ResolvedAddr));
+   if (!addrs) {
+      return 0;
    }
-   fd = accept(handle->fd, NULL, NULL);
-   if (fd < 0) {
-      if (errno == EAGAIN) {
-         return fixscript_int(0);
-      }
-      *error = fixscript_create_error_string(heap, "I/O error");
-      return fixscript_int(0);
+   for (i=0; i<cnt; i++) {
+      ((struct sockaddr_in *)&addrs[i].addr)->sin_family = AF_INET;
+      ((struct sockaddr_in *)&addrs[i].addr)->sin_addr = *((LPIN_ADDR)host_ent->h_addr_list[i]);
+      addrs[i].len = sizeof(struct sockaddr_in);
    }
+   *addrs_out = addrs;
+   return cnt;
+#else
+   struct addrinfo *addrinfo = NULL, *ai, hints;
+   ResolvedAddr *addrs;
+   int cnt = 0;
 
-   flag = 1;
-   setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(int));
-#endif
+   *addrs_out = NULL;
+   memset(&hints, 0, sizeof(struct addrinfo));
+   hints.ai_family = AF_UNSPEC;
+   hints.ai_socktype = SOCK_STREAM;
 
-   conn_handle = calloc(1, sizeof(TCPConnectionHandle));
-   if (!conn_handle) {
-      #if defined(_WIN32)
-         closesocket(sock);
-      #else
-         close(fd);
-      #endif
-      fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
-      return fixscript_int(0);
+   if (getaddrinfo(hostname, NULL, &hints, &addrinfo) != 0) {
+      return 0;
    }
 
-   conn_handle->refcnt = 1;
-#if defined(_WIN32)
-   conn_handle->socket = sock;
-#else
-   conn_handle->fd = fd;
-#endif
-
-   retval = fixscript_create_value_handle(heap, HANDLE_TYPE_TCP_CONNECTION, conn_handle, tcp_connection_handle_func);
-   if (!retval.value) {
-      fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
-      return fixscript_int(0);
+   addrs = calloc(DNS_MAX_ADDRS, sizeof(ResolvedAddr));
+   if (!addrs) {
+      freeaddrinfo(addrinfo);
+      return 0;
+   }
+   for (ai = addrinfo; ai && cnt < DNS_MAX_ADDRS; ai = ai->ai_next) {
+      if ((ai->ai_family != AF_INET && ai->ai_family != AF_INET6) || ai->ai_addrlen > sizeof(struct sockaddr_storage)) {
+         continue;
+      }
+      memcpy(&addrs[cnt].addr, ai->ai_addr, ai->ai_addrlen);
+      addrs[cnt].len = ai->ai_addrlen;
+      cnt++;
    }
+   freeaddrinfo(addrinfo);
 
-   return retval;
-#endif /* __wasm__ */
+   if (cnt == 0) {
+      free(addrs);
+      return 0;
+   }
+   *addrs_out = addrs;
+   return cnt;
+#endif
 }
 
 
-#ifndef __wasm__
-static void async_process_ref(AsyncProcess *proc)
+static int dns_copy_addrs(DNSEntry *entry, ResolvedAddr **addrs_out)
 {
-   __sync_add_and_fetch(&proc->refcnt, 1);
+   if (entry->num_addrs == 0) {
+      return 0;
+   }
+   *addrs_out = malloc(entry->num_addrs * sizeof(ResolvedAddr));
+   if (!*addrs_out) {
+      return 0;
+   }
+   memcpy(*addrs_out, entry->addrs, entry->num_addrs * sizeof(ResolvedAddr));
+   return entry->num_addrs;
 }
-#endif
 
 
-#ifndef __wasm__
-static void async_process_unref(AsyncProcess *proc)
+static DNSEntry *dns_find_entry(DNSEntry *list, const char *hostname, uint32_t hash)
 {
-   AsyncThreadResult *atr, *atr_next;
-   AsyncTimer *timer, *timer_next;
-   
-   if (__sync_sub_and_fetch(&proc->refcnt, 1) == 0) {
-      for (atr = proc->thread_results; atr; atr = atr_next) {
-         #if defined(_WIN32)
-            if (atr->socket != INVALID_SOCKET) {
-               closesocket(atr->socket);
-            }
-         #elif defined(__wasm__)
-         #else
-            if (atr->fd != -1) {
-               close(atr->fd);
-            }
-         #endif
-         atr_next = atr->next;
-         free(atr);
-      }
-      #if defined(_WIN32)
-         CloseHandle(proc->iocp);
-      #elif defined(__wasm__)
-      #else
-         poll_destroy(proc->poll);
-      #endif
-      for (timer = proc->timers; timer; timer = timer_next) {
-         timer_next = timer->next;
-         free(timer);
+   DNSEntry *entry;
+
+   for (entry = list; entry; entry = entry->next) {
+      if (entry->hash == hash && strcasecmp(entry->hostname, hostname) == 0) {
+         return entry;
       }
-      pthread_mutex_destroy(&proc->mutex);
-      free(proc);
    }
+   return NULL;
 }
-#endif
 
 
-#ifndef __wasm__
-static AsyncProcess *get_async_process(Heap *heap, Value *error)
+static void dns_free_entry(DNSEntry *entry)
 {
-   AsyncProcess *proc;
-   int err;
+   pthread_cond_destroy(&entry->cond);
+   free(entry->hostname);
+   free(entry->addrs);
+   free(entry);
+}
 
-   proc = fixscript_get_heap_data(heap, async_process_key);
-   if (!proc) {
-      proc = calloc(1, sizeof(AsyncProcess));
-      proc->refcnt = 1;
-      if (pthread_mutex_init(&proc->mutex, NULL) != 0) {
-         free(proc);
-         *error = fixscript_create_error_string(heap, "can't create mutex");
-         return NULL;
-      }
 
-#if defined(_WIN32)
-      proc->iocp = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 0);
-      if (!proc->iocp) {
-         pthread_mutex_destroy(&proc->mutex);
-         free(proc);
-         *error = fixscript_create_error_string(heap, "can't create IO completion port");
-         return NULL;
-      }
-#else
-      #ifndef __wasm__
-         proc->poll = poll_create();
-      #endif
-      if (!proc->poll) {
-         pthread_mutex_destroy(&proc->mutex);
-         free(proc);
-         *error = fixscript_create_error_string(heap, "can't create poll file descriptor");
-         return NULL;
-      }
-#endif
+static void dns_purge_cache(int all)
+{
+   DNSEntry *entry, **prev;
+   uint32_t time = get_time();
+   int i;
 
-      err = fixscript_set_heap_data(heap, async_process_key, proc, (HandleFreeFunc)async_process_unref);
-      if (err) {
-         fixscript_error(heap, error, err);
-         return NULL;
+   for (i=0; i<DNS_CACHE_BUCKETS; i++) {
+      prev = &dns_cache[i];
+      while ((entry = *prev)) {
+         if (!entry->resolving && entry->waiters == 0 && (all || (int32_t)(entry->expires - time) <= 0)) {
+            *prev = entry->next;
+            dns_free_entry(entry);
+            dns_cache_cnt--;
+            continue;
+         }
+         prev = &entry->next;
       }
    }
-   return proc;
 }
-#endif
 
 
-#ifndef __wasm__
-static void async_process_notify(AsyncProcess *proc)
+static DNSEntry *dns_create_entry(const char *hostname, uint32_t hash)
 {
-#if defined(_WIN32)
-   PostQueuedCompletionStatus(proc->iocp, 0, 0, (OVERLAPPED *)proc);
-#elif defined(__wasm__)
-#else
-   poll_interrupt(proc->poll);
-#endif
+   DNSEntry *entry;
+
+   entry = calloc(1, sizeof(DNSEntry));
+   if (!entry) {
+      return NULL;
+   }
+   entry->hostname = strdup(hostname);
+   if (!entry->hostname) {
+      free(entry);
+      return NULL;
+   }
+   if (pthread_cond_init(&entry->cond, NULL) != 0) {
+      free(entry->hostname);
+      free(entry);
+      return NULL;
+   }
+   entry->hash = hash;
+   return entry;
 }
-#endif
 
 
-static pthread_mutex_t *get_mutex(volatile pthread_mutex_t **mutex_ptr)
+// returns number of addresses (or 0 on failure), the caller must free the returned array:
+static int dns_resolve(const char *hostname, ResolvedAddr **addrs_out)
 {
-   pthread_mutex_t *mutex, *cur_mutex;
+   pthread_mutex_t *mutex;
+   DNSEntry *entry;
+   ResolvedAddr *addrs;
+   uint32_t hash, time;
+   int bucket, cnt;
 
-   mutex = (pthread_mutex_t *)*mutex_ptr;
+   *addrs_out = NULL;
+
+   addrs = malloc(sizeof(ResolvedAddr));
+   if (!addrs) {
+      return 0;
+   }
+   if (dns_parse_address(hostname, addrs)) {
+      *addrs_out = addrs;
+      return 1;
+   }
+   free(addrs);
+
+   mutex = get_mutex(&dns_mutex);
    if (!mutex) {
-      mutex = calloc(1, sizeof(pthread_mutex_t));
-      if (!mutex) {
-         return NULL;
-      }
-      if (pthread_mutex_init(mutex, NULL) != 0) {
-         free(mutex);
-         return NULL;
-      }
-      cur_mutex = (pthread_mutex_t *)__sync_val_compare_and_swap(mutex_ptr, NULL, mutex);
-      if (cur_mutex) {
-         pthread_mutex_destroy(mutex);
-         free(mutex);
-         mutex = cur_mutex;
-      }
+      return 0;
    }
-   return mutex;
-}
 
+   hash = dns_hash(hostname);
+   bucket = hash & (DNS_CACHE_BUCKETS-1);
 
-#if !defined(_WIN32) && !defined(__wasm__)
-static pthread_cond_t *get_cond(volatile pthread_cond_t **cond_ptr)
-{
-   pthread_cond_t *cond, *cur_cond;
+   pthread_mutex_lock(mutex);
+   entry = dns_find_entry(dns_hosts, hostname, hash);
+   if (entry) {
+      cnt = dns_copy_addrs(entry, addrs_out);
+      pthread_mutex_unlock(mutex);
+      return cnt;
+   }
 
-   cond = (pthread_cond_t *)*cond_ptr;
-   if (!cond) {
-      cond = calloc(1, sizeof(pthread_cond_t));
-      if (!cond) {
-         return NULL;
-      }
-      if (pthread_cond_init(cond, NULL) != 0) {
-         free(cond);
-         return NULL;
+   if (!dns_system_resolver) {
+      pthread_mutex_unlock(mutex);
+      return 0;
+   }
+
+   entry = dns_find_entry(dns_cache[bucket], hostname, hash);
+   if (entry && entry->resolving) {
+      entry->waiters++;
+      while (entry->resolving) {
+         pthread_cond_wait(&entry->cond, mutex);
       }
-      cur_cond = (pthread_cond_t *)__sync_val_compare_and_swap(cond_ptr, NULL, cond);
-      if (cur_cond) {
-         pthread_cond_destroy(cond);
-         free(cond);
-         cond = cur_cond;
+      if (--entry->waiters > 0) {
+         pthread_cond_signal(&entry->cond);
       }
+      cnt = dns_copy_addrs(entry, addrs_out);
+      pthread_mutex_unlock(mutex);
+      return cnt;
    }
-   return cond;
-}
-#endif
 
-
-#ifndef __wasm__
-#if defined(_WIN32)
-static DWORD WINAPI thread_main(void *data)
-#else
-static void *thread_main(void *data)
-#endif
-{
-   Thread *thread = data;
-   pthread_mutex_t *global_mutex;
-   
-   global_mutex = get_mutex(&threads_mutex);
-   if (!global_mutex) {
-#if defined(_WIN32)
-      return 0;
-#else
-      return NULL;
-#endif
+   if (entry && (int32_t)(entry->expires - get_time()) > 0) {
+      cnt = dns_copy_addrs(entry, addrs_out);
+      pthread_mutex_unlock(mutex);
+      return cnt;
    }
 
-   for (;;) {
-      pthread_mutex_lock(&thread->mutex);
-      while (!thread->func) {
-         if (pthread_cond_timedwait_relative(&thread->cond, &thread->mutex, 5000*1000000LL) == ETIMEDOUT && !thread->func) {
-            pthread_mutex_unlock(&thread->mutex);
-            goto end;
+   if (!entry) {
+      if (dns_cache_cnt >= DNS_CACHE_MAX_ENTRIES) {
+         dns_purge_cache(0);
+         if (dns_cache_cnt >= DNS_CACHE_MAX_ENTRIES) {
+            dns_purge_cache(1);
          }
       }
-
-      thread->func(thread->data);
-      thread->func = NULL;
-      pthread_mutex_unlock(&thread->mutex);
-      
-      pthread_mutex_lock(global_mutex);
-      thread->next = threads_pool;
-      threads_pool = thread;
-      pthread_mutex_unlock(global_mutex);
+      entry = dns_create_entry(hostname, hash);
+      if (!entry) {
+         pthread_mutex_unlock(mutex);
+         return 0;
+      }
+      entry->next = dns_cache[bucket];
+      dns_cache[bucket] = entry;
+      dns_cache_cnt++;
    }
+   entry->resolving = 1;
+   pthread_mutex_unlock(mutex);
 
-end:
-   pthread_cond_destroy(&thread->cond);
-   pthread_mutex_destroy(&thread->mutex);
-   free(thread);
+   cnt = dns_system_lookup(hostname, &addrs);
 
-#if defined(_WIN32)
-   return 0;
-#else
-   return NULL;
-#endif
+   pthread_mutex_lock(mutex);
+   time = get_time();
+   free(entry->addrs);
+   entry->addrs = addrs;
+   entry->num_addrs = cnt;
+   entry->expires = time + (uint32_t)(cnt > 0? dns_positive_ttl : dns_negative_ttl);
+   entry->resolving = 0;
+   if (entry->waiters > 0) {
+      pthread_cond_signal(&entry->cond);
+   }
+   cnt = dns_copy_addrs(entry, addrs_out);
+   pthread_mutex_unlock(mutex);
+   return cnt;
 }
-#endif
 
 
-#ifndef __wasm__
-static int async_run_thread(ThreadFunc func, void *data)
+#if !defined(_WIN32)
+static int connect_addrs(ResolvedAddr *addrs, int num_addrs)
 {
-   pthread_mutex_t *mutex;
-   Thread *thread;
-#if defined(_WIN32)
-   HANDLE handle;
-#else
-   pthread_t handle;
-#endif
+   ResolvedAddr *order[DNS_MAX_ADDRS];
+   struct pollfd fds[DNS_MAX_ADDRS];
+   int i, j, fd, cnt, next, num_fds, flags, err, ret, start_next, first_family;
+   socklen_t len;
 
-   mutex = get_mutex(&threads_mutex);
-   if (!mutex) {
-      return 0;
+   if (num_addrs > DNS_MAX_ADDRS) {
+      num_addrs = DNS_MAX_ADDRS;
    }
-   
-   pthread_mutex_lock(mutex);
 
-   if (threads_pool) {
-      thread = threads_pool;
-      threads_pool = thread->next;
+   // interleave the address families so that IPv6 and IPv4 attempts race (Happy Eyeballs):
+   first_family = addrs[0].addr.ss_family;
+   cnt = 0;
+   i = 0;
+   j = 0;
+   while (cnt < num_addrs) {
+      while (i < num_addrs && addrs[i].addr.ss_family != first_family) i++;
+      if (i < num_addrs) order[cnt++] = &addrs[i++];
+      while (j < num_addrs && addrs[j].addr.ss_family == first_family) j++;
+      if (j < num_addrs) order[cnt++] = &addrs[j++];
    }
-   else {
-      thread = calloc(1, sizeof(Thread));
-      if (!thread) {
-         pthread_mutex_unlock(mutex);
-         return 0;
-      }
 
-      if (pthread_mutex_init(&thread->mutex, NULL) != 0) {
-         free(thread);
-         pthread_mutex_unlock(mutex);
-         return 0;
+   next = 0;
+   num_fds = 0;
+   start_next = 1;
+   for (;;) {
+      while (start_next && next < num_addrs) {
+         fd = socket(order[next]->addr.ss_family, SOCK_STREAM, IPPROTO_TCP);
+         next++;
+         if (fd == -1) {
+            continue;
+         }
+         flags = fcntl(fd, F_GETFL);
+         if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+            close(fd);
+            continue;
+         }
+         if (connect(fd, (struct sockaddr *)&order[next-1]->addr, order[next-1]->len) == 0) {
+            goto connected;
+         }
+         if (errno != EINPROGRESS) {
+            close(fd);
+            continue;
+         }
+         fds[num_fds].fd = fd;
+         fds[num_fds].events = POLLOUT;
+         fds[num_fds].revents = 0;
+         num_fds++;
+         start_next = 0;
       }
 
-      if (pthread_cond_init(&thread->cond, NULL) != 0) {
-         pthread_mutex_destroy(&thread->mutex);
-         free(thread);
-         pthread_mutex_unlock(mutex);
-         return 0;
+      if (num_fds == 0) {
+         return -1;
       }
 
-#if defined(_WIN32)
-      handle = CreateThread(NULL, 0, thread_main, thread, 0, NULL);
-      if (!handle) {
-         pthread_cond_destroy(&thread->cond);
-         pthread_mutex_destroy(&thread->mutex);
-         free(thread);
-         pthread_mutex_unlock(mutex);
-         return 0;
+      ret = poll(fds, num_fds, next < num_addrs? DNS_CONNECT_DELAY : -1);
+      if (ret < 0) {
+         if (errno == EINTR) continue;
+         break;
       }
-      CloseHandle(handle);
-#else
-      if (pthread_create(&handle, NULL, thread_main, thread) != 0) {
-         pthread_cond_destroy(&thread->cond);
-         pthread_mutex_destroy(&thread->mutex);
-         free(thread);
-         pthread_mutex_unlock(mutex);
-         return 0;
+      if (ret == 0) {
+         start_next = 1;
+         continue;
       }
-      pthread_detach(handle);
-#endif
-   }
-
-   pthread_mutex_unlock(mutex);
-   
-   pthread_mutex_lock(&thread->mutex);
-   thread->func = func;
-   thread->data = data;
-   pthread_cond_signal(&thread->cond);
-   pthread_mutex_unlock(&thread->mutex);
-   return 1;
-}
-#endif
-
-
-#ifndef __wasm__
-static void free_async_handle(void *data)
-{
-   AsyncHandle *handle = data;
-#if !defined(_WIN32) && !defined(__wasm__)
-   AsyncProcess *proc = handle->proc;
-#endif
 
-#if !defined(_WIN32) && !defined(__wasm__)
-   poll_remove_socket(proc->poll, handle->fd);
-#endif
-   async_process_unref(handle->proc);
+      for (i=0; i<num_fds; i++) {
+         if (fds[i].revents == 0) continue;
 
-   if (handle->type == ASYNC_TCP_CONNECTION || handle->type == ASYNC_TCP_SERVER) {
-      #if defined(_WIN32)
-      if (handle->type == ASYNC_TCP_SERVER) {
-         closesocket(((AsyncServerHandle *)handle)->accept_socket);
+         err = 0;
+         len = sizeof(int);
+         if (getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0) {
+            fd = fds[i].fd;
+            fds[i] = fds[--num_fds];
+            goto connected;
+         }
+         close(fds[i].fd);
+         fds[i--] = fds[--num_fds];
+         start_next = 1;
       }
-      closesocket(handle->socket);
-      #elif defined(__wasm__)
-      #else
-      close(handle->fd);
-      #endif
    }
-   free(handle);
-}
-#endif
 
+   for (i=0; i<num_fds; i++) {
+      close(fds[i].fd);
+   }
+   return -1;
 
-#if !defined(_WIN32) && !defined(__wasm__)
-static void update_poll_ctl(AsyncHandle *handle)
-{
-   AsyncServerHandle *server_handle;
-
-   if (handle->type == ASYNC_TCP_CONNECTION) {
-      if (handle->active != handle->last_active) {
-         poll_update_socket(handle->proc->poll, handle->fd, handle, handle->active);
-         handle->last_active = handle->active;
-      }
+connected:
+   for (i=0; i<num_fds; i++) {
+      close(fds[i].fd);
    }
-   else if (handle->type == ASYNC_TCP_SERVER) {
-      server_handle = (AsyncServerHandle *)handle;
-      if (server_handle->active != server_handle->last_active) {
-         poll_update_socket(server_handle->proc->poll, server_handle->fd, server_handle, server_handle->active? ASYNC_READ : 0);
-         server_handle->last_active = server_handle->active;
-      }
+   flags = fcntl(fd, F_GETFL);
+   if (flags == -1 || fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) == -1) {
+      close(fd);
+      return -1;
    }
+   return fd;
 }
 #endif
+#endif /* __wasm__ */
 
 
 #ifndef __wasm__
-typedef struct {
-   AsyncProcess *proc;
-   char *hostname;
-   int port;
-   Value callback;
-   Value data;
-   AsyncThreadResult *atr;
-} TCPOpenData;
-
-static void tcp_open_func(void *data)
+#if defined(_WIN32)
+static int tcp_connect(const char *hostname, int port, SOCKET *ret, int overlapped)
+#else
+static int tcp_connect(const char *hostname, int port, int *ret)
+#endif
 {
-   TCPOpenData *tod = data;
-   AsyncProcess *proc = tod->proc;
-   AsyncThreadResult *atr = tod->atr;
+   ResolvedAddr *addrs;
+   int i, num_addrs, flag;
 #if defined(_WIN32)
-   u_long arg;
+   SOCKET sock = INVALID_SOCKET;
 #else
-   int flags;
+   int fd;
 #endif
 
-   atr->type = ASYNC_TCP_CONNECTION;
-   atr->callback = tod->callback;
-   atr->data = tod->data;
-
-#if defined(_WIN32)
-   if (tcp_connect(tod->hostname, tod->port, &atr->socket, 1)) {
-      arg = 1;
-      if (ioctlsocket(atr->socket, FIONBIO, &arg) != 0) {
-         closesocket(atr->socket);
-         atr->socket = INVALID_SOCKET;
-      }
+   num_addrs = dns_resolve(hostname, &addrs);
+   if (num_addrs == 0) {
+      return 0;
    }
-   else {
-      atr->socket = INVALID_SOCKET;
+   for (i=0; i<num_addrs; i++) {
+      dns_set_port(&addrs[i], port);
    }
-#else
-   if (tcp_connect(tod->hostname, tod->port, &atr->fd)) {
-      flags = fcntl(atr->fd, F_GETFL);
-      if (flags != -1) {
-         flags |= O_NONBLOCK;
-         if (fcntl(atr->fd, F_SETFL, flags) == -1) {
-            close(atr->fd);
-            atr->fd = -1;
-         }
+
+#if defined(_WIN32)
+   for (i=0; i<num_addrs; i++) {
+      if (overlapped) {
+         sock = WSASocket(addrs[i].addr.ss_family, SOCK_STREAM, IPPROTO_TCP, NULL, 0, WSA_FLAG_OVERLAPPED);
       }
       else {
-         close(atr->fd);
-         atr->fd = -1;
+         sock = socket(addrs[i].addr.ss_family, SOCK_STREAM, IPPROTO_TCP);
+      }
+      if (sock == INVALID_SOCKET) {
+         continue;
+      }
+      if (connect(sock, (struct sockaddr *)&addrs[i].addr, addrs[i].len) == 0) {
+         break;
       }
+      closesocket(sock);
+      sock = INVALID_SOCKET;
    }
-   else {
-      atr->fd = -1;
+   free(addrs);
+
+   if (sock == INVALID_SOCKET) {
+      return 0;
    }
-#endif
 
-   pthread_mutex_lock(&proc->mutex);
-   atr->next = proc->thread_results;
-   proc->thread_results = atr;
-   async_process_notify(proc);
-   pthread_mutex_unlock(&proc->mutex);
+   flag = 1;
+   setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(int));
 
-   async_process_unref(tod->proc);
-   free(tod->hostname);
-   free(tod);
-}
-#endif /* __wasm__ */
+   *ret = sock;
+#else
+   fd = connect_addrs(addrs, num_addrs);
+   free(addrs);
 
-static Value native_async_tcp_connection_open(Heap *heap, Value *error, int num_params, Value *params, void *data)
+   if (fd == -1) {
+      return 0;
+   }
+
+   flag = 1;
+   setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(int));
+
+   *ret = fd;
+#endif
+
+   return 1;
+}
+#endif /* __wasm__ */
+ 
+
+static Value native_dns_resolve(Heap *heap, Value *error, int num_params, Value *params, void *data)
 {
 #if defined(__wasm__)
    *error = fixscript_create_error_string(heap, "not supported");
    return fixscript_int(0);
 #else
-   AsyncProcess *proc;
-   TCPOpenData *tod;
-   int err;
-   
-   proc = get_async_process(heap, error);
-   if (!proc) return fixscript_int(0);
+   ResolvedAddr *addrs = NULL;
+   Value arr = fixscript_int(0), str;
+   char *hostname = NULL;
+   char buf[128];
+   int i, err, num_addrs;
 
-   tod = calloc(1, sizeof(TCPOpenData));
-   if (!tod) {
-      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
-   }
-   
-   tod->atr = calloc(1, sizeof(AsyncThreadResult));
-   if (!tod->atr) {
-      free(tod);
-      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+   err = fixscript_get_string(heap, params[0], 0, -1, &hostname, NULL);
+   if (err) {
+      fixscript_error(heap, error, err);
+      goto error;
    }
 
-   err = fixscript_get_string(heap, params[0], 0, -1, &tod->hostname, NULL);
-   if (err) {
-      free(tod->atr);
-      free(tod);
-      return fixscript_error(heap, error, err);
+   num_addrs = dns_resolve(hostname, &addrs);
+   if (num_addrs == 0) {
+      snprintf(buf, sizeof(buf), "can't resolve %s", hostname);
+      *error = fixscript_create_error_string(heap, buf);
+      goto error;
    }
 
-   tod->proc = proc;
-   tod->port = fixscript_get_int(params[1]);
-   tod->callback = params[2];
-   tod->data = params[3];
-   async_process_ref(proc);
-   fixscript_ref(heap, tod->data);
+   arr = fixscript_create_array(heap, num_addrs);
+   if (!arr.value) {
+      fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      goto error;
+   }
 
-   if (!async_run_thread(tcp_open_func, tod)) {
-      async_process_unref(proc);
-      fixscript_unref(heap, tod->data);
-      free(tod->hostname);
-      free(tod->atr);
-      free(tod);
-      *error = fixscript_create_error_string(heap, "can't create thread");
-      return fixscript_int(0);
+   for (i=0; i<num_addrs; i++) {
+      dns_format_address(&addrs[i], buf, sizeof(buf));
+      str = fixscript_create_string(heap, buf, -1);
+      if (!str.value) {
+         fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+         goto error;
+      }
+      err = fixscript_set_array_elem(heap, arr, i, str);
+      if (err) {
+         fixscript_error(heap, error, err);
+         goto error;
+      }
    }
 
-   return fixscript_int(0);
-#endif /* __wasm__ */
+error:
+   free(hostname);
+   free(addrs);
+   return error->value? fixscript_int(0) : arr;
+#endif
 }
 
 
-static Value native_async_tcp_connection_read(Heap *heap, Value *error, int num_params, Value *params, void *data)
+static Value native_dns_add_host(Heap *heap, Value *error, int num_params, Value *params, void *data)
 {
 #if defined(__wasm__)
    *error = fixscript_create_error_string(heap, "not supported");
    return fixscript_int(0);
 #else
-   AsyncHandle *handle;
-#ifdef _WIN32
-   WSABUF wsabuf;
-   DWORD flags;
-   DWORD read;
-#endif
+   pthread_mutex_t *mutex;
+   DNSEntry *entry;
+   ResolvedAddr addr, *new_addrs;
+   char *hostname = NULL, *address = NULL;
+   uint32_t hash;
+   int err;
 
-   handle = fixscript_get_handle(heap, params[0], HANDLE_TYPE_ASYNC, NULL);
-   if (!handle || handle->type != ASYNC_TCP_CONNECTION) {
-      *error = fixscript_create_error_string(heap, "invalid async stream handle");
-      return fixscript_int(0);
+   err = fixscript_get_string(heap, params[0], 0, -1, &hostname, NULL);
+   if (!err) {
+      err = fixscript_get_string(heap, params[1], 0, -1, &address, NULL);
    }
-   
-   if (handle->active & ASYNC_READ) {
-      *error = fixscript_create_error_string(heap, "only one read operation can be active at a time");
-      return fixscript_int(0);
+   if (err) {
+      fixscript_error(heap, error, err);
+      goto error;
    }
 
-#ifdef _WIN32
-   if (params[3].value > sizeof(handle->read.buf)) {
-      params[3].value = sizeof(handle->read.buf);
-   }
-   if (params[3].value < 0) {
-      *error = fixscript_create_error_string(heap, "negative length");
-      return fixscript_int(0);
+   if (!dns_parse_address(address, &addr)) {
+      *error = fixscript_create_error_string(heap, "invalid address");
+      goto error;
    }
-#endif
 
-   handle->active |= ASYNC_READ;
-   handle->read.callback = params[4];
-   handle->read.data = params[5];
-   handle->read.array = params[1];
-   handle->read.off = params[2].value;
-   handle->read.len = params[3].value;
-   fixscript_ref(heap, handle->read.data);
-   fixscript_ref(heap, handle->read.array);
+   mutex = get_mutex(&dns_mutex);
+   if (!mutex) {
+      *error = fixscript_create_error_string(heap, "can't create mutex");
+      goto error;
+   }
 
-#ifdef _WIN32
-   memset(&handle->read.overlapped, 0, sizeof(WSAOVERLAPPED));
+   hash = dns_hash(hostname);
+   pthread_mutex_lock(mutex);
+   entry = dns_find_entry(dns_hosts, hostname, hash);
+   if (!entry) {
+      entry = dns_create_entry(hostname, hash);
+      if (entry) {
+         entry->next = dns_hosts;
+         dns_hosts = entry;
+      }
+   }
+   if (entry && entry->num_addrs < DNS_MAX_ADDRS) {
+      new_addrs = realloc(entry->addrs, (entry->num_addrs+1) * sizeof(ResolvedAddr));
+      if (new_addrs) {
+         new_addrs[entry->num_addrs++] = addr;
+         entry->addrs = new_addrs;
+      }
+      else {
+         entry = NULL;
+      }
+   }
+   pthread_mutex_unlock(mutex);
 
-   wsabuf.len = params[3].value;
-   wsabuf.buf = handle->read.buf;
-   flags = 0;
-   WSARecv(handle->socket, &wsabuf, 1, &read, &flags, &handle->read.overlapped, NULL);
-#else
-   update_poll_ctl(handle);
-#endif
+   if (!entry) {
+      fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+   }
 
+error:
+   free(hostname);
+   free(address);
    return fixscript_int(0);
-#endif /* __wasm__ */
+#endif
 }
 
 
-#if defined(_WIN32)
-static Value native_async_tcp_connection_write(Heap *heap, Value *error, int num_params, Value *params, void *data)
+static Value native_dns_remove_host(Heap *heap, Value *error, int num_params, Value *params, void *data)
 {
-   AsyncHandle *handle;
-   WSABUF wsabuf;
-   DWORD written;
+#if defined(__wasm__)
+   *error = fixscript_create_error_string(heap, "not supported");
+   return fixscript_int(0);
+#else
+   pthread_mutex_t *mutex;
+   DNSEntry *entry, **prev;
+   char *hostname = NULL;
+   uint32_t hash = 0;
    int err;
 
-   handle = fixscript_get_handle(heap, params[0], HANDLE_TYPE_ASYNC, NULL);
-   if (!handle || handle->type != ASYNC_TCP_CONNECTION) {
-      *error = fixscript_create_error_string(heap, "invalid async stream handle");
-      return fixscript_int(0);
-   }
-   
-   if (handle->active & ASYNC_WRITE) {
-      *error = fixscript_create_error_string(heap, "only one write operation can be active at a time");
+   mutex = get_mutex(&dns_mutex);
+   if (!mutex) {
+      *error = fixscript_create_error_string(heap, "can't create mutex");
       return fixscript_int(0);
    }
 
-   if (params[3].value > sizeof(handle->write.buf)) {
-      params[3].value = sizeof(handle->write.buf);
+   if (num_params == 1) {
+      err = fixscript_get_string(heap, params[0], 0, -1, &hostname, NULL);
+      if (err) {
+         return fixscript_error(heap, error, err);
+      }
+      hash = dns_hash(hostname);
    }
 
-   err = fixscript_get_array_bytes(heap, params[1], params[2].value, params[3].value, handle->write.buf);
-   if (err) {
-      return fixscript_error(heap, error, err);
+   pthread_mutex_lock(mutex);
+   prev = &dns_hosts;
+   while ((entry = *prev)) {
+      if (!hostname || (entry->hash == hash && strcasecmp(entry->hostname, hostname) == 0)) {
+         *prev = entry->next;
+         dns_free_entry(entry);
+         continue;
+      }
+      prev = &entry->next;
    }
+   pthread_mutex_unlock(mutex);
 
-   handle->active |= ASYNC_WRITE;
-   handle->write.callback = params[4];
-   handle->write.data = params[5];
-   fixscript_ref(heap, handle->write.data);
-
-   memset(&handle->write.overlapped, 0, sizeof(WSAOVERLAPPED));
-
-   wsabuf.len = params[3].value;
-   wsabuf.buf = handle->write.buf;
-   WSASend(handle->socket, &wsabuf, 1, &written, 0, &handle->write.overlapped, NULL);
-
+   free(hostname);
    return fixscript_int(0);
+#endif
 }
-#elif defined(__wasm__)
-static Value native_async_tcp_connection_write(Heap *heap, Value *error, int num_params, Value *params, void *data)
+
+
+static Value native_dns_set_system_resolver(Heap *heap, Value *error, int num_params, Value *params, void *data)
 {
-   *error = fixscript_create_error_string(heap, "not supported");
+#ifndef __wasm__
+   dns_system_resolver = params[0].value != 0;
+#endif
    return fixscript_int(0);
 }
-#else
-static Value native_async_tcp_connection_write(Heap *heap, Value *error, int num_params, Value *params, void *data)
-{
-   AsyncHandle *handle;
-   char *buf;
-   int err;
-   int written;
 
-   handle = fixscript_get_handle(heap, params[0], HANDLE_TYPE_ASYNC, NULL);
-   if (!handle || handle->type != ASYNC_TCP_CONNECTION) {
-      *error = fixscript_create_error_string(heap, "invalid async stream handle");
-      return fixscript_int(0);
-   }
-   
-   if (handle->active & ASYNC_WRITE) {
-      *error = fixscript_create_error_string(heap, "only one write operation can be active at a time");
-      return fixscript_int(0);
-   }
 
-   err = fixscript_lock_array(heap, params[1], params[2].value, params[3].value, (void **)&buf, 1, ACCESS_READ_ONLY);
-   if (err) {
-      fixscript_error(heap, error, err);
+static Value native_dns_set_cache_ttl(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+#ifndef __wasm__
+   if (params[0].value < 0 || params[1].value < 0) {
+      *error = fixscript_create_error_string(heap, "negative TTL");
       return fixscript_int(0);
    }
-
-   handle->active |= ASYNC_WRITE;
-   handle->write.callback = params[4];
-   handle->write.data = params[5];
-   fixscript_ref(heap, handle->write.data);
-
-   written = write(handle->fd, buf, params[3].value);
-   if (written < 0 && errno == EAGAIN) {
-      written = 0;
-   }
-   handle->write.result = written;
-   update_poll_ctl(handle);
-
-   fixscript_unlock_array(heap, params[1], params[2].value, params[3].value, (void **)&buf, 1, ACCESS_READ_ONLY);
-
+   dns_positive_ttl = params[0].value;
+   dns_negative_ttl = params[1].value;
+#endif
    return fixscript_int(0);
 }
-#endif
 
 
-static Value native_async_tcp_connection_close(Heap *heap, Value *error, int num_params, Value *params, void *data)
+static Value native_dns_clear_cache(Heap *heap, Value *error, int num_params, Value *params, void *data)
 {
-   AsyncHandle *handle;
+#ifndef __wasm__
+   pthread_mutex_t *mutex;
 
-   handle = fixscript_get_handle(heap, params[0], HANDLE_TYPE_ASYNC, NULL);
-   if (!handle || handle->type != ASYNC_TCP_CONNECTION) {
-      *error = fixscript_create_error_string(heap, "invalid async stream handle");
+   mutex = get_mutex(&dns_mutex);
+   if (!mutex) {
+      *error = fixscript_create_error_string(heap, "can't create mutex");
       return fixscript_int(0);
    }
 
-#if defined(_WIN32)
-   closesocket(handle->socket);
-   handle->socket = INVALID_SOCKET;
-#elif defined(__wasm__)
-#else
-   poll_remove_socket(handle->proc->poll, handle->fd);
-   close(handle->fd);
-   handle->fd = -1;
+   pthread_mutex_lock(mutex);
+   dns_purge_cache(1);
+   pthread_mutex_unlock(mutex);
 #endif
    return fixscript_int(0);
 }
 
 
-static Value native_async_tcp_server_create(Heap *heap, Value *error, int num_params, Value *params, void *data)
+static Value native_tcp_connection_open(Heap *heap, Value *error, int num_params, Value *params, void *data)
 {
 #if defined(__wasm__)
    *error = fixscript_create_error_string(heap, "not supported");
    return fixscript_int(0);
 #else
-   int local_only = data == (void *)1;
-   AsyncProcess *proc;
-   AsyncServerHandle *handle;
-   struct sockaddr_in server;
+   TCPConnectionHandle *handle;
+   char *hostname = NULL;
+   char buf[128];
+   int err;
+   Value retval = fixscript_int(0);
 #if defined(_WIN32)
    SOCKET sock = INVALID_SOCKET;
 #else
    int fd = -1;
 #endif
-   int reuse;
-   Value retval = fixscript_int(0);
-   
-   proc = get_async_process(heap, error);
-   if (!proc) return fixscript_int(0);
-
-#if defined(_WIN32)
-   sock = socket(AF_INET, SOCK_STREAM, 0);
-   if (sock == INVALID_SOCKET) {
-      goto io_error;
-   }
-
-   reuse = 1;
-   if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuse, sizeof(reuse)) < 0) {
-      goto io_error;
-   }
-
-   server.sin_family = AF_INET;
-   server.sin_addr.s_addr = htonl(local_only? INADDR_LOOPBACK : INADDR_ANY);
-   server.sin_port = htons(params[0].value);
 
-   if (bind(sock, (struct sockaddr *)&server, sizeof(server)) == SOCKET_ERROR) {
-      goto io_error;
+   err = fixscript_get_string(heap, params[0], 0, -1, &hostname, NULL);
+   if (err) {
+      fixscript_error(heap, error, err);
+      goto error;
    }
 
-   if (listen(sock, 5) == SOCKET_ERROR) {
-      goto io_error;
-   }
+#if defined(_WIN32)
+   if (!tcp_connect(hostname, params[1].value, &sock, 0))
 #else
-   fd = socket(AF_INET, SOCK_STREAM, 0);
-   if (fd == -1) {
-      goto io_error;
-   }
-
-   reuse = 1;
-   if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuse, sizeof(reuse)) < 0) {
-      goto io_error;
-   }
-
-   server.sin_family = AF_INET;
-   server.sin_addr.s_addr = htonl(local_only? INADDR_LOOPBACK : INADDR_ANY);
-   server.sin_port = htons(params[0].value);
-
-   if (bind(fd, (struct sockaddr *)&server, sizeof(server)) < 0) {
-      goto io_error;
-   }
-
-   if (listen(fd, 5) < 0) {
-      goto io_error;
-   }
+   if (!tcp_connect(hostname, params[1].value, &fd))
 #endif
+   {
+      snprintf(buf, sizeof(buf), "can't connect to %s:%d", hostname, params[1].value);
+      *error = fixscript_create_error_string(heap, buf);
+      goto error;
+   }
 
-   handle = calloc(1, sizeof(AsyncServerHandle));
+   handle = calloc(1, sizeof(TCPConnectionHandle));
    if (!handle) {
       fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
       goto error;
    }
 
-   handle->proc = proc;
-   async_process_ref(handle->proc);
-   handle->type = ASYNC_TCP_SERVER;
+   handle->refcnt = 1;
 #if defined(_WIN32)
    handle->socket = sock;
-   handle->accept_socket = INVALID_SOCKET;
-   if (!CreateIoCompletionPort((HANDLE)handle->socket, proc->iocp, (ULONG_PTR)handle, 0)) {
-      async_process_unref(handle->proc);
-      free(handle);
-      goto io_error;
-   }
 #else
    handle->fd = fd;
-   if (!poll_add_socket(proc->poll, fd, handle, 0)) {
-      async_process_unref(handle->proc);
-      free(handle);
-      goto io_error;
-   }
 #endif
 
-   retval = fixscript_create_handle(heap, HANDLE_TYPE_ASYNC, handle, free_async_handle);
+   retval = fixscript_create_value_handle(heap, HANDLE_TYPE_TCP_CONNECTION, handle, tcp_connection_handle_func);
 #if defined(_WIN32)
    sock = INVALID_SOCKET;
 #else
@@ -7367,6 +8053,7 @@ static Value native_async_tcp_server_create(Heap *heap, Value *error, int num_pa
    }
 
 error:
+   free(hostname);
 #if defined(_WIN32)
    if (!retval.value && sock != INVALID_SOCKET) {
       closesocket(sock);
@@ -7377,7032 +8064,11356 @@ error:
    }
 #endif
    return retval;
-
-io_error:
-   *error = fixscript_create_error_string(heap, "I/O error");
-   goto error;
-
-   return fixscript_int(0);
 #endif /* __wasm__ */
 }
 
 
-static Value native_async_tcp_server_close(Heap *heap, Value *error, int num_params, Value *params, void *data)
+static Value native_tcp_connection_close(Heap *heap, Value *error, int num_params, Value *params, void *data)
 {
-#if defined(__wasm__)
+   TCPConnectionHandle *handle;
+
+   handle = get_tcp_connection_handle(heap, error, params[0]);
+   if (!handle) {
+      return fixscript_int(0);
+   }
+
+   handle->closed = 1;
+#if defined(_WIN32)
+   if (closesocket(handle->socket) != 0) {
+      *error = fixscript_create_error_string(heap, "I/O error");
+      return fixscript_int(0);
+   }
+#elif defined(__wasm__)
    *error = fixscript_create_error_string(heap, "not supported");
+#else
+   if (close(handle->fd) == -1) {
+      *error = fixscript_create_error_string(heap, "I/O error");
+      return fixscript_int(0);
+   }
+#endif
    return fixscript_int(0);
+}
+
+
+#ifndef __wasm__
+// returns 1 when ready, 0 on timeout and -1 on error:
+static int tcp_connection_wait_read(TCPConnectionHandle *handle, int timeout)
+{
+#if defined(_WIN32)
+   fd_set readfds;
+   TIMEVAL timeval;
 #else
-   AsyncServerHandle *handle;
+   struct pollfd pfd;
+#endif
+   int ret;
 
-   handle = fixscript_get_handle(heap, params[0], HANDLE_TYPE_ASYNC, NULL);
-   if (!handle || handle->type != ASYNC_TCP_SERVER) {
-      *error = fixscript_create_error_string(heap, "invalid async TCP server handle");
-      return fixscript_int(0);
+#if defined(_WIN32)
+   if (timeout >= 0) {
+      FD_ZERO(&readfds);
+      FD_SET(handle->socket, &readfds);
+      timeval.tv_sec = timeout / 1000;
+      timeval.tv_usec = (timeout % 1000) * 1000;
+      ret = select(1, &readfds, NULL, NULL, &timeval);
+      if (ret == SOCKET_ERROR) {
+         return -1;
+      }
+      if (ret == 0) {
+         return 0;
+      }
+      handle->want_nonblocking = 1;
+   }
+#else
+   if (timeout >= 0) {
+      pfd.fd = handle->fd;
+      pfd.events = POLLIN;
+      ret = poll(&pfd, 1, timeout);
+      if (ret < 0) {
+         return -1;
+      }
+      if (ret == 1) {
+         ret = 0;
+         if (pfd.revents & POLLIN) ret = 1;
+      }
+      if (ret == 0) {
+         return 0;
+      }
+      handle->want_nonblocking = 1;
    }
+#endif
 
-#ifdef _WIN32
-   closesocket(handle->socket);
-   handle->socket = INVALID_SOCKET;
+   ret = update_nonblocking(handle);
+   handle->want_nonblocking = 0;
+   return ret? 1 : -1;
+}
+
+
+// returns number of bytes read, 0 when no data is available, -1 on end of stream and -2 on error:
+static int tcp_connection_recv(TCPConnectionHandle *handle, char *buf, int len)
+{
+#if defined(_WIN32)
+   int ret;
+
+   ret = recv(handle->socket, buf, len, 0);
+   if (ret == SOCKET_ERROR) {
+      return -2;
+   }
 #else
-   poll_remove_socket(handle->proc->poll, handle->fd);
-   close(handle->fd);
-   handle->fd = -1;
+   ssize_t ret;
+
+   ret = read(handle->fd, buf, len);
+   if (ret < 0) {
+      if (errno == EAGAIN) {
+         return 0;
+      }
+      return -2;
+   }
 #endif
-   return fixscript_int(0);
-#endif /* __wasm__ */
+   if (ret == 0) {
+      return -1;
+   }
+   return ret;
 }
+#endif /* __wasm__ */
 
 
-static Value native_async_tcp_server_accept(Heap *heap, Value *error, int num_params, Value *params, void *data)
+static Value native_tcp_connection_read(Heap *heap, Value *error, int num_params, Value *params, void *data)
 {
 #if defined(__wasm__)
    *error = fixscript_create_error_string(heap, "not supported");
    return fixscript_int(0);
 #else
-   AsyncServerHandle *handle;
-#ifdef _WIN32
-   BOOL ret;
-   int flag;
-#endif
+   TCPConnectionHandle *handle;
+   char *buf;
+   int timeout = fixscript_get_int(params[4]);
+   int err, ret, len;
 
-   handle = fixscript_get_handle(heap, params[0], HANDLE_TYPE_ASYNC, NULL);
-   if (!handle || handle->type != ASYNC_TCP_SERVER) {
-      *error = fixscript_create_error_string(heap, "invalid async TCP server handle");
+   handle = get_tcp_connection_handle(heap, error, params[0]);
+   if (!handle) {
       return fixscript_int(0);
    }
-   
-   if (handle->active) {
-      *error = fixscript_create_error_string(heap, "only one accept operation can be active at a time");
+
+   ret = tcp_connection_wait_read(handle, timeout);
+   if (ret < 0) {
+      *error = fixscript_create_error_string(heap, "I/O error");
+      return fixscript_int(0);
+   }
+   if (ret == 0) {
       return fixscript_int(0);
    }
 
-#ifdef _WIN32
-   handle->accept_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-   if (handle->accept_socket == INVALID_SOCKET) {
-      *error = fixscript_create_error_string(heap, "I/O error");
+   len = params[3].value;
+   err = fixscript_lock_array(heap, params[1], params[2].value, len, (void **)&buf, 1, ACCESS_WRITE_ONLY);
+   if (err) {
+      fixscript_error(heap, error, err);
       return fixscript_int(0);
    }
-   flag = 1;
-   setsockopt(handle->accept_socket, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(int));
-#endif
 
-   handle->active = 1;
-   handle->callback = params[1];
-   handle->data = params[2];
-   fixscript_ref(heap, handle->data);
+   ret = tcp_connection_recv(handle, buf, len);
 
-#ifdef _WIN32
-   memset(&handle->overlapped, 0, sizeof(OVERLAPPED));
-   ret = AcceptEx(handle->socket, handle->accept_socket, handle->buf, 0, sizeof(struct sockaddr_in) + 16, sizeof(struct sockaddr_in) + 16, NULL, &handle->overlapped);
-   if (ret != 0 || WSAGetLastError() != ERROR_IO_PENDING) {
+   fixscript_unlock_array(heap, params[1], params[2].value, ret > 0? ret : 0, (void **)&buf, 1, ACCESS_WRITE_ONLY);
+
+   if (ret == -2) {
       *error = fixscript_create_error_string(heap, "I/O error");
       return fixscript_int(0);
    }
-#else
-   update_poll_ctl((AsyncHandle *)handle);
-#endif
-   return fixscript_int(0);
+   return fixscript_int(ret);
 #endif /* __wasm__ */
 }
 
 
-#ifndef __wasm__
-static uint32_t get_time()
+static Value native_tcp_connection_write(Heap *heap, Value *error, int num_params, Value *params, void *data)
 {
-#if defined(_WIN32)
-   return timeGetTime();
-#elif defined(__APPLE__)
-   uint64_t time;
-   mach_timebase_info_data_t info;
-   time = mach_absolute_time();
-   mach_timebase_info(&info);
-   return time * info.numer / info.denom / 1000000;
+#if defined(__wasm__)
+   *error = fixscript_create_error_string(heap, "not supported");
+   return fixscript_int(0);
 #else
-   struct timespec ts;
-   if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
-      return 0;
-   }
-   return ((uint64_t)ts.tv_sec) * 1000 + ((uint64_t)ts.tv_nsec / 1000000L);
-#endif
-}
+   TCPConnectionHandle *handle;
+   char *buf;
+   int timeout = fixscript_get_int(params[4]);
+#if defined(_WIN32)
+   fd_set writefds;
+   TIMEVAL timeval;
+   int ret;
+#else
+   struct pollfd pfd;
+   ssize_t ret;
 #endif
+   int err;
 
+   handle = get_tcp_connection_handle(heap, error, params[0]);
+   if (!handle) {
+      return fixscript_int(0);
+   }
 
-#ifndef __wasm__
-static void wait_events(AsyncProcess *proc, int timeout)
-{
-   AsyncTimer *timer;
-   int32_t diff;
-#ifdef _WIN32
-   CompletedIO *cio;
+#if defined(_WIN32)
+   if (timeout >= 0) {
+      FD_ZERO(&writefds);
+      FD_SET(handle->socket, &writefds);
+      timeval.tv_sec = timeout / 1000;
+      timeval.tv_usec = (timeout % 1000) * 1000;
+      ret = select(1, NULL, &writefds, NULL, &timeval);
+      if (ret == SOCKET_ERROR) {
+         *error = fixscript_create_error_string(heap, "I/O error");
+         return fixscript_int(0);
+      }
+      if (ret == 0) {
+         return fixscript_int(0);
+      }
+      handle->want_nonblocking = 1;
+   }
+#else
+   if (timeout >= 0) {
+      pfd.fd = handle->fd;
+      pfd.events = POLLOUT;
+      ret = poll(&pfd, 1, timeout);
+      if (ret < 0) {
+         *error = fixscript_create_error_string(heap, "I/O error");
+         return fixscript_int(0);
+      }
+      if (ret == 1) {
+         ret = 0;
+         if (pfd.revents & POLLOUT) ret = 1;
+      }
+      if (ret == 0) {
+         return fixscript_int(0);
+      }
+      handle->want_nonblocking = 1;
+   }
 #endif
 
-   pthread_mutex_lock(&proc->mutex);
-   timer = proc->timers;
-   if (timer) {
-      if (timer->immediate) {
-         timeout = 0;
+   if (!update_nonblocking(handle)) {
+      *error = fixscript_create_error_string(heap, "I/O error");
+      return fixscript_int(0);
+   }
+   handle->want_nonblocking = 0;
+
+   err = fixscript_lock_array(heap, params[1], params[2].value, params[3].value, (void **)&buf, 1, ACCESS_READ_ONLY);
+   if (err) {
+      fixscript_error(heap, error, err);
+      return fixscript_int(0);
+   }
+
+#if defined(_WIN32)
+   ret = send(handle->socket, buf, params[3].value, 0);
+   if (ret == SOCKET_ERROR) {
+      if (WSAGetLastError() == WSAEWOULDBLOCK) {
+         ret = 0;
       }
       else {
-         diff = (int32_t)(timer->time - get_time());
-         if (timeout < 0 || diff < timeout) {
-            timeout = diff;
-            if (timeout < 0) timeout = 0;
-         }
+         ret = -1;
       }
    }
-   pthread_mutex_unlock(&proc->mutex);
+#else
+   ret = write(handle->fd, buf, params[3].value);
+   if (ret < 0 && errno == EAGAIN) {
+      ret = 0;
+   }
+#endif
+
+   fixscript_unlock_array(heap, params[1], params[2].value, params[3].value, (void **)&buf, 1, ACCESS_READ_ONLY);
+
+   if (ret < 0) {
+      *error = fixscript_create_error_string(heap, "I/O error");
+      return fixscript_int(0);
+   }
+   return fixscript_int(ret);
+#endif /* __wasm__ */
+}
+
+
+#ifndef __wasm__
+#define SEND_FILE_BUF_SIZE 16384
 
 #if defined(_WIN32)
-   if (timeout < 0) {
-      timeout = INFINITE;
+// reads at the given offset, the offset in OVERLAPPED moves the file position on synchronous
+// handles so the position of the script file is restored afterwards:
+static int read_file_at(HANDLE handle, char *buf, int len, int64_t off, DWORD *read)
+{
+   OVERLAPPED overlapped;
+   LARGE_INTEGER zero, saved_pos;
+   DWORD err = 0;
+   int ret;
+
+   zero.QuadPart = 0;
+   if (!SetFilePointerEx(handle, zero, &saved_pos, FILE_CURRENT)) {
+      return 0;
    }
-   proc->num_events = 0;
-   cio = &proc->completed_ios[0];
+   memset(&overlapped, 0, sizeof(OVERLAPPED));
+   overlapped.Offset = (DWORD)off;
+   overlapped.OffsetHigh = (DWORD)(off >> 32);
+   ret = ReadFile(handle, buf, len, read, &overlapped);
+   if (!ret) {
+      err = GetLastError();
+   }
+   SetFilePointerEx(handle, saved_pos, NULL, FILE_BEGIN);
+   if (!ret) {
+      SetLastError(err);
+   }
+   return ret;
+}
+#endif
 
-   while (proc->num_events < sizeof(proc->completed_ios)/sizeof(CompletedIO)) {
-      GetQueuedCompletionStatus(proc->iocp, &cio->transferred, &cio->key, (OVERLAPPED **)&cio->overlapped, timeout);
-      if (!cio->overlapped) break;
+// returns number of bytes sent, 0 when the socket would block, -1 on error and -2 on unexpected end of file
+#if defined(_WIN32)
+static int send_file_chunk(SOCKET socket, FileHandle *file, int64_t off, int64_t len, char *buf, int buf_size)
+#else
+static int send_file_chunk(int fd, FileHandle *file, int64_t off, int64_t len, char *buf, int buf_size)
+#endif
+{
+#if defined(_WIN32)
+   DWORD read;
+   int ret;
+#else
+   ssize_t ret, read;
+#endif
+#if defined(__linux__)
+   off_t pos;
+#endif
 
-      cio = &proc->completed_ios[++proc->num_events];
-      timeout = 0;
+   if (file->closed) {
+      return -1;
    }
-#elif defined(__wasm__)
+   if (len <= 0) {
+      return 0;
+   }
+
+#if defined(__linux__)
+   pos = off;
+   ret = sendfile(fd, file->fd, &pos, len > (1<<30)? (1<<30) : len);
+   if (ret > 0) {
+      return ret;
+   }
+   if (ret == 0) {
+      return -2;
+   }
+   if (errno == EAGAIN) {
+      return 0;
+   }
+   if (errno != EINVAL && errno != ENOSYS) {
+      return -1;
+   }
+#endif
+
+   if (len > buf_size) {
+      len = buf_size;
+   }
+
+#if defined(_WIN32)
+   if (!read_file_at(file->handle, buf, len, off, &read)) {
+      return GetLastError() == ERROR_HANDLE_EOF? -2 : -1;
+   }
+   if (read == 0) {
+      return -2;
+   }
+   ret = send(socket, buf, read, 0);
+   if (ret == SOCKET_ERROR) {
+      return WSAGetLastError() == WSAEWOULDBLOCK? 0 : -1;
+   }
+   return ret;
 #else
-   if (timeout < 0) {
-      timeout = -1;
+   read = pread(file->fd, buf, len, off);
+   if (read < 0) {
+      return -1;
    }
-   poll_wait(proc->poll, timeout);
+   if (read == 0) {
+      return -2;
+   }
+   ret = write(fd, buf, read);
+   if (ret < 0) {
+      return errno == EAGAIN? 0 : -1;
+   }
+   return ret;
 #endif
 }
 #endif
 
 
-#ifndef __wasm__
-static int process_events(AsyncProcess *proc, Heap *heap, Value *error)
+static Value native_tcp_connection_send_file(Heap *heap, Value *error, int num_params, Value *params, void *data)
 {
-   AsyncThreadResult *atr = NULL, *atr_next;
-   AsyncTimer *timer;
-   AsyncHandle *handle;
-   Value handle_val, callback_error;
-   uint32_t time = 0;
-   int32_t diff;
-   int time_obtained;
+#if defined(__wasm__)
+   *error = fixscript_create_error_string(heap, "not supported");
+   return fixscript_int(0);
+#else
+   TCPConnectionHandle *handle;
+   FileHandle *file;
+   char buf[SEND_FILE_BUF_SIZE];
+   int64_t off;
+   int len, timeout, ret;
 #if defined(_WIN32)
-   CompletedIO *cio;
-   int i;
+   fd_set writefds;
+   TIMEVAL timeval;
 #else
-   int flags;
+   struct pollfd pfd;
 #endif
 
-#if defined(_WIN32)
-   for (i=0; i<proc->num_events; i++) {
-      cio = &proc->completed_ios[i];
-      if (cio->overlapped == proc) {
-         continue;
-      }
-
-      handle = (AsyncHandle *)(uintptr_t)cio->key;
-      if (handle->type == ASYNC_TCP_CONNECTION) {
-         if ((void *)cio->overlapped == &handle->read.overlapped) {
-            if (handle->active & ASYNC_READ) {
-               Value callback, data;
-               int result = cio->transferred;
+   handle = get_tcp_connection_handle(heap, error, params[0]);
+   if (!handle) {
+      return fixscript_int(0);
+   }
 
-               callback = handle->read.callback;
-               data = handle->read.data;
-               handle->active &= ~ASYNC_READ;
+   file = get_file_handle(heap, error, params[1]);
+   if (!file) {
+      return fixscript_int(0);
+   }
 
-               if (fixscript_set_array_bytes(heap, handle->read.array, handle->read.off, result, handle->read.buf) != 0) {
-                  result = -1;
-               }
-               fixscript_unref(heap, handle->read.array);
+   if ((file->mode & SCRIPT_FILE_READ) == 0) {
+      *error = fixscript_create_error_string(heap, "file not opened for reading");
+      return fixscript_int(0);
+   }
 
-               fixscript_call(heap, callback, 2, &callback_error, data, fixscript_int(result));
-               if (callback_error.value) {
-                  fixscript_dump_value(heap, callback_error, 1);
-               }
-               fixscript_unref(heap, data);
-            }
-         }
-         if ((void *)cio->overlapped == &handle->write.overlapped) {
-            if (handle->active & ASYNC_WRITE) {
-               Value callback, data;
-               int result = cio->transferred;
+   off = ((uint32_t)params[2].value) | (((uint64_t)params[3].value) << 32);
+   len = fixscript_get_int(params[4]);
+   timeout = fixscript_get_int(params[5]);
 
-               callback = handle->write.callback;
-               data = handle->write.data;
-               handle->active &= ~ASYNC_WRITE;
+   if (off < 0 || len < 0) {
+      *error = fixscript_create_error_string(heap, "negative offset or length");
+      return fixscript_int(0);
+   }
 
-               fixscript_call(heap, callback, 2, &callback_error, data, fixscript_int(result));
-               if (callback_error.value) {
-                  fixscript_dump_value(heap, callback_error, 1);
-               }
-               fixscript_unref(heap, data);
-            }
-         }
+#if defined(_WIN32)
+   if (timeout >= 0) {
+      FD_ZERO(&writefds);
+      FD_SET(handle->socket, &writefds);
+      timeval.tv_sec = timeout / 1000;
+      timeval.tv_usec = (timeout % 1000) * 1000;
+      ret = select(1, NULL, &writefds, NULL, &timeval);
+      if (ret == SOCKET_ERROR) {
+         *error = fixscript_create_error_string(heap, "I/O error");
+         return fixscript_int(0);
       }
-      else if (handle->type == ASYNC_TCP_SERVER) {
-         AsyncServerHandle *server_handle = (AsyncServerHandle *)handle;
-         if ((void *)cio->overlapped == &server_handle->overlapped) {
-            AsyncHandle *new_handle;
-            Value callback, data;
-            Value result = fixscript_int(0);
-            SOCKET socket;
+      if (ret == 0) {
+         return fixscript_int(0);
+      }
+      handle->want_nonblocking = 1;
+   }
+#else
+   if (timeout >= 0) {
+      pfd.fd = handle->fd;
+      pfd.events = POLLOUT;
+      ret = poll(&pfd, 1, timeout);
+      if (ret < 0) {
+         *error = fixscript_create_error_string(heap, "I/O error");
+         return fixscript_int(0);
+      }
+      if (ret == 1) {
+         ret = 0;
+         if (pfd.revents & POLLOUT) ret = 1;
+      }
+      if (ret == 0) {
+         return fixscript_int(0);
+      }
+      handle->want_nonblocking = 1;
+   }
+#endif
 
-            socket = server_handle->accept_socket;
-            server_handle->accept_socket = INVALID_SOCKET;
+   if (!update_nonblocking(handle)) {
+      *error = fixscript_create_error_string(heap, "I/O error");
+      return fixscript_int(0);
+   }
+   handle->want_nonblocking = 0;
 
-            new_handle = calloc(1, sizeof(AsyncHandle));
-            if (!new_handle) {
-               closesocket(socket);
-            }
-            else {
-               new_handle->proc = proc;
-               async_process_ref(new_handle->proc);
-               new_handle->type = ASYNC_TCP_CONNECTION;
-               new_handle->socket = socket;
-               if (!CreateIoCompletionPort((HANDLE)new_handle->socket, proc->iocp, (ULONG_PTR)new_handle, 0)) {
-                  async_process_unref(new_handle->proc);
-                  closesocket(new_handle->socket);
-                  free(new_handle);
-               }
-               else {
-                  result = fixscript_create_handle(heap, HANDLE_TYPE_ASYNC, new_handle, free_async_handle);
-               }
-            }
+#if defined(_WIN32)
+   ret = send_file_chunk(handle->socket, file, off, len, buf, sizeof(buf));
+#else
+   ret = send_file_chunk(handle->fd, file, off, len, buf, sizeof(buf));
+#endif
+   if (ret == -2) {
+      *error = fixscript_create_error_string(heap, "unexpected end of file");
+      return fixscript_int(0);
+   }
+   if (ret < 0) {
+      *error = fixscript_create_error_string(heap, "I/O error");
+      return fixscript_int(0);
+   }
+   return fixscript_int(ret);
+#endif /* __wasm__ */
+}
 
-            callback = server_handle->callback;
-            data = server_handle->data;
-            server_handle->active = 0;
 
-            fixscript_call(heap, callback, 2, &callback_error, data, result);
-            if (callback_error.value) {
-               fixscript_dump_value(heap, callback_error, 1);
+#ifndef __wasm__
+static void *tcp_server_handle_func(Heap *heap, int op, void *p1, void *p2)
+{
+   TCPServerHandle *handle = p1;
+   switch (op) {
+      case HANDLE_OP_FREE:
+         if (__sync_sub_and_fetch(&handle->refcnt, 1) == 0) {
+            if (!handle->closed) {
+               #if defined(_WIN32)
+                  closesocket(handle->socket);
+               #elif defined(__wasm__)
+               #else
+                  close(handle->fd);
+               #endif
             }
-            fixscript_unref(heap, data);
+            free(handle);
          }
-      }
+         break;
+
+      case HANDLE_OP_COPY:
+         __sync_add_and_fetch(&handle->refcnt, 1);
+         return handle;
+   }
+   return NULL;
+}
+#endif
+
+
+static TCPServerHandle *get_tcp_server_handle(Heap *heap, Value *error, Value handle_val)
+{
+   TCPServerHandle *handle;
+
+   handle = fixscript_get_handle(heap, handle_val, HANDLE_TYPE_TCP_SERVER, NULL);
+   if (!handle) {
+      *error = fixscript_create_error_string(heap, "invalid TCP server handle");
+      return NULL;
+   }
+
+   if (handle->closed) {
+      *error = fixscript_create_error_string(heap, "TCP server is already closed");
+      return NULL;
    }
+
+   return handle;
+}
+
+
+static Value native_tcp_server_create(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+#if defined(__wasm__)
+   *error = fixscript_create_error_string(heap, "not supported");
+   return fixscript_int(0);
 #else
-   for (;;) {
-      handle = poll_get_event(proc->poll, &flags);
-      if (!handle) break;
+   int local_only = data == (void *)1;
+   TCPServerHandle *handle;
+   struct sockaddr_in server;
+#if defined(_WIN32)
+   SOCKET sock = INVALID_SOCKET;
+#else
+   int fd = -1;
+#endif
+   int reuse;
+   Value retval = fixscript_int(0);
 
-      if (handle->type == ASYNC_TCP_CONNECTION) {
-         if (flags & ASYNC_READ) {
-            if (handle->active & ASYNC_READ) {
-               Value callback, data;
-               char *buf;
-               int err = 0, result = -1;
+#if defined(_WIN32)
+   sock = socket(AF_INET, SOCK_STREAM, 0);
+   if (sock == INVALID_SOCKET) {
+      goto io_error;
+   }
 
-               callback = handle->read.callback;
-               data = handle->read.data;
-               handle->active &= ~ASYNC_READ;
+   reuse = 1;
+   if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuse, sizeof(reuse)) < 0) {
+      goto io_error;
+   }
 
-               err = fixscript_lock_array(heap, handle->read.array, handle->read.off, handle->read.len, (void **)&buf, 1, ACCESS_WRITE_ONLY);
-               if (!err) {
-                  result = read(handle->fd, buf, handle->read.len);
-                  handle->read.len = result;
-                  if (handle->read.len < 0) handle->read.len = 0;
-                  fixscript_unlock_array(heap, handle->read.array, handle->read.off, handle->read.len, (void **)&buf, 1, ACCESS_WRITE_ONLY);
-               }
-               fixscript_unref(heap, handle->read.array);
+   server.sin_family = AF_INET;
+   server.sin_addr.s_addr = htonl(local_only? INADDR_LOOPBACK : INADDR_ANY);
+   server.sin_port = htons(params[0].value);
 
-               fixscript_call(heap, callback, 2, &callback_error, data, fixscript_int(result));
-               if (callback_error.value) {
-                  fixscript_dump_value(heap, callback_error, 1);
-               }
-               fixscript_unref(heap, data);
-            }
-         }
-         if (flags & ASYNC_WRITE) {
-            if (handle->active & ASYNC_WRITE) {
-               Value callback, data;
+   if (bind(sock, (struct sockaddr *)&server, sizeof(server)) == SOCKET_ERROR) {
+      goto io_error;
+   }
 
-               callback = handle->write.callback;
-               data = handle->write.data;
-               handle->active &= ~ASYNC_WRITE;
+   if (listen(sock, 5) == SOCKET_ERROR) {
+      goto io_error;
+   }
+#else
+   fd = socket(AF_INET, SOCK_STREAM, 0);
+   if (fd == -1) {
+      goto io_error;
+   }
 
-               fixscript_call(heap, callback, 2, &callback_error, data, fixscript_int(handle->write.result));
-               if (callback_error.value) {
-                  fixscript_dump_value(heap, callback_error, 1);
-               }
-               fixscript_unref(heap, data);
-            }
-         }
-         update_poll_ctl(handle);
-      }
-      else if (handle->type == ASYNC_TCP_SERVER) {
-         AsyncServerHandle *server_handle = (AsyncServerHandle *)handle;
-         AsyncHandle *new_handle;
-         if (flags & ASYNC_READ) {
-            Value callback, data;
-            Value result = fixscript_int(0);
-            int fd, flag;
-            fd = accept(server_handle->fd, NULL, NULL);
-            if (fd >= 0) {
-               flag = 1;
-               setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(int));
-               flag = fcntl(fd, F_GETFL);
-               flag |= O_NONBLOCK;
-               fcntl(fd, F_SETFL, flag);
+   reuse = 1;
+   if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuse, sizeof(reuse)) < 0) {
+      goto io_error;
+   }
 
-               new_handle = calloc(1, sizeof(AsyncHandle));
-               if (!new_handle) {
-                  close(fd);
-               }
-               else {
-                  new_handle->proc = proc;
-                  async_process_ref(new_handle->proc);
-                  new_handle->type = ASYNC_TCP_CONNECTION;
-                  new_handle->fd = fd;
-                  if (!poll_add_socket(proc->poll, fd, new_handle, 0)) {
-                     async_process_unref(new_handle->proc);
-                     close(new_handle->fd);
-                     free(new_handle);
-                  }
-                  else {
-                     result = fixscript_create_handle(heap, HANDLE_TYPE_ASYNC, new_handle, free_async_handle);
-                  }
-               }
-            }
+   server.sin_family = AF_INET;
+   server.sin_addr.s_addr = htonl(local_only? INADDR_LOOPBACK : INADDR_ANY);
+   server.sin_port = htons(params[0].value);
 
-            callback = server_handle->callback;
-            data = server_handle->data;
-            server_handle->active = 0;
+   if (bind(fd, (struct sockaddr *)&server, sizeof(server)) < 0) {
+      goto io_error;
+   }
 
-            fixscript_call(heap, callback, 2, &callback_error, data, result);
-            if (callback_error.value) {
-               fixscript_dump_value(heap, callback_error, 1);
-            }
-            fixscript_unref(heap, data);
-         }
-         update_poll_ctl(handle);
-      }
+   if (listen(fd, 5) < 0) {
+      goto io_error;
    }
 #endif
 
-   pthread_mutex_lock(&proc->mutex);
-   atr = proc->thread_results;
-   proc->thread_results = NULL;
-   pthread_mutex_unlock(&proc->mutex);
-
-   while (atr) {
-      if (atr->type == ASYNC_TCP_CONNECTION) {
-         #ifdef _WIN32
-         if (atr->socket != INVALID_SOCKET)
-         #else
-         if (atr->fd != -1)
-         #endif
-         {
-            handle = calloc(1, sizeof(AsyncHandle));
-            if (!handle) {
-               #ifdef _WIN32
-               closesocket(handle->socket);
-               #else
-               close(handle->fd);
-               #endif
-               fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
-               goto error;
-            }
-            handle->proc = proc;
-            async_process_ref(handle->proc);
-            handle->type = ASYNC_TCP_CONNECTION;
-            #ifdef _WIN32
-            handle->socket = atr->socket;
-            if (!CreateIoCompletionPort((HANDLE)handle->socket, proc->iocp, (ULONG_PTR)handle, 0)) {
-               async_process_unref(handle->proc);
-               closesocket(handle->socket);
-               free(handle);
-               *error = fixscript_create_error_string(heap, "can't add socket to IO completion port");
-               goto error;
-            }
-            #else
-            handle->fd = atr->fd;
-            if (!poll_add_socket(proc->poll, atr->fd, handle, 0)) {
-               async_process_unref(handle->proc);
-               close(handle->fd);
-               free(handle);
-               *error = fixscript_create_error_string(heap, "can't add socket to poll");
-               goto error;
-            }
-            #endif
-
-            handle_val = fixscript_create_handle(heap, HANDLE_TYPE_ASYNC, handle, free_async_handle);
-            if (!handle_val.value) {
-               fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
-               goto error;
-            }
-         }
-         else {
-            handle_val = fixscript_int(0);
-         }
-
-         fixscript_call(heap, atr->callback, 2, &callback_error, atr->data, handle_val);
-         if (callback_error.value) {
-            fixscript_dump_value(heap, callback_error, 1);
-         }
-         fixscript_unref(heap, atr->data);
-      }
-      atr_next = atr->next;
-      free(atr);
-      atr = atr_next;
+   handle = calloc(1, sizeof(TCPServerHandle));
+   if (!handle) {
+      fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      goto error;
    }
 
-   pthread_mutex_lock(&proc->mutex);
-   time_obtained = 0;
-   while (proc->timers) {
-      timer = proc->timers;
-      if (!timer->immediate) {
-         if (!time_obtained) {
-            time = get_time();
-            time_obtained = 1;
-         }
-         diff = (int32_t)(timer->time - time);
-         if (diff > 0) break;
-      }
-
-      proc->timers = timer->next;
-      pthread_mutex_unlock(&proc->mutex);
-
-      fixscript_call(heap, timer->callback, 1, &callback_error, timer->data);
-      if (callback_error.value) {
-         fixscript_dump_value(heap, callback_error, 1);
-      }
-      fixscript_unref(heap, timer->data);
-
-      free(timer);
+   handle->refcnt = 1;
+#if defined(_WIN32)
+   handle->socket = sock;
+#else
+   handle->fd = fd;
+#endif
 
-      pthread_mutex_lock(&proc->mutex);
+   retval = fixscript_create_value_handle(heap, HANDLE_TYPE_TCP_SERVER, handle, tcp_server_handle_func);
+#if defined(_WIN32)
+   sock = INVALID_SOCKET;
+#else
+   fd = -1;
+#endif
+   if (!retval.value) {
+      fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      goto error;
    }
-   pthread_mutex_unlock(&proc->mutex);
-   return 1;
 
 error:
-   while (atr) {
-      atr_next = atr->next;
-      free(atr);
-      atr = atr_next;
+#if defined(_WIN32)
+   if (!retval.value && sock != INVALID_SOCKET) {
+      closesocket(sock);
    }
-   return 0;
-}
-#endif /* __wasm__ */
-
-
-static Value native_async_process(Heap *heap, Value *error, int num_params, Value *params, void *func_data)
-{
-#if defined(__wasm__)
-   *error = fixscript_create_error_string(heap, "not supported");
-   return fixscript_int(0);
 #else
-   AsyncProcess *proc;
-   int timeout = -1, infinite;
-   Value quit_value;
-   
-   proc = get_async_process(heap, error);
-   if (!proc) return fixscript_int(0);
-   
-   if (proc->foreign_notify_func) {
-      *error = fixscript_create_error_string(heap, "can't use async_process when integrated with other event loop");
-      return fixscript_int(0);
-   }
-
-   if (num_params == 1) {
-      timeout = fixscript_get_int(params[0]);
-   }
-
-   fixscript_unref(heap, proc->quit_value);
-   infinite = (timeout < 0);
-   proc->quit = !infinite;
-   proc->quit_value = fixscript_int(0);
-
-   if (infinite) {
-      timeout = -1;
-   }
-
-   do {
-      wait_events(proc, timeout);
-      if (!process_events(proc, heap, error)) {
-         return fixscript_int(0);
-      }
+   if (!retval.value && fd != -1) {
+      close(fd);
    }
-   while (!proc->quit);
+#endif
+   return retval;
 
-   quit_value = proc->quit_value;
-   proc->quit_value = fixscript_int(0);
-   fixscript_unref(heap, quit_value);
-   return quit_value;
+io_error:
+   *error = fixscript_create_error_string(heap, "I/O error");
+   goto error;
 #endif /* __wasm__ */
 }
 
 
-static Value native_async_run_later(Heap *heap, Value *error, int num_params, Value *params, void *data)
+static Value native_tcp_server_close(Heap *heap, Value *error, int num_params, Value *params, void *data)
 {
-#if defined(__wasm__)
-   *error = fixscript_create_error_string(heap, "not supported");
-   return fixscript_int(0);
-#else
-   AsyncProcess *proc;
-   AsyncTimer *timer, *t, **p;
-   int32_t diff;
-
-   proc = get_async_process(heap, error);
-   if (!proc) return fixscript_int(0);
-
-   timer = calloc(1, sizeof(AsyncTimer));
-   if (!timer) {
-      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
-   }
+   TCPServerHandle *handle;
 
-   if (params[0].value == 0) {
-      timer->immediate = 1;
-   }
-   else {
-      timer->time = get_time() + (uint32_t)params[0].value;
+   handle = get_tcp_server_handle(heap, error, params[0]);
+   if (!handle) {
+      return fixscript_int(0);
    }
 
-   timer->callback = params[1];
-   timer->data = params[2];
-   fixscript_ref(heap, timer->data);
-
-   pthread_mutex_lock(&proc->mutex);
-   if (timer->immediate || !proc->timers) {
-      timer->next = proc->timers;
-      proc->timers = timer;
-   }
-   else {
-      p = &proc->timers;
-      for (t=proc->timers; t; t=t->next) {
-         diff = (int32_t)(timer->time - t->time);
-         if (!t->immediate && diff <= 0) {
-            timer->next = t;
-            *p = timer;
-            break;
-         }
-         if (!t->next) {
-            t->next = timer;
-            break;
-         }
-         p = &t->next;
-      }
+   handle->closed = 1;
+#if defined(_WIN32)
+   if (closesocket(handle->socket) != 0) {
+      *error = fixscript_create_error_string(heap, "I/O error");
+      return fixscript_int(0);
    }
-   pthread_mutex_unlock(&proc->mutex);
-
-   if (proc->foreign_notify_func) {
-      async_process_notify(proc);
+#elif defined(__wasm__)
+   *error = fixscript_create_error_string(heap, "not supported");
+#else
+   if (close(handle->fd) == -1) {
+      *error = fixscript_create_error_string(heap, "I/O error");
+      return fixscript_int(0);
    }
+#endif
    return fixscript_int(0);
-#endif /* __wasm__ */
 }
 
 
-static Value native_async_quit(Heap *heap, Value *error, int num_params, Value *params, void *data)
+static Value native_tcp_server_accept(Heap *heap, Value *error, int num_params, Value *params, void *data)
 {
 #if defined(__wasm__)
    *error = fixscript_create_error_string(heap, "not supported");
    return fixscript_int(0);
 #else
-   AsyncProcess *proc;
-   Value quit_value = fixscript_int(0);
-   
-   proc = get_async_process(heap, error);
-   if (!proc) return fixscript_int(0);
-   
-   if (proc->foreign_notify_func) {
-      *error = fixscript_create_error_string(heap, "can't use async_quit when integrated with other event loop");
+   TCPServerHandle *handle;
+   TCPConnectionHandle *conn_handle;
+   Value retval;
+   int timeout = fixscript_get_int(params[1]);
+#if defined(_WIN32)
+   fd_set readfds;
+   TIMEVAL timeval;
+   SOCKET sock;
+#else
+   struct pollfd pfd;
+   int fd;
+#endif
+   int ret, flag;
+
+   handle = get_tcp_server_handle(heap, error, params[0]);
+   if (!handle) {
       return fixscript_int(0);
    }
 
-   if (num_params == 1) {
-      quit_value = params[0];
+#if defined(_WIN32)
+   if (timeout >= 0) {
+      FD_ZERO(&readfds);
+      FD_SET(handle->socket, &readfds);
+      timeval.tv_sec = timeout / 1000;
+      timeval.tv_usec = (timeout % 1000) * 1000;
+      ret = select(1, &readfds, NULL, NULL, &timeval);
+      if (ret == SOCKET_ERROR) {
+         *error = fixscript_create_error_string(heap, "I/O error");
+         return fixscript_int(0);
+      }
+      if (ret == 0) {
+         return fixscript_int(0);
+      }
+   }
+   sock = accept(handle->socket, NULL, NULL);
+   if (sock == INVALID_SOCKET) {
+      if (WSAGetLastError() == WSAEWOULDBLOCK) {
+         return fixscript_int(0);
+      }
+      *error = fixscript_create_error_string(heap, "I/O error");
+      return fixscript_int(0);
    }
 
-   fixscript_unref(heap, proc->quit_value);
-   proc->quit = 1;
-   proc->quit_value = quit_value;
-   fixscript_ref(heap, proc->quit_value);
-
-   return fixscript_int(0);
+   flag = 1;
+   setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(int));
+#else
+   if (timeout >= 0) {
+      pfd.fd = handle->fd;
+      pfd.events = POLLIN;
+      ret = poll(&pfd, 1, timeout);
+      if (ret < 0) {
+         *error = fixscript_create_error_string(heap, "I/O error");
+         return fixscript_int(0);
+      }
+      if (ret == 1) {
+         ret = 0;
+         if (pfd.revents & POLLIN) ret = 1;
+      }
+      if (ret == 0) {
+         return fixscript_int(0);
+      }
+   }
+   fd = accept(handle->fd, NULL, NULL);
+   if (fd < 0) {
+      if (errno == EAGAIN) {
+         return fixscript_int(0);
+      }
+      *error = fixscript_create_error_string(heap, "I/O error");
+      return fixscript_int(0);
+   }
+
+   flag = 1;
+   setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(int));
+#endif
+
+   conn_handle = calloc(1, sizeof(TCPConnectionHandle));
+   if (!conn_handle) {
+      #if defined(_WIN32)
+         closesocket(sock);
+      #else
+         close(fd);
+      #endif
+      fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      return fixscript_int(0);
+   }
+
+   conn_handle->refcnt = 1;
+#if defined(_WIN32)
+   conn_handle->socket = sock;
+#else
+   conn_handle->fd = fd;
+#endif
+
+   retval = fixscript_create_value_handle(heap, HANDLE_TYPE_TCP_CONNECTION, conn_handle, tcp_connection_handle_func);
+   if (!retval.value) {
+      fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      return fixscript_int(0);
+   }
+
+   return retval;
 #endif /* __wasm__ */
 }
 
 
-#ifndef __wasm__
-static void *process_handle_func(Heap *heap, int op, void *p1, void *p2)
+#define READ_BUFFER_INITIAL_SIZE 4096
+
+typedef struct {
+   Heap *heap;
+   unsigned char *data;
+   int size, start, len;
+   int max_size;
+} ReadBuffer;
+
+
+static void free_read_buffer(void *ptr)
 {
-   ProcessHandle *handle = p1;
-   switch (op) {
-      case HANDLE_OP_FREE:
-         if (__sync_sub_and_fetch(&handle->refcnt, 1) == 0) {
-            #if defined(_WIN32)
-               if (handle->flags & REDIR_IN) CloseHandle(handle->in);
-               if (handle->flags & REDIR_OUT) CloseHandle(handle->out);
-               if (handle->flags & REDIR_ERR) CloseHandle(handle->err);
-               if (handle->process != ERROR_INVALID_HANDLE) {
-                  CloseHandle(handle->process);
-               }
-            #elif defined(__wasm__)
-            #else
-               if (handle->flags & REDIR_IN) close(handle->in_fd);
-               if (handle->flags & REDIR_OUT) close(handle->out_fd);
-               if (handle->flags & REDIR_ERR) close(handle->err_fd);
-            #endif
-            free(handle);
-         }
-         break;
+   ReadBuffer *rb = ptr;
 
-      case HANDLE_OP_COPY:
-         __sync_add_and_fetch(&handle->refcnt, 1);
-         return handle;
-   }
-   return NULL;
+   fixscript_adjust_heap_size(rb->heap, -rb->size);
+   free(rb->data);
+   free(rb);
 }
-#endif
 
 
-static Value native_process_create(Heap *heap, Value *error, int num_params, Value *params, void *data)
+static ReadBuffer *get_read_buffer(Heap *heap, Value *error, Value handle_val)
 {
-#if defined(_WIN32)
-   ProcessHandle *handle;
-   Value *arg_values = NULL, key_val, value_val, handle_val, ret = fixscript_int(0);
-   uint16_t **args = NULL, *p, *cmdline = NULL, **envs = NULL, *key, *value, *envblock = NULL, *path = NULL;
-   DWORD proc_flags = 0;
-   STARTUPINFO si;
-   PROCESS_INFORMATION pi;
-   SECURITY_ATTRIBUTES sa;
-   HANDLE pipes[6];
-   HANDLE in_other, out_other, err_other;
-   int flags = params[3].value;
-   int num_args=0, total_len, len, num_envs=0, num_pipes;
-   int i, j, err, needs_quotes, pos, idx;
+   ReadBuffer *rb;
 
-   if (flags & REDIR_MERGE_ERR) {
-      if ((flags & (REDIR_OUT | REDIR_ERR)) != REDIR_OUT) {
-         *error = fixscript_create_error_string(heap, "incompatible flags");
-         goto error;
-      }
+   rb = fixscript_get_handle(heap, handle_val, HANDLE_TYPE_READ_BUFFER, NULL);
+   if (!rb) {
+      *error = fixscript_create_error_string(heap, "invalid read buffer handle");
+      return NULL;
    }
+   return rb;
+}
 
-   err = fixscript_get_array_length(heap, params[0], &num_args);
-   if (!err) {
-      if (num_args < 1) {
-         *error = fixscript_create_error_string(heap, "must provide executable argument");
-         goto error;
+
+// makes sure there is some free space, returns the size of the contiguous free space after the data:
+static int read_buffer_reserve(ReadBuffer *rb)
+{
+   unsigned char *data;
+   int new_size, end, amount;
+
+   if (rb->len == rb->size) {
+      if (rb->size >= rb->max_size) {
+         return 0;
       }
-      arg_values = calloc(num_args, sizeof(Value));
-      if (!arg_values) {
-         err = FIXSCRIPT_ERR_OUT_OF_MEMORY;
+      new_size = rb->size * 2;
+      data = malloc(new_size);
+      if (!data) {
+         return -1;
       }
+      amount = rb->size - rb->start;
+      memcpy(data, rb->data + rb->start, amount);
+      memcpy(data + amount, rb->data, rb->len - amount);
+      fixscript_adjust_heap_size(rb->heap, new_size - rb->size);
+      free(rb->data);
+      rb->data = data;
+      rb->size = new_size;
+      rb->start = 0;
    }
-   if (!err) {
-      err = fixscript_get_array_range(heap, params[0], 0, num_args, arg_values);
+
+   if (rb->len == 0) {
+      rb->start = 0;
    }
-   if (!err) {
-      args = calloc(num_args, sizeof(uint8_t *));
-      if (!args) {
-         err = FIXSCRIPT_ERR_OUT_OF_MEMORY;
-      }
+   end = (rb->start + rb->len) & (rb->size - 1);
+   if (end < rb->start || (end == rb->start && rb->len > 0)) {
+      return rb->start - end;
    }
-   if (!err) {
-      for (i=0; i<num_args; i++) {
-         err = fixscript_get_string_utf16(heap, arg_values[i], 0, -1, &args[i], NULL);
-         if (err) break;
-      }
+   return rb->size - end;
+}
+
+
+static void read_buffer_consume(ReadBuffer *rb, int len)
+{
+   rb->start = (rb->start + len) & (rb->size - 1);
+   rb->len -= len;
+   if (rb->len == 0) {
+      rb->start = 0;
    }
-   if (!err) {
-      total_len = 0;
-      for (i=0; i<num_args; i++) {
-         if (i > 0) total_len++;
-         needs_quotes = 0;
-         for (p = args[i]; *p; p++) {
-            if (*p == ' ' || *p == '"') {
-               needs_quotes = 1;
-               break;
-            }
-         }
-         if (needs_quotes) {
-            total_len += 2;
-         }
-         for (p = args[i]; *p; p++) {
-            if (*p == '"') {
-               total_len += 3;
-               continue;
-            }
-            total_len++;
-         }
-      }
-      cmdline = calloc(total_len+1, sizeof(uint16_t));
-      if (!cmdline) {
-         err = FIXSCRIPT_ERR_OUT_OF_MEMORY;
+}
+
+
+static int read_buffer_find(ReadBuffer *rb, const unsigned char *delim, int delim_len, int pos)
+{
+   int mask = rb->size - 1;
+   int i, amount, last = rb->len - delim_len;
+   unsigned char *p, *found;
+
+   while (pos <= last) {
+      // search for the first byte of the delimiter in the contiguous part:
+      p = rb->data + ((rb->start + pos) & mask);
+      amount = rb->data + rb->size - p;
+      if (amount > last - pos + 1) {
+         amount = last - pos + 1;
+      }
+      found = memchr(p, delim[0], amount);
+      if (!found) {
+         pos += amount;
+         continue;
       }
-   }
-   if (!err) {
-      for (i=0, j=0; i<num_args; i++) {
-         if (i > 0) {
-            cmdline[j++] = ' ';
-         }
-         needs_quotes = 0;
-         for (p = args[i]; *p; p++) {
-            if (*p == ' ' || *p == '"') {
-               needs_quotes = 1;
-               break;
-            }
-         }
-         if (needs_quotes) {
-            cmdline[j++] = '"';
-         }
-         for (p = args[i]; *p; p++) {
-            if (*p == '"') {
-               cmdline[j++] = '"';
-               cmdline[j++] = '"';
-               cmdline[j++] = '"';
-               continue;
-            }
-            cmdline[j++] = *p;
-         }
-         if (needs_quotes) {
-            cmdline[j++] = '"';
-         }
+      pos += found - p;
+      for (i=1; i<delim_len; i++) {
+         if (rb->data[(rb->start + pos + i) & mask] != delim[i]) break;
       }
-      cmdline[j] = 0;
-      if (j != total_len) {
-         err = FIXSCRIPT_ERR_OUT_OF_MEMORY;
+      if (i == delim_len) {
+         return pos;
       }
+      pos++;
    }
-   if (params[1].value) {
-      if (!err) {
-         err = fixscript_get_array_length(heap, params[1], &num_envs);
-      }
-      if (!err) {
-         envs = calloc(num_envs*2, sizeof(uint16_t *));
-         if (!envs) {
-            err = FIXSCRIPT_ERR_OUT_OF_MEMORY;
-         }
-      }
-      if (!err) {
-         pos = 0;
-         idx = 0;
-         while (fixscript_iter_hash(heap, params[1], &key_val, &value_val, &pos)) {
-            err = fixscript_get_string_utf16(heap, key_val, 0, -1, &key, NULL);
-            if (err) {
-               break;
-            }
-            err = fixscript_get_string_utf16(heap, value_val, 0, -1, &value, NULL);
-            if (err) {
-               free(key);
-               break;
-            }
-            envs[idx++] = key;
-            envs[idx++] = value;
-         }
-         if (!err && idx != num_envs*2) {
-            err = FIXSCRIPT_ERR_INVALID_ACCESS;
-         }
-      }
-      if (!err) {
-         total_len = 0;
-         for (i=0; i<num_envs; i++) {
-            total_len += wcslen(envs[i*2+0]);
-            total_len++;
-            total_len += wcslen(envs[i*2+1]);
-            total_len++;
-         }
-         envblock = calloc(total_len+1, sizeof(uint16_t));
-         if (!envblock) {
-            err = FIXSCRIPT_ERR_OUT_OF_MEMORY;
-         }
-      }
-      if (!err) {
-         for (i=0, j=0; i<num_envs; i++) {
-            len = wcslen(envs[i*2+0]);
-            memcpy(envblock+j, envs[i*2+0], len*2);
-            j += len;
-            envblock[j++] = '=';
-            
-            len = wcslen(envs[i*2+1]);
-            memcpy(envblock+j, envs[i*2+1], len*2);
-            j += len;
-            envblock[j++] = 0;
-         }
-         envblock[j] = 0;
-         if (j != total_len) {
-            err = FIXSCRIPT_ERR_OUT_OF_MEMORY;
-         }
-      }
-      proc_flags |= CREATE_UNICODE_ENVIRONMENT;
+   return -1;
+}
+
+
+static Value native_read_buffer_create(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+   ReadBuffer *rb;
+   Value ret;
+   int max_size = params[0].value;
+
+   if (max_size < 1 || max_size > (1 << 30)) {
+      *error = fixscript_create_error_string(heap, "invalid maximum size");
+      return fixscript_int(0);
    }
-   if (params[2].value) {
-      if (!err) {
-         err = fixscript_get_string_utf16(heap, params[2], 0, -1, &path, NULL);
-      }
+
+   rb = calloc(1, sizeof(ReadBuffer));
+   if (!rb) {
+      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
    }
-   if (err) {
-      fixscript_error(heap, error, err);
-      goto error;
+
+   rb->size = READ_BUFFER_INITIAL_SIZE;
+   rb->max_size = READ_BUFFER_INITIAL_SIZE;
+   while (rb->max_size < max_size) {
+      rb->max_size <<= 1;
+   }
+   rb->data = malloc(rb->size);
+   if (!rb->data) {
+      free(rb);
+      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
    }
+   rb->heap = heap;
+   fixscript_adjust_heap_size(heap, rb->size);
 
-   handle = calloc(1, sizeof(ProcessHandle));
-   if (!handle) {
-      fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
-      goto error;
+   ret = fixscript_create_handle(heap, HANDLE_TYPE_READ_BUFFER, rb, free_read_buffer);
+   if (!ret.value) {
+      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
    }
+   return ret;
+}
 
-   memset(&si, 0, sizeof(STARTUPINFO));
-   si.cb = sizeof(STARTUPINFO);
-   memset(&pi, 0, sizeof(PROCESS_INFORMATION));
 
-   if (flags & (REDIR_IN | REDIR_OUT | REDIR_ERR)) {
-      si.dwFlags |= STARTF_USESTDHANDLES | STARTF_USESHOWWINDOW;
-      si.wShowWindow = SW_HIDE;
 
-      memset(&sa, 0, sizeof(SECURITY_ATTRIBUTES));
-      sa.nLength = sizeof(SECURITY_ATTRIBUTES);
-      sa.bInheritHandle = 1;
+static Value native_read_buffer_get_length(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+   ReadBuffer *rb;
 
-      num_pipes = 0;
-      if (flags & REDIR_IN) num_pipes++;
-      if (flags & REDIR_OUT) num_pipes++;
-      if (flags & REDIR_ERR) num_pipes++;
-      for (i=0; i<num_pipes; i++) {
-         if (!CreatePipe(&pipes[i*2+0], &pipes[i*2+1], &sa, 0)) {
-            while (i > 0) {
-               i--;
-               CloseHandle(pipes[i*2+0]);
-               CloseHandle(pipes[i*2+1]);
-            }
-            *error = fixscript_create_error_string(heap, "can't create pipe");
-            free(handle);
-            goto error;
-         }
-      }
+   rb = get_read_buffer(heap, error, params[0]);
+   if (!rb) {
+      return fixscript_int(0);
+   }
+   return fixscript_int(data? rb->max_size - rb->len : rb->len);
+}
 
-      if (flags & REDIR_IN) {
-         num_pipes--;
-         handle->in = pipes[num_pipes*2+1];
-         in_other = pipes[num_pipes*2+0];
-         si.hStdInput = pipes[num_pipes*2+0];
-         SetHandleInformation(handle->in, HANDLE_FLAG_INHERIT, 0);
-      }
-      else {
-         si.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
-      }
 
-      if (flags & REDIR_OUT) {
-         num_pipes--;
-         handle->out = pipes[num_pipes*2+0];
-         out_other = pipes[num_pipes*2+1];
-         si.hStdOutput = pipes[num_pipes*2+1];
-         if (flags & REDIR_MERGE_ERR) {
-            si.hStdError = pipes[num_pipes*2+1];
-         }
-         SetHandleInformation(handle->out, HANDLE_FLAG_INHERIT, 0);
-      }
-      else {
-         si.hStdOutput = GetStdHandle(STD_OUTPUT_HANDLE);
-      }
+static Value native_read_buffer_fill(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+#if defined(__wasm__)
+   *error = fixscript_create_error_string(heap, "not supported");
+   return fixscript_int(0);
+#else
+   ReadBuffer *rb;
+   TCPConnectionHandle *handle;
+   int ret, amount;
 
-      if (flags & REDIR_ERR) {
-         num_pipes--;
-         handle->err = pipes[num_pipes*2+0];
-         err_other = pipes[num_pipes*2+1];
-         si.hStdError = pipes[num_pipes*2+1];
-         SetHandleInformation(handle->err, HANDLE_FLAG_INHERIT, 0);
-      }
-      else {
-         si.hStdError = GetStdHandle(STD_ERROR_HANDLE);
-      }
+   rb = get_read_buffer(heap, error, params[0]);
+   if (!rb) {
+      return fixscript_int(0);
    }
 
-   handle->refcnt = 1;
-   handle->flags = flags;
-   handle->process = ERROR_INVALID_HANDLE;
+   handle = get_tcp_connection_handle(heap, error, params[1]);
+   if (!handle) {
+      return fixscript_int(0);
+   }
 
-   handle_val = fixscript_create_value_handle(heap, HANDLE_TYPE_PROCESS, handle, process_handle_func);
-   if (!handle_val.value) {
-      fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
-      goto error;
+   amount = read_buffer_reserve(rb);
+   if (amount < 0) {
+      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+   }
+   if (amount == 0) {
+      *error = fixscript_create_error_string(heap, "read buffer is full");
+      return fixscript_int(0);
    }
 
-   if (!CreateProcess(NULL, cmdline, NULL, NULL, TRUE, proc_flags, envblock, path, &si, &pi)) {
-      *error = fixscript_create_error_string(heap, "can't start process");
-      goto error;
+   ret = tcp_connection_wait_read(handle, fixscript_get_int(params[2]));
+   if (ret < 0) {
+      *error = fixscript_create_error_string(heap, "I/O error");
+      return fixscript_int(0);
    }
-   
-   if (flags & REDIR_IN) {
-      CloseHandle(in_other);
+   if (ret == 0) {
+      return fixscript_int(0);
    }
-   if (flags & REDIR_OUT) {
-      CloseHandle(out_other);
+
+   ret = tcp_connection_recv(handle, (char *)rb->data + ((rb->start + rb->len) & (rb->size - 1)), amount);
+   if (ret == -2) {
+      *error = fixscript_create_error_string(heap, "I/O error");
+      return fixscript_int(0);
    }
-   if (flags & REDIR_ERR) {
-      CloseHandle(err_other);
+   if (ret > 0) {
+      rb->len += ret;
    }
+   return fixscript_int(ret);
+#endif
+}
 
-   CloseHandle(pi.hThread);
-   handle->process = pi.hProcess;
 
-   ret = handle_val;
+static Value native_read_buffer_append(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+   ReadBuffer *rb;
+   int err, off, len, amount, total = 0;
 
-error:
-   free(arg_values);
-   if (args) {
-      for (i=0; i<num_args; i++) {
-         free(args[i]);
-      }
-      free(args);
+   rb = get_read_buffer(heap, error, params[0]);
+   if (!rb) {
+      return fixscript_int(0);
    }
-   free(cmdline);
-   if (envs) {
-      for (i=0; i<num_envs*2; i++) {
-         free(envs[i]);
+
+   off = params[2].value;
+   len = params[3].value;
+   while (len > 0) {
+      amount = read_buffer_reserve(rb);
+      if (amount < 0) {
+         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
       }
-      free(envs);
+      if (amount == 0) {
+         break;
+      }
+      if (amount > len) {
+         amount = len;
+      }
+      err = fixscript_get_array_bytes(heap, params[1], off, amount, (char *)rb->data + ((rb->start + rb->len) & (rb->size - 1)));
+      if (err) {
+         return fixscript_error(heap, error, err);
+      }
+      rb->len += amount;
+      off += amount;
+      len -= amount;
+      total += amount;
    }
-   free(envblock);
-   free(path);
-   return ret;
-#elif defined(__wasm__)
-   *error = fixscript_create_error_string(heap, "not supported");
-   return fixscript_int(0);
-#else
-   ProcessHandle *handle = NULL;
-   Value *arg_values = NULL;
-   Value key_val, value_val, handle_val, ret = fixscript_int(0);
-   int flags = params[3].value;
-   char **args = NULL, **envs = NULL, *path = NULL, *key, *value;
-   int num_args=0, num_envs=0;
-   int i, err, pos, idx, own_handle=1;
-   int in_fds[2], out_fds[2], err_fds[2];
+   return fixscript_int(total);
+}
 
-   in_fds[0] = -1;
-   in_fds[1] = -1;
-   out_fds[0] = -1;
-   out_fds[1] = -1;
-   err_fds[0] = -1;
-   err_fds[1] = -1;
 
-   if (flags & REDIR_MERGE_ERR) {
-      if ((flags & (REDIR_OUT | REDIR_ERR)) != REDIR_OUT) {
-         *error = fixscript_create_error_string(heap, "incompatible flags");
-         goto error;
-      }
+static Value native_read_buffer_find(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+   ReadBuffer *rb;
+   unsigned char delim[16];
+   int err, len, pos;
+
+   rb = get_read_buffer(heap, error, params[0]);
+   if (!rb) {
+      return fixscript_int(0);
    }
 
-   err = fixscript_get_array_length(heap, params[0], &num_args);
-   if (!err) {
-      if (num_args < 1) {
-         *error = fixscript_create_error_string(heap, "must provide executable argument");
-         goto error;
-      }
-      arg_values = calloc(num_args, sizeof(Value));
-      if (!arg_values) {
-         err = FIXSCRIPT_ERR_OUT_OF_MEMORY;
-      }
+   err = fixscript_get_array_length(heap, params[1], &len);
+   if (!err && (len < 1 || len > (int)sizeof(delim))) {
+      *error = fixscript_create_error_string(heap, "invalid delimiter length");
+      return fixscript_int(0);
    }
    if (!err) {
-      err = fixscript_get_array_range(heap, params[0], 0, num_args, arg_values);
+      err = fixscript_get_array_bytes(heap, params[1], 0, len, (char *)delim);
    }
-   if (!err) {
-      args = calloc(num_args+1, sizeof(char *));
-      if (!args) {
-         err = FIXSCRIPT_ERR_OUT_OF_MEMORY;
-      }
+   if (err) {
+      return fixscript_error(heap, error, err);
    }
-   if (!err) {
-      for (i=0; i<num_args; i++) {
-         err = fixscript_get_string(heap, arg_values[i], 0, -1, &args[i], NULL);
-         if (err) break;
-      }
+
+   pos = params[2].value;
+   if (pos < 0) {
+      pos = 0;
    }
-   if (params[1].value) {
-      if (!err) {
-         err = fixscript_get_array_length(heap, params[1], &num_envs);
-      }
-      if (!err) {
-         envs = calloc(num_envs*2, sizeof(char *));
-         if (!envs) {
-            err = FIXSCRIPT_ERR_OUT_OF_MEMORY;
-         }
-      }
-      if (!err) {
-         pos = 0;
-         idx = 0;
-         while (fixscript_iter_hash(heap, params[1], &key_val, &value_val, &pos)) {
-            err = fixscript_get_string(heap, key_val, 0, -1, &key, NULL);
-            if (err) {
-               break;
-            }
-            err = fixscript_get_string(heap, value_val, 0, -1, &value, NULL);
-            if (err) {
-               free(key);
-               break;
-            }
-            envs[idx++] = key;
-            envs[idx++] = value;
-         }
-         if (!err && idx != num_envs*2) {
-            err = FIXSCRIPT_ERR_INVALID_ACCESS;
-         }
-      }
-   }
-   if (params[2].value) {
-      if (!err) {
-         err = fixscript_get_string(heap, params[2], 0, -1, &path, NULL);
-      }
+   return fixscript_int(read_buffer_find(rb, delim, len, pos));
+}
+
+
+static Value native_read_buffer_read(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+   ReadBuffer *rb;
+   int err, off, len, amount, total;
+
+   rb = get_read_buffer(heap, error, params[0]);
+   if (!rb) {
+      return fixscript_int(0);
    }
-   if (!err) {
-      handle = calloc(1, sizeof(ProcessHandle));
-      if (!handle) {
-         err = FIXSCRIPT_ERR_OUT_OF_MEMORY;
-      }
+
+   off = params[2].value;
+   len = params[3].value;
+   if (len < 0) {
+      *error = fixscript_create_error_string(heap, "negative length");
+      return fixscript_int(0);
    }
-   if (err) {
-      fixscript_error(heap, error, err);
-      goto error;
+   if (len > rb->len) {
+      len = rb->len;
    }
 
-   handle->refcnt = 1;
-   handle->flags = flags;
-   handle->ret_value = -1;
-   handle->in_fd = -1;
-   handle->out_fd = -1;
-   handle->err_fd = -1;
-
-   if (flags & REDIR_IN) {
-      if (pipe(in_fds) < 0) {
-         *error = fixscript_create_error_string(heap, "can't create pipe");
-         goto error;
-      }
+   total = len;
+   amount = rb->size - rb->start;
+   if (amount > len) {
+      amount = len;
    }
-
-   if (flags & REDIR_OUT) {
-      if (pipe(out_fds) < 0) {
-         *error = fixscript_create_error_string(heap, "can't create pipe");
-         goto error;
-      }
+   err = fixscript_set_array_bytes(heap, params[1], off, amount, (char *)rb->data + rb->start);
+   if (!err && amount < len) {
+      err = fixscript_set_array_bytes(heap, params[1], off + amount, len - amount, (char *)rb->data);
+   }
+   if (err) {
+      return fixscript_error(heap, error, err);
    }
 
-   if (flags & REDIR_ERR) {
-      if (pipe(err_fds) < 0) {
-         *error = fixscript_create_error_string(heap, "can't create pipe");
-         goto error;
-      }
+   if (params[4].value) {
+      read_buffer_consume(rb, total);
    }
+   return fixscript_int(total);
+}
 
-   handle->pid = fork();
 
-   if (handle->pid < 0) {
-      *error = fixscript_create_error_string(heap, "can't fork process");
-      goto error;
+static Value native_read_buffer_extract(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+   ReadBuffer *rb;
+   Value arr;
+   int err, len, amount;
+
+   rb = get_read_buffer(heap, error, params[0]);
+   if (!rb) {
+      return fixscript_int(0);
    }
 
-   handle_val = fixscript_create_value_handle(heap, HANDLE_TYPE_PROCESS, handle, process_handle_func);
-   own_handle = 0;
-   if (!handle_val.value) {
-      fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
-      goto error;
+   len = params[1].value;
+   if (len < 0 || len > rb->len) {
+      *error = fixscript_create_error_string(heap, "invalid length");
+      return fixscript_int(0);
    }
 
-   if (handle->pid == 0) {
-      if (flags & REDIR_IN) {
-         dup2(in_fds[0], 0);
-         close(in_fds[0]);
-         close(in_fds[1]);
-      }
-      if (flags & REDIR_OUT) {
-         dup2(out_fds[1], 1);
-         if (flags & REDIR_MERGE_ERR) {
-            dup2(out_fds[1], 2);
+   amount = rb->size - rb->start;
+   if (amount > len) {
+      amount = len;
+   }
+   if (data) {
+      // bytes are stored as individual characters:
+      arr = fixscript_create_string(heap, "", 0);
+      amount = 0;
+   }
+   else {
+      arr = fixscript_create_byte_array(heap, (char *)rb->data + rb->start, amount);
+   }
+   if (!arr.value) {
+      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+   }
+   if (amount < len) {
+      err = fixscript_set_array_length(heap, arr, len);
+      if (!err && data) {
+         amount = rb->size - rb->start;
+         if (amount > len) {
+            amount = len;
          }
-         close(out_fds[0]);
-         close(out_fds[1]);
-      }
-      if (flags & REDIR_ERR) {
-         dup2(err_fds[1], 2);
-         close(err_fds[0]);
-         close(err_fds[1]);
+         err = fixscript_set_array_bytes(heap, arr, 0, amount, (char *)rb->data + rb->start);
       }
-      if (path) {
-         chdir(path);
+      if (!err && amount < len) {
+         err = fixscript_set_array_bytes(heap, arr, amount, len - amount, (char *)rb->data);
       }
-      if (envs) {
-#ifdef __linux__
-         clearenv();
-#else
-         environ = NULL;
-#endif
-         for (i=0; i<num_envs; i++) {
-            setenv(envs[i*2+0], envs[i*2+1], 0);
-         }
+      if (err) {
+         return fixscript_error(heap, error, err);
       }
-      execvp(args[0], args);
-      exit(1);
-   }
-
-   if (flags & REDIR_IN) {
-      handle->in_fd = in_fds[1];
-      close(in_fds[0]);
-      in_fds[0] = -1;
-      in_fds[1] = -1;
    }
 
-   if (flags & REDIR_OUT) {
-      handle->out_fd = out_fds[0];
-      close(out_fds[1]);
-      out_fds[0] = -1;
-      out_fds[1] = -1;
+   if (params[2].value) {
+      read_buffer_consume(rb, len);
    }
+   return arr;
+}
 
-   if (flags & REDIR_ERR) {
-      handle->err_fd = err_fds[0];
-      close(err_fds[1]);
-      err_fds[0] = -1;
-      err_fds[1] = -1;
-   }
 
-   ret = handle_val;
+static Value native_read_buffer_skip(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+   ReadBuffer *rb;
+   int len;
 
-error:
-   free(arg_values);
-   if (args) {
-      for (i=0; i<num_args; i++) {
-         free(args[i]);
-      }
-      free(args);
-   }
-   if (envs) {
-      for (i=0; i<num_envs*2; i++) {
-         free(envs[i]);
-      }
-      free(envs);
+   rb = get_read_buffer(heap, error, params[0]);
+   if (!rb) {
+      return fixscript_int(0);
    }
-   free(path);
-   if (own_handle) {
-      free(handle);
+
+   len = params[1].value;
+   if (len < 0 || len > rb->len) {
+      *error = fixscript_create_error_string(heap, "invalid length");
+      return fixscript_int(0);
    }
-   if (in_fds[0] != -1) close(in_fds[0]);
-   if (in_fds[1] != -1) close(in_fds[1]);
-   if (out_fds[0] != -1) close(out_fds[0]);
-   if (out_fds[1] != -1) close(out_fds[1]);
-   if (err_fds[0] != -1) close(err_fds[0]);
-   if (err_fds[1] != -1) close(err_fds[1]);
-   return ret;
-#endif
+   read_buffer_consume(rb, len);
+   return fixscript_int(0);
 }
 
 
-static Value native_process_read(Heap *heap, Value *error, int num_params, Value *params, void *data)
+#ifndef __wasm__
+static void async_process_ref(AsyncProcess *proc)
 {
-#if defined(__wasm__)
-   *error = fixscript_create_error_string(heap, "not supported");
-   return fixscript_int(0);
-#else
-   ProcessHandle *handle = NULL;
-   char *buf;
-   int timeout;
-   int err;
-#ifdef _WIN32
-   DWORD ret;
-   HANDLE h;
-#else
-   int ret;
-   int fd = (int)(intptr_t)data;
+   __sync_add_and_fetch(&proc->refcnt, 1);
+}
 #endif
 
-   if (num_params == 5) {
-      handle = fixscript_get_handle(heap, params[0], HANDLE_TYPE_PROCESS, NULL);
-      if (!handle) {
-         *error = fixscript_create_error_string(heap, "invalid process handle");
-         return fixscript_int(0);
-      }
-      params++;
-
-#ifdef _WIN32
-      switch ((int)(intptr_t)data) {
-         case 1: h = (handle->flags & REDIR_OUT)? handle->out : INVALID_HANDLE_VALUE; break;
-         case 2: h = (handle->flags & REDIR_ERR)? handle->err : INVALID_HANDLE_VALUE; break;
-         default: h = INVALID_HANDLE_VALUE;
-      }
 
-      if (h == INVALID_HANDLE_VALUE) {
-         *error = fixscript_create_error_string(heap, "stream is not redirected");
-         return fixscript_int(0);
-      }
-#else
-      switch (fd) {
-         case 1: fd = (handle->flags & REDIR_OUT)? handle->out_fd : -1; break;
-         case 2: fd = (handle->flags & REDIR_ERR)? handle->err_fd : -1; break;
-         default: fd = -1;
+#ifndef __wasm__
+static void async_process_unref(AsyncProcess *proc)
+{
+   AsyncThreadResult *atr, *atr_next;
+   int i;
+   
+   if (__sync_sub_and_fetch(&proc->refcnt, 1) == 0) {
+      for (atr = proc->thread_results; atr; atr = atr_next) {
+         #if defined(_WIN32)
+            if (atr->socket != INVALID_SOCKET) {
+               closesocket(atr->socket);
+            }
+         #elif defined(__wasm__)
+         #else
+            if (atr->fd != -1) {
+               close(atr->fd);
+            }
+         #endif
+         if (atr->file_op) {
+            free(atr->file_op->buf);
+            free(atr->file_op);
+         }
+         atr_next = atr->next;
+         free(atr);
       }
-
-      if (fd == -1) {
-         *error = fixscript_create_error_string(heap, "stream is not redirected");
-         return fixscript_int(0);
+      #if defined(_WIN32)
+         CloseHandle(proc->iocp);
+      #elif defined(__wasm__)
+      #else
+         poll_destroy(proc->poll);
+      #endif
+      for (i=0; i<proc->timers_cnt; i++) {
+         free(proc->timers[i]);
       }
-#endif
+      free(proc->timers);
+      free(proc->timer_ids);
+      pthread_mutex_destroy(&proc->mutex);
+      free(proc);
    }
-   else {
-#ifdef _WIN32
-      switch ((int)(intptr_t)data) {
-         case 0: h = GetStdHandle(STD_INPUT_HANDLE); break;
-         default: h = INVALID_HANDLE_VALUE;
-      }
+}
 #endif
-   }
 
-   timeout = params[3].value;
 
-   err = fixscript_lock_array(heap, params[0], params[1].value, params[2].value, (void **)&buf, 1, ACCESS_WRITE_ONLY);
-   if (err) {
-      return fixscript_error(heap, error, err);
-   }
+#ifndef __wasm__
+static AsyncProcess *get_async_process(Heap *heap, Value *error)
+{
+   AsyncProcess *proc;
+   int err;
 
-#ifdef _WIN32
-   if (!ReadFile(h, buf, params[2].value, &ret, NULL)) {
-      ret = -1;
-   }
+   proc = fixscript_get_heap_data(heap, async_process_key);
+   if (!proc) {
+      proc = calloc(1, sizeof(AsyncProcess));
+      proc->refcnt = 1;
+      proc->timer_seq = TIMER_SEQ_START;
+      proc->timer_time_offset = TIMER_CLOCK_START - get_time();
+      if (pthread_mutex_init(&proc->mutex, NULL) != 0) {
+         free(proc);
+         *error = fixscript_create_error_string(heap, "can't create mutex");
+         return NULL;
+      }
+
+#if defined(_WIN32)
+      proc->iocp = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 0);
+      if (!proc->iocp) {
+         pthread_mutex_destroy(&proc->mutex);
+         free(proc);
+         *error = fixscript_create_error_string(heap, "can't create IO completion port");
+         return NULL;
+      }
 #else
-   ret = read(fd, buf, params[2].value);
-   if (ret < params[2].value) {
-      params[2].value = ret >= 0? ret : 0;
-   }
+      #ifndef __wasm__
+         proc->poll = poll_create();
+      #endif
+      if (!proc->poll) {
+         pthread_mutex_destroy(&proc->mutex);
+         free(proc);
+         *error = fixscript_create_error_string(heap, "can't create poll file descriptor");
+         return NULL;
+      }
 #endif
 
-   fixscript_unlock_array(heap, params[0], params[1].value, params[2].value, (void **)&buf, 1, ACCESS_WRITE_ONLY);
-   if (ret < 0) {
-      *error = fixscript_create_error_string(heap, "I/O error");
-      return fixscript_int(0);
+      err = fixscript_set_heap_data(heap, async_process_key, proc, (HandleFreeFunc)async_process_unref);
+      if (err) {
+         fixscript_error(heap, error, err);
+         return NULL;
+      }
    }
-   if (ret == 0) ret = -1;
-   return fixscript_int(ret);
-#endif /* __wasm__ */
+   return proc;
 }
+#endif
 
 
-static Value native_process_write(Heap *heap, Value *error, int num_params, Value *params, void *data)
+#ifndef __wasm__
+static void async_process_notify(AsyncProcess *proc)
 {
-#if defined(__wasm__)
-   *error = fixscript_create_error_string(heap, "not supported");
-   return fixscript_int(0);
-#else
-   ProcessHandle *handle = NULL;
-   char *buf;
-   int timeout;
-   int err;
-#ifdef _WIN32
-   DWORD ret;
-   HANDLE h;
+#if defined(_WIN32)
+   PostQueuedCompletionStatus(proc->iocp, 0, 0, (OVERLAPPED *)proc);
+#elif defined(__wasm__)
 #else
-   int ret;
-   int fd = (int)(intptr_t)data;
+   poll_interrupt(proc->poll);
+#endif
+}
 #endif
 
-   if (num_params == 5) {
-      handle = fixscript_get_handle(heap, params[0], HANDLE_TYPE_PROCESS, NULL);
-      if (!handle) {
-         *error = fixscript_create_error_string(heap, "invalid process handle");
-         return fixscript_int(0);
-      }
-      params++;
 
-#ifdef _WIN32
-      switch ((int)(intptr_t)data) {
-         case 0: h = (handle->flags & REDIR_IN)? handle->in : INVALID_HANDLE_VALUE; break;
-         default: h = INVALID_HANDLE_VALUE;
+static pthread_mutex_t *get_mutex(volatile pthread_mutex_t **mutex_ptr)
+{
+   pthread_mutex_t *mutex, *cur_mutex;
+
+   mutex = (pthread_mutex_t *)*mutex_ptr;
+   if (!mutex) {
+      mutex = calloc(1, sizeof(pthread_mutex_t));
+      if (!mutex) {
+         return NULL;
+      }
+      if (pthread_mutex_init(mutex, NULL) != 0) {
+         free(mutex);
+         return NULL;
+      }
+      cur_mutex = (pthread_mutex_t *)__sync_val_compare_and_swap(mutex_ptr, NULL, mutex);
+      if (cur_mutex) {
+         pthread_mutex_destroy(mutex);
+         free(mutex);
+         mutex = cur_mutex;
       }
+   }
+   return mutex;
+}
 
-      if (h == INVALID_HANDLE_VALUE) {
-         *error = fixscript_create_error_string(heap, "stream is not redirected");
-         return fixscript_int(0);
+
+#ifndef __wasm__
+static pthread_cond_t *get_cond(volatile pthread_cond_t **cond_ptr)
+{
+   pthread_cond_t *cond, *cur_cond;
+
+   cond = (pthread_cond_t *)*cond_ptr;
+   if (!cond) {
+      cond = calloc(1, sizeof(pthread_cond_t));
+      if (!cond) {
+         return NULL;
+      }
+      if (pthread_cond_init(cond, NULL) != 0) {
+         free(cond);
+         return NULL;
+      }
+      cur_cond = (pthread_cond_t *)__sync_val_compare_and_swap(cond_ptr, NULL, cond);
+      if (cur_cond) {
+         pthread_cond_destroy(cond);
+         free(cond);
+         cond = cur_cond;
       }
+   }
+   return cond;
+}
+#endif
+
+
+#ifndef __wasm__
+#if defined(_WIN32)
+static DWORD WINAPI thread_main(void *data)
 #else
-      switch (fd) {
-         case 0: fd = (handle->flags & REDIR_IN)? handle->in_fd : -1; break;
-         default: fd = -1;
+static void *thread_main(void *data)
+#endif
+{
+   pthread_mutex_t *mutex;
+   pthread_cond_t *cond;
+   ThreadTask *task;
+   ThreadFunc func;
+   void *func_data;
+   int timed_out;
+   
+   mutex = get_mutex(&threads_mutex);
+   cond = get_cond(&threads_cond);
+
+   pthread_mutex_lock(mutex);
+   for (;;) {
+      timed_out = 0;
+      while (!threads_queue || threads_cnt > threads_max) {
+         if (threads_cnt > threads_max || (timed_out && threads_cnt > threads_min)) {
+            threads_cnt--;
+            if (threads_cnt > threads_max && threads_idle_cnt > 0) {
+               pthread_cond_signal(cond);
+            }
+            pthread_mutex_unlock(mutex);
+            goto end;
+         }
+         threads_idle_cnt++;
+         timed_out = (pthread_cond_timedwait_relative(cond, mutex, threads_idle_timeout*1000000LL) == ETIMEDOUT);
+         threads_idle_cnt--;
       }
 
-      if (fd == -1) {
-         *error = fixscript_create_error_string(heap, "stream is not redirected");
-         return fixscript_int(0);
+      task = threads_queue;
+      threads_queue = task->next;
+      if (!threads_queue) {
+         threads_queue_last = NULL;
       }
-#endif
-   }
-   else {
-#ifdef _WIN32
-      switch ((int)(intptr_t)data) {
-         case 1: h = GetStdHandle(STD_OUTPUT_HANDLE); break;
-         case 2: h = GetStdHandle(STD_ERROR_HANDLE); break;
-         default: h = INVALID_HANDLE_VALUE;
+      threads_queue_len--;
+      if (threads_queue && threads_idle_cnt > 0) {
+         pthread_cond_signal(cond);
       }
-#endif
-   }
+      pthread_mutex_unlock(mutex);
 
-   timeout = params[3].value;
+      func = task->func;
+      func_data = task->data;
+      free(task);
+      func(func_data);
 
-   err = fixscript_lock_array(heap, params[0], params[1].value, params[2].value, (void **)&buf, 1, ACCESS_READ_ONLY);
-   if (err) {
-      return fixscript_error(heap, error, err);
+      pthread_mutex_lock(mutex);
+      threads_completed++;
    }
 
-#ifdef _WIN32
-   if (!WriteFile(h, buf, params[2].value, &ret, NULL)) {
-      ret = -1;
-   }
+end:
+#if defined(_WIN32)
+   return 0;
 #else
-   ret = write(fd, buf, params[2].value);
+   return NULL;
+#endif
+}
 #endif
 
-   fixscript_unlock_array(heap, params[0], params[1].value, params[2].value, (void **)&buf, 1, ACCESS_READ_ONLY);
 
-   if (ret < 0) {
-      *error = fixscript_create_error_string(heap, "I/O error");
-      return fixscript_int(0);
-   }
-   return fixscript_int(ret);
-#endif /* __wasm__ */
+#ifndef __wasm__
+#if defined(_WIN32)
+static DWORD WINAPI dedicated_thread_main(void *data)
+#else
+static void *dedicated_thread_main(void *data)
+#endif
+{
+   ThreadTask *task = data;
+
+   task->func(task->data);
+   free(task);
+
+#if defined(_WIN32)
+   return 0;
+#else
+   return NULL;
+#endif
 }
+#endif
 
 
-static Value native_process_close(Heap *heap, Value *error, int num_params, Value *params, void *data)
+#ifndef __wasm__
+// runs the function in a new thread outside of the pool (for long running functions):
+static int start_thread(ThreadFunc func, void *data)
 {
-#if defined(__wasm__)
-   *error = fixscript_create_error_string(heap, "not supported");
-   return fixscript_int(0);
-#else
-   ProcessHandle *handle = NULL;
-#ifdef _WIN32
-   DWORD ret;
-   HANDLE h;
+   ThreadTask *task;
+#if defined(_WIN32)
+   HANDLE handle;
 #else
-   int ret;
-   int fd = (int)(intptr_t)data;
+   pthread_t handle;
 #endif
 
-   handle = fixscript_get_handle(heap, params[0], HANDLE_TYPE_PROCESS, NULL);
-   if (!handle) {
-      *error = fixscript_create_error_string(heap, "invalid process handle");
-      return fixscript_int(0);
-   }
-
-#ifdef _WIN32
-   switch ((int)(intptr_t)data) {
-      case 0: h = (handle->flags & REDIR_IN)? handle->in : INVALID_HANDLE_VALUE; break;
-      case 1: h = (handle->flags & REDIR_OUT)? handle->out : INVALID_HANDLE_VALUE; break;
-      case 2: h = (handle->flags & REDIR_ERR)? handle->err : INVALID_HANDLE_VALUE; break;
-      default: h = INVALID_HANDLE_VALUE;
+   task = calloc(1, sizeof(ThreadTask));
+   if (!task) {
+      return 0;
    }
+   task->func = func;
+   task->data = data;
 
-   if (h == INVALID_HANDLE_VALUE) {
-      *error = fixscript_create_error_string(heap, "stream is not redirected");
-      return fixscript_int(0);
+#if defined(_WIN32)
+   handle = CreateThread(NULL, 0, dedicated_thread_main, task, 0, NULL);
+   if (!handle) {
+      free(task);
+      return 0;
    }
+   CloseHandle(handle);
 #else
-   switch (fd) {
-      case 0: fd = (handle->flags & REDIR_IN)? handle->in_fd : -1; break;
-      case 1: fd = (handle->flags & REDIR_OUT)? handle->out_fd : -1; break;
-      case 2: fd = (handle->flags & REDIR_ERR)? handle->err_fd : -1; break;
-      default: fd = -1;
-   }
-
-   if (fd == -1) {
-      *error = fixscript_create_error_string(heap, "stream is not redirected");
-      return fixscript_int(0);
+   if (pthread_create(&handle, NULL, dedicated_thread_main, task) != 0) {
+      free(task);
+      return 0;
    }
+   pthread_detach(handle);
+#endif
+   return 1;
+}
 #endif
 
-#ifdef _WIN32
-   ret = 0;
-   if (!CloseHandle(h)) {
-      ret = -1;
+
+#ifndef __wasm__
+static int start_pool_thread()
+{
+#if defined(_WIN32)
+   HANDLE handle;
+
+   handle = CreateThread(NULL, 0, thread_main, NULL, 0, NULL);
+   if (!handle) {
+      return 0;
    }
+   CloseHandle(handle);
 #else
-   ret = close(fd);
+   pthread_t handle;
+
+   if (pthread_create(&handle, NULL, thread_main, NULL) != 0) {
+      return 0;
+   }
+   pthread_detach(handle);
 #endif
 
-   if (ret < 0) {
-      *error = fixscript_create_error_string(heap, "I/O error");
-      return fixscript_int(0);
+   if (++threads_cnt > threads_peak) {
+      threads_peak = threads_cnt;
    }
-   return fixscript_int(0);
-#endif /* __wasm__ */
+   return 1;
 }
+#endif
 
 
-static Value native_process_wait(Heap *heap, Value *error, int num_params, Value *params, void *data)
+#ifndef __wasm__
+// runs the function in the shared thread pool, returns 0 when the queue is full:
+static int async_run_thread(ThreadFunc func, void *data)
 {
-#if defined(__wasm__)
-   *error = fixscript_create_error_string(heap, "not supported");
-   return fixscript_int(0);
-#else
-   ProcessHandle *handle;
-#ifdef _WIN32
-   DWORD result = 0xFFFFFFFF;
-#else
-   int status;
-#endif
+   pthread_mutex_t *mutex;
+   pthread_cond_t *cond;
+   ThreadTask *task;
 
-   handle = fixscript_get_handle(heap, params[0], HANDLE_TYPE_PROCESS, NULL);
-   if (!handle) {
-      *error = fixscript_create_error_string(heap, "invalid process handle");
-      return fixscript_int(0);
+   mutex = get_mutex(&threads_mutex);
+   if (!mutex) {
+      return 0;
    }
 
-#ifdef _WIN32
-   WaitForSingleObject(handle->process, INFINITE);
-   GetExitCodeProcess(handle->process, &result);
-   return fixscript_int(result);
-#else
-   if (handle->pid == 0) {
-      return fixscript_int(handle->ret_value);
+   cond = get_cond(&threads_cond);
+   if (!cond) {
+      return 0;
    }
 
-   if (waitpid(handle->pid, &status, 0) == handle->pid) {
-      handle->pid = 0;
-      if (WIFEXITED(status)) {
-         handle->ret_value = WEXITSTATUS(status);
-      }
-      return fixscript_int(handle->ret_value);
+   task = calloc(1, sizeof(ThreadTask));
+   if (!task) {
+      return 0;
    }
+   task->func = func;
+   task->data = data;
+   
+   pthread_mutex_lock(mutex);
 
-   handle->pid = 0;
-   *error = fixscript_create_error_string(heap, "I/O error");
-   return fixscript_int(0);
-#endif
-#endif /* __wasm__ */
-}
-
-
-static Value native_process_kill(Heap *heap, Value *error, int num_params, Value *params, void *data)
-{
-#if defined(__wasm__)
-   *error = fixscript_create_error_string(heap, "not supported");
-   return fixscript_int(0);
-#else
-   ProcessHandle *handle;
-   int force = 0;
-
-   handle = fixscript_get_handle(heap, params[0], HANDLE_TYPE_PROCESS, NULL);
-   if (!handle) {
-      *error = fixscript_create_error_string(heap, "invalid process handle");
-      return fixscript_int(0);
+   if (threads_idle_cnt <= threads_queue_len) {
+      if (threads_cnt < threads_max && start_pool_thread()) {
+         // the new thread picks the task from the queue
+      }
+      else if (threads_cnt == 0 || threads_queue_len - threads_idle_cnt >= threads_max_queued) {
+         threads_rejected++;
+         pthread_mutex_unlock(mutex);
+         free(task);
+         return 0;
+      }
    }
 
-#ifdef _WIN32
-   // TODO: send a message to GUI applications for non-forceful killing
-   if (handle->process != INVALID_HANDLE_VALUE) {
-      TerminateProcess(handle->process, 1);
+   if (threads_queue_last) {
+      threads_queue_last->next = task;
    }
-   return fixscript_int(0);
-#else
-   if (handle->pid == 0) {
-      return fixscript_int(0);
+   else {
+      threads_queue = task;
    }
-
-   if (num_params == 2) {
-      force = params[1].value;
+   threads_queue_last = task;
+   if (++threads_queue_len > threads_peak_queue_len) {
+      threads_peak_queue_len = threads_queue_len;
+   }
+   if (threads_idle_cnt > 0) {
+      pthread_cond_signal(cond);
    }
 
-   kill(handle->pid, force? SIGKILL : SIGTERM);
-   return fixscript_int(0);
-#endif
-#endif /* __wasm__ */
+   pthread_mutex_unlock(mutex);
+   return 1;
 }
+#endif
 
 
-static Value native_process_is_running(Heap *heap, Value *error, int num_params, Value *params, void *data)
+#ifndef __wasm__
+static void free_async_handle(void *data)
 {
-#if defined(__wasm__)
-   *error = fixscript_create_error_string(heap, "not supported");
-   return fixscript_int(0);
-#else
-   ProcessHandle *handle;
-#ifdef _WIN32
-   DWORD result;
-#else
-   pid_t ret;
-   int status;
+   AsyncHandle *handle = data;
+#if !defined(_WIN32) && !defined(__wasm__)
+   AsyncProcess *proc = handle->proc;
 #endif
 
-   handle = fixscript_get_handle(heap, params[0], HANDLE_TYPE_PROCESS, NULL);
-   if (!handle) {
-      *error = fixscript_create_error_string(heap, "invalid process handle");
-      return fixscript_int(0);
-   }
+#if !defined(_WIN32) && !defined(__wasm__)
+   poll_remove_socket(proc->poll, handle->fd);
+#endif
+   async_process_unref(handle->proc);
 
-#ifdef _WIN32
-   if (GetExitCodeProcess(handle->process, &result) && result == STILL_ACTIVE) {
-      return fixscript_int(1);
-   }
-   return fixscript_int(0);
-#else
-   if (handle->pid == 0) {
-      return fixscript_int(0);
+   if (handle->type == ASYNC_TCP_CONNECTION) {
+      if (handle->write.file) {
+         file_handle_func(NULL, HANDLE_OP_FREE, handle->write.file, NULL);
+      }
+      free(handle->write.file_buf);
    }
 
-   ret = waitpid(handle->pid, &status, WNOHANG);
-   if (ret == 0) {
-      return fixscript_int(1);
-   }
-   if (ret == handle->pid) {
-      handle->pid = 0;
-      if (WIFEXITED(status)) {
-         handle->ret_value = WEXITSTATUS(status);
+   if (handle->type == ASYNC_TCP_CONNECTION || handle->type == ASYNC_TCP_SERVER) {
+      #if defined(_WIN32)
+      if (handle->type == ASYNC_TCP_SERVER) {
+         closesocket(((AsyncServerHandle *)handle)->accept_socket);
       }
-      return fixscript_int(0);
+      closesocket(handle->socket);
+      #elif defined(__wasm__)
+      #else
+      close(handle->fd);
+      #endif
    }
-
-   handle->pid = 0;
-   *error = fixscript_create_error_string(heap, "I/O error");
-   return fixscript_int(0);
-#endif
-#endif /* __wasm__ */
+   free(handle);
 }
+#endif
 
 
-static Value native_process_get_id(Heap *heap, Value *error, int num_params, Value *params, void *data)
+#if !defined(_WIN32) && !defined(__wasm__)
+static void update_poll_ctl(AsyncHandle *handle)
 {
-#if defined(__wasm__)
-   *error = fixscript_create_error_string(heap, "not supported");
-   return fixscript_int(0);
-#else
-   ProcessHandle *handle;
-#ifdef _WIN32
-   DWORD ret;
-#endif
+   AsyncServerHandle *server_handle;
 
-   handle = fixscript_get_handle(heap, params[0], HANDLE_TYPE_PROCESS, NULL);
-   if (!handle) {
-      *error = fixscript_create_error_string(heap, "invalid process handle");
-      return fixscript_int(0);
+   if (handle->type == ASYNC_TCP_CONNECTION) {
+      if (handle->active != handle->last_active) {
+         poll_update_socket(handle->proc->poll, handle->fd, handle, handle->active);
+         handle->last_active = handle->active;
+      }
    }
-
-#ifdef _WIN32
-   if (handle->process != ERROR_INVALID_HANDLE) {
-      ret = GetProcessId(handle->process);
-      return fixscript_int(ret);
+   else if (handle->type == ASYNC_TCP_SERVER) {
+      server_handle = (AsyncServerHandle *)handle;
+      if (server_handle->active != server_handle->last_active) {
+         poll_update_socket(server_handle->proc->poll, server_handle->fd, server_handle, server_handle->active? ASYNC_READ : 0);
+         server_handle->last_active = server_handle->active;
+      }
    }
-   return fixscript_int(0);
-#else
-   return fixscript_int(handle->pid);
-#endif
-#endif /* __wasm__ */
 }
+#endif
 
 
-static Value native_process_get_current_environment(Heap *heap, Value *error, int num_params, Value *params, void *data)
+#ifndef __wasm__
+typedef struct {
+   AsyncProcess *proc;
+   char *hostname;
+   int port;
+   Value callback;
+   Value data;
+   AsyncThreadResult *atr;
+} TCPOpenData;
+
+static void tcp_open_func(void *data)
 {
+   TCPOpenData *tod = data;
+   AsyncProcess *proc = tod->proc;
+   AsyncThreadResult *atr = tod->atr;
 #if defined(_WIN32)
-   Value map, key_val, value_val;
-   uint16_t *env, *p, *key, *value;
-   int err;
+   u_long arg;
+#else
+   int flags;
+#endif
 
-   map = fixscript_create_hash(heap);
-   if (!map.value) {
-      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
-   }
+   atr->type = ASYNC_TCP_CONNECTION;
+   atr->callback = tod->callback;
+   atr->data = tod->data;
 
-   env = GetEnvironmentStrings();
-   for (p=env; *p; p++) {
-      key = p;
-      value = NULL;
-      for (; *p; p++) {
-         if (*p == '=') {
-            value = p+1;
-            break;
-         }
-      }
-      while (*p) {
-         p++;
-      }
-      if (value) {
-         key_val = fixscript_create_string_utf16(heap, key, value - key - 1);
-         value_val = fixscript_create_string_utf16(heap, value, -1);
-      }
-      else {
-         key_val = fixscript_create_string_utf16(heap, key, -1);
-         value_val = fixscript_create_string_utf16(heap, L"", -1);
-      }
-      if (!key_val.value || !value_val.value) {
-         FreeEnvironmentStrings(env);
-         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
-      }
-      err = fixscript_set_hash_elem(heap, map, key_val, value_val);
-      if (err) {
-         FreeEnvironmentStrings(env);
-         return fixscript_error(heap, error, err);
+#if defined(_WIN32)
+   if (tcp_connect(tod->hostname, tod->port, &atr->socket, 1)) {
+      arg = 1;
+      if (ioctlsocket(atr->socket, FIONBIO, &arg) != 0) {
+         closesocket(atr->socket);
+         atr->socket = INVALID_SOCKET;
       }
    }
-   FreeEnvironmentStrings(env);
-   return map;
-#elif defined(__wasm__)
-   *error = fixscript_create_error_string(heap, "not supported");
-   return fixscript_int(0);
-#else
-   Value map, key_val, value_val;
-   const char **p, *s, *key, *value;
-   int err;
-
-   map = fixscript_create_hash(heap);
-   if (!map.value) {
-      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+   else {
+      atr->socket = INVALID_SOCKET;
    }
-
-   for (p=(const char **)environ; *p; p++) {
-      s = *p;
-      key = s;
-      value = NULL;
-      for (; *s; s++) {
-         if (*s == '=') {
-            value = s+1;
-            break;
+#else
+   if (tcp_connect(tod->hostname, tod->port, &atr->fd)) {
+      flags = fcntl(atr->fd, F_GETFL);
+      if (flags != -1) {
+         flags |= O_NONBLOCK;
+         if (fcntl(atr->fd, F_SETFL, flags) == -1) {
+            close(atr->fd);
+            atr->fd = -1;
          }
       }
-      if (value) {
-         key_val = fixscript_create_string(heap, key, value - key - 1);
-         value_val = fixscript_create_string(heap, value, -1);
-      }
       else {
-         key_val = fixscript_create_string(heap, key, -1);
-         value_val = fixscript_create_string(heap, "", -1);
-      }
-      if (!key_val.value || !value_val.value) {
-         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
-      }
-      err = fixscript_set_hash_elem(heap, map, key_val, value_val);
-      if (err) {
-         return fixscript_error(heap, error, err);
+         close(atr->fd);
+         atr->fd = -1;
       }
    }
-   return map;
+   else {
+      atr->fd = -1;
+   }
 #endif
-}
 
+   pthread_mutex_lock(&proc->mutex);
+   atr->next = proc->thread_results;
+   proc->thread_results = atr;
+   async_process_notify(proc);
+   pthread_mutex_unlock(&proc->mutex);
 
-static Value native_clock_get_time(Heap *heap, Value *error, int num_params, Value *params, void *data)
+   async_process_unref(tod->proc);
+   free(tod->hostname);
+   free(tod);
+}
+#endif /* __wasm__ */
+
+static Value native_async_tcp_connection_open(Heap *heap, Value *error, int num_params, Value *params, void *data)
 {
 #if defined(__wasm__)
-   // TODO
+   *error = fixscript_create_error_string(heap, "not supported");
    return fixscript_int(0);
 #else
-   int micro = ((intptr_t)data == 1);
-   union {
-      int64_t time;
-      int32_t i[2];
-   } u;
-
-#ifdef _WIN32
-   FILETIME ft;
-
-   GetSystemTimeAsFileTime(&ft);
-   u.i[0] = ft.dwLowDateTime;
-   u.i[1] = ft.dwHighDateTime;
-   u.time = ((u.time + 5) / 10LL) - 11644473600000000LL;
-#else
-   struct timeval tv;
+   AsyncProcess *proc;
+   TCPOpenData *tod;
+   int err;
+   
+   proc = get_async_process(heap, error);
+   if (!proc) return fixscript_int(0);
 
-   if (gettimeofday(&tv, NULL) != 0) {
-      tv.tv_sec = 0;
-      tv.tv_usec = 0;
+   tod = calloc(1, sizeof(TCPOpenData));
+   if (!tod) {
+      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
    }
-
-   if (sizeof(time_t) == 4) {
-      // treat time_t as unsigned to give chance for possible unsigned hack once year 2038 happens:
-      u.time = ((uint32_t)tv.tv_sec) * 1000000LL + tv.tv_usec;
+   
+   tod->atr = calloc(1, sizeof(AsyncThreadResult));
+   if (!tod->atr) {
+      free(tod);
+      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
    }
-   else {
-      u.time = tv.tv_sec * 1000000LL + tv.tv_usec;
+
+   err = fixscript_get_string(heap, params[0], 0, -1, &tod->hostname, NULL);
+   if (err) {
+      free(tod->atr);
+      free(tod);
+      return fixscript_error(heap, error, err);
    }
-#endif
 
-   if (!micro) {
-      u.time = (u.time + 500) / 1000;
+   tod->proc = proc;
+   tod->port = fixscript_get_int(params[1]);
+   tod->callback = params[2];
+   tod->data = params[3];
+   async_process_ref(proc);
+   fixscript_ref(heap, tod->data);
+
+   if (!async_run_thread(tcp_open_func, tod)) {
+      async_process_unref(proc);
+      fixscript_unref(heap, tod->data);
+      free(tod->hostname);
+      free(tod->atr);
+      free(tod);
+      *error = fixscript_create_error_string(heap, "thread pool is full");
+      return fixscript_int(0);
    }
 
-   *error = fixscript_int(u.i[1]);
-   return fixscript_int(u.i[0]);
+   return fixscript_int(0);
 #endif /* __wasm__ */
 }
 
 
-static Value native_monotonic_get_time(Heap *heap, Value *error, int num_params, Value *params, void *data)
+#ifndef __wasm__
+static void async_file_func(void *data)
 {
-#if defined(__wasm__)
-   // TODO
-   return fixscript_int(0);
+   AsyncFileOp *op = data;
+   AsyncProcess *proc = op->proc;
+   AsyncThreadResult *atr = op->atr;
+#if defined(_WIN32)
+   OVERLAPPED overlapped;
+   DWORD amount;
 #else
-   int micro = ((intptr_t)data == 1);
-   uint64_t time;
+   ssize_t ret;
+#endif
+   int written = 0;
 
-#if defined(_WIN32)
-   uint64_t freq, cnt;
-   QueryPerformanceFrequency((LARGE_INTEGER *)&freq);
-   QueryPerformanceCounter((LARGE_INTEGER *)&cnt);
-   time = cnt * 1000000 / freq;
-#elif defined(__linux__)
-   struct timespec ts;
-   
-   if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
-      ts.tv_sec = 0;
-      ts.tv_nsec = 0;
-   }
+   switch (op->type) {
+      case FILE_OP_READ:
+         #if defined(_WIN32)
+            memset(&overlapped, 0, sizeof(OVERLAPPED));
+            overlapped.Offset = (DWORD)op->pos;
+            overlapped.OffsetHigh = (DWORD)(op->pos >> 32);
+            if (ReadFile(op->handle, op->buf, op->len, &amount, &overlapped)) {
+               op->result = amount;
+            }
+            else if (GetLastError() == ERROR_HANDLE_EOF) {
+               op->result = 0;
+            }
+            else {
+               op->failed = 1;
+            }
+         #else
+            do {
+               ret = pread(op->fd, op->buf, op->len, op->pos);
+            }
+            while (ret < 0 && errno == EINTR);
+            if (ret < 0) {
+               op->failed = 1;
+            }
+            else {
+               op->result = ret;
+            }
+         #endif
+         if (op->result == 0 && op->len > 0) {
+            op->result = -1;
+         }
+         break;
 
-   time = ts.tv_sec * 1000000LL + (ts.tv_nsec + 500) / 1000;
-#else
-   struct timeval tv;
+      case FILE_OP_WRITE:
+         while (written < op->len) {
+            #if defined(_WIN32)
+               memset(&overlapped, 0, sizeof(OVERLAPPED));
+               overlapped.Offset = (DWORD)(op->pos + written);
+               overlapped.OffsetHigh = (DWORD)((op->pos + written) >> 32);
+               if (!WriteFile(op->handle, op->buf + written, op->len - written, &amount, &overlapped) || amount == 0) {
+                  op->failed = 1;
+                  break;
+               }
+               written += amount;
+            #else
+               ret = pwrite(op->fd, op->buf + written, op->len - written, op->pos + written);
+               if (ret < 0 && errno == EINTR) continue;
+               if (ret <= 0) {
+                  op->failed = 1;
+                  break;
+               }
+               written += ret;
+            #endif
+         }
+         op->result = written;
+         break;
 
-   if (gettimeofday(&tv, NULL) != 0) {
-      tv.tv_sec = 0;
-      tv.tv_usec = 0;
+      case FILE_OP_SYNC:
+         #if defined(_WIN32)
+            if (!FlushFileBuffers(op->handle)) {
+         #elif defined(__APPLE__)
+            if (fcntl(op->fd, F_FULLFSYNC) != 0) {
+         #elif defined(__linux__)
+            if (fdatasync(op->fd) != 0) {
+         #else
+            if (fsync(op->fd) != 0) {
+         #endif
+               op->failed = 1;
+            }
+         break;
    }
 
-   time = tv.tv_sec * 1000000LL + tv.tv_usec;
+#if defined(_WIN32)
+   CloseHandle(op->handle);
+#else
+   close(op->fd);
 #endif
 
-   if (micro) {
-      return fixscript_int(time);
-   }
-   else {
-      return fixscript_int((time + 500) / 1000);
-   }
-#endif /* __wasm__ */
+   pthread_mutex_lock(&proc->mutex);
+   atr->next = proc->thread_results;
+   proc->thread_results = atr;
+   async_process_notify(proc);
+   pthread_mutex_unlock(&proc->mutex);
+
+   async_process_unref(proc);
 }
 
 
-static Value native_array_create_view(Heap *heap, Value *error, int num_params, Value *params, void *data)
-{
-   SharedArrayHandle *sah;
-   Value value;
-   char *ptr;
-   int arr_len, arr_elem_size;
-   int off, len, elem_size;
-   int created;
-   
-   sah = fixscript_get_shared_array_handle(heap, params[0], -1, NULL);
-   if (!sah) {
-      *error = fixscript_create_error_string(heap, "invalid shared array");
-      return fixscript_int(0);
-   }
+#if defined(_WIN32)
+typedef HANDLE (WINAPI *ReOpenFileFunc)(HANDLE, DWORD, DWORD, DWORD);
 
-   ptr = fixscript_get_shared_array_handle_data(sah, &arr_len, &arr_elem_size, NULL, -1, NULL);
+static volatile int reopen_file_init = 0;
+static ReOpenFileFunc func_ReOpenFile;
 
-   if (num_params >= 3) {
-      off = params[1].value;
-      len = params[2].value;
+// returns a separate handle of the same file (a duplicated handle shares the file position
+// with the original and positional I/O moves it on synchronous handles), NULL when not
+// supported (before Vista):
+static HANDLE reopen_file(FileHandle *handle)
+{
+   HMODULE lib;
+   DWORD access = 0;
+
+   if (reopen_file_init == 0) {
+      lib = GetModuleHandle(L"kernel32.dll");
+      if (lib) {
+         func_ReOpenFile = (void *)GetProcAddress(lib, "ReOpenFile");
+      }
+      reopen_file_init = func_ReOpenFile? 1 : -1;
    }
-   else {
-      off = 0;
-      len = arr_len;
+   if (reopen_file_init < 0) {
+      return NULL;
    }
 
-   elem_size = num_params == 2? params[1].value : num_params == 4? params[3].value : arr_elem_size;
-   if (elem_size != 1 && elem_size != 2 && elem_size != 4) {
-      *error = fixscript_create_error_string(heap, "element size must be 1, 2 or 4");
-      return fixscript_int(0);
+   if (handle->mode & SCRIPT_FILE_APPEND) {
+      access = FILE_APPEND_DATA;
    }
-
-   if (off < 0 || off >= arr_len || len < 0 || (int64_t)off + (int64_t)len > arr_len) {
-      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_BOUNDS);
+   else {
+      if (handle->mode & SCRIPT_FILE_READ) access |= GENERIC_READ;
+      if (handle->mode & SCRIPT_FILE_WRITE) access |= GENERIC_WRITE;
    }
+   return func_ReOpenFile(handle->handle, access, FILE_SHARE_DELETE | FILE_SHARE_READ | FILE_SHARE_WRITE, 0);
+}
+#endif
+#endif /* __wasm__ */
 
-   ptr += (intptr_t)off * arr_elem_size;
-   if ((((intptr_t)ptr) & (elem_size-1)) != 0) {
-      *error = fixscript_create_error_string(heap, "unaligned offset");
+static Value native_async_file_op(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+#if defined(__wasm__)
+   *error = fixscript_create_error_string(heap, "not supported");
+   return fixscript_int(0);
+#else
+   AsyncProcess *proc;
+   AsyncFileOp *op;
+   FileHandle *handle;
+   int type = (intptr_t)data;
+   int64_t pos = 0;
+   int off = 0, len = 0, array_len, err;
+#if defined(_WIN32)
+   LARGE_INTEGER zero, saved_pos;
+   int run_directly = 0;
+#endif
+
+   proc = get_async_process(heap, error);
+   if (!proc) return fixscript_int(0);
+
+   handle = get_file_handle(heap, error, params[0]);
+   if (!handle) {
       return fixscript_int(0);
    }
 
-   value = fixscript_get_shared_array(heap, -1, ptr, len, elem_size, sah);
-   if (value.value) {
-      return value;
+   if (type == FILE_OP_READ && (handle->mode & SCRIPT_FILE_READ) == 0) {
+      *error = fixscript_create_error_string(heap, "file not opened for reading");
+      return fixscript_int(0);
+   }
+   if (type == FILE_OP_WRITE && (handle->mode & SCRIPT_FILE_WRITE) == 0) {
+      *error = fixscript_create_error_string(heap, "file not opened for writing");
+      return fixscript_int(0);
    }
 
-   fixscript_ref_shared_array(sah);
-   value = fixscript_create_or_get_shared_array(heap, -1, ptr, (intptr_t)len * arr_elem_size / elem_size, elem_size, (HandleFreeFunc)fixscript_unref_shared_array, sah, &created);
-   if (!value.value) {
+   if (type != FILE_OP_SYNC) {
+      pos = ((uint64_t)(uint32_t)fixscript_get_int(params[2]) << 32) | (uint32_t)fixscript_get_int(params[1]);
+      off = fixscript_get_int(params[4]);
+      len = fixscript_get_int(params[5]);
+      if (pos < 0) {
+         *error = fixscript_create_error_string(heap, "negative position");
+         return fixscript_int(0);
+      }
+      if (off < 0 || len < 0) {
+         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_BOUNDS);
+      }
+      err = fixscript_get_array_length(heap, params[3], &array_len);
+      if (!err && (int64_t)off + (int64_t)len > array_len) {
+         err = FIXSCRIPT_ERR_OUT_OF_BOUNDS;
+      }
+      if (err) {
+         return fixscript_error(heap, error, err);
+      }
+   }
+
+   op = calloc(1, sizeof(AsyncFileOp));
+   if (!op) {
       return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
    }
-   if (!created) {
-      fixscript_unref_shared_array(sah);
+   op->atr = calloc(1, sizeof(AsyncThreadResult));
+   op->buf = malloc(len > 0? len : 1);
+   if (!op->atr || !op->buf) {
+      free(op->atr);
+      free(op->buf);
+      free(op);
+      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
    }
-   return value;
-}
-
 
-typedef struct {
-   char *start;
-   char *cur, *end;
-} Buffer;
+   if (type == FILE_OP_WRITE) {
+      err = fixscript_get_array_bytes(heap, params[3], off, len, op->buf);
+      if (err) {
+         free(op->atr);
+         free(op->buf);
+         free(op);
+         return fixscript_error(heap, error, err);
+      }
+   }
 
+   // the worker uses its own descriptor so that closing the file meanwhile is safe:
+#if defined(_WIN32)
+   op->handle = reopen_file(handle);
+   if (!op->handle) {
+      // without a separate handle the position can't be kept intact from another thread:
+      run_directly = 1;
+      if (!DuplicateHandle(GetCurrentProcess(), handle->handle, GetCurrentProcess(), &op->handle, 0, FALSE, DUPLICATE_SAME_ACCESS)) {
+         op->handle = INVALID_HANDLE_VALUE;
+      }
+   }
+   if (op->handle == INVALID_HANDLE_VALUE) {
+#else
+   op->fd = dup(handle->fd);
+   if (op->fd == -1) {
+#endif
+      free(op->atr);
+      free(op->buf);
+      free(op);
+      *error = fixscript_create_error_string(heap, "I/O error");
+      return fixscript_int(0);
+   }
 
-static int buffer_expand(Buffer *buf)
-{
-   char *new_data;
-   int new_size, pos;
+   op->proc = proc;
+   op->type = type;
+   op->pos = pos;
+   op->len = len;
+   op->off = off;
+   op->atr->type = ASYNC_FILE_OP;
+   op->atr->callback = params[num_params-2];
+   op->atr->data = params[num_params-1];
+   op->atr->file_op = op;
+#if defined(_WIN32)
+   op->atr->socket = INVALID_SOCKET;
+#else
+   op->atr->fd = -1;
+#endif
+   if (type == FILE_OP_READ) {
+      op->array = params[3];
+      fixscript_ref(heap, op->array);
+   }
+   async_process_ref(proc);
+   fixscript_ref(heap, op->atr->data);
 
-   new_size = buf->end - buf->start;
-   if (new_size >= (1<<30)) {
-      return 0;
+#if defined(_WIN32)
+   if (run_directly) {
+      zero.QuadPart = 0;
+      if (!SetFilePointerEx(handle->handle, zero, &saved_pos, FILE_CURRENT)) {
+         saved_pos.QuadPart = -1;
+      }
+      async_file_func(op);
+      if (saved_pos.QuadPart >= 0) {
+         SetFilePointerEx(handle->handle, saved_pos, NULL, FILE_BEGIN);
+      }
+      return fixscript_int(0);
    }
+#endif
 
-   new_size <<= 1;
-   pos = buf->cur - buf->start;
-   new_data = realloc(buf->start, new_size);
-   if (!new_data) {
-      return 0;
+   if (!async_run_thread(async_file_func, op)) {
+      async_process_unref(proc);
+      fixscript_unref(heap, op->atr->data);
+      if (type == FILE_OP_READ) {
+         fixscript_unref(heap, op->array);
+      }
+#if defined(_WIN32)
+      CloseHandle(op->handle);
+#else
+      close(op->fd);
+#endif
+      free(op->atr);
+      free(op->buf);
+      free(op);
+      *error = fixscript_create_error_string(heap, "thread pool is full");
+      return fixscript_int(0);
    }
 
-   buf->start = new_data;
-   buf->cur = new_data + pos;
-   buf->end = new_data + new_size;
-   return 1;
+   return fixscript_int(0);
+#endif /* __wasm__ */
 }
 
 
-static inline int buffer_append_byte(Buffer *buf, uint8_t value)
+static Value native_async_tcp_connection_read(Heap *heap, Value *error, int num_params, Value *params, void *data)
 {
-   if (buf->cur == buf->end) {
-      if (!buffer_expand(buf)) return 0;
-   }
-   *buf->cur++ = value;
-   return 1;
-}
+#if defined(__wasm__)
+   *error = fixscript_create_error_string(heap, "not supported");
+   return fixscript_int(0);
+#else
+   AsyncHandle *handle;
+#ifdef _WIN32
+   WSABUF wsabuf;
+   DWORD flags;
+   DWORD read;
+#endif
 
+   handle = fixscript_get_handle(heap, params[0], HANDLE_TYPE_ASYNC, NULL);
+   if (!handle || handle->type != ASYNC_TCP_CONNECTION) {
+      *error = fixscript_create_error_string(heap, "invalid async stream handle");
+      return fixscript_int(0);
+   }
+   
+   if (handle->active & ASYNC_READ) {
+      *error = fixscript_create_error_string(heap, "only one read operation can be active at a time");
+      return fixscript_int(0);
+   }
 
-static inline int buffer_append_short(Buffer *buf, uint16_t value)
-{
-   if (buf->end - buf->cur < 2) {
-      if (!buffer_expand(buf)) return 0;
+#ifdef _WIN32
+   if (params[3].value > sizeof(handle->read.buf)) {
+      params[3].value = sizeof(handle->read.buf);
    }
-   memcpy(buf->cur, &value, 2);
-   buf->cur += 2;
-   return 1;
-}
+   if (params[3].value < 0) {
+      *error = fixscript_create_error_string(heap, "negative length");
+      return fixscript_int(0);
+   }
+#endif
+
+   handle->active |= ASYNC_READ;
+   handle->read.callback = params[4];
+   handle->read.data = params[5];
+   handle->read.array = params[1];
+   handle->read.off = params[2].value;
+   handle->read.len = params[3].value;
+   fixscript_ref(heap, handle->read.data);
+   fixscript_ref(heap, handle->read.array);
 
+#ifdef _WIN32
+   memset(&handle->read.overlapped, 0, sizeof(WSAOVERLAPPED));
 
-static inline int buffer_append_int(Buffer *buf, int value)
-{
-   if (buf->end - buf->cur < 4) {
-      if (!buffer_expand(buf)) return 0;
-   }
-   memcpy(buf->cur, &value, 4);
-   buf->cur += 4;
-   return 1;
+   wsabuf.len = params[3].value;
+   wsabuf.buf = handle->read.buf;
+   flags = 0;
+   WSARecv(handle->socket, &wsabuf, 1, &read, &flags, &handle->read.overlapped, NULL);
+#else
+   update_poll_ctl(handle);
+#endif
+
+   return fixscript_int(0);
+#endif /* __wasm__ */
 }
 
 
-static inline int buffer_append_length(Buffer *buf, int type, int len)
+#if defined(_WIN32)
+static Value native_async_tcp_connection_write(Heap *heap, Value *error, int num_params, Value *params, void *data)
 {
-   if (len <= 12) {
-      if (!buffer_append_byte(buf, type | (len << 4))) return 0;
-   }
-   else if (len <= 0xFF) {
-      if (!buffer_append_byte(buf, type | (13 << 4))) return 0;
-      if (!buffer_append_byte(buf, len)) return 0;
-   }
-   else if (len <= 0xFFFF) {
-      if (!buffer_append_byte(buf, type | (14 << 4))) return 0;
-      if (!buffer_append_short(buf, len)) return 0;
+   AsyncHandle *handle;
+   WSABUF wsabuf;
+   DWORD written;
+   int err;
+
+   handle = fixscript_get_handle(heap, params[0], HANDLE_TYPE_ASYNC, NULL);
+   if (!handle || handle->type != ASYNC_TCP_CONNECTION) {
+      *error = fixscript_create_error_string(heap, "invalid async stream handle");
+      return fixscript_int(0);
    }
-   else {
-      if (!buffer_append_byte(buf, type | (15 << 4))) return 0;
-      if (!buffer_append_int(buf, len)) return 0;
+   
+   if (handle->active & ASYNC_WRITE) {
+      *error = fixscript_create_error_string(heap, "only one write operation can be active at a time");
+      return fixscript_int(0);
    }
-   return 1;
-}
 
+   if (params[3].value > sizeof(handle->write.buf)) {
+      params[3].value = sizeof(handle->write.buf);
+   }
 
-static inline int buffer_read_byte(Buffer *buf, uint8_t *value)
-{
-   if (buf->cur == buf->end) {
-      return 0;
+   err = fixscript_get_array_bytes(heap, params[1], params[2].value, params[3].value, handle->write.buf);
+   if (err) {
+      return fixscript_error(heap, error, err);
    }
-   *value = *buf->cur++;
-   return 1;
-}
 
+   handle->active |= ASYNC_WRITE;
+   handle->write.callback = params[4];
+   handle->write.data = params[5];
+   fixscript_ref(heap, handle->write.data);
 
-static inline int buffer_read_short(Buffer *buf, uint16_t *value)
-{
-   if (buf->end - buf->cur < 2) {
-      return 0;
-   }
-   memcpy(value, buf->cur, 2);
-   buf->cur += 2;
-   return 1;
-}
+   memset(&handle->write.overlapped, 0, sizeof(WSAOVERLAPPED));
 
+   wsabuf.len = params[3].value;
+   wsabuf.buf = handle->write.buf;
+   WSASend(handle->socket, &wsabuf, 1, &written, 0, &handle->write.overlapped, NULL);
 
-static inline int buffer_read_int(Buffer *buf, int *value)
+   return fixscript_int(0);
+}
+#elif defined(__wasm__)
+static Value native_async_tcp_connection_write(Heap *heap, Value *error, int num_params, Value *params, void *data)
 {
-   if (buf->end - buf->cur < 4) {
-      return 0;
-   }
-   memcpy(value, buf->cur, 4);
-   buf->cur += 4;
-   return 1;
+   *error = fixscript_create_error_string(heap, "not supported");
+   return fixscript_int(0);
 }
-
-
-static inline int buffer_read_length(Buffer *buf, uint8_t type, int *len)
+#else
+static Value native_async_tcp_connection_write(Heap *heap, Value *error, int num_params, Value *params, void *data)
 {
-   uint8_t len8;
-   uint16_t len16;
+   AsyncHandle *handle;
+   char *buf;
+   int err;
+   int written;
 
-   if ((type >> 4) <= 12) {
-      *len = type >> 4;
-      return 1;
-   }
-   if ((type >> 4) == 13) {
-      if (!buffer_read_byte(buf, &len8)) return 0;
-      *len = len8;
-      return 1;
+   handle = fixscript_get_handle(heap, params[0], HANDLE_TYPE_ASYNC, NULL);
+   if (!handle || handle->type != ASYNC_TCP_CONNECTION) {
+      *error = fixscript_create_error_string(heap, "invalid async stream handle");
+      return fixscript_int(0);
    }
-   if ((type >> 4) == 14) {
-      if (!buffer_read_short(buf, &len16)) return 0;
-      *len = len16;
-      return 1;
+   
+   if (handle->active & ASYNC_WRITE) {
+      *error = fixscript_create_error_string(heap, "only one write operation can be active at a time");
+      return fixscript_int(0);
    }
-   return buffer_read_int(buf, len);
-}
 
+   err = fixscript_lock_array(heap, params[1], params[2].value, params[3].value, (void **)&buf, 1, ACCESS_READ_ONLY);
+   if (err) {
+      fixscript_error(heap, error, err);
+      return fixscript_int(0);
+   }
 
-enum {
-   SER_ZERO         = 0,
-   SER_BYTE         = 1,
-   SER_SHORT        = 2,
-   SER_INT          = 3,
-   SER_FLOAT        = 4,
-   SER_FLOAT_ZERO   = 5,
-   SER_REF          = 6,
-   SER_REF_SHORT    = 7,
-   SER_ARRAY        = 8,
-   SER_ARRAY_BYTE   = 9,
-   SER_ARRAY_SHORT  = 10,
-   SER_ARRAY_INT    = 11,
-   SER_STRING_BYTE  = 12,
-   SER_STRING_SHORT = 13,
-   SER_STRING_INT   = 14,
-   SER_HASH         = 15
-};
+   handle->active |= ASYNC_WRITE;
+   handle->write.callback = params[4];
+   handle->write.data = params[5];
+   fixscript_ref(heap, handle->write.data);
 
-typedef struct {
-   char *key, *value;
-   int key_len, value_len;
-} SortedEntry;
+   written = write(handle->fd, buf, params[3].value);
+   if (written < 0 && errno == EAGAIN) {
+      written = 0;
+   }
+   handle->write.result = written;
+   update_poll_ctl(handle);
 
+   fixscript_unlock_array(heap, params[1], params[2].value, params[3].value, (void **)&buf, 1, ACCESS_READ_ONLY);
 
-static int compare_serialized_values(Buffer *buf1, Buffer *buf2, int remaining)
+   return fixscript_int(0);
+}
+#endif
+
+
+#ifndef __wasm__
+static int async_send_file_prepare(Heap *heap, Value *error, AsyncHandle *handle, Value *params)
 {
-   uint8_t type1, type2;
+   FileHandle *file;
+   int64_t off;
+   int len;
 
-   while (remaining-- > 0) {
-      if (buf1->cur == buf1->end) return buf2->cur == buf2->end? 0 : -1;
-      if (buf2->cur == buf2->end) return +1;
+   if (handle->active & ASYNC_WRITE) {
+      *error = fixscript_create_error_string(heap, "only one write operation can be active at a time");
+      return 0;
+   }
 
-      type1 = *(buf1->cur++);
-      type2 = *(buf2->cur++);
+   file = get_file_handle(heap, error, params[1]);
+   if (!file) {
+      return 0;
+   }
 
-      switch (type1 & 0x0F) {
-         case SER_ZERO:
-            switch (type2 & 0x0F) {
-               case SER_ZERO:
-                  continue;
+   if ((file->mode & SCRIPT_FILE_READ) == 0) {
+      *error = fixscript_create_error_string(heap, "file not opened for reading");
+      return 0;
+   }
 
-               case SER_BYTE:
-               case SER_SHORT:
-                  return -1;
+   off = ((uint32_t)params[2].value) | (((uint64_t)params[3].value) << 32);
+   len = fixscript_get_int(params[4]);
+   if (off < 0 || len < 0) {
+      *error = fixscript_create_error_string(heap, "negative offset or length");
+      return 0;
+   }
 
-               case SER_INT:
-                  if (buf2->end - buf2->cur < 4) goto error;
-                  if (buf2->cur[3] & 0x80) return +1;
-                  return -1;
+   if (!handle->write.file_buf) {
+      handle->write.file_buf = malloc(SEND_FILE_BUF_SIZE);
+      if (!handle->write.file_buf) {
+         fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+         return 0;
+      }
+   }
 
-               case SER_FLOAT:
-               case SER_FLOAT_ZERO:
-               case SER_ARRAY:
-               case SER_ARRAY_BYTE:
-               case SER_ARRAY_SHORT:
-               case SER_ARRAY_INT:
-               case SER_STRING_BYTE:
-               case SER_STRING_SHORT:
-               case SER_STRING_INT:
-               case SER_HASH:
-                  return -1;
-            }
-            goto error;
+   handle->active |= ASYNC_WRITE;
+   handle->write.callback = params[5];
+   handle->write.data = params[6];
+   handle->write.file = file_handle_func(heap, HANDLE_OP_COPY, file, NULL);
+   handle->write.file_off = off;
+   handle->write.file_remaining = len;
+   handle->write.file_sent = 0;
+   fixscript_ref(heap, handle->write.data);
+   return 1;
+}
+#endif
 
-         case SER_BYTE:
-            switch (type2 & 0x0F) {
-               case SER_ZERO:
-                  return +1;
 
-               case SER_BYTE: {
-                  uint8_t val1, val2;
-                  if (!buffer_read_byte(buf1, &val1)) goto error;
-                  if (!buffer_read_byte(buf2, &val2)) goto error;
-                  if (val1 == val2) continue;
-                  return (int)val1 - (int)val2;
-               }
+#if defined(_WIN32)
+static int async_send_file_next(AsyncHandle *handle)
+{
+   AsyncWrite *write = &handle->write;
+   WSABUF wsabuf;
+   DWORD read, written;
+   int len;
 
-               case SER_SHORT:
-                  return -1;
+   if (write->file->closed) {
+      return 0;
+   }
 
-               case SER_INT:
-                  if (buf2->end - buf2->cur < 4) goto error;
-                  if (buf2->cur[3] & 0x80) return +1;
-                  return -1;
+   len = write->file_remaining;
+   if (len > SEND_FILE_BUF_SIZE) {
+      len = SEND_FILE_BUF_SIZE;
+   }
 
-               case SER_FLOAT:
-               case SER_FLOAT_ZERO:
-               case SER_ARRAY:
-               case SER_ARRAY_BYTE:
-               case SER_ARRAY_SHORT:
-               case SER_ARRAY_INT:
-               case SER_STRING_BYTE:
-               case SER_STRING_SHORT:
-               case SER_STRING_INT:
-               case SER_HASH:
-                  return -1;
-            }
-            goto error;
+   if (!read_file_at(write->file->handle, write->file_buf, len, write->file_off, &read) || read == 0) {
+      return 0;
+   }
 
-         case SER_SHORT:
-            switch (type2 & 0x0F) {
-               case SER_ZERO:
-               case SER_BYTE:
-                  return +1;
+   memset(&write->overlapped, 0, sizeof(WSAOVERLAPPED));
+   wsabuf.len = read;
+   wsabuf.buf = write->file_buf;
+   if (WSASend(handle->socket, &wsabuf, 1, &written, 0, &write->overlapped, NULL) == SOCKET_ERROR) {
+      if (WSAGetLastError() != WSA_IO_PENDING) {
+         return 0;
+      }
+   }
+   return 1;
+}
 
-               case SER_SHORT: {
-                  uint16_t val1, val2;
-                  if (!buffer_read_short(buf1, &val1)) goto error;
-                  if (!buffer_read_short(buf2, &val2)) goto error;
-                  if (val1 == val2) continue;
-                  return (int)val1 - (int)val2;
-               }
 
-               case SER_INT:
-                  if (buf2->end - buf2->cur < 4) goto error;
-                  if (buf2->cur[3] & 0x80) return +1;
-                  return -1;
+static Value native_async_tcp_connection_send_file(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+   AsyncHandle *handle;
 
-               case SER_FLOAT:
-               case SER_FLOAT_ZERO:
-               case SER_ARRAY:
-               case SER_ARRAY_BYTE:
-               case SER_ARRAY_SHORT:
-               case SER_ARRAY_INT:
-               case SER_STRING_BYTE:
-               case SER_STRING_SHORT:
-               case SER_STRING_INT:
-               case SER_HASH:
-                  return -1;
-            }
-            goto error;
+   handle = fixscript_get_handle(heap, params[0], HANDLE_TYPE_ASYNC, NULL);
+   if (!handle || handle->type != ASYNC_TCP_CONNECTION) {
+      *error = fixscript_create_error_string(heap, "invalid async stream handle");
+      return fixscript_int(0);
+   }
 
-         case SER_INT:
-            switch (type2 & 0x0F) {
-               case SER_ZERO:
-               case SER_BYTE:
-               case SER_SHORT:
-                  if (buf1->end - buf1->cur < 4) goto error;
-                  if (buf1->cur[3] & 0x80) return -1;
-                  return +1;
+   if (!async_send_file_prepare(heap, error, handle, params)) {
+      return fixscript_int(0);
+   }
 
-               case SER_INT: {
-                  int val1, val2;
-                  if (!buffer_read_int(buf1, &val1)) goto error;
-                  if (!buffer_read_int(buf2, &val2)) goto error;
-                  if (val1 == val2) continue;
-                  return val1 < val2? -1 : +1;
-               }
+   if (handle->write.file_remaining == 0 || !async_send_file_next(handle)) {
+      if (handle->write.file_remaining > 0) {
+         handle->write.file_sent = -1;
+      }
+      memset(&handle->write.overlapped, 0, sizeof(WSAOVERLAPPED));
+      PostQueuedCompletionStatus(handle->proc->iocp, 0, (ULONG_PTR)handle, &handle->write.overlapped);
+   }
+   return fixscript_int(0);
+}
+#elif defined(__wasm__)
+static Value native_async_tcp_connection_send_file(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+   *error = fixscript_create_error_string(heap, "not supported");
+   return fixscript_int(0);
+}
+#else
+// returns 0 when the transfer needs to wait for the socket to become writable again
+static int async_send_file_step(AsyncHandle *handle)
+{
+   AsyncWrite *write = &handle->write;
+   int ret;
 
-               case SER_FLOAT:
-               case SER_FLOAT_ZERO:
-               case SER_ARRAY:
-               case SER_ARRAY_BYTE:
-               case SER_ARRAY_SHORT:
-               case SER_ARRAY_INT:
-               case SER_STRING_BYTE:
-               case SER_STRING_SHORT:
-               case SER_STRING_INT:
-               case SER_HASH:
-                  return -1;
-            }
-            goto error;
+   while (write->file_remaining > 0) {
+      ret = send_file_chunk(handle->fd, write->file, write->file_off, write->file_remaining, write->file_buf, SEND_FILE_BUF_SIZE);
+      if (ret == 0) {
+         return 0;
+      }
+      if (ret < 0) {
+         write->file_remaining = 0;
+         write->file_sent = -1;
+         break;
+      }
+      write->file_off += ret;
+      write->file_remaining -= ret;
+      write->file_sent += ret;
+   }
+   write->result = write->file_sent;
+   return 1;
+}
 
-         case SER_FLOAT:
-            switch (type2 & 0x0F) {
-               case SER_ZERO:
-               case SER_BYTE:
-               case SER_SHORT:
-               case SER_INT:
-                  return +1;
 
-               case SER_FLOAT: {
-                  int val1, val2;
-                  if (!buffer_read_int(buf1, &val1)) goto error;
-                  if (!buffer_read_int(buf2, &val2)) goto error;
-                  if (val1 == val2) continue;
-                  if (val1 & 0x80000000) {
-                     if (val2 & 0x80000000) {
-                        return (val2 & 0x7FFFFFFF) - (val1 & 0x7FFFFFFF);
-                     }
-                     return -1;
-                  }
-                  if (val2 & 0x80000000) {
-                     return +1;
-                  }
-                  return (val1 & 0x7FFFFFFF) - (val2 & 0x7FFFFFFF);
-               }
-
-               case SER_FLOAT_ZERO: {
-                  if (buf1->end - buf1->cur < 4) goto error;
-                  if (buf1->cur[3] & 0x80) return -1;
-                  return +1;
-               }
+static Value native_async_tcp_connection_send_file(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+   AsyncHandle *handle;
 
-               case SER_ARRAY:
-               case SER_ARRAY_BYTE:
-               case SER_ARRAY_SHORT:
-               case SER_ARRAY_INT:
-               case SER_STRING_BYTE:
-               case SER_STRING_SHORT:
-               case SER_STRING_INT:
-               case SER_HASH:
-                  return -1;
-            }
-            goto error;
+   handle = fixscript_get_handle(heap, params[0], HANDLE_TYPE_ASYNC, NULL);
+   if (!handle || handle->type != ASYNC_TCP_CONNECTION) {
+      *error = fixscript_create_error_string(heap, "invalid async stream handle");
+      return fixscript_int(0);
+   }
 
-         case SER_FLOAT_ZERO:
-            switch (type2 & 0x0F) {
-               case SER_ZERO:
-               case SER_BYTE:
-               case SER_SHORT:
-               case SER_INT:
-                  return +1;
+   if (!async_send_file_prepare(heap, error, handle, params)) {
+      return fixscript_int(0);
+   }
 
-               case SER_FLOAT: {
-                  if (buf2->end - buf2->cur < 4) goto error;
-                  if (buf2->cur[3] & 0x80) return +1;
-                  return -1;
-               }
+   async_send_file_step(handle);
+   update_poll_ctl(handle);
+   return fixscript_int(0);
+}
+#endif
 
-               case SER_FLOAT_ZERO:
-                  continue;
 
-               case SER_ARRAY:
-               case SER_ARRAY_BYTE:
-               case SER_ARRAY_SHORT:
-               case SER_ARRAY_INT:
-               case SER_STRING_BYTE:
-               case SER_STRING_SHORT:
-               case SER_STRING_INT:
-               case SER_HASH:
-                  return -1;
-            }
-            goto error;
+static Value native_async_tcp_connection_close(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+   AsyncHandle *handle;
 
-         case SER_ARRAY:
-            switch (type2 & 0x0F) {
-               case SER_ZERO:
-               case SER_BYTE:
-               case SER_SHORT:
-               case SER_INT:
-               case SER_FLOAT:
-               case SER_FLOAT_ZERO:
-                  return +1;
+   handle = fixscript_get_handle(heap, params[0], HANDLE_TYPE_ASYNC, NULL);
+   if (!handle || handle->type != ASYNC_TCP_CONNECTION) {
+      *error = fixscript_create_error_string(heap, "invalid async stream handle");
+      return fixscript_int(0);
+   }
 
-               case SER_ARRAY: {
-                  int len1, len2, ret;
+#if defined(_WIN32)
+   closesocket(handle->socket);
+   handle->socket = INVALID_SOCKET;
+#elif defined(__wasm__)
+#else
+   poll_remove_socket(handle->proc->poll, handle->fd);
+   close(handle->fd);
+   handle->fd = -1;
+#endif
+   return fixscript_int(0);
+}
 
-                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
-                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
 
-                  ret = compare_serialized_values(buf1, buf2, len1 < len2? len1 : len2);
-                  if (ret != 0) return ret;
-                  if (len1 == len2) {
-                     continue;
-                  }
-                  return len1 - len2;
-               }
+static Value native_async_tcp_server_create(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+#if defined(__wasm__)
+   *error = fixscript_create_error_string(heap, "not supported");
+   return fixscript_int(0);
+#else
+   int local_only = data == (void *)1;
+   AsyncProcess *proc;
+   AsyncServerHandle *handle;
+   struct sockaddr_in server;
+#if defined(_WIN32)
+   SOCKET sock = INVALID_SOCKET;
+#else
+   int fd = -1;
+#endif
+   int reuse;
+   Value retval = fixscript_int(0);
+   
+   proc = get_async_process(heap, error);
+   if (!proc) return fixscript_int(0);
 
-               case SER_ARRAY_BYTE: {
-                  uint8_t val2;
-                  int i, len1, len2, len;
+#if defined(_WIN32)
+   sock = socket(AF_INET, SOCK_STREAM, 0);
+   if (sock == INVALID_SOCKET) {
+      goto io_error;
+   }
 
-                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
-                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
-                  len = len1 < len2? len1 : len2;
+   reuse = 1;
+   if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuse, sizeof(reuse)) < 0) {
+      goto io_error;
+   }
 
-                  for (i=0; i<len; i++) {
-                     if (!buffer_read_byte(buf1, &type1)) goto error;
-                     if (!buffer_read_byte(buf2, &val2)) goto error;
-                     switch (type1 & 0x0F) {
-                        case SER_ZERO:
-                           if (val2 > 0) return -1;
-                           continue;
+   server.sin_family = AF_INET;
+   server.sin_addr.s_addr = htonl(local_only? INADDR_LOOPBACK : INADDR_ANY);
+   server.sin_port = htons(params[0].value);
 
-                        case SER_BYTE: {
-                           uint8_t val1;
-                           if (!buffer_read_byte(buf1, &val1)) goto error;
-                           if (val1 != val2) {
-                              return (int)val1 - (int)val2;
-                           }
-                           continue;
-                        }
+   if (bind(sock, (struct sockaddr *)&server, sizeof(server)) == SOCKET_ERROR) {
+      goto io_error;
+   }
 
-                        case SER_SHORT: {
-                           uint16_t val1;
-                           if (!buffer_read_short(buf1, &val1)) goto error;
-                           if (val1 != val2) {
-                              return (int)val1 - (int)val2;
-                           }
-                           continue;
-                        }
-                        
-                        case SER_INT: {
-                           int val1;
-                           if (!buffer_read_int(buf1, &val1)) goto error;
-                           if (val1 != val2) {
-                              return val1 < val2? -1 : +1;
-                           }
-                           continue;
-                        }
+   if (listen(sock, SOMAXCONN) == SOCKET_ERROR) {
+      goto io_error;
+   }
+#else
+   fd = socket(AF_INET, SOCK_STREAM, 0);
+   if (fd == -1) {
+      goto io_error;
+   }
 
-                        case SER_FLOAT:
-                        case SER_FLOAT_ZERO:
-                        case SER_ARRAY:
-                        case SER_ARRAY_BYTE:
-                        case SER_ARRAY_SHORT:
-                        case SER_ARRAY_INT:
-                        case SER_STRING_BYTE:
-                        case SER_STRING_SHORT:
-                        case SER_STRING_INT:
-                        case SER_HASH:
-                           return +1;
-                     }
-                     goto error;
-                  }
-                  if (len1 == len2) {
-                     continue;
-                  }
-                  return len1 - len2;
-               }
+   reuse = 1;
+   if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuse, sizeof(reuse)) < 0) {
+      goto io_error;
+   }
 
-               case SER_ARRAY_SHORT: {
-                  uint16_t val2;
-                  int i, len1, len2, len;
+   server.sin_family = AF_INET;
+   server.sin_addr.s_addr = htonl(local_only? INADDR_LOOPBACK : INADDR_ANY);
+   server.sin_port = htons(params[0].value);
 
-                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
-                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
-                  len = len1 < len2? len1 : len2;
+   if (bind(fd, (struct sockaddr *)&server, sizeof(server)) < 0) {
+      goto io_error;
+   }
 
-                  for (i=0; i<len; i++) {
-                     if (!buffer_read_byte(buf1, &type1)) goto error;
-                     if (!buffer_read_short(buf2, &val2)) goto error;
-                     switch (type1 & 0x0F) {
-                        case SER_ZERO:
-                           if (val2 > 0) return -1;
-                           continue;
+   if (listen(fd, SOMAXCONN) < 0) {
+      goto io_error;
+   }
+#endif
 
-                        case SER_BYTE: {
-                           uint8_t val1;
-                           if (!buffer_read_byte(buf1, &val1)) goto error;
-                           if (val1 != val2) {
-                              return (int)val1 - (int)val2;
-                           }
-                           continue;
-                        }
+   handle = calloc(1, sizeof(AsyncServerHandle));
+   if (!handle) {
+      fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      goto error;
+   }
 
-                        case SER_SHORT: {
-                           uint16_t val1;
-                           if (!buffer_read_short(buf1, &val1)) goto error;
-                           if (val1 != val2) {
-                              return (int)val1 - (int)val2;
-                           }
-                           continue;
-                        }
-                        
-                        case SER_INT: {
-                           int val1;
-                           if (!buffer_read_int(buf1, &val1)) goto error;
-                           if (val1 != val2) {
-                              return val1 < val2? -1 : +1;
-                           }
-                           continue;
-                        }
+   handle->proc = proc;
+   async_process_ref(handle->proc);
+   handle->type = ASYNC_TCP_SERVER;
+#if defined(_WIN32)
+   handle->socket = sock;
+   handle->accept_socket = INVALID_SOCKET;
+   if (!CreateIoCompletionPort((HANDLE)handle->socket, proc->iocp, (ULONG_PTR)handle, 0)) {
+      async_process_unref(handle->proc);
+      free(handle);
+      goto io_error;
+   }
+#else
+   handle->fd = fd;
+   if (!poll_add_socket(proc->poll, fd, handle, 0)) {
+      async_process_unref(handle->proc);
+      free(handle);
+      goto io_error;
+   }
+#endif
 
-                        case SER_FLOAT:
-                        case SER_FLOAT_ZERO:
-                        case SER_ARRAY:
-                        case SER_ARRAY_BYTE:
-                        case SER_ARRAY_SHORT:
-                        case SER_ARRAY_INT:
-                        case SER_STRING_BYTE:
-                        case SER_STRING_SHORT:
-                        case SER_STRING_INT:
-                        case SER_HASH:
-                           return +1;
-                     }
-                     goto error;
-                  }
-                  if (len1 == len2) {
-                     continue;
-                  }
-                  return len1 - len2;
-               }
+   retval = fixscript_create_handle(heap, HANDLE_TYPE_ASYNC, handle, free_async_handle);
+#if defined(_WIN32)
+   sock = INVALID_SOCKET;
+#else
+   fd = -1;
+#endif
+   if (!retval.value) {
+      fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      goto error;
+   }
 
-               case SER_ARRAY_INT: {
-                  int val2;
-                  int i, len1, len2, len;
+error:
+#if defined(_WIN32)
+   if (!retval.value && sock != INVALID_SOCKET) {
+      closesocket(sock);
+   }
+#else
+   if (!retval.value && fd != -1) {
+      close(fd);
+   }
+#endif
+   return retval;
 
-                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
-                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
-                  len = len1 < len2? len1 : len2;
+io_error:
+   *error = fixscript_create_error_string(heap, "I/O error");
+   goto error;
 
-                  for (i=0; i<len; i++) {
-                     if (!buffer_read_byte(buf1, &type1)) goto error;
-                     if (!buffer_read_int(buf2, &val2)) goto error;
-                     switch (type1 & 0x0F) {
-                        case SER_ZERO:
-                           if (val2 < 0) return +1;
-                           if (val2 > 0) return -1;
-                           continue;
+   return fixscript_int(0);
+#endif /* __wasm__ */
+}
 
-                        case SER_BYTE: {
-                           uint8_t val1;
-                           if (!buffer_read_byte(buf1, &val1)) goto error;
-                           if (val1 != val2) {
-                              return val1 < val2? -1 : +1;
-                           }
-                           continue;
-                        }
 
-                        case SER_SHORT: {
-                           uint16_t val1;
-                           if (!buffer_read_short(buf1, &val1)) goto error;
-                           if (val1 != val2) {
-                              return val1 < val2? -1 : +1;
-                           }
-                           continue;
-                        }
-                        
-                        case SER_INT: {
-                           int val1;
-                           if (!buffer_read_int(buf1, &val1)) goto error;
-                           if (val1 != val2) {
-                              return val1 < val2? -1 : +1;
-                           }
-                           continue;
-                        }
+static Value native_async_tcp_server_close(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+#if defined(__wasm__)
+   *error = fixscript_create_error_string(heap, "not supported");
+   return fixscript_int(0);
+#else
+   AsyncServerHandle *handle;
 
-                        case SER_FLOAT:
-                        case SER_FLOAT_ZERO:
-                        case SER_ARRAY:
-                        case SER_ARRAY_BYTE:
-                        case SER_ARRAY_SHORT:
-                        case SER_ARRAY_INT:
-                        case SER_STRING_BYTE:
-                        case SER_STRING_SHORT:
-                        case SER_STRING_INT:
-                        case SER_HASH:
-                           return +1;
-                     }
-                     goto error;
-                  }
-                  if (len1 == len2) {
-                     continue;
-                  }
-                  return len1 - len2;
-               }
+   handle = fixscript_get_handle(heap, params[0], HANDLE_TYPE_ASYNC, NULL);
+   if (!handle || handle->type != ASYNC_TCP_SERVER) {
+      *error = fixscript_create_error_string(heap, "invalid async TCP server handle");
+      return fixscript_int(0);
+   }
 
-               case SER_STRING_BYTE:
-               case SER_STRING_SHORT:
-               case SER_STRING_INT:
-               case SER_HASH:
-                  return -1;
-            }
-            goto error;
+#ifdef _WIN32
+   closesocket(handle->socket);
+   handle->socket = INVALID_SOCKET;
+#else
+   poll_remove_socket(handle->proc->poll, handle->fd);
+   close(handle->fd);
+   handle->fd = -1;
+#endif
+   return fixscript_int(0);
+#endif /* __wasm__ */
+}
 
-         case SER_ARRAY_BYTE:
-            switch (type2 & 0x0F) {
-               case SER_ZERO:
-               case SER_BYTE:
-               case SER_SHORT:
-               case SER_INT:
-               case SER_FLOAT:
-               case SER_FLOAT_ZERO:
-                  return +1;
 
-               case SER_ARRAY: {
-                  uint8_t val1;
-                  int i, len1, len2, len;
+static Value native_async_tcp_server_accept(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+#if defined(__wasm__)
+   *error = fixscript_create_error_string(heap, "not supported");
+   return fixscript_int(0);
+#else
+   AsyncServerHandle *handle;
+#ifdef _WIN32
+   BOOL ret;
+   int flag;
+#endif
 
-                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
-                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
-                  len = len1 < len2? len1 : len2;
+   handle = fixscript_get_handle(heap, params[0], HANDLE_TYPE_ASYNC, NULL);
+   if (!handle || handle->type != ASYNC_TCP_SERVER) {
+      *error = fixscript_create_error_string(heap, "invalid async TCP server handle");
+      return fixscript_int(0);
+   }
+   
+   if (handle->active) {
+      *error = fixscript_create_error_string(heap, "only one accept operation can be active at a time");
+      return fixscript_int(0);
+   }
 
-                  for (i=0; i<len; i++) {
-                     if (!buffer_read_byte(buf1, &val1)) goto error;
-                     if (!buffer_read_byte(buf2, &type2)) goto error;
-                     switch (type2 & 0x0F) {
-                        case SER_ZERO:
-                           if (val1 > 0) return +1;
-                           continue;
+#ifdef _WIN32
+   handle->accept_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+   if (handle->accept_socket == INVALID_SOCKET) {
+      *error = fixscript_create_error_string(heap, "I/O error");
+      return fixscript_int(0);
+   }
+   flag = 1;
+   setsockopt(handle->accept_socket, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(int));
+#endif
 
-                        case SER_BYTE: {
-                           uint8_t val2;
-                           if (!buffer_read_byte(buf2, &val2)) goto error;
-                           if (val1 != val2) {
-                              return (int)val1 - (int)val2;
-                           }
-                           continue;
-                        }
+   handle->active = 1;
+   handle->callback = params[1];
+   handle->data = params[2];
+   fixscript_ref(heap, handle->data);
 
-                        case SER_SHORT: {
-                           uint16_t val2;
-                           if (!buffer_read_short(buf2, &val2)) goto error;
-                           if (val1 != val2) {
-                              return (int)val1 - (int)val2;
-                           }
-                           continue;
-                        }
+#ifdef _WIN32
+   memset(&handle->overlapped, 0, sizeof(OVERLAPPED));
+   ret = AcceptEx(handle->socket, handle->accept_socket, handle->buf, 0, sizeof(struct sockaddr_in) + 16, sizeof(struct sockaddr_in) + 16, NULL, &handle->overlapped);
+   if (ret != 0 || WSAGetLastError() != ERROR_IO_PENDING) {
+      *error = fixscript_create_error_string(heap, "I/O error");
+      return fixscript_int(0);
+   }
+#else
+   update_poll_ctl((AsyncHandle *)handle);
+#endif
+   return fixscript_int(0);
+#endif /* __wasm__ */
+}
 
-                        case SER_INT: {
-                           int val2;
-                           if (!buffer_read_int(buf2, &val2)) goto error;
-                           if (val1 != val2) {
-                              return val1 < val2? -1 : +1;
-                           }
-                           continue;
-                        }
 
-                        case SER_FLOAT:
-                        case SER_FLOAT_ZERO:
-                        case SER_ARRAY:
-                        case SER_ARRAY_BYTE:
-                        case SER_ARRAY_SHORT:
-                        case SER_ARRAY_INT:
-                        case SER_STRING_BYTE:
-                        case SER_STRING_SHORT:
-                        case SER_STRING_INT:
-                        case SER_HASH:
-                           return -1;
-                     }
-                     goto error;
-                  }
-                  if (len1 == len2) {
-                     continue;
-                  }
-                  return len1 - len2;
-               }
+#ifndef __wasm__
+static uint32_t get_time()
+{
+#if defined(_WIN32)
+   return timeGetTime();
+#elif defined(__APPLE__)
+   uint64_t time;
+   mach_timebase_info_data_t info;
+   time = mach_absolute_time();
+   mach_timebase_info(&info);
+   return time * info.numer / info.denom / 1000000;
+#else
+   struct timespec ts;
+   if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
+      return 0;
+   }
+   return ((uint64_t)ts.tv_sec) * 1000 + ((uint64_t)ts.tv_nsec / 1000000L);
+#endif
+}
+#endif
 
-               case SER_ARRAY_BYTE: {
-                  uint8_t val1, val2;
-                  int i, len1, len2, len;
 
-                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
-                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
-                  len = len1 < len2? len1 : len2;
+#ifndef __wasm__
+static uint32_t get_timer_time(AsyncProcess *proc)
+{
+   return get_time() + proc->timer_time_offset;
+}
 
-                  for (i=0; i<len; i++) {
-                     if (!buffer_read_byte(buf1, &val1)) goto error;
-                     if (!buffer_read_byte(buf2, &val2)) goto error;
-                     if (val1 != val2) {
-                        return (int)val1 - (int)val2;
-                     }
-                  }
-                  if (len1 == len2) {
-                     continue;
-                  }
-                  return len1 - len2;
-               }
 
-               case SER_ARRAY_SHORT: {
-                  uint8_t val1;
-                  uint16_t val2;
-                  int i, len1, len2, len;
+static int timer_less(AsyncTimer *timer1, AsyncTimer *timer2)
+{
+   int32_t diff;
 
-                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
-                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
-                  len = len1 < len2? len1 : len2;
+   if (timer1->immediate != timer2->immediate) {
+      return timer1->immediate;
+   }
+   if (!timer1->immediate) {
+      diff = (int32_t)(timer1->time - timer2->time);
+      if (diff != 0) {
+         return diff < 0;
+      }
+   }
+   return (int32_t)(timer1->seq - timer2->seq) < 0;
+}
 
-                  for (i=0; i<len; i++) {
-                     if (!buffer_read_byte(buf1, &val1)) goto error;
-                     if (!buffer_read_short(buf2, &val2)) goto error;
-                     if (val1 != val2) {
-                        return (int)val1 - (int)val2;
-                     }
-                  }
-                  if (len1 == len2) {
-                     continue;
-                  }
-                  return len1 - len2;
-               }
 
-               case SER_ARRAY_INT: {
-                  uint8_t val1;
-                  int val2;
-                  int i, len1, len2, len;
+static void timer_heap_move(AsyncProcess *proc, int idx)
+{
+   AsyncTimer **timers = proc->timers;
+   AsyncTimer *timer = timers[idx];
+   int parent, child;
 
-                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
-                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
-                  len = len1 < len2? len1 : len2;
+   while (idx > 0) {
+      parent = (idx-1) >> 1;
+      if (!timer_less(timer, timers[parent])) break;
+      timers[idx] = timers[parent];
+      timers[idx]->heap_idx = idx;
+      idx = parent;
+   }
 
-                  for (i=0; i<len; i++) {
-                     if (!buffer_read_byte(buf1, &val1)) goto error;
-                     if (!buffer_read_int(buf2, &val2)) goto error;
-                     if (val1 != val2) {
-                        return val1 < val2? -1 : +1;
-                     }
-                  }
-                  if (len1 == len2) {
-                     continue;
-                  }
-                  return len1 - len2;
-               }
+   for (;;) {
+      child = idx*2+1;
+      if (child >= proc->timers_cnt) break;
+      if (child+1 < proc->timers_cnt && timer_less(timers[child+1], timers[child])) {
+         child++;
+      }
+      if (!timer_less(timers[child], timer)) break;
+      timers[idx] = timers[child];
+      timers[idx]->heap_idx = idx;
+      idx = child;
+   }
 
-               case SER_STRING_BYTE:
-               case SER_STRING_SHORT:
-               case SER_STRING_INT:
-               case SER_HASH:
-                  return -1;
-            }
-            goto error;
+   timers[idx] = timer;
+   timer->heap_idx = idx;
+}
 
-         case SER_ARRAY_SHORT:
-            switch (type2 & 0x0F) {
-               case SER_ZERO:
-               case SER_BYTE:
-               case SER_SHORT:
-               case SER_INT:
-               case SER_FLOAT:
-               case SER_FLOAT_ZERO:
-                  return +1;
 
-               case SER_ARRAY: {
-                  uint16_t val1;
-                  int i, len1, len2, len;
+static int timer_heap_add(AsyncProcess *proc, AsyncTimer *timer)
+{
+   AsyncTimer **new_timers;
+   int new_cap;
 
-                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
-                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
-                  len = len1 < len2? len1 : len2;
+   if (proc->timers_cnt == proc->timers_cap) {
+      new_cap = proc->timers_cap? proc->timers_cap*2 : 16;
+      new_timers = realloc(proc->timers, new_cap * sizeof(AsyncTimer *));
+      if (!new_timers) {
+         return 0;
+      }
+      proc->timers = new_timers;
+      proc->timers_cap = new_cap;
+   }
 
-                  for (i=0; i<len; i++) {
-                     if (!buffer_read_short(buf1, &val1)) goto error;
-                     if (!buffer_read_byte(buf2, &type2)) goto error;
-                     switch (type2 & 0x0F) {
-                        case SER_ZERO:
-                           if (val1 > 0) return +1;
-                           continue;
+   proc->timers[proc->timers_cnt] = timer;
+   timer_heap_move(proc, proc->timers_cnt++);
+   return 1;
+}
 
-                        case SER_BYTE: {
-                           uint8_t val2;
-                           if (!buffer_read_byte(buf2, &val2)) goto error;
-                           if (val1 != val2) {
-                              return (int)val1 - (int)val2;
-                           }
-                           continue;
-                        }
 
-                        case SER_SHORT: {
-                           uint16_t val2;
-                           if (!buffer_read_short(buf2, &val2)) goto error;
-                           if (val1 != val2) {
-                              return (int)val1 - (int)val2;
-                           }
-                           continue;
-                        }
+static void timer_heap_remove(AsyncProcess *proc, int idx)
+{
+   proc->timers[idx]->heap_idx = -1;
+   if (idx != --proc->timers_cnt) {
+      proc->timers[idx] = proc->timers[proc->timers_cnt];
+      timer_heap_move(proc, idx);
+   }
+}
 
-                        case SER_INT: {
-                           int val2;
-                           if (!buffer_read_int(buf2, &val2)) goto error;
-                           if (val1 != val2) {
-                              return val1 < val2? -1 : +1;
-                           }
-                           continue;
-                        }
 
-                        case SER_FLOAT:
-                        case SER_FLOAT_ZERO:
-                        case SER_ARRAY:
-                        case SER_ARRAY_BYTE:
-                        case SER_ARRAY_SHORT:
-                        case SER_ARRAY_INT:
-                        case SER_STRING_BYTE:
-                        case SER_STRING_SHORT:
-                        case SER_STRING_INT:
-                        case SER_HASH:
-                           return -1;
-                     }
-                     goto error;
-                  }
-                  if (len1 == len2) {
-                     continue;
-                  }
-                  return len1 - len2;
-               }
+// the timers are indexed by their ids in an open addressing table, the ids are the full sequence
+// numbers so stale ids can't match another timer until the 31-bit counter wraps around:
+static inline int hash_timer_id(int id)
+{
+   uint32_t hash = (uint32_t)id * 0x9E3779B1;
+   return hash ^ (hash >> 15);
+}
 
-               case SER_ARRAY_BYTE: {
-                  uint16_t val1;
-                  uint8_t val2;
-                  int i, len1, len2, len;
 
-                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
-                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
-                  len = len1 < len2? len1 : len2;
+static AsyncTimer **find_timer_id(AsyncProcess *proc, int id)
+{
+   AsyncTimer *timer;
+   int idx, mask = proc->timer_ids_cap-1;
 
-                  for (i=0; i<len; i++) {
-                     if (!buffer_read_short(buf1, &val1)) goto error;
-                     if (!buffer_read_byte(buf2, &val2)) goto error;
-                     if (val1 != val2) {
-                        return (int)val1 - (int)val2;
-                     }
-                  }
-                  if (len1 == len2) {
-                     continue;
-                  }
-                  return len1 - len2;
-               }
+   if (proc->timer_ids_cap == 0) {
+      return NULL;
+   }
+   for (idx = hash_timer_id(id) & mask; (timer = proc->timer_ids[idx]); idx = (idx+1) & mask) {
+      if (timer->id == id) {
+         return &proc->timer_ids[idx];
+      }
+   }
+   return NULL;
+}
 
-               case SER_ARRAY_SHORT: {
-                  uint16_t val1;
-                  uint16_t val2;
-                  int i, len1, len2, len;
 
-                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
-                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
-                  len = len1 < len2? len1 : len2;
+static void put_timer_id(AsyncTimer **table, int mask, AsyncTimer *timer)
+{
+   int idx;
 
-                  for (i=0; i<len; i++) {
-                     if (!buffer_read_short(buf1, &val1)) goto error;
-                     if (!buffer_read_short(buf2, &val2)) goto error;
-                     if (val1 != val2) {
-                        return (int)val1 - (int)val2;
-                     }
-                  }
-                  if (len1 == len2) {
-                     continue;
-                  }
-                  return len1 - len2;
-               }
+   for (idx = hash_timer_id(timer->id) & mask; table[idx]; idx = (idx+1) & mask);
+   table[idx] = timer;
+}
 
-               case SER_ARRAY_INT: {
-                  uint16_t val1;
-                  int val2;
-                  int i, len1, len2, len;
 
-                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
-                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
-                  len = len1 < len2? len1 : len2;
+static int alloc_timer_id(AsyncProcess *proc, AsyncTimer *timer)
+{
+   AsyncTimer **new_ids;
+   int i, new_cap;
 
-                  for (i=0; i<len; i++) {
-                     if (!buffer_read_short(buf1, &val1)) goto error;
-                     if (!buffer_read_int(buf2, &val2)) goto error;
-                     if (val1 != val2) {
-                        return val1 < val2? -1 : +1;
-                     }
-                  }
-                  if (len1 == len2) {
-                     continue;
-                  }
-                  return len1 - len2;
-               }
+   if ((proc->timer_ids_cnt+1)*2 > proc->timer_ids_cap) {
+      if (proc->timer_ids_cnt >= MAX_TIMERS) {
+         return 0;
+      }
+      new_cap = proc->timer_ids_cap? proc->timer_ids_cap*2 : 16;
+      new_ids = calloc(new_cap, sizeof(AsyncTimer *));
+      if (!new_ids) {
+         return 0;
+      }
+      for (i=0; i<proc->timer_ids_cap; i++) {
+         if (proc->timer_ids[i]) {
+            put_timer_id(new_ids, new_cap-1, proc->timer_ids[i]);
+         }
+      }
+      free(proc->timer_ids);
+      proc->timer_ids = new_ids;
+      proc->timer_ids_cap = new_cap;
+   }
 
-               case SER_STRING_BYTE:
-               case SER_STRING_SHORT:
-               case SER_STRING_INT:
-               case SER_HASH:
-                  return -1;
-            }
-            goto error;
+   do {
+      timer->seq = proc->timer_seq++;
+      timer->id = timer->seq & 0x7FFFFFFF;
+   }
+   while (timer->id == 0 || find_timer_id(proc, timer->id));
 
-         case SER_ARRAY_INT:
-            switch (type2 & 0x0F) {
-               case SER_ZERO:
-               case SER_BYTE:
-               case SER_SHORT:
-               case SER_INT:
-               case SER_FLOAT:
-               case SER_FLOAT_ZERO:
-                  return +1;
+   put_timer_id(proc->timer_ids, proc->timer_ids_cap-1, timer);
+   proc->timer_ids_cnt++;
+   return 1;
+}
 
-               case SER_ARRAY: {
-                  int val1;
-                  int i, len1, len2, len;
 
-                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
-                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
-                  len = len1 < len2? len1 : len2;
+static void free_timer_id(AsyncProcess *proc, AsyncTimer *timer)
+{
+   AsyncTimer **table = proc->timer_ids, *other;
+   int i, j, home, mask = proc->timer_ids_cap-1;
 
-                  for (i=0; i<len; i++) {
-                     if (!buffer_read_int(buf1, &val1)) goto error;
-                     if (!buffer_read_byte(buf2, &type2)) goto error;
-                     switch (type2 & 0x0F) {
-                        case SER_ZERO:
-                           if (val1 < 0) return -1;
-                           if (val1 > 0) return +1;
-                           continue;
+   i = find_timer_id(proc, timer->id) - table;
+   proc->timer_ids_cnt--;
 
-                        case SER_BYTE: {
-                           uint8_t val2;
-                           if (!buffer_read_byte(buf2, &val2)) goto error;
-                           if (val1 != val2) {
-                              return val1 < val2? -1 : +1;
-                           }
-                           continue;
-                        }
+   // shift back the following entries of the cluster that would become unreachable:
+   for (j = (i+1) & mask; (other = table[j]); j = (j+1) & mask) {
+      home = hash_timer_id(other->id) & mask;
+      if (i <= j? (i < home && home <= j) : (i < home || home <= j)) {
+         continue;
+      }
+      table[i] = other;
+      i = j;
+   }
+   table[i] = NULL;
+}
 
-                        case SER_SHORT: {
-                           uint16_t val2;
-                           if (!buffer_read_short(buf2, &val2)) goto error;
-                           if (val1 != val2) {
-                              return val1 < val2? -1 : +1;
-                           }
-                           continue;
-                        }
 
-                        case SER_INT: {
-                           int val2;
-                           if (!buffer_read_int(buf2, &val2)) goto error;
-                           if (val1 != val2) {
-                              return val1 < val2? -1 : +1;
-                           }
-                           continue;
-                        }
+static void wait_events(AsyncProcess *proc, int timeout)
+{
+   AsyncTimer *timer;
+   int32_t diff;
+#ifdef _WIN32
+   CompletedIO *cio;
+#endif
 
-                        case SER_FLOAT:
-                        case SER_FLOAT_ZERO:
-                        case SER_ARRAY:
-                        case SER_ARRAY_BYTE:
-                        case SER_ARRAY_SHORT:
-                        case SER_ARRAY_INT:
-                        case SER_STRING_BYTE:
-                        case SER_STRING_SHORT:
-                        case SER_STRING_INT:
-                        case SER_HASH:
-                           return -1;
-                     }
-                     goto error;
-                  }
-                  if (len1 == len2) {
-                     continue;
-                  }
-                  return len1 - len2;
-               }
+   pthread_mutex_lock(&proc->mutex);
+   if (proc->timers_cnt > 0) {
+      timer = proc->timers[0];
+      if (timer->immediate) {
+         timeout = 0;
+      }
+      else {
+         diff = (int32_t)(timer->time - get_timer_time(proc));
+         if (timeout < 0 || diff < timeout) {
+            timeout = diff;
+            if (timeout < 0) timeout = 0;
+         }
+      }
+   }
+   pthread_mutex_unlock(&proc->mutex);
 
-               case SER_ARRAY_BYTE: {
-                  int val1;
-                  uint8_t val2;
-                  int i, len1, len2, len;
+#if defined(_WIN32)
+   if (timeout < 0) {
+      timeout = INFINITE;
+   }
+   proc->num_events = 0;
+   cio = &proc->completed_ios[0];
 
-                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
-                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
-                  len = len1 < len2? len1 : len2;
+   while (proc->num_events < sizeof(proc->completed_ios)/sizeof(CompletedIO)) {
+      GetQueuedCompletionStatus(proc->iocp, &cio->transferred, &cio->key, (OVERLAPPED **)&cio->overlapped, timeout);
+      if (!cio->overlapped) break;
 
-                  for (i=0; i<len; i++) {
-                     if (!buffer_read_int(buf1, &val1)) goto error;
-                     if (!buffer_read_byte(buf2, &val2)) goto error;
-                     if (val1 != val2) {
-                        return val1 < val2? -1 : +1;
-                     }
-                  }
-                  if (len1 == len2) {
-                     continue;
-                  }
-                  return len1 - len2;
-               }
+      cio = &proc->completed_ios[++proc->num_events];
+      timeout = 0;
+   }
+#elif defined(__wasm__)
+#else
+   if (timeout < 0) {
+      timeout = -1;
+   }
+   poll_wait(proc->poll, timeout);
+#endif
+}
+#endif
 
-               case SER_ARRAY_SHORT: {
-                  int val1;
-                  uint16_t val2;
-                  int i, len1, len2, len;
 
-                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
-                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
-                  len = len1 < len2? len1 : len2;
+#ifndef __wasm__
+static int process_events(AsyncProcess *proc, Heap *heap, Value *error)
+{
+   AsyncThreadResult *atr = NULL, *atr_next;
+   AsyncTimer *timer, *expired, **expired_last;
+   AsyncHandle *handle;
+   Value handle_val, callback_error;
+   uint32_t time = 0;
+   int32_t diff;
+   int time_obtained;
+#if defined(_WIN32)
+   CompletedIO *cio;
+   int i;
+#else
+   int flags;
+#endif
 
-                  for (i=0; i<len; i++) {
-                     if (!buffer_read_int(buf1, &val1)) goto error;
-                     if (!buffer_read_short(buf2, &val2)) goto error;
-                     if (val1 != val2) {
-                        return val1 < val2? -1 : +1;
-                     }
-                  }
-                  if (len1 == len2) {
-                     continue;
-                  }
-                  return len1 - len2;
-               }
+#if defined(_WIN32)
+   for (i=0; i<proc->num_events; i++) {
+      cio = &proc->completed_ios[i];
+      if (cio->overlapped == proc) {
+         continue;
+      }
 
-               case SER_ARRAY_INT: {
-                  int val1;
-                  int val2;
-                  int i, len1, len2, len;
+      handle = (AsyncHandle *)(uintptr_t)cio->key;
+      if (handle->type == ASYNC_TCP_CONNECTION) {
+         if ((void *)cio->overlapped == &handle->read.overlapped) {
+            if (handle->active & ASYNC_READ) {
+               Value callback, data;
+               int result = cio->transferred;
 
-                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
-                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
-                  len = len1 < len2? len1 : len2;
+               callback = handle->read.callback;
+               data = handle->read.data;
+               handle->active &= ~ASYNC_READ;
 
-                  for (i=0; i<len; i++) {
-                     if (!buffer_read_int(buf1, &val1)) goto error;
-                     if (!buffer_read_int(buf2, &val2)) goto error;
-                     if (val1 != val2) {
-                        return val1 < val2? -1 : +1;
+               if (fixscript_set_array_bytes(heap, handle->read.array, handle->read.off, result, handle->read.buf) != 0) {
+                  result = -1;
+               }
+               fixscript_unref(heap, handle->read.array);
+
+               fixscript_call(heap, callback, 2, &callback_error, data, fixscript_int(result));
+               if (callback_error.value) {
+                  fixscript_dump_value(heap, callback_error, 1);
+               }
+               fixscript_unref(heap, data);
+            }
+         }
+         if ((void *)cio->overlapped == &handle->write.overlapped) {
+            if (handle->active & ASYNC_WRITE) {
+               Value callback, data;
+               int result = cio->transferred;
+
+               if (handle->write.file) {
+                  if (handle->write.file_sent >= 0 && handle->write.file_remaining > 0) {
+                     handle->write.file_off += result;
+                     handle->write.file_remaining -= result;
+                     handle->write.file_sent += result;
+                     if (handle->write.file_remaining > 0) {
+                        if (result > 0 && async_send_file_next(handle)) {
+                           continue;
+                        }
+                        handle->write.file_sent = -1;
                      }
                   }
-                  if (len1 == len2) {
-                     continue;
-                  }
-                  return len1 - len2;
+                  result = handle->write.file_sent;
+                  file_handle_func(heap, HANDLE_OP_FREE, handle->write.file, NULL);
+                  handle->write.file = NULL;
                }
 
-               case SER_STRING_BYTE:
-               case SER_STRING_SHORT:
-               case SER_STRING_INT:
-               case SER_HASH:
-                  return -1;
+               callback = handle->write.callback;
+               data = handle->write.data;
+               handle->active &= ~ASYNC_WRITE;
+
+               fixscript_call(heap, callback, 2, &callback_error, data, fixscript_int(result));
+               if (callback_error.value) {
+                  fixscript_dump_value(heap, callback_error, 1);
+               }
+               fixscript_unref(heap, data);
             }
-            goto error;
+         }
+      }
+      else if (handle->type == ASYNC_TCP_SERVER) {
+         AsyncServerHandle *server_handle = (AsyncServerHandle *)handle;
+         if ((void *)cio->overlapped == &server_handle->overlapped) {
+            AsyncHandle *new_handle;
+            Value callback, data;
+            Value result = fixscript_int(0);
+            SOCKET socket;
 
-         case SER_STRING_BYTE:
-            switch (type2 & 0x0F) {
-               case SER_ZERO:
-               case SER_BYTE:
-               case SER_SHORT:
-               case SER_INT:
-               case SER_FLOAT:
-               case SER_FLOAT_ZERO:
-               case SER_ARRAY:
-               case SER_ARRAY_BYTE:
-               case SER_ARRAY_SHORT:
-               case SER_ARRAY_INT:
-                  return +1;
-
-               case SER_STRING_BYTE: {
-                  uint8_t val1, val2;
-                  int i, len1, len2, len;
-
-                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
-                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
-                  len = len1 < len2? len1 : len2;
+            socket = server_handle->accept_socket;
+            server_handle->accept_socket = INVALID_SOCKET;
 
-                  for (i=0; i<len; i++) {
-                     if (!buffer_read_byte(buf1, &val1)) goto error;
-                     if (!buffer_read_byte(buf2, &val2)) goto error;
-                     if (val1 != val2) {
-                        return (int)val1 - (int)val2;
-                     }
-                  }
-                  if (len1 == len2) {
-                     continue;
-                  }
-                  return len1 - len2;
+            new_handle = calloc(1, sizeof(AsyncHandle));
+            if (!new_handle) {
+               closesocket(socket);
+            }
+            else {
+               new_handle->proc = proc;
+               async_process_ref(new_handle->proc);
+               new_handle->type = ASYNC_TCP_CONNECTION;
+               new_handle->socket = socket;
+               if (!CreateIoCompletionPort((HANDLE)new_handle->socket, proc->iocp, (ULONG_PTR)new_handle, 0)) {
+                  async_process_unref(new_handle->proc);
+                  closesocket(new_handle->socket);
+                  free(new_handle);
                }
-
-               case SER_STRING_SHORT: {
-                  uint8_t val1;
-                  uint16_t val2;
-                  int i, len1, len2, len;
-
-                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
-                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
-                  len = len1 < len2? len1 : len2;
-
-                  for (i=0; i<len; i++) {
-                     if (!buffer_read_byte(buf1, &val1)) goto error;
-                     if (!buffer_read_short(buf2, &val2)) goto error;
-                     if (val1 != val2) {
-                        return (int)val1 - (int)val2;
-                     }
-                  }
-                  if (len1 == len2) {
-                     continue;
-                  }
-                  return len1 - len2;
+               else {
+                  result = fixscript_create_handle(heap, HANDLE_TYPE_ASYNC, new_handle, free_async_handle);
                }
+            }
 
-               case SER_STRING_INT: {
-                  uint8_t val1;
-                  int val2;
-                  int i, len1, len2, len;
-
-                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
-                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
-                  len = len1 < len2? len1 : len2;
-
-                  for (i=0; i<len; i++) {
-                     if (!buffer_read_byte(buf1, &val1)) goto error;
-                     if (!buffer_read_int(buf2, &val2)) goto error;
-                     if (val1 != val2) {
-                        return val1 < val2? -1 : +1;
-                     }
-                  }
-                  if (len1 == len2) {
-                     continue;
-                  }
-                  return len1 - len2;
-               }
+            callback = server_handle->callback;
+            data = server_handle->data;
+            server_handle->active = 0;
 
-               case SER_HASH:
-                  return -1;
+            fixscript_call(heap, callback, 2, &callback_error, data, result);
+            if (callback_error.value) {
+               fixscript_dump_value(heap, callback_error, 1);
             }
-            goto error;
-
-         case SER_STRING_SHORT:
-            switch (type2 & 0x0F) {
-               case SER_ZERO:
-               case SER_BYTE:
-               case SER_SHORT:
-               case SER_INT:
-               case SER_FLOAT:
-               case SER_FLOAT_ZERO:
-               case SER_ARRAY:
-               case SER_ARRAY_BYTE:
-               case SER_ARRAY_SHORT:
-               case SER_ARRAY_INT:
-                  return +1;
+            fixscript_unref(heap, data);
+         }
+      }
+   }
+#else
+   for (;;) {
+      handle = poll_get_event(proc->poll, &flags);
+      if (!handle) break;
 
-               case SER_STRING_BYTE: {
-                  uint16_t val1;
-                  uint8_t val2;
-                  int i, len1, len2, len;
+      if (handle->type == ASYNC_TCP_CONNECTION) {
+         if (flags & ASYNC_READ) {
+            if (handle->active & ASYNC_READ) {
+               Value callback, data;
+               char *buf;
+               int err = 0, result = -1;
 
-                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
-                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
-                  len = len1 < len2? len1 : len2;
+               callback = handle->read.callback;
+               data = handle->read.data;
+               handle->active &= ~ASYNC_READ;
 
-                  for (i=0; i<len; i++) {
-                     if (!buffer_read_short(buf1, &val1)) goto error;
-                     if (!buffer_read_byte(buf2, &val2)) goto error;
-                     if (val1 != val2) {
-                        return (int)val1 - (int)val2;
-                     }
-                  }
-                  if (len1 == len2) {
-                     continue;
-                  }
-                  return len1 - len2;
+               err = fixscript_lock_array(heap, handle->read.array, handle->read.off, handle->read.len, (void **)&buf, 1, ACCESS_WRITE_ONLY);
+               if (!err) {
+                  result = read(handle->fd, buf, handle->read.len);
+                  handle->read.len = result;
+                  if (handle->read.len < 0) handle->read.len = 0;
+                  fixscript_unlock_array(heap, handle->read.array, handle->read.off, handle->read.len, (void **)&buf, 1, ACCESS_WRITE_ONLY);
                }
+               fixscript_unref(heap, handle->read.array);
 
-               case SER_STRING_SHORT: {
-                  uint16_t val1, val2;
-                  int i, len1, len2, len;
-
-                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
-                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
-                  len = len1 < len2? len1 : len2;
+               fixscript_call(heap, callback, 2, &callback_error, data, fixscript_int(result));
+               if (callback_error.value) {
+                  fixscript_dump_value(heap, callback_error, 1);
+               }
+               fixscript_unref(heap, data);
+            }
+         }
+         if (flags & ASYNC_WRITE) {
+            if ((handle->active & ASYNC_WRITE) && (!handle->write.file || async_send_file_step(handle))) {
+               Value callback, data;
 
-                  for (i=0; i<len; i++) {
-                     if (!buffer_read_short(buf1, &val1)) goto error;
-                     if (!buffer_read_short(buf2, &val2)) goto error;
-                     if (val1 != val2) {
-                        return (int)val1 - (int)val2;
-                     }
-                  }
-                  if (len1 == len2) {
-                     continue;
-                  }
-                  return len1 - len2;
+               if (handle->write.file) {
+                  file_handle_func(heap, HANDLE_OP_FREE, handle->write.file, NULL);
+                  handle->write.file = NULL;
                }
 
-               case SER_STRING_INT: {
-                  uint16_t val1;
-                  int val2;
-                  int i, len1, len2, len;
+               callback = handle->write.callback;
+               data = handle->write.data;
+               handle->active &= ~ASYNC_WRITE;
 
-                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
-                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
-                  len = len1 < len2? len1 : len2;
+               fixscript_call(heap, callback, 2, &callback_error, data, fixscript_int(handle->write.result));
+               if (callback_error.value) {
+                  fixscript_dump_value(heap, callback_error, 1);
+               }
+               fixscript_unref(heap, data);
+            }
+         }
+         update_poll_ctl(handle);
+      }
+      else if (handle->type == ASYNC_TCP_SERVER) {
+         AsyncServerHandle *server_handle = (AsyncServerHandle *)handle;
+         AsyncHandle *new_handle;
+         if (flags & ASYNC_READ) {
+            Value callback, data;
+            Value result = fixscript_int(0);
+            int fd, flag;
+            fd = accept(server_handle->fd, NULL, NULL);
+            if (fd >= 0) {
+               flag = 1;
+               setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(int));
+               flag = fcntl(fd, F_GETFL);
+               flag |= O_NONBLOCK;
+               fcntl(fd, F_SETFL, flag);
 
-                  for (i=0; i<len; i++) {
-                     if (!buffer_read_short(buf1, &val1)) goto error;
-                     if (!buffer_read_int(buf2, &val2)) goto error;
-                     if (val1 != val2) {
-                        return val1 < val2? -1 : +1;
-                     }
+               new_handle = calloc(1, sizeof(AsyncHandle));
+               if (!new_handle) {
+                  close(fd);
+               }
+               else {
+                  new_handle->proc = proc;
+                  async_process_ref(new_handle->proc);
+                  new_handle->type = ASYNC_TCP_CONNECTION;
+                  new_handle->fd = fd;
+                  if (!poll_add_socket(proc->poll, fd, new_handle, 0)) {
+                     async_process_unref(new_handle->proc);
+                     close(new_handle->fd);
+                     free(new_handle);
                   }
-                  if (len1 == len2) {
-                     continue;
+                  else {
+                     result = fixscript_create_handle(heap, HANDLE_TYPE_ASYNC, new_handle, free_async_handle);
                   }
-                  return len1 - len2;
                }
-
-               case SER_HASH:
-                  return -1;
             }
-            goto error;
 
-         case SER_STRING_INT:
-            switch (type2 & 0x0F) {
-               case SER_ZERO:
-               case SER_BYTE:
-               case SER_SHORT:
-               case SER_INT:
-               case SER_FLOAT:
-               case SER_FLOAT_ZERO:
-               case SER_ARRAY:
-               case SER_ARRAY_BYTE:
-               case SER_ARRAY_SHORT:
-               case SER_ARRAY_INT:
-                  return +1;
-
-               case SER_STRING_BYTE: {
-                  int val1;
-                  uint8_t val2;
-                  int i, len1, len2, len;
-
-                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
-                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
-                  len = len1 < len2? len1 : len2;
-
-                  for (i=0; i<len; i++) {
-                     if (!buffer_read_int(buf1, &val1)) goto error;
-                     if (!buffer_read_byte(buf2, &val2)) goto error;
-                     if (val1 != val2) {
-                        return val1 < val2? -1 : +1;
-                     }
-                  }
-                  if (len1 == len2) {
-                     continue;
-                  }
-                  return len1 - len2;
-               }
-
-               case SER_STRING_SHORT: {
-                  int val1;
-                  uint16_t val2;
-                  int i, len1, len2, len;
-
-                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
-                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
-                  len = len1 < len2? len1 : len2;
+            callback = server_handle->callback;
+            data = server_handle->data;
+            server_handle->active = 0;
 
-                  for (i=0; i<len; i++) {
-                     if (!buffer_read_int(buf1, &val1)) goto error;
-                     if (!buffer_read_short(buf2, &val2)) goto error;
-                     if (val1 != val2) {
-                        return val1 < val2? -1 : +1;
-                     }
-                  }
-                  if (len1 == len2) {
-                     continue;
-                  }
-                  return len1 - len2;
-               }
+            fixscript_call(heap, callback, 2, &callback_error, data, result);
+            if (callback_error.value) {
+               fixscript_dump_value(heap, callback_error, 1);
+            }
+            fixscript_unref(heap, data);
+         }
+         update_poll_ctl(handle);
+      }
+   }
+#endif
 
-               case SER_STRING_INT: {
-                  int val1, val2;
-                  int i, len1, len2, len;
+   pthread_mutex_lock(&proc->mutex);
+   atr = proc->thread_results;
+   proc->thread_results = NULL;
+   pthread_mutex_unlock(&proc->mutex);
 
-                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
-                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
-                  len = len1 < len2? len1 : len2;
+   while (atr) {
+      if (atr->type == ASYNC_TCP_CONNECTION) {
+         #ifdef _WIN32
+         if (atr->socket != INVALID_SOCKET)
+         #else
+         if (atr->fd != -1)
+         #endif
+         {
+            handle = calloc(1, sizeof(AsyncHandle));
+            if (!handle) {
+               #ifdef _WIN32
+               closesocket(handle->socket);
+               #else
+               close(handle->fd);
+               #endif
+               fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+               goto error;
+            }
+            handle->proc = proc;
+            async_process_ref(handle->proc);
+            handle->type = ASYNC_TCP_CONNECTION;
+            #ifdef _WIN32
+            handle->socket = atr->socket;
+            if (!CreateIoCompletionPort((HANDLE)handle->socket, proc->iocp, (ULONG_PTR)handle, 0)) {
+               async_process_unref(handle->proc);
+               closesocket(handle->socket);
+               free(handle);
+               *error = fixscript_create_error_string(heap, "can't add socket to IO completion port");
+               goto error;
+            }
+            #else
+            handle->fd = atr->fd;
+            if (!poll_add_socket(proc->poll, atr->fd, handle, 0)) {
+               async_process_unref(handle->proc);
+               close(handle->fd);
+               free(handle);
+               *error = fixscript_create_error_string(heap, "can't add socket to poll");
+               goto error;
+            }
+            #endif
 
-                  for (i=0; i<len; i++) {
-                     if (!buffer_read_int(buf1, &val1)) goto error;
-                     if (!buffer_read_int(buf2, &val2)) goto error;
-                     if (val1 != val2) {
-                        return val1 < val2? -1 : +1;
-                     }
-                  }
-                  if (len1 == len2) {
-                     continue;
-                  }
-                  return len1 - len2;
-               }
+            handle_val = fixscript_create_handle(heap, HANDLE_TYPE_ASYNC, handle, free_async_handle);
+            if (!handle_val.value) {
+               fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+               goto error;
+            }
+         }
+         else {
+            handle_val = fixscript_int(0);
+         }
 
-               case SER_HASH:
-                  return -1;
+         fixscript_call(heap, atr->callback, 2, &callback_error, atr->data, handle_val);
+         if (callback_error.value) {
+            fixscript_dump_value(heap, callback_error, 1);
+         }
+         fixscript_unref(heap, atr->data);
+      }
+      else if (atr->type == ASYNC_FILE_OP) {
+         AsyncFileOp *file_op = atr->file_op;
+         Value result_val, error_val;
+         int err;
+
+         atr->file_op = NULL;
+         result_val = fixscript_int(file_op->result);
+         error_val = fixscript_int(0);
+         if (file_op->failed) {
+            result_val = fixscript_int(0);
+            error_val = fixscript_create_error_string(heap, "I/O error");
+         }
+         else if (file_op->type == FILE_OP_READ && file_op->result > 0) {
+            err = fixscript_set_array_bytes(heap, file_op->array, file_op->off, file_op->result, file_op->buf);
+            if (err) {
+               result_val = fixscript_int(0);
+               fixscript_error(heap, &error_val, err);
             }
-            goto error;
+         }
+         if (file_op->type == FILE_OP_READ) {
+            fixscript_unref(heap, file_op->array);
+         }
+         free(file_op->buf);
+         free(file_op);
 
-         case SER_HASH:
-            switch (type2 & 0x0F) {
-               case SER_ZERO:
-               case SER_BYTE:
-               case SER_SHORT:
-               case SER_INT:
-               case SER_FLOAT:
-               case SER_FLOAT_ZERO:
-               case SER_ARRAY:
-               case SER_ARRAY_BYTE:
-               case SER_ARRAY_SHORT:
-               case SER_ARRAY_INT:
-               case SER_STRING_BYTE:
-               case SER_STRING_SHORT:
-               case SER_STRING_INT:
-                  return +1;
+         fixscript_call(heap, atr->callback, 3, &callback_error, atr->data, result_val, error_val);
+         if (callback_error.value) {
+            fixscript_dump_value(heap, callback_error, 1);
+         }
+         fixscript_unref(heap, atr->data);
+      }
+      atr_next = atr->next;
+      free(atr);
+      atr = atr_next;
+   }
 
-               case SER_HASH: {
-                  int len1, len2, len, ret;
+   pthread_mutex_lock(&proc->mutex);
+   time_obtained = 0;
+   expired = NULL;
+   expired_last = &expired;
+   while (proc->timers_cnt > 0) {
+      timer = proc->timers[0];
+      if (!timer->immediate) {
+         if (!time_obtained) {
+            time = get_timer_time(proc);
+            time_obtained = 1;
+         }
+         diff = (int32_t)(timer->time - time);
+         if (diff > 0) break;
+      }
 
-                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
-                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
-                  len = len1 < len2? len1 : len2;
-                  if (len >= ((1<<30)-1)) goto error;
+      timer_heap_remove(proc, 0);
+      timer->next = NULL;
+      *expired_last = timer;
+      expired_last = &timer->next;
+   }
+   pthread_mutex_unlock(&proc->mutex);
 
-                  ret = compare_serialized_values(buf1, buf2, len*2);
-                  if (ret != 0) return ret;
-                  if (len1 == len2) {
-                     continue;
-                  }
-                  return len1 - len2;
-               }
-            }
-            goto error;
+   while (expired) {
+      timer = expired;
+      expired = timer->next;
 
-         default:
-            goto error;
+      pthread_mutex_lock(&proc->mutex);
+      free_timer_id(proc, timer);
+      pthread_mutex_unlock(&proc->mutex);
+
+      if (!timer->cancelled) {
+         fixscript_call(heap, timer->callback, 1, &callback_error, timer->data);
+         if (callback_error.value) {
+            fixscript_dump_value(heap, callback_error, 1);
+         }
       }
+      fixscript_unref(heap, timer->data);
+      free(timer);
    }
-   return 0;
+   return 1;
 
 error:
-   return 0x80000000;
+   while (atr) {
+      atr_next = atr->next;
+      free(atr);
+      atr = atr_next;
+   }
+   return 0;
 }
+#endif /* __wasm__ */
 
 
-static int compare_sorted_entries(const void *e1, const void *e2)
+static Value native_async_process(Heap *heap, Value *error, int num_params, Value *params, void *func_data)
 {
-   const SortedEntry *entry1 = (void *)e1;
-   const SortedEntry *entry2 = (void *)e2;
-   Buffer buf1, buf2;
-
-   buf1.cur = entry1->key;
-   buf1.end = entry1->key + entry1->key_len;
-   buf2.cur = entry2->key;
-   buf2.end = entry2->key + entry2->key_len;
-   return compare_serialized_values(&buf1, &buf2, 1);
-}
+#if defined(__wasm__)
+   *error = fixscript_create_error_string(heap, "not supported");
+   return fixscript_int(0);
+#else
+   AsyncProcess *proc;
+   int timeout = -1, infinite;
+   Value quit_value;
+   
+   proc = get_async_process(heap, error);
+   if (!proc) return fixscript_int(0);
+   
+   if (proc->foreign_notify_func) {
+      *error = fixscript_create_error_string(heap, "can't use async_process when integrated with other event loop");
+      return fixscript_int(0);
+   }
 
+   if (num_params == 1) {
+      timeout = fixscript_get_int(params[0]);
+   }
 
-static int serialize_key(Heap *heap, Value value, Buffer *buf, int recursion_limit);
+   fixscript_unref(heap, proc->quit_value);
+   infinite = (timeout < 0);
+   proc->quit = !infinite;
+   proc->quit_value = fixscript_int(0);
 
-static int serialize_subkey(Heap *heap, Value value, char **out_data, int *out_len, int recursion_limit)
-{
-   Buffer buf;
-   int err;
+   if (infinite) {
+      timeout = -1;
+   }
 
-   buf.start = malloc(8);
-   if (!buf.start) {
-      return FIXSCRIPT_ERR_OUT_OF_MEMORY;
-   }
-   buf.cur = buf.start;
-   buf.end = buf.start + 8;
-
-   err = serialize_key(heap, value, &buf, recursion_limit);
-   if (err) {
-      free(buf.start);
-      return err;
+   do {
+      wait_events(proc, timeout);
+      if (!process_events(proc, heap, error)) {
+         return fixscript_int(0);
+      }
    }
+   while (!proc->quit);
 
-   *out_data = buf.start;
-   *out_len = buf.cur - buf.start;
-   return FIXSCRIPT_SUCCESS;
+   quit_value = proc->quit_value;
+   proc->quit_value = fixscript_int(0);
+   fixscript_unref(heap, quit_value);
+   return quit_value;
+#endif /* __wasm__ */
 }
 
 
-static int serialize_key(Heap *heap, Value value, Buffer *buf, int recursion_limit)
+static Value native_async_thread_pool_set_limits(Heap *heap, Value *error, int num_params, Value *params, void *data)
 {
-   Value key, elem;
-   SortedEntry *entries;
-   int i, err, val, max_val, has_refs, len, elem_size, is_string, pos;
-   void *data;
+#if defined(__wasm__)
+   *error = fixscript_create_error_string(heap, "not supported");
+   return fixscript_int(0);
+#else
+   pthread_mutex_t *mutex;
+   int min_threads = params[0].value;
+   int max_threads = params[1].value;
+   int max_queued = params[2].value;
 
-   if (recursion_limit <= 0) {
-      return FIXSCRIPT_ERR_RECURSION_LIMIT;
+   if (min_threads < 0 || max_threads < 1 || min_threads > max_threads || max_queued < 0) {
+      *error = fixscript_create_error_string(heap, "invalid limits");
+      return fixscript_int(0);
    }
 
-   if (fixscript_is_int(value)) {
-      if (value.value == 0) {
-         if (!buffer_append_byte(buf, SER_ZERO)) goto error;
-         return FIXSCRIPT_SUCCESS;
-      }
-      if ((value.value & ~0xFF) == 0) {
-         if (!buffer_append_byte(buf, SER_BYTE)) goto error;
-         if (!buffer_append_byte(buf, value.value)) goto error;
-         return FIXSCRIPT_SUCCESS;
-      }
-      if ((value.value & ~0xFFFF) == 0) {
-         if (!buffer_append_byte(buf, SER_SHORT)) goto error;
-         if (!buffer_append_short(buf, value.value)) goto error;
-         return FIXSCRIPT_SUCCESS;
-      }
-      if (!buffer_append_byte(buf, SER_INT)) goto error;
-      if (!buffer_append_int(buf, value.value)) goto error;
-      return FIXSCRIPT_SUCCESS;
+   mutex = get_mutex(&threads_mutex);
+   if (!mutex || !get_cond(&threads_cond)) {
+      *error = fixscript_create_error_string(heap, "can't create mutex");
+      return fixscript_int(0);
    }
 
-   if (fixscript_is_float(value)) {
-      if (value.value == 0) {
-         if (!buffer_append_byte(buf, SER_FLOAT_ZERO)) goto error;
-         return FIXSCRIPT_SUCCESS;
-      }
-      // normalize NaNs:
-      val = value.value;
-      if (((val >> 23) & 0xFF) == 0xFF && (val & ((1<<23)-1))) {
-         val = (val & ~((1<<23)-1)) | (1 << 22);
+   pthread_mutex_lock(mutex);
+   threads_min = min_threads;
+   threads_max = max_threads;
+   threads_max_queued = max_queued;
+   while (threads_cnt < threads_min) {
+      if (!start_pool_thread()) {
+         pthread_mutex_unlock(mutex);
+         *error = fixscript_create_error_string(heap, "can't create thread");
+         return fixscript_int(0);
       }
-      if (!buffer_append_byte(buf, SER_FLOAT)) goto error;
-      if (!buffer_append_int(buf, val)) goto error;
-      return FIXSCRIPT_SUCCESS;
    }
+   // wake idle threads so that threads above the new maximum exit:
+   pthread_cond_broadcast(get_cond(&threads_cond));
+   pthread_mutex_unlock(mutex);
+   return fixscript_int(0);
+#endif
+}
 
-   if (fixscript_is_array(heap, value)) {
-      is_string = fixscript_is_string(heap, value);
 
-      err = fixscript_get_array_length(heap, value, &len);
-      if (err) return err;
-      err = fixscript_has_array_references(heap, value, 0, len, 1, &has_refs);
-      if (err) return err;
+static Value native_async_thread_pool_set_idle_timeout(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+#ifndef __wasm__
+   pthread_mutex_t *mutex;
 
-      if (has_refs) {
-         if (is_string) {
-            return FIXSCRIPT_ERR_UNSERIALIZABLE_REF;
-         }
+   if (params[0].value < 1) {
+      *error = fixscript_create_error_string(heap, "invalid timeout");
+      return fixscript_int(0);
+   }
 
-         if (!buffer_append_length(buf, SER_ARRAY, len)) goto error;
-         for (i=0; i<len; i++) {
-            err = fixscript_get_array_elem(heap, value, i, &elem);
-            if (err) return err;
-            err = serialize_key(heap, elem, buf, recursion_limit-1);
-            if (err) return err;
-         }
-         return FIXSCRIPT_SUCCESS;
-      }
+   mutex = get_mutex(&threads_mutex);
+   if (!mutex || !get_cond(&threads_cond)) {
+      *error = fixscript_create_error_string(heap, "can't create mutex");
+      return fixscript_int(0);
+   }
 
-      err = fixscript_get_array_element_size(heap, value, &elem_size);
-      if (err) return err;
-      err = fixscript_lock_array(heap, value, 0, len, &data, elem_size, ACCESS_READ_ONLY);
-      if (err) return err;
+   // wake idle threads so that they wait with the new timeout:
+   pthread_mutex_lock(mutex);
+   threads_idle_timeout = params[0].value;
+   pthread_cond_broadcast(get_cond(&threads_cond));
+   pthread_mutex_unlock(mutex);
+#endif
+   return fixscript_int(0);
+}
 
-      if (elem_size == 1) {
-         if (!buffer_append_length(buf, is_string? SER_STRING_BYTE : SER_ARRAY_BYTE, len)) goto array_memory_error;
-         while (buf->end - buf->cur < len) {
-            if (!buffer_expand(buf)) goto array_memory_error;
-         }
-         memcpy(buf->cur, data, len);
-         buf->cur += len;
-      }
-      else if (elem_size == 2) {
-         max_val = 0;
-         for (i=0; i<len; i++) {
-            max_val |= ((uint16_t *)data)[i];
-         }
-         if ((max_val & ~0xFF) == 0) {
-            if (!buffer_append_length(buf, is_string? SER_STRING_BYTE : SER_ARRAY_BYTE, len)) goto array_memory_error;
-            while (buf->end - buf->cur < len) {
-               if (!buffer_expand(buf)) goto array_memory_error;
-            }
-            for (i=0; i<len; i++) {
-               *buf->cur++ = ((uint16_t *)data)[i];
-            }
-         }
-         else {
-            if (!buffer_append_length(buf, is_string? SER_STRING_SHORT : SER_ARRAY_SHORT, len)) goto array_memory_error;
-            if (len >= ((1<<30)-1)) goto array_memory_error;
-            while (buf->end - buf->cur < len*2) {
-               if (!buffer_expand(buf)) goto array_memory_error;
-            }
-            for (i=0; i<len; i++) {
-               val = ((uint16_t *)data)[i];
-               *buf->cur++ = val & 0xFF;
-               *buf->cur++ = val >> 8;
-            }
-         }
-      }
-      else {
-         max_val = 0;
-         for (i=0; i<len; i++) {
-            max_val |= ((uint32_t *)data)[i];
-         }
-         if ((max_val & ~0xFF) == 0) {
-            if (!buffer_append_length(buf, is_string? SER_STRING_BYTE : SER_ARRAY_BYTE, len)) goto array_memory_error;
-            while (buf->end - buf->cur < len) {
-               if (!buffer_expand(buf)) goto array_memory_error;
-            }
-            for (i=0; i<len; i++) {
-               *buf->cur++ = ((uint32_t *)data)[i];
-            }
-         }
-         else if ((max_val & ~0xFFFF) == 0) {
-            if (!buffer_append_length(buf, is_string? SER_STRING_SHORT : SER_ARRAY_SHORT, len)) goto array_memory_error;
-            if (len >= ((1<<30)-1)) goto array_memory_error;
-            while (buf->end - buf->cur < len*2) {
-               if (!buffer_expand(buf)) goto array_memory_error;
-            }
-            for (i=0; i<len; i++) {
-               val = ((uint32_t *)data)[i];
-               *buf->cur++ = val & 0xFF;
-               *buf->cur++ = val >> 8;
-            }
-         }
-         else {
-            if (!buffer_append_length(buf, is_string? SER_STRING_INT : SER_ARRAY_INT, len)) goto array_memory_error;
-            if (len >= ((1<<29)-1)) goto array_memory_error;
-            while (buf->end - buf->cur < len*4) {
-               if (!buffer_expand(buf)) goto array_memory_error;
-            }
-            for (i=0; i<len; i++) {
-               val = ((uint32_t *)data)[i];
-               *buf->cur++ = val & 0xFF;
-               *buf->cur++ = (val >> 8) & 0xFF;
-               *buf->cur++ = (val >> 16) & 0xFF;
-               *buf->cur++ = (val >> 24) & 0xFF;
-            }
-         }
-      }
 
-array_error:
-      fixscript_unlock_array(heap, value, 0, len, &data, elem_size, ACCESS_READ_ONLY);
-      return err;
+static Value native_async_thread_pool_get_stats(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+   Value values[THREAD_POOL_STATS_SIZE], ret;
+   int err;
+#ifndef __wasm__
+   pthread_mutex_t *mutex;
+#endif
 
-array_memory_error:
-      err = FIXSCRIPT_ERR_OUT_OF_MEMORY;
-      goto array_error;
+   memset(values, 0, sizeof(values));
+
+#ifndef __wasm__
+   mutex = get_mutex(&threads_mutex);
+   if (!mutex) {
+      *error = fixscript_create_error_string(heap, "can't create mutex");
+      return fixscript_int(0);
    }
 
-   if (fixscript_is_hash(heap, value)) {
-      err = fixscript_get_array_length(heap, value, &len);
-      if (err) return err;
+   pthread_mutex_lock(mutex);
+   values[THREAD_POOL_STATS_threads] = fixscript_int(threads_cnt);
+   values[THREAD_POOL_STATS_idle_threads] = fixscript_int(threads_idle_cnt);
+   values[THREAD_POOL_STATS_queue_length] = fixscript_int(threads_queue_len);
+   values[THREAD_POOL_STATS_peak_threads] = fixscript_int(threads_peak);
+   values[THREAD_POOL_STATS_peak_queue_length] = fixscript_int(threads_peak_queue_len);
+   values[THREAD_POOL_STATS_completed_tasks] = fixscript_int(threads_completed > INT_MAX? INT_MAX : (int)threads_completed);
+   values[THREAD_POOL_STATS_rejected_tasks] = fixscript_int(threads_rejected > INT_MAX? INT_MAX : (int)threads_rejected);
+   pthread_mutex_unlock(mutex);
+#endif
 
-      if (!buffer_append_length(buf, SER_HASH, len)) goto error;
+   ret = fixscript_create_array(heap, THREAD_POOL_STATS_SIZE);
+   if (!ret.value) {
+      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+   }
+   err = fixscript_set_array_range(heap, ret, 0, THREAD_POOL_STATS_SIZE, values);
+   if (err) {
+      return fixscript_error(heap, error, err);
+   }
+   return ret;
+}
 
-      entries = calloc(len, sizeof(SortedEntry));
-      if (!entries) goto error;
 
-      i = 0;
-      pos = 0;
-      while (fixscript_iter_hash(heap, value, &key, &elem, &pos)) {
-         err = serialize_subkey(heap, key, &entries[i].key, &entries[i].key_len, recursion_limit-1);
-         if (err) goto hash_error;
-         err = serialize_subkey(heap, elem, &entries[i].value, &entries[i].value_len, recursion_limit-1);
-         if (err) goto hash_error;
-         i++;
-      }
+static Value native_async_use_io_uring(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+#ifdef USE_IO_URING
+   use_io_uring = params[0].value != 0;
+   return fixscript_int(1);
+#else
+   return fixscript_int(0);
+#endif
+}
 
-      qsort(entries, len, sizeof(SortedEntry), compare_sorted_entries);
 
-      for (i=0; i<len; i++) {
-         while (buf->end - buf->cur < entries[i].key_len + entries[i].value_len) {
-            if (!buffer_expand(buf)) goto hash_memory_error;
-         }
-         memcpy(buf->cur, entries[i].key, entries[i].key_len);
-         buf->cur += entries[i].key_len;
-         memcpy(buf->cur, entries[i].value, entries[i].value_len);
-         buf->cur += entries[i].value_len;
-      }
+static Value native_async_get_backend(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+#if defined(__wasm__)
+   return fixscript_create_string(heap, "none", -1);
+#else
+   AsyncProcess *proc;
+   const char *name;
 
-hash_error:
-      for (i=0; i<len; i++) {
-         free(entries[i].key);
-         free(entries[i].value);
-      }
-      free(entries);
-      return err;
-
-hash_memory_error:
-      err = FIXSCRIPT_ERR_OUT_OF_MEMORY;
-      goto hash_error;
-   }
-
-   return FIXSCRIPT_ERR_UNSERIALIZABLE_REF;
+   proc = get_async_process(heap, error);
+   if (!proc) return fixscript_int(0);
 
-error:
-   return FIXSCRIPT_ERR_OUT_OF_MEMORY;
+   #if defined(_WIN32)
+      name = "iocp";
+   #elif defined(USE_EPOLL)
+      name = "epoll";
+      #ifdef USE_IO_URING
+      if (proc->poll->uring) {
+         name = "io_uring";
+      }
+      #endif
+   #else
+      name = "poll";
+   #endif
+   return fixscript_create_string(heap, name, -1);
+#endif
 }
 
 
-static Value native_serialize_key(Heap *heap, Value *error, int num_params, Value *params, void *data)
+static Value native_async_run_later(Heap *heap, Value *error, int num_params, Value *params, void *data)
 {
-   Buffer buf;
-   Value ret = fixscript_int(0);
-   int64_t new_len;
-   int err, len;
+#if defined(__wasm__)
+   *error = fixscript_create_error_string(heap, "not supported");
+   return fixscript_int(0);
+#else
+   AsyncProcess *proc;
+   AsyncTimer *timer;
+   int id;
 
-   buf.start = malloc(64);
-   if (!buf.start) {
+   proc = get_async_process(heap, error);
+   if (!proc) return fixscript_int(0);
+
+   timer = calloc(1, sizeof(AsyncTimer));
+   if (!timer) {
       return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
    }
-   buf.cur = buf.start;
-   buf.end = buf.start + 64;
 
-   err = serialize_key(heap, params[num_params-1], &buf, 50);
-   if (err) {
-      fixscript_error(heap, error, err);
-      goto error;
+   if (params[0].value == 0) {
+      timer->immediate = 1;
+   }
+   else {
+      timer->time = get_timer_time(proc) + (uint32_t)params[0].value;
    }
 
-   if (num_params == 2) {
-      err = fixscript_get_array_length(heap, params[0], &len);
-      if (!err) {
-         new_len = (int64_t)len + (int64_t)(buf.cur - buf.start);
-         if (new_len > INT_MAX) err = FIXSCRIPT_ERR_OUT_OF_MEMORY;
-      }
-      if (!err) {
-         err = fixscript_set_array_length(heap, params[0], (int)new_len);
-      }
-      if (!err) {
-         err = fixscript_set_array_bytes(heap, params[0], len, buf.cur - buf.start, buf.start);
-      }
-      if (err) {
-         fixscript_error(heap, error, err);
-         goto error;
-      }
+   timer->callback = params[1];
+   timer->data = params[2];
+
+   pthread_mutex_lock(&proc->mutex);
+   if (!alloc_timer_id(proc, timer)) {
+      pthread_mutex_unlock(&proc->mutex);
+      free(timer);
+      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
    }
-   else {
-      ret = fixscript_create_byte_array(heap, buf.start, buf.cur - buf.start);
-      if (!ret.value) {
-         fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
-         goto error;
-      }
+   if (!timer_heap_add(proc, timer)) {
+      free_timer_id(proc, timer);
+      pthread_mutex_unlock(&proc->mutex);
+      free(timer);
+      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
    }
+   id = timer->id;
+   pthread_mutex_unlock(&proc->mutex);
 
-error:
-   free(buf.start);
-   return ret;
+   fixscript_ref(heap, timer->data);
+
+   if (proc->foreign_notify_func) {
+      async_process_notify(proc);
+   }
+   return fixscript_int(id);
+#endif /* __wasm__ */
 }
 
 
-static Value native_serialize_compare(Heap *heap, Value *error, int num_params, Value *params, void *data)
+static Value native_async_cancel_timer(Heap *heap, Value *error, int num_params, Value *params, void *data)
 {
-   Value arr1, arr2;
-   Buffer buf1, buf2;
-   char *data1 = NULL, *data2 = NULL;
-   int err, off1, len1, off2, len2, ret=0;
+#if defined(__wasm__)
+   *error = fixscript_create_error_string(heap, "not supported");
+   return fixscript_int(0);
+#else
+   AsyncProcess *proc;
+   AsyncTimer *timer = NULL, **timer_ptr;
+   int id = params[0].value;
+   int found = 0;
 
-   if (num_params == 6) {
-      arr1 = params[0];
-      off1 = params[1].value;
-      len1 = params[2].value;
-      arr2 = params[3];
-      off2 = params[4].value;
-      len2 = params[5].value;
+   proc = get_async_process(heap, error);
+   if (!proc) return fixscript_int(0);
+
+   pthread_mutex_lock(&proc->mutex);
+   timer_ptr = fixscript_is_int(params[0]) && id > 0? find_timer_id(proc, id) : NULL;
+   if (timer_ptr && !(*timer_ptr)->cancelled) {
+      timer = *timer_ptr;
    }
-   else {
-      arr1 = params[0];
-      arr2 = params[1];
-      off1 = 0;
-      off2 = 0;
-      err = fixscript_get_array_length(heap, arr1, &len1);
-      if (!err) {
-         err = fixscript_get_array_length(heap, arr2, &len2);
+   if (timer) {
+      found = 1;
+      if (timer->heap_idx >= 0) {
+         timer_heap_remove(proc, timer->heap_idx);
+         free_timer_id(proc, timer);
       }
-      if (err) {
-         return fixscript_error(heap, error, err);
+      else {
+         // already expired and waiting in the current batch in process_events:
+         timer->cancelled = 1;
+         timer = NULL;
       }
    }
+   pthread_mutex_unlock(&proc->mutex);
 
-   err = fixscript_lock_array(heap, arr1, off1, len1, (void **)&data1, 1, ACCESS_READ_ONLY);
-   if (!err) {
-      err = fixscript_lock_array(heap, arr2, off2, len2, (void **)&data2, 1, ACCESS_READ_ONLY);
-   }
-   if (err) {
-      fixscript_error(heap, error, err);
-      goto error;
+   if (timer) {
+      fixscript_unref(heap, timer->data);
+      free(timer);
    }
+   return fixscript_int(found);
+#endif /* __wasm__ */
+}
 
-   buf1.cur = data1;
-   buf1.end = data1 + len1;
-   buf2.cur = data2;
-   buf2.end = data2 + len2;
-   ret = compare_serialized_values(&buf1, &buf2, 1);
-   if (ret == 0x80000000) {
-      ret = 0;
-      fixscript_error(heap, error, FIXSCRIPT_ERR_BAD_FORMAT);
-      goto error;
-   }
-   if (ret < 0) ret = -1;
-   if (ret > 0) ret = +1;
 
-error:
-   if (data1) {
-      fixscript_unlock_array(heap, arr1, off1, len1, (void **)&data1, 1, ACCESS_READ_ONLY);
+static Value native_async_quit(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+#if defined(__wasm__)
+   *error = fixscript_create_error_string(heap, "not supported");
+   return fixscript_int(0);
+#else
+   AsyncProcess *proc;
+   Value quit_value = fixscript_int(0);
+   
+   proc = get_async_process(heap, error);
+   if (!proc) return fixscript_int(0);
+   
+   if (proc->foreign_notify_func) {
+      *error = fixscript_create_error_string(heap, "can't use async_quit when integrated with other event loop");
+      return fixscript_int(0);
    }
-   if (data2) {
-      fixscript_unlock_array(heap, arr2, off2, len2, (void **)&data2, 1, ACCESS_READ_ONLY);
+
+   if (num_params == 1) {
+      quit_value = params[0];
    }
-   return fixscript_int(ret);
+
+   fixscript_unref(heap, proc->quit_value);
+   proc->quit = 1;
+   proc->quit_value = quit_value;
+   fixscript_ref(heap, proc->quit_value);
+
+   return fixscript_int(0);
+#endif /* __wasm__ */
 }
 
 
-#ifndef _WIN32
-typedef struct {
-   char buf[8];
-   int cnt;
 #ifndef __wasm__
-   mbstate_t mbstate;
-#endif
-} NativeConvertState;
-
-static void convert_from_native(wchar_t *dest, int dest_len, char *src, int src_len, NativeConvertState *state, int *processed_dest, int *processed_src)
+static void *process_handle_func(Heap *heap, int op, void *p1, void *p2)
 {
-#ifndef __wasm__
-   mbstate_t mbstate_sav;
+   ProcessHandle *handle = p1;
+   switch (op) {
+      case HANDLE_OP_FREE:
+         if (__sync_sub_and_fetch(&handle->refcnt, 1) == 0) {
+            #if defined(_WIN32)
+               if (handle->flags & REDIR_IN) CloseHandle(handle->in);
+               if (handle->flags & REDIR_OUT) CloseHandle(handle->out);
+               if (handle->flags & REDIR_ERR) CloseHandle(handle->err);
+               if (handle->process != ERROR_INVALID_HANDLE) {
+                  CloseHandle(handle->process);
+               }
+            #elif defined(__wasm__)
+            #else
+               if (handle->flags & REDIR_IN) close(handle->in_fd);
+               if (handle->flags & REDIR_OUT) close(handle->out_fd);
+               if (handle->flags & REDIR_ERR) close(handle->err_fd);
+            #endif
+            free(handle);
+         }
+         break;
+
+      case HANDLE_OP_COPY:
+         __sync_add_and_fetch(&handle->refcnt, 1);
+         return handle;
+   }
+   return NULL;
+}
 #endif
-   wchar_t *orig_dest = dest;
-   char *orig_src = src;
-   unsigned int c;
-   unsigned char c2, c3, c4;
-   int parsed;
 
-   for (;;) {
-      while (src_len > 0 && state->cnt < sizeof(state->buf)) {
-         state->buf[state->cnt++] = *src++;
-         src_len--;
-      }
-      if (state->cnt <= 0 || dest_len <= 0) break;
 
-      if (state->buf[0] == 0) {
-         *dest++ = 0;
-         dest_len--;
-         memmove(state->buf, state->buf+1, --state->cnt);
-         continue;
+static Value native_process_create(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+#if defined(_WIN32)
+   ProcessHandle *handle;
+   Value *arg_values = NULL, key_val, value_val, handle_val, ret = fixscript_int(0);
+   uint16_t **args = NULL, *p, *cmdline = NULL, **envs = NULL, *key, *value, *envblock = NULL, *path = NULL;
+   DWORD proc_flags = 0;
+   STARTUPINFO si;
+   PROCESS_INFORMATION pi;
+   SECURITY_ATTRIBUTES sa;
+   HANDLE pipes[6];
+   HANDLE in_other, out_other, err_other;
+   int flags = params[3].value;
+   int num_args=0, total_len, len, num_envs=0, num_pipes;
+   int i, j, err, needs_quotes, pos, idx;
+
+   if (flags & REDIR_MERGE_ERR) {
+      if ((flags & (REDIR_OUT | REDIR_ERR)) != REDIR_OUT) {
+         *error = fixscript_create_error_string(heap, "incompatible flags");
+         goto error;
       }
+   }
 
-      if (native_charset_utf8) {
-         c = (unsigned char)state->buf[0];
-         if ((c & 0x80) == 0) {
-            parsed = 1;
+   err = fixscript_get_array_length(heap, params[0], &num_args);
+   if (!err) {
+      if (num_args < 1) {
+         *error = fixscript_create_error_string(heap, "must provide executable argument");
+         goto error;
+      }
+      arg_values = calloc(num_args, sizeof(Value));
+      if (!arg_values) {
+         err = FIXSCRIPT_ERR_OUT_OF_MEMORY;
+      }
+   }
+   if (!err) {
+      err = fixscript_get_array_range(heap, params[0], 0, num_args, arg_values);
+   }
+   if (!err) {
+      args = calloc(num_args, sizeof(uint8_t *));
+      if (!args) {
+         err = FIXSCRIPT_ERR_OUT_OF_MEMORY;
+      }
+   }
+   if (!err) {
+      for (i=0; i<num_args; i++) {
+         err = fixscript_get_string_utf16(heap, arg_values[i], 0, -1, &args[i], NULL);
+         if (err) break;
+      }
+   }
+   if (!err) {
+      total_len = 0;
+      for (i=0; i<num_args; i++) {
+         if (i > 0) total_len++;
+         needs_quotes = 0;
+         for (p = args[i]; *p; p++) {
+            if (*p == ' ' || *p == '"') {
+               needs_quotes = 1;
+               break;
+            }
          }
-         else if ((c & 0xE0) == 0xC0) {
-            if (state->cnt < 2) break;
-            c2 = state->buf[1];
-            c = ((c & 0x1F) << 6) | (c2 & 0x3F);
-            if (c < 0x80) {
-               c = 0xFFFD;
+         if (needs_quotes) {
+            total_len += 2;
+         }
+         for (p = args[i]; *p; p++) {
+            if (*p == '"') {
+               total_len += 3;
+               continue;
             }
-            parsed = 2;
+            total_len++;
          }
-         else if ((c & 0xF0) == 0xE0) {
-            if (state->cnt < 3) break;
-            c2 = state->buf[1];
-            c3 = state->buf[2];
-            c = ((c & 0x0F) << 12) | ((c2 & 0x3F) << 6) | (c3 & 0x3F);
-            if (c < 0x800) {
-               c = 0xFFFD;
+      }
+      cmdline = calloc(total_len+1, sizeof(uint16_t));
+      if (!cmdline) {
+         err = FIXSCRIPT_ERR_OUT_OF_MEMORY;
+      }
+   }
+   if (!err) {
+      for (i=0, j=0; i<num_args; i++) {
+         if (i > 0) {
+            cmdline[j++] = ' ';
+         }
+         needs_quotes = 0;
+         for (p = args[i]; *p; p++) {
+            if (*p == ' ' || *p == '"') {
+               needs_quotes = 1;
+               break;
             }
-            parsed = 3;
          }
-         else if ((c & 0xF8) == 0xF0) {
-            if (state->cnt < 4) break;
-            c2 = state->buf[1];
-            c3 = state->buf[2];
-            c4 = state->buf[3];
-            c = ((c & 0x07) << 18) | ((c2 & 0x3F) << 12) | ((c3 & 0x3F) << 6) | (c4 & 0x3F);
-            if (c < 0x10000 || c > 0x10FFFF) {
-               c = 0xFFFD;
+         if (needs_quotes) {
+            cmdline[j++] = '"';
+         }
+         for (p = args[i]; *p; p++) {
+            if (*p == '"') {
+               cmdline[j++] = '"';
+               cmdline[j++] = '"';
+               cmdline[j++] = '"';
+               continue;
             }
-            parsed = 4;
+            cmdline[j++] = *p;
          }
-         else {
-            c = 0xFFFD;
-            parsed = 1;
+         if (needs_quotes) {
+            cmdline[j++] = '"';
          }
-
-         if (c >= 0xD800 && c <= 0xDFFF) {
-            c = 0xFFFD;
+      }
+      cmdline[j] = 0;
+      if (j != total_len) {
+         err = FIXSCRIPT_ERR_OUT_OF_MEMORY;
+      }
+   }
+   if (params[1].value) {
+      if (!err) {
+         err = fixscript_get_array_length(heap, params[1], &num_envs);
+      }
+      if (!err) {
+         envs = calloc(num_envs*2, sizeof(uint16_t *));
+         if (!envs) {
+            err = FIXSCRIPT_ERR_OUT_OF_MEMORY;
          }
-
-         #if WCHAR_MAX > 0xFFFF
-            *dest = c;
-         #elif WCHAR_MAX > 0xFF
-            if (c > 0xFFFF) {
-               c = 0xFFFD;
+      }
+      if (!err) {
+         pos = 0;
+         idx = 0;
+         while (fixscript_iter_hash(heap, params[1], &key_val, &value_val, &pos)) {
+            err = fixscript_get_string_utf16(heap, key_val, 0, -1, &key, NULL);
+            if (err) {
+               break;
             }
-            *dest = c;
-         #else
-            if (c > 0xFF) {
-               c = '?';
+            err = fixscript_get_string_utf16(heap, value_val, 0, -1, &value, NULL);
+            if (err) {
+               free(key);
+               break;
             }
-            *dest = c;
-         #endif
+            envs[idx++] = key;
+            envs[idx++] = value;
+         }
+         if (!err && idx != num_envs*2) {
+            err = FIXSCRIPT_ERR_INVALID_ACCESS;
+         }
       }
-#ifndef __wasm__
-      else {
-         memcpy(&mbstate_sav, &state->mbstate, sizeof(mbstate_t));
-         parsed = (int)mbrtowc(dest, state->buf, state->cnt, &state->mbstate);
-         if (parsed == -2) {
-            memcpy(&state->mbstate, &mbstate_sav, sizeof(mbstate_t));
-            break;
+      if (!err) {
+         total_len = 0;
+         for (i=0; i<num_envs; i++) {
+            total_len += wcslen(envs[i*2+0]);
+            total_len++;
+            total_len += wcslen(envs[i*2+1]);
+            total_len++;
          }
-         if (parsed < 0) {
-            memcpy(&state->mbstate, &mbstate_sav, sizeof(mbstate_t));
-            #if WCHAR_MAX > 0xFF
-               *dest++ = 0xFFFD;
-            #else
-               *dest++ = '?';
-            #endif
-            dest_len--;
-            memmove(state->buf, state->buf+1, --state->cnt);
-            continue;
+         envblock = calloc(total_len+1, sizeof(uint16_t));
+         if (!envblock) {
+            err = FIXSCRIPT_ERR_OUT_OF_MEMORY;
          }
       }
-#endif
+      if (!err) {
+         for (i=0, j=0; i<num_envs; i++) {
+            len = wcslen(envs[i*2+0]);
+            memcpy(envblock+j, envs[i*2+0], len*2);
+            j += len;
+            envblock[j++] = '=';
+            
+            len = wcslen(envs[i*2+1]);
+            memcpy(envblock+j, envs[i*2+1], len*2);
+            j += len;
+            envblock[j++] = 0;
+         }
+         envblock[j] = 0;
+         if (j != total_len) {
+            err = FIXSCRIPT_ERR_OUT_OF_MEMORY;
+         }
+      }
+      proc_flags |= CREATE_UNICODE_ENVIRONMENT;
+   }
+   if (params[2].value) {
+      if (!err) {
+         err = fixscript_get_string_utf16(heap, params[2], 0, -1, &path, NULL);
+      }
+   }
+   if (err) {
+      fixscript_error(heap, error, err);
+      goto error;
+   }
 
-      dest++;
-      dest_len--;
-      state->cnt -= parsed;
-      memmove(state->buf, state->buf+parsed, state->cnt);
+   handle = calloc(1, sizeof(ProcessHandle));
+   if (!handle) {
+      fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      goto error;
    }
 
-   *processed_dest = dest - orig_dest;
-   *processed_src = src - orig_src;
-}
+   memset(&si, 0, sizeof(STARTUPINFO));
+   si.cb = sizeof(STARTUPINFO);
+   memset(&pi, 0, sizeof(PROCESS_INFORMATION));
 
-static void convert_to_native(char *dest, int dest_len, wchar_t *src, int src_len, NativeConvertState *state, int *processed_dest, int *processed_src)
-{
-#ifndef __wasm__
-   mbstate_t mbstate_sav;
-#endif
-   char *orig_dest = dest;
-   wchar_t *orig_src = src;
-   int len, c;
+   if (flags & (REDIR_IN | REDIR_OUT | REDIR_ERR)) {
+      si.dwFlags |= STARTF_USESTDHANDLES | STARTF_USESHOWWINDOW;
+      si.wShowWindow = SW_HIDE;
 
-   for (;;) {
-      if (state->cnt == 0) {
-         if (src_len <= 0) break;
-         
-         if (native_charset_utf8) {
-            #if WCHAR_MAX > 0xFFFF
-               c = *src++;
-            #elif WCHAR_MAX > 0xFF
-               c = (uint16_t)*src++;
-            #else
-               c = (uint8_t)*src++;
-            #endif
-            src_len--;
-            if (c < 0 || c > 0x10FFFF) {
-               c = 0xFFFD;
-            }
-            if (c >= 0xD800 && c <= 0xDFFF) {
-               c = 0xFFFD;
-            }
-            if (c >= 0x10000) {
-               state->buf[0] = (c >> 18) | 0xF0;
-               state->buf[1] = ((c >> 12) & 0x3F) | 0x80;
-               state->buf[2] = ((c >> 6) & 0x3F) | 0x80;
-               state->buf[3] = (c & 0x3F) | 0x80;
-               state->cnt = 4;
-            }
-            else if (c >= 0x800) {
-               state->buf[0] = (c >> 12) | 0xE0;
-               state->buf[1] = ((c >> 6) & 0x3F) | 0x80;
-               state->buf[2] = (c & 0x3F) | 0x80;
-               state->cnt = 3;
-            }
-            else if (c >= 0x80) {
-               state->buf[0] = (c >> 6) | 0xC0;
-               state->buf[1] = (c & 0x3F) | 0x80;
-               state->cnt = 2;
-            }
-            else {
-               state->buf[0] = c;
-               state->cnt = 1;
-            }
-         }
-#ifndef __wasm__
-         else if (*src == 0) {
-            src++;
-            src_len--;
-            state->buf[0] = 0;
-            state->cnt = 1;
-         }
-         else {
-            memcpy(&mbstate_sav, &state->mbstate, sizeof(mbstate_t));
-            len = (int)wcrtomb(state->buf, *src, &state->mbstate);
-            if (len <= 0) {
-               memcpy(&state->mbstate, &mbstate_sav, sizeof(mbstate_t));
-               src++;
-               src_len--;
-               state->buf[0] = '?';
-               state->cnt = 1;
-            }
-            else {
-               src++;
-               src_len--;
-               state->cnt = len;
+      memset(&sa, 0, sizeof(SECURITY_ATTRIBUTES));
+      sa.nLength = sizeof(SECURITY_ATTRIBUTES);
+      sa.bInheritHandle = 1;
+
+      num_pipes = 0;
+      if (flags & REDIR_IN) num_pipes++;
+      if (flags & REDIR_OUT) num_pipes++;
+      if (flags & REDIR_ERR) num_pipes++;
+      for (i=0; i<num_pipes; i++) {
+         if (!CreatePipe(&pipes[i*2+0], &pipes[i*2+1], &sa, 0)) {
+            while (i > 0) {
+               i--;
+               CloseHandle(pipes[i*2+0]);
+               CloseHandle(pipes[i*2+1]);
             }
+            *error = fixscript_create_error_string(heap, "can't create pipe");
+            free(handle);
+            goto error;
          }
-#endif
       }
 
-      if (dest_len <= 0) break;
+      if (flags & REDIR_IN) {
+         num_pipes--;
+         handle->in = pipes[num_pipes*2+1];
+         in_other = pipes[num_pipes*2+0];
+         si.hStdInput = pipes[num_pipes*2+0];
+         SetHandleInformation(handle->in, HANDLE_FLAG_INHERIT, 0);
+      }
+      else {
+         si.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+      }
 
-      len = state->cnt;
-      if (len > dest_len) {
-         len = dest_len;
+      if (flags & REDIR_OUT) {
+         num_pipes--;
+         handle->out = pipes[num_pipes*2+0];
+         out_other = pipes[num_pipes*2+1];
+         si.hStdOutput = pipes[num_pipes*2+1];
+         if (flags & REDIR_MERGE_ERR) {
+            si.hStdError = pipes[num_pipes*2+1];
+         }
+         SetHandleInformation(handle->out, HANDLE_FLAG_INHERIT, 0);
+      }
+      else {
+         si.hStdOutput = GetStdHandle(STD_OUTPUT_HANDLE);
       }
-      memcpy(dest, state->buf, len);
-      dest += len;
-      dest_len -= len;
-      state->cnt -= len;
-      memmove(state->buf, state->buf + len, state->cnt);
-   }
 
-   *processed_dest = dest - orig_dest;
-   *processed_src = src - orig_src;
-}
-#endif
+      if (flags & REDIR_ERR) {
+         num_pipes--;
+         handle->err = pipes[num_pipes*2+0];
+         err_other = pipes[num_pipes*2+1];
+         si.hStdError = pipes[num_pipes*2+1];
+         SetHandleInformation(handle->err, HANDLE_FLAG_INHERIT, 0);
+      }
+      else {
+         si.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+      }
+   }
 
+   handle->refcnt = 1;
+   handle->flags = flags;
+   handle->process = ERROR_INVALID_HANDLE;
 
-static Value native_string_from_native(Heap *heap, Value *error, int num_params, Value *params, void *data)
-{
-   Value arr, off, len, result;
-   char *bytes;
-#ifdef _WIN32
-   Value str;
-   unsigned short *chars;
-   int64_t len64;
-   int chars_len, result_len, real_chars_len;
-#else
-   NativeConvertState state;
-   wchar_t chars[128];
-   Value values[128];
-   int processed_dest, processed_src;
-   int i, j, result_len=0;
-#if !defined(__HAIKU__)
-   locale_t prev_locale = (locale_t)0;
-#endif
-#endif
-   int err;
+   handle_val = fixscript_create_value_handle(heap, HANDLE_TYPE_PROCESS, handle, process_handle_func);
+   if (!handle_val.value) {
+      fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      goto error;
+   }
 
-   if (num_params == 2 || num_params == 4) {
-      result = *params++;
+   if (!CreateProcess(NULL, cmdline, NULL, NULL, TRUE, proc_flags, envblock, path, &si, &pi)) {
+      *error = fixscript_create_error_string(heap, "can't start process");
+      goto error;
    }
-   else {
-      result = fixscript_int(0);
+   
+   if (flags & REDIR_IN) {
+      CloseHandle(in_other);
    }
-   arr = *params++;
-   if (num_params == 3 || num_params == 4) {
-      off = *params++;
-      len = *params++;
-
-      if (off.value < 0) {
-         *error = fixscript_create_error_string(heap, "negative offset");
-         return fixscript_int(0);
-      }
-      if (len.value < 0) {
-         *error = fixscript_create_error_string(heap, "negative length");
-         return fixscript_int(0);
-      }
+   if (flags & REDIR_OUT) {
+      CloseHandle(out_other);
    }
-   else {
-      off.value = 0;
-      err = fixscript_get_array_length(heap, arr, &len.value);
-      if (err) {
-         return fixscript_error(heap, error, err);
-      }
+   if (flags & REDIR_ERR) {
+      CloseHandle(err_other);
    }
 
-   if (!result.value) {
-      result = fixscript_create_string(heap, NULL, 0);
-      if (!result.value) {
-         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
-      }
-   }
+   CloseHandle(pi.hThread);
+   handle->process = pi.hProcess;
 
-   err = fixscript_lock_array(heap, arr, off.value, len.value, (void **)&bytes, 1, ACCESS_READ_ONLY);
-   if (err) {
-      return fixscript_error(heap, error, err);
-   }
+   ret = handle_val;
 
-#ifdef _WIN32
-   if (len.value > 0) {
-      chars_len = MultiByteToWideChar(CP_ACP, 0, bytes, len.value, NULL, 0);
-      if (chars_len <= 0) {
-         fixscript_unlock_array(heap, arr, off.value, len.value, (void **)&bytes, 1, ACCESS_READ_ONLY);
-         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+error:
+   free(arg_values);
+   if (args) {
+      for (i=0; i<num_args; i++) {
+         free(args[i]);
       }
-
-      len64 = (int64_t)chars_len * sizeof(uint16_t);
-      if (len64 > INT_MAX) {
-         fixscript_unlock_array(heap, arr, off.value, len.value, (void **)&bytes, 1, ACCESS_READ_ONLY);
-         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      free(args);
+   }
+   free(cmdline);
+   if (envs) {
+      for (i=0; i<num_envs*2; i++) {
+         free(envs[i]);
       }
+      free(envs);
+   }
+   free(envblock);
+   free(path);
+   return ret;
+#elif defined(__wasm__)
+   *error = fixscript_create_error_string(heap, "not supported");
+   return fixscript_int(0);
+#else
+   ProcessHandle *handle = NULL;
+   Value *arg_values = NULL;
+   Value key_val, value_val, handle_val, ret = fixscript_int(0);
+   int flags = params[3].value;
+   char **args = NULL, **envs = NULL, *path = NULL, *key, *value;
+   int num_args=0, num_envs=0;
+   int i, err, pos, idx, own_handle=1;
+   int in_fds[2], out_fds[2], err_fds[2];
 
-      chars = malloc(len64);
-      if (!chars) {
-         fixscript_unlock_array(heap, arr, off.value, len.value, (void **)&bytes, 1, ACCESS_READ_ONLY);
-         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
-      }
+   in_fds[0] = -1;
+   in_fds[1] = -1;
+   out_fds[0] = -1;
+   out_fds[1] = -1;
+   err_fds[0] = -1;
+   err_fds[1] = -1;
 
-      if (MultiByteToWideChar(CP_ACP, 0, bytes, len.value, chars, chars_len) != chars_len) {
-         free(chars);
-         fixscript_unlock_array(heap, arr, off.value, len.value, (void **)&bytes, 1, ACCESS_READ_ONLY);
-         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+   if (flags & REDIR_MERGE_ERR) {
+      if ((flags & (REDIR_OUT | REDIR_ERR)) != REDIR_OUT) {
+         *error = fixscript_create_error_string(heap, "incompatible flags");
+         goto error;
       }
+   }
 
-      err = fixscript_get_array_length(heap, result, &result_len);
-      if (!err) {
-         if (result_len >= INT_MAX - chars_len) {
-            err = FIXSCRIPT_ERR_OUT_OF_MEMORY;
-         }
-      }
-      if (!err) {
-         str = fixscript_create_string_utf16(heap, chars, chars_len);
-         if (!str.value) {
-            err = FIXSCRIPT_ERR_OUT_OF_MEMORY;
-         }
+   err = fixscript_get_array_length(heap, params[0], &num_args);
+   if (!err) {
+      if (num_args < 1) {
+         *error = fixscript_create_error_string(heap, "must provide executable argument");
+         goto error;
       }
-      if (!err) {
-         err = fixscript_get_array_length(heap, str, &real_chars_len);
+      arg_values = calloc(num_args, sizeof(Value));
+      if (!arg_values) {
+         err = FIXSCRIPT_ERR_OUT_OF_MEMORY;
       }
-      if (!err) {
-         err = fixscript_set_array_length(heap, result, result_len + real_chars_len);
-      }
-      if (!err) {
-         err = fixscript_copy_array(heap, result, result_len, str, 0, real_chars_len);
-      }
-      if (err) {
-         free(chars);
-         fixscript_unlock_array(heap, arr, off.value, len.value, (void **)&bytes, 1, ACCESS_READ_ONLY);
-         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
-      }
-
-      free(chars);
    }
-#else
-   #if !defined(__HAIKU__)
-      if (!native_charset_utf8) {
-         prev_locale = uselocale(cur_locale);
-      }
-   #endif
-   memset(&state, 0, sizeof(NativeConvertState));
-
-   i = 0;
-   for (;;) {
-      convert_from_native(chars, sizeof(chars)/sizeof(wchar_t), bytes + i, len.value - i, &state, &processed_dest, &processed_src);
-      if (processed_dest == 0) {
-         if (state.cnt > 0) {
-            state.cnt = 0;
-            chars[0] = 0xFFFD;
-            processed_dest = 1;
-         }
-         else break;
-      }
-
-      if (result_len >= INT_MAX - processed_dest) {
+   if (!err) {
+      err = fixscript_get_array_range(heap, params[0], 0, num_args, arg_values);
+   }
+   if (!err) {
+      args = calloc(num_args+1, sizeof(char *));
+      if (!args) {
          err = FIXSCRIPT_ERR_OUT_OF_MEMORY;
       }
+   }
+   if (!err) {
+      for (i=0; i<num_args; i++) {
+         err = fixscript_get_string(heap, arg_values[i], 0, -1, &args[i], NULL);
+         if (err) break;
+      }
+   }
+   if (params[1].value) {
       if (!err) {
-         err = fixscript_set_array_length(heap, result, result_len + processed_dest);
+         err = fixscript_get_array_length(heap, params[1], &num_envs);
       }
       if (!err) {
-         for (j=0; j<processed_dest; j++) {
-            #if WCHAR_MAX > 0xFFFF
-               values[j] = fixscript_int(chars[j]);
-            #elif WCHAR_MAX > 0xFF
-               values[j] = fixscript_int((uint16_t)chars[j]);
-            #else
-               values[j] = fixscript_int((uint8_t)chars[j]);
-            #endif
+         envs = calloc(num_envs*2, sizeof(char *));
+         if (!envs) {
+            err = FIXSCRIPT_ERR_OUT_OF_MEMORY;
          }
-         err = fixscript_set_array_range(heap, result, result_len, processed_dest, values);
-         result_len += processed_dest;
       }
-      if (err) {
-         #if !defined(__HAIKU__)
-            if (!native_charset_utf8) {
-               uselocale(prev_locale);
+      if (!err) {
+         pos = 0;
+         idx = 0;
+         while (fixscript_iter_hash(heap, params[1], &key_val, &value_val, &pos)) {
+            err = fixscript_get_string(heap, key_val, 0, -1, &key, NULL);
+            if (err) {
+               break;
             }
-         #endif
-         fixscript_unlock_array(heap, arr, off.value, len.value, (void **)&bytes, 1, ACCESS_READ_ONLY);
-         return fixscript_error(heap, error, err);
+            err = fixscript_get_string(heap, value_val, 0, -1, &value, NULL);
+            if (err) {
+               free(key);
+               break;
+            }
+            envs[idx++] = key;
+            envs[idx++] = value;
+         }
+         if (!err && idx != num_envs*2) {
+            err = FIXSCRIPT_ERR_INVALID_ACCESS;
+         }
       }
-      i += processed_src;
    }
-
-   #if !defined(__HAIKU__)
-      if (!native_charset_utf8) {
-         uselocale(prev_locale);
+   if (params[2].value) {
+      if (!err) {
+         err = fixscript_get_string(heap, params[2], 0, -1, &path, NULL);
       }
-   #endif
-#endif
-
-   fixscript_unlock_array(heap, arr, off.value, len.value, (void **)&bytes, 1, ACCESS_READ_ONLY);
-   return result;
-}
-
-
-static Value native_string_to_native(Heap *heap, Value *error, int num_params, Value *params, void *data)
-{
-   Value str, off, len, result;
-#ifdef _WIN32
-   unsigned short *chars;
-   char *bytes;
-   int chars_len, bytes_len, result_len;
-#else
-   NativeConvertState state;
-   wchar_t chars[128];
-   char bytes[128*4];
-   int chars_cap = sizeof(chars) / sizeof(wchar_t) - 1;
-   int processed_dest, processed_src;
-   int i, j, elem_size, cnt, result_len=0, ch;
-   union {
-      uint8_t *u8;
-      uint16_t *u16;
-      int32_t *s32;
-   } u;
-#if !defined(__HAIKU__)
-   locale_t prev_locale = (locale_t)0;
-#endif
-#endif
-   int err;
-
-   if (num_params == 2 || num_params == 4) {
-      result = *params++;
    }
-   else {
-      result = fixscript_int(0);
+   if (!err) {
+      handle = calloc(1, sizeof(ProcessHandle));
+      if (!handle) {
+         err = FIXSCRIPT_ERR_OUT_OF_MEMORY;
+      }
+   }
+   if (err) {
+      fixscript_error(heap, error, err);
+      goto error;
    }
-   str = *params++;
-   if (num_params == 3 || num_params == 4) {
-      off = *params++;
-      len = *params++;
 
-      if (off.value < 0) {
-         *error = fixscript_create_error_string(heap, "negative offset");
-         return fixscript_int(0);
-      }
-      if (len.value < 0) {
-         *error = fixscript_create_error_string(heap, "negative length");
-         return fixscript_int(0);
+   handle->refcnt = 1;
+   handle->flags = flags;
+   handle->ret_value = -1;
+   handle->in_fd = -1;
+   handle->out_fd = -1;
+   handle->err_fd = -1;
+
+   if (flags & REDIR_IN) {
+      if (pipe(in_fds) < 0) {
+         *error = fixscript_create_error_string(heap, "can't create pipe");
+         goto error;
       }
    }
-   else {
-      off.value = 0;
-      err = fixscript_get_array_length(heap, str, &len.value);
-      if (err) {
-         return fixscript_error(heap, error, err);
+
+   if (flags & REDIR_OUT) {
+      if (pipe(out_fds) < 0) {
+         *error = fixscript_create_error_string(heap, "can't create pipe");
+         goto error;
       }
    }
 
-   if (!result.value) {
-      result = fixscript_create_array(heap, 0);
-      if (!result.value) {
-         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+   if (flags & REDIR_ERR) {
+      if (pipe(err_fds) < 0) {
+         *error = fixscript_create_error_string(heap, "can't create pipe");
+         goto error;
       }
    }
 
-#ifdef _WIN32
-   err = fixscript_get_string_utf16(heap, str, off.value, len.value, &chars, &chars_len);
-   if (err) {
-      return fixscript_error(heap, error, err);
-   }
+   handle->pid = fork();
 
-   if (chars_len > 0) {
-      bytes_len = WideCharToMultiByte(CP_ACP, 0, chars, chars_len, NULL, 0, NULL, NULL);
-      if (bytes_len <= 0) {
-         free(chars);
-         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
-      }
+   if (handle->pid < 0) {
+      *error = fixscript_create_error_string(heap, "can't fork process");
+      goto error;
+   }
 
-      bytes = malloc(bytes_len);
-      if (!bytes) {
-         free(chars);
-         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
-      }
+   handle_val = fixscript_create_value_handle(heap, HANDLE_TYPE_PROCESS, handle, process_handle_func);
+   own_handle = 0;
+   if (!handle_val.value) {
+      fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      goto error;
+   }
 
-      if (WideCharToMultiByte(CP_ACP, 0, chars, chars_len, bytes, bytes_len, NULL, NULL) != bytes_len) {
-         free(chars);
-         free(bytes);
-         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+   if (handle->pid == 0) {
+      if (flags & REDIR_IN) {
+         dup2(in_fds[0], 0);
+         close(in_fds[0]);
+         close(in_fds[1]);
       }
-
-      err = fixscript_get_array_length(heap, result, &result_len);
-      if (!err) {
-         if (result_len >= INT_MAX - bytes_len) {
-            err = FIXSCRIPT_ERR_OUT_OF_MEMORY;
+      if (flags & REDIR_OUT) {
+         dup2(out_fds[1], 1);
+         if (flags & REDIR_MERGE_ERR) {
+            dup2(out_fds[1], 2);
          }
+         close(out_fds[0]);
+         close(out_fds[1]);
       }
-      if (!err) {
-         err = fixscript_set_array_length(heap, result, result_len + bytes_len);
+      if (flags & REDIR_ERR) {
+         dup2(err_fds[1], 2);
+         close(err_fds[0]);
+         close(err_fds[1]);
       }
-      if (!err) {
-         err = fixscript_set_array_bytes(heap, result, result_len, bytes_len, bytes);
+      if (path) {
+         chdir(path);
       }
-      if (err) {
-         free(chars);
-         free(bytes);
-         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      if (envs) {
+#ifdef __linux__
+         clearenv();
+#else
+         environ = NULL;
+#endif
+         for (i=0; i<num_envs; i++) {
+            setenv(envs[i*2+0], envs[i*2+1], 0);
+         }
       }
-
-      free(bytes);
+      execvp(args[0], args);
+      exit(1);
    }
 
-   free(chars);
-#else
-   err = fixscript_get_array_element_size(heap, str, &elem_size);
-   if (!err) {
-      err = fixscript_lock_array(heap, str, off.value, len.value, (void **)&u.u8, elem_size, ACCESS_READ_ONLY);
-   }
-   if (err) {
-      return fixscript_error(heap, error, err);
+   if (flags & REDIR_IN) {
+      handle->in_fd = in_fds[1];
+      close(in_fds[0]);
+      in_fds[0] = -1;
+      in_fds[1] = -1;
    }
 
-   #if !defined(__HAIKU__)
-      if (!native_charset_utf8) {
-         prev_locale = uselocale(cur_locale);
-      }
-   #endif
-   memset(&state, 0, sizeof(NativeConvertState));
-
-   i = 0;
-   while (i < len.value) {
-      cnt = len.value - i;
-      if (cnt > chars_cap) {
-         cnt = chars_cap;
-      }
-
-      switch (elem_size) {
-         default:
-         case 1:
-            for (j=0; j<cnt; j++) {
-               chars[j] = u.u8[i++];
-            }
-            break;
+   if (flags & REDIR_OUT) {
+      handle->out_fd = out_fds[0];
+      close(out_fds[1]);
+      out_fds[0] = -1;
+      out_fds[1] = -1;
+   }
 
-         case 2:
-            for (j=0; j<cnt; j++) {
-               ch = u.u16[i++];
-               #if WCHAR_MAX > 0xFF
-               if (ch >= 0xD800 && ch <= 0xDFFF) {
-                  ch = 0xFFFD;
-               }
-               #else
-               if (ch > 0xFF) {
-                  ch = '?';
-               }
-               #endif
-               chars[j] = ch;
-            }
-            break;
+   if (flags & REDIR_ERR) {
+      handle->err_fd = err_fds[0];
+      close(err_fds[1]);
+      err_fds[0] = -1;
+      err_fds[1] = -1;
+   }
 
-         case 4:
-            for (j=0; j<cnt; j++) {
-               ch = u.s32[i++];
-               if ((ch >= 0xD800 && ch <= 0xDFFF) || ch < 0 || ch > 0x10FFFF) {
-                  ch = 0xFFFD;
-               }
-               #if WCHAR_MAX <= 0xFF
-               if (ch > 0xFF) {
-                  ch = '?';
-               }
-               #elif WCHAR_MAX <= 0xFFFF
-               if (ch > 0xFFFF) {
-                  ch = 0xFFFD;
-               }
-               #endif
-               chars[j] = ch;
-            }
-            break;
-      }
+   ret = handle_val;
 
-      for (j=0; j<cnt; ) {
-         convert_to_native(bytes, sizeof(bytes)-1, chars + j, cnt - j, &state, &processed_dest, &processed_src);
-         if (processed_dest > 0) {
-            if (result_len >= INT_MAX - processed_dest) {
-               err = FIXSCRIPT_ERR_OUT_OF_MEMORY;
-            }
-            if (!err) {
-               err = fixscript_set_array_length(heap, result, result_len + processed_dest);
-            }
-            if (!err) {
-               err = fixscript_set_array_bytes(heap, result, result_len, processed_dest, bytes);
-               result_len += processed_dest;
-            }
-            if (err) {
-               #if !defined(__HAIKU__)
-                  if (!native_charset_utf8) {
-                     uselocale(prev_locale);
-                  }
-               #endif
-               fixscript_unlock_array(heap, str, off.value, len.value, (void **)&u.u8, elem_size, ACCESS_READ_ONLY);
-               return fixscript_error(heap, error, err);
-            }
-         }
-         j += processed_src;
+error:
+   free(arg_values);
+   if (args) {
+      for (i=0; i<num_args; i++) {
+         free(args[i]);
       }
+      free(args);
    }
-
-   #if !defined(__HAIKU__)
-      if (!native_charset_utf8) {
-         uselocale(prev_locale);
+   if (envs) {
+      for (i=0; i<num_envs*2; i++) {
+         free(envs[i]);
       }
-   #endif
-   fixscript_unlock_array(heap, str, off.value, len.value, (void **)&u.u8, elem_size, ACCESS_READ_ONLY);
-#endif
-
-   return result;
-}
-
-
-#ifndef __wasm__
-static int clear_console_line()
-{
-   if (console_clear_line) {
-      fputc('\r', stdout);
-      fputs(console_clear_line, stdout);
-      fputc('\r', stdout);
-      free(console_clear_line);
-      console_clear_line = NULL;
-      return 1;
+      free(envs);
    }
-   return 0;
-}
+   free(path);
+   if (own_handle) {
+      free(handle);
+   }
+   if (in_fds[0] != -1) close(in_fds[0]);
+   if (in_fds[1] != -1) close(in_fds[1]);
+   if (out_fds[0] != -1) close(out_fds[0]);
+   if (out_fds[1] != -1) close(out_fds[1]);
+   if (err_fds[0] != -1) close(err_fds[0]);
+   if (err_fds[1] != -1) close(err_fds[1]);
+   return ret;
 #endif
+}
 
 
-static Value native_console_is_present(Heap *heap, Value *error, int num_params, Value *params, void *data);
-
-static Value native_print(Heap *heap, Value *error, int num_params, Value *params, void *data)
+static Value native_process_read(Heap *heap, Value *error, int num_params, Value *params, void *data)
 {
 #if defined(__wasm__)
-   int mode = (intptr_t)data;
-   NativeFunc log_func;
-   void *log_data;
-
-   if (mode == PRINT_NORMAL || mode == PRINT_PROGRESS) {
-      log_func = fixscript_get_native_func(heap, "log#1", &log_data);
-      return log_func(heap, error, 1, params, log_data);
-   }
+   *error = fixscript_create_error_string(heap, "not supported");
    return fixscript_int(0);
 #else
-   int mode = (intptr_t)data;
-   Script *script;
+   ProcessHandle *handle = NULL;
+   char *buf;
+   int timeout;
+   int err;
 #ifdef _WIN32
-   HANDLE in, out;
-   DWORD console_mode, ret;
-   Value prompt_str, tmp_str, val1, val2;
-   pthread_mutex_t *mutex;
-   uint16_t *s, buf[256];
-   char *bytes;
-   int i, j, err, len, len2, bytes_len;
+   DWORD ret;
+   HANDLE h;
 #else
-   pthread_mutex_t *mutex;
-#if !defined(__HAIKU__)
-   locale_t prev_locale = (locale_t)0;
-#endif
-   NativeConvertState state;
-   char *bytes;
-   wchar_t buf[128];
-   char charbuf[128], *cp;
-   Value prompt_str;
-   int buf_cap = sizeof(buf) / sizeof(wchar_t);
-   int i, j, err, len, elem_size, cnt, processed_dest, processed_src;
-   union {
-      uint8_t *u8;
-      uint16_t *u16;
-      int32_t *s32;
-   } u;
+   int ret;
+   int fd = (int)(intptr_t)data;
 #endif
 
-#ifdef _WIN32
-   if (gui_app) {
-      NativeFunc log_func;
-      void *log_data;
+   if (num_params == 5) {
+      handle = fixscript_get_handle(heap, params[0], HANDLE_TYPE_PROCESS, NULL);
+      if (!handle) {
+         *error = fixscript_create_error_string(heap, "invalid process handle");
+         return fixscript_int(0);
+      }
+      params++;
 
-      if (mode == PRINT_NORMAL || mode == PRINT_PROGRESS) {
-         log_func = fixscript_get_native_func(heap, "log#1", &log_data);
-         return log_func(heap, error, 1, params, log_data);
+#ifdef _WIN32
+      switch ((int)(intptr_t)data) {
+         case 1: h = (handle->flags & REDIR_OUT)? handle->out : INVALID_HANDLE_VALUE; break;
+         case 2: h = (handle->flags & REDIR_ERR)? handle->err : INVALID_HANDLE_VALUE; break;
+         default: h = INVALID_HANDLE_VALUE;
       }
-      return fixscript_int(0);
-   }
-#endif
 
-   if (mode == PRINT_PROMPT) {
-      script = fixscript_get(heap, "io/console.fix");
-      if (!script) {
-         *error = fixscript_create_error_string(heap, "script io/console must be imported");
+      if (h == INVALID_HANDLE_VALUE) {
+         *error = fixscript_create_error_string(heap, "stream is not redirected");
          return fixscript_int(0);
       }
+#else
+      switch (fd) {
+         case 1: fd = (handle->flags & REDIR_OUT)? handle->out_fd : -1; break;
+         case 2: fd = (handle->flags & REDIR_ERR)? handle->err_fd : -1; break;
+         default: fd = -1;
+      }
 
-      if (native_console_is_present(heap, error, 0, NULL, NULL).value) {
-         return fixscript_run(heap, script, "prompt#2", error, params[0], fixscript_int(0));
+      if (fd == -1) {
+         *error = fixscript_create_error_string(heap, "stream is not redirected");
+         return fixscript_int(0);
       }
+#endif
    }
-
-   mutex = get_mutex(&console_mutex);
-   if (!mutex) {
-      *error = fixscript_create_error_string(heap, "can't lock console");
-      return fixscript_int(0);
+   else {
+#ifdef _WIN32
+      switch ((int)(intptr_t)data) {
+         case 0: h = GetStdHandle(STD_INPUT_HANDLE); break;
+         default: h = INVALID_HANDLE_VALUE;
+      }
+#endif
    }
 
-   pthread_mutex_lock(mutex);
-   
-   if (console_active) {
-      pthread_mutex_unlock(mutex);
-      return fixscript_int(0);
-   }
+   timeout = params[3].value;
 
-#ifdef _WIN32
-   if ((mode == PRINT_NORMAL || mode == PRINT_LOG) && !fixscript_is_string(heap, params[0])) {
-      err = fixscript_to_string(heap, params[0], 0, &bytes, &bytes_len);
-      if (err) {
-         pthread_mutex_unlock(mutex);
-         return fixscript_error(heap, error, err);
-      }
-      
-      params[0] = fixscript_create_string(heap, bytes, bytes_len);
-      free(bytes);
-      if (!params[0].value) {
-         pthread_mutex_unlock(mutex);
-         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
-      }
-   }
-
-   err = fixscript_get_string_utf16(heap, params[0], 0, -1, &s, &len);
+   err = fixscript_lock_array(heap, params[0], params[1].value, params[2].value, (void **)&buf, 1, ACCESS_WRITE_ONLY);
    if (err) {
-      pthread_mutex_unlock(mutex);
       return fixscript_error(heap, error, err);
    }
 
-   for (i=0; i<len; i++) {
-      if (s[i] >= 0 && s[i] < 32) {
-         switch (s[i]) {
-            case '\t':
-               break;
-
-            case '\n':
-               if (mode == PRINT_PROGRESS) {
-                  s[i] = '?';
-               }
-               break;
-
-            default:
-               s[i] = '?';
-         }
-      }
+#ifdef _WIN32
+   if (!ReadFile(h, buf, params[2].value, &ret, NULL)) {
+      ret = -1;
    }
-
-   out = GetStdHandle(mode == PRINT_LOG? STD_ERROR_HANDLE : STD_OUTPUT_HANDLE);
-   if (GetConsoleMode(out, &console_mode)) {
-      if (mode == PRINT_PROGRESS) {
-         if (!clear_console_line()) {
-            WriteConsole(out, L"\r", 1, NULL, NULL);
-         }
-
-         console_clear_line = malloc(len+1);
-         if (console_clear_line) {
-            for (i=0, j=0; i<len; i++) {
-               if (s[i] >= 0xD800 && s[i] <= 0xDBFF) {
-                  continue;
-               }
-               console_clear_line[j++] = s[i] == '\t'? '\t' : ' ';
-            }
-            console_clear_line[j] = 0;
-         }
-      }
-      else {
-         clear_console_line();
-      }
-      WriteConsole(out, s, len, NULL, NULL);
-      if (mode == PRINT_NORMAL || mode == PRINT_LOG) {
-         WriteConsole(out, L"\n", 1, NULL, NULL);
-      }
+#else
+   ret = read(fd, buf, params[2].value);
+   if (ret < params[2].value) {
+      params[2].value = ret >= 0? ret : 0;
    }
-   else {
-      if (len > 0) {
-         bytes_len = WideCharToMultiByte(CP_ACP, 0, s, len, NULL, 0, NULL, NULL);
-         if (bytes_len <= 0) {
-            free(s);
-            pthread_mutex_unlock(mutex);
-            return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
-         }
+#endif
 
-         if (INT_MAX - bytes_len < 2) {
-            free(s);
-            pthread_mutex_unlock(mutex);
-            return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
-         }
-      }
-      else {
-         bytes_len = 0;
-      }
+   fixscript_unlock_array(heap, params[0], params[1].value, params[2].value, (void **)&buf, 1, ACCESS_WRITE_ONLY);
+   if (ret < 0) {
+      *error = fixscript_create_error_string(heap, "I/O error");
+      return fixscript_int(0);
+   }
+   if (ret == 0) ret = -1;
+   return fixscript_int(ret);
+#endif /* __wasm__ */
+}
 
-      bytes = malloc(bytes_len+2);
-      if (!bytes) {
-         free(s);
-         pthread_mutex_unlock(mutex);
-         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
-      }
 
-      if (len > 0) {
-         if (WideCharToMultiByte(CP_ACP, 0, (mode == PRINT_PROGRESS)? s+1 : s, len, bytes, bytes_len, NULL, NULL) != bytes_len) {
-            free(bytes);
-            free(s);
-            pthread_mutex_unlock(mutex);
-            return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
-         }
-      }
+static Value native_process_write(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+#if defined(__wasm__)
+   *error = fixscript_create_error_string(heap, "not supported");
+   return fixscript_int(0);
+#else
+   ProcessHandle *handle = NULL;
+   char *buf;
+   int timeout;
+   int err;
+#ifdef _WIN32
+   DWORD ret;
+   HANDLE h;
+#else
+   int ret;
+   int fd = (int)(intptr_t)data;
+#endif
 
-      if (mode == PRINT_PROGRESS) {
-         bytes[0] = '\r';
-         bytes_len++;
+   if (num_params == 5) {
+      handle = fixscript_get_handle(heap, params[0], HANDLE_TYPE_PROCESS, NULL);
+      if (!handle) {
+         *error = fixscript_create_error_string(heap, "invalid process handle");
+         return fixscript_int(0);
       }
+      params++;
 
-      if (mode == PRINT_NORMAL || mode == PRINT_LOG) {
-         bytes[bytes_len++] = '\n';
+#ifdef _WIN32
+      switch ((int)(intptr_t)data) {
+         case 0: h = (handle->flags & REDIR_IN)? handle->in : INVALID_HANDLE_VALUE; break;
+         default: h = INVALID_HANDLE_VALUE;
       }
 
-      clear_console_line();
-      WriteFile(out, bytes, bytes_len, &ret, NULL);
-      free(bytes);
-   }
-
-   free(s);
-
-   if (mode == PRINT_PROMPT) {
-      prompt_str = fixscript_create_string(heap, NULL, 0);
-      if (!prompt_str.value) {
-         pthread_mutex_unlock(mutex);
-         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      if (h == INVALID_HANDLE_VALUE) {
+         *error = fixscript_create_error_string(heap, "stream is not redirected");
+         return fixscript_int(0);
       }
-
-      in = GetStdHandle(STD_INPUT_HANDLE);
-      if (GetConsoleMode(in, &console_mode)) {
-         SetConsoleMode(in, console_mode | ENABLE_LINE_INPUT | ENABLE_ECHO_INPUT);
-
-         for (;;) {
-            if (!ReadConsole(in, buf, sizeof(buf)/sizeof(uint16_t), &ret, 0)) {
-               break;
-            }
-            if (ret <= 0) continue;
-            
-            tmp_str = fixscript_create_string_utf16(heap, buf, ret);
-            if (!tmp_str.value) {
-               err = FIXSCRIPT_ERR_OUT_OF_MEMORY;
-            }
-            if (!err) {
-               err = fixscript_get_array_length(heap, prompt_str, &len);
-            }
-            if (!err) {
-               err = fixscript_get_array_length(heap, tmp_str, &len2);
-            }
-            if (len > INT_MAX - len2) {
-               err = FIXSCRIPT_ERR_OUT_OF_MEMORY;
-            }
-            if (!err) {
-               err = fixscript_set_array_length(heap, prompt_str, len + len2);
-            }
-            if (!err) {
-               err = fixscript_copy_array(heap, prompt_str, len, tmp_str, 0, len2);
-            }
-            if (err) {
-               SetConsoleMode(in, console_mode);
-               pthread_mutex_unlock(mutex);
-               return fixscript_error(heap, error, err);
-            }
-
-            if (buf[ret-1] == '\n') break;
-         }
-
-         SetConsoleMode(in, console_mode);
+#else
+      switch (fd) {
+         case 0: fd = (handle->flags & REDIR_IN)? handle->in_fd : -1; break;
+         default: fd = -1;
       }
 
-      err = fixscript_get_array_length(heap, prompt_str, &len);
-      if (!err && len >= 2) {
-         err = fixscript_get_array_elem(heap, prompt_str, len-2, &val1);
-         if (!err) {
-            err = fixscript_get_array_elem(heap, prompt_str, len-1, &val2);
-         }
-         if (!err && val1.value == '\r' && val2.value == '\n') {
-            err = fixscript_set_array_length(heap, prompt_str, len-2);
-         }
-      }
-      pthread_mutex_unlock(mutex);
-      if (err) {
-         return fixscript_error(heap, error, err);
+      if (fd == -1) {
+         *error = fixscript_create_error_string(heap, "stream is not redirected");
+         return fixscript_int(0);
       }
-      return prompt_str;
+#endif
    }
    else {
-      // TODO
-      pthread_mutex_unlock(mutex);
-      return fixscript_create_string(heap, NULL, 0);
-   }
-
-   pthread_mutex_unlock(mutex);
-#else
-   if ((mode == PRINT_NORMAL || mode == PRINT_LOG) && !fixscript_is_string(heap, params[0])) {
-      err = fixscript_to_string(heap, params[0], 0, &bytes, &len);
-      if (err) {
-         pthread_mutex_unlock(mutex);
-         return fixscript_error(heap, error, err);
-      }
-      
-      params[0] = fixscript_create_string(heap, bytes, len);
-      free(bytes);
-      if (!params[0].value) {
-         pthread_mutex_unlock(mutex);
-         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+#ifdef _WIN32
+      switch ((int)(intptr_t)data) {
+         case 1: h = GetStdHandle(STD_OUTPUT_HANDLE); break;
+         case 2: h = GetStdHandle(STD_ERROR_HANDLE); break;
+         default: h = INVALID_HANDLE_VALUE;
       }
+#endif
    }
 
-   err = fixscript_get_array_length(heap, params[0], &len);
-   if (!err) {
-      err = fixscript_get_array_element_size(heap, params[0], &elem_size);
-   }
-   if (!err) {
-      err = fixscript_lock_array(heap, params[0], 0, len, (void **)&u.u8, elem_size, ACCESS_READ_ONLY);
-   }
+   timeout = params[3].value;
+
+   err = fixscript_lock_array(heap, params[0], params[1].value, params[2].value, (void **)&buf, 1, ACCESS_READ_ONLY);
    if (err) {
-      pthread_mutex_unlock(mutex);
       return fixscript_error(heap, error, err);
    }
 
-   #if !defined(__HAIKU__)
-      if (!native_charset_utf8) {
-         prev_locale = uselocale(cur_locale);
-      }
-   #endif
-   memset(&state, 0, sizeof(NativeConvertState));
-
-   if (mode == PRINT_PROGRESS) {
-      if (!clear_console_line()) {
-         fputc('\r', stdout);
-      }
-
-      console_clear_line = malloc(len+1);
-      if (console_clear_line) {
-         if (elem_size == 1) {
-            for (i=0; i<len; i++) {
-               console_clear_line[i] = u.u8[i] == '\t'? '\t' : ' ';
-            }
-         }
-         else if (elem_size == 2) {
-            for (i=0; i<len; i++) {
-               console_clear_line[i] = u.u16[i] == '\t'? '\t' : ' ';
-            }
-         }
-         else if (elem_size == 4) {
-            for (i=0; i<len; i++) {
-               console_clear_line[i] = u.s32[i] == '\t'? '\t' : ' ';
-            }
-         }
-         console_clear_line[len] = 0;
-      }
-   }
-   else {
-      clear_console_line();
+#ifdef _WIN32
+   if (!WriteFile(h, buf, params[2].value, &ret, NULL)) {
+      ret = -1;
    }
+#else
+   ret = write(fd, buf, params[2].value);
+#endif
 
-   i = 0;
-   for (;;) {
-      cnt = len - i;
-      if (cnt > buf_cap) {
-         cnt = buf_cap;
-      }
-
-      if (elem_size == 1) {
-         for (j=0; j<cnt; j++) {
-            buf[j] = u.u8[i+j];
-         }
-      }
-      else if (elem_size == 2) {
-         for (j=0; j<cnt; j++) {
-            buf[j] = u.u16[i+j];
-         }
-      }
-      else if (elem_size == 4) {
-         for (j=0; j<cnt; j++) {
-            #if WCHAR_MAX <= 0xFFFF
-               buf[j] = (u.s32[i+j] < 0 || u.s32[i+j] > 0xFFFF)? 0xFFFD : u.s32[i+j];
-            #else
-               buf[j] = u.s32[i+j];
-            #endif
-         }
-      }
+   fixscript_unlock_array(heap, params[0], params[1].value, params[2].value, (void **)&buf, 1, ACCESS_READ_ONLY);
 
-      for (j=0; j<cnt; j++) {
-         if (buf[j] >= 0 && buf[j] < 32) {
-            switch (buf[j]) {
-               case '\t':
-                  break;
+   if (ret < 0) {
+      *error = fixscript_create_error_string(heap, "I/O error");
+      return fixscript_int(0);
+   }
+   return fixscript_int(ret);
+#endif /* __wasm__ */
+}
 
-               case '\n':
-                  if (mode == PRINT_PROGRESS) {
-                     buf[j] = '?';
-                  }
-                  break;
 
-               default:
-                  buf[j] = '?';
-            }
-         }
-      }
+static Value native_process_close(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+#if defined(__wasm__)
+   *error = fixscript_create_error_string(heap, "not supported");
+   return fixscript_int(0);
+#else
+   ProcessHandle *handle = NULL;
+#ifdef _WIN32
+   DWORD ret;
+   HANDLE h;
+#else
+   int ret;
+   int fd = (int)(intptr_t)data;
+#endif
 
-      convert_to_native(charbuf, sizeof(charbuf)-1, buf, cnt, &state, &processed_dest, &processed_src);
-      if (processed_dest == 0 && processed_src == 0) break;
-      charbuf[processed_dest] = 0;
-      fputs(charbuf, mode == PRINT_LOG? stderr : stdout);
-      i += processed_src;
+   handle = fixscript_get_handle(heap, params[0], HANDLE_TYPE_PROCESS, NULL);
+   if (!handle) {
+      *error = fixscript_create_error_string(heap, "invalid process handle");
+      return fixscript_int(0);
    }
 
-   if (mode == PRINT_NORMAL) {
-      fputc('\n', stdout);
-      fflush(stdout);
+#ifdef _WIN32
+   switch ((int)(intptr_t)data) {
+      case 0: h = (handle->flags & REDIR_IN)? handle->in : INVALID_HANDLE_VALUE; break;
+      case 1: h = (handle->flags & REDIR_OUT)? handle->out : INVALID_HANDLE_VALUE; break;
+      case 2: h = (handle->flags & REDIR_ERR)? handle->err : INVALID_HANDLE_VALUE; break;
+      default: h = INVALID_HANDLE_VALUE;
    }
-   else if (mode == PRINT_LOG) {
-      fputc('\n', stderr);
-      fflush(stderr);
+
+   if (h == INVALID_HANDLE_VALUE) {
+      *error = fixscript_create_error_string(heap, "stream is not redirected");
+      return fixscript_int(0);
    }
-   else {
-      fflush(stdout);
+#else
+   switch (fd) {
+      case 0: fd = (handle->flags & REDIR_IN)? handle->in_fd : -1; break;
+      case 1: fd = (handle->flags & REDIR_OUT)? handle->out_fd : -1; break;
+      case 2: fd = (handle->flags & REDIR_ERR)? handle->err_fd : -1; break;
+      default: fd = -1;
    }
-   
-   fixscript_unlock_array(heap, params[0], 0, len, (void **)&u.u8, elem_size, ACCESS_READ_ONLY);
 
-   if (mode == PRINT_PROMPT) {
-      prompt_str = fixscript_create_string(heap, NULL, 0);
-      if (!prompt_str.value) {
-         #if !defined(__HAIKU__)
-            if (!native_charset_utf8) {
-               uselocale(prev_locale);
-            }
-         #endif
-         pthread_mutex_unlock(mutex);
-         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
-      }
-      memset(&state, 0, sizeof(NativeConvertState));
-      for (;;) {
-         if (!fgets(charbuf, sizeof(charbuf), stdin)) {
-            break;
-         }
-         cp = charbuf;
-         len = strlen(charbuf);
-         for (;;) {
-            convert_from_native(buf, sizeof(buf)/sizeof(wchar_t), cp, len, &state, &processed_dest, &processed_src);
-            if (processed_dest == 0 && processed_src == 0) break;
-            for (i=0; i<processed_dest; i++) {
-               if (buf[i] == '\n') {
-                  goto end;
-               }
-               err = fixscript_append_array_elem(heap, prompt_str, fixscript_int(buf[i]));
-               if (err) {
-                  #if !defined(__HAIKU__)
-                     if (!native_charset_utf8) {
-                        uselocale(prev_locale);
-                     }
-                  #endif
-                  pthread_mutex_unlock(mutex);
-                  return fixscript_error(heap, error, err);
-               }
-            }
-            cp += processed_src;
-            len -= processed_src;
-         }
-      }
-      end:;
+   if (fd == -1) {
+      *error = fixscript_create_error_string(heap, "stream is not redirected");
+      return fixscript_int(0);
    }
+#endif
 
-   #if !defined(__HAIKU__)
-      if (!native_charset_utf8) {
-         uselocale(prev_locale);
-      }
-   #endif
-   pthread_mutex_unlock(mutex);
-   
-   if (mode == PRINT_PROMPT) {
-      return prompt_str;
+#ifdef _WIN32
+   ret = 0;
+   if (!CloseHandle(h)) {
+      ret = -1;
    }
+#else
+   ret = close(fd);
 #endif
 
+   if (ret < 0) {
+      *error = fixscript_create_error_string(heap, "I/O error");
+      return fixscript_int(0);
+   }
    return fixscript_int(0);
 #endif /* __wasm__ */
 }
 
 
-static Value native_beep(Heap *heap, Value *error, int num_params, Value *params, void *data)
+static Value native_process_wait(Heap *heap, Value *error, int num_params, Value *params, void *data)
 {
-#if defined(_WIN32)
-   DWORD console_mode;
+#if defined(__wasm__)
+   *error = fixscript_create_error_string(heap, "not supported");
+   return fixscript_int(0);
+#else
+   ProcessHandle *handle;
+#ifdef _WIN32
+   DWORD result = 0xFFFFFFFF;
+#else
+   int status;
+#endif
 
-   if (!gui_app && GetConsoleMode(GetStdHandle(STD_OUTPUT_HANDLE), &console_mode)) {
-      MessageBeep(-1);
+   handle = fixscript_get_handle(heap, params[0], HANDLE_TYPE_PROCESS, NULL);
+   if (!handle) {
+      *error = fixscript_create_error_string(heap, "invalid process handle");
+      return fixscript_int(0);
    }
-#elif defined(__wasm__)
+
+#ifdef _WIN32
+   WaitForSingleObject(handle->process, INFINITE);
+   GetExitCodeProcess(handle->process, &result);
+   return fixscript_int(result);
 #else
-   if (isatty(STDOUT_FILENO)) {
-      fprintf(stdout, "\a");
-      fflush(stdout);
+   if (handle->pid == 0) {
+      return fixscript_int(handle->ret_value);
+   }
+
+   if (waitpid(handle->pid, &status, 0) == handle->pid) {
+      handle->pid = 0;
+      if (WIFEXITED(status)) {
+         handle->ret_value = WEXITSTATUS(status);
+      }
+      return fixscript_int(handle->ret_value);
    }
-#endif
 
+   handle->pid = 0;
+   *error = fixscript_create_error_string(heap, "I/O error");
    return fixscript_int(0);
+#endif
+#endif /* __wasm__ */
 }
 
 
-#ifdef __wasm__
-static void call_log_function_cont(Heap *heap, Value result, Value error, void *data)
+static Value native_process_kill(Heap *heap, Value *error, int num_params, Value *params, void *data)
 {
-   LogFunc *log_func = data;
+#if defined(__wasm__)
+   *error = fixscript_create_error_string(heap, "not supported");
+   return fixscript_int(0);
+#else
+   ProcessHandle *handle;
+   int force = 0;
 
-   if (error.value) {
-      fixscript_dump_value(heap, error, 1);
+   handle = fixscript_get_handle(heap, params[0], HANDLE_TYPE_PROCESS, NULL);
+   if (!handle) {
+      *error = fixscript_create_error_string(heap, "invalid process handle");
+      return fixscript_int(0);
    }
-   log_func->recursive = 0;
-   log_func->cont_func(heap, fixscript_int(0), fixscript_int(0), log_func->cont_data);
-}
-#endif
-
-
-static Value call_log_function(Heap *heap, Value *error, int num_params, Value *params, void *data)
-{
-   LogFunc *log_func = data;
-#ifndef __wasm__
-   Value func_error;
-#endif
 
-   if (log_func->recursive) {
-      return log_func->func(heap, error, num_params, params, log_func->data);
+#ifdef _WIN32
+   // TODO: send a message to GUI applications for non-forceful killing
+   if (handle->process != INVALID_HANDLE_VALUE) {
+      TerminateProcess(handle->process, 1);
    }
-
-   log_func->recursive = 1;
-#ifdef __wasm__
-   fixscript_suspend(heap, &log_func->cont_func, &log_func->cont_data);
-   fixscript_call_async(heap, log_func->custom_func, 1, &params[0], call_log_function_cont, log_func);
+   return fixscript_int(0);
 #else
-   fixscript_call(heap, log_func->custom_func, 1, &func_error, params[0]);
-   if (func_error.value) {
-      fixscript_dump_value(heap, func_error, 1);
+   if (handle->pid == 0) {
+      return fixscript_int(0);
    }
-   log_func->recursive = 0;
-#endif
+
+   if (num_params == 2) {
+      force = params[1].value;
+   }
+
+   kill(handle->pid, force? SIGKILL : SIGTERM);
    return fixscript_int(0);
+#endif
+#endif /* __wasm__ */
 }
 
 
-static Value set_log_function(Heap *heap, Value *error, int num_params, Value *params, void *data)
+static Value native_process_is_running(Heap *heap, Value *error, int num_params, Value *params, void *data)
 {
-   LogFunc *log_func = data;
-   int err;
+#if defined(__wasm__)
+   *error = fixscript_create_error_string(heap, "not supported");
+   return fixscript_int(0);
+#else
+   ProcessHandle *handle;
+#ifdef _WIN32
+   DWORD result;
+#else
+   pid_t ret;
+   int status;
+#endif
 
-   if (!params[0].value) {
-      if (log_func) {
-         fixscript_register_native_func(heap, "log#1", log_func->func, log_func->data);
-      }
+   handle = fixscript_get_handle(heap, params[0], HANDLE_TYPE_PROCESS, NULL);
+   if (!handle) {
+      *error = fixscript_create_error_string(heap, "invalid process handle");
       return fixscript_int(0);
    }
 
-   err = fixscript_get_function_name(heap, params[0], NULL, NULL, NULL);
-   if (err) {
-      return fixscript_error(heap, error, err);
+#ifdef _WIN32
+   if (GetExitCodeProcess(handle->process, &result) && result == STILL_ACTIVE) {
+      return fixscript_int(1);
+   }
+   return fixscript_int(0);
+#else
+   if (handle->pid == 0) {
+      return fixscript_int(0);
    }
 
-   if (!log_func) {
-      log_func = calloc(1, sizeof(LogFunc));
-      if (!log_func) {
-         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+   ret = waitpid(handle->pid, &status, WNOHANG);
+   if (ret == 0) {
+      return fixscript_int(1);
+   }
+   if (ret == handle->pid) {
+      handle->pid = 0;
+      if (WIFEXITED(status)) {
+         handle->ret_value = WEXITSTATUS(status);
       }
-      log_func->func = fixscript_get_native_func(heap, "log#1", &log_func->data);
-
-      fixscript_register_native_func(heap, "set_log_function#1", set_log_function, log_func);
-      fixscript_register_cleanup(heap, free, log_func);
+      return fixscript_int(0);
    }
 
-   log_func->custom_func = params[0];
-   fixscript_register_native_func(heap, "log#1", call_log_function, log_func);
+   handle->pid = 0;
+   *error = fixscript_create_error_string(heap, "I/O error");
    return fixscript_int(0);
+#endif
+#endif /* __wasm__ */
 }
 
 
-#if !defined(_WIN32) && !defined(__wasm__)
-static void console_interrupt_signal_handler(int signum)
+static Value native_process_get_id(Heap *heap, Value *error, int num_params, Value *params, void *data)
 {
-   struct termios tios;
-   const char restore[] = "\e[0m\e[7h\e[?7h\e[?25h";
-   ssize_t ret, pos=0;
+#if defined(__wasm__)
+   *error = fixscript_create_error_string(heap, "not supported");
+   return fixscript_int(0);
+#else
+   ProcessHandle *handle;
+#ifdef _WIN32
+   DWORD ret;
+#endif
 
-   while (pos < sizeof(restore)) {
-      ret = write(STDOUT_FILENO, restore + pos, sizeof(restore) - pos);
-      if (ret < 0) break;
-      pos += ret;
+   handle = fixscript_get_handle(heap, params[0], HANDLE_TYPE_PROCESS, NULL);
+   if (!handle) {
+      *error = fixscript_create_error_string(heap, "invalid process handle");
+      return fixscript_int(0);
    }
 
-   if (tcgetattr(STDOUT_FILENO, &tios) == 0) {
-      tios.c_iflag |= IXON;
-      tios.c_lflag |= ECHO | ICANON | ISIG | IEXTEN;
-      tios.c_cc[VMIN] = 1;
-      tios.c_cc[VTIME] = 0;
-      tcsetattr(STDOUT_FILENO, TCSAFLUSH, &tios);
+#ifdef _WIN32
+   if (handle->process != ERROR_INVALID_HANDLE) {
+      ret = GetProcessId(handle->process);
+      return fixscript_int(ret);
    }
-
-   signal(SIGINT, SIG_DFL);
-   kill(getpid(), SIGINT);
-}
+   return fixscript_int(0);
+#else
+   return fixscript_int(handle->pid);
 #endif
+#endif /* __wasm__ */
+}
 
 
-#if !defined(_WIN32) && !defined(__wasm__)
-static void *console_auto_flush_thread_main(void *data)
+static Value native_process_get_current_environment(Heap *heap, Value *error, int num_params, Value *params, void *data)
 {
-   pthread_mutex_t *mutex;
-   pthread_cond_t *cond;
+#if defined(_WIN32)
+   Value map, key_val, value_val;
+   uint16_t *env, *p, *key, *value;
+   int err;
 
-   mutex = get_mutex(&console_auto_flush_mutex);
-   cond = get_cond(&console_auto_flush_cond);
+   map = fixscript_create_hash(heap);
+   if (!map.value) {
+      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+   }
 
-   pthread_mutex_lock(mutex);
-   while (console_auto_flush_active) {
-      pthread_cond_wait(cond, mutex);
-      if (!console_auto_flush_active) break;
-      if (console_auto_flush_trigger) {
-         pthread_mutex_unlock(mutex);
-         usleep(10*1000);
-         pthread_mutex_lock(mutex);
-         if (console_auto_flush_active) {
-            fflush(stdout);
+   env = GetEnvironmentStrings();
+   for (p=env; *p; p++) {
+      key = p;
+      value = NULL;
+      for (; *p; p++) {
+         if (*p == '=') {
+            value = p+1;
+            break;
          }
-         console_auto_flush_trigger = 0;
+      }
+      while (*p) {
+         p++;
+      }
+      if (value) {
+         key_val = fixscript_create_string_utf16(heap, key, value - key - 1);
+         value_val = fixscript_create_string_utf16(heap, value, -1);
+      }
+      else {
+         key_val = fixscript_create_string_utf16(heap, key, -1);
+         value_val = fixscript_create_string_utf16(heap, L"", -1);
+      }
+      if (!key_val.value || !value_val.value) {
+         FreeEnvironmentStrings(env);
+         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      }
+      err = fixscript_set_hash_elem(heap, map, key_val, value_val);
+      if (err) {
+         FreeEnvironmentStrings(env);
+         return fixscript_error(heap, error, err);
       }
    }
-   pthread_mutex_unlock(mutex);
+   FreeEnvironmentStrings(env);
+   return map;
+#elif defined(__wasm__)
+   *error = fixscript_create_error_string(heap, "not supported");
+   return fixscript_int(0);
+#else
+   Value map, key_val, value_val;
+   const char **p, *s, *key, *value;
+   int err;
 
-   return NULL;
-}
+   map = fixscript_create_hash(heap);
+   if (!map.value) {
+      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+   }
+
+   for (p=(const char **)environ; *p; p++) {
+      s = *p;
+      key = s;
+      value = NULL;
+      for (; *s; s++) {
+         if (*s == '=') {
+            value = s+1;
+            break;
+         }
+      }
+      if (value) {
+         key_val = fixscript_create_string(heap, key, value - key - 1);
+         value_val = fixscript_create_string(heap, value, -1);
+      }
+      else {
+         key_val = fixscript_create_string(heap, key, -1);
+         value_val = fixscript_create_string(heap, "", -1);
+      }
+      if (!key_val.value || !value_val.value) {
+         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      }
+      err = fixscript_set_hash_elem(heap, map, key_val, value_val);
+      if (err) {
+         return fixscript_error(heap, error, err);
+      }
+   }
+   return map;
 #endif
+}
 
 
-#if !defined(_WIN32) && !defined(__wasm__)
-static void console_flush()
+static Value native_clock_get_time(Heap *heap, Value *error, int num_params, Value *params, void *data)
 {
-   pthread_mutex_t *mutex;
-   pthread_cond_t *cond;
-
-   mutex = get_mutex(&console_auto_flush_mutex);
-   cond = get_cond(&console_auto_flush_cond);
-
-   pthread_mutex_lock(mutex);
-   console_auto_flush_trigger = 1;
-   pthread_cond_signal(cond);
-   pthread_mutex_unlock(mutex);
-}
-#endif
+#if defined(__wasm__)
+   // TODO
+   return fixscript_int(0);
+#else
+   int micro = ((intptr_t)data == 1);
+   union {
+      int64_t time;
+      int32_t i[2];
+   } u;
 
+#ifdef _WIN32
+   FILETIME ft;
 
-#if !defined(_WIN32) && !defined(__wasm__)
-enum {
-   CSSE_OCCURED     = 1 << 0,
-   CSSE_WITH_RESET  = 1 << 1,
-   CSSE_NEEDS_RESET = 1 << 2,
-   CSSE_WAS_RESET   = 1 << 3
-};
+   GetSystemTimeAsFileTime(&ft);
+   u.i[0] = ft.dwLowDateTime;
+   u.i[1] = ft.dwHighDateTime;
+   u.time = ((u.time + 5) / 10LL) - 11644473600000000LL;
+#else
+   struct timeval tv;
 
-static void console_size_signal_handler(int signum)
-{
-   struct termios tios;
-   int csse;
+   if (gettimeofday(&tv, NULL) != 0) {
+      tv.tv_sec = 0;
+      tv.tv_usec = 0;
+   }
 
-   console_size = -2;
+   if (sizeof(time_t) == 4) {
+      // treat time_t as unsigned to give chance for possible unsigned hack once year 2038 happens:
+      u.time = ((uint32_t)tv.tv_sec) * 1000000LL + tv.tv_usec;
+   }
+   else {
+      u.time = tv.tv_sec * 1000000LL + tv.tv_usec;
+   }
+#endif
 
-   for (;;) {
-      csse = console_send_size_event;
-      if (csse & CSSE_NEEDS_RESET) {
-         if (!__sync_bool_compare_and_swap(&console_send_size_event, csse, csse | CSSE_OCCURED | CSSE_WITH_RESET)) continue;
-         if (tcgetattr(STDOUT_FILENO, &tios) == 0) {
-            tios.c_cc[VMIN] = 0;
-            tios.c_cc[VTIME] = 0;
-            tcsetattr(STDOUT_FILENO, TCSANOW, &tios);
-         }
-         __sync_fetch_and_or(&console_send_size_event, CSSE_WAS_RESET);
-         break;
-      }
-      else {
-         if (!__sync_bool_compare_and_swap(&console_send_size_event, csse, csse | CSSE_OCCURED)) continue;
-         break;
-      }
+   if (!micro) {
+      u.time = (u.time + 500) / 1000;
    }
+
+   *error = fixscript_int(u.i[1]);
+   return fixscript_int(u.i[0]);
+#endif /* __wasm__ */
 }
-#endif
 
 
-#ifndef __wasm__
-static void activate_console()
+static Value native_monotonic_get_time(Heap *heap, Value *error, int num_params, Value *params, void *data)
 {
+#if defined(__wasm__)
+   // TODO
+   return fixscript_int(0);
+#else
+   int micro = ((intptr_t)data == 1);
+   uint64_t time;
+
 #if defined(_WIN32)
-   HANDLE in, out;
-   DWORD console_mode;
+   uint64_t freq, cnt;
+   QueryPerformanceFrequency((LARGE_INTEGER *)&freq);
+   QueryPerformanceCounter((LARGE_INTEGER *)&cnt);
+   time = cnt * 1000000 / freq;
+#elif defined(__linux__)
+   struct timespec ts;
    
-   in = GetStdHandle(STD_INPUT_HANDLE);
-   out = GetStdHandle(STD_OUTPUT_HANDLE);
-   if (GetConsoleMode(in, &console_mode)) {
-      SetConsoleMode(in, console_mode & ~ENABLE_PROCESSED_INPUT);
-   }
-   if (GetConsoleMode(out, &console_mode)) {
-      SetConsoleMode(out, console_mode & ~ENABLE_WRAP_AT_EOL_OUTPUT);
+   if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+      ts.tv_sec = 0;
+      ts.tv_nsec = 0;
    }
-   console_cur_attr = 0x07;
-   GetConsoleScreenBufferInfo(out, &last_csbi);
-#elif defined(__wasm__)
+
+   time = ts.tv_sec * 1000000LL + (ts.tv_nsec + 500) / 1000;
 #else
-   struct termios tios;
-   pthread_mutex_t *mutex;
+   struct timeval tv;
 
-   if (tcgetattr(STDOUT_FILENO, &tios) == 0) {
-      tios.c_iflag &= ~(IXON);
-      tios.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
-      tios.c_cc[VMIN] = 1;
-      tios.c_cc[VTIME] = 0;
-      tcsetattr(STDOUT_FILENO, TCSAFLUSH, &tios);
+   if (gettimeofday(&tv, NULL) != 0) {
+      tv.tv_sec = 0;
+      tv.tv_usec = 0;
    }
 
-   fprintf(stdout, "\e[0m"); // reset color
-   fprintf(stdout, "\e[7l"); // disable line wrap (vt100)
-   fprintf(stdout, "\e[?7l"); // disable line wrap (other)
-   fflush(stdout);
+   time = tv.tv_sec * 1000000LL + tv.tv_usec;
+#endif
 
-   signal(SIGINT, console_interrupt_signal_handler);
-   if (console_size == -1) {
-      signal(SIGWINCH, console_size_signal_handler);
+   if (micro) {
+      return fixscript_int(time);
    }
-
-   mutex = get_mutex(&console_auto_flush_mutex);
-   pthread_mutex_lock(mutex);
-   console_auto_flush_active = 1;
-   pthread_mutex_unlock(mutex);
-   pthread_create(&console_auto_flush_thread, NULL, console_auto_flush_thread_main, NULL);
-
-   setvbuf(stdin, NULL, _IONBF, 0);
-#endif
+   else {
+      return fixscript_int((time + 500) / 1000);
+   }
+#endif /* __wasm__ */
 }
-#endif
 
 
-#ifndef __wasm__
-static void deactivate_console()
+static Value native_array_create_view(Heap *heap, Value *error, int num_params, Value *params, void *data)
 {
-#if defined(_WIN32)
-   HANDLE in, out;
-   DWORD console_mode;
-   CONSOLE_CURSOR_INFO cci;
+   SharedArrayHandle *sah;
+   Value value;
+   char *ptr;
+   int arr_len, arr_elem_size;
+   int off, len, elem_size;
+   int created;
    
-   in = GetStdHandle(STD_INPUT_HANDLE);
-   out = GetStdHandle(STD_OUTPUT_HANDLE);
-   if (GetConsoleMode(in, &console_mode)) {
-      SetConsoleMode(in, console_mode | ENABLE_PROCESSED_INPUT);
+   sah = fixscript_get_shared_array_handle(heap, params[0], -1, NULL);
+   if (!sah) {
+      *error = fixscript_create_error_string(heap, "invalid shared array");
+      return fixscript_int(0);
    }
-   if (GetConsoleMode(out, &console_mode)) {
-      SetConsoleMode(out, console_mode | ENABLE_WRAP_AT_EOL_OUTPUT);
+
+   ptr = fixscript_get_shared_array_handle_data(sah, &arr_len, &arr_elem_size, NULL, -1, NULL);
+
+   if (num_params >= 3) {
+      off = params[1].value;
+      len = params[2].value;
    }
-   if (GetConsoleCursorInfo(out, &cci)) {
-      cci.bVisible = 1;
-      SetConsoleCursorInfo(out, &cci);
+   else {
+      off = 0;
+      len = arr_len;
    }
-#elif defined(__wasm__)
-#else
-   struct termios tios;
-   pthread_mutex_t *mutex;
-   pthread_cond_t *cond;
 
-   mutex = get_mutex(&console_auto_flush_mutex);
-   cond = get_cond(&console_auto_flush_cond);
+   elem_size = num_params == 2? params[1].value : num_params == 4? params[3].value : arr_elem_size;
+   if (elem_size != 1 && elem_size != 2 && elem_size != 4) {
+      *error = fixscript_create_error_string(heap, "element size must be 1, 2 or 4");
+      return fixscript_int(0);
+   }
 
-   pthread_mutex_lock(mutex);
-   console_auto_flush_active = 0;
-   pthread_cond_signal(cond);
-   pthread_mutex_unlock(mutex);
-   pthread_join(console_auto_flush_thread, NULL);
+   if (off < 0 || off >= arr_len || len < 0 || (int64_t)off + (int64_t)len > arr_len) {
+      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_BOUNDS);
+   }
 
-   if (tcgetattr(STDOUT_FILENO, &tios) == 0) {
-      tios.c_iflag |= IXON;
-      tios.c_lflag |= ECHO | ICANON | ISIG | IEXTEN;
-      tios.c_cc[VMIN] = 1;
-      tios.c_cc[VTIME] = 0;
-      tcsetattr(STDOUT_FILENO, TCSAFLUSH, &tios);
+   ptr += (intptr_t)off * arr_elem_size;
+   if ((((intptr_t)ptr) & (elem_size-1)) != 0) {
+      *error = fixscript_create_error_string(heap, "unaligned offset");
+      return fixscript_int(0);
    }
-   fprintf(stdout, "\e[0m"); // reset color
-   fprintf(stdout, "\e[7h"); // enable line wrap (vt100)
-   fprintf(stdout, "\e[?7h"); // enable line wrap (other)
-   fprintf(stdout, "\e[?25h"); // show cursor
-   fflush(stdout);
 
-   signal(SIGINT, SIG_DFL);
+   value = fixscript_get_shared_array(heap, -1, ptr, len, elem_size, sah);
+   if (value.value) {
+      return value;
+   }
 
-   setvbuf(stdin, NULL, _IOLBF, 0);
-#endif
+   fixscript_ref_shared_array(sah);
+   value = fixscript_create_or_get_shared_array(heap, -1, ptr, (intptr_t)len * arr_elem_size / elem_size, elem_size, (HandleFreeFunc)fixscript_unref_shared_array, sah, &created);
+   if (!value.value) {
+      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+   }
+   if (!created) {
+      fixscript_unref_shared_array(sah);
+   }
+   return value;
 }
-#endif
 
 
-#ifndef __wasm__
-static void handle_console_cleanup()
+typedef struct {
+   char *start;
+   char *cur, *end;
+} Buffer;
+
+
+static int buffer_expand(Buffer *buf)
 {
-   pthread_mutex_t *mutex;
+   char *new_data;
+   int new_size, pos;
 
-   mutex = get_mutex(&console_mutex);
-   if (mutex) {
-      pthread_mutex_lock(mutex);
-      if (clear_console_line()) {
-         fflush(stdout);
-      }
-      if (console_active) {
-         deactivate_console();
-         console_active = 0;
-      }
-      pthread_mutex_unlock(mutex);
+   new_size = buf->end - buf->start;
+   if (new_size >= (1<<30)) {
+      return 0;
    }
-}
-#endif
 
+   new_size <<= 1;
+   pos = buf->cur - buf->start;
+   new_data = realloc(buf->start, new_size);
+   if (!new_data) {
+      return 0;
+   }
 
-static Value native_console_is_present(Heap *heap, Value *error, int num_params, Value *params, void *data)
-{
-   int is_present = console_is_present;
-#ifdef _WIN32
-   DWORD console_mode;
-#endif
+   buf->start = new_data;
+   buf->cur = new_data + pos;
+   buf->end = new_data + new_size;
+   return 1;
+}
 
-   if (is_present < 0) {
-      #if defined(_WIN32)
-         if (gui_app) {
-            is_present = 0;
-         }
-         else {
-            is_present = GetConsoleMode(GetStdHandle(STD_INPUT_HANDLE), &console_mode) && GetConsoleMode(GetStdHandle(STD_OUTPUT_HANDLE), &console_mode);
-         }
-      #elif defined(__wasm__)
-         is_present = 0;
-      #else
-         is_present = isatty(STDIN_FILENO) && isatty(STDOUT_FILENO);
-      #endif
-      console_is_present = is_present;
+
+static inline int buffer_append_byte(Buffer *buf, uint8_t value)
+{
+   if (buf->cur == buf->end) {
+      if (!buffer_expand(buf)) return 0;
    }
-   return fixscript_int(is_present);
+   *buf->cur++ = value;
+   return 1;
 }
 
 
-static Value native_console_get_size(Heap *heap, Value *error, int num_params, Value *params, void *data)
+static inline int buffer_append_short(Buffer *buf, uint16_t value)
 {
-#if defined(__wasm__)
-   return fixscript_int(0);
-#else
-   int which = (intptr_t)data;
-   int size;
-#ifdef _WIN32
-   CONSOLE_SCREEN_BUFFER_INFO csbi;
-#else
-   struct {
-      unsigned short ws_row;
-      unsigned short ws_col;
-      unsigned short ws_xpixel;
-      unsigned short ws_ypixel;
-   } ws;
-#endif
-
-   size = console_size;
-   if (size < 0) {
-      #ifdef _WIN32
-         if (gui_app) {
-            size = 0;
-         }
-         else {
-            if (GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &csbi)) {
-               size = ((uint16_t)csbi.dwSize.X) | (((int)(uint16_t)(csbi.srWindow.Bottom - csbi.srWindow.Top + 1)) << 16);
-            }
-            else {
-               size = 0;
-            }
-         }
-      #else
-         if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) != 0) {
-            return fixscript_int(0);
-         }
-         if (size == -1) {
-            signal(SIGWINCH, console_size_signal_handler);
-         }
-         size = ws.ws_col | (((int)ws.ws_row) << 16);
-      #endif
-      console_size = size;
+   if (buf->end - buf->cur < 2) {
+      if (!buffer_expand(buf)) return 0;
    }
-
-   return fixscript_int(which == 0? (size & 0xFFFF) : ((size >> 16) & 0xFFFF));
-#endif /* __wasm__ */
+   memcpy(buf->cur, &value, 2);
+   buf->cur += 2;
+   return 1;
 }
 
 
-static Value native_console_set_active(Heap *heap, Value *error, int num_params, Value *params, void *data)
+static inline int buffer_append_int(Buffer *buf, int value)
 {
-#if defined(__wasm__)
-   *error = fixscript_create_error_string(heap, "not supported");
-   return fixscript_int(0);
-#else
-   pthread_mutex_t *mutex;
-
-   if (!native_console_is_present(heap, error, 0, NULL, NULL).value) {
-      *error = fixscript_create_error_string(heap, "console is not present");
-      return fixscript_int(0);
+   if (buf->end - buf->cur < 4) {
+      if (!buffer_expand(buf)) return 0;
    }
+   memcpy(buf->cur, &value, 4);
+   buf->cur += 4;
+   return 1;
+}
 
-   mutex = get_mutex(&console_mutex);
-   if (!mutex) {
-      *error = fixscript_create_error_string(heap, "can't lock console");
-      return fixscript_int(0);
-   }
 
-   pthread_mutex_lock(mutex);
-   if (clear_console_line()) {
-      fflush(stdout);
+static inline int buffer_append_length(Buffer *buf, int type, int len)
+{
+   if (len <= 12) {
+      if (!buffer_append_byte(buf, type | (len << 4))) return 0;
    }
-
-   if (!console_active && params[0].value) {
-      activate_console();
-      console_active = 1;
+   else if (len <= 0xFF) {
+      if (!buffer_append_byte(buf, type | (13 << 4))) return 0;
+      if (!buffer_append_byte(buf, len)) return 0;
    }
-   else if (console_active && !params[0].value) {
-      deactivate_console();
-      console_active = 0;
+   else if (len <= 0xFFFF) {
+      if (!buffer_append_byte(buf, type | (14 << 4))) return 0;
+      if (!buffer_append_short(buf, len)) return 0;
    }
-
-   pthread_mutex_unlock(mutex);
-   return fixscript_int(0);
-#endif /* __wasm__ */
+   else {
+      if (!buffer_append_byte(buf, type | (15 << 4))) return 0;
+      if (!buffer_append_int(buf, len)) return 0;
+   }
+   return 1;
 }
 
 
-static Value native_console_is_active(Heap *heap, Value *error, int num_params, Value *params, void *data)
+static inline int buffer_read_byte(Buffer *buf, uint8_t *value)
 {
-   pthread_mutex_t *mutex;
-   int active;
-
-   mutex = get_mutex(&console_mutex);
-   if (!mutex) {
-      *error = fixscript_create_error_string(heap, "can't lock console");
-      return fixscript_int(0);
+   if (buf->cur == buf->end) {
+      return 0;
    }
-
-   pthread_mutex_lock(mutex);
-   active = console_active;
-   pthread_mutex_unlock(mutex);
-   
-   return fixscript_int(active);
+   *value = *buf->cur++;
+   return 1;
 }
 
 
-static Value native_console_get_cursor(Heap *heap, Value *error, int num_params, Value *params, void *data)
+static inline int buffer_read_short(Buffer *buf, uint16_t *value)
 {
-#if defined(__wasm__)
-   *error = fixscript_create_error_string(heap, "not supported");
-   return fixscript_int(0);
-#else
-   pthread_mutex_t *mutex;
-   Value cursor[2], ret;
-   int err;
-#ifdef _WIN32
-   HANDLE out;
-   CONSOLE_SCREEN_BUFFER_INFO csbi;
-   int base_y;
-#else
-   char c;
-   int i, ch, x, y, start;
-#endif
-
-   mutex = get_mutex(&console_mutex);
-   if (!mutex) {
-      *error = fixscript_create_error_string(heap, "can't lock console");
-      return fixscript_int(0);
+   if (buf->end - buf->cur < 2) {
+      return 0;
    }
+   memcpy(value, buf->cur, 2);
+   buf->cur += 2;
+   return 1;
+}
 
-   pthread_mutex_lock(mutex);
-   if (!console_active) {
-      pthread_mutex_unlock(mutex);
-      *error = fixscript_create_error_string(heap, "console is not active");
-      return fixscript_int(0);
+
+static inline int buffer_read_int(Buffer *buf, int *value)
+{
+   if (buf->end - buf->cur < 4) {
+      return 0;
    }
+   memcpy(value, buf->cur, 4);
+   buf->cur += 4;
+   return 1;
+}
 
-   cursor[0] = fixscript_int(0);
-   cursor[1] = fixscript_int(0);
 
-#ifdef _WIN32
-   out = GetStdHandle(STD_OUTPUT_HANDLE);
-   if (GetConsoleScreenBufferInfo(out, &csbi)) {
-      base_y = csbi.dwSize.Y - (csbi.srWindow.Bottom - csbi.srWindow.Top + 1);
+static inline int buffer_read_length(Buffer *buf, uint8_t type, int *len)
+{
+   uint8_t len8;
+   uint16_t len16;
 
-      cursor[0] = fixscript_int(csbi.dwCursorPosition.X);
-      cursor[1] = fixscript_int(csbi.dwCursorPosition.Y - base_y);
+   if ((type >> 4) <= 12) {
+      *len = type >> 4;
+      return 1;
    }
-#else
-   fprintf(stdout, "\e[6n");
-   fflush(stdout);
-   for (;;) {
-      if (read(STDIN_FILENO, &c, 1) == 1) {
-         ch = c;
-      }
-      else {
-         ch = EOF;
-      }
-      if (ch != EOF) {
-         if (console_input_len == sizeof(console_input_buf)) {
-            memmove(console_input_buf, console_input_buf+1, --console_input_len);
-         }
-         console_input_buf[console_input_len++] = ch;
-
-         if (ch == 'R' && console_input_len >= 6) {
-            for (i=console_input_len-2; i>=0; i--) {
-               if (console_input_buf[i] == '\e' && console_input_buf[i+1] == '[') {
-                  start = i;
-                  i += 2;
-                  y = 0;
-                  while (console_input_buf[i] >= '0' && console_input_buf[i] <= '9') {
-                     y = y*10 + (console_input_buf[i++] - '0');
-                  }
-                  if (console_input_buf[i++] == ';') {
-                     x = 0;
-                     while (console_input_buf[i] >= '0' && console_input_buf[i] <= '9') {
-                        x = x*10 + (console_input_buf[i++] - '0');
-                     }
-                     if (i == console_input_len-1) {
-                        cursor[0] = fixscript_int(x-1);
-                        cursor[1] = fixscript_int(y-1);
-                        console_input_len = start;
-                        goto end;
-                     }
-                  }
-                  break;
-               }
-            }
-         }
-      }
+   if ((type >> 4) == 13) {
+      if (!buffer_read_byte(buf, &len8)) return 0;
+      *len = len8;
+      return 1;
    }
-   end:;
-#endif
-
-   pthread_mutex_unlock(mutex);
-
-   ret = fixscript_create_array(heap, 2);
-   if (!ret.value) {
-      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
-   }
-
-   err = fixscript_set_array_range(heap, ret, 0, 2, cursor);
-   if (err) {
-      return fixscript_error(heap, error, err);
+   if ((type >> 4) == 14) {
+      if (!buffer_read_short(buf, &len16)) return 0;
+      *len = len16;
+      return 1;
    }
-   return ret;
-#endif /* __wasm__ */
+   return buffer_read_int(buf, len);
 }
 
 
-static Value native_console_set_cursor(Heap *heap, Value *error, int num_params, Value *params, void *data)
-{
-#if defined(__wasm__)
-   *error = fixscript_create_error_string(heap, "not supported");
-   return fixscript_int(0);
-#else
-   int relative = (intptr_t)data;
-   pthread_mutex_t *mutex;
-#ifdef _WIN32
-   HANDLE out;
-   CONSOLE_SCREEN_BUFFER_INFO csbi;
-   int x, y, w, h, base_y;
-#endif
+enum {
+   SER_ZERO         = 0,
+   SER_BYTE         = 1,
+   SER_SHORT        = 2,
+   SER_INT          = 3,
+   SER_FLOAT        = 4,
+   SER_FLOAT_ZERO   = 5,
+   SER_REF          = 6,
+   SER_REF_SHORT    = 7,
+   SER_ARRAY        = 8,
+   SER_ARRAY_BYTE   = 9,
+   SER_ARRAY_SHORT  = 10,
+   SER_ARRAY_INT    = 11,
+   SER_STRING_BYTE  = 12,
+   SER_STRING_SHORT = 13,
+   SER_STRING_INT   = 14,
+   SER_HASH         = 15
+};
 
-   mutex = get_mutex(&console_mutex);
-   if (!mutex) {
-      *error = fixscript_create_error_string(heap, "can't lock console");
-      return fixscript_int(0);
-   }
+typedef struct {
+   char *key, *value;
+   int key_len, value_len;
+} SortedEntry;
 
-   pthread_mutex_lock(mutex);
-   if (!console_active) {
-      pthread_mutex_unlock(mutex);
-      *error = fixscript_create_error_string(heap, "console is not active");
-      return fixscript_int(0);
-   }
 
-#ifdef _WIN32
-   out = GetStdHandle(STD_OUTPUT_HANDLE);
-   if (GetConsoleScreenBufferInfo(out, &csbi)) {
-      base_y = csbi.dwSize.Y - (csbi.srWindow.Bottom - csbi.srWindow.Top + 1);
+static int compare_serialized_values(Buffer *buf1, Buffer *buf2, int remaining)
+{
+   uint8_t type1, type2;
 
-      if (relative) {
-         x = csbi.dwCursorPosition.X;
-         y = csbi.dwCursorPosition.Y - base_y;
-         x += params[0].value;
-         y += params[1].value;
-      }
-      else {
-         x = params[0].value;
-         y = params[1].value;
-      }
+   while (remaining-- > 0) {
+      if (buf1->cur == buf1->end) return buf2->cur == buf2->end? 0 : -1;
+      if (buf2->cur == buf2->end) return +1;
 
-      w = csbi.dwSize.X;
-      h = csbi.srWindow.Bottom - csbi.srWindow.Top + 1;
+      type1 = *(buf1->cur++);
+      type2 = *(buf2->cur++);
 
-      if (x < 0) x = 0;
-      if (y < -base_y) y = -base_y;
-      if (x >= w) x = w-1;
-      if (y >= h) y = h-1;
+      switch (type1 & 0x0F) {
+         case SER_ZERO:
+            switch (type2 & 0x0F) {
+               case SER_ZERO:
+                  continue;
 
-      csbi.dwCursorPosition.X = x;
-      csbi.dwCursorPosition.Y = y + base_y;
-      SetConsoleCursorPosition(out, csbi.dwCursorPosition);
-   }
-#else
-   if (relative) {
-      if (params[0].value < 0) {
-         fprintf(stdout, "\e[%dD", -params[0].value);
-      }
-      if (params[0].value > 0) {
-         fprintf(stdout, "\e[%dC", params[0].value);
-      }
-      if (params[1].value < 0) {
-         fprintf(stdout, "\e[%dA", -params[1].value);
-      }
-      if (params[1].value > 0) {
-         fprintf(stdout, "\e[%dB", params[1].value);
-      }
-   }
-   else {
-      fprintf(stdout, "\e[%d;%dH", params[1].value+1, params[0].value+1);
-   }
-   console_flush();
-#endif
+               case SER_BYTE:
+               case SER_SHORT:
+                  return -1;
 
-   pthread_mutex_unlock(mutex);
-   return fixscript_int(0);
-#endif /* __wasm__ */
-}
+               case SER_INT:
+                  if (buf2->end - buf2->cur < 4) goto error;
+                  if (buf2->cur[3] & 0x80) return +1;
+                  return -1;
 
+               case SER_FLOAT:
+               case SER_FLOAT_ZERO:
+               case SER_ARRAY:
+               case SER_ARRAY_BYTE:
+               case SER_ARRAY_SHORT:
+               case SER_ARRAY_INT:
+               case SER_STRING_BYTE:
+               case SER_STRING_SHORT:
+               case SER_STRING_INT:
+               case SER_HASH:
+                  return -1;
+            }
+            goto error;
 
-static Value native_console_show_cursor(Heap *heap, Value *error, int num_params, Value *params, void *data)
-{
-#if defined(__wasm__)
-   *error = fixscript_create_error_string(heap, "not supported");
-   return fixscript_int(0);
-#else
-   int show = (intptr_t)data;
-   pthread_mutex_t *mutex;
-#ifdef _WIN32
-   HANDLE out;
-   CONSOLE_CURSOR_INFO cci;
-#endif
+         case SER_BYTE:
+            switch (type2 & 0x0F) {
+               case SER_ZERO:
+                  return +1;
 
-   mutex = get_mutex(&console_mutex);
-   if (!mutex) {
-      *error = fixscript_create_error_string(heap, "can't lock console");
-      return fixscript_int(0);
-   }
+               case SER_BYTE: {
+                  uint8_t val1, val2;
+                  if (!buffer_read_byte(buf1, &val1)) goto error;
+                  if (!buffer_read_byte(buf2, &val2)) goto error;
+                  if (val1 == val2) continue;
+                  return (int)val1 - (int)val2;
+               }
 
-   pthread_mutex_lock(mutex);
-   if (!console_active) {
-      pthread_mutex_unlock(mutex);
-      *error = fixscript_create_error_string(heap, "console is not active");
-      return fixscript_int(0);
-   }
+               case SER_SHORT:
+                  return -1;
 
-#ifdef _WIN32
-   out = GetStdHandle(STD_OUTPUT_HANDLE);
-   if (GetConsoleCursorInfo(out, &cci)) {
-      cci.bVisible = show;
-      SetConsoleCursorInfo(out, &cci);
-   }
-#else
-   if (show) {
-      fprintf(stdout, "\e[?25h");
-   }
-   else {
-      fprintf(stdout, "\e[?25l");
-   }
-   console_flush();
-#endif
+               case SER_INT:
+                  if (buf2->end - buf2->cur < 4) goto error;
+                  if (buf2->cur[3] & 0x80) return +1;
+                  return -1;
 
-   pthread_mutex_unlock(mutex);
-   return fixscript_int(0);
-#endif /* __wasm__ */
-}
+               case SER_FLOAT:
+               case SER_FLOAT_ZERO:
+               case SER_ARRAY:
+               case SER_ARRAY_BYTE:
+               case SER_ARRAY_SHORT:
+               case SER_ARRAY_INT:
+               case SER_STRING_BYTE:
+               case SER_STRING_SHORT:
+               case SER_STRING_INT:
+               case SER_HASH:
+                  return -1;
+            }
+            goto error;
 
+         case SER_SHORT:
+            switch (type2 & 0x0F) {
+               case SER_ZERO:
+               case SER_BYTE:
+                  return +1;
 
-static Value native_console_clear(Heap *heap, Value *error, int num_params, Value *params, void *data)
-{
-#if defined(__wasm__)
-   *error = fixscript_create_error_string(heap, "not supported");
-   return fixscript_int(0);
-#else
-   pthread_mutex_t *mutex;
-#ifdef _WIN32
-   HANDLE out;
-   CONSOLE_SCREEN_BUFFER_INFO csbi;
-   COORD size, coord;
-   SMALL_RECT rect;
-   CHAR_INFO *chars;
-   int64_t len64;
-   int i;
-#endif
+               case SER_SHORT: {
+                  uint16_t val1, val2;
+                  if (!buffer_read_short(buf1, &val1)) goto error;
+                  if (!buffer_read_short(buf2, &val2)) goto error;
+                  if (val1 == val2) continue;
+                  return (int)val1 - (int)val2;
+               }
 
-   mutex = get_mutex(&console_mutex);
-   if (!mutex) {
-      *error = fixscript_create_error_string(heap, "can't lock console");
-      return fixscript_int(0);
-   }
+               case SER_INT:
+                  if (buf2->end - buf2->cur < 4) goto error;
+                  if (buf2->cur[3] & 0x80) return +1;
+                  return -1;
 
-   pthread_mutex_lock(mutex);
-   if (!console_active) {
-      pthread_mutex_unlock(mutex);
+               case SER_FLOAT:
+               case SER_FLOAT_ZERO:
+               case SER_ARRAY:
+               case SER_ARRAY_BYTE:
+               case SER_ARRAY_SHORT:
+               case SER_ARRAY_INT:
+               case SER_STRING_BYTE:
+               case SER_STRING_SHORT:
+               case SER_STRING_INT:
+               case SER_HASH:
+                  return -1;
+            }
+            goto error;
+
+         case SER_INT:
+            switch (type2 & 0x0F) {
+               case SER_ZERO:
+               case SER_BYTE:
+               case SER_SHORT:
+                  if (buf1->end - buf1->cur < 4) goto error;
+                  if (buf1->cur[3] & 0x80) return -1;
+                  return +1;
+
+               case SER_INT: {
+                  int val1, val2;
+                  if (!buffer_read_int(buf1, &val1)) goto error;
+                  if (!buffer_read_int(buf2, &val2)) goto error;
+                  if (val1 == val2) continue;
+                  return val1 < val2? -1 : +1;
+               }
+
+               case SER_FLOAT:
+               case SER_FLOAT_ZERO:
+               case SER_ARRAY:
+               case SER_ARRAY_BYTE:
+               case SER_ARRAY_SHORT:
+               case SER_ARRAY_INT:
+               case SER_STRING_BYTE:
+               case SER_STRING_SHORT:
+               case SER_STRING_INT:
+               case SER_HASH:
+                  return -1;
+            }
+            goto error;
+
+         case SER_FLOAT:
+            switch (type2 & 0x0F) {
+               case SER_ZERO:
+               case SER_BYTE:
+               case SER_SHORT:
+               case SER_INT:
+                  return +1;
+
+               case SER_FLOAT: {
+                  int val1, val2;
+                  if (!buffer_read_int(buf1, &val1)) goto error;
+                  if (!buffer_read_int(buf2, &val2)) goto error;
+                  if (val1 == val2) continue;
+                  if (val1 & 0x80000000) {
+                     if (val2 & 0x80000000) {
+                        return (val2 & 0x7FFFFFFF) - (val1 & 0x7FFFFFFF);
+                     }
+                     return -1;
+                  }
+                  if (val2 & 0x80000000) {
+                     return +1;
+                  }
+                  return (val1 & 0x7FFFFFFF) - (val2 & 0x7FFFFFFF);
+               }
+
+               case SER_FLOAT_ZERO: {
+                  if (buf1->end - buf1->cur < 4) goto error;
+                  if (buf1->cur[3] & 0x80) return -1;
+                  return +1;
+               }
+
+               case SER_ARRAY:
+               case SER_ARRAY_BYTE:
+               case SER_ARRAY_SHORT:
+               case SER_ARRAY_INT:
+               case SER_STRING_BYTE:
+               case SER_STRING_SHORT:
+               case SER_STRING_INT:
+               case SER_HASH:
+                  return -1;
+            }
+            goto error;
+
+         case SER_FLOAT_ZERO:
+            switch (type2 & 0x0F) {
+               case SER_ZERO:
+               case SER_BYTE:
+               case SER_SHORT:
+               case SER_INT:
+                  return +1;
+
+               case SER_FLOAT: {
+                  if (buf2->end - buf2->cur < 4) goto error;
+                  if (buf2->cur[3] & 0x80) return +1;
+                  return -1;
+               }
+
+               case SER_FLOAT_ZERO:
+                  continue;
+
+               case SER_ARRAY:
+               case SER_ARRAY_BYTE:
+               case SER_ARRAY_SHORT:
+               case SER_ARRAY_INT:
+               case SER_STRING_BYTE:
+               case SER_STRING_SHORT:
+               case SER_STRING_INT:
+               case SER_HASH:
+                  return -1;
+            }
+            goto error;
+
+         case SER_ARRAY:
+            switch (type2 & 0x0F) {
+               case SER_ZERO:
+               case SER_BYTE:
+               case SER_SHORT:
+               case SER_INT:
+               case SER_FLOAT:
+               case SER_FLOAT_ZERO:
+                  return +1;
+
+               case SER_ARRAY: {
+                  int len1, len2, ret;
+
+                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
+                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
+
+                  ret = compare_serialized_values(buf1, buf2, len1 < len2? len1 : len2);
+                  if (ret != 0) return ret;
+                  if (len1 == len2) {
+                     continue;
+                  }
+                  return len1 - len2;
+               }
+
+               case SER_ARRAY_BYTE: {
+                  uint8_t val2;
+                  int i, len1, len2, len;
+
+                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
+                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
+                  len = len1 < len2? len1 : len2;
+
+                  for (i=0; i<len; i++) {
+                     if (!buffer_read_byte(buf1, &type1)) goto error;
+                     if (!buffer_read_byte(buf2, &val2)) goto error;
+                     switch (type1 & 0x0F) {
+                        case SER_ZERO:
+                           if (val2 > 0) return -1;
+                           continue;
+
+                        case SER_BYTE: {
+                           uint8_t val1;
+                           if (!buffer_read_byte(buf1, &val1)) goto error;
+                           if (val1 != val2) {
+                              return (int)val1 - (int)val2;
+                           }
+                           continue;
+                        }
+
+                        case SER_SHORT: {
+                           uint16_t val1;
+                           if (!buffer_read_short(buf1, &val1)) goto error;
+                           if (val1 != val2) {
+                              return (int)val1 - (int)val2;
+                           }
+                           continue;
+                        }
+                        
+                        case SER_INT: {
+                           int val1;
+                           if (!buffer_read_int(buf1, &val1)) goto error;
+                           if (val1 != val2) {
+                              return val1 < val2? -1 : +1;
+                           }
+                           continue;
+                        }
+
+                        case SER_FLOAT:
+                        case SER_FLOAT_ZERO:
+                        case SER_ARRAY:
+                        case SER_ARRAY_BYTE:
+                        case SER_ARRAY_SHORT:
+                        case SER_ARRAY_INT:
+                        case SER_STRING_BYTE:
+                        case SER_STRING_SHORT:
+                        case SER_STRING_INT:
+                        case SER_HASH:
+                           return +1;
+                     }
+                     goto error;
+                  }
+                  if (len1 == len2) {
+                     continue;
+                  }
+                  return len1 - len2;
+               }
+
+               case SER_ARRAY_SHORT: {
+                  uint16_t val2;
+                  int i, len1, len2, len;
+
+                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
+                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
+                  len = len1 < len2? len1 : len2;
+
+                  for (i=0; i<len; i++) {
+                     if (!buffer_read_byte(buf1, &type1)) goto error;
+                     if (!buffer_read_short(buf2, &val2)) goto error;
+                     switch (type1 & 0x0F) {
+                        case SER_ZERO:
+                           if (val2 > 0) return -1;
+                           continue;
+
+                        case SER_BYTE: {
+                           uint8_t val1;
+                           if (!buffer_read_byte(buf1, &val1)) goto error;
+                           if (val1 != val2) {
+                              return (int)val1 - (int)val2;
+                           }
+                           continue;
+                        }
+
+                        case SER_SHORT: {
+                           uint16_t val1;
+                           if (!buffer_read_short(buf1, &val1)) goto error;
+                           if (val1 != val2) {
+                              return (int)val1 - (int)val2;
+                           }
+                           continue;
+                        }
+                        
+                        case SER_INT: {
+                           int val1;
+                           if (!buffer_read_int(buf1, &val1)) goto error;
+                           if (val1 != val2) {
+                              return val1 < val2? -1 : +1;
+                           }
+                           continue;
+                        }
+
+                        case SER_FLOAT:
+                        case SER_FLOAT_ZERO:
+                        case SER_ARRAY:
+                        case SER_ARRAY_BYTE:
+                        case SER_ARRAY_SHORT:
+                        case SER_ARRAY_INT:
+                        case SER_STRING_BYTE:
+                        case SER_STRING_SHORT:
+                        case SER_STRING_INT:
+                        case SER_HASH:
+                           return +1;
+                     }
+                     goto error;
+                  }
+                  if (len1 == len2) {
+                     continue;
+                  }
+                  return len1 - len2;
+               }
+
+               case SER_ARRAY_INT: {
+                  int val2;
+                  int i, len1, len2, len;
+
+                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
+                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
+                  len = len1 < len2? len1 : len2;
+
+                  for (i=0; i<len; i++) {
+                     if (!buffer_read_byte(buf1, &type1)) goto error;
+                     if (!buffer_read_int(buf2, &val2)) goto error;
+                     switch (type1 & 0x0F) {
+                        case SER_ZERO:
+                           if (val2 < 0) return +1;
+                           if (val2 > 0) return -1;
+                           continue;
+
+                        case SER_BYTE: {
+                           uint8_t val1;
+                           if (!buffer_read_byte(buf1, &val1)) goto error;
+                           if (val1 != val2) {
+                              return val1 < val2? -1 : +1;
+                           }
+                           continue;
+                        }
+
+                        case SER_SHORT: {
+                           uint16_t val1;
+                           if (!buffer_read_short(buf1, &val1)) goto error;
+                           if (val1 != val2) {
+                              return val1 < val2? -1 : +1;
+                           }
+                           continue;
+                        }
+                        
+                        case SER_INT: {
+                           int val1;
+                           if (!buffer_read_int(buf1, &val1)) goto error;
+                           if (val1 != val2) {
+                              return val1 < val2? -1 : +1;
+                           }
+                           continue;
+                        }
+
+                        case SER_FLOAT:
+                        case SER_FLOAT_ZERO:
+                        case SER_ARRAY:
+                        case SER_ARRAY_BYTE:
+                        case SER_ARRAY_SHORT:
+                        case SER_ARRAY_INT:
+                        case SER_STRING_BYTE:
+                        case SER_STRING_SHORT:
+                        case SER_STRING_INT:
+                        case SER_HASH:
+                           return +1;
+                     }
+                     goto error;
+                  }
+                  if (len1 == len2) {
+                     continue;
+                  }
+                  return len1 - len2;
+               }
+
+               case SER_STRING_BYTE:
+               case SER_STRING_SHORT:
+               case SER_STRING_INT:
+               case SER_HASH:
+                  return -1;
+            }
+            goto error;
+
+         case SER_ARRAY_BYTE:
+            switch (type2 & 0x0F) {
+               case SER_ZERO:
+               case SER_BYTE:
+               case SER_SHORT:
+               case SER_INT:
+               case SER_FLOAT:
+               case SER_FLOAT_ZERO:
+                  return +1;
+
+               case SER_ARRAY: {
+                  uint8_t val1;
+                  int i, len1, len2, len;
+
+                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
+                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
+                  len = len1 < len2? len1 : len2;
+
+                  for (i=0; i<len; i++) {
+                     if (!buffer_read_byte(buf1, &val1)) goto error;
+                     if (!buffer_read_byte(buf2, &type2)) goto error;
+                     switch (type2 & 0x0F) {
+                        case SER_ZERO:
+                           if (val1 > 0) return +1;
+                           continue;
+
+                        case SER_BYTE: {
+                           uint8_t val2;
+                           if (!buffer_read_byte(buf2, &val2)) goto error;
+                           if (val1 != val2) {
+                              return (int)val1 - (int)val2;
+                           }
+                           continue;
+                        }
+
+                        case SER_SHORT: {
+                           uint16_t val2;
+                           if (!buffer_read_short(buf2, &val2)) goto error;
+                           if (val1 != val2) {
+                              return (int)val1 - (int)val2;
+                           }
+                           continue;
+                        }
+
+                        case SER_INT: {
+                           int val2;
+                           if (!buffer_read_int(buf2, &val2)) goto error;
+                           if (val1 != val2) {
+                              return val1 < val2? -1 : +1;
+                           }
+                           continue;
+                        }
+
+                        case SER_FLOAT:
+                        case SER_FLOAT_ZERO:
+                        case SER_ARRAY:
+                        case SER_ARRAY_BYTE:
+                        case SER_ARRAY_SHORT:
+                        case SER_ARRAY_INT:
+                        case SER_STRING_BYTE:
+                        case SER_STRING_SHORT:
+                        case SER_STRING_INT:
+                        case SER_HASH:
+                           return -1;
+                     }
+                     goto error;
+                  }
+                  if (len1 == len2) {
+                     continue;
+                  }
+                  return len1 - len2;
+               }
+
+               case SER_ARRAY_BYTE: {
+                  uint8_t val1, val2;
+                  int i, len1, len2, len;
+
+                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
+                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
+                  len = len1 < len2? len1 : len2;
+
+                  for (i=0; i<len; i++) {
+                     if (!buffer_read_byte(buf1, &val1)) goto error;
+                     if (!buffer_read_byte(buf2, &val2)) goto error;
+                     if (val1 != val2) {
+                        return (int)val1 - (int)val2;
+                     }
+                  }
+                  if (len1 == len2) {
+                     continue;
+                  }
+                  return len1 - len2;
+               }
+
+               case SER_ARRAY_SHORT: {
+                  uint8_t val1;
+                  uint16_t val2;
+                  int i, len1, len2, len;
+
+                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
+                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
+                  len = len1 < len2? len1 : len2;
+
+                  for (i=0; i<len; i++) {
+                     if (!buffer_read_byte(buf1, &val1)) goto error;
+                     if (!buffer_read_short(buf2, &val2)) goto error;
+                     if (val1 != val2) {
+                        return (int)val1 - (int)val2;
+                     }
+                  }
+                  if (len1 == len2) {
+                     continue;
+                  }
+                  return len1 - len2;
+               }
+
+               case SER_ARRAY_INT: {
+                  uint8_t val1;
+                  int val2;
+                  int i, len1, len2, len;
+
+                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
+                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
+                  len = len1 < len2? len1 : len2;
+
+                  for (i=0; i<len; i++) {
+                     if (!buffer_read_byte(buf1, &val1)) goto error;
+                     if (!buffer_read_int(buf2, &val2)) goto error;
+                     if (val1 != val2) {
+                        return val1 < val2? -1 : +1;
+                     }
+                  }
+                  if (len1 == len2) {
+                     continue;
+                  }
+                  return len1 - len2;
+               }
+
+               case SER_STRING_BYTE:
+               case SER_STRING_SHORT:
+               case SER_STRING_INT:
+               case SER_HASH:
+                  return -1;
+            }
+            goto error;
+
+         case SER_ARRAY_SHORT:
+            switch (type2 & 0x0F) {
+               case SER_ZERO:
+               case SER_BYTE:
+               case SER_SHORT:
+               case SER_INT:
+               case SER_FLOAT:
+               case SER_FLOAT_ZERO:
+                  return +1;
+
+               case SER_ARRAY: {
+                  uint16_t val1;
+                  int i, len1, len2, len;
+
+                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
+                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
+                  len = len1 < len2? len1 : len2;
+
+                  for (i=0; i<len; i++) {
+                     if (!buffer_read_short(buf1, &val1)) goto error;
+                     if (!buffer_read_byte(buf2, &type2)) goto error;
+                     switch (type2 & 0x0F) {
+                        case SER_ZERO:
+                           if (val1 > 0) return +1;
+                           continue;
+
+                        case SER_BYTE: {
+                           uint8_t val2;
+                           if (!buffer_read_byte(buf2, &val2)) goto error;
+                           if (val1 != val2) {
+                              return (int)val1 - (int)val2;
+                           }
+                           continue;
+                        }
+
+                        case SER_SHORT: {
+                           uint16_t val2;
+                           if (!buffer_read_short(buf2, &val2)) goto error;
+                           if (val1 != val2) {
+                              return (int)val1 - (int)val2;
+                           }
+                           continue;
+                        }
+
+                        case SER_INT: {
+                           int val2;
+                           if (!buffer_read_int(buf2, &val2)) goto error;
+                           if (val1 != val2) {
+                              return val1 < val2? -1 : +1;
+                           }
+                           continue;
+                        }
+
+                        case SER_FLOAT:
+                        case SER_FLOAT_ZERO:
+                        case SER_ARRAY:
+                        case SER_ARRAY_BYTE:
+                        case SER_ARRAY_SHORT:
+                        case SER_ARRAY_INT:
+                        case SER_STRING_BYTE:
+                        case SER_STRING_SHORT:
+                        case SER_STRING_INT:
+                        case SER_HASH:
+                           return -1;
+                     }
+                     goto error;
+                  }
+                  if (len1 == len2) {
+                     continue;
+                  }
+                  return len1 - len2;
+               }
+
+               case SER_ARRAY_BYTE: {
+                  uint16_t val1;
+                  uint8_t val2;
+                  int i, len1, len2, len;
+
+                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
+                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
+                  len = len1 < len2? len1 : len2;
+
+                  for (i=0; i<len; i++) {
+                     if (!buffer_read_short(buf1, &val1)) goto error;
+                     if (!buffer_read_byte(buf2, &val2)) goto error;
+                     if (val1 != val2) {
+                        return (int)val1 - (int)val2;
+                     }
+                  }
+                  if (len1 == len2) {
+                     continue;
+                  }
+                  return len1 - len2;
+               }
+
+               case SER_ARRAY_SHORT: {
+                  uint16_t val1;
+                  uint16_t val2;
+                  int i, len1, len2, len;
+
+                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
+                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
+                  len = len1 < len2? len1 : len2;
+
+                  for (i=0; i<len; i++) {
+                     if (!buffer_read_short(buf1, &val1)) goto error;
+                     if (!buffer_read_short(buf2, &val2)) goto error;
+                     if (val1 != val2) {
+                        return (int)val1 - (int)val2;
+                     }
+                  }
+                  if (len1 == len2) {
+                     continue;
+                  }
+                  return len1 - len2;
+               }
+
+               case SER_ARRAY_INT: {
+                  uint16_t val1;
+                  int val2;
+                  int i, len1, len2, len;
+
+                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
+                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
+                  len = len1 < len2? len1 : len2;
+
+                  for (i=0; i<len; i++) {
+                     if (!buffer_read_short(buf1, &val1)) goto error;
+                     if (!buffer_read_int(buf2, &val2)) goto error;
+                     if (val1 != val2) {
+                        return val1 < val2? -1 : +1;
+                     }
+                  }
+                  if (len1 == len2) {
+                     continue;
+                  }
+                  return len1 - len2;
+               }
+
+               case SER_STRING_BYTE:
+               case SER_STRING_SHORT:
+               case SER_STRING_INT:
+               case SER_HASH:
+                  return -1;
+            }
+            goto error;
+
+         case SER_ARRAY_INT:
+            switch (type2 & 0x0F) {
+               case SER_ZERO:
+               case SER_BYTE:
+               case SER_SHORT:
+               case SER_INT:
+               case SER_FLOAT:
+               case SER_FLOAT_ZERO:
+                  return +1;
+
+               case SER_ARRAY: {
+                  int val1;
+                  int i, len1, len2, len;
+
+                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
+                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
+                  len = len1 < len2? len1 : len2;
+
+                  for (i=0; i<len; i++) {
+                     if (!buffer_read_int(buf1, &val1)) goto error;
+                     if (!buffer_read_byte(buf2, &type2)) goto error;
+                     switch (type2 & 0x0F) {
+                        case SER_ZERO:
+                           if (val1 < 0) return -1;
+                           if (val1 > 0) return +1;
+                           continue;
+
+                        case SER_BYTE: {
+                           uint8_t val2;
+                           if (!buffer_read_byte(buf2, &val2)) goto error;
+                           if (val1 != val2) {
+                              return val1 < val2? -1 : +1;
+                           }
+                           continue;
+                        }
+
+                        case SER_SHORT: {
+                           uint16_t val2;
+                           if (!buffer_read_short(buf2, &val2)) goto error;
+                           if (val1 != val2) {
+                              return val1 < val2? -1 : +1;
+                           }
+                           continue;
+                        }
+
+                        case SER_INT: {
+                           int val2;
+                           if (!buffer_read_int(buf2, &val2)) goto error;
+                           if (val1 != val2) {
+                              return val1 < val2? -1 : +1;
+                           }
+                           continue;
+                        }
+
+                        case SER_FLOAT:
+                        case SER_FLOAT_ZERO:
+                        case SER_ARRAY:
+                        case SER_ARRAY_BYTE:
+                        case SER_ARRAY_SHORT:
+                        case SER_ARRAY_INT:
+                        case SER_STRING_BYTE:
+                        case SER_STRING_SHORT:
+                        case SER_STRING_INT:
+                        case SER_HASH:
+                           return -1;
+                     }
+                     goto error;
+                  }
+                  if (len1 == len2) {
+                     continue;
+                  }
+                  return len1 - len2;
+               }
+
+               case SER_ARRAY_BYTE: {
+                  int val1;
+                  uint8_t val2;
+                  int i, len1, len2, len;
+
+                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
+                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
+                  len = len1 < len2? len1 : len2;
+
+                  for (i=0; i<len; i++) {
+                     if (!buffer_read_int(buf1, &val1)) goto error;
+                     if (!buffer_read_byte(buf2, &val2)) goto error;
+                     if (val1 != val2) {
+                        return val1 < val2? -1 : +1;
+                     }
+                  }
+                  if (len1 == len2) {
+                     continue;
+                  }
+                  return len1 - len2;
+               }
+
+               case SER_ARRAY_SHORT: {
+                  int val1;
+                  uint16_t val2;
+                  int i, len1, len2, len;
+
+                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
+                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
+                  len = len1 < len2? len1 : len2;
+
+                  for (i=0; i<len; i++) {
+                     if (!buffer_read_int(buf1, &val1)) goto error;
+                     if (!buffer_read_short(buf2, &val2)) goto error;
+                     if (val1 != val2) {
+                        return val1 < val2? -1 : +1;
+                     }
+                  }
+                  if (len1 == len2) {
+                     continue;
+                  }
+                  return len1 - len2;
+               }
+
+               case SER_ARRAY_INT: {
+                  int val1;
+                  int val2;
+                  int i, len1, len2, len;
+
+                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
+                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
+                  len = len1 < len2? len1 : len2;
+
+                  for (i=0; i<len; i++) {
+                     if (!buffer_read_int(buf1, &val1)) goto error;
+                     if (!buffer_read_int(buf2, &val2)) goto error;
+                     if (val1 != val2) {
+                        return val1 < val2? -1 : +1;
+                     }
+                  }
+                  if (len1 == len2) {
+                     continue;
+                  }
+                  return len1 - len2;
+               }
+
+               case SER_STRING_BYTE:
+               case SER_STRING_SHORT:
+               case SER_STRING_INT:
+               case SER_HASH:
+                  return -1;
+            }
+            goto error;
+
+         case SER_STRING_BYTE:
+            switch (type2 & 0x0F) {
+               case SER_ZERO:
+               case SER_BYTE:
+               case SER_SHORT:
+               case SER_INT:
+               case SER_FLOAT:
+               case SER_FLOAT_ZERO:
+               case SER_ARRAY:
+               case SER_ARRAY_BYTE:
+               case SER_ARRAY_SHORT:
+               case SER_ARRAY_INT:
+                  return +1;
+
+               case SER_STRING_BYTE: {
+                  uint8_t val1, val2;
+                  int i, len1, len2, len;
+
+                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
+                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
+                  len = len1 < len2? len1 : len2;
+
+                  for (i=0; i<len; i++) {
+                     if (!buffer_read_byte(buf1, &val1)) goto error;
+                     if (!buffer_read_byte(buf2, &val2)) goto error;
+                     if (val1 != val2) {
+                        return (int)val1 - (int)val2;
+                     }
+                  }
+                  if (len1 == len2) {
+                     continue;
+                  }
+                  return len1 - len2;
+               }
+
+               case SER_STRING_SHORT: {
+                  uint8_t val1;
+                  uint16_t val2;
+                  int i, len1, len2, len;
+
+                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
+                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
+                  len = len1 < len2? len1 : len2;
+
+                  for (i=0; i<len; i++) {
+                     if (!buffer_read_byte(buf1, &val1)) goto error;
+                     if (!buffer_read_short(buf2, &val2)) goto error;
+                     if (val1 != val2) {
+                        return (int)val1 - (int)val2;
+                     }
+                  }
+                  if (len1 == len2) {
+                     continue;
+                  }
+                  return len1 - len2;
+               }
+
+               case SER_STRING_INT: {
+                  uint8_t val1;
+                  int val2;
+                  int i, len1, len2, len;
+
+                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
+                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
+                  len = len1 < len2? len1 : len2;
+
+                  for (i=0; i<len; i++) {
+                     if (!buffer_read_byte(buf1, &val1)) goto error;
+                     if (!buffer_read_int(buf2, &val2)) goto error;
+                     if (val1 != val2) {
+                        return val1 < val2? -1 : +1;
+                     }
+                  }
+                  if (len1 == len2) {
+                     continue;
+                  }
+                  return len1 - len2;
+               }
+
+               case SER_HASH:
+                  return -1;
+            }
+            goto error;
+
+         case SER_STRING_SHORT:
+            switch (type2 & 0x0F) {
+               case SER_ZERO:
+               case SER_BYTE:
+               case SER_SHORT:
+               case SER_INT:
+               case SER_FLOAT:
+               case SER_FLOAT_ZERO:
+               case SER_ARRAY:
+               case SER_ARRAY_BYTE:
+               case SER_ARRAY_SHORT:
+               case SER_ARRAY_INT:
+                  return +1;
+
+               case SER_STRING_BYTE: {
+                  uint16_t val1;
+                  uint8_t val2;
+                  int i, len1, len2, len;
+
+                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
+                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
+                  len = len1 < len2? len1 : len2;
+
+                  for (i=0; i<len; i++) {
+                     if (!buffer_read_short(buf1, &val1)) goto error;
+                     if (!buffer_read_byte(buf2, &val2)) goto error;
+                     if (val1 != val2) {
+                        return (int)val1 - (int)val2;
+                     }
+                  }
+                  if (len1 == len2) {
+                     continue;
+                  }
+                  return len1 - len2;
+               }
+
+               case SER_STRING_SHORT: {
+                  uint16_t val1, val2;
+                  int i, len1, len2, len;
+
+                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
+                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
+                  len = len1 < len2? len1 : len2;
+
+                  for (i=0; i<len; i++) {
+                     if (!buffer_read_short(buf1, &val1)) goto error;
+                     if (!buffer_read_short(buf2, &val2)) goto error;
+                     if (val1 != val2) {
+                        return (int)val1 - (int)val2;
+                     }
+                  }
+                  if (len1 == len2) {
+                     continue;
+                  }
+                  return len1 - len2;
+               }
+
+               case SER_STRING_INT: {
+                  uint16_t val1;
+                  int val2;
+                  int i, len1, len2, len;
+
+                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
+                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
+                  len = len1 < len2? len1 : len2;
+
+                  for (i=0; i<len; i++) {
+                     if (!buffer_read_short(buf1, &val1)) goto error;
+                     if (!buffer_read_int(buf2, &val2)) goto error;
+                     if (val1 != val2) {
+                        return val1 < val2? -1 : +1;
+                     }
+                  }
+                  if (len1 == len2) {
+                     continue;
+                  }
+                  return len1 - len2;
+               }
+
+               case SER_HASH:
+                  return -1;
+            }
+            goto error;
+
+         case SER_STRING_INT:
+            switch (type2 & 0x0F) {
+               case SER_ZERO:
+               case SER_BYTE:
+               case SER_SHORT:
+               case SER_INT:
+               case SER_FLOAT:
+               case SER_FLOAT_ZERO:
+               case SER_ARRAY:
+               case SER_ARRAY_BYTE:
+               case SER_ARRAY_SHORT:
+               case SER_ARRAY_INT:
+                  return +1;
+
+               case SER_STRING_BYTE: {
+                  int val1;
+                  uint8_t val2;
+                  int i, len1, len2, len;
+
+                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
+                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
+                  len = len1 < len2? len1 : len2;
+
+                  for (i=0; i<len; i++) {
+                     if (!buffer_read_int(buf1, &val1)) goto error;
+                     if (!buffer_read_byte(buf2, &val2)) goto error;
+                     if (val1 != val2) {
+                        return val1 < val2? -1 : +1;
+                     }
+                  }
+                  if (len1 == len2) {
+                     continue;
+                  }
+                  return len1 - len2;
+               }
+
+               case SER_STRING_SHORT: {
+                  int val1;
+                  uint16_t val2;
+                  int i, len1, len2, len;
+
+                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
+                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
+                  len = len1 < len2? len1 : len2;
+
+                  for (i=0; i<len; i++) {
+                     if (!buffer_read_int(buf1, &val1)) goto error;
+                     if (!buffer_read_short(buf2, &val2)) goto error;
+                     if (val1 != val2) {
+                        return val1 < val2? -1 : +1;
+                     }
+                  }
+                  if (len1 == len2) {
+                     continue;
+                  }
+                  return len1 - len2;
+               }
+
+               case SER_STRING_INT: {
+                  int val1, val2;
+                  int i, len1, len2, len;
+
+                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
+                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
+                  len = len1 < len2? len1 : len2;
+
+                  for (i=0; i<len; i++) {
+                     if (!buffer_read_int(buf1, &val1)) goto error;
+                     if (!buffer_read_int(buf2, &val2)) goto error;
+                     if (val1 != val2) {
+                        return val1 < val2? -1 : +1;
+                     }
+                  }
+                  if (len1 == len2) {
+                     continue;
+                  }
+                  return len1 - len2;
+               }
+
+               case SER_HASH:
+                  return -1;
+            }
+            goto error;
+
+         case SER_HASH:
+            switch (type2 & 0x0F) {
+               case SER_ZERO:
+               case SER_BYTE:
+               case SER_SHORT:
+               case SER_INT:
+               case SER_FLOAT:
+               case SER_FLOAT_ZERO:
+               case SER_ARRAY:
+               case SER_ARRAY_BYTE:
+               case SER_ARRAY_SHORT:
+               case SER_ARRAY_INT:
+               case SER_STRING_BYTE:
+               case SER_STRING_SHORT:
+               case SER_STRING_INT:
+                  return +1;
+
+               case SER_HASH: {
+                  int len1, len2, len, ret;
+
+                  if (!buffer_read_length(buf1, type1, &len1)) goto error;
+                  if (!buffer_read_length(buf2, type2, &len2)) goto error;
+                  len = len1 < len2? len1 : len2;
+                  if (len >= ((1<<30)-1)) goto error;
+
+                  ret = compare_serialized_values(buf1, buf2, len*2);
+                  if (ret != 0) return ret;
+                  if (len1 == len2) {
+                     continue;
+                  }
+                  return len1 - len2;
+               }
+            }
+            goto error;
+
+         default:
+            goto error;
+      }
+   }
+   return 0;
+
+error:
+   return 0x80000000;
+}
+
+
+static int compare_sorted_entries(const void *e1, const void *e2)
+{
+   const SortedEntry *entry1 = (void *)e1;
+   const SortedEntry *entry2 = (void *)e2;
+   Buffer buf1, buf2;
+
+   buf1.cur = entry1->key;
+   buf1.end = entry1->key + entry1->key_len;
+   buf2.cur = entry2->key;
+   buf2.end = entry2->key + entry2->key_len;
+   return compare_serialized_values(&buf1, &buf2, 1);
+}
+
+
+static int serialize_key(Heap *heap, Value value, Buffer *buf, int recursion_limit);
+
+static int serialize_subkey(Heap *heap, Value value, char **out_data, int *out_len, int recursion_limit)
+{
+   Buffer buf;
+   int err;
+
+   buf.start = malloc(8);
+   if (!buf.start) {
+      return FIXSCRIPT_ERR_OUT_OF_MEMORY;
+   }
+   buf.cur = buf.start;
+   buf.end = buf.start + 8;
+
+   err = serialize_key(heap, value, &buf, recursion_limit);
+   if (err) {
+      free(buf.start);
+      return err;
+   }
+
+   *out_data = buf.start;
+   *out_len = buf.cur - buf.start;
+   return FIXSCRIPT_SUCCESS;
+}
+
+
+static int serialize_key(Heap *heap, Value value, Buffer *buf, int recursion_limit)
+{
+   Value key, elem;
+   SortedEntry *entries;
+   int i, err, val, max_val, has_refs, len, elem_size, is_string, pos;
+   void *data;
+
+   if (recursion_limit <= 0) {
+      return FIXSCRIPT_ERR_RECURSION_LIMIT;
+   }
+
+   if (fixscript_is_int(value)) {
+      if (value.value == 0) {
+         if (!buffer_append_byte(buf, SER_ZERO)) goto error;
+         return FIXSCRIPT_SUCCESS;
+      }
+      if ((value.value & ~0xFF) == 0) {
+         if (!buffer_append_byte(buf, SER_BYTE)) goto error;
+         if (!buffer_append_byte(buf, value.value)) goto error;
+         return FIXSCRIPT_SUCCESS;
+      }
+      if ((value.value & ~0xFFFF) == 0) {
+         if (!buffer_append_byte(buf, SER_SHORT)) goto error;
+         if (!buffer_append_short(buf, value.value)) goto error;
+         return FIXSCRIPT_SUCCESS;
+      }
+      if (!buffer_append_byte(buf, SER_INT)) goto error;
+      if (!buffer_append_int(buf, value.value)) goto error;
+      return FIXSCRIPT_SUCCESS;
+   }
+
+   if (fixscript_is_float(value)) {
+      if (value.value == 0) {
+         if (!buffer_append_byte(buf, SER_FLOAT_ZERO)) goto error;
+         return FIXSCRIPT_SUCCESS;
+      }
+      // normalize NaNs:
+      val = value.value;
+      if (((val >> 23) & 0xFF) == 0xFF && (val & ((1<<23)-1))) {
+         val = (val & ~((1<<23)-1)) | (1 << 22);
+      }
+      if (!buffer_append_byte(buf, SER_FLOAT)) goto error;
+      if (!buffer_append_int(buf, val)) goto error;
+      return FIXSCRIPT_SUCCESS;
+   }
+
+   if (fixscript_is_array(heap, value)) {
+      is_string = fixscript_is_string(heap, value);
+
+      err = fixscript_get_array_length(heap, value, &len);
+      if (err) return err;
+      err = fixscript_has_array_references(heap, value, 0, len, 1, &has_refs);
+      if (err) return err;
+
+      if (has_refs) {
+         if (is_string) {
+            return FIXSCRIPT_ERR_UNSERIALIZABLE_REF;
+         }
+
+         if (!buffer_append_length(buf, SER_ARRAY, len)) goto error;
+         for (i=0; i<len; i++) {
+            err = fixscript_get_array_elem(heap, value, i, &elem);
+            if (err) return err;
+            err = serialize_key(heap, elem, buf, recursion_limit-1);
+            if (err) return err;
+         }
+         return FIXSCRIPT_SUCCESS;
+      }
+
+      err = fixscript_get_array_element_size(heap, value, &elem_size);
+      if (err) return err;
+      err = fixscript_lock_array(heap, value, 0, len, &data, elem_size, ACCESS_READ_ONLY);
+      if (err) return err;
+
+      if (elem_size == 1) {
+         if (!buffer_append_length(buf, is_string? SER_STRING_BYTE : SER_ARRAY_BYTE, len)) goto array_memory_error;
+         while (buf->end - buf->cur < len) {
+            if (!buffer_expand(buf)) goto array_memory_error;
+         }
+         memcpy(buf->cur, data, len);
+         buf->cur += len;
+      }
+      else if (elem_size == 2) {
+         max_val = 0;
+         for (i=0; i<len; i++) {
+            max_val |= ((uint16_t *)data)[i];
+         }
+         if ((max_val & ~0xFF) == 0) {
+            if (!buffer_append_length(buf, is_string? SER_STRING_BYTE : SER_ARRAY_BYTE, len)) goto array_memory_error;
+            while (buf->end - buf->cur < len) {
+               if (!buffer_expand(buf)) goto array_memory_error;
+            }
+            for (i=0; i<len; i++) {
+               *buf->cur++ = ((uint16_t *)data)[i];
+            }
+         }
+         else {
+            if (!buffer_append_length(buf, is_string? SER_STRING_SHORT : SER_ARRAY_SHORT, len)) goto array_memory_error;
+            if (len >= ((1<<30)-1)) goto array_memory_error;
+            while (buf->end - buf->cur < len*2) {
+               if (!buffer_expand(buf)) goto array_memory_error;
+            }
+            for (i=0; i<len; i++) {
+               val = ((uint16_t *)data)[i];
+               *buf->cur++ = val & 0xFF;
+               *buf->cur++ = val >> 8;
+            }
+         }
+      }
+      else {
+         max_val = 0;
+         for (i=0; i<len; i++) {
+            max_val |= ((uint32_t *)data)[i];
+         }
+         if ((max_val & ~0xFF) == 0) {
+            if (!buffer_append_length(buf, is_string? SER_STRING_BYTE : SER_ARRAY_BYTE, len)) goto array_memory_error;
+            while (buf->end - buf->cur < len) {
+               if (!buffer_expand(buf)) goto array_memory_error;
+            }
+            for (i=0; i<len; i++) {
+               *buf->cur++ = ((uint32_t *)data)[i];
+            }
+         }
+         else if ((max_val & ~0xFFFF) == 0) {
+            if (!buffer_append_length(buf, is_string? SER_STRING_SHORT : SER_ARRAY_SHORT, len)) goto array_memory_error;
+            if (len >= ((1<<30)-1)) goto array_memory_error;
+            while (buf->end - buf->cur < len*2) {
+               if (!buffer_expand(buf)) goto array_memory_error;
+            }
+            for (i=0; i<len; i++) {
+               val = ((uint32_t *)data)[i];
+               *buf->cur++ = val & 0xFF;
+               *buf->cur++ = val >> 8;
+            }
+         }
+         else {
+            if (!buffer_append_length(buf, is_string? SER_STRING_INT : SER_ARRAY_INT, len)) goto array_memory_error;
+            if (len >= ((1<<29)-1)) goto array_memory_error;
+            while (buf->end - buf->cur < len*4) {
+               if (!buffer_expand(buf)) goto array_memory_error;
+            }
+            for (i=0; i<len; i++) {
+               val = ((uint32_t *)data)[i];
+               *buf->cur++ = val & 0xFF;
+               *buf->cur++ = (val >> 8) & 0xFF;
+               *buf->cur++ = (val >> 16) & 0xFF;
+               *buf->cur++ = (val >> 24) & 0xFF;
+            }
+         }
+      }
+
+array_error:
+      fixscript_unlock_array(heap, value, 0, len, &data, elem_size, ACCESS_READ_ONLY);
+      return err;
+
+array_memory_error:
+      err = FIXSCRIPT_ERR_OUT_OF_MEMORY;
+      goto array_error;
+   }
+
+   if (fixscript_is_hash(heap, value)) {
+      err = fixscript_get_array_length(heap, value, &len);
+      if (err) return err;
+
+      if (!buffer_append_length(buf, SER_HASH, len)) goto error;
+
+      entries = calloc(len, sizeof(SortedEntry));
+      if (!entries) goto error;
+
+      i = 0;
+      pos = 0;
+      while (fixscript_iter_hash(heap, value, &key, &elem, &pos)) {
+         err = serialize_subkey(heap, key, &entries[i].key, &entries[i].key_len, recursion_limit-1);
+         if (err) goto hash_error;
+         err = serialize_subkey(heap, elem, &entries[i].value, &entries[i].value_len, recursion_limit-1);
+         if (err) goto hash_error;
+         i++;
+      }
+
+      qsort(entries, len, sizeof(SortedEntry), compare_sorted_entries);
+
+      for (i=0; i<len; i++) {
+         while (buf->end - buf->cur < entries[i].key_len + entries[i].value_len) {
+            if (!buffer_expand(buf)) goto hash_memory_error;
+         }
+         memcpy(buf->cur, entries[i].key, entries[i].key_len);
+         buf->cur += entries[i].key_len;
+         memcpy(buf->cur, entries[i].value, entries[i].value_len);
+         buf->cur += entries[i].value_len;
+      }
+
+hash_error:
+      for (i=0; i<len; i++) {
+         free(entries[i].key);
+         free(entries[i].value);
+      }
+      free(entries);
+      return err;
+
+hash_memory_error:
+      err = FIXSCRIPT_ERR_OUT_OF_MEMORY;
+      goto hash_error;
+   }
+
+   return FIXSCRIPT_ERR_UNSERIALIZABLE_REF;
+
+error:
+   return FIXSCRIPT_ERR_OUT_OF_MEMORY;
+}
+
+
+static Value native_serialize_key(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+   Buffer buf;
+   Value ret = fixscript_int(0);
+   int64_t new_len;
+   int err, len;
+
+   buf.start = malloc(64);
+   if (!buf.start) {
+      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+   }
+   buf.cur = buf.start;
+   buf.end = buf.start + 64;
+
+   err = serialize_key(heap, params[num_params-1], &buf, 50);
+   if (err) {
+      fixscript_error(heap, error, err);
+      goto error;
+   }
+
+   if (num_params == 2) {
+      err = fixscript_get_array_length(heap, params[0], &len);
+      if (!err) {
+         new_len = (int64_t)len + (int64_t)(buf.cur - buf.start);
+         if (new_len > INT_MAX) err = FIXSCRIPT_ERR_OUT_OF_MEMORY;
+      }
+      if (!err) {
+         err = fixscript_set_array_length(heap, params[0], (int)new_len);
+      }
+      if (!err) {
+         err = fixscript_set_array_bytes(heap, params[0], len, buf.cur - buf.start, buf.start);
+      }
+      if (err) {
+         fixscript_error(heap, error, err);
+         goto error;
+      }
+   }
+   else {
+      ret = fixscript_create_byte_array(heap, buf.start, buf.cur - buf.start);
+      if (!ret.value) {
+         fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+         goto error;
+      }
+   }
+
+error:
+   free(buf.start);
+   return ret;
+}
+
+
+static Value native_serialize_compare(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+   Value arr1, arr2;
+   Buffer buf1, buf2;
+   char *data1 = NULL, *data2 = NULL;
+   int err, off1, len1, off2, len2, ret=0;
+
+   if (num_params == 6) {
+      arr1 = params[0];
+      off1 = params[1].value;
+      len1 = params[2].value;
+      arr2 = params[3];
+      off2 = params[4].value;
+      len2 = params[5].value;
+   }
+   else {
+      arr1 = params[0];
+      arr2 = params[1];
+      off1 = 0;
+      off2 = 0;
+      err = fixscript_get_array_length(heap, arr1, &len1);
+      if (!err) {
+         err = fixscript_get_array_length(heap, arr2, &len2);
+      }
+      if (err) {
+         return fixscript_error(heap, error, err);
+      }
+   }
+
+   err = fixscript_lock_array(heap, arr1, off1, len1, (void **)&data1, 1, ACCESS_READ_ONLY);
+   if (!err) {
+      err = fixscript_lock_array(heap, arr2, off2, len2, (void **)&data2, 1, ACCESS_READ_ONLY);
+   }
+   if (err) {
+      fixscript_error(heap, error, err);
+      goto error;
+   }
+
+   buf1.cur = data1;
+   buf1.end = data1 + len1;
+   buf2.cur = data2;
+   buf2.end = data2 + len2;
+   ret = compare_serialized_values(&buf1, &buf2, 1);
+   if (ret == 0x80000000) {
+      ret = 0;
+      fixscript_error(heap, error, FIXSCRIPT_ERR_BAD_FORMAT);
+      goto error;
+   }
+   if (ret < 0) ret = -1;
+   if (ret > 0) ret = +1;
+
+error:
+   if (data1) {
+      fixscript_unlock_array(heap, arr1, off1, len1, (void **)&data1, 1, ACCESS_READ_ONLY);
+   }
+   if (data2) {
+      fixscript_unlock_array(heap, arr2, off2, len2, (void **)&data2, 1, ACCESS_READ_ONLY);
+   }
+   return fixscript_int(ret);
+}
+
+
+#ifndef _WIN32
+typedef struct {
+   char buf[8];
+   int cnt;
+#ifndef __wasm__
+   mbstate_t mbstate;
+#endif
+} NativeConvertState;
+
+static void convert_from_native(wchar_t *dest, int dest_len, char *src, int src_len, NativeConvertState *state, int *processed_dest, int *processed_src)
+{
+#ifndef __wasm__
+   mbstate_t mbstate_sav;
+#endif
+   wchar_t *orig_dest = dest;
+   char *orig_src = src;
+   unsigned int c;
+   unsigned char c2, c3, c4;
+   int parsed;
+
+   for (;;) {
+      while (src_len > 0 && state->cnt < sizeof(state->buf)) {
+         state->buf[state->cnt++] = *src++;
+         src_len--;
+      }
+      if (state->cnt <= 0 || dest_len <= 0) break;
+
+      if (state->buf[0] == 0) {
+         *dest++ = 0;
+         dest_len--;
+         memmove(state->buf, state->buf+1, --state->cnt);
+         continue;
+      }
+
+      if (native_charset_utf8) {
+         c = (unsigned char)state->buf[0];
+         if ((c & 0x80) == 0) {
+            parsed = 1;
+         }
+         else if ((c & 0xE0) == 0xC0) {
+            if (state->cnt < 2) break;
+            c2 = state->buf[1];
+            c = ((c & 0x1F) << 6) | (c2 & 0x3F);
+            if (c < 0x80) {
+               c = 0xFFFD;
+            }
+            parsed = 2;
+         }
+         else if ((c & 0xF0) == 0xE0) {
+            if (state->cnt < 3) break;
+            c2 = state->buf[1];
+            c3 = state->buf[2];
+            c = ((c & 0x0F) << 12) | ((c2 & 0x3F) << 6) | (c3 & 0x3F);
+            if (c < 0x800) {
+               c = 0xFFFD;
+            }
+            parsed = 3;
+         }
+         else if ((c & 0xF8) == 0xF0) {
+            if (state->cnt < 4) break;
+            c2 = state->buf[1];
+            c3 = state->buf[2];
+            c4 = state->buf[3];
+            c = ((c & 0x07) << 18) | ((c2 & 0x3F) << 12) | ((c3 & 0x3F) << 6) | (c4 & 0x3F);
+            if (c < 0x10000 || c > 0x10FFFF) {
+               c = 0xFFFD;
+            }
+            parsed = 4;
+         }
+         else {
+            c = 0xFFFD;
+            parsed = 1;
+         }
+
+         if (c >= 0xD800 && c <= 0xDFFF) {
+            c = 0xFFFD;
+         }
+
+         #if WCHAR_MAX > 0xFFFF
+            *dest = c;
+         #elif WCHAR_MAX > 0xFF
+            if (c > 0xFFFF) {
+               c = 0xFFFD;
+            }
+            *dest = c;
+         #else
+            if (c > 0xFF) {
+               c = '?';
+            }
+            *dest = c;
+         #endif
+      }
+#ifndef __wasm__
+      else {
+         memcpy(&mbstate_sav, &state->mbstate, sizeof(mbstate_t));
+         parsed = (int)mbrtowc(dest, state->buf, state->cnt, &state->mbstate);
+         if (parsed == -2) {
+            memcpy(&state->mbstate, &mbstate_sav, sizeof(mbstate_t));
+            break;
+         }
+         if (parsed < 0) {
+            memcpy(&state->mbstate, &mbstate_sav, sizeof(mbstate_t));
+            #if WCHAR_MAX > 0xFF
+               *dest++ = 0xFFFD;
+            #else
+               *dest++ = '?';
+            #endif
+            dest_len--;
+            memmove(state->buf, state->buf+1, --state->cnt);
+            continue;
+         }
+      }
+#endif
+
+      dest++;
+      dest_len--;
+      state->cnt -= parsed;
+      memmove(state->buf, state->buf+parsed, state->cnt);
+   }
+
+   *processed_dest = dest - orig_dest;
+   *processed_src = src - orig_src;
+}
+
+static void convert_to_native(char *dest, int dest_len, wchar_t *src, int src_len, NativeConvertState *state, int *processed_dest, int *processed_src)
+{
+#ifndef __wasm__
+   mbstate_t mbstate_sav;
+#endif
+   char *orig_dest = dest;
+   wchar_t *orig_src = src;
+   int len, c;
+
+   for (;;) {
+      if (state->cnt == 0) {
+         if (src_len <= 0) break;
+         
+         if (native_charset_utf8) {
+            #if WCHAR_MAX > 0xFFFF
+               c = *src++;
+            #elif WCHAR_MAX > 0xFF
+               c = (uint16_t)*src++;
+            #else
+               c = (uint8_t)*src++;
+            #endif
+            src_len--;
+            if (c < 0 || c > 0x10FFFF) {
+               c = 0xFFFD;
+            }
+            if (c >= 0xD800 && c <= 0xDFFF) {
+               c = 0xFFFD;
+            }
+            if (c >= 0x10000) {
+               state->buf[0] = (c >> 18) | 0xF0;
+               state->buf[1] = ((c >> 12) & 0x3F) | 0x80;
+               state->buf[2] = ((c >> 6) & 0x3F) | 0x80;
+               state->buf[3] = (c & 0x3F) | 0x80;
+               state->cnt = 4;
+            }
+            else if (c >= 0x800) {
+               state->buf[0] = (c >> 12) | 0xE0;
+               state->buf[1] = ((c >> 6) & 0x3F) | 0x80;
+               state->buf[2] = (c & 0x3F) | 0x80;
+               state->cnt = 3;
+            }
+            else if (c >= 0x80) {
+               state->buf[0] = (c >> 6) | 0xC0;
+               state->buf[1] = (c & 0x3F) | 0x80;
+               state->cnt = 2;
+            }
+            else {
+               state->buf[0] = c;
+               state->cnt = 1;
+            }
+         }
+#ifndef __wasm__
+         else if (*src == 0) {
+            src++;
+            src_len--;
+            state->buf[0] = 0;
+            state->cnt = 1;
+         }
+         else {
+            memcpy(&mbstate_sav, &state->mbstate, sizeof(mbstate_t));
+            len = (int)wcrtomb(state->buf, *src, &state->mbstate);
+            if (len <= 0) {
+               memcpy(&state->mbstate, &mbstate_sav, sizeof(mbstate_t));
+               src++;
+               src_len--;
+               state->buf[0] = '?';
+               state->cnt = 1;
+            }
+            else {
+               src++;
+               src_len--;
+               state->cnt = len;
+            }
+         }
+#endif
+      }
+
+      if (dest_len <= 0) break;
+
+      len = state->cnt;
+      if (len > dest_len) {
+         len = dest_len;
+      }
+      memcpy(dest, state->buf, len);
+      dest += len;
+      dest_len -= len;
+      state->cnt -= len;
+      memmove(state->buf, state->buf + len, state->cnt);
+   }
+
+   *processed_dest = dest - orig_dest;
+   *processed_src = src - orig_src;
+}
+#endif
+
+
+static Value native_string_from_native(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+   Value arr, off, len, result;
+   char *bytes;
+#ifdef _WIN32
+   Value str;
+   unsigned short *chars;
+   int64_t len64;
+   int chars_len, result_len, real_chars_len;
+#else
+   NativeConvertState state;
+   wchar_t chars[128];
+   Value values[128];
+   int processed_dest, processed_src;
+   int i, j, result_len=0;
+#if !defined(__HAIKU__)
+   locale_t prev_locale = (locale_t)0;
+#endif
+#endif
+   int err;
+
+   if (num_params == 2 || num_params == 4) {
+      result = *params++;
+   }
+   else {
+      result = fixscript_int(0);
+   }
+   arr = *params++;
+   if (num_params == 3 || num_params == 4) {
+      off = *params++;
+      len = *params++;
+
+      if (off.value < 0) {
+         *error = fixscript_create_error_string(heap, "negative offset");
+         return fixscript_int(0);
+      }
+      if (len.value < 0) {
+         *error = fixscript_create_error_string(heap, "negative length");
+         return fixscript_int(0);
+      }
+   }
+   else {
+      off.value = 0;
+      err = fixscript_get_array_length(heap, arr, &len.value);
+      if (err) {
+         return fixscript_error(heap, error, err);
+      }
+   }
+
+   if (!result.value) {
+      result = fixscript_create_string(heap, NULL, 0);
+      if (!result.value) {
+         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      }
+   }
+
+   err = fixscript_lock_array(heap, arr, off.value, len.value, (void **)&bytes, 1, ACCESS_READ_ONLY);
+   if (err) {
+      return fixscript_error(heap, error, err);
+   }
+
+#ifdef _WIN32
+   if (len.value > 0) {
+      chars_len = MultiByteToWideChar(CP_ACP, 0, bytes, len.value, NULL, 0);
+      if (chars_len <= 0) {
+         fixscript_unlock_array(heap, arr, off.value, len.value, (void **)&bytes, 1, ACCESS_READ_ONLY);
+         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      }
+
+      len64 = (int64_t)chars_len * sizeof(uint16_t);
+      if (len64 > INT_MAX) {
+         fixscript_unlock_array(heap, arr, off.value, len.value, (void **)&bytes, 1, ACCESS_READ_ONLY);
+         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      }
+
+      chars = malloc(len64);
+      if (!chars) {
+         fixscript_unlock_array(heap, arr, off.value, len.value, (void **)&bytes, 1, ACCESS_READ_ONLY);
+         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      }
+
+      if (MultiByteToWideChar(CP_ACP, 0, bytes, len.value, chars, chars_len) != chars_len) {
+         free(chars);
+         fixscript_unlock_array(heap, arr, off.value, len.value, (void **)&bytes, 1, ACCESS_READ_ONLY);
+         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      }
+
+      err = fixscript_get_array_length(heap, result, &result_len);
+      if (!err) {
+         if (result_len >= INT_MAX - chars_len) {
+            err = FIXSCRIPT_ERR_OUT_OF_MEMORY;
+         }
+      }
+      if (!err) {
+         str = fixscript_create_string_utf16(heap, chars, chars_len);
+         if (!str.value) {
+            err = FIXSCRIPT_ERR_OUT_OF_MEMORY;
+         }
+      }
+      if (!err) {
+         err = fixscript_get_array_length(heap, str, &real_chars_len);
+      }
+      if (!err) {
+         err = fixscript_set_array_length(heap, result, result_len + real_chars_len);
+      }
+      if (!err) {
+         err = fixscript_copy_array(heap, result, result_len, str, 0, real_chars_len);
+      }
+      if (err) {
+         free(chars);
+         fixscript_unlock_array(heap, arr, off.value, len.value, (void **)&bytes, 1, ACCESS_READ_ONLY);
+         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      }
+
+      free(chars);
+   }
+#else
+   #if !defined(__HAIKU__)
+      if (!native_charset_utf8) {
+         prev_locale = uselocale(cur_locale);
+      }
+   #endif
+   memset(&state, 0, sizeof(NativeConvertState));
+
+   i = 0;
+   for (;;) {
+      convert_from_native(chars, sizeof(chars)/sizeof(wchar_t), bytes + i, len.value - i, &state, &processed_dest, &processed_src);
+      if (processed_dest == 0) {
+         if (state.cnt > 0) {
+            state.cnt = 0;
+            chars[0] = 0xFFFD;
+            processed_dest = 1;
+         }
+         else break;
+      }
+
+      if (result_len >= INT_MAX - processed_dest) {
+         err = FIXSCRIPT_ERR_OUT_OF_MEMORY;
+      }
+      if (!err) {
+         err = fixscript_set_array_length(heap, result, result_len + processed_dest);
+      }
+      if (!err) {
+         for (j=0; j<processed_dest; j++) {
+            #if WCHAR_MAX > 0xFFFF
+               values[j] = fixscript_int(chars[j]);
+            #elif WCHAR_MAX > 0xFF
+               values[j] = fixscript_int((uint16_t)chars[j]);
+            #else
+               values[j] = fixscript_int((uint8_t)chars[j]);
+            #endif
+         }
+         err = fixscript_set_array_range(heap, result, result_len, processed_dest, values);
+         result_len += processed_dest;
+      }
+      if (err) {
+         #if !defined(__HAIKU__)
+            if (!native_charset_utf8) {
+               uselocale(prev_locale);
+            }
+         #endif
+         fixscript_unlock_array(heap, arr, off.value, len.value, (void **)&bytes, 1, ACCESS_READ_ONLY);
+         return fixscript_error(heap, error, err);
+      }
+      i += processed_src;
+   }
+
+   #if !defined(__HAIKU__)
+      if (!native_charset_utf8) {
+         uselocale(prev_locale);
+      }
+   #endif
+#endif
+
+   fixscript_unlock_array(heap, arr, off.value, len.value, (void **)&bytes, 1, ACCESS_READ_ONLY);
+   return result;
+}
+
+
+static Value native_string_to_native(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+   Value str, off, len, result;
+#ifdef _WIN32
+   unsigned short *chars;
+   char *bytes;
+   int chars_len, bytes_len, result_len;
+#else
+   NativeConvertState state;
+   wchar_t chars[128];
+   char bytes[128*4];
+   int chars_cap = sizeof(chars) / sizeof(wchar_t) - 1;
+   int processed_dest, processed_src;
+   int i, j, elem_size, cnt, result_len=0, ch;
+   union {
+      uint8_t *u8;
+      uint16_t *u16;
+      int32_t *s32;
+   } u;
+#if !defined(__HAIKU__)
+   locale_t prev_locale = (locale_t)0;
+#endif
+#endif
+   int err;
+
+   if (num_params == 2 || num_params == 4) {
+      result = *params++;
+   }
+   else {
+      result = fixscript_int(0);
+   }
+   str = *params++;
+   if (num_params == 3 || num_params == 4) {
+      off = *params++;
+      len = *params++;
+
+      if (off.value < 0) {
+         *error = fixscript_create_error_string(heap, "negative offset");
+         return fixscript_int(0);
+      }
+      if (len.value < 0) {
+         *error = fixscript_create_error_string(heap, "negative length");
+         return fixscript_int(0);
+      }
+   }
+   else {
+      off.value = 0;
+      err = fixscript_get_array_length(heap, str, &len.value);
+      if (err) {
+         return fixscript_error(heap, error, err);
+      }
+   }
+
+   if (!result.value) {
+      result = fixscript_create_array(heap, 0);
+      if (!result.value) {
+         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      }
+   }
+
+#ifdef _WIN32
+   err = fixscript_get_string_utf16(heap, str, off.value, len.value, &chars, &chars_len);
+   if (err) {
+      return fixscript_error(heap, error, err);
+   }
+
+   if (chars_len > 0) {
+      bytes_len = WideCharToMultiByte(CP_ACP, 0, chars, chars_len, NULL, 0, NULL, NULL);
+      if (bytes_len <= 0) {
+         free(chars);
+         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      }
+
+      bytes = malloc(bytes_len);
+      if (!bytes) {
+         free(chars);
+         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      }
+
+      if (WideCharToMultiByte(CP_ACP, 0, chars, chars_len, bytes, bytes_len, NULL, NULL) != bytes_len) {
+         free(chars);
+         free(bytes);
+         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      }
+
+      err = fixscript_get_array_length(heap, result, &result_len);
+      if (!err) {
+         if (result_len >= INT_MAX - bytes_len) {
+            err = FIXSCRIPT_ERR_OUT_OF_MEMORY;
+         }
+      }
+      if (!err) {
+         err = fixscript_set_array_length(heap, result, result_len + bytes_len);
+      }
+      if (!err) {
+         err = fixscript_set_array_bytes(heap, result, result_len, bytes_len, bytes);
+      }
+      if (err) {
+         free(chars);
+         free(bytes);
+         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      }
+
+      free(bytes);
+   }
+
+   free(chars);
+#else
+   err = fixscript_get_array_element_size(heap, str, &elem_size);
+   if (!err) {
+      err = fixscript_lock_array(heap, str, off.value, len.value, (void **)&u.u8, elem_size, ACCESS_READ_ONLY);
+   }
+   if (err) {
+      return fixscript_error(heap, error, err);
+   }
+
+   #if !defined(__HAIKU__)
+      if (!native_charset_utf8) {
+         prev_locale = uselocale(cur_locale);
+      }
+   #endif
+   memset(&state, 0, sizeof(NativeConvertState));
+
+   i = 0;
+   while (i < len.value) {
+      cnt = len.value - i;
+      if (cnt > chars_cap) {
+         cnt = chars_cap;
+      }
+
+      switch (elem_size) {
+         default:
+         case 1:
+            for (j=0; j<cnt; j++) {
+               chars[j] = u.u8[i++];
+            }
+            break;
+
+         case 2:
+            for (j=0; j<cnt; j++) {
+               ch = u.u16[i++];
+               #if WCHAR_MAX > 0xFF
+               if (ch >= 0xD800 && ch <= 0xDFFF) {
+                  ch = 0xFFFD;
+               }
+               #else
+               if (ch > 0xFF) {
+                  ch = '?';
+               }
+               #endif
+               chars[j] = ch;
+            }
+            break;
+
+         case 4:
+            for (j=0; j<cnt; j++) {
+               ch = u.s32[i++];
+               if ((ch >= 0xD800 && ch <= 0xDFFF) || ch < 0 || ch > 0x10FFFF) {
+                  ch = 0xFFFD;
+               }
+               #if WCHAR_MAX <= 0xFF
+               if (ch > 0xFF) {
+                  ch = '?';
+               }
+               #elif WCHAR_MAX <= 0xFFFF
+               if (ch > 0xFFFF) {
+                  ch = 0xFFFD;
+               }
+               #endif
+               chars[j] = ch;
+            }
+            break;
+      }
+
+      for (j=0; j<cnt; ) {
+         convert_to_native(bytes, sizeof(bytes)-1, chars + j, cnt - j, &state, &processed_dest, &processed_src);
+         if (processed_dest > 0) {
+            if (result_len >= INT_MAX - processed_dest) {
+               err = FIXSCRIPT_ERR_OUT_OF_MEMORY;
+            }
+            if (!err) {
+               err = fixscript_set_array_length(heap, result, result_len + processed_dest);
+            }
+            if (!err) {
+               err = fixscript_set_array_bytes(heap, result, result_len, processed_dest, bytes);
+               result_len += processed_dest;
+            }
+            if (err) {
+               #if !defined(__HAIKU__)
+                  if (!native_charset_utf8) {
+                     uselocale(prev_locale);
+                  }
+               #endif
+               fixscript_unlock_array(heap, str, off.value, len.value, (void **)&u.u8, elem_size, ACCESS_READ_ONLY);
+               return fixscript_error(heap, error, err);
+            }
+         }
+         j += processed_src;
+      }
+   }
+
+   #if !defined(__HAIKU__)
+      if (!native_charset_utf8) {
+         uselocale(prev_locale);
+      }
+   #endif
+   fixscript_unlock_array(heap, str, off.value, len.value, (void **)&u.u8, elem_size, ACCESS_READ_ONLY);
+#endif
+
+   return result;
+}
+
+
+#ifndef __wasm__
+static int clear_console_line()
+{
+   if (console_clear_line) {
+      fputc('\r', stdout);
+      fputs(console_clear_line, stdout);
+      fputc('\r', stdout);
+      free(console_clear_line);
+      console_clear_line = NULL;
+      return 1;
+   }
+   return 0;
+}
+#endif
+
+
+static Value native_console_is_present(Heap *heap, Value *error, int num_params, Value *params, void *data);
+
+static Value native_print(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+#if defined(__wasm__)
+   int mode = (intptr_t)data;
+   NativeFunc log_func;
+   void *log_data;
+
+   if (mode == PRINT_NORMAL || mode == PRINT_PROGRESS) {
+      log_func = fixscript_get_native_func(heap, "log#1", &log_data);
+      return log_func(heap, error, 1, params, log_data);
+   }
+   return fixscript_int(0);
+#else
+   int mode = (intptr_t)data;
+   Script *script;
+#ifdef _WIN32
+   HANDLE in, out;
+   DWORD console_mode, ret;
+   Value prompt_str, tmp_str, val1, val2;
+   pthread_mutex_t *mutex;
+   uint16_t *s, buf[256];
+   char *bytes;
+   int i, j, err, len, len2, bytes_len;
+#else
+   pthread_mutex_t *mutex;
+#if !defined(__HAIKU__)
+   locale_t prev_locale = (locale_t)0;
+#endif
+   NativeConvertState state;
+   char *bytes;
+   wchar_t buf[128];
+   char charbuf[128], *cp;
+   Value prompt_str;
+   int buf_cap = sizeof(buf) / sizeof(wchar_t);
+   int i, j, err, len, elem_size, cnt, processed_dest, processed_src;
+   union {
+      uint8_t *u8;
+      uint16_t *u16;
+      int32_t *s32;
+   } u;
+#endif
+
+#ifdef _WIN32
+   if (gui_app) {
+      NativeFunc log_func;
+      void *log_data;
+
+      if (mode == PRINT_NORMAL || mode == PRINT_PROGRESS) {
+         log_func = fixscript_get_native_func(heap, "log#1", &log_data);
+         return log_func(heap, error, 1, params, log_data);
+      }
+      return fixscript_int(0);
+   }
+#endif
+
+   if (mode == PRINT_PROMPT) {
+      script = fixscript_get(heap, "io/console.fix");
+      if (!script) {
+         *error = fixscript_create_error_string(heap, "script io/console must be imported");
+         return fixscript_int(0);
+      }
+
+      if (native_console_is_present(heap, error, 0, NULL, NULL).value) {
+         return fixscript_run(heap, script, "prompt#2", error, params[0], fixscript_int(0));
+      }
+   }
+
+   mutex = get_mutex(&console_mutex);
+   if (!mutex) {
+      *error = fixscript_create_error_string(heap, "can't lock console");
+      return fixscript_int(0);
+   }
+
+   pthread_mutex_lock(mutex);
+   
+   if (console_active) {
+      pthread_mutex_unlock(mutex);
+      return fixscript_int(0);
+   }
+
+#ifdef _WIN32
+   if ((mode == PRINT_NORMAL || mode == PRINT_LOG) && !fixscript_is_string(heap, params[0])) {
+      err = fixscript_to_string(heap, params[0], 0, &bytes, &bytes_len);
+      if (err) {
+         pthread_mutex_unlock(mutex);
+         return fixscript_error(heap, error, err);
+      }
+      
+      params[0] = fixscript_create_string(heap, bytes, bytes_len);
+      free(bytes);
+      if (!params[0].value) {
+         pthread_mutex_unlock(mutex);
+         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      }
+   }
+
+   err = fixscript_get_string_utf16(heap, params[0], 0, -1, &s, &len);
+   if (err) {
+      pthread_mutex_unlock(mutex);
+      return fixscript_error(heap, error, err);
+   }
+
+   for (i=0; i<len; i++) {
+      if (s[i] >= 0 && s[i] < 32) {
+         switch (s[i]) {
+            case '\t':
+               break;
+
+            case '\n':
+               if (mode == PRINT_PROGRESS) {
+                  s[i] = '?';
+               }
+               break;
+
+            default:
+               s[i] = '?';
+         }
+      }
+   }
+
+   out = GetStdHandle(mode == PRINT_LOG? STD_ERROR_HANDLE : STD_OUTPUT_HANDLE);
+   if (GetConsoleMode(out, &console_mode)) {
+      if (mode == PRINT_PROGRESS) {
+         if (!clear_console_line()) {
+            WriteConsole(out, L"\r", 1, NULL, NULL);
+         }
+
+         console_clear_line = malloc(len+1);
+         if (console_clear_line) {
+            for (i=0, j=0; i<len; i++) {
+               if (s[i] >= 0xD800 && s[i] <= 0xDBFF) {
+                  continue;
+               }
+               console_clear_line[j++] = s[i] == '\t'? '\t' : ' ';
+            }
+            console_clear_line[j] = 0;
+         }
+      }
+      else {
+         clear_console_line();
+      }
+      WriteConsole(out, s, len, NULL, NULL);
+      if (mode == PRINT_NORMAL || mode == PRINT_LOG) {
+         WriteConsole(out, L"\n", 1, NULL, NULL);
+      }
+   }
+   else {
+      if (len > 0) {
+         bytes_len = WideCharToMultiByte(CP_ACP, 0, s, len, NULL, 0, NULL, NULL);
+         if (bytes_len <= 0) {
+            free(s);
+            pthread_mutex_unlock(mutex);
+            return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+         }
+
+         if (INT_MAX - bytes_len < 2) {
+            free(s);
+            pthread_mutex_unlock(mutex);
+            return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+         }
+      }
+      else {
+         bytes_len = 0;
+      }
+
+      bytes = malloc(bytes_len+2);
+      if (!bytes) {
+         free(s);
+         pthread_mutex_unlock(mutex);
+         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      }
+
+      if (len > 0) {
+         if (WideCharToMultiByte(CP_ACP, 0, (mode == PRINT_PROGRESS)? s+1 : s, len, bytes, bytes_len, NULL, NULL) != bytes_len) {
+            free(bytes);
+            free(s);
+            pthread_mutex_unlock(mutex);
+            return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+         }
+      }
+
+      if (mode == PRINT_PROGRESS) {
+         bytes[0] = '\r';
+         bytes_len++;
+      }
+
+      if (mode == PRINT_NORMAL || mode == PRINT_LOG) {
+         bytes[bytes_len++] = '\n';
+      }
+
+      clear_console_line();
+      WriteFile(out, bytes, bytes_len, &ret, NULL);
+      free(bytes);
+   }
+
+   free(s);
+
+   if (mode == PRINT_PROMPT) {
+      prompt_str = fixscript_create_string(heap, NULL, 0);
+      if (!prompt_str.value) {
+         pthread_mutex_unlock(mutex);
+         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      }
+
+      in = GetStdHandle(STD_INPUT_HANDLE);
+      if (GetConsoleMode(in, &console_mode)) {
+         SetConsoleMode(in, console_mode | ENABLE_LINE_INPUT | ENABLE_ECHO_INPUT);
+
+         for (;;) {
+            if (!ReadConsole(in, buf, sizeof(buf)/sizeof(uint16_t), &ret, 0)) {
+               break;
+            }
+            if (ret <= 0) continue;
+            
+            tmp_str = fixscript_create_string_utf16(heap, buf, ret);
+            if (!tmp_str.value) {
+               err = FIXSCRIPT_ERR_OUT_OF_MEMORY;
+            }
+            if (!err) {
+               err = fixscript_get_array_length(heap, prompt_str, &len);
+            }
+            if (!err) {
+               err = fixscript_get_array_length(heap, tmp_str, &len2);
+            }
+            if (len > INT_MAX - len2) {
+               err = FIXSCRIPT_ERR_OUT_OF_MEMORY;
+            }
+            if (!err) {
+               err = fixscript_set_array_length(heap, prompt_str, len + len2);
+            }
+            if (!err) {
+               err = fixscript_copy_array(heap, prompt_str, len, tmp_str, 0, len2);
+            }
+            if (err) {
+               SetConsoleMode(in, console_mode);
+               pthread_mutex_unlock(mutex);
+               return fixscript_error(heap, error, err);
+            }
+
+            if (buf[ret-1] == '\n') break;
+         }
+
+         SetConsoleMode(in, console_mode);
+      }
+
+      err = fixscript_get_array_length(heap, prompt_str, &len);
+      if (!err && len >= 2) {
+         err = fixscript_get_array_elem(heap, prompt_str, len-2, &val1);
+         if (!err) {
+            err = fixscript_get_array_elem(heap, prompt_str, len-1, &val2);
+         }
+         if (!err && val1.value == '\r' && val2.value == '\n') {
+            err = fixscript_set_array_length(heap, prompt_str, len-2);
+         }
+      }
+      pthread_mutex_unlock(mutex);
+      if (err) {
+         return fixscript_error(heap, error, err);
+      }
+      return prompt_str;
+   }
+   else {
+      // TODO
+      pthread_mutex_unlock(mutex);
+      return fixscript_create_string(heap, NULL, 0);
+   }
+
+   pthread_mutex_unlock(mutex);
+#else
+   if ((mode == PRINT_NORMAL || mode == PRINT_LOG) && !fixscript_is_string(heap, params[0])) {
+      err = fixscript_to_string(heap, params[0], 0, &bytes, &len);
+      if (err) {
+         pthread_mutex_unlock(mutex);
+         return fixscript_error(heap, error, err);
+      }
+      
+      params[0] = fixscript_create_string(heap, bytes, len);
+      free(bytes);
+      if (!params[0].value) {
+         pthread_mutex_unlock(mutex);
+         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      }
+   }
+
+   err = fixscript_get_array_length(heap, params[0], &len);
+   if (!err) {
+      err = fixscript_get_array_element_size(heap, params[0], &elem_size);
+   }
+   if (!err) {
+      err = fixscript_lock_array(heap, params[0], 0, len, (void **)&u.u8, elem_size, ACCESS_READ_ONLY);
+   }
+   if (err) {
+      pthread_mutex_unlock(mutex);
+      return fixscript_error(heap, error, err);
+   }
+
+   #if !defined(__HAIKU__)
+      if (!native_charset_utf8) {
+         prev_locale = uselocale(cur_locale);
+      }
+   #endif
+   memset(&state, 0, sizeof(NativeConvertState));
+
+   if (mode == PRINT_PROGRESS) {
+      if (!clear_console_line()) {
+         fputc('\r', stdout);
+      }
+
+      console_clear_line = malloc(len+1);
+      if (console_clear_line) {
+         if (elem_size == 1) {
+            for (i=0; i<len; i++) {
+               console_clear_line[i] = u.u8[i] == '\t'? '\t' : ' ';
+            }
+         }
+         else if (elem_size == 2) {
+            for (i=0; i<len; i++) {
+               console_clear_line[i] = u.u16[i] == '\t'? '\t' : ' ';
+            }
+         }
+         else if (elem_size == 4) {
+            for (i=0; i<len; i++) {
+               console_clear_line[i] = u.s32[i] == '\t'? '\t' : ' ';
+            }
+         }
+         console_clear_line[len] = 0;
+      }
+   }
+   else {
+      clear_console_line();
+   }
+
+   i = 0;
+   for (;;) {
+      cnt = len - i;
+      if (cnt > buf_cap) {
+         cnt = buf_cap;
+      }
+
+      if (elem_size == 1) {
+         for (j=0; j<cnt; j++) {
+            buf[j] = u.u8[i+j];
+         }
+      }
+      else if (elem_size == 2) {
+         for (j=0; j<cnt; j++) {
+            buf[j] = u.u16[i+j];
+         }
+      }
+      else if (elem_size == 4) {
+         for (j=0; j<cnt; j++) {
+            #if WCHAR_MAX <= 0xFFFF
+               buf[j] = (u.s32[i+j] < 0 || u.s32[i+j] > 0xFFFF)? 0xFFFD : u.s32[i+j];
+            #else
+               buf[j] = u.s32[i+j];
+            #endif
+         }
+      }
+
+      for (j=0; j<cnt; j++) {
+         if (buf[j] >= 0 && buf[j] < 32) {
+            switch (buf[j]) {
+               case '\t':
+                  break;
+
+               case '\n':
+                  if (mode == PRINT_PROGRESS) {
+                     buf[j] = '?';
+                  }
+                  break;
+
+               default:
+                  buf[j] = '?';
+            }
+         }
+      }
+
+      convert_to_native(charbuf, sizeof(charbuf)-1, buf, cnt, &state, &processed_dest, &processed_src);
+      if (processed_dest == 0 && processed_src == 0) break;
+      charbuf[processed_dest] = 0;
+      fputs(charbuf, mode == PRINT_LOG? stderr : stdout);
+      i += processed_src;
+   }
+
+   if (mode == PRINT_NORMAL) {
+      fputc('\n', stdout);
+      fflush(stdout);
+   }
+   else if (mode == PRINT_LOG) {
+      fputc('\n', stderr);
+      fflush(stderr);
+   }
+   else {
+      fflush(stdout);
+   }
+   
+   fixscript_unlock_array(heap, params[0], 0, len, (void **)&u.u8, elem_size, ACCESS_READ_ONLY);
+
+   if (mode == PRINT_PROMPT) {
+      prompt_str = fixscript_create_string(heap, NULL, 0);
+      if (!prompt_str.value) {
+         #if !defined(__HAIKU__)
+            if (!native_charset_utf8) {
+               uselocale(prev_locale);
+            }
+         #endif
+         pthread_mutex_unlock(mutex);
+         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      }
+      memset(&state, 0, sizeof(NativeConvertState));
+      for (;;) {
+         if (!fgets(charbuf, sizeof(charbuf), stdin)) {
+            break;
+         }
+         cp = charbuf;
+         len = strlen(charbuf);
+         for (;;) {
+            convert_from_native(buf, sizeof(buf)/sizeof(wchar_t), cp, len, &state, &processed_dest, &processed_src);
+            if (processed_dest == 0 && processed_src == 0) break;
+            for (i=0; i<processed_dest; i++) {
+               if (buf[i] == '\n') {
+                  goto end;
+               }
+               err = fixscript_append_array_elem(heap, prompt_str, fixscript_int(buf[i]));
+               if (err) {
+                  #if !defined(__HAIKU__)
+                     if (!native_charset_utf8) {
+                        uselocale(prev_locale);
+                     }
+                  #endif
+                  pthread_mutex_unlock(mutex);
+                  return fixscript_error(heap, error, err);
+               }
+            }
+            cp += processed_src;
+            len -= processed_src;
+         }
+      }
+      end:;
+   }
+
+   #if !defined(__HAIKU__)
+      if (!native_charset_utf8) {
+         uselocale(prev_locale);
+      }
+   #endif
+   pthread_mutex_unlock(mutex);
+   
+   if (mode == PRINT_PROMPT) {
+      return prompt_str;
+   }
+#endif
+
+   return fixscript_int(0);
+#endif /* __wasm__ */
+}
+
+
+static Value native_beep(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+#if defined(_WIN32)
+   DWORD console_mode;
+
+   if (!gui_app && GetConsoleMode(GetStdHandle(STD_OUTPUT_HANDLE), &console_mode)) {
+      MessageBeep(-1);
+   }
+#elif defined(__wasm__)
+#else
+   if (isatty(STDOUT_FILENO)) {
+      fprintf(stdout, "\a");
+      fflush(stdout);
+   }
+#endif
+
+   return fixscript_int(0);
+}
+
+
+#ifdef __wasm__
+static void call_log_function_cont(Heap *heap, Value result, Value error, void *data)
+{
+   LogFunc *log_func = data;
+
+   if (error.value) {
+      fixscript_dump_value(heap, error, 1);
+   }
+   log_func->recursive = 0;
+   log_func->cont_func(heap, fixscript_int(0), fixscript_int(0), log_func->cont_data);
+}
+#endif
+
+
+static Value call_log_function(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+   LogFunc *log_func = data;
+#ifndef __wasm__
+   Value func_error;
+#endif
+
+   if (log_func->recursive) {
+      return log_func->func(heap, error, num_params, params, log_func->data);
+   }
+
+   log_func->recursive = 1;
+#ifdef __wasm__
+   fixscript_suspend(heap, &log_func->cont_func, &log_func->cont_data);
+   fixscript_call_async(heap, log_func->custom_func, 1, &params[0], call_log_function_cont, log_func);
+#else
+   fixscript_call(heap, log_func->custom_func, 1, &func_error, params[0]);
+   if (func_error.value) {
+      fixscript_dump_value(heap, func_error, 1);
+   }
+   log_func->recursive = 0;
+#endif
+   return fixscript_int(0);
+}
+
+
+static Value set_log_function(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+   LogFunc *log_func = data;
+   int err;
+
+   if (!params[0].value) {
+      if (log_func) {
+         fixscript_register_native_func(heap, "log#1", log_func->func, log_func->data);
+      }
+      return fixscript_int(0);
+   }
+
+   err = fixscript_get_function_name(heap, params[0], NULL, NULL, NULL);
+   if (err) {
+      return fixscript_error(heap, error, err);
+   }
+
+   if (!log_func) {
+      log_func = calloc(1, sizeof(LogFunc));
+      if (!log_func) {
+         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      }
+      log_func->func = fixscript_get_native_func(heap, "log#1", &log_func->data);
+
+      fixscript_register_native_func(heap, "set_log_function#1", set_log_function, log_func);
+      fixscript_register_cleanup(heap, free, log_func);
+   }
+
+   log_func->custom_func = params[0];
+   fixscript_register_native_func(heap, "log#1", call_log_function, log_func);
+   return fixscript_int(0);
+}
+
+
+#if !defined(_WIN32) && !defined(__wasm__)
+static void console_interrupt_signal_handler(int signum)
+{
+   struct termios tios;
+   const char restore[] = "\e[0m\e[7h\e[?7h\e[?25h";
+   ssize_t ret, pos=0;
+
+   while (pos < sizeof(restore)) {
+      ret = write(STDOUT_FILENO, restore + pos, sizeof(restore) - pos);
+      if (ret < 0) break;
+      pos += ret;
+   }
+
+   if (tcgetattr(STDOUT_FILENO, &tios) == 0) {
+      tios.c_iflag |= IXON;
+      tios.c_lflag |= ECHO | ICANON | ISIG | IEXTEN;
+      tios.c_cc[VMIN] = 1;
+      tios.c_cc[VTIME] = 0;
+      tcsetattr(STDOUT_FILENO, TCSAFLUSH, &tios);
+   }
+
+   signal(SIGINT, SIG_DFL);
+   kill(getpid(), SIGINT);
+}
+#endif
+
+
+#if !defined(_WIN32) && !defined(__wasm__)
+static void *console_auto_flush_thread_main(void *data)
+{
+   pthread_mutex_t *mutex;
+   pthread_cond_t *cond;
+
+   mutex = get_mutex(&console_auto_flush_mutex);
+   cond = get_cond(&console_auto_flush_cond);
+
+   pthread_mutex_lock(mutex);
+   while (console_auto_flush_active) {
+      pthread_cond_wait(cond, mutex);
+      if (!console_auto_flush_active) break;
+      if (console_auto_flush_trigger) {
+         pthread_mutex_unlock(mutex);
+         usleep(10*1000);
+         pthread_mutex_lock(mutex);
+         if (console_auto_flush_active) {
+            fflush(stdout);
+         }
+         console_auto_flush_trigger = 0;
+      }
+   }
+   pthread_mutex_unlock(mutex);
+
+   return NULL;
+}
+#endif
+
+
+#if !defined(_WIN32) && !defined(__wasm__)
+static void console_flush()
+{
+   pthread_mutex_t *mutex;
+   pthread_cond_t *cond;
+
+   mutex = get_mutex(&console_auto_flush_mutex);
+   cond = get_cond(&console_auto_flush_cond);
+
+   pthread_mutex_lock(mutex);
+   console_auto_flush_trigger = 1;
+   pthread_cond_signal(cond);
+   pthread_mutex_unlock(mutex);
+}
+#endif
+
+
+#if !defined(_WIN32) && !defined(__wasm__)
+enum {
+   CSSE_OCCURED     = 1 << 0,
+   CSSE_WITH_RESET  = 1 << 1,
+   CSSE_NEEDS_RESET = 1 << 2,
+   CSSE_WAS_RESET   = 1 << 3
+};
+
+static void console_size_signal_handler(int signum)
+{
+   struct termios tios;
+   int csse;
+
+   console_size = -2;
+
+   for (;;) {
+      csse = console_send_size_event;
+      if (csse & CSSE_NEEDS_RESET) {
+         if (!__sync_bool_compare_and_swap(&console_send_size_event, csse, csse | CSSE_OCCURED | CSSE_WITH_RESET)) continue;
+         if (tcgetattr(STDOUT_FILENO, &tios) == 0) {
+            tios.c_cc[VMIN] = 0;
+            tios.c_cc[VTIME] = 0;
+            tcsetattr(STDOUT_FILENO, TCSANOW, &tios);
+         }
+         __sync_fetch_and_or(&console_send_size_event, CSSE_WAS_RESET);
+         break;
+      }
+      else {
+         if (!__sync_bool_compare_and_swap(&console_send_size_event, csse, csse | CSSE_OCCURED)) continue;
+         break;
+      }
+   }
+}
+#endif
+
+
+#ifndef __wasm__
+static void activate_console()
+{
+#if defined(_WIN32)
+   HANDLE in, out;
+   DWORD console_mode;
+   
+   in = GetStdHandle(STD_INPUT_HANDLE);
+   out = GetStdHandle(STD_OUTPUT_HANDLE);
+   if (GetConsoleMode(in, &console_mode)) {
+      SetConsoleMode(in, console_mode & ~ENABLE_PROCESSED_INPUT);
+   }
+   if (GetConsoleMode(out, &console_mode)) {
+      SetConsoleMode(out, console_mode & ~ENABLE_WRAP_AT_EOL_OUTPUT);
+   }
+   console_cur_attr = 0x07;
+   GetConsoleScreenBufferInfo(out, &last_csbi);
+#elif defined(__wasm__)
+#else
+   struct termios tios;
+   pthread_mutex_t *mutex;
+
+   if (tcgetattr(STDOUT_FILENO, &tios) == 0) {
+      tios.c_iflag &= ~(IXON);
+      tios.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
+      tios.c_cc[VMIN] = 1;
+      tios.c_cc[VTIME] = 0;
+      tcsetattr(STDOUT_FILENO, TCSAFLUSH, &tios);
+   }
+
+   fprintf(stdout, "\e[0m"); // reset color
+   fprintf(stdout, "\e[7l"); // disable line wrap (vt100)
+   fprintf(stdout, "\e[?7l"); // disable line wrap (other)
+   fflush(stdout);
+
+   signal(SIGINT, console_interrupt_signal_handler);
+   if (console_size == -1) {
+      signal(SIGWINCH, console_size_signal_handler);
+   }
+
+   mutex = get_mutex(&console_auto_flush_mutex);
+   pthread_mutex_lock(mutex);
+   console_auto_flush_active = 1;
+   pthread_mutex_unlock(mutex);
+   pthread_create(&console_auto_flush_thread, NULL, console_auto_flush_thread_main, NULL);
+
+   setvbuf(stdin, NULL, _IONBF, 0);
+#endif
+}
+#endif
+
+
+#ifndef __wasm__
+static void deactivate_console()
+{
+#if defined(_WIN32)
+   HANDLE in, out;
+   DWORD console_mode;
+   CONSOLE_CURSOR_INFO cci;
+   
+   in = GetStdHandle(STD_INPUT_HANDLE);
+   out = GetStdHandle(STD_OUTPUT_HANDLE);
+   if (GetConsoleMode(in, &console_mode)) {
+      SetConsoleMode(in, console_mode | ENABLE_PROCESSED_INPUT);
+   }
+   if (GetConsoleMode(out, &console_mode)) {
+      SetConsoleMode(out, console_mode | ENABLE_WRAP_AT_EOL_OUTPUT);
+   }
+   if (GetConsoleCursorInfo(out, &cci)) {
+      cci.bVisible = 1;
+      SetConsoleCursorInfo(out, &cci);
+   }
+#elif defined(__wasm__)
+#else
+   struct termios tios;
+   pthread_mutex_t *mutex;
+   pthread_cond_t *cond;
+
+   mutex = get_mutex(&console_auto_flush_mutex);
+   cond = get_cond(&console_auto_flush_cond);
+
+   pthread_mutex_lock(mutex);
+   console_auto_flush_active = 0;
+   pthread_cond_signal(cond);
+   pthread_mutex_unlock(mutex);
+   pthread_join(console_auto_flush_thread, NULL);
+
+   if (tcgetattr(STDOUT_FILENO, &tios) == 0) {
+      tios.c_iflag |= IXON;
+      tios.c_lflag |= ECHO | ICANON | ISIG | IEXTEN;
+      tios.c_cc[VMIN] = 1;
+      tios.c_cc[VTIME] = 0;
+      tcsetattr(STDOUT_FILENO, TCSAFLUSH, &tios);
+   }
+   fprintf(stdout, "\e[0m"); // reset color
+   fprintf(stdout, "\e[7h"); // enable line wrap (vt100)
+   fprintf(stdout, "\e[?7h"); // enable line wrap (other)
+   fprintf(stdout, "\e[?25h"); // show cursor
+   fflush(stdout);
+
+   signal(SIGINT, SIG_DFL);
+
+   setvbuf(stdin, NULL, _IOLBF, 0);
+#endif
+}
+#endif
+
+
+#ifndef __wasm__
+static void handle_console_cleanup()
+{
+   pthread_mutex_t *mutex;
+
+   mutex = get_mutex(&console_mutex);
+   if (mutex) {
+      pthread_mutex_lock(mutex);
+      if (clear_console_line()) {
+         fflush(stdout);
+      }
+      if (console_active) {
+         deactivate_console();
+         console_active = 0;
+      }
+      pthread_mutex_unlock(mutex);
+   }
+}
+#endif
+
+
+static Value native_console_is_present(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+   int is_present = console_is_present;
+#ifdef _WIN32
+   DWORD console_mode;
+#endif
+
+   if (is_present < 0) {
+      #if defined(_WIN32)
+         if (gui_app) {
+            is_present = 0;
+         }
+         else {
+            is_present = GetConsoleMode(GetStdHandle(STD_INPUT_HANDLE), &console_mode) && GetConsoleMode(GetStdHandle(STD_OUTPUT_HANDLE), &console_mode);
+         }
+      #elif defined(__wasm__)
+         is_present = 0;
+      #else
+         is_present = isatty(STDIN_FILENO) && isatty(STDOUT_FILENO);
+      #endif
+      console_is_present = is_present;
+   }
+   return fixscript_int(is_present);
+}
+
+
+static Value native_console_get_size(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+#if defined(__wasm__)
+   return fixscript_int(0);
+#else
+   int which = (intptr_t)data;
+   int size;
+#ifdef _WIN32
+   CONSOLE_SCREEN_BUFFER_INFO csbi;
+#else
+   struct {
+      unsigned short ws_row;
+      unsigned short ws_col;
+      unsigned short ws_xpixel;
+      unsigned short ws_ypixel;
+   } ws;
+#endif
+
+   size = console_size;
+   if (size < 0) {
+      #ifdef _WIN32
+         if (gui_app) {
+            size = 0;
+         }
+         else {
+            if (GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &csbi)) {
+               size = ((uint16_t)csbi.dwSize.X) | (((int)(uint16_t)(csbi.srWindow.Bottom - csbi.srWindow.Top + 1)) << 16);
+            }
+            else {
+               size = 0;
+            }
+         }
+      #else
+         if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) != 0) {
+            return fixscript_int(0);
+         }
+         if (size == -1) {
+            signal(SIGWINCH, console_size_signal_handler);
+         }
+         size = ws.ws_col | (((int)ws.ws_row) << 16);
+      #endif
+      console_size = size;
+   }
+
+   return fixscript_int(which == 0? (size & 0xFFFF) : ((size >> 16) & 0xFFFF));
+#endif /* __wasm__ */
+}
+
+
+static Value native_console_set_active(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+#if defined(__wasm__)
+   *error = fixscript_create_error_string(heap, "not supported");
+   return fixscript_int(0);
+#else
+   pthread_mutex_t *mutex;
+
+   if (!native_console_is_present(heap, error, 0, NULL, NULL).value) {
+      *error = fixscript_create_error_string(heap, "console is not present");
+      return fixscript_int(0);
+   }
+
+   mutex = get_mutex(&console_mutex);
+   if (!mutex) {
+      *error = fixscript_create_error_string(heap, "can't lock console");
+      return fixscript_int(0);
+   }
+
+   pthread_mutex_lock(mutex);
+   if (clear_console_line()) {
+      fflush(stdout);
+   }
+
+   if (!console_active && params[0].value) {
+      activate_console();
+      console_active = 1;
+   }
+   else if (console_active && !params[0].value) {
+      deactivate_console();
+      console_active = 0;
+   }
+
+   pthread_mutex_unlock(mutex);
+   return fixscript_int(0);
+#endif /* __wasm__ */
+}
+
+
+static Value native_console_is_active(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+   pthread_mutex_t *mutex;
+   int active;
+
+   mutex = get_mutex(&console_mutex);
+   if (!mutex) {
+      *error = fixscript_create_error_string(heap, "can't lock console");
+      return fixscript_int(0);
+   }
+
+   pthread_mutex_lock(mutex);
+   active = console_active;
+   pthread_mutex_unlock(mutex);
+   
+   return fixscript_int(active);
+}
+
+
+static Value native_console_get_cursor(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+#if defined(__wasm__)
+   *error = fixscript_create_error_string(heap, "not supported");
+   return fixscript_int(0);
+#else
+   pthread_mutex_t *mutex;
+   Value cursor[2], ret;
+   int err;
+#ifdef _WIN32
+   HANDLE out;
+   CONSOLE_SCREEN_BUFFER_INFO csbi;
+   int base_y;
+#else
+   char c;
+   int i, ch, x, y, start;
+#endif
+
+   mutex = get_mutex(&console_mutex);
+   if (!mutex) {
+      *error = fixscript_create_error_string(heap, "can't lock console");
+      return fixscript_int(0);
+   }
+
+   pthread_mutex_lock(mutex);
+   if (!console_active) {
+      pthread_mutex_unlock(mutex);
+      *error = fixscript_create_error_string(heap, "console is not active");
+      return fixscript_int(0);
+   }
+
+   cursor[0] = fixscript_int(0);
+   cursor[1] = fixscript_int(0);
+
+#ifdef _WIN32
+   out = GetStdHandle(STD_OUTPUT_HANDLE);
+   if (GetConsoleScreenBufferInfo(out, &csbi)) {
+      base_y = csbi.dwSize.Y - (csbi.srWindow.Bottom - csbi.srWindow.Top + 1);
+
+      cursor[0] = fixscript_int(csbi.dwCursorPosition.X);
+      cursor[1] = fixscript_int(csbi.dwCursorPosition.Y - base_y);
+   }
+#else
+   fprintf(stdout, "\e[6n");
+   fflush(stdout);
+   for (;;) {
+      if (read(STDIN_FILENO, &c, 1) == 1) {
+         ch = c;
+      }
+      else {
+         ch = EOF;
+      }
+      if (ch != EOF) {
+         if (console_input_len == sizeof(console_input_buf)) {
+            memmove(console_input_buf, console_input_buf+1, --console_input_len);
+         }
+         console_input_buf[console_input_len++] = ch;
+
+         if (ch == 'R' && console_input_len >= 6) {
+            for (i=console_input_len-2; i>=0; i--) {
+               if (console_input_buf[i] == '\e' && console_input_buf[i+1] == '[') {
+                  start = i;
+                  i += 2;
+                  y = 0;
+                  while (console_input_buf[i] >= '0' && console_input_buf[i] <= '9') {
+                     y = y*10 + (console_input_buf[i++] - '0');
+                  }
+                  if (console_input_buf[i++] == ';') {
+                     x = 0;
+                     while (console_input_buf[i] >= '0' && console_input_buf[i] <= '9') {
+                        x = x*10 + (console_input_buf[i++] - '0');
+                     }
+                     if (i == console_input_len-1) {
+                        cursor[0] = fixscript_int(x-1);
+                        cursor[1] = fixscript_int(y-1);
+                        console_input_len = start;
+                        goto end;
+                     }
+                  }
+                  break;
+               }
+            }
+         }
+      }
+   }
+   end:;
+#endif
+
+   pthread_mutex_unlock(mutex);
+
+   ret = fixscript_create_array(heap, 2);
+   if (!ret.value) {
+      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+   }
+
+   err = fixscript_set_array_range(heap, ret, 0, 2, cursor);
+   if (err) {
+      return fixscript_error(heap, error, err);
+   }
+   return ret;
+#endif /* __wasm__ */
+}
+
+
+static Value native_console_set_cursor(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+#if defined(__wasm__)
+   *error = fixscript_create_error_string(heap, "not supported");
+   return fixscript_int(0);
+#else
+   int relative = (intptr_t)data;
+   pthread_mutex_t *mutex;
+#ifdef _WIN32
+   HANDLE out;
+   CONSOLE_SCREEN_BUFFER_INFO csbi;
+   int x, y, w, h, base_y;
+#endif
+
+   mutex = get_mutex(&console_mutex);
+   if (!mutex) {
+      *error = fixscript_create_error_string(heap, "can't lock console");
+      return fixscript_int(0);
+   }
+
+   pthread_mutex_lock(mutex);
+   if (!console_active) {
+      pthread_mutex_unlock(mutex);
+      *error = fixscript_create_error_string(heap, "console is not active");
+      return fixscript_int(0);
+   }
+
+#ifdef _WIN32
+   out = GetStdHandle(STD_OUTPUT_HANDLE);
+   if (GetConsoleScreenBufferInfo(out, &csbi)) {
+      base_y = csbi.dwSize.Y - (csbi.srWindow.Bottom - csbi.srWindow.Top + 1);
+
+      if (relative) {
+         x = csbi.dwCursorPosition.X;
+         y = csbi.dwCursorPosition.Y - base_y;
+         x += params[0].value;
+         y += params[1].value;
+      }
+      else {
+         x = params[0].value;
+         y = params[1].value;
+      }
+
+      w = csbi.dwSize.X;
+      h = csbi.srWindow.Bottom - csbi.srWindow.Top + 1;
+
+      if (x < 0) x = 0;
+      if (y < -base_y) y = -base_y;
+      if (x >= w) x = w-1;
+      if (y >= h) y = h-1;
+
+      csbi.dwCursorPosition.X = x;
+      csbi.dwCursorPosition.Y = y + base_y;
+      SetConsoleCursorPosition(out, csbi.dwCursorPosition);
+   }
+#else
+   if (relative) {
+      if (params[0].value < 0) {
+         fprintf(stdout, "\e[%dD", -params[0].value);
+      }
+      if (params[0].value > 0) {
+         fprintf(stdout, "\e[%dC", params[0].value);
+      }
+      if (params[1].value < 0) {
+         fprintf(stdout, "\e[%dA", -params[1].value);
+      }
+      if (params[1].value > 0) {
+         fprintf(stdout, "\e[%dB", params[1].value);
+      }
+   }
+   else {
+      fprintf(stdout, "\e[%d;%dH", params[1].value+1, params[0].value+1);
+   }
+   console_flush();
+#endif
+
+   pthread_mutex_unlock(mutex);
+   return fixscript_int(0);
+#endif /* __wasm__ */
+}
+
+
+static Value native_console_show_cursor(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+#if defined(__wasm__)
+   *error = fixscript_create_error_string(heap, "not supported");
+   return fixscript_int(0);
+#else
+   int show = (intptr_t)data;
+   pthread_mutex_t *mutex;
+#ifdef _WIN32
+   HANDLE out;
+   CONSOLE_CURSOR_INFO cci;
+#endif
+
+   mutex = get_mutex(&console_mutex);
+   if (!mutex) {
+      *error = fixscript_create_error_string(heap, "can't lock console");
+      return fixscript_int(0);
+   }
+
+   pthread_mutex_lock(mutex);
+   if (!console_active) {
+      pthread_mutex_unlock(mutex);
+      *error = fixscript_create_error_string(heap, "console is not active");
+      return fixscript_int(0);
+   }
+
+#ifdef _WIN32
+   out = GetStdHandle(STD_OUTPUT_HANDLE);
+   if (GetConsoleCursorInfo(out, &cci)) {
+      cci.bVisible = show;
+      SetConsoleCursorInfo(out, &cci);
+   }
+#else
+   if (show) {
+      fprintf(stdout, "\e[?25h");
+   }
+   else {
+      fprintf(stdout, "\e[?25l");
+   }
+   console_flush();
+#endif
+
+   pthread_mutex_unlock(mutex);
+   return fixscript_int(0);
+#endif /* __wasm__ */
+}
+
+
+static Value native_console_clear(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+#if defined(__wasm__)
+   *error = fixscript_create_error_string(heap, "not supported");
+   return fixscript_int(0);
+#else
+   pthread_mutex_t *mutex;
+#ifdef _WIN32
+   HANDLE out;
+   CONSOLE_SCREEN_BUFFER_INFO csbi;
+   COORD size, coord;
+   SMALL_RECT rect;
+   CHAR_INFO *chars;
+   int64_t len64;
+   int i;
+#endif
+
+   mutex = get_mutex(&console_mutex);
+   if (!mutex) {
+      *error = fixscript_create_error_string(heap, "can't lock console");
+      return fixscript_int(0);
+   }
+
+   pthread_mutex_lock(mutex);
+   if (!console_active) {
+      pthread_mutex_unlock(mutex);
+      *error = fixscript_create_error_string(heap, "console is not active");
+      return fixscript_int(0);
+   }
+
+#ifdef _WIN32
+   out = GetStdHandle(STD_OUTPUT_HANDLE);
+   if (GetConsoleScreenBufferInfo(out, &csbi)) {
+      size.X = csbi.dwSize.X;
+      size.Y = csbi.srWindow.Bottom - csbi.srWindow.Top + 1;
+
+      len64 = ((int64_t)size.X) * ((int64_t)size.Y) * sizeof(CHAR_INFO);
+      chars = len64 > 0 && len64 <= INT_MAX? malloc(len64) : NULL;
+      if (chars) {
+         for (i=0; i<size.X*size.Y; i++) {
+            chars[i].Char.UnicodeChar = ' ';
+            chars[i].Attributes = 0x07;
+         }
+         coord.X = 0;
+         coord.Y = 0;
+         rect.Left = 0;
+         rect.Top = csbi.dwSize.Y - (csbi.srWindow.Bottom - csbi.srWindow.Top + 1);
+         rect.Right = rect.Left+size.X-1;
+         rect.Bottom = rect.Top+size.Y-1;
+         csbi.dwCursorPosition.X = rect.Left;
+         csbi.dwCursorPosition.Y = rect.Top;
+         WriteConsoleOutput(out, chars, size, coord, &rect);
+         SetConsoleCursorPosition(out, csbi.dwCursorPosition);
+         free(chars);
+      }
+   }
+#else
+   fprintf(stdout, "\e[1;1H\e[2J");
+   console_flush();
+#endif
+
+   pthread_mutex_unlock(mutex);
+   return fixscript_int(0);
+#endif /* __wasm__ */
+}
+
+
+static Value native_console_put_text(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+#if defined(__wasm__)
+   *error = fixscript_create_error_string(heap, "not supported");
+   return fixscript_int(0);
+#else
+   pthread_mutex_t *mutex;
+   union {
+      uint8_t *u8;
+      uint16_t *u16;
+      int32_t *s32;
+   } u;
+#ifdef _WIN32
+   CHAR_INFO *chars;
+   HANDLE out;
+   CONSOLE_SCREEN_BUFFER_INFO csbi;
+   COORD size, coord;
+   SMALL_RECT rect;
+   int64_t len64;
+   int ch;
+#else
+#if !defined(__HAIKU__)
+   locale_t prev_locale = (locale_t)0;
+#endif
+   NativeConvertState state;
+   wchar_t buf[128];
+   char charbuf[128*4];
+   int buf_cap = sizeof(buf) / sizeof(wchar_t) - 1;
+   int processed_dest, processed_src;
+   int j, cnt, bp;
+#endif
+   int i, err, off, len, elem_size;
+
+   mutex = get_mutex(&console_mutex);
+   if (!mutex) {
+      *error = fixscript_create_error_string(heap, "can't lock console");
+      return fixscript_int(0);
+   }
+
+   pthread_mutex_lock(mutex);
+   if (!console_active) {
+      pthread_mutex_unlock(mutex);
+      *error = fixscript_create_error_string(heap, "console is not active");
+      return fixscript_int(0);
+   }
+
+   if (num_params == 1) {
+      off = 0;
+      err = fixscript_get_array_length(heap, params[0], &len);
+      if (err) {
+         pthread_mutex_unlock(mutex);
+         return fixscript_error(heap, error, err);
+      }
+   }
+   else {
+      off = params[1].value;
+      len = params[2].value;
+   }
+
+#ifdef _WIN32
+   err = fixscript_get_array_element_size(heap, params[0], &elem_size);
+   if (!err) {
+      err = fixscript_lock_array(heap, params[0], off, len, (void **)&u.u8, elem_size, ACCESS_READ_ONLY);
+   }
+   if (err) {
+      pthread_mutex_unlock(mutex);
+      return fixscript_error(heap, error, err);
+   }
+
+   if (len > 0) {
+      len64 = ((int64_t)len) * sizeof(CHAR_INFO);
+      chars = len64 <= INT_MAX? malloc(len64) : NULL;
+      if (!chars) {
+         fixscript_unlock_array(heap, params[0], off, len, (void **)&u.u8, elem_size, ACCESS_READ_ONLY);
+         pthread_mutex_unlock(mutex);
+         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      }
+
+      if (elem_size == 1) {
+         for (i=0; i<len; i++) {
+            chars[i].Char.UnicodeChar = u.u8[i];
+            chars[i].Attributes = console_cur_attr;
+         }
+      }
+      else if (elem_size == 2) {
+         for (i=0; i<len; i++) {
+            chars[i].Char.UnicodeChar = u.u16[i];
+            chars[i].Attributes = console_cur_attr;
+         }
+      }
+      else {
+         for (i=0; i<len; i++) {
+            ch = u.s32[i];
+            if (ch < 0 || ch > 0xFFFF) {
+               ch = 0xFFFD;
+            }
+            chars[i].Char.UnicodeChar = ch;
+            chars[i].Attributes = console_cur_attr;
+         }
+      }
+      
+      out = GetStdHandle(STD_OUTPUT_HANDLE);
+      if (GetConsoleScreenBufferInfo(out, &csbi)) {
+         size.X = len;
+         size.Y = 1;
+         coord.X = 0;
+         coord.Y = 0;
+         rect.Left = csbi.dwCursorPosition.X;
+         rect.Top = csbi.dwCursorPosition.Y;
+         rect.Right = rect.Left+len-1;
+         rect.Bottom = rect.Top;
+         WriteConsoleOutput(out, chars, size, coord, &rect);
+
+         csbi.dwCursorPosition.X += len;
+         if (csbi.dwCursorPosition.X >= csbi.dwSize.X) {
+            csbi.dwCursorPosition.X = csbi.dwSize.X-1;
+         }
+         SetConsoleCursorPosition(out, csbi.dwCursorPosition);
+      }
+
+      free(chars);
+   }
+
+   fixscript_unlock_array(heap, params[0], off, len, (void **)&u.u8, elem_size, ACCESS_READ_ONLY);
+#else
+   err = fixscript_get_array_element_size(heap, params[0], &elem_size);
+   if (!err) {
+      err = fixscript_lock_array(heap, params[0], off, len, (void **)&u.u8, elem_size, ACCESS_READ_ONLY);
+   }
+   if (err) {
+      pthread_mutex_unlock(mutex);
+      return fixscript_error(heap, error, err);
+   }
+
+   #if !defined(__HAIKU__)
+      if (!native_charset_utf8) {
+         prev_locale = uselocale(cur_locale);
+      }
+   #endif
+   memset(&state, 0, sizeof(NativeConvertState));
+
+   for (i=0; i<len; ) {
+      cnt = len - i;
+      if (cnt > buf_cap) {
+         cnt = buf_cap;
+      }
+
+      if (elem_size == 1) {
+         for (j=0; j<cnt; j++) {
+            buf[j] = u.u8[i+j];
+         }
+      }
+      else if (elem_size == 2) {
+         for (j=0; j<cnt; j++) {
+            buf[j] = u.u16[i+j];
+         }
+      }
+      else if (elem_size == 4) {
+         for (j=0; j<cnt; j++) {
+            #if WCHAR_MAX <= 0xFFFF
+               buf[j] = (u.s32[i+j] < 0 || u.s32[i+j] > 0xFFFF)? 0xFFFD : u.s32[i+j];
+            #else
+               buf[j] = u.s32[i+j];
+            #endif
+         }
+      }
+
+      for (j=0; j<cnt; j++) {
+         if (buf[j] >= 0 && buf[j] < 32) {
+            buf[j] = '?';
+         }
+      }
+
+      bp = 0;
+      for (;;) {
+         convert_to_native(charbuf, sizeof(charbuf)-1, buf + bp, cnt - bp, &state, &processed_dest, &processed_src);
+         if (processed_dest == 0 && processed_src == 0) break;
+         charbuf[processed_dest] = 0;
+         fputs(charbuf, stdout);
+         bp += processed_src;
+      }
+      i += cnt;
+   }
+   
+   #if !defined(__HAIKU__)
+      if (!native_charset_utf8) {
+         uselocale(prev_locale);
+      }
+   #endif
+   fixscript_unlock_array(heap, params[0], off, len, (void **)&u.u8, elem_size, ACCESS_READ_ONLY);
+   console_flush();
+#endif
+
+   pthread_mutex_unlock(mutex);
+   return fixscript_int(0);
+#endif /* __wasm__ */
+}
+
+
+static Value native_console_set_color(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+#if defined(__wasm__)
+   *error = fixscript_create_error_string(heap, "not supported");
+   return fixscript_int(0);
+#else
+   int reset = (intptr_t)data;
+   pthread_mutex_t *mutex;
+   int background = 0, foreground = 0;
+
+   if (!reset) {
+      background = params[0].value;
+      foreground = params[1].value;
+      if (background < 0 || background > 15 || foreground < 0 || foreground > 15) {
+         *error = fixscript_create_error_string(heap, "invalid color value");
+         return fixscript_int(0);
+      }
+   }
+
+   mutex = get_mutex(&console_mutex);
+   if (!mutex) {
+      *error = fixscript_create_error_string(heap, "can't lock console");
+      return fixscript_int(0);
+   }
+
+   pthread_mutex_lock(mutex);
+   if (!console_active) {
+      pthread_mutex_unlock(mutex);
+      *error = fixscript_create_error_string(heap, "console is not active");
+      return fixscript_int(0);
+   }
+
+#ifdef _WIN32
+   if (reset) {
+      console_cur_attr = 0x07;
+   }
+   else {
+      console_cur_attr = (background << 4) | foreground;
+   }
+#else
+   if (reset) {
+      fprintf(stdout, "\e[0m");
+   }
+   else {
+      switch (background) {
+         case  0: background = 40; break;
+         case  1: background = 44; break;
+         case  2: background = 42; break;
+         case  3: background = 46; break;
+         case  4: background = 41; break;
+         case  5: background = 45; break;
+         case  6: background = 43; break;
+         case  7: background = 47; break;
+         case  8: background = 100; break;
+         case  9: background = 104; break;
+         case 10: background = 102; break;
+         case 11: background = 106; break;
+         case 12: background = 101; break;
+         case 13: background = 105; break;
+         case 14: background = 103; break;
+         case 15: background = 107; break;
+      }
+      switch (foreground) {
+         case  0: foreground = 30; break;
+         case  1: foreground = 34; break;
+         case  2: foreground = 32; break;
+         case  3: foreground = 36; break;
+         case  4: foreground = 31; break;
+         case  5: foreground = 35; break;
+         case  6: foreground = 33; break;
+         case  7: foreground = 37; break;
+         case  8: foreground = 90; break;
+         case  9: foreground = 94; break;
+         case 10: foreground = 92; break;
+         case 11: foreground = 96; break;
+         case 12: foreground = 91; break;
+         case 13: foreground = 95; break;
+         case 14: foreground = 93; break;
+         case 15: foreground = 97; break;
+      }
+      fprintf(stdout, "\e[%d;%dm", foreground, background);
+   }
+   console_flush();
+#endif
+
+   pthread_mutex_unlock(mutex);
+   return fixscript_int(0);
+#endif /* __wasm__ */
+}
+
+
+static Value native_console_scroll(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+#if defined(__wasm__)
+   *error = fixscript_create_error_string(heap, "not supported");
+   return fixscript_int(0);
+#else
+   int rel_y = params[0].value;
+   pthread_mutex_t *mutex;
+#ifdef _WIN32
+   HANDLE out;
+   CONSOLE_SCREEN_BUFFER_INFO csbi;
+   SMALL_RECT rect;
+   COORD origin;
+   CHAR_INFO fill;
+   int x, y, w, h, base_y;
+#endif
+
+   mutex = get_mutex(&console_mutex);
+   if (!mutex) {
+      *error = fixscript_create_error_string(heap, "can't lock console");
+      return fixscript_int(0);
+   }
+
+   pthread_mutex_lock(mutex);
+   if (!console_active) {
+      pthread_mutex_unlock(mutex);
+      *error = fixscript_create_error_string(heap, "console is not active");
+      return fixscript_int(0);
+   }
+
+#ifdef _WIN32
+   out = GetStdHandle(STD_OUTPUT_HANDLE);
+
+   fill.Char.UnicodeChar = ' ';
+   fill.Attributes = console_cur_attr;
+
+   if (GetConsoleScreenBufferInfo(out, &csbi)) {
+      base_y = csbi.dwSize.Y - (csbi.srWindow.Bottom - csbi.srWindow.Top + 1);
+
+      x = csbi.dwCursorPosition.X;
+      y = csbi.dwCursorPosition.Y - base_y;
+      y -= rel_y;
+
+      w = csbi.dwSize.X;
+      h = csbi.srWindow.Bottom - csbi.srWindow.Top + 1;
+
+      if (x < 0) x = 0;
+      if (y < -base_y) y = -base_y;
+      if (x >= w) x = w-1;
+      if (y >= h) y = h-1;
+
+      if (rel_y > 0) {
+         rect.Left = 0;
+         rect.Top = 0;
+         rect.Right = csbi.dwSize.X;
+         rect.Bottom = csbi.dwSize.Y;
+         origin.X = 0;
+         origin.Y = -rel_y;
+         ScrollConsoleScreenBuffer(out, &rect, NULL, origin, &fill);
+      }
+      else {
+         rect.Left = 0;
+         rect.Top = base_y;
+         rect.Right = csbi.dwSize.X;
+         rect.Bottom = base_y+h;
+         origin.X = 0;
+         origin.Y = base_y-rel_y;
+         ScrollConsoleScreenBuffer(out, &rect, &rect, origin, &fill);
+      }
+
+      csbi.dwCursorPosition.X = x;
+      csbi.dwCursorPosition.Y = y + base_y;
+      SetConsoleCursorPosition(out, csbi.dwCursorPosition);
+   }
+#else
+   if (rel_y > 0) {
+      fprintf(stdout, "\e[%dS\e[%dA", rel_y, rel_y);
+   }
+   else if (rel_y < 0) {
+      fprintf(stdout, "\e[%dT\e[%dB", -rel_y, -rel_y);
+   }
+   console_flush();
+#endif
+
+   pthread_mutex_unlock(mutex);
+   return fixscript_int(0);
+#endif /* __wasm__ */
+}
+
+
+#if !defined(_WIN32) && !defined(__wasm__)
+static int get_char()
+{
+   int ch;
+   char c;
+   
+   if (console_input_len > 0) {
+      ch = console_input_buf[0];
+      memmove(console_input_buf, console_input_buf+1, --console_input_len);
+      return ch;
+   }
+
+   if (read(STDIN_FILENO, &c, 1) == 1) {
+      return c;
+   }
+   return EOF;
+}
+
+static int get_modifiers(int ch)
+{
+   int mod = 0;
+   if (ch >= '2' && ch <= '8') {
+      ch -= '1';
+      if (ch & 1) mod |= MOD_SHIFT;
+      if (ch & 2) mod |= MOD_ALT;
+      if (ch & 4) mod |= MOD_CTRL;
+   }
+   return mod;
+}
+
+static int decode_ext_key(int ch, int key, uint32_t *event)
+{
+   int mod;
+   switch (ch) {
+      case '~':
+         if (key) {
+            *event = KEY_PRESSED(key, 0);
+            ch = EOF;
+         }
+         break;
+      case ';':
+         mod = get_modifiers(get_char());
+         ch = get_char();
+         if (ch == '~') {
+            if (key) {
+               *event = KEY_PRESSED(key, mod);
+               ch = EOF;
+            }
+         }
+         else if (key == 0) {
+            switch (ch) {
+               case 'A': *event = KEY_PRESSED(KEY_UP, mod); ch = EOF; break;
+               case 'B': *event = KEY_PRESSED(KEY_DOWN, mod); ch = EOF; break;
+               case 'C': *event = KEY_PRESSED(KEY_RIGHT, mod); ch = EOF; break;
+               case 'D': *event = KEY_PRESSED(KEY_LEFT, mod); ch = EOF; break;
+               case 'H': *event = KEY_PRESSED(KEY_HOME, mod); ch = EOF; break;
+               case 'F': *event = KEY_PRESSED(KEY_END, mod); ch = EOF; break;
+            }
+         }
+         break;
+   }
+   return ch;
+}
+
+static Value handle_console_resize_event(Heap *heap, Value *error, int wait)
+{
+   struct termios tios;
+   int size, width, height;
+
+   do {
+      native_console_get_size(heap, error, 0, NULL, (void *)0);
+      size = console_size;
+   }
+   while (size == -2);
+
+   if (wait) {
+      if (__sync_fetch_and_and(&console_send_size_event, ~CSSE_NEEDS_RESET) & CSSE_WITH_RESET) {
+         while ((console_send_size_event & CSSE_WAS_RESET) == 0) {
+            #if defined(__APPLE__) || defined(__HAIKU__)
+               sched_yield();
+            #else
+               pthread_yield();
+            #endif
+         }
+      }
+      __sync_fetch_and_and(&console_send_size_event, CSSE_OCCURED);
+   }
+
+   if (tcgetattr(STDOUT_FILENO, &tios) == 0) {
+      tios.c_cc[VMIN] = 1;
+      tios.c_cc[VTIME] = 0;
+      tcsetattr(STDOUT_FILENO, TCSANOW, &tios);
+   }
+
+   width = size & 0xFFFF;
+   height = (size >> 16) & 0xFFFF;
+   if (width > 0x3FFF) width = 0x3FFF;
+   if (height > 0x3FFF) height = 0x3FFF;
+   return fixscript_int((EVENT_CONSOLE_RESIZED << 28) | (width << 14) | height);
+}
+#endif
+
+
+static Value native_console_get_event(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+#if defined(__wasm__)
+   *error = fixscript_create_error_string(heap, "not supported");
+   return fixscript_int(0);
+#else
+   pthread_mutex_t *mutex;
+   uint32_t event = 0;
+   int timeout = -1;
+#ifdef _WIN32
+   HANDLE in, out;
+   CONSOLE_SCREEN_BUFFER_INFO csbi;
+   INPUT_RECORD in_rec;
+   DWORD num_events = 0;
+   BOOL success;
+   int key, mod, override, width, height, last_width=0, last_height=0;
+#else
+   struct termios tios;
+   wchar_t chars[1];
+   char bytes[1];
+   NativeConvertState state;
+   int processed_dest, processed_src;
+   int ch, mod, csse;
+#if !defined(__HAIKU__)
+   locale_t prev_locale = (locale_t)0;
+#endif
+#endif
+
+   if (num_params == 1) {
+      timeout = params[0].value;
+   }
+
+   mutex = get_mutex(&console_mutex);
+   if (!mutex) {
+      *error = fixscript_create_error_string(heap, "can't lock console");
+      return fixscript_int(0);
+   }
+
+   pthread_mutex_lock(mutex);
+   if (!console_active) {
+      pthread_mutex_unlock(mutex);
       *error = fixscript_create_error_string(heap, "console is not active");
       return fixscript_int(0);
    }
 
 #ifdef _WIN32
+   in = GetStdHandle(STD_INPUT_HANDLE);
    out = GetStdHandle(STD_OUTPUT_HANDLE);
-   if (GetConsoleScreenBufferInfo(out, &csbi)) {
-      size.X = csbi.dwSize.X;
-      size.Y = csbi.srWindow.Bottom - csbi.srWindow.Top + 1;
+again:
+   for (;;) {
+      if (GetConsoleScreenBufferInfo(out, &csbi)) {
+         width = csbi.dwSize.X;
+         height = csbi.srWindow.Bottom - csbi.srWindow.Top + 1;
+         last_width = last_csbi.dwSize.X;
+         last_height = last_csbi.srWindow.Bottom - last_csbi.srWindow.Top + 1;
+         last_csbi = csbi;
+      }
+      else {
+         width = 0;
+         height = 0;
+      }
+      if (width != last_width || height != last_height) {
+         if (width < 0) width = 0;
+         if (height < 0) height = 0;
+         if (width > 0x3FFF) width = 0x3FFF;
+         if (height > 0x3FFF) height = 0x3FFF;
+         pthread_mutex_unlock(mutex);
+         return fixscript_int((EVENT_CONSOLE_RESIZED << 28) | (width << 14) | height);
+      }
 
-      len64 = ((int64_t)size.X) * ((int64_t)size.Y) * sizeof(CHAR_INFO);
-      chars = len64 > 0 && len64 <= INT_MAX? malloc(len64) : NULL;
-      if (chars) {
-         for (i=0; i<size.X*size.Y; i++) {
-            chars[i].Char.UnicodeChar = ' ';
-            chars[i].Attributes = 0x07;
+      success = PeekConsoleInput(in, &in_rec, 1, &num_events);
+      if (!success || num_events == 1) break;
+      if (timeout >= 0) {
+         if (timeout < 10) break;
+         Sleep(10);
+         timeout -= 10;
+      }
+   }
+
+   if (success && num_events == 1) {
+      ReadConsoleInput(in, &in_rec, 1, &num_events);
+      if (in_rec.EventType == KEY_EVENT) {
+         if (in_rec.Event.KeyEvent.bKeyDown) {
+            override = 0;
+            key = KEY_NONE;
+            switch (in_rec.Event.KeyEvent.wVirtualKeyCode) {
+               case VK_ESCAPE:             key = KEY_ESCAPE; override = 1; break;
+               case VK_F1:                 key = KEY_F1; break;
+               case VK_F2:                 key = KEY_F2; break;
+               case VK_F3:                 key = KEY_F3; break;
+               case VK_F4:                 key = KEY_F4; break;
+               case VK_F5:                 key = KEY_F5; break;
+               case VK_F6:                 key = KEY_F6; break;
+               case VK_F7:                 key = KEY_F7; break;
+               case VK_F8:                 key = KEY_F8; break;
+               case VK_F9:                 key = KEY_F9; break;
+               case VK_F10:                key = KEY_F10; break;
+               case VK_F11:                key = KEY_F11; break;
+               case VK_F12:                key = KEY_F12; break;
+               //case VK_SNAPSHOT:           key = KEY_PRINT_SCREEN; break;
+               //case VK_SCROLL:             key = KEY_SCROLL_LOCK; break;
+               case VK_PAUSE:              key = KEY_PAUSE; break;
+               case 0xC0:                  key = KEY_GRAVE; break;
+               case '1':                   key = KEY_NUM1; break;
+               case '2':                   key = KEY_NUM2; break;
+               case '3':                   key = KEY_NUM3; break;
+               case '4':                   key = KEY_NUM4; break;
+               case '5':                   key = KEY_NUM5; break;
+               case '6':                   key = KEY_NUM6; break;
+               case '7':                   key = KEY_NUM7; break;
+               case '8':                   key = KEY_NUM8; break;
+               case '9':                   key = KEY_NUM9; break;
+               case '0':                   key = KEY_NUM0; break;
+               case VK_OEM_MINUS:          key = KEY_MINUS; break;
+               case 0xBB:                  key = KEY_EQUAL; break;
+               case VK_BACK:               key = KEY_BACKSPACE; override = 1; break;
+               case VK_TAB:                key = KEY_TAB; override = 1; break;
+               case 'Q':                   key = KEY_Q; break;
+               case 'W':                   key = KEY_W; break;
+               case 'E':                   key = KEY_E; break;
+               case 'R':                   key = KEY_R; break;
+               case 'T':                   key = KEY_T; break;
+               case 'Y':                   key = KEY_Y; break;
+               case 'U':                   key = KEY_U; break;
+               case 'I':                   key = KEY_I; break;
+               case 'O':                   key = KEY_O; break;
+               case 'P':                   key = KEY_P; break;
+               case 0xDB:                  key = KEY_LBRACKET; break;
+               case 0xDD:                  key = KEY_RBRACKET; break;
+               case 0xDC:                  key = KEY_BACKSLASH; break;
+               //case VK_CAPITAL:            key = KEY_CAPS_LOCK; break;
+               case 'A':                   key = KEY_A; break;
+               case 'S':                   key = KEY_S; break;
+               case 'D':                   key = KEY_D; break;
+               case 'F':                   key = KEY_F; break;
+               case 'G':                   key = KEY_G; break;
+               case 'H':                   key = KEY_H; break;
+               case 'J':                   key = KEY_J; break;
+               case 'K':                   key = KEY_K; break;
+               case 'L':                   key = KEY_L; break;
+               case 0xBA:                  key = KEY_SEMICOLON; break;
+               case 0xDE:                  key = KEY_APOSTROPHE; break;
+               case VK_RETURN:             key = KEY_ENTER; override = 1; break;
+               //case VK_SHIFT:              key = KEY_LSHIFT; break;
+               case 'Z':                   key = KEY_Z; break;
+               case 'X':                   key = KEY_X; break;
+               case 'C':                   key = KEY_C; break;
+               case 'V':                   key = KEY_V; break;
+               case 'B':                   key = KEY_B; break;
+               case 'N':                   key = KEY_N; break;
+               case 'M':                   key = KEY_M; break;
+               case VK_OEM_COMMA:          key = KEY_COMMA; break;
+               case VK_OEM_PERIOD:         key = KEY_PERIOD; break;
+               case 0xBF:                  key = KEY_SLASH; break;
+               //case VK_RSHIFT:             key = KEY_RSHIFT; break;
+               //case VK_CONTROL:            key = KEY_LCONTROL; break;
+               case VK_LWIN:               key = KEY_LMETA; break;
+               //case VK_MENU:               key = KEY_LALT; break;
+               case VK_SPACE:              key = KEY_SPACE; break;
+               //case VK_RALT:               key = KEY_RALT; break;
+               case VK_RWIN:               key = KEY_RMETA; break;
+               case 0x5D:                  key = KEY_RMENU; break;
+               //case VK_RCONTROL:           key = KEY_RCONTROL; break;
+               case VK_INSERT:             key = KEY_INSERT; break;
+               case VK_DELETE:             key = KEY_DELETE; break;
+               case VK_HOME:               key = KEY_HOME; break;
+               case VK_END:                key = KEY_END; break;
+               case VK_PRIOR:              key = KEY_PAGE_UP; break;
+               case VK_NEXT:               key = KEY_PAGE_DOWN; break;
+               case VK_LEFT:               key = KEY_LEFT; break;
+               case VK_UP:                 key = KEY_UP; break;
+               case VK_RIGHT:              key = KEY_RIGHT; break;
+               case VK_DOWN:               key = KEY_DOWN; break;
+               //case VK_NUMLOCK:            key = KEY_NUM_LOCK; break;
+               case 0x6F:                  key = KEY_NUMPAD_SLASH; break;
+               case 0x6A:                  key = KEY_NUMPAD_STAR; break;
+               case 0x6D:                  key = KEY_NUMPAD_MINUS; break;
+               case 0x6B:                  key = KEY_NUMPAD_PLUS; break;
+               //case VK_NUMPAD_ENTER:       key = KEY_NUMPAD_ENTER; break;
+               case 0x6E:                  key = KEY_NUMPAD_DOT; break;
+               case VK_NUMPAD0:            key = KEY_NUMPAD0; break;
+               case VK_NUMPAD1:            key = KEY_NUMPAD1; break;
+               case VK_NUMPAD2:            key = KEY_NUMPAD2; break;
+               case VK_NUMPAD3:            key = KEY_NUMPAD3; break;
+               case VK_NUMPAD4:            key = KEY_NUMPAD4; break;
+               case VK_NUMPAD5:            key = KEY_NUMPAD5; break;
+               case VK_NUMPAD6:            key = KEY_NUMPAD6; break;
+               case VK_NUMPAD7:            key = KEY_NUMPAD7; break;
+               case VK_NUMPAD8:            key = KEY_NUMPAD8; break;
+               case VK_NUMPAD9:            key = KEY_NUMPAD9; break;
+            }
+            mod = 0;
+            if (in_rec.Event.KeyEvent.dwControlKeyState & (LEFT_CTRL_PRESSED | RIGHT_CTRL_PRESSED)) mod |= MOD_CTRL;
+            if (in_rec.Event.KeyEvent.dwControlKeyState & (LEFT_ALT_PRESSED | RIGHT_ALT_PRESSED)) mod |= MOD_ALT;
+            if (in_rec.Event.KeyEvent.dwControlKeyState & SHIFT_PRESSED) mod |= MOD_SHIFT;
+            if (in_rec.Event.KeyEvent.uChar.UnicodeChar != 0 && (mod & (MOD_CTRL | MOD_ALT)) == 0 && !override) {
+               event = (EVENT_CHAR_TYPED << 28) | (in_rec.Event.KeyEvent.uChar.UnicodeChar & 0x0FFFFFFF);
+            }
+            else if (key) {
+               event = KEY_PRESSED(key, mod);
+            }
+            else if (timeout != 0) {
+               goto again;
+            }
+         }
+         else if (timeout != 0) {
+            goto again;
          }
-         coord.X = 0;
-         coord.Y = 0;
-         rect.Left = 0;
-         rect.Top = csbi.dwSize.Y - (csbi.srWindow.Bottom - csbi.srWindow.Top + 1);
-         rect.Right = rect.Left+size.X-1;
-         rect.Bottom = rect.Top+size.Y-1;
-         csbi.dwCursorPosition.X = rect.Left;
-         csbi.dwCursorPosition.Y = rect.Top;
-         WriteConsoleOutput(out, chars, size, coord, &rect);
-         SetConsoleCursorPosition(out, csbi.dwCursorPosition);
-         free(chars);
+      }
+      else if (timeout != 0) {
+         goto again;
       }
    }
 #else
-   fprintf(stdout, "\e[1;1H\e[2J");
-   console_flush();
-#endif
-
-   pthread_mutex_unlock(mutex);
-   return fixscript_int(0);
-#endif /* __wasm__ */
-}
-
-
-static Value native_console_put_text(Heap *heap, Value *error, int num_params, Value *params, void *data)
-{
-#if defined(__wasm__)
-   *error = fixscript_create_error_string(heap, "not supported");
-   return fixscript_int(0);
-#else
-   pthread_mutex_t *mutex;
-   union {
-      uint8_t *u8;
-      uint16_t *u16;
-      int32_t *s32;
-   } u;
-#ifdef _WIN32
-   CHAR_INFO *chars;
-   HANDLE out;
-   CONSOLE_SCREEN_BUFFER_INFO csbi;
-   COORD size, coord;
-   SMALL_RECT rect;
-   int64_t len64;
-   int ch;
-#else
-#if !defined(__HAIKU__)
-   locale_t prev_locale = (locale_t)0;
-#endif
-   NativeConvertState state;
-   wchar_t buf[128];
-   char charbuf[128*4];
-   int buf_cap = sizeof(buf) / sizeof(wchar_t) - 1;
-   int processed_dest, processed_src;
-   int j, cnt, bp;
-#endif
-   int i, err, off, len, elem_size;
+   fflush(stdout);
 
-   mutex = get_mutex(&console_mutex);
-   if (!mutex) {
-      *error = fixscript_create_error_string(heap, "can't lock console");
-      return fixscript_int(0);
+   if (__sync_fetch_and_and(&console_send_size_event, ~CSSE_OCCURED) & CSSE_OCCURED) {
+      pthread_mutex_unlock(mutex);
+      return handle_console_resize_event(heap, error, 0);
    }
 
-   pthread_mutex_lock(mutex);
-   if (!console_active) {
+   if (tcgetattr(STDOUT_FILENO, &tios) != 0) {
       pthread_mutex_unlock(mutex);
-      *error = fixscript_create_error_string(heap, "console is not active");
+      *error = fixscript_create_error_string(heap, "I/O error");
       return fixscript_int(0);
    }
 
-   if (num_params == 1) {
-      off = 0;
-      err = fixscript_get_array_length(heap, params[0], &len);
-      if (err) {
-         pthread_mutex_unlock(mutex);
-         return fixscript_error(heap, error, err);
-      }
-   }
-   else {
-      off = params[1].value;
-      len = params[2].value;
+   if (timeout > 0 && timeout < 10) {
+      timeout = 10;
    }
 
-#ifdef _WIN32
-   err = fixscript_get_array_element_size(heap, params[0], &elem_size);
-   if (!err) {
-      err = fixscript_lock_array(heap, params[0], off, len, (void **)&u.u8, elem_size, ACCESS_READ_ONLY);
-   }
-   if (err) {
-      pthread_mutex_unlock(mutex);
-      return fixscript_error(heap, error, err);
+   if (timeout >= 0) {
+      tios.c_cc[VMIN] = 0;
+      tios.c_cc[VTIME] = timeout / 100;
+      tcsetattr(STDOUT_FILENO, TCSANOW, &tios);
    }
 
-   if (len > 0) {
-      len64 = ((int64_t)len) * sizeof(CHAR_INFO);
-      chars = len64 <= INT_MAX? malloc(len64) : NULL;
-      if (!chars) {
-         fixscript_unlock_array(heap, params[0], off, len, (void **)&u.u8, elem_size, ACCESS_READ_ONLY);
+   for (;;) {
+      csse = console_send_size_event;
+      if (csse & CSSE_OCCURED) {
+         if (!__sync_bool_compare_and_swap(&console_send_size_event, csse, csse & ~CSSE_OCCURED)) continue;
          pthread_mutex_unlock(mutex);
-         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+         return handle_console_resize_event(heap, error, 0);
+      }
+      else {
+         if (!__sync_bool_compare_and_swap(&console_send_size_event, csse, csse | CSSE_NEEDS_RESET)) continue;
+         break;
       }
+   }
 
-      if (elem_size == 1) {
-         for (i=0; i<len; i++) {
-            chars[i].Char.UnicodeChar = u.u8[i];
-            chars[i].Attributes = console_cur_attr;
+   ch = get_char();
+   if (ch == EOF && __sync_fetch_and_and(&console_send_size_event, ~CSSE_OCCURED) & CSSE_OCCURED) {
+      pthread_mutex_unlock(mutex);
+      return handle_console_resize_event(heap, error, 1);
+   }
+   if (ch == EOF && timeout > 0 && timeout < 100) {
+      while (timeout >= 10) {
+         usleep(10*1000);
+         timeout -= 10;
+         ch = get_char();
+         if (ch == EOF && __sync_fetch_and_and(&console_send_size_event, ~CSSE_OCCURED) & CSSE_OCCURED) {
+            pthread_mutex_unlock(mutex);
+            return handle_console_resize_event(heap, error, 1);
          }
+         if (ch != EOF) break;
       }
-      else if (elem_size == 2) {
-         for (i=0; i<len; i++) {
-            chars[i].Char.UnicodeChar = u.u16[i];
-            chars[i].Attributes = console_cur_attr;
+   }
+
+   if (ch == 27) {
+      tios.c_cc[VMIN] = 0;
+      tios.c_cc[VTIME] = 0;
+      tcsetattr(STDOUT_FILENO, TCSANOW, &tios);
+      ch = get_char();
+      if (ch == EOF) {
+         if (__sync_fetch_and_and(&console_send_size_event, ~CSSE_OCCURED) & CSSE_OCCURED) {
+            pthread_mutex_unlock(mutex);
+            return handle_console_resize_event(heap, error, 1);
+         }
+         usleep(10*1000);
+         ch = get_char();
+         tios.c_cc[VMIN] = 1;
+         tios.c_cc[VTIME] = 0;
+         tcsetattr(STDOUT_FILENO, TCSANOW, &tios);
+         if (ch == EOF) {
+            if (__sync_fetch_and_and(&console_send_size_event, ~CSSE_OCCURED) & CSSE_OCCURED) {
+               pthread_mutex_unlock(mutex);
+               return handle_console_resize_event(heap, error, 1);
+            }
+            ch = 27;
          }
       }
       else {
-         for (i=0; i<len; i++) {
-            ch = u.s32[i];
-            if (ch < 0 || ch > 0xFFFF) {
-               ch = 0xFFFD;
+         tios.c_cc[VMIN] = 1;
+         tios.c_cc[VTIME] = 0;
+         tcsetattr(STDOUT_FILENO, TCSANOW, &tios);
+      }
+      switch (ch) {
+         case 'O':
+            switch ((ch = get_char())) {
+               case 'P': event = KEY_PRESSED(KEY_F1, 0); ch = EOF; break;
+               case 'Q': event = KEY_PRESSED(KEY_F2, 0); ch = EOF; break;
+               case 'R': event = KEY_PRESSED(KEY_F3, 0); ch = EOF; break;
+               case 'S': event = KEY_PRESSED(KEY_F4, 0); ch = EOF; break;
+
+               case '2': case '3': case '4': case '5': case '6': case '7': case '8':
+                  mod = get_modifiers(ch);
+                  switch ((ch = get_char())) {
+                     case 'P': event = KEY_PRESSED(KEY_F1, mod); ch = EOF; break;
+                     case 'Q': event = KEY_PRESSED(KEY_F2, mod); ch = EOF; break;
+                     case 'R': event = KEY_PRESSED(KEY_F3, mod); ch = EOF; break;
+                     case 'S': event = KEY_PRESSED(KEY_F4, mod); ch = EOF; break;
+                  }
+                  break;
+
+               case 'M': event = KEY_PRESSED(KEY_ENTER, MOD_SHIFT); ch = EOF; break;
+
+               case EOF: ch = 'O'; break;
+            }
+            break;
+
+         case '[':
+            switch ((ch = get_char())) {
+               case '1':
+                  switch ((ch = get_char())) {
+                     case '1': ch = decode_ext_key(get_char(), KEY_F1, &event); break;
+                     case '2': ch = decode_ext_key(get_char(), KEY_F2, &event); break;
+                     case '3': ch = decode_ext_key(get_char(), KEY_F3, &event); break;
+                     case '4': ch = decode_ext_key(get_char(), KEY_F4, &event); break;
+                     case '5': ch = decode_ext_key(get_char(), KEY_F5, &event); break;
+                     case '7': ch = decode_ext_key(get_char(), KEY_F6, &event); break;
+                     case '8': ch = decode_ext_key(get_char(), KEY_F7, &event); break;
+                     case '9': ch = decode_ext_key(get_char(), KEY_F8, &event); break;
+                     case '~': case ';': ch = decode_ext_key(ch, KEY_HOME, &event); break;
+                  }
+                  break;
+               case '2':
+                  switch ((ch = get_char())) {
+                     case '0': ch = decode_ext_key(get_char(), KEY_F9, &event); break;
+                     case '1': ch = decode_ext_key(get_char(), KEY_F10, &event); break;
+                     case '3': ch = decode_ext_key(get_char(), KEY_F11, &event); break;
+                     case '4': ch = decode_ext_key(get_char(), KEY_F12, &event); break;
+                     case '~': case ';': ch = decode_ext_key(ch, KEY_INSERT, &event); break;
+                  }
+                  break;
+               case '3': ch = decode_ext_key(get_char(), KEY_DELETE, &event); break;
+               case '4':
+                  switch ((ch = get_char())) {
+                     case '~': case ';': ch = decode_ext_key(ch, KEY_END, &event); break;
+                  }
+                  break;
+               case '5': ch = decode_ext_key(get_char(), KEY_PAGE_UP, &event); break;
+               case '6': ch = decode_ext_key(get_char(), KEY_PAGE_DOWN, &event); break;
+               case 'A': event = KEY_PRESSED(KEY_UP, 0); ch = EOF; break;
+               case 'B': event = KEY_PRESSED(KEY_DOWN, 0); ch = EOF; break;
+               case 'C': event = KEY_PRESSED(KEY_RIGHT, 0); ch = EOF; break;
+               case 'D': event = KEY_PRESSED(KEY_LEFT, 0); ch = EOF; break;
+               case 'H': event = KEY_PRESSED(KEY_HOME, 0); ch = EOF; break;
+               case 'F': event = KEY_PRESSED(KEY_END, 0); ch = EOF; break;
+               case 'Z': event = KEY_PRESSED(KEY_TAB, MOD_SHIFT); ch = EOF; break;
+               case EOF: ch = '['; break;
             }
-            chars[i].Char.UnicodeChar = ch;
-            chars[i].Attributes = console_cur_attr;
-         }
+            break;
+
+         case '\n': event = KEY_PRESSED(KEY_ENTER, MOD_ALT); ch = EOF; break;
       }
-      
-      out = GetStdHandle(STD_OUTPUT_HANDLE);
-      if (GetConsoleScreenBufferInfo(out, &csbi)) {
-         size.X = len;
-         size.Y = 1;
-         coord.X = 0;
-         coord.Y = 0;
-         rect.Left = csbi.dwCursorPosition.X;
-         rect.Top = csbi.dwCursorPosition.Y;
-         rect.Right = rect.Left+len-1;
-         rect.Bottom = rect.Top;
-         WriteConsoleOutput(out, chars, size, coord, &rect);
+      if (event == 0) {
+         switch (ch) {
+            case 'q':  event = KEY_PRESSED(KEY_Q, MOD_ALT); ch = EOF; break;
+            case 'w':  event = KEY_PRESSED(KEY_W, MOD_ALT); ch = EOF; break;
+            case 'e':  event = KEY_PRESSED(KEY_E, MOD_ALT); ch = EOF; break;
+            case 'r':  event = KEY_PRESSED(KEY_R, MOD_ALT); ch = EOF; break;
+            case 't':  event = KEY_PRESSED(KEY_T, MOD_ALT); ch = EOF; break;
+            case 'y':  event = KEY_PRESSED(KEY_Y, MOD_ALT); ch = EOF; break;
+            case 'u':  event = KEY_PRESSED(KEY_U, MOD_ALT); ch = EOF; break;
+            case 'i':  event = KEY_PRESSED(KEY_I, MOD_ALT); ch = EOF; break;
+            case 'o':  event = KEY_PRESSED(KEY_O, MOD_ALT); ch = EOF; break;
+            case 'p':  event = KEY_PRESSED(KEY_P, MOD_ALT); ch = EOF; break;
+            case '[':  event = KEY_PRESSED(KEY_LBRACKET, MOD_ALT); ch = EOF; break;
+            case ']':  event = KEY_PRESSED(KEY_RBRACKET, MOD_ALT); ch = EOF; break;
+            case '\\': event = KEY_PRESSED(KEY_BACKSLASH, MOD_ALT); ch = EOF; break;
+            case 'a':  event = KEY_PRESSED(KEY_A, MOD_ALT); ch = EOF; break;
+            case 's':  event = KEY_PRESSED(KEY_S, MOD_ALT); ch = EOF; break;
+            case 'd':  event = KEY_PRESSED(KEY_D, MOD_ALT); ch = EOF; break;
+            case 'f':  event = KEY_PRESSED(KEY_F, MOD_ALT); ch = EOF; break;
+            case 'g':  event = KEY_PRESSED(KEY_G, MOD_ALT); ch = EOF; break;
+            case 'h':  event = KEY_PRESSED(KEY_H, MOD_ALT); ch = EOF; break;
+            case 'j':  event = KEY_PRESSED(KEY_J, MOD_ALT); ch = EOF; break;
+            case 'k':  event = KEY_PRESSED(KEY_K, MOD_ALT); ch = EOF; break;
+            case 'l':  event = KEY_PRESSED(KEY_L, MOD_ALT); ch = EOF; break;
+            case ';':  event = KEY_PRESSED(KEY_SEMICOLON, MOD_ALT); ch = EOF; break;
+            case '\'': event = KEY_PRESSED(KEY_APOSTROPHE, MOD_ALT); ch = EOF; break;
+            case 'z':  event = KEY_PRESSED(KEY_Z, MOD_ALT); ch = EOF; break;
+            case 'x':  event = KEY_PRESSED(KEY_X, MOD_ALT); ch = EOF; break;
+            case 'c':  event = KEY_PRESSED(KEY_C, MOD_ALT); ch = EOF; break;
+            case 'v':  event = KEY_PRESSED(KEY_V, MOD_ALT); ch = EOF; break;
+            case 'b':  event = KEY_PRESSED(KEY_B, MOD_ALT); ch = EOF; break;
+            case 'n':  event = KEY_PRESSED(KEY_N, MOD_ALT); ch = EOF; break;
+            case 'm':  event = KEY_PRESSED(KEY_M, MOD_ALT); ch = EOF; break;
+            case ',':  event = KEY_PRESSED(KEY_COMMA, MOD_ALT); ch = EOF; break;
+            case '.':  event = KEY_PRESSED(KEY_PERIOD, MOD_ALT); ch = EOF; break;
+            case '/':  event = KEY_PRESSED(KEY_SLASH, MOD_ALT); ch = EOF; break;
 
-         csbi.dwCursorPosition.X += len;
-         if (csbi.dwCursorPosition.X >= csbi.dwSize.X) {
-            csbi.dwCursorPosition.X = csbi.dwSize.X-1;
+            case 'Q':  event = KEY_PRESSED(KEY_Q, MOD_ALT | MOD_SHIFT); ch = EOF; break;
+            case 'W':  event = KEY_PRESSED(KEY_W, MOD_ALT | MOD_SHIFT); ch = EOF; break;
+            case 'E':  event = KEY_PRESSED(KEY_E, MOD_ALT | MOD_SHIFT); ch = EOF; break;
+            case 'R':  event = KEY_PRESSED(KEY_R, MOD_ALT | MOD_SHIFT); ch = EOF; break;
+            case 'T':  event = KEY_PRESSED(KEY_T, MOD_ALT | MOD_SHIFT); ch = EOF; break;
+            case 'Y':  event = KEY_PRESSED(KEY_Y, MOD_ALT | MOD_SHIFT); ch = EOF; break;
+            case 'U':  event = KEY_PRESSED(KEY_U, MOD_ALT | MOD_SHIFT); ch = EOF; break;
+            case 'I':  event = KEY_PRESSED(KEY_I, MOD_ALT | MOD_SHIFT); ch = EOF; break;
+            case 'O':  event = KEY_PRESSED(KEY_O, MOD_ALT | MOD_SHIFT); ch = EOF; break;
+            case 'P':  event = KEY_PRESSED(KEY_P, MOD_ALT | MOD_SHIFT); ch = EOF; break;
+            case '{':  event = KEY_PRESSED(KEY_LBRACKET, MOD_ALT | MOD_SHIFT); ch = EOF; break;
+            case '}':  event = KEY_PRESSED(KEY_RBRACKET, MOD_ALT | MOD_SHIFT); ch = EOF; break;
+            case '|':  event = KEY_PRESSED(KEY_BACKSLASH, MOD_ALT | MOD_SHIFT); ch = EOF; break;
+            case 'A':  event = KEY_PRESSED(KEY_A, MOD_ALT | MOD_SHIFT); ch = EOF; break;
+            case 'S':  event = KEY_PRESSED(KEY_S, MOD_ALT | MOD_SHIFT); ch = EOF; break;
+            case 'D':  event = KEY_PRESSED(KEY_D, MOD_ALT | MOD_SHIFT); ch = EOF; break;
+            case 'F':  event = KEY_PRESSED(KEY_F, MOD_ALT | MOD_SHIFT); ch = EOF; break;
+            case 'G':  event = KEY_PRESSED(KEY_G, MOD_ALT | MOD_SHIFT); ch = EOF; break;
+            case 'H':  event = KEY_PRESSED(KEY_H, MOD_ALT | MOD_SHIFT); ch = EOF; break;
+            case 'J':  event = KEY_PRESSED(KEY_J, MOD_ALT | MOD_SHIFT); ch = EOF; break;
+            case 'K':  event = KEY_PRESSED(KEY_K, MOD_ALT | MOD_SHIFT); ch = EOF; break;
+            case 'L':  event = KEY_PRESSED(KEY_L, MOD_ALT | MOD_SHIFT); ch = EOF; break;
+            case ':':  event = KEY_PRESSED(KEY_SEMICOLON, MOD_ALT | MOD_SHIFT); ch = EOF; break;
+            case '"':  event = KEY_PRESSED(KEY_APOSTROPHE, MOD_ALT | MOD_SHIFT); ch = EOF; break;
+            case 'Z':  event = KEY_PRESSED(KEY_Z, MOD_ALT | MOD_SHIFT); ch = EOF; break;
+            case 'X':  event = KEY_PRESSED(KEY_X, MOD_ALT | MOD_SHIFT); ch = EOF; break;
+            case 'C':  event = KEY_PRESSED(KEY_C, MOD_ALT | MOD_SHIFT); ch = EOF; break;
+            case 'V':  event = KEY_PRESSED(KEY_V, MOD_ALT | MOD_SHIFT); ch = EOF; break;
+            case 'B':  event = KEY_PRESSED(KEY_B, MOD_ALT | MOD_SHIFT); ch = EOF; break;
+            case 'N':  event = KEY_PRESSED(KEY_N, MOD_ALT | MOD_SHIFT); ch = EOF; break;
+            case 'M':  event = KEY_PRESSED(KEY_M, MOD_ALT | MOD_SHIFT); ch = EOF; break;
+            case '<':  event = KEY_PRESSED(KEY_COMMA, MOD_ALT | MOD_SHIFT); ch = EOF; break;
+            case '>':  event = KEY_PRESSED(KEY_PERIOD, MOD_ALT | MOD_SHIFT); ch = EOF; break;
+            case '?':  event = KEY_PRESSED(KEY_SLASH, MOD_ALT | MOD_SHIFT); ch = EOF; break;
          }
-         SetConsoleCursorPosition(out, csbi.dwCursorPosition);
       }
-
-      free(chars);
    }
 
-   fixscript_unlock_array(heap, params[0], off, len, (void **)&u.u8, elem_size, ACCESS_READ_ONLY);
-#else
-   err = fixscript_get_array_element_size(heap, params[0], &elem_size);
-   if (!err) {
-      err = fixscript_lock_array(heap, params[0], off, len, (void **)&u.u8, elem_size, ACCESS_READ_ONLY);
-   }
-   if (err) {
-      pthread_mutex_unlock(mutex);
-      return fixscript_error(heap, error, err);
+   if (__sync_fetch_and_and(&console_send_size_event, ~CSSE_NEEDS_RESET) & CSSE_WITH_RESET) {
+      while ((console_send_size_event & CSSE_WAS_RESET) == 0) {
+         #if defined(__APPLE__) || defined(__HAIKU__)
+            sched_yield();
+         #else
+            pthread_yield();
+         #endif
+      }
    }
+   __sync_fetch_and_and(&console_send_size_event, CSSE_OCCURED);
 
-   #if !defined(__HAIKU__)
-      if (!native_charset_utf8) {
-         prev_locale = uselocale(cur_locale);
-      }
-   #endif
-   memset(&state, 0, sizeof(NativeConvertState));
+   tios.c_cc[VMIN] = 1;
+   tios.c_cc[VTIME] = 0;
+   tcsetattr(STDOUT_FILENO, TCSANOW, &tios);
 
-   for (i=0; i<len; ) {
-      cnt = len - i;
-      if (cnt > buf_cap) {
-         cnt = buf_cap;
-      }
+   if (ch != EOF) {
+      switch (ch) {
+         case 27:   event = KEY_PRESSED(KEY_ESCAPE, 0); break;
+         case 127:  event = KEY_PRESSED(KEY_BACKSPACE, 0); break;
 
-      if (elem_size == 1) {
-         for (j=0; j<cnt; j++) {
-            buf[j] = u.u8[i+j];
-         }
-      }
-      else if (elem_size == 2) {
-         for (j=0; j<cnt; j++) {
-            buf[j] = u.u16[i+j];
-         }
-      }
-      else if (elem_size == 4) {
-         for (j=0; j<cnt; j++) {
-            #if WCHAR_MAX <= 0xFFFF
-               buf[j] = (u.s32[i+j] < 0 || u.s32[i+j] > 0xFFFF)? 0xFFFD : u.s32[i+j];
-            #else
-               buf[j] = u.s32[i+j];
-            #endif
-         }
-      }
+         case '\t': event = KEY_PRESSED(KEY_TAB, 0); break;
+         case 17:   event = KEY_PRESSED(KEY_Q, MOD_CTRL); break;
+         case 23:   event = KEY_PRESSED(KEY_W, MOD_CTRL); break;
+         case 5:    event = KEY_PRESSED(KEY_E, MOD_CTRL); break;
+         case 18:   event = KEY_PRESSED(KEY_R, MOD_CTRL); break;
+         case 20:   event = KEY_PRESSED(KEY_T, MOD_CTRL); break;
+         case 25:   event = KEY_PRESSED(KEY_Y, MOD_CTRL); break;
+         case 21:   event = KEY_PRESSED(KEY_U, MOD_CTRL); break;
+         case 15:   event = KEY_PRESSED(KEY_O, MOD_CTRL); break;
+         case 16:   event = KEY_PRESSED(KEY_P, MOD_CTRL); break;
+         case 29:   event = KEY_PRESSED(KEY_RBRACKET, MOD_CTRL); break;
+         case 28:   event = KEY_PRESSED(KEY_BACKSLASH, MOD_CTRL); break;
 
-      for (j=0; j<cnt; j++) {
-         if (buf[j] >= 0 && buf[j] < 32) {
-            buf[j] = '?';
-         }
-      }
+         case 1:    event = KEY_PRESSED(KEY_A, MOD_CTRL); break;
+         case 19:   event = KEY_PRESSED(KEY_S, MOD_CTRL); break;
+         case 4:    event = KEY_PRESSED(KEY_D, MOD_CTRL); break;
+         case 6:    event = KEY_PRESSED(KEY_F, MOD_CTRL); break;
+         case 7:    event = KEY_PRESSED(KEY_G, MOD_CTRL); break;
+         case 8:    event = KEY_PRESSED(KEY_H, MOD_CTRL); break;
+         case 11:   event = KEY_PRESSED(KEY_K, MOD_CTRL); break;
+         case 12:   event = KEY_PRESSED(KEY_L, MOD_CTRL); break;
+         case '\n': event = KEY_PRESSED(KEY_ENTER, 0); break;
 
-      bp = 0;
-      for (;;) {
-         convert_to_native(charbuf, sizeof(charbuf)-1, buf + bp, cnt - bp, &state, &processed_dest, &processed_src);
-         if (processed_dest == 0 && processed_src == 0) break;
-         charbuf[processed_dest] = 0;
-         fputs(charbuf, stdout);
-         bp += processed_src;
+         case 26:   event = KEY_PRESSED(KEY_Z, MOD_CTRL); break;
+         case 24:   event = KEY_PRESSED(KEY_X, MOD_CTRL); break;
+         case 3:    event = KEY_PRESSED(KEY_C, MOD_CTRL); break;
+         case 22:   event = KEY_PRESSED(KEY_V, MOD_CTRL); break;
+         case 2:    event = KEY_PRESSED(KEY_B, MOD_CTRL); break;
+         case 14:   event = KEY_PRESSED(KEY_N, MOD_CTRL); break;
+         case 31:   event = KEY_PRESSED(KEY_SLASH, MOD_CTRL); break;
+
+         case 0:    event = KEY_PRESSED(KEY_SPACE, MOD_CTRL); break;
+
+         default:
+            #if !defined(__HAIKU__)
+               if (!native_charset_utf8) {
+                  prev_locale = uselocale(cur_locale);
+               }
+            #endif
+            memset(&state, 0, sizeof(NativeConvertState));
+            for (;;) {
+               bytes[0] = ch;
+               convert_from_native(chars, 1, bytes, 1, &state, &processed_dest, &processed_src);
+               if (processed_dest == 1 || processed_src != 1) break;
+               ch = get_char();
+            }
+            if (chars[0]) {
+               event = (EVENT_CHAR_TYPED << 28) | (chars[0] & 0x0FFFFFFF);
+            }
+            #if !defined(__HAIKU__)
+               if (!native_charset_utf8) {
+                  uselocale(prev_locale);
+               }
+            #endif
       }
-      i += cnt;
    }
-   
-   #if !defined(__HAIKU__)
-      if (!native_charset_utf8) {
-         uselocale(prev_locale);
-      }
-   #endif
-   fixscript_unlock_array(heap, params[0], off, len, (void **)&u.u8, elem_size, ACCESS_READ_ONLY);
-   console_flush();
 #endif
 
    pthread_mutex_unlock(mutex);
-   return fixscript_int(0);
+   return fixscript_int(event);
 #endif /* __wasm__ */
 }
 
 
-static Value native_console_set_color(Heap *heap, Value *error, int num_params, Value *params, void *data)
+#ifdef FIXIO_SQLITE
+
+static void *sqlite_handle_func(Heap *heap, int op, void *p1, void *p2)
+{
+   SQLiteHandle *handle = p1;
+   switch (op) {
+      case HANDLE_OP_FREE:
+         if (handle->db) {
+            sqlite3_close_v2(handle->db);
+         }
+         free(handle);
+         break;
+   }
+   return NULL;
+}
+
+
+static void *sqlite_stmt_handle_func(Heap *heap, int op, void *p1, void *p2)
+{
+   SQLiteStatementHandle *handle = p1;
+   switch (op) {
+      case HANDLE_OP_FREE:
+         if (handle->stmt) {
+            sqlite3_finalize(handle->stmt);
+         }
+         free(handle);
+         break;
+   }
+   return NULL;
+}
+
+
+static SQLiteHandle *get_sqlite_handle(Heap *heap, Value *error, Value handle_val)
 {
-#if defined(__wasm__)
-   *error = fixscript_create_error_string(heap, "not supported");
-   return fixscript_int(0);
-#else
-   int reset = (intptr_t)data;
-   pthread_mutex_t *mutex;
-   int background = 0, foreground = 0;
+   SQLiteHandle *handle;
 
-   if (!reset) {
-      background = params[0].value;
-      foreground = params[1].value;
-      if (background < 0 || background > 15 || foreground < 0 || foreground > 15) {
-         *error = fixscript_create_error_string(heap, "invalid color value");
-         return fixscript_int(0);
-      }
+   handle = fixscript_get_handle(heap, handle_val, HANDLE_TYPE_SQLITE, NULL);
+   if (!handle) {
+      *error = fixscript_create_error_string(heap, "invalid SQLite database handle");
+      return NULL;
    }
 
-   mutex = get_mutex(&console_mutex);
-   if (!mutex) {
-      *error = fixscript_create_error_string(heap, "can't lock console");
-      return fixscript_int(0);
+   if (!handle->db) {
+      *error = fixscript_create_error_string(heap, "SQLite database is already closed");
+      return NULL;
    }
+   return handle;
+}
 
-   pthread_mutex_lock(mutex);
-   if (!console_active) {
-      pthread_mutex_unlock(mutex);
-      *error = fixscript_create_error_string(heap, "console is not active");
-      return fixscript_int(0);
+
+static SQLiteStatementHandle *get_sqlite_stmt_handle(Heap *heap, Value *error, Value handle_val)
+{
+   SQLiteStatementHandle *handle;
+
+   handle = fixscript_get_handle(heap, handle_val, HANDLE_TYPE_SQLITE_STMT, NULL);
+   if (!handle) {
+      *error = fixscript_create_error_string(heap, "invalid SQLite statement handle");
+      return NULL;
    }
 
-#ifdef _WIN32
-   if (reset) {
-      console_cur_attr = 0x07;
+   if (!handle->stmt) {
+      *error = fixscript_create_error_string(heap, "SQLite statement is already closed");
+      return NULL;
    }
-   else {
-      console_cur_attr = (background << 4) | foreground;
+   return handle;
+}
+
+
+static Value native_sqlite_is_present(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+   return fixscript_int(1);
+}
+
+
+static Value native_sqlite_open(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+   SQLiteHandle *handle = NULL;
+   Value ret = fixscript_int(0);
+   char *fname = NULL;
+   int err;
+
+   handle = calloc(1, sizeof(SQLiteHandle));
+   if (!handle) {
+      fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      goto error;
    }
-#else
-   if (reset) {
-      fprintf(stdout, "\e[0m");
+
+   err = fixscript_get_string(heap, params[0], 0, -1, &fname, NULL);
+   if (err) {
+      fixscript_error(heap, error, err);
+      goto error;
    }
-   else {
-      switch (background) {
-         case  0: background = 40; break;
-         case  1: background = 44; break;
-         case  2: background = 42; break;
-         case  3: background = 46; break;
-         case  4: background = 41; break;
-         case  5: background = 45; break;
-         case  6: background = 43; break;
-         case  7: background = 47; break;
-         case  8: background = 100; break;
-         case  9: background = 104; break;
-         case 10: background = 102; break;
-         case 11: background = 106; break;
-         case 12: background = 101; break;
-         case 13: background = 105; break;
-         case 14: background = 103; break;
-         case 15: background = 107; break;
-      }
-      switch (foreground) {
-         case  0: foreground = 30; break;
-         case  1: foreground = 34; break;
-         case  2: foreground = 32; break;
-         case  3: foreground = 36; break;
-         case  4: foreground = 31; break;
-         case  5: foreground = 35; break;
-         case  6: foreground = 33; break;
-         case  7: foreground = 37; break;
-         case  8: foreground = 90; break;
-         case  9: foreground = 94; break;
-         case 10: foreground = 92; break;
-         case 11: foreground = 96; break;
-         case 12: foreground = 91; break;
-         case 13: foreground = 95; break;
-         case 14: foreground = 93; break;
-         case 15: foreground = 97; break;
-      }
-      fprintf(stdout, "\e[%d;%dm", foreground, background);
+
+   err = sqlite3_open(fname, &handle->db);
+   if (err) {
+      *error = fixscript_create_error_string(heap, sqlite3_errmsg(handle->db));
+      sqlite3_close_v2(handle->db);
+      goto error;
+   }
+   
+   ret = fixscript_create_value_handle(heap, HANDLE_TYPE_SQLITE, handle, sqlite_handle_func);
+   handle = NULL;
+   if (!ret.value) {
+      fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      goto error;
    }
-   console_flush();
-#endif
 
-   pthread_mutex_unlock(mutex);
-   return fixscript_int(0);
-#endif /* __wasm__ */
+error:
+   free(handle);
+   free(fname);
+   return ret;
 }
 
 
-static Value native_console_scroll(Heap *heap, Value *error, int num_params, Value *params, void *data)
+static Value native_sqlite_close(Heap *heap, Value *error, int num_params, Value *params, void *data)
 {
-#if defined(__wasm__)
-   *error = fixscript_create_error_string(heap, "not supported");
-   return fixscript_int(0);
-#else
-   int rel_y = params[0].value;
-   pthread_mutex_t *mutex;
-#ifdef _WIN32
-   HANDLE out;
-   CONSOLE_SCREEN_BUFFER_INFO csbi;
-   SMALL_RECT rect;
-   COORD origin;
-   CHAR_INFO fill;
-   int x, y, w, h, base_y;
-#endif
+   SQLiteHandle *handle;
+   int err;
 
-   mutex = get_mutex(&console_mutex);
-   if (!mutex) {
-      *error = fixscript_create_error_string(heap, "can't lock console");
+   handle = get_sqlite_handle(heap, error, params[0]);
+   if (!handle) {
       return fixscript_int(0);
    }
 
-   pthread_mutex_lock(mutex);
-   if (!console_active) {
-      pthread_mutex_unlock(mutex);
-      *error = fixscript_create_error_string(heap, "console is not active");
+   err = sqlite3_close_v2(handle->db);
+   handle->db = NULL;
+   if (err) {
+      *error = fixscript_create_error_string(heap, sqlite3_errmsg(handle->db));
       return fixscript_int(0);
    }
+   return fixscript_int(0);
+}
 
-#ifdef _WIN32
-   out = GetStdHandle(STD_OUTPUT_HANDLE);
 
-   fill.Char.UnicodeChar = ' ';
-   fill.Attributes = console_cur_attr;
+static Value native_sqlite_exec(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+   SQLiteHandle *handle;
+   SQLiteStatementHandle *stmt_handle;
+   Value ret = fixscript_int(0);
+   sqlite3_stmt *stmt = NULL;
+   Value *sql_params = NULL, long_val[2];
+   char *sql = NULL, *sig = NULL, *text;
+   void *bin_data;
+   int i, err, len, num_sql_params=0, num_binds;
+   union {
+      uint64_t i;
+      double f;
+   } u;
+
+   handle = get_sqlite_handle(heap, error, params[0]);
+   if (!handle) {
+      goto error;
+   }
+
+   err = fixscript_get_string(heap, params[1], 0, -1, &sql, NULL);
+   if (err) {
+      fixscript_error(heap, error, err);
+      goto error;
+   }
+
+   if (params[2].value) {
+      err = fixscript_get_string(heap, params[2], 0, -1, &sig, NULL);
+      if (err) {
+         fixscript_error(heap, error, err);
+         goto error;
+      }
+      
+      if (!params[3].value) {
+         *error = fixscript_create_error_string(heap, "must provide parameters");
+         goto error;
+      }
+
+      err = fixscript_get_array_length(heap, params[3], &num_sql_params);
+      if (!err) {
+         sql_params = calloc(num_sql_params, sizeof(Value));
+         if (!sql_params) {
+            err = FIXSCRIPT_ERR_OUT_OF_MEMORY;
+         }
+      }
+      if (!err) {
+         err = fixscript_get_array_range(heap, params[3], 0, num_sql_params, sql_params);
+      }
+      if (err) {
+         fixscript_error(heap, error, err);
+         goto error;
+      }
+
+      if (strlen(sig) != num_sql_params) {
+         *error = fixscript_create_error_string(heap, "parameter count mismatch");
+         goto error;
+      }
+   }
+   else {
+      if (params[3].value) {
+         *error = fixscript_create_error_string(heap, "must provide signature");
+         goto error;
+      }
+   }
+
+   err = sqlite3_prepare_v2(handle->db, sql, -1, &stmt, NULL);
+   if (err) {
+      *error = fixscript_create_error_string(heap, sqlite3_errmsg(handle->db));
+      goto error;
+   }
+   
+   num_binds = sqlite3_bind_parameter_count(stmt);
+   if (num_binds != num_sql_params) {
+      *error = fixscript_create_error_string(heap, "parameter count mismatch");
+      goto error;
+   }
+
+   for (i=0; i<num_sql_params; i++) {
+      switch (sig[i]) {
+         case 'i':
+            err = sqlite3_bind_int(stmt, i+1, fixscript_get_int(sql_params[i]));
+            break;
+
+         case 'l':
+            if (sql_params[i].value) {
+               err = fixscript_get_array_range(heap, sql_params[i], 0, 2, long_val);
+               if (err) {
+                  fixscript_error(heap, error, err);
+                  goto error;
+               }
+               u.i = ((uint64_t)(uint32_t)long_val[0].value) | (((uint64_t)(uint32_t)long_val[1].value) << 32);
+               err = sqlite3_bind_int64(stmt, i+1, u.i);
+            }
+            else {
+               err = sqlite3_bind_null(stmt, i+1);
+            }
+            break;
 
-   if (GetConsoleScreenBufferInfo(out, &csbi)) {
-      base_y = csbi.dwSize.Y - (csbi.srWindow.Bottom - csbi.srWindow.Top + 1);
+         case 'f':
+            err = sqlite3_bind_double(stmt, i+1, fixscript_get_float(sql_params[i]));
+            break;
 
-      x = csbi.dwCursorPosition.X;
-      y = csbi.dwCursorPosition.Y - base_y;
-      y -= rel_y;
+         case 'd':
+            if (sql_params[i].value) {
+               err = fixscript_get_array_range(heap, sql_params[i], 0, 2, long_val);
+               if (err) {
+                  fixscript_error(heap, error, err);
+                  goto error;
+               }
+               u.i = ((uint64_t)(uint32_t)long_val[0].value) | (((uint64_t)(uint32_t)long_val[1].value) << 32);
+               err = sqlite3_bind_double(stmt, i+1, u.f);
+            }
+            else {
+               err = sqlite3_bind_null(stmt, i+1);
+            }
+            break;
 
-      w = csbi.dwSize.X;
-      h = csbi.srWindow.Bottom - csbi.srWindow.Top + 1;
+         case 's':
+            if (sql_params[i].value) {
+               err = fixscript_get_string(heap, sql_params[i], 0, -1, &text, NULL);
+               if (err) {
+                  fixscript_error(heap, error, err);
+                  goto error;
+               }
+               err = sqlite3_bind_text(stmt, i+1, text, -1, free);
+            }
+            else {
+               err = sqlite3_bind_null(stmt, i+1);
+            }
+            break;
 
-      if (x < 0) x = 0;
-      if (y < -base_y) y = -base_y;
-      if (x >= w) x = w-1;
-      if (y >= h) y = h-1;
+         case 'b':
+            if (sql_params[i].value) {
+               err = fixscript_get_array_length(heap, sql_params[i], &len);
+               if (!err) {
+                  err = fixscript_lock_array(heap, sql_params[i], 0, len, &bin_data, 1, ACCESS_READ_ONLY);
+               }
+               if (err) {
+                  fixscript_error(heap, error, err);
+                  goto error;
+               }
+               err = sqlite3_bind_blob(stmt, i+1, bin_data, len, SQLITE_TRANSIENT);
+               fixscript_unlock_array(heap, sql_params[i], 0, len, &bin_data, 1, ACCESS_READ_ONLY);
+            }
+            else {
+               err = sqlite3_bind_null(stmt, i+1);
+            }
+            break;
 
-      if (rel_y > 0) {
-         rect.Left = 0;
-         rect.Top = 0;
-         rect.Right = csbi.dwSize.X;
-         rect.Bottom = csbi.dwSize.Y;
-         origin.X = 0;
-         origin.Y = -rel_y;
-         ScrollConsoleScreenBuffer(out, &rect, NULL, origin, &fill);
+         default:
+            *error = fixscript_create_error_string(heap, "invalid signature");
+            goto error;
       }
-      else {
-         rect.Left = 0;
-         rect.Top = base_y;
-         rect.Right = csbi.dwSize.X;
-         rect.Bottom = base_y+h;
-         origin.X = 0;
-         origin.Y = base_y-rel_y;
-         ScrollConsoleScreenBuffer(out, &rect, &rect, origin, &fill);
+
+      if (err) {
+         *error = fixscript_create_error_string(heap, sqlite3_errmsg(handle->db));
+         goto error;
       }
+   }
 
-      csbi.dwCursorPosition.X = x;
-      csbi.dwCursorPosition.Y = y + base_y;
-      SetConsoleCursorPosition(out, csbi.dwCursorPosition);
+   err = sqlite3_step(stmt);
+   if (err == SQLITE_DONE) {
+      if (sqlite3_column_count(stmt) == 0) {
+         err = sqlite3_finalize(stmt);
+         if (err) {
+            *error = fixscript_create_error_string(heap, sqlite3_errmsg(handle->db));
+         }
+         goto error;
+      }
    }
-#else
-   if (rel_y > 0) {
-      fprintf(stdout, "\e[%dS\e[%dA", rel_y, rel_y);
+   else if (err != SQLITE_ROW) {
+      *error = fixscript_create_error_string(heap, sqlite3_errmsg(handle->db));
+      sqlite3_finalize(stmt);
+      goto error;
    }
-   else if (rel_y < 0) {
-      fprintf(stdout, "\e[%dT\e[%dB", -rel_y, -rel_y);
+
+   stmt_handle = calloc(1, sizeof(SQLiteStatementHandle));
+   if (!stmt_handle) {
+      sqlite3_finalize(stmt);
+      fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      goto error;
    }
-   console_flush();
-#endif
 
-   pthread_mutex_unlock(mutex);
-   return fixscript_int(0);
-#endif /* __wasm__ */
+   stmt_handle->stmt = stmt;
+   stmt_handle->done = (err == SQLITE_DONE);
+   stmt_handle->ignore_step = 1;
+   
+   ret = fixscript_create_value_handle(heap, HANDLE_TYPE_SQLITE_STMT, stmt_handle, sqlite_stmt_handle_func);
+   if (!ret.value) {
+      fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      goto error;
+   }
+
+error:
+   free(sql);
+   free(sig);
+   free(sql_params);
+   return ret;
 }
 
 
-#if !defined(_WIN32) && !defined(__wasm__)
-static int get_char()
+static Value native_sqlite_step(Heap *heap, Value *error, int num_params, Value *params, void *data)
 {
-   int ch;
-   char c;
-   
-   if (console_input_len > 0) {
-      ch = console_input_buf[0];
-      memmove(console_input_buf, console_input_buf+1, --console_input_len);
-      return ch;
+   SQLiteStatementHandle *stmt_handle;
+   int err;
+
+   stmt_handle = get_sqlite_stmt_handle(heap, error, params[0]);
+   if (!stmt_handle) {
+      return fixscript_int(0);
    }
 
-   if (read(STDIN_FILENO, &c, 1) == 1) {
-      return c;
+   if (stmt_handle->done) {
+      return fixscript_int(0);
    }
-   return EOF;
-}
 
-static int get_modifiers(int ch)
-{
-   int mod = 0;
-   if (ch >= '2' && ch <= '8') {
-      ch -= '1';
-      if (ch & 1) mod |= MOD_SHIFT;
-      if (ch & 2) mod |= MOD_ALT;
-      if (ch & 4) mod |= MOD_CTRL;
+   if (stmt_handle->ignore_step) {
+      stmt_handle->ignore_step = 0;
+      return fixscript_int(1);
    }
-   return mod;
-}
 
-static int decode_ext_key(int ch, int key, uint32_t *event)
-{
-   int mod;
-   switch (ch) {
-      case '~':
-         if (key) {
-            *event = KEY_PRESSED(key, 0);
-            ch = EOF;
-         }
-         break;
-      case ';':
-         mod = get_modifiers(get_char());
-         ch = get_char();
-         if (ch == '~') {
-            if (key) {
-               *event = KEY_PRESSED(key, mod);
-               ch = EOF;
-            }
-         }
-         else if (key == 0) {
-            switch (ch) {
-               case 'A': *event = KEY_PRESSED(KEY_UP, mod); ch = EOF; break;
-               case 'B': *event = KEY_PRESSED(KEY_DOWN, mod); ch = EOF; break;
-               case 'C': *event = KEY_PRESSED(KEY_RIGHT, mod); ch = EOF; break;
-               case 'D': *event = KEY_PRESSED(KEY_LEFT, mod); ch = EOF; break;
-               case 'H': *event = KEY_PRESSED(KEY_HOME, mod); ch = EOF; break;
-               case 'F': *event = KEY_PRESSED(KEY_END, mod); ch = EOF; break;
-            }
-         }
-         break;
+   err = sqlite3_step(stmt_handle->stmt);
+   if (err == SQLITE_ROW) {
+      return fixscript_int(1);
    }
-   return ch;
+   if (err != SQLITE_DONE) {
+      *error = fixscript_create_error_string(heap, sqlite3_errstr(err));
+      return fixscript_int(0);
+   }
+   stmt_handle->done = 1;
+   return fixscript_int(0);
 }
 
-static Value handle_console_resize_event(Heap *heap, Value *error, int wait)
-{
-   struct termios tios;
-   int size, width, height;
 
-   do {
-      native_console_get_size(heap, error, 0, NULL, (void *)0);
-      size = console_size;
-   }
-   while (size == -2);
+static Value native_sqlite_finalize(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+   SQLiteStatementHandle *stmt_handle;
+   int err;
 
-   if (wait) {
-      if (__sync_fetch_and_and(&console_send_size_event, ~CSSE_NEEDS_RESET) & CSSE_WITH_RESET) {
-         while ((console_send_size_event & CSSE_WAS_RESET) == 0) {
-            #if defined(__APPLE__) || defined(__HAIKU__)
-               sched_yield();
-            #else
-               pthread_yield();
-            #endif
-         }
-      }
-      __sync_fetch_and_and(&console_send_size_event, CSSE_OCCURED);
+   stmt_handle = get_sqlite_stmt_handle(heap, error, params[0]);
+   if (!stmt_handle) {
+      return fixscript_int(0);
    }
 
-   if (tcgetattr(STDOUT_FILENO, &tios) == 0) {
-      tios.c_cc[VMIN] = 1;
-      tios.c_cc[VTIME] = 0;
-      tcsetattr(STDOUT_FILENO, TCSANOW, &tios);
+   err = sqlite3_finalize(stmt_handle->stmt);
+   stmt_handle->stmt = NULL;
+   if (err) {
+      *error = fixscript_create_error_string(heap, sqlite3_errstr(err));
+      return fixscript_int(0);
    }
-
-   width = size & 0xFFFF;
-   height = (size >> 16) & 0xFFFF;
-   if (width > 0x3FFF) width = 0x3FFF;
-   if (height > 0x3FFF) height = 0x3FFF;
-   return fixscript_int((EVENT_CONSOLE_RESIZED << 28) | (width << 14) | height);
+   return fixscript_int(0);
 }
-#endif
 
 
-static Value native_console_get_event(Heap *heap, Value *error, int num_params, Value *params, void *data)
+static Value native_sqlite_column_count(Heap *heap, Value *error, int num_params, Value *params, void *data)
 {
-#if defined(__wasm__)
-   *error = fixscript_create_error_string(heap, "not supported");
-   return fixscript_int(0);
-#else
-   pthread_mutex_t *mutex;
-   uint32_t event = 0;
-   int timeout = -1;
-#ifdef _WIN32
-   HANDLE in, out;
-   CONSOLE_SCREEN_BUFFER_INFO csbi;
-   INPUT_RECORD in_rec;
-   DWORD num_events = 0;
-   BOOL success;
-   int key, mod, override, width, height, last_width=0, last_height=0;
-#else
-   struct termios tios;
-   wchar_t chars[1];
-   char bytes[1];
-   NativeConvertState state;
-   int processed_dest, processed_src;
-   int ch, mod, csse;
-#if !defined(__HAIKU__)
-   locale_t prev_locale = (locale_t)0;
-#endif
-#endif
-
-   if (num_params == 1) {
-      timeout = params[0].value;
-   }
+   SQLiteStatementHandle *stmt_handle;
 
-   mutex = get_mutex(&console_mutex);
-   if (!mutex) {
-      *error = fixscript_create_error_string(heap, "can't lock console");
+   stmt_handle = get_sqlite_stmt_handle(heap, error, params[0]);
+   if (!stmt_handle) {
       return fixscript_int(0);
    }
 
-   pthread_mutex_lock(mutex);
-   if (!console_active) {
-      pthread_mutex_unlock(mutex);
-      *error = fixscript_create_error_string(heap, "console is not active");
+   return fixscript_int(sqlite3_column_count(stmt_handle->stmt));
+}
+
+
+static Value native_sqlite_column_name(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+   SQLiteStatementHandle *stmt_handle;
+   Value ret;
+   const char *name;
+
+   stmt_handle = get_sqlite_stmt_handle(heap, error, params[0]);
+   if (!stmt_handle) {
       return fixscript_int(0);
    }
 
-#ifdef _WIN32
-   in = GetStdHandle(STD_INPUT_HANDLE);
-   out = GetStdHandle(STD_OUTPUT_HANDLE);
-again:
-   for (;;) {
-      if (GetConsoleScreenBufferInfo(out, &csbi)) {
-         width = csbi.dwSize.X;
-         height = csbi.srWindow.Bottom - csbi.srWindow.Top + 1;
-         last_width = last_csbi.dwSize.X;
-         last_height = last_csbi.srWindow.Bottom - last_csbi.srWindow.Top + 1;
-         last_csbi = csbi;
-      }
-      else {
-         width = 0;
-         height = 0;
-      }
-      if (width != last_width || height != last_height) {
-         if (width < 0) width = 0;
-         if (height < 0) height = 0;
-         if (width > 0x3FFF) width = 0x3FFF;
-         if (height > 0x3FFF) height = 0x3FFF;
-         pthread_mutex_unlock(mutex);
-         return fixscript_int((EVENT_CONSOLE_RESIZED << 28) | (width << 14) | height);
+   name = sqlite3_column_name(stmt_handle->stmt, params[1].value);
+   if (!name) {
+      if (params[1].value < 0 || params[1].value >= sqlite3_column_count(stmt_handle->stmt)) {
+         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_BOUNDS);
       }
+      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+   }
 
-      success = PeekConsoleInput(in, &in_rec, 1, &num_events);
-      if (!success || num_events == 1) break;
-      if (timeout >= 0) {
-         if (timeout < 10) break;
-         Sleep(10);
-         timeout -= 10;
-      }
+   ret = fixscript_create_string(heap, name, -1);
+   if (!ret.value) {
+      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
    }
+   return ret;
+}
 
-   if (success && num_events == 1) {
-      ReadConsoleInput(in, &in_rec, 1, &num_events);
-      if (in_rec.EventType == KEY_EVENT) {
-         if (in_rec.Event.KeyEvent.bKeyDown) {
-            override = 0;
-            key = KEY_NONE;
-            switch (in_rec.Event.KeyEvent.wVirtualKeyCode) {
-               case VK_ESCAPE:             key = KEY_ESCAPE; override = 1; break;
-               case VK_F1:                 key = KEY_F1; break;
-               case VK_F2:                 key = KEY_F2; break;
-               case VK_F3:                 key = KEY_F3; break;
-               case VK_F4:                 key = KEY_F4; break;
-               case VK_F5:                 key = KEY_F5; break;
-               case VK_F6:                 key = KEY_F6; break;
-               case VK_F7:                 key = KEY_F7; break;
-               case VK_F8:                 key = KEY_F8; break;
-               case VK_F9:                 key = KEY_F9; break;
-               case VK_F10:                key = KEY_F10; break;
-               case VK_F11:                key = KEY_F11; break;
-               case VK_F12:                key = KEY_F12; break;
-               //case VK_SNAPSHOT:           key = KEY_PRINT_SCREEN; break;
-               //case VK_SCROLL:             key = KEY_SCROLL_LOCK; break;
-               case VK_PAUSE:              key = KEY_PAUSE; break;
-               case 0xC0:                  key = KEY_GRAVE; break;
-               case '1':                   key = KEY_NUM1; break;
-               case '2':                   key = KEY_NUM2; break;
-               case '3':                   key = KEY_NUM3; break;
-               case '4':                   key = KEY_NUM4; break;
-               case '5':                   key = KEY_NUM5; break;
-               case '6':                   key = KEY_NUM6; break;
-               case '7':                   key = KEY_NUM7; break;
-               case '8':                   key = KEY_NUM8; break;
-               case '9':                   key = KEY_NUM9; break;
-               case '0':                   key = KEY_NUM0; break;
-               case VK_OEM_MINUS:          key = KEY_MINUS; break;
-               case 0xBB:                  key = KEY_EQUAL; break;
-               case VK_BACK:               key = KEY_BACKSPACE; override = 1; break;
-               case VK_TAB:                key = KEY_TAB; override = 1; break;
-               case 'Q':                   key = KEY_Q; break;
-               case 'W':                   key = KEY_W; break;
-               case 'E':                   key = KEY_E; break;
-               case 'R':                   key = KEY_R; break;
-               case 'T':                   key = KEY_T; break;
-               case 'Y':                   key = KEY_Y; break;
-               case 'U':                   key = KEY_U; break;
-               case 'I':                   key = KEY_I; break;
-               case 'O':                   key = KEY_O; break;
-               case 'P':                   key = KEY_P; break;
-               case 0xDB:                  key = KEY_LBRACKET; break;
-               case 0xDD:                  key = KEY_RBRACKET; break;
-               case 0xDC:                  key = KEY_BACKSLASH; break;
-               //case VK_CAPITAL:            key = KEY_CAPS_LOCK; break;
-               case 'A':                   key = KEY_A; break;
-               case 'S':                   key = KEY_S; break;
-               case 'D':                   key = KEY_D; break;
-               case 'F':                   key = KEY_F; break;
-               case 'G':                   key = KEY_G; break;
-               case 'H':                   key = KEY_H; break;
-               case 'J':                   key = KEY_J; break;
-               case 'K':                   key = KEY_K; break;
-               case 'L':                   key = KEY_L; break;
-               case 0xBA:                  key = KEY_SEMICOLON; break;
-               case 0xDE:                  key = KEY_APOSTROPHE; break;
-               case VK_RETURN:             key = KEY_ENTER; override = 1; break;
-               //case VK_SHIFT:              key = KEY_LSHIFT; break;
-               case 'Z':                   key = KEY_Z; break;
-               case 'X':                   key = KEY_X; break;
-               case 'C':                   key = KEY_C; break;
-               case 'V':                   key = KEY_V; break;
-               case 'B':                   key = KEY_B; break;
-               case 'N':                   key = KEY_N; break;
-               case 'M':                   key = KEY_M; break;
-               case VK_OEM_COMMA:          key = KEY_COMMA; break;
-               case VK_OEM_PERIOD:         key = KEY_PERIOD; break;
-               case 0xBF:                  key = KEY_SLASH; break;
-               //case VK_RSHIFT:             key = KEY_RSHIFT; break;
-               //case VK_CONTROL:            key = KEY_LCONTROL; break;
-               case VK_LWIN:               key = KEY_LMETA; break;
-               //case VK_MENU:               key = KEY_LALT; break;
-               case VK_SPACE:              key = KEY_SPACE; break;
-               //case VK_RALT:               key = KEY_RALT; break;
-               case VK_RWIN:               key = KEY_RMETA; break;
-               case 0x5D:                  key = KEY_RMENU; break;
-               //case VK_RCONTROL:           key = KEY_RCONTROL; break;
-               case VK_INSERT:             key = KEY_INSERT; break;
-               case VK_DELETE:             key = KEY_DELETE; break;
-               case VK_HOME:               key = KEY_HOME; break;
-               case VK_END:                key = KEY_END; break;
-               case VK_PRIOR:              key = KEY_PAGE_UP; break;
-               case VK_NEXT:               key = KEY_PAGE_DOWN; break;
-               case VK_LEFT:               key = KEY_LEFT; break;
-               case VK_UP:                 key = KEY_UP; break;
-               case VK_RIGHT:              key = KEY_RIGHT; break;
-               case VK_DOWN:               key = KEY_DOWN; break;
-               //case VK_NUMLOCK:            key = KEY_NUM_LOCK; break;
-               case 0x6F:                  key = KEY_NUMPAD_SLASH; break;
-               case 0x6A:                  key = KEY_NUMPAD_STAR; break;
-               case 0x6D:                  key = KEY_NUMPAD_MINUS; break;
-               case 0x6B:                  key = KEY_NUMPAD_PLUS; break;
-               //case VK_NUMPAD_ENTER:       key = KEY_NUMPAD_ENTER; break;
-               case 0x6E:                  key = KEY_NUMPAD_DOT; break;
-               case VK_NUMPAD0:            key = KEY_NUMPAD0; break;
-               case VK_NUMPAD1:            key = KEY_NUMPAD1; break;
-               case VK_NUMPAD2:            key = KEY_NUMPAD2; break;
-               case VK_NUMPAD3:            key = KEY_NUMPAD3; break;
-               case VK_NUMPAD4:            key = KEY_NUMPAD4; break;
-               case VK_NUMPAD5:            key = KEY_NUMPAD5; break;
-               case VK_NUMPAD6:            key = KEY_NUMPAD6; break;
-               case VK_NUMPAD7:            key = KEY_NUMPAD7; break;
-               case VK_NUMPAD8:            key = KEY_NUMPAD8; break;
-               case VK_NUMPAD9:            key = KEY_NUMPAD9; break;
-            }
-            mod = 0;
-            if (in_rec.Event.KeyEvent.dwControlKeyState & (LEFT_CTRL_PRESSED | RIGHT_CTRL_PRESSED)) mod |= MOD_CTRL;
-            if (in_rec.Event.KeyEvent.dwControlKeyState & (LEFT_ALT_PRESSED | RIGHT_ALT_PRESSED)) mod |= MOD_ALT;
-            if (in_rec.Event.KeyEvent.dwControlKeyState & SHIFT_PRESSED) mod |= MOD_SHIFT;
-            if (in_rec.Event.KeyEvent.uChar.UnicodeChar != 0 && (mod & (MOD_CTRL | MOD_ALT)) == 0 && !override) {
-               event = (EVENT_CHAR_TYPED << 28) | (in_rec.Event.KeyEvent.uChar.UnicodeChar & 0x0FFFFFFF);
-            }
-            else if (key) {
-               event = KEY_PRESSED(key, mod);
-            }
-            else if (timeout != 0) {
-               goto again;
-            }
-         }
-         else if (timeout != 0) {
-            goto again;
-         }
-      }
-      else if (timeout != 0) {
-         goto again;
-      }
+
+static Value native_sqlite_column_type(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+   SQLiteStatementHandle *stmt_handle;
+   const char *name;
+
+   stmt_handle = get_sqlite_stmt_handle(heap, error, params[0]);
+   if (!stmt_handle) {
+      return fixscript_int(0);
+   }
+
+   name = sqlite3_column_decltype(stmt_handle->stmt, params[1].value);
+   if (name) {
+      if (strcmp(name, "INTEGER") == 0) return fixscript_int(SQL_TYPE_LONG);
+      if (strcmp(name, "REAL") == 0)    return fixscript_int(SQL_TYPE_DOUBLE);
+      if (strcmp(name, "TEXT") == 0)    return fixscript_int(SQL_TYPE_STRING);
+      if (strcmp(name, "BLOB") == 0)    return fixscript_int(SQL_TYPE_BINARY);
    }
-#else
-   fflush(stdout);
 
-   if (__sync_fetch_and_and(&console_send_size_event, ~CSSE_OCCURED) & CSSE_OCCURED) {
-      pthread_mutex_unlock(mutex);
-      return handle_console_resize_event(heap, error, 0);
+   if (params[1].value < 0 || params[1].value >= sqlite3_column_count(stmt_handle->stmt)) {
+      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_BOUNDS);
    }
+   return fixscript_int(SQL_TYPE_UNKNOWN);
+}
 
-   if (tcgetattr(STDOUT_FILENO, &tios) != 0) {
-      pthread_mutex_unlock(mutex);
-      *error = fixscript_create_error_string(heap, "I/O error");
+
+static Value native_sqlite_data_type(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+   SQLiteStatementHandle *stmt_handle;
+   int type;
+
+   stmt_handle = get_sqlite_stmt_handle(heap, error, params[0]);
+   if (!stmt_handle) {
       return fixscript_int(0);
    }
 
-   if (timeout > 0 && timeout < 10) {
-      timeout = 10;
+   type = sqlite3_column_type(stmt_handle->stmt, params[1].value);
+   if (type == SQLITE_NULL) {
+      if (params[1].value < 0 || params[1].value >= sqlite3_column_count(stmt_handle->stmt)) {
+         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_BOUNDS);
+      }
+      return fixscript_int(SQL_TYPE_UNKNOWN);
    }
 
-   if (timeout >= 0) {
-      tios.c_cc[VMIN] = 0;
-      tios.c_cc[VTIME] = timeout / 100;
-      tcsetattr(STDOUT_FILENO, TCSANOW, &tios);
+   switch (type) {
+      case SQLITE_INTEGER: return fixscript_int(SQL_TYPE_LONG);
+      case SQLITE_FLOAT:   return fixscript_int(SQL_TYPE_DOUBLE);
+      case SQLITE_TEXT:    return fixscript_int(SQL_TYPE_STRING);
+      case SQLITE_BLOB:    return fixscript_int(SQL_TYPE_BINARY);
    }
+   return fixscript_int(SQL_TYPE_UNKNOWN);
+}
 
-   for (;;) {
-      csse = console_send_size_event;
-      if (csse & CSSE_OCCURED) {
-         if (!__sync_bool_compare_and_swap(&console_send_size_event, csse, csse & ~CSSE_OCCURED)) continue;
-         pthread_mutex_unlock(mutex);
-         return handle_console_resize_event(heap, error, 0);
-      }
-      else {
-         if (!__sync_bool_compare_and_swap(&console_send_size_event, csse, csse | CSSE_NEEDS_RESET)) continue;
-         break;
+
+static Value native_sqlite_is_null(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+   SQLiteStatementHandle *stmt_handle;
+
+   stmt_handle = get_sqlite_stmt_handle(heap, error, params[0]);
+   if (!stmt_handle) {
+      return fixscript_int(0);
+   }
+
+   if (sqlite3_column_type(stmt_handle->stmt, params[1].value) == SQLITE_NULL) {
+      if (params[1].value < 0 || params[1].value >= sqlite3_column_count(stmt_handle->stmt)) {
+         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_BOUNDS);
       }
+      return fixscript_int(1);
+   }
+   return fixscript_int(0);
+}
+
+
+static Value native_sqlite_get_int(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+   SQLiteStatementHandle *stmt_handle;
+   int64_t value;
+
+   stmt_handle = get_sqlite_stmt_handle(heap, error, params[0]);
+   if (!stmt_handle) {
+      return fixscript_int(0);
    }
 
-   ch = get_char();
-   if (ch == EOF && __sync_fetch_and_and(&console_send_size_event, ~CSSE_OCCURED) & CSSE_OCCURED) {
-      pthread_mutex_unlock(mutex);
-      return handle_console_resize_event(heap, error, 1);
+   value = sqlite3_column_int64(stmt_handle->stmt, params[1].value);
+   if (value < INT_MIN || value > INT_MAX) {
+      *error = fixscript_create_error_string(heap, "integer overflow");
+      return fixscript_int(0);
    }
-   if (ch == EOF && timeout > 0 && timeout < 100) {
-      while (timeout >= 10) {
-         usleep(10*1000);
-         timeout -= 10;
-         ch = get_char();
-         if (ch == EOF && __sync_fetch_and_and(&console_send_size_event, ~CSSE_OCCURED) & CSSE_OCCURED) {
-            pthread_mutex_unlock(mutex);
-            return handle_console_resize_event(heap, error, 1);
+   if (value == 0) {
+      if (sqlite3_column_type(stmt_handle->stmt, params[1].value) == SQLITE_NULL) {
+         if (params[1].value < 0 || params[1].value >= sqlite3_column_count(stmt_handle->stmt)) {
+            return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_BOUNDS);
          }
-         if (ch != EOF) break;
+         return params[2];
       }
    }
+   return fixscript_int(value);
+}
 
-   if (ch == 27) {
-      tios.c_cc[VMIN] = 0;
-      tios.c_cc[VTIME] = 0;
-      tcsetattr(STDOUT_FILENO, TCSANOW, &tios);
-      ch = get_char();
-      if (ch == EOF) {
-         if (__sync_fetch_and_and(&console_send_size_event, ~CSSE_OCCURED) & CSSE_OCCURED) {
-            pthread_mutex_unlock(mutex);
-            return handle_console_resize_event(heap, error, 1);
-         }
-         usleep(10*1000);
-         ch = get_char();
-         tios.c_cc[VMIN] = 1;
-         tios.c_cc[VTIME] = 0;
-         tcsetattr(STDOUT_FILENO, TCSANOW, &tios);
-         if (ch == EOF) {
-            if (__sync_fetch_and_and(&console_send_size_event, ~CSSE_OCCURED) & CSSE_OCCURED) {
-               pthread_mutex_unlock(mutex);
-               return handle_console_resize_event(heap, error, 1);
-            }
-            ch = 27;
-         }
-      }
-      else {
-         tios.c_cc[VMIN] = 1;
-         tios.c_cc[VTIME] = 0;
-         tcsetattr(STDOUT_FILENO, TCSANOW, &tios);
-      }
-      switch (ch) {
-         case 'O':
-            switch ((ch = get_char())) {
-               case 'P': event = KEY_PRESSED(KEY_F1, 0); ch = EOF; break;
-               case 'Q': event = KEY_PRESSED(KEY_F2, 0); ch = EOF; break;
-               case 'R': event = KEY_PRESSED(KEY_F3, 0); ch = EOF; break;
-               case 'S': event = KEY_PRESSED(KEY_F4, 0); ch = EOF; break;
 
-               case '2': case '3': case '4': case '5': case '6': case '7': case '8':
-                  mod = get_modifiers(ch);
-                  switch ((ch = get_char())) {
-                     case 'P': event = KEY_PRESSED(KEY_F1, mod); ch = EOF; break;
-                     case 'Q': event = KEY_PRESSED(KEY_F2, mod); ch = EOF; break;
-                     case 'R': event = KEY_PRESSED(KEY_F3, mod); ch = EOF; break;
-                     case 'S': event = KEY_PRESSED(KEY_F4, mod); ch = EOF; break;
-                  }
-                  break;
+static Value native_sqlite_get_long(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+   SQLiteStatementHandle *stmt_handle;
+   uint64_t value;
 
-               case 'M': event = KEY_PRESSED(KEY_ENTER, MOD_SHIFT); ch = EOF; break;
+   stmt_handle = get_sqlite_stmt_handle(heap, error, params[0]);
+   if (!stmt_handle) {
+      return fixscript_int(0);
+   }
 
-               case EOF: ch = 'O'; break;
-            }
-            break;
+   value = sqlite3_column_int64(stmt_handle->stmt, params[1].value);
+   if (value == 0) {
+      if (sqlite3_column_type(stmt_handle->stmt, params[1].value) == SQLITE_NULL) {
+         if (params[1].value < 0 || params[1].value >= sqlite3_column_count(stmt_handle->stmt)) {
+            return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_BOUNDS);
+         }
+         return params[2];
+      }
+   }
+   *error = fixscript_int(value >> 32);
+   return fixscript_int(value);
+}
 
-         case '[':
-            switch ((ch = get_char())) {
-               case '1':
-                  switch ((ch = get_char())) {
-                     case '1': ch = decode_ext_key(get_char(), KEY_F1, &event); break;
-                     case '2': ch = decode_ext_key(get_char(), KEY_F2, &event); break;
-                     case '3': ch = decode_ext_key(get_char(), KEY_F3, &event); break;
-                     case '4': ch = decode_ext_key(get_char(), KEY_F4, &event); break;
-                     case '5': ch = decode_ext_key(get_char(), KEY_F5, &event); break;
-                     case '7': ch = decode_ext_key(get_char(), KEY_F6, &event); break;
-                     case '8': ch = decode_ext_key(get_char(), KEY_F7, &event); break;
-                     case '9': ch = decode_ext_key(get_char(), KEY_F8, &event); break;
-                     case '~': case ';': ch = decode_ext_key(ch, KEY_HOME, &event); break;
-                  }
-                  break;
-               case '2':
-                  switch ((ch = get_char())) {
-                     case '0': ch = decode_ext_key(get_char(), KEY_F9, &event); break;
-                     case '1': ch = decode_ext_key(get_char(), KEY_F10, &event); break;
-                     case '3': ch = decode_ext_key(get_char(), KEY_F11, &event); break;
-                     case '4': ch = decode_ext_key(get_char(), KEY_F12, &event); break;
-                     case '~': case ';': ch = decode_ext_key(ch, KEY_INSERT, &event); break;
-                  }
-                  break;
-               case '3': ch = decode_ext_key(get_char(), KEY_DELETE, &event); break;
-               case '4':
-                  switch ((ch = get_char())) {
-                     case '~': case ';': ch = decode_ext_key(ch, KEY_END, &event); break;
-                  }
-                  break;
-               case '5': ch = decode_ext_key(get_char(), KEY_PAGE_UP, &event); break;
-               case '6': ch = decode_ext_key(get_char(), KEY_PAGE_DOWN, &event); break;
-               case 'A': event = KEY_PRESSED(KEY_UP, 0); ch = EOF; break;
-               case 'B': event = KEY_PRESSED(KEY_DOWN, 0); ch = EOF; break;
-               case 'C': event = KEY_PRESSED(KEY_RIGHT, 0); ch = EOF; break;
-               case 'D': event = KEY_PRESSED(KEY_LEFT, 0); ch = EOF; break;
-               case 'H': event = KEY_PRESSED(KEY_HOME, 0); ch = EOF; break;
-               case 'F': event = KEY_PRESSED(KEY_END, 0); ch = EOF; break;
-               case 'Z': event = KEY_PRESSED(KEY_TAB, MOD_SHIFT); ch = EOF; break;
-               case EOF: ch = '['; break;
-            }
-            break;
 
-         case '\n': event = KEY_PRESSED(KEY_ENTER, MOD_ALT); ch = EOF; break;
-      }
-      if (event == 0) {
-         switch (ch) {
-            case 'q':  event = KEY_PRESSED(KEY_Q, MOD_ALT); ch = EOF; break;
-            case 'w':  event = KEY_PRESSED(KEY_W, MOD_ALT); ch = EOF; break;
-            case 'e':  event = KEY_PRESSED(KEY_E, MOD_ALT); ch = EOF; break;
-            case 'r':  event = KEY_PRESSED(KEY_R, MOD_ALT); ch = EOF; break;
-            case 't':  event = KEY_PRESSED(KEY_T, MOD_ALT); ch = EOF; break;
-            case 'y':  event = KEY_PRESSED(KEY_Y, MOD_ALT); ch = EOF; break;
-            case 'u':  event = KEY_PRESSED(KEY_U, MOD_ALT); ch = EOF; break;
-            case 'i':  event = KEY_PRESSED(KEY_I, MOD_ALT); ch = EOF; break;
-            case 'o':  event = KEY_PRESSED(KEY_O, MOD_ALT); ch = EOF; break;
-            case 'p':  event = KEY_PRESSED(KEY_P, MOD_ALT); ch = EOF; break;
-            case '[':  event = KEY_PRESSED(KEY_LBRACKET, MOD_ALT); ch = EOF; break;
-            case ']':  event = KEY_PRESSED(KEY_RBRACKET, MOD_ALT); ch = EOF; break;
-            case '\\': event = KEY_PRESSED(KEY_BACKSLASH, MOD_ALT); ch = EOF; break;
-            case 'a':  event = KEY_PRESSED(KEY_A, MOD_ALT); ch = EOF; break;
-            case 's':  event = KEY_PRESSED(KEY_S, MOD_ALT); ch = EOF; break;
-            case 'd':  event = KEY_PRESSED(KEY_D, MOD_ALT); ch = EOF; break;
-            case 'f':  event = KEY_PRESSED(KEY_F, MOD_ALT); ch = EOF; break;
-            case 'g':  event = KEY_PRESSED(KEY_G, MOD_ALT); ch = EOF; break;
-            case 'h':  event = KEY_PRESSED(KEY_H, MOD_ALT); ch = EOF; break;
-            case 'j':  event = KEY_PRESSED(KEY_J, MOD_ALT); ch = EOF; break;
-            case 'k':  event = KEY_PRESSED(KEY_K, MOD_ALT); ch = EOF; break;
-            case 'l':  event = KEY_PRESSED(KEY_L, MOD_ALT); ch = EOF; break;
-            case ';':  event = KEY_PRESSED(KEY_SEMICOLON, MOD_ALT); ch = EOF; break;
-            case '\'': event = KEY_PRESSED(KEY_APOSTROPHE, MOD_ALT); ch = EOF; break;
-            case 'z':  event = KEY_PRESSED(KEY_Z, MOD_ALT); ch = EOF; break;
-            case 'x':  event = KEY_PRESSED(KEY_X, MOD_ALT); ch = EOF; break;
-            case 'c':  event = KEY_PRESSED(KEY_C, MOD_ALT); ch = EOF; break;
-            case 'v':  event = KEY_PRESSED(KEY_V, MOD_ALT); ch = EOF; break;
-            case 'b':  event = KEY_PRESSED(KEY_B, MOD_ALT); ch = EOF; break;
-            case 'n':  event = KEY_PRESSED(KEY_N, MOD_ALT); ch = EOF; break;
-            case 'm':  event = KEY_PRESSED(KEY_M, MOD_ALT); ch = EOF; break;
-            case ',':  event = KEY_PRESSED(KEY_COMMA, MOD_ALT); ch = EOF; break;
-            case '.':  event = KEY_PRESSED(KEY_PERIOD, MOD_ALT); ch = EOF; break;
-            case '/':  event = KEY_PRESSED(KEY_SLASH, MOD_ALT); ch = EOF; break;
+static Value native_sqlite_get_float(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+   int use_double = (data == (void *)1);
+   SQLiteStatementHandle *stmt_handle;
+   double value;
+   union {
+      double f;
+      uint64_t i;
+   } u;
 
-            case 'Q':  event = KEY_PRESSED(KEY_Q, MOD_ALT | MOD_SHIFT); ch = EOF; break;
-            case 'W':  event = KEY_PRESSED(KEY_W, MOD_ALT | MOD_SHIFT); ch = EOF; break;
-            case 'E':  event = KEY_PRESSED(KEY_E, MOD_ALT | MOD_SHIFT); ch = EOF; break;
-            case 'R':  event = KEY_PRESSED(KEY_R, MOD_ALT | MOD_SHIFT); ch = EOF; break;
-            case 'T':  event = KEY_PRESSED(KEY_T, MOD_ALT | MOD_SHIFT); ch = EOF; break;
-            case 'Y':  event = KEY_PRESSED(KEY_Y, MOD_ALT | MOD_SHIFT); ch = EOF; break;
-            case 'U':  event = KEY_PRESSED(KEY_U, MOD_ALT | MOD_SHIFT); ch = EOF; break;
-            case 'I':  event = KEY_PRESSED(KEY_I, MOD_ALT | MOD_SHIFT); ch = EOF; break;
-            case 'O':  event = KEY_PRESSED(KEY_O, MOD_ALT | MOD_SHIFT); ch = EOF; break;
-            case 'P':  event = KEY_PRESSED(KEY_P, MOD_ALT | MOD_SHIFT); ch = EOF; break;
-            case '{':  event = KEY_PRESSED(KEY_LBRACKET, MOD_ALT | MOD_SHIFT); ch = EOF; break;
-            case '}':  event = KEY_PRESSED(KEY_RBRACKET, MOD_ALT | MOD_SHIFT); ch = EOF; break;
-            case '|':  event = KEY_PRESSED(KEY_BACKSLASH, MOD_ALT | MOD_SHIFT); ch = EOF; break;
-            case 'A':  event = KEY_PRESSED(KEY_A, MOD_ALT | MOD_SHIFT); ch = EOF; break;
-            case 'S':  event = KEY_PRESSED(KEY_S, MOD_ALT | MOD_SHIFT); ch = EOF; break;
-            case 'D':  event = KEY_PRESSED(KEY_D, MOD_ALT | MOD_SHIFT); ch = EOF; break;
-            case 'F':  event = KEY_PRESSED(KEY_F, MOD_ALT | MOD_SHIFT); ch = EOF; break;
-            case 'G':  event = KEY_PRESSED(KEY_G, MOD_ALT | MOD_SHIFT); ch = EOF; break;
-            case 'H':  event = KEY_PRESSED(KEY_H, MOD_ALT | MOD_SHIFT); ch = EOF; break;
-            case 'J':  event = KEY_PRESSED(KEY_J, MOD_ALT | MOD_SHIFT); ch = EOF; break;
-            case 'K':  event = KEY_PRESSED(KEY_K, MOD_ALT | MOD_SHIFT); ch = EOF; break;
-            case 'L':  event = KEY_PRESSED(KEY_L, MOD_ALT | MOD_SHIFT); ch = EOF; break;
-            case ':':  event = KEY_PRESSED(KEY_SEMICOLON, MOD_ALT | MOD_SHIFT); ch = EOF; break;
-            case '"':  event = KEY_PRESSED(KEY_APOSTROPHE, MOD_ALT | MOD_SHIFT); ch = EOF; break;
-            case 'Z':  event = KEY_PRESSED(KEY_Z, MOD_ALT | MOD_SHIFT); ch = EOF; break;
-            case 'X':  event = KEY_PRESSED(KEY_X, MOD_ALT | MOD_SHIFT); ch = EOF; break;
-            case 'C':  event = KEY_PRESSED(KEY_C, MOD_ALT | MOD_SHIFT); ch = EOF; break;
-            case 'V':  event = KEY_PRESSED(KEY_V, MOD_ALT | MOD_SHIFT); ch = EOF; break;
-            case 'B':  event = KEY_PRESSED(KEY_B, MOD_ALT | MOD_SHIFT); ch = EOF; break;
-            case 'N':  event = KEY_PRESSED(KEY_N, MOD_ALT | MOD_SHIFT); ch = EOF; break;
-            case 'M':  event = KEY_PRESSED(KEY_M, MOD_ALT | MOD_SHIFT); ch = EOF; break;
-            case '<':  event = KEY_PRESSED(KEY_COMMA, MOD_ALT | MOD_SHIFT); ch = EOF; break;
-            case '>':  event = KEY_PRESSED(KEY_PERIOD, MOD_ALT | MOD_SHIFT); ch = EOF; break;
-            case '?':  event = KEY_PRESSED(KEY_SLASH, MOD_ALT | MOD_SHIFT); ch = EOF; break;
+   stmt_handle = get_sqlite_stmt_handle(heap, error, params[0]);
+   if (!stmt_handle) {
+      return fixscript_int(0);
+   }
+
+   value = sqlite3_column_double(stmt_handle->stmt, params[1].value);
+   if (value == 0) {
+      if (sqlite3_column_type(stmt_handle->stmt, params[1].value) == SQLITE_NULL) {
+         if (params[1].value < 0 || params[1].value >= sqlite3_column_count(stmt_handle->stmt)) {
+            return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_BOUNDS);
          }
+         return params[2];
       }
    }
+   if (use_double) {
+      u.f = value;
+      *error = fixscript_int(u.i >> 32);
+      return fixscript_int(u.i);
+   }
+   return fixscript_float(value);
+}
 
-   if (__sync_fetch_and_and(&console_send_size_event, ~CSSE_NEEDS_RESET) & CSSE_WITH_RESET) {
-      while ((console_send_size_event & CSSE_WAS_RESET) == 0) {
-         #if defined(__APPLE__) || defined(__HAIKU__)
-            sched_yield();
-         #else
-            pthread_yield();
-         #endif
+
+static Value native_sqlite_get_string(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+   SQLiteStatementHandle *stmt_handle;
+   const unsigned char *text;
+   Value ret;
+
+   stmt_handle = get_sqlite_stmt_handle(heap, error, params[0]);
+   if (!stmt_handle) {
+      return fixscript_int(0);
+   }
+
+   text = sqlite3_column_text(stmt_handle->stmt, params[1].value);
+   if (!text) {
+      if (params[1].value < 0 || params[1].value >= sqlite3_column_count(stmt_handle->stmt)) {
+         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_BOUNDS);
       }
+      return fixscript_int(0);
    }
-   __sync_fetch_and_and(&console_send_size_event, CSSE_OCCURED);
 
-   tios.c_cc[VMIN] = 1;
-   tios.c_cc[VTIME] = 0;
-   tcsetattr(STDOUT_FILENO, TCSANOW, &tios);
+   ret = fixscript_create_string(heap, (const char *)text, -1);
+   if (!ret.value) {
+      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+   }
+   return ret;
+}
 
-   if (ch != EOF) {
-      switch (ch) {
-         case 27:   event = KEY_PRESSED(KEY_ESCAPE, 0); break;
-         case 127:  event = KEY_PRESSED(KEY_BACKSPACE, 0); break;
 
-         case '\t': event = KEY_PRESSED(KEY_TAB, 0); break;
-         case 17:   event = KEY_PRESSED(KEY_Q, MOD_CTRL); break;
-         case 23:   event = KEY_PRESSED(KEY_W, MOD_CTRL); break;
-         case 5:    event = KEY_PRESSED(KEY_E, MOD_CTRL); break;
-         case 18:   event = KEY_PRESSED(KEY_R, MOD_CTRL); break;
-         case 20:   event = KEY_PRESSED(KEY_T, MOD_CTRL); break;
-         case 25:   event = KEY_PRESSED(KEY_Y, MOD_CTRL); break;
-         case 21:   event = KEY_PRESSED(KEY_U, MOD_CTRL); break;
-         case 15:   event = KEY_PRESSED(KEY_O, MOD_CTRL); break;
-         case 16:   event = KEY_PRESSED(KEY_P, MOD_CTRL); break;
-         case 29:   event = KEY_PRESSED(KEY_RBRACKET, MOD_CTRL); break;
-         case 28:   event = KEY_PRESSED(KEY_BACKSLASH, MOD_CTRL); break;
+static Value native_sqlite_get_binary(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+   SQLiteStatementHandle *stmt_handle;
+   const void *blob;
+   Value ret;
 
-         case 1:    event = KEY_PRESSED(KEY_A, MOD_CTRL); break;
-         case 19:   event = KEY_PRESSED(KEY_S, MOD_CTRL); break;
-         case 4:    event = KEY_PRESSED(KEY_D, MOD_CTRL); break;
-         case 6:    event = KEY_PRESSED(KEY_F, MOD_CTRL); break;
-         case 7:    event = KEY_PRESSED(KEY_G, MOD_CTRL); break;
-         case 8:    event = KEY_PRESSED(KEY_H, MOD_CTRL); break;
-         case 11:   event = KEY_PRESSED(KEY_K, MOD_CTRL); break;
-         case 12:   event = KEY_PRESSED(KEY_L, MOD_CTRL); break;
-         case '\n': event = KEY_PRESSED(KEY_ENTER, 0); break;
+   stmt_handle = get_sqlite_stmt_handle(heap, error, params[0]);
+   if (!stmt_handle) {
+      return fixscript_int(0);
+   }
 
-         case 26:   event = KEY_PRESSED(KEY_Z, MOD_CTRL); break;
-         case 24:   event = KEY_PRESSED(KEY_X, MOD_CTRL); break;
-         case 3:    event = KEY_PRESSED(KEY_C, MOD_CTRL); break;
-         case 22:   event = KEY_PRESSED(KEY_V, MOD_CTRL); break;
-         case 2:    event = KEY_PRESSED(KEY_B, MOD_CTRL); break;
-         case 14:   event = KEY_PRESSED(KEY_N, MOD_CTRL); break;
-         case 31:   event = KEY_PRESSED(KEY_SLASH, MOD_CTRL); break;
+   blob = sqlite3_column_blob(stmt_handle->stmt, params[1].value);
+   if (!blob) {
+      if (params[1].value < 0 || params[1].value >= sqlite3_column_count(stmt_handle->stmt)) {
+         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_BOUNDS);
+      }
+      return fixscript_int(0);
+   }
 
-         case 0:    event = KEY_PRESSED(KEY_SPACE, MOD_CTRL); break;
+   ret = fixscript_create_byte_array(heap, (const char *)blob, sqlite3_column_bytes(stmt_handle->stmt, params[1].value));
+   if (!ret.value) {
+      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+   }
+   return ret;
+}
 
-         default:
-            #if !defined(__HAIKU__)
-               if (!native_charset_utf8) {
-                  prev_locale = uselocale(cur_locale);
-               }
-            #endif
-            memset(&state, 0, sizeof(NativeConvertState));
-            for (;;) {
-               bytes[0] = ch;
-               convert_from_native(chars, 1, bytes, 1, &state, &processed_dest, &processed_src);
-               if (processed_dest == 1 || processed_src != 1) break;
-               ch = get_char();
-            }
-            if (chars[0]) {
-               event = (EVENT_CHAR_TYPED << 28) | (chars[0] & 0x0FFFFFFF);
-            }
-            #if !defined(__HAIKU__)
-               if (!native_charset_utf8) {
-                  uselocale(prev_locale);
-               }
-            #endif
+
+static Value native_sqlite_last_insert_rowid(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+   SQLiteHandle *handle;
+   uint64_t ret;
+
+   handle = get_sqlite_handle(heap, error, params[0]);
+   if (!handle) {
+      return fixscript_int(0);
+   }
+
+   ret = sqlite3_last_insert_rowid(handle->db);
+   *error = fixscript_int(ret >> 32);
+   return fixscript_int(ret);
+}
+
+#endif /* FIXIO_SQLITE */
+
+
+#ifndef __wasm__
+
+// Embedded key-value store:
+//
+// The database is a B+tree stored in a single file split into pages, keys are
+// encoded using serialize_key and ordered by compare_serialized_values, values
+// are stored in the standard serialization format. Changes are kept in memory
+// until commit, the modified pages are first written to a write-ahead log file
+// ("<name>-wal") and only after it's synced they are written to the database file.
+// On open the log is replayed if it contains a complete commit, otherwise it's
+// discarded (the database file was not modified yet).
+//
+// Page layout (all numbers are little endian):
+//   header:   magic "FIXKVDB1", page size, root page, number of pages, free list, count
+//   leaf:     type, 0, count (16bit), next leaf, 0, cells (key len 16bit, value len, key, value or overflow page)
+//   internal: type, 0, count (16bit), first child, 0, cells (key len 16bit, child, key)
+//   overflow: type, 0, used (16bit), next page, 0, data
+//   free:     type, 0, 0, next free page
+//
+// Removal doesn't rebalance the tree, the space in the pages is reused by later inserts.
+
+#define KV_PAGE_SIZE     4096
+#define KV_NODE_HEADER   12
+#define KV_MAX_KEY       1024
+#define KV_MAX_INLINE    1000
+#define KV_CACHE_BUCKETS 256
+#define KV_MAX_CACHED    1024 // 4MB
+#define KV_MAX_DEPTH     32
+
+enum {
+   KV_PAGE_LEAF     = 1,
+   KV_PAGE_INTERNAL = 2,
+   KV_PAGE_OVERFLOW = 3,
+   KV_PAGE_FREE     = 4
+};
+
+enum {
+   KV_OK        = 0,
+   KV_IO_ERROR  = 1,
+   KV_CORRUPTED = 2,
+   KV_NO_MEMORY = 3
+};
+
+enum {
+   KV_UNBOUNDED = 0,
+   KV_INCLUSIVE = 1,
+   KV_EXCLUSIVE = 2
+};
+
+#if defined(_WIN32)
+typedef HANDLE KVFile;
+#else
+typedef int KVFile;
+#endif
+
+typedef struct KVPage {
+   uint32_t num;
+   int dirty;
+   struct KVPage *next;
+   unsigned char data[KV_PAGE_SIZE];
+} KVPage;
+
+typedef struct {
+   uint32_t root;
+   uint32_t num_pages;
+   uint32_t free_head;
+   uint32_t count;
+} KVHeader;
+
+typedef struct {
+   KVFile file, wal;
+   int opened;
+   KVPage *cache[KV_CACHE_BUCKETS];
+   int num_cached, num_dirty;
+   KVHeader hdr, saved_hdr;
+   int in_transaction;
+} KVStore;
+
+typedef struct {
+   int split;
+   uint32_t page;
+   int key_len;
+   unsigned char key[KV_MAX_KEY];
+} KVSplit;
+
+static const char kv_magic[8] = { 'F', 'I', 'X', 'K', 'V', 'D', 'B', '1' };
+static const char kv_wal_magic[8] = { 'F', 'I', 'X', 'K', 'V', 'W', 'A', 'L' };
+
+
+static inline uint32_t kv_get16(const unsigned char *p)
+{
+   return p[0] | (p[1] << 8);
+}
+
+
+static inline uint32_t kv_get32(const unsigned char *p)
+{
+   return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+
+static inline void kv_put16(unsigned char *p, uint32_t value)
+{
+   p[0] = value;
+   p[1] = value >> 8;
+}
+
+
+static inline void kv_put32(unsigned char *p, uint32_t value)
+{
+   p[0] = value;
+   p[1] = value >> 8;
+   p[2] = value >> 16;
+   p[3] = value >> 24;
+}
+
+
+static int kv_file_read(KVFile file, int64_t off, void *buf, int len)
+{
+#if defined(_WIN32)
+   OVERLAPPED overlapped;
+   DWORD read;
+#else
+   ssize_t ret;
+#endif
+   int total = 0;
+
+   while (total < len) {
+#if defined(_WIN32)
+      memset(&overlapped, 0, sizeof(OVERLAPPED));
+      overlapped.Offset = (off + total) & 0xFFFFFFFF;
+      overlapped.OffsetHigh = (off + total) >> 32;
+      if (!ReadFile(file, (char *)buf + total, len - total, &read, &overlapped)) {
+         if (GetLastError() == ERROR_HANDLE_EOF) break;
+         return -1;
+      }
+      if (read == 0) break;
+      total += read;
+#else
+      ret = pread(file, (char *)buf + total, len - total, off + total);
+      if (ret < 0) {
+         if (errno == EINTR) continue;
+         return -1;
+      }
+      if (ret == 0) break;
+      total += ret;
+#endif
+   }
+   return total;
+}
+
+
+static int kv_file_write(KVFile file, int64_t off, const void *buf, int len)
+{
+#if defined(_WIN32)
+   OVERLAPPED overlapped;
+   DWORD written;
+#else
+   ssize_t ret;
+#endif
+   int total = 0;
+
+   while (total < len) {
+#if defined(_WIN32)
+      memset(&overlapped, 0, sizeof(OVERLAPPED));
+      overlapped.Offset = (off + total) & 0xFFFFFFFF;
+      overlapped.OffsetHigh = (off + total) >> 32;
+      if (!WriteFile(file, (const char *)buf + total, len - total, &written, &overlapped)) {
+         return 0;
+      }
+      total += written;
+#else
+      ret = pwrite(file, (const char *)buf + total, len - total, off + total);
+      if (ret < 0) {
+         if (errno == EINTR) continue;
+         return 0;
       }
+      total += ret;
+#endif
    }
+   return 1;
+}
+
+
+static int kv_file_sync(KVFile file)
+{
+#if defined(_WIN32)
+   return FlushFileBuffers(file) != 0;
+#elif defined(__APPLE__)
+   return fcntl(file, F_FULLFSYNC) == 0;
+#elif defined(__linux__)
+   return fdatasync(file) == 0;
+#else
+   return fsync(file) == 0;
 #endif
+}
 
-   pthread_mutex_unlock(mutex);
-   return fixscript_int(event);
-#endif /* __wasm__ */
+
+static int kv_file_truncate(KVFile file, int64_t size)
+{
+#if defined(_WIN32)
+   LARGE_INTEGER pos;
+   pos.QuadPart = size;
+   if (!SetFilePointerEx(file, pos, NULL, FILE_BEGIN)) return 0;
+   return SetEndOfFile(file) != 0;
+#else
+   return ftruncate(file, size) == 0;
+#endif
 }
 
 
-#ifdef FIXIO_SQLITE
+static int64_t kv_file_size(KVFile file)
+{
+#if defined(_WIN32)
+   LARGE_INTEGER size;
+   if (!GetFileSizeEx(file, &size)) return -1;
+   return size.QuadPart;
+#else
+   struct stat buf;
+   if (fstat(file, &buf) != 0) return -1;
+   return buf.st_size;
+#endif
+}
 
-static void *sqlite_handle_func(Heap *heap, int op, void *p1, void *p2)
+
+static void kv_file_close(KVFile file)
 {
-   SQLiteHandle *handle = p1;
-   switch (op) {
-      case HANDLE_OP_FREE:
-         if (handle->db) {
-            sqlite3_close_v2(handle->db);
-         }
-         free(handle);
-         break;
-   }
-   return NULL;
+#if defined(_WIN32)
+   CloseHandle(file);
+#else
+   close(file);
+#endif
 }
 
 
-static void *sqlite_stmt_handle_func(Heap *heap, int op, void *p1, void *p2)
+static int kv_compare(const unsigned char *key1, int len1, const unsigned char *key2, int len2)
 {
-   SQLiteStatementHandle *handle = p1;
-   switch (op) {
-      case HANDLE_OP_FREE:
-         if (handle->stmt) {
-            sqlite3_finalize(handle->stmt);
-         }
-         free(handle);
-         break;
+   Buffer buf1, buf2;
+
+   buf1.cur = (char *)key1;
+   buf1.end = (char *)key1 + len1;
+   buf2.cur = (char *)key2;
+   buf2.end = (char *)key2 + len2;
+   return compare_serialized_values(&buf1, &buf2, 1);
+}
+
+
+static KVPage *kv_find_cached(KVStore *kv, uint32_t num)
+{
+   KVPage *page;
+
+   for (page = kv->cache[num % KV_CACHE_BUCKETS]; page; page = page->next) {
+      if (page->num == num) {
+         return page;
+      }
    }
    return NULL;
 }
 
 
-static SQLiteHandle *get_sqlite_handle(Heap *heap, Value *error, Value handle_val)
+static int kv_get_page(KVStore *kv, uint32_t num, KVPage **page_out)
 {
-   SQLiteHandle *handle;
+   KVPage *page;
+   int ret;
 
-   handle = fixscript_get_handle(heap, handle_val, HANDLE_TYPE_SQLITE, NULL);
-   if (!handle) {
-      *error = fixscript_create_error_string(heap, "invalid SQLite database handle");
-      return NULL;
+   page = kv_find_cached(kv, num);
+   if (page) {
+      *page_out = page;
+      return KV_OK;
    }
 
-   if (!handle->db) {
-      *error = fixscript_create_error_string(heap, "SQLite database is already closed");
-      return NULL;
+   if (num == 0 || num >= kv->hdr.num_pages) {
+      return KV_CORRUPTED;
    }
-   return handle;
+
+   page = malloc(sizeof(KVPage));
+   if (!page) {
+      return KV_NO_MEMORY;
+   }
+
+   ret = kv_file_read(kv->file, (int64_t)num * KV_PAGE_SIZE, page->data, KV_PAGE_SIZE);
+   if (ret != KV_PAGE_SIZE) {
+      free(page);
+      return ret < 0? KV_IO_ERROR : KV_CORRUPTED;
+   }
+
+   page->num = num;
+   page->dirty = 0;
+   page->next = kv->cache[num % KV_CACHE_BUCKETS];
+   kv->cache[num % KV_CACHE_BUCKETS] = page;
+   kv->num_cached++;
+   *page_out = page;
+   return KV_OK;
 }
 
 
-static SQLiteStatementHandle *get_sqlite_stmt_handle(Heap *heap, Value *error, Value handle_val)
+static void kv_mark_dirty(KVStore *kv, KVPage *page)
 {
-   SQLiteStatementHandle *handle;
+   if (!page->dirty) {
+      page->dirty = 1;
+      kv->num_dirty++;
+   }
+}
 
-   handle = fixscript_get_handle(heap, handle_val, HANDLE_TYPE_SQLITE_STMT, NULL);
-   if (!handle) {
-      *error = fixscript_create_error_string(heap, "invalid SQLite statement handle");
-      return NULL;
+
+static int kv_alloc_page(KVStore *kv, int type, KVPage **page_out)
+{
+   KVPage *page;
+   uint32_t num;
+   int err;
+
+   if (kv->hdr.free_head) {
+      err = kv_get_page(kv, kv->hdr.free_head, &page);
+      if (err) return err;
+      if (page->data[0] != KV_PAGE_FREE) return KV_CORRUPTED;
+      kv->hdr.free_head = kv_get32(page->data + 4);
    }
+   else {
+      if (kv->hdr.num_pages >= 0x7FFFFFFF / KV_PAGE_SIZE * KV_PAGE_SIZE) {
+         return KV_NO_MEMORY;
+      }
+      num = kv->hdr.num_pages++;
+      page = malloc(sizeof(KVPage));
+      if (!page) {
+         kv->hdr.num_pages--;
+         return KV_NO_MEMORY;
+      }
+      page->num = num;
+      page->dirty = 0;
+      page->next = kv->cache[num % KV_CACHE_BUCKETS];
+      kv->cache[num % KV_CACHE_BUCKETS] = page;
+      kv->num_cached++;
+   }
+
+   memset(page->data, 0, KV_PAGE_SIZE);
+   page->data[0] = type;
+   kv_mark_dirty(kv, page);
+   *page_out = page;
+   return KV_OK;
+}
 
-   if (!handle->stmt) {
-      *error = fixscript_create_error_string(heap, "SQLite statement is already closed");
-      return NULL;
+
+static void kv_free_page(KVStore *kv, KVPage *page)
+{
+   memset(page->data, 0, KV_PAGE_SIZE);
+   page->data[0] = KV_PAGE_FREE;
+   kv_put32(page->data + 4, kv->hdr.free_head);
+   kv->hdr.free_head = page->num;
+   kv_mark_dirty(kv, page);
+}
+
+
+static void kv_drop_pages(KVStore *kv, int dirty_only)
+{
+   KVPage *page, **prev;
+   int i;
+
+   for (i=0; i<KV_CACHE_BUCKETS; i++) {
+      prev = &kv->cache[i];
+      while ((page = *prev)) {
+         if (page->dirty && !dirty_only) {
+            prev = &page->next;
+            continue;
+         }
+         if (!page->dirty && dirty_only) {
+            prev = &page->next;
+            continue;
+         }
+         *prev = page->next;
+         free(page);
+         kv->num_cached--;
+      }
+   }
+   if (dirty_only) {
+      kv->num_dirty = 0;
    }
-   return handle;
 }
 
 
-static Value native_sqlite_is_present(Heap *heap, Value *error, int num_params, Value *params, void *data)
+static void kv_rollback(KVStore *kv)
 {
-   return fixscript_int(1);
+   kv_drop_pages(kv, 1);
+   kv->hdr = kv->saved_hdr;
 }
 
 
-static Value native_sqlite_open(Heap *heap, Value *error, int num_params, Value *params, void *data)
+static int kv_compare_pages(const void *p1, const void *p2)
 {
-   SQLiteHandle *handle = NULL;
-   Value ret = fixscript_int(0);
-   char *fname = NULL;
-   int err;
+   const KVPage *page1 = *(KVPage **)p1;
+   const KVPage *page2 = *(KVPage **)p2;
+   return page1->num < page2->num? -1 : page1->num > page2->num? +1 : 0;
+}
 
-   handle = calloc(1, sizeof(SQLiteHandle));
-   if (!handle) {
-      fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
-      goto error;
+
+static int kv_apply_log(KVStore *kv, const unsigned char *log, int64_t len)
+{
+   uint32_t i, cnt, num;
+   const unsigned char *p;
+
+   if (len < 20 || memcmp(log, kv_wal_magic, 8) != 0) {
+      return 0;
+   }
+   cnt = kv_get32(log + 8);
+   if (cnt > (len - 20) / (4 + KV_PAGE_SIZE) || len != 20 + (int64_t)cnt * (4 + KV_PAGE_SIZE)) {
+      return 0;
+   }
+   if (kv_get32(log + len - 4) != calc_crc32(0xFFFFFFFF, log, len - 4)) {
+      return 0;
    }
 
-   err = fixscript_get_string(heap, params[0], 0, -1, &fname, NULL);
-   if (err) {
-      fixscript_error(heap, error, err);
-      goto error;
+   for (i=0, p=log+16; i<cnt; i++, p += 4 + KV_PAGE_SIZE) {
+      num = kv_get32(p);
+      if (!kv_file_write(kv->file, (int64_t)num * KV_PAGE_SIZE, p + 4, KV_PAGE_SIZE)) {
+         return -1;
+      }
+   }
+   if (!kv_file_sync(kv->file)) {
+      return -1;
+   }
+   if (!kv_file_truncate(kv->file, (int64_t)kv_get32(log + 12) * KV_PAGE_SIZE)) {
+      return -1;
    }
+   return 1;
+}
 
-   err = sqlite3_open(fname, &handle->db);
-   if (err) {
-      *error = fixscript_create_error_string(heap, sqlite3_errmsg(handle->db));
-      sqlite3_close_v2(handle->db);
+
+static int kv_commit(KVStore *kv)
+{
+   KVPage *page, **pages = NULL;
+   unsigned char *log = NULL, *p;
+   int64_t log_len;
+   int i, cnt, err;
+
+   if (kv->num_dirty == 0 && memcmp(&kv->hdr, &kv->saved_hdr, sizeof(KVHeader)) == 0) {
+      return KV_OK;
+   }
+
+   page = kv_find_cached(kv, 0);
+   if (!page) {
+      page = calloc(1, sizeof(KVPage));
+      if (!page) return KV_NO_MEMORY;
+      page->next = kv->cache[0];
+      kv->cache[0] = page;
+      kv->num_cached++;
+   }
+   memset(page->data, 0, KV_PAGE_SIZE);
+   memcpy(page->data, kv_magic, 8);
+   kv_put32(page->data + 8, KV_PAGE_SIZE);
+   kv_put32(page->data + 12, kv->hdr.root);
+   kv_put32(page->data + 16, kv->hdr.num_pages);
+   kv_put32(page->data + 20, kv->hdr.free_head);
+   kv_put32(page->data + 24, kv->hdr.count);
+   kv_mark_dirty(kv, page);
+
+   pages = malloc(kv->num_dirty * sizeof(KVPage *));
+   log_len = 20 + (int64_t)kv->num_dirty * (4 + KV_PAGE_SIZE);
+   if (!pages || log_len > INT_MAX) {
+      err = KV_NO_MEMORY;
       goto error;
    }
-   
-   ret = fixscript_create_value_handle(heap, HANDLE_TYPE_SQLITE, handle, sqlite_handle_func);
-   handle = NULL;
-   if (!ret.value) {
-      fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+   log = malloc(log_len);
+   if (!log) {
+      err = KV_NO_MEMORY;
       goto error;
    }
 
+   cnt = 0;
+   for (i=0; i<KV_CACHE_BUCKETS; i++) {
+      for (page = kv->cache[i]; page; page = page->next) {
+         if (page->dirty) {
+            pages[cnt++] = page;
+         }
+      }
+   }
+   qsort(pages, cnt, sizeof(KVPage *), kv_compare_pages);
+
+   memcpy(log, kv_wal_magic, 8);
+   kv_put32(log + 8, cnt);
+   kv_put32(log + 12, kv->hdr.num_pages);
+   for (i=0, p=log+16; i<cnt; i++, p += 4 + KV_PAGE_SIZE) {
+      kv_put32(p, pages[i]->num);
+      memcpy(p + 4, pages[i]->data, KV_PAGE_SIZE);
+   }
+   kv_put32(p, calc_crc32(0xFFFFFFFF, log, log_len - 4));
+
+   err = KV_IO_ERROR;
+   if (!kv_file_write(kv->wal, 0, log, log_len)) goto error;
+   if (!kv_file_truncate(kv->wal, log_len)) goto error;
+   if (!kv_file_sync(kv->wal)) goto error;
+
+   // from now on the commit is durable, errors are recovered by replaying the log on the next open:
+   for (i=0; i<cnt; i++) {
+      if (!kv_file_write(kv->file, (int64_t)pages[i]->num * KV_PAGE_SIZE, pages[i]->data, KV_PAGE_SIZE)) goto fatal_error;
+   }
+   if (!kv_file_sync(kv->file)) goto fatal_error;
+   kv_file_truncate(kv->wal, 0);
+
+   for (i=0; i<cnt; i++) {
+      pages[i]->dirty = 0;
+   }
+   kv->num_dirty = 0;
+   kv->saved_hdr = kv->hdr;
+
+   if (kv->num_cached > KV_MAX_CACHED) {
+      kv_drop_pages(kv, 0);
+   }
+
+   free(pages);
+   free(log);
+   return KV_OK;
+
+fatal_error:
+   // the database file may be partially updated, close the store so the log is replayed on the next open:
+   kv_drop_pages(kv, 1);
+   kv_drop_pages(kv, 0);
+   kv_file_close(kv->file);
+   kv_file_close(kv->wal);
+   kv->opened = 0;
+
 error:
-   free(handle);
-   free(fname);
-   return ret;
+   free(pages);
+   free(log);
+   return err;
 }
 
 
-static Value native_sqlite_close(Heap *heap, Value *error, int num_params, Value *params, void *data)
+static int kv_cell_size(int type, const unsigned char *cell)
 {
-   SQLiteHandle *handle;
-   int err;
+   uint32_t value_len;
 
-   handle = get_sqlite_handle(heap, error, params[0]);
-   if (!handle) {
-      return fixscript_int(0);
+   if (type == KV_PAGE_LEAF) {
+      value_len = kv_get32(cell + 2);
+      return 6 + kv_get16(cell) + (value_len > KV_MAX_INLINE? 4 : value_len);
    }
+   return 6 + kv_get16(cell);
+}
 
-   err = sqlite3_close_v2(handle->db);
-   handle->db = NULL;
-   if (err) {
-      *error = fixscript_create_error_string(heap, sqlite3_errmsg(handle->db));
-      return fixscript_int(0);
+
+// fills the offsets of the cells, returns the number of cells or -1 when the page is corrupted:
+static int kv_get_cells(KVPage *page, int type, int *offsets, int *used)
+{
+   int i, cnt, off = KV_NODE_HEADER, size;
+
+   if (page->data[0] != type) {
+      return -1;
    }
-   return fixscript_int(0);
+   cnt = kv_get16(page->data + 2);
+   for (i=0; i<cnt; i++) {
+      if (off + 6 > KV_PAGE_SIZE) return -1;
+      size = kv_cell_size(type, page->data + off);
+      if (kv_get16(page->data + off) > KV_MAX_KEY || off + size > KV_PAGE_SIZE) return -1;
+      offsets[i] = off;
+      off += size;
+   }
+   *used = off;
+   return cnt;
 }
 
 
-static Value native_sqlite_exec(Heap *heap, Value *error, int num_params, Value *params, void *data)
+// returns the index of the first cell with key greater (or equal when not after) than given key:
+static int kv_search(KVPage *page, int *offsets, int cnt, const unsigned char *key, int key_len, int after, int *found)
 {
-   SQLiteHandle *handle;
-   SQLiteStatementHandle *stmt_handle;
-   Value ret = fixscript_int(0);
-   sqlite3_stmt *stmt = NULL;
-   Value *sql_params = NULL, long_val[2];
-   char *sql = NULL, *sig = NULL, *text;
-   void *bin_data;
-   int i, err, len, num_sql_params=0, num_binds;
-   union {
-      uint64_t i;
-      double f;
-   } u;
+   int lo = 0, hi = cnt, mid, cmp;
+   const unsigned char *cell;
 
-   handle = get_sqlite_handle(heap, error, params[0]);
-   if (!handle) {
-      goto error;
+   *found = 0;
+   while (lo < hi) {
+      mid = (lo + hi) >> 1;
+      cell = page->data + offsets[mid];
+      cmp = kv_compare(cell + 6, kv_get16(cell), key, key_len);
+      if (cmp == 0) {
+         *found = 1;
+      }
+      if (cmp < 0 || (cmp == 0 && after)) {
+         lo = mid + 1;
+      }
+      else {
+         hi = mid;
+      }
    }
+   return lo;
+}
 
-   err = fixscript_get_string(heap, params[1], 0, -1, &sql, NULL);
-   if (err) {
-      fixscript_error(heap, error, err);
-      goto error;
-   }
 
-   if (params[2].value) {
-      err = fixscript_get_string(heap, params[2], 0, -1, &sig, NULL);
-      if (err) {
-         fixscript_error(heap, error, err);
-         goto error;
+static int kv_find_leaf(KVStore *kv, const unsigned char *key, int key_len, KVPage **leaf_out)
+{
+   KVPage *page;
+   int offsets[KV_PAGE_SIZE/6];
+   int err, depth, cnt, idx, used, found;
+   uint32_t num = kv->hdr.root;
+
+   for (depth=0; depth<KV_MAX_DEPTH; depth++) {
+      err = kv_get_page(kv, num, &page);
+      if (err) return err;
+      if (page->data[0] == KV_PAGE_LEAF) {
+         *leaf_out = page;
+         return KV_OK;
       }
-      
-      if (!params[3].value) {
-         *error = fixscript_create_error_string(heap, "must provide parameters");
-         goto error;
+      cnt = kv_get_cells(page, KV_PAGE_INTERNAL, offsets, &used);
+      if (cnt < 0) return KV_CORRUPTED;
+      if (key) {
+         idx = kv_search(page, offsets, cnt, key, key_len, 1, &found);
+      }
+      else {
+         idx = 0;
       }
+      num = idx == 0? kv_get32(page->data + 4) : kv_get32(page->data + offsets[idx-1] + 2);
+   }
+   return KV_CORRUPTED;
+}
 
-      err = fixscript_get_array_length(heap, params[3], &num_sql_params);
-      if (!err) {
-         sql_params = calloc(num_sql_params, sizeof(Value));
-         if (!sql_params) {
-            err = FIXSCRIPT_ERR_OUT_OF_MEMORY;
-         }
+
+static int kv_write_overflow(KVStore *kv, const unsigned char *data, int len, uint32_t *first)
+{
+   KVPage *page, *prev = NULL;
+   int err, amount;
+
+   *first = 0;
+   while (len > 0) {
+      err = kv_alloc_page(kv, KV_PAGE_OVERFLOW, &page);
+      if (err) return err;
+      amount = len < KV_PAGE_SIZE - KV_NODE_HEADER? len : KV_PAGE_SIZE - KV_NODE_HEADER;
+      kv_put16(page->data + 2, amount);
+      memcpy(page->data + KV_NODE_HEADER, data, amount);
+      if (prev) {
+         kv_put32(prev->data + 4, page->num);
       }
-      if (!err) {
-         err = fixscript_get_array_range(heap, params[3], 0, num_sql_params, sql_params);
+      else {
+         *first = page->num;
       }
-      if (err) {
-         fixscript_error(heap, error, err);
-         goto error;
+      prev = page;
+      data += amount;
+      len -= amount;
+   }
+   return KV_OK;
+}
+
+
+static int kv_read_overflow(KVStore *kv, uint32_t num, unsigned char *data, int len)
+{
+   KVPage *page;
+   int err, amount;
+
+   while (len > 0) {
+      err = kv_get_page(kv, num, &page);
+      if (err) return err;
+      amount = kv_get16(page->data + 2);
+      if (page->data[0] != KV_PAGE_OVERFLOW || amount > len || amount > KV_PAGE_SIZE - KV_NODE_HEADER || amount == 0) {
+         return KV_CORRUPTED;
+      }
+      memcpy(data, page->data + KV_NODE_HEADER, amount);
+      num = kv_get32(page->data + 4);
+      data += amount;
+      len -= amount;
+   }
+   return KV_OK;
+}
+
+
+static int kv_free_overflow(KVStore *kv, uint32_t num, int len)
+{
+   KVPage *page;
+   int err, amount;
+
+   while (len > 0) {
+      err = kv_get_page(kv, num, &page);
+      if (err) return err;
+      amount = kv_get16(page->data + 2);
+      if (page->data[0] != KV_PAGE_OVERFLOW || amount > len || amount == 0) {
+         return KV_CORRUPTED;
       }
+      num = kv_get32(page->data + 4);
+      len -= amount;
+      kv_free_page(kv, page);
+   }
+   return KV_OK;
+}
 
-      if (strlen(sig) != num_sql_params) {
-         *error = fixscript_create_error_string(heap, "parameter count mismatch");
-         goto error;
+
+static int kv_read_value(KVStore *kv, const unsigned char *cell, unsigned char **value_out, int *len_out)
+{
+   unsigned char *value;
+   int err, key_len, len;
+
+   key_len = kv_get16(cell);
+   len = kv_get32(cell + 2);
+   if (len < 0) return KV_CORRUPTED;
+
+   value = malloc(len > 0? len : 1);
+   if (!value) return KV_NO_MEMORY;
+
+   if (len > KV_MAX_INLINE) {
+      err = kv_read_overflow(kv, kv_get32(cell + 6 + key_len), value, len);
+      if (err) {
+         free(value);
+         return err;
       }
    }
    else {
-      if (params[3].value) {
-         *error = fixscript_create_error_string(heap, "must provide signature");
-         goto error;
-      }
+      memcpy(value, cell + 6 + key_len, len);
    }
+   *value_out = value;
+   *len_out = len;
+   return KV_OK;
+}
 
-   err = sqlite3_prepare_v2(handle->db, sql, -1, &stmt, NULL);
-   if (err) {
-      *error = fixscript_create_error_string(heap, sqlite3_errmsg(handle->db));
-      goto error;
+
+// inserts the cell at given index, splitting the page when it doesn't fit:
+static int kv_insert_cell(KVStore *kv, KVPage *page, int type, int idx, const unsigned char *cell, int cell_len, KVSplit *split)
+{
+   unsigned char tmp[KV_PAGE_SIZE*2];
+   int offsets[KV_PAGE_SIZE/6+1], tmp_offsets[KV_PAGE_SIZE/6+3];
+   KVPage *right;
+   int i, cnt, num, used, total, size, mid, best, diff, left_len, right_off, err;
+   unsigned char *p;
+
+   cnt = kv_get_cells(page, type, offsets, &used);
+   if (cnt < 0 || idx > cnt) return KV_CORRUPTED;
+
+   kv_mark_dirty(kv, page);
+   split->split = 0;
+
+   if (used + cell_len <= KV_PAGE_SIZE) {
+      p = page->data + (idx < cnt? offsets[idx] : used);
+      memmove(p + cell_len, p, page->data + used - p);
+      memcpy(p, cell, cell_len);
+      kv_put16(page->data + 2, cnt + 1);
+      return KV_OK;
+   }
+
+   // build the combined list of cells:
+   total = 0;
+   num = 0;
+   for (i=0; i<=cnt; i++) {
+      if (i == idx) {
+         tmp_offsets[num++] = total;
+         memcpy(tmp + total, cell, cell_len);
+         total += cell_len;
+      }
+      if (i < cnt) {
+         size = kv_cell_size(type, page->data + offsets[i]);
+         tmp_offsets[num++] = total;
+         memcpy(tmp + total, page->data + offsets[i], size);
+         total += size;
+      }
+   }
+   tmp_offsets[num] = total;
+
+   // find the most balanced split point where both halves fit (the middle cell is moved
+   // to the parent in the case of internal pages):
+   mid = -1;
+   best = INT_MAX;
+   for (i=1; i<num-(type == KV_PAGE_INTERNAL? 1 : 0); i++) {
+      left_len = tmp_offsets[i];
+      right_off = type == KV_PAGE_INTERNAL? tmp_offsets[i+1] : tmp_offsets[i];
+      if (KV_NODE_HEADER + left_len > KV_PAGE_SIZE || KV_NODE_HEADER + total - right_off > KV_PAGE_SIZE) continue;
+      diff = left_len - (total - right_off);
+      if (diff < 0) diff = -diff;
+      if (diff < best) {
+         best = diff;
+         mid = i;
+      }
+   }
+   if (mid < 0) return KV_CORRUPTED;
+
+   err = kv_alloc_page(kv, type, &right);
+   if (err) return err;
+
+   p = tmp + tmp_offsets[mid];
+   split->split = 1;
+   split->page = right->num;
+   split->key_len = kv_get16(p);
+   memcpy(split->key, p + 6, split->key_len);
+
+   if (type == KV_PAGE_LEAF) {
+      right_off = tmp_offsets[mid];
+      kv_put32(right->data + 4, kv_get32(page->data + 4));
+      kv_put32(page->data + 4, right->num);
+      kv_put16(right->data + 2, num - mid);
    }
-   
-   num_binds = sqlite3_bind_parameter_count(stmt);
-   if (num_binds != num_sql_params) {
-      *error = fixscript_create_error_string(heap, "parameter count mismatch");
-      goto error;
+   else {
+      right_off = tmp_offsets[mid+1];
+      kv_put32(right->data + 4, kv_get32(p + 2));
+      kv_put16(right->data + 2, num - mid - 1);
    }
+   memcpy(right->data + KV_NODE_HEADER, tmp + right_off, total - right_off);
 
-   for (i=0; i<num_sql_params; i++) {
-      switch (sig[i]) {
-         case 'i':
-            err = sqlite3_bind_int(stmt, i+1, fixscript_get_int(sql_params[i]));
-            break;
+   memset(page->data + KV_NODE_HEADER, 0, KV_PAGE_SIZE - KV_NODE_HEADER);
+   memcpy(page->data + KV_NODE_HEADER, tmp, tmp_offsets[mid]);
+   kv_put16(page->data + 2, mid);
+   return KV_OK;
+}
 
-         case 'l':
-            if (sql_params[i].value) {
-               err = fixscript_get_array_range(heap, sql_params[i], 0, 2, long_val);
-               if (err) {
-                  fixscript_error(heap, error, err);
-                  goto error;
-               }
-               u.i = ((uint64_t)(uint32_t)long_val[0].value) | (((uint64_t)(uint32_t)long_val[1].value) << 32);
-               err = sqlite3_bind_int64(stmt, i+1, u.i);
-            }
-            else {
-               err = sqlite3_bind_null(stmt, i+1);
-            }
-            break;
 
-         case 'f':
-            err = sqlite3_bind_double(stmt, i+1, fixscript_get_float(sql_params[i]));
-            break;
+static void kv_remove_cell(KVStore *kv, KVPage *page, int type, int *offsets, int cnt, int used, int idx)
+{
+   int size;
 
-         case 'd':
-            if (sql_params[i].value) {
-               err = fixscript_get_array_range(heap, sql_params[i], 0, 2, long_val);
-               if (err) {
-                  fixscript_error(heap, error, err);
-                  goto error;
-               }
-               u.i = ((uint64_t)(uint32_t)long_val[0].value) | (((uint64_t)(uint32_t)long_val[1].value) << 32);
-               err = sqlite3_bind_double(stmt, i+1, u.f);
-            }
-            else {
-               err = sqlite3_bind_null(stmt, i+1);
-            }
-            break;
+   size = kv_cell_size(type, page->data + offsets[idx]);
+   memmove(page->data + offsets[idx], page->data + offsets[idx] + size, used - offsets[idx] - size);
+   memset(page->data + used - size, 0, size);
+   kv_put16(page->data + 2, cnt - 1);
+   kv_mark_dirty(kv, page);
+}
 
-         case 's':
-            if (sql_params[i].value) {
-               err = fixscript_get_string(heap, sql_params[i], 0, -1, &text, NULL);
-               if (err) {
-                  fixscript_error(heap, error, err);
-                  goto error;
-               }
-               err = sqlite3_bind_text(stmt, i+1, text, -1, free);
-            }
-            else {
-               err = sqlite3_bind_null(stmt, i+1);
-            }
-            break;
 
-         case 'b':
-            if (sql_params[i].value) {
-               err = fixscript_get_array_length(heap, sql_params[i], &len);
-               if (!err) {
-                  err = fixscript_lock_array(heap, sql_params[i], 0, len, &bin_data, 1, ACCESS_READ_ONLY);
-               }
-               if (err) {
-                  fixscript_error(heap, error, err);
-                  goto error;
-               }
-               err = sqlite3_bind_blob(stmt, i+1, bin_data, len, SQLITE_TRANSIENT);
-               fixscript_unlock_array(heap, sql_params[i], 0, len, &bin_data, 1, ACCESS_READ_ONLY);
-            }
-            else {
-               err = sqlite3_bind_null(stmt, i+1);
-            }
-            break;
+static int kv_get(KVStore *kv, const unsigned char *key, int key_len, unsigned char **value_out, int *len_out)
+{
+   KVPage *leaf;
+   int offsets[KV_PAGE_SIZE/6];
+   int err, cnt, used, idx, found;
 
-         default:
-            *error = fixscript_create_error_string(heap, "invalid signature");
-            goto error;
-      }
+   err = kv_find_leaf(kv, key, key_len, &leaf);
+   if (err) return err;
 
-      if (err) {
-         *error = fixscript_create_error_string(heap, sqlite3_errmsg(handle->db));
-         goto error;
+   cnt = kv_get_cells(leaf, KV_PAGE_LEAF, offsets, &used);
+   if (cnt < 0) return KV_CORRUPTED;
+
+   idx = kv_search(leaf, offsets, cnt, key, key_len, 0, &found);
+   if (!found || idx >= cnt) {
+      *value_out = NULL;
+      return KV_OK;
+   }
+   return kv_read_value(kv, leaf->data + offsets[idx], value_out, len_out);
+}
+
+
+static int kv_put(KVStore *kv, const unsigned char *key, int key_len, const unsigned char *value, int value_len)
+{
+   KVPage *page, *root, *path[KV_MAX_DEPTH];
+   int path_idx[KV_MAX_DEPTH];
+   unsigned char cell[6 + KV_MAX_KEY + KV_MAX_INLINE];
+   int offsets[KV_PAGE_SIZE/6];
+   KVSplit split, parent_split;
+   int err, depth, cnt, used, idx, found, cell_len;
+   uint32_t num = kv->hdr.root, overflow;
+
+   for (depth=0; ; depth++) {
+      if (depth >= KV_MAX_DEPTH) return KV_CORRUPTED;
+      err = kv_get_page(kv, num, &page);
+      if (err) return err;
+      if (page->data[0] == KV_PAGE_LEAF) break;
+
+      cnt = kv_get_cells(page, KV_PAGE_INTERNAL, offsets, &used);
+      if (cnt < 0) return KV_CORRUPTED;
+      idx = kv_search(page, offsets, cnt, key, key_len, 1, &found);
+      path[depth] = page;
+      path_idx[depth] = idx;
+      num = idx == 0? kv_get32(page->data + 4) : kv_get32(page->data + offsets[idx-1] + 2);
+   }
+
+   cnt = kv_get_cells(page, KV_PAGE_LEAF, offsets, &used);
+   if (cnt < 0) return KV_CORRUPTED;
+   idx = kv_search(page, offsets, cnt, key, key_len, 0, &found);
+   if (found) {
+      if (kv_get32(page->data + offsets[idx] + 2) > KV_MAX_INLINE) {
+         err = kv_free_overflow(kv, kv_get32(page->data + offsets[idx] + 6 + key_len), kv_get32(page->data + offsets[idx] + 2));
+         if (err) return err;
       }
+      kv_remove_cell(kv, page, KV_PAGE_LEAF, offsets, cnt, used, idx);
+   }
+   else {
+      kv->hdr.count++;
    }
 
-   err = sqlite3_step(stmt);
-   if (err == SQLITE_DONE) {
-      if (sqlite3_column_count(stmt) == 0) {
-         err = sqlite3_finalize(stmt);
-         if (err) {
-            *error = fixscript_create_error_string(heap, sqlite3_errmsg(handle->db));
-         }
-         goto error;
+   kv_put16(cell, key_len);
+   kv_put32(cell + 2, value_len);
+   memcpy(cell + 6, key, key_len);
+   cell_len = 6 + key_len;
+   if (value_len > KV_MAX_INLINE) {
+      err = kv_write_overflow(kv, value, value_len, &overflow);
+      if (err) return err;
+      kv_put32(cell + cell_len, overflow);
+      cell_len += 4;
+   }
+   else {
+      memcpy(cell + cell_len, value, value_len);
+      cell_len += value_len;
+   }
+
+   err = kv_insert_cell(kv, page, KV_PAGE_LEAF, idx, cell, cell_len, &split);
+   if (err) return err;
+
+   while (split.split) {
+      kv_put16(cell, split.key_len);
+      kv_put32(cell + 2, split.page);
+      memcpy(cell + 6, split.key, split.key_len);
+      cell_len = 6 + split.key_len;
+
+      if (depth == 0) {
+         err = kv_alloc_page(kv, KV_PAGE_INTERNAL, &root);
+         if (err) return err;
+         kv_put32(root->data + 4, kv->hdr.root);
+         kv_put16(root->data + 2, 1);
+         memcpy(root->data + KV_NODE_HEADER, cell, cell_len);
+         kv->hdr.root = root->num;
+         break;
       }
+
+      depth--;
+      err = kv_insert_cell(kv, path[depth], KV_PAGE_INTERNAL, path_idx[depth], cell, cell_len, &parent_split);
+      if (err) return err;
+      split = parent_split;
    }
-   else if (err != SQLITE_ROW) {
-      *error = fixscript_create_error_string(heap, sqlite3_errmsg(handle->db));
-      sqlite3_finalize(stmt);
+   return KV_OK;
+}
+
+
+static int kv_remove(KVStore *kv, const unsigned char *key, int key_len, int *removed)
+{
+   KVPage *leaf;
+   int offsets[KV_PAGE_SIZE/6];
+   int err, cnt, used, idx, found;
+   uint32_t value_len;
+
+   *removed = 0;
+
+   err = kv_find_leaf(kv, key, key_len, &leaf);
+   if (err) return err;
+
+   cnt = kv_get_cells(leaf, KV_PAGE_LEAF, offsets, &used);
+   if (cnt < 0) return KV_CORRUPTED;
+
+   idx = kv_search(leaf, offsets, cnt, key, key_len, 0, &found);
+   if (!found) {
+      return KV_OK;
+   }
+
+   value_len = kv_get32(leaf->data + offsets[idx] + 2);
+   if (value_len > KV_MAX_INLINE) {
+      err = kv_free_overflow(kv, kv_get32(leaf->data + offsets[idx] + 6 + key_len), value_len);
+      if (err) return err;
+   }
+   kv_remove_cell(kv, leaf, KV_PAGE_LEAF, offsets, cnt, used, idx);
+   kv->hdr.count--;
+   *removed = 1;
+   return KV_OK;
+}
+
+
+static int kv_open_files(KVStore *kv, Heap *heap, Value *error, Value path)
+{
+#if defined(_WIN32)
+   uint16_t *fname = NULL, *wal_fname = NULL;
+   int i, len;
+#else
+   char *fname = NULL, *wal_fname = NULL;
+#endif
+   int err, ret = 0;
+
+#if defined(_WIN32)
+   err = fixscript_get_string_utf16(heap, path, 0, -1, &fname, &len);
+#else
+   err = fixscript_get_string(heap, path, 0, -1, &fname, NULL);
+#endif
+   if (err) {
+      fixscript_error(heap, error, err);
       goto error;
    }
 
-   stmt_handle = calloc(1, sizeof(SQLiteStatementHandle));
-   if (!stmt_handle) {
-      sqlite3_finalize(stmt);
+#if defined(_WIN32)
+   wal_fname = malloc((len + 5) * sizeof(uint16_t));
+   if (!wal_fname) {
       fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
       goto error;
    }
+   memcpy(wal_fname, fname, len * sizeof(uint16_t));
+   for (i=0; i<5; i++) {
+      wal_fname[len+i] = "-wal"[i];
+   }
 
-   stmt_handle->stmt = stmt;
-   stmt_handle->done = (err == SQLITE_DONE);
-   stmt_handle->ignore_step = 1;
-   
-   ret = fixscript_create_value_handle(heap, HANDLE_TYPE_SQLITE_STMT, stmt_handle, sqlite_stmt_handle_func);
-   if (!ret.value) {
+   kv->file = CreateFile(fname, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+   if (kv->file == INVALID_HANDLE_VALUE) {
+      *error = fixscript_create_error_string(heap, GetLastError() == ERROR_SHARING_VIOLATION? "database is locked" : "can't open database file");
+      goto error;
+   }
+   kv->wal = CreateFile(wal_fname, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+   if (kv->wal == INVALID_HANDLE_VALUE) {
+      CloseHandle(kv->file);
+      *error = fixscript_create_error_string(heap, "can't open database log file");
+      goto error;
+   }
+#else
+   wal_fname = malloc(strlen(fname) + 5);
+   if (!wal_fname) {
       fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
       goto error;
    }
+   strcpy(wal_fname, fname);
+   strcat(wal_fname, "-wal");
+
+   kv->file = open(fname, O_RDWR | O_CREAT, 0666);
+   if (kv->file == -1) {
+      *error = fixscript_create_error_string(heap, "can't open database file");
+      goto error;
+   }
+   if (flock(kv->file, LOCK_EX | LOCK_NB) != 0) {
+      close(kv->file);
+      *error = fixscript_create_error_string(heap, "database is locked");
+      goto error;
+   }
+   kv->wal = open(wal_fname, O_RDWR | O_CREAT, 0666);
+   if (kv->wal == -1) {
+      close(kv->file);
+      *error = fixscript_create_error_string(heap, "can't open database log file");
+      goto error;
+   }
+#endif
+   kv->opened = 1;
+   ret = 1;
 
 error:
-   free(sql);
-   free(sig);
-   free(sql_params);
+   free(fname);
+   free(wal_fname);
    return ret;
 }
 
 
-static Value native_sqlite_step(Heap *heap, Value *error, int num_params, Value *params, void *data)
+static int kv_load(KVStore *kv)
 {
-   SQLiteStatementHandle *stmt_handle;
-   int err;
+   KVPage *page;
+   unsigned char *log, header[KV_PAGE_SIZE];
+   int64_t size;
+   int ret;
 
-   stmt_handle = get_sqlite_stmt_handle(heap, error, params[0]);
-   if (!stmt_handle) {
-      return fixscript_int(0);
+   // replay the log of the last commit when it's complete:
+   size = kv_file_size(kv->wal);
+   if (size < 0) return KV_IO_ERROR;
+   if (size > 0) {
+      if (size <= INT_MAX) {
+         log = malloc(size);
+         if (!log) return KV_NO_MEMORY;
+         ret = kv_file_read(kv->wal, 0, log, size);
+         if (ret == size) {
+            ret = kv_apply_log(kv, log, size);
+         }
+         free(log);
+         if (ret < 0) return KV_IO_ERROR;
+      }
+      if (!kv_file_truncate(kv->wal, 0) || !kv_file_sync(kv->wal)) {
+         return KV_IO_ERROR;
+      }
    }
 
-   if (stmt_handle->done) {
-      return fixscript_int(0);
+   size = kv_file_size(kv->file);
+   if (size < 0) return KV_IO_ERROR;
+   if (size == 0) {
+      memset(&kv->hdr, 0, sizeof(KVHeader));
+      memset(&kv->saved_hdr, 0, sizeof(KVHeader));
+      kv->hdr.num_pages = 1;
+      ret = kv_alloc_page(kv, KV_PAGE_LEAF, &page);
+      if (ret) return ret;
+      kv->hdr.root = page->num;
+      return kv_commit(kv);
    }
 
-   if (stmt_handle->ignore_step) {
-      stmt_handle->ignore_step = 0;
-      return fixscript_int(1);
+   if (kv_file_read(kv->file, 0, header, KV_PAGE_SIZE) != KV_PAGE_SIZE) {
+      return KV_CORRUPTED;
    }
-
-   err = sqlite3_step(stmt_handle->stmt);
-   if (err == SQLITE_ROW) {
-      return fixscript_int(1);
+   if (memcmp(header, kv_magic, 8) != 0 || kv_get32(header + 8) != KV_PAGE_SIZE) {
+      return KV_CORRUPTED;
    }
-   if (err != SQLITE_DONE) {
-      *error = fixscript_create_error_string(heap, sqlite3_errstr(err));
-      return fixscript_int(0);
+   kv->hdr.root = kv_get32(header + 12);
+   kv->hdr.num_pages = kv_get32(header + 16);
+   kv->hdr.free_head = kv_get32(header + 20);
+   kv->hdr.count = kv_get32(header + 24);
+   if (kv->hdr.root == 0 || kv->hdr.root >= kv->hdr.num_pages || kv->hdr.free_head >= kv->hdr.num_pages || (int64_t)kv->hdr.num_pages * KV_PAGE_SIZE > size) {
+      return KV_CORRUPTED;
    }
-   stmt_handle->done = 1;
-   return fixscript_int(0);
+   kv->saved_hdr = kv->hdr;
+   return KV_OK;
 }
 
 
-static Value native_sqlite_finalize(Heap *heap, Value *error, int num_params, Value *params, void *data)
+static void kv_close(KVStore *kv)
 {
-   SQLiteStatementHandle *stmt_handle;
-   int err;
-
-   stmt_handle = get_sqlite_stmt_handle(heap, error, params[0]);
-   if (!stmt_handle) {
-      return fixscript_int(0);
-   }
+   if (!kv->opened) return;
 
-   err = sqlite3_finalize(stmt_handle->stmt);
-   stmt_handle->stmt = NULL;
-   if (err) {
-      *error = fixscript_create_error_string(heap, sqlite3_errstr(err));
-      return fixscript_int(0);
-   }
-   return fixscript_int(0);
+   kv_rollback(kv);
+   kv_drop_pages(kv, 0);
+   kv_file_close(kv->file);
+   kv_file_close(kv->wal);
+   kv->opened = 0;
 }
 
 
-static Value native_sqlite_column_count(Heap *heap, Value *error, int num_params, Value *params, void *data)
+static void *kv_store_handle_func(Heap *heap, int op, void *p1, void *p2)
 {
-   SQLiteStatementHandle *stmt_handle;
-
-   stmt_handle = get_sqlite_stmt_handle(heap, error, params[0]);
-   if (!stmt_handle) {
-      return fixscript_int(0);
+   KVStore *kv = p1;
+   switch (op) {
+      case HANDLE_OP_FREE:
+         kv_close(kv);
+         free(kv);
+         break;
    }
-
-   return fixscript_int(sqlite3_column_count(stmt_handle->stmt));
+   return NULL;
 }
 
 
-static Value native_sqlite_column_name(Heap *heap, Value *error, int num_params, Value *params, void *data)
+static KVStore *get_kv_store(Heap *heap, Value *error, Value handle_val)
 {
-   SQLiteStatementHandle *stmt_handle;
-   Value ret;
-   const char *name;
+   KVStore *kv;
 
-   stmt_handle = get_sqlite_stmt_handle(heap, error, params[0]);
-   if (!stmt_handle) {
-      return fixscript_int(0);
+   kv = fixscript_get_handle(heap, handle_val, HANDLE_TYPE_KV_STORE, NULL);
+   if (!kv) {
+      *error = fixscript_create_error_string(heap, "invalid key-value store handle");
+      return NULL;
+   }
+
+   if (!kv->opened) {
+      *error = fixscript_create_error_string(heap, "key-value store is already closed");
+      return NULL;
    }
+   return kv;
+}
 
-   name = sqlite3_column_name(stmt_handle->stmt, params[1].value);
-   if (!name) {
-      if (params[1].value < 0 || params[1].value >= sqlite3_column_count(stmt_handle->stmt)) {
-         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_BOUNDS);
-      }
-      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
-   }
 
-   ret = fixscript_create_string(heap, name, -1);
-   if (!ret.value) {
-      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+static Value kv_error(Heap *heap, Value *error, KVStore *kv, int err)
+{
+   // any failure discards the whole transaction as the modified pages may be inconsistent:
+   kv_rollback(kv);
+   kv->in_transaction = 0;
+
+   switch (err) {
+      case KV_IO_ERROR:
+         *error = fixscript_create_error_string(heap, "I/O error");
+         break;
+
+      case KV_CORRUPTED:
+         *error = fixscript_create_error_string(heap, "database is corrupted");
+         break;
+
+      default:
+         fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+         break;
    }
-   return ret;
+   return fixscript_int(0);
 }
 
 
-static Value native_sqlite_column_type(Heap *heap, Value *error, int num_params, Value *params, void *data)
+static int kv_serialize_key(Heap *heap, Value *error, Value key, Buffer *buf)
 {
-   SQLiteStatementHandle *stmt_handle;
-   const char *name;
+   int err;
 
-   stmt_handle = get_sqlite_stmt_handle(heap, error, params[0]);
-   if (!stmt_handle) {
-      return fixscript_int(0);
+   buf->start = malloc(64);
+   if (!buf->start) {
+      fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      return 0;
    }
+   buf->cur = buf->start;
+   buf->end = buf->start + 64;
 
-   name = sqlite3_column_decltype(stmt_handle->stmt, params[1].value);
-   if (name) {
-      if (strcmp(name, "INTEGER") == 0) return fixscript_int(SQL_TYPE_LONG);
-      if (strcmp(name, "REAL") == 0)    return fixscript_int(SQL_TYPE_DOUBLE);
-      if (strcmp(name, "TEXT") == 0)    return fixscript_int(SQL_TYPE_STRING);
-      if (strcmp(name, "BLOB") == 0)    return fixscript_int(SQL_TYPE_BINARY);
+   err = serialize_key(heap, key, buf, 50);
+   if (err) {
+      free(buf->start);
+      fixscript_error(heap, error, err);
+      return 0;
    }
 
-   if (params[1].value < 0 || params[1].value >= sqlite3_column_count(stmt_handle->stmt)) {
-      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_BOUNDS);
+   if (buf->cur - buf->start > KV_MAX_KEY) {
+      free(buf->start);
+      *error = fixscript_create_error_string(heap, "key is too long");
+      return 0;
    }
-   return fixscript_int(SQL_TYPE_UNKNOWN);
+   return 1;
 }
 
 
-static Value native_sqlite_data_type(Heap *heap, Value *error, int num_params, Value *params, void *data)
+static Value native_kv_open(Heap *heap, Value *error, int num_params, Value *params, void *data)
 {
-   SQLiteStatementHandle *stmt_handle;
-   int type;
+   KVStore *kv;
+   Value handle;
+   int err;
 
-   stmt_handle = get_sqlite_stmt_handle(heap, error, params[0]);
-   if (!stmt_handle) {
+   kv = calloc(1, sizeof(KVStore));
+   if (!kv) {
+      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+   }
+
+   if (!kv_open_files(kv, heap, error, params[0])) {
+      free(kv);
       return fixscript_int(0);
    }
 
-   type = sqlite3_column_type(stmt_handle->stmt, params[1].value);
-   if (type == SQLITE_NULL) {
-      if (params[1].value < 0 || params[1].value >= sqlite3_column_count(stmt_handle->stmt)) {
-         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_BOUNDS);
-      }
-      return fixscript_int(SQL_TYPE_UNKNOWN);
+   err = kv_load(kv);
+   if (err) {
+      kv_error(heap, error, kv, err);
+      kv_close(kv);
+      free(kv);
+      return fixscript_int(0);
    }
 
-   switch (type) {
-      case SQLITE_INTEGER: return fixscript_int(SQL_TYPE_LONG);
-      case SQLITE_FLOAT:   return fixscript_int(SQL_TYPE_DOUBLE);
-      case SQLITE_TEXT:    return fixscript_int(SQL_TYPE_STRING);
-      case SQLITE_BLOB:    return fixscript_int(SQL_TYPE_BINARY);
+   handle = fixscript_create_value_handle(heap, HANDLE_TYPE_KV_STORE, kv, kv_store_handle_func);
+   if (!handle.value) {
+      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
    }
-   return fixscript_int(SQL_TYPE_UNKNOWN);
+   return handle;
 }
 
 
-static Value native_sqlite_is_null(Heap *heap, Value *error, int num_params, Value *params, void *data)
+static Value native_kv_close(Heap *heap, Value *error, int num_params, Value *params, void *data)
 {
-   SQLiteStatementHandle *stmt_handle;
+   KVStore *kv;
 
-   stmt_handle = get_sqlite_stmt_handle(heap, error, params[0]);
-   if (!stmt_handle) {
+   kv = get_kv_store(heap, error, params[0]);
+   if (!kv) {
       return fixscript_int(0);
    }
 
-   if (sqlite3_column_type(stmt_handle->stmt, params[1].value) == SQLITE_NULL) {
-      if (params[1].value < 0 || params[1].value >= sqlite3_column_count(stmt_handle->stmt)) {
-         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_BOUNDS);
-      }
-      return fixscript_int(1);
-   }
+   kv_close(kv);
    return fixscript_int(0);
 }
 
 
-static Value native_sqlite_get_int(Heap *heap, Value *error, int num_params, Value *params, void *data)
+static Value native_kv_get(Heap *heap, Value *error, int num_params, Value *params, void *data)
 {
-   SQLiteStatementHandle *stmt_handle;
-   int64_t value;
+   int contains = (intptr_t)data;
+   KVStore *kv;
+   Buffer key;
+   Value ret;
+   unsigned char *value;
+   int err, len;
 
-   stmt_handle = get_sqlite_stmt_handle(heap, error, params[0]);
-   if (!stmt_handle) {
+   kv = get_kv_store(heap, error, params[0]);
+   if (!kv) {
       return fixscript_int(0);
    }
 
-   value = sqlite3_column_int64(stmt_handle->stmt, params[1].value);
-   if (value < INT_MIN || value > INT_MAX) {
-      *error = fixscript_create_error_string(heap, "integer overflow");
+   if (!kv_serialize_key(heap, error, params[1], &key)) {
       return fixscript_int(0);
    }
-   if (value == 0) {
-      if (sqlite3_column_type(stmt_handle->stmt, params[1].value) == SQLITE_NULL) {
-         if (params[1].value < 0 || params[1].value >= sqlite3_column_count(stmt_handle->stmt)) {
-            return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_BOUNDS);
-         }
-         return params[2];
-      }
-   }
-   return fixscript_int(value);
-}
 
+   err = kv_get(kv, (unsigned char *)key.start, key.cur - key.start, &value, &len);
+   free(key.start);
+   if (err) {
+      return kv_error(heap, error, kv, err);
+   }
 
-static Value native_sqlite_get_long(Heap *heap, Value *error, int num_params, Value *params, void *data)
-{
-   SQLiteStatementHandle *stmt_handle;
-   uint64_t value;
+   if (contains) {
+      free(value);
+      return fixscript_int(value != NULL);
+   }
 
-   stmt_handle = get_sqlite_stmt_handle(heap, error, params[0]);
-   if (!stmt_handle) {
-      return fixscript_int(0);
+   if (!value) {
+      return params[2];
    }
 
-   value = sqlite3_column_int64(stmt_handle->stmt, params[1].value);
-   if (value == 0) {
-      if (sqlite3_column_type(stmt_handle->stmt, params[1].value) == SQLITE_NULL) {
-         if (params[1].value < 0 || params[1].value >= sqlite3_column_count(stmt_handle->stmt)) {
-            return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_BOUNDS);
-         }
-         return params[2];
-      }
+   err = fixscript_unserialize_from_array(heap, (char *)value, NULL, len, &ret);
+   free(value);
+   if (err) {
+      return fixscript_error(heap, error, err);
    }
-   *error = fixscript_int(value >> 32);
-   return fixscript_int(value);
+   return ret;
 }
 
 
-static Value native_sqlite_get_float(Heap *heap, Value *error, int num_params, Value *params, void *data)
+static Value native_kv_put(Heap *heap, Value *error, int num_params, Value *params, void *data)
 {
-   int use_double = (data == (void *)1);
-   SQLiteStatementHandle *stmt_handle;
-   double value;
-   union {
-      double f;
-      uint64_t i;
-   } u;
+   KVStore *kv;
+   Buffer key;
+   char *value;
+   int err, len, removed;
 
-   stmt_handle = get_sqlite_stmt_handle(heap, error, params[0]);
-   if (!stmt_handle) {
+   kv = get_kv_store(heap, error, params[0]);
+   if (!kv) {
       return fixscript_int(0);
    }
 
-   value = sqlite3_column_double(stmt_handle->stmt, params[1].value);
-   if (value == 0) {
-      if (sqlite3_column_type(stmt_handle->stmt, params[1].value) == SQLITE_NULL) {
-         if (params[1].value < 0 || params[1].value >= sqlite3_column_count(stmt_handle->stmt)) {
-            return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_BOUNDS);
-         }
-         return params[2];
+   if (!kv_serialize_key(heap, error, params[1], &key)) {
+      return fixscript_int(0);
+   }
+
+   if (num_params == 3) {
+      err = fixscript_serialize_to_array(heap, &value, &len, params[2]);
+      if (err) {
+         free(key.start);
+         return fixscript_error(heap, error, err);
       }
+      err = kv_put(kv, (unsigned char *)key.start, key.cur - key.start, (unsigned char *)value, len);
+      free(value);
+      removed = 1;
    }
-   if (use_double) {
-      u.f = value;
-      *error = fixscript_int(u.i >> 32);
-      return fixscript_int(u.i);
+   else {
+      err = kv_remove(kv, (unsigned char *)key.start, key.cur - key.start, &removed);
    }
-   return fixscript_float(value);
+   free(key.start);
+
+   if (!err && !kv->in_transaction) {
+      err = kv_commit(kv);
+   }
+   if (err) {
+      return kv_error(heap, error, kv, err);
+   }
+   return fixscript_int(removed);
 }
 
 
-static Value native_sqlite_get_string(Heap *heap, Value *error, int num_params, Value *params, void *data)
+static Value native_kv_transaction(Heap *heap, Value *error, int num_params, Value *params, void *data)
 {
-   SQLiteStatementHandle *stmt_handle;
-   const unsigned char *text;
-   Value ret;
+   int op = (intptr_t)data;
+   KVStore *kv;
+   int err;
 
-   stmt_handle = get_sqlite_stmt_handle(heap, error, params[0]);
-   if (!stmt_handle) {
+   kv = get_kv_store(heap, error, params[0]);
+   if (!kv) {
       return fixscript_int(0);
    }
 
-   text = sqlite3_column_text(stmt_handle->stmt, params[1].value);
-   if (!text) {
-      if (params[1].value < 0 || params[1].value >= sqlite3_column_count(stmt_handle->stmt)) {
-         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_BOUNDS);
-      }
-      return fixscript_int(0);
-   }
+   switch (op) {
+      case 0: // begin
+         if (kv->in_transaction) {
+            *error = fixscript_create_error_string(heap, "transaction is already in progress");
+            return fixscript_int(0);
+         }
+         kv->in_transaction = 1;
+         break;
 
-   ret = fixscript_create_string(heap, (const char *)text, -1);
-   if (!ret.value) {
-      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      case 1: // commit
+         if (!kv->in_transaction) {
+            *error = fixscript_create_error_string(heap, "no transaction in progress");
+            return fixscript_int(0);
+         }
+         err = kv_commit(kv);
+         if (err) {
+            return kv_error(heap, error, kv, err);
+         }
+         kv->in_transaction = 0;
+         break;
+
+      case 2: // rollback
+         if (!kv->in_transaction) {
+            *error = fixscript_create_error_string(heap, "no transaction in progress");
+            return fixscript_int(0);
+         }
+         kv_rollback(kv);
+         kv->in_transaction = 0;
+         break;
    }
-   return ret;
+   return fixscript_int(0);
 }
 
 
-static Value native_sqlite_get_binary(Heap *heap, Value *error, int num_params, Value *params, void *data)
+static Value native_kv_count(Heap *heap, Value *error, int num_params, Value *params, void *data)
 {
-   SQLiteStatementHandle *stmt_handle;
-   const void *blob;
-   Value ret;
+   KVStore *kv;
 
-   stmt_handle = get_sqlite_stmt_handle(heap, error, params[0]);
-   if (!stmt_handle) {
+   kv = get_kv_store(heap, error, params[0]);
+   if (!kv) {
       return fixscript_int(0);
    }
+   return fixscript_int(kv->hdr.count);
+}
 
-   blob = sqlite3_column_blob(stmt_handle->stmt, params[1].value);
-   if (!blob) {
-      if (params[1].value < 0 || params[1].value >= sqlite3_column_count(stmt_handle->stmt)) {
-         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_BOUNDS);
-      }
+
+static Value native_kv_range(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+   KVStore *kv;
+   KVPage *leaf;
+   Buffer from, to;
+   Value ret, key, value;
+   int offsets[KV_PAGE_SIZE/6];
+   int from_mode = params[2].value, to_mode = params[4].value, limit = params[5].value;
+   unsigned char *cell, *value_data;
+   int err, cnt, used, idx, found, cmp, len, num = 0;
+   uint32_t next, visited = 0;
+
+   kv = get_kv_store(heap, error, params[0]);
+   if (!kv) {
       return fixscript_int(0);
    }
 
-   ret = fixscript_create_byte_array(heap, (const char *)blob, sqlite3_column_bytes(stmt_handle->stmt, params[1].value));
+   from.start = from.cur = NULL;
+   to.start = to.cur = NULL;
+   if (from_mode != KV_UNBOUNDED && !kv_serialize_key(heap, error, params[1], &from)) {
+      return fixscript_int(0);
+   }
+   if (to_mode != KV_UNBOUNDED && !kv_serialize_key(heap, error, params[3], &to)) {
+      free(from.start);
+      return fixscript_int(0);
+   }
+
+   ret = fixscript_create_array(heap, 0);
    if (!ret.value) {
-      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      goto error;
    }
-   return ret;
-}
 
+   err = kv_find_leaf(kv, (unsigned char *)from.start, from.cur - from.start, &leaf);
+   if (err) goto kv_error;
 
-static Value native_sqlite_last_insert_rowid(Heap *heap, Value *error, int num_params, Value *params, void *data)
-{
-   SQLiteHandle *handle;
-   uint64_t ret;
+   idx = -1;
+   for (;;) {
+      cnt = kv_get_cells(leaf, KV_PAGE_LEAF, offsets, &used);
+      if (cnt < 0) {
+         err = KV_CORRUPTED;
+         goto kv_error;
+      }
+      if (idx < 0) {
+         idx = from.start? kv_search(leaf, offsets, cnt, (unsigned char *)from.start, from.cur - from.start, from_mode == KV_EXCLUSIVE, &found) : 0;
+      }
 
-   handle = get_sqlite_handle(heap, error, params[0]);
-   if (!handle) {
-      return fixscript_int(0);
+      for (; idx<cnt && num<limit; idx++) {
+         cell = leaf->data + offsets[idx];
+         if (to.start) {
+            cmp = kv_compare(cell + 6, kv_get16(cell), (unsigned char *)to.start, to.cur - to.start);
+            if (cmp > 0 || (cmp == 0 && to_mode == KV_EXCLUSIVE)) goto done;
+         }
+
+         err = kv_read_value(kv, cell, &value_data, &len);
+         if (err) goto kv_error;
+         err = fixscript_unserialize_from_array(heap, (char *)cell + 6, NULL, kv_get16(cell), &key);
+         if (!err) {
+            err = fixscript_unserialize_from_array(heap, (char *)value_data, NULL, len, &value);
+         }
+         free(value_data);
+         if (!err) {
+            err = fixscript_append_array_elem(heap, ret, key);
+         }
+         if (!err) {
+            err = fixscript_append_array_elem(heap, ret, value);
+         }
+         if (err) {
+            fixscript_error(heap, error, err);
+            goto error;
+         }
+         num++;
+      }
+      if (num >= limit) break;
+
+      next = kv_get32(leaf->data + 4);
+      if (next == 0) break;
+      if (++visited > kv->hdr.num_pages) {
+         err = KV_CORRUPTED;
+         goto kv_error;
+      }
+      err = kv_get_page(kv, next, &leaf);
+      if (err) goto kv_error;
+      idx = 0;
    }
 
-   ret = sqlite3_last_insert_rowid(handle->db);
-   *error = fixscript_int(ret >> 32);
-   return fixscript_int(ret);
+done:
+   free(from.start);
+   free(to.start);
+   return ret;
+
+kv_error:
+   kv_error(heap, error, kv, err);
+error:
+   free(from.start);
+   free(to.start);
+   return fixscript_int(0);
 }
 
-#endif /* FIXIO_SQLITE */
+#endif /* __wasm__ */
 
 
 void fixio_register_functions(Heap *heap)
@@ -14518,16 +19529,22 @@ void fixio_register_functions(Heap *heap)
    
    fixscript_register_native_func(heap, "zcompress#1", native_zcompress_memory, (void *)(ZC_COMPRESS));
    fixscript_register_native_func(heap, "zcompress#3", native_zcompress_memory, (void *)(ZC_COMPRESS));
+   fixscript_register_native_func(heap, "zcompress#2", native_zcompress_memory, (void *)(ZC_COMPRESS));
+   fixscript_register_native_func(heap, "zcompress#4", native_zcompress_memory, (void *)(ZC_COMPRESS));
    fixscript_register_native_func(heap, "zuncompress#1", native_zcompress_memory, (void *)(0));
    fixscript_register_native_func(heap, "zuncompress#3", native_zcompress_memory, (void *)(0));
    fixscript_register_native_func(heap, "gzip_compress#1", native_zcompress_memory, (void *)(ZC_COMPRESS | ZC_GZIP));
    fixscript_register_native_func(heap, "gzip_compress#3", native_zcompress_memory, (void *)(ZC_COMPRESS | ZC_GZIP));
+   fixscript_register_native_func(heap, "gzip_compress#2", native_zcompress_memory, (void *)(ZC_COMPRESS | ZC_GZIP));
+   fixscript_register_native_func(heap, "gzip_compress#4", native_zcompress_memory, (void *)(ZC_COMPRESS | ZC_GZIP));
    fixscript_register_native_func(heap, "gzip_uncompress#1", native_zcompress_memory, (void *)(ZC_GZIP));
    fixscript_register_native_func(heap, "gzip_uncompress#3", native_zcompress_memory, (void *)(ZC_GZIP));
 
    fixscript_register_native_func(heap, "zcompress_create#1", native_zcompress_create, (void *)(ZC_COMPRESS));
+   fixscript_register_native_func(heap, "zcompress_create#2", native_zcompress_create, (void *)(ZC_COMPRESS));
    fixscript_register_native_func(heap, "zuncompress_create#0", native_zcompress_create, (void *)(0));
    fixscript_register_native_func(heap, "gzip_compress_create#1", native_zcompress_create, (void *)(ZC_COMPRESS | ZC_GZIP));
+   fixscript_register_native_func(heap, "gzip_compress_create#2", native_zcompress_create, (void *)(ZC_COMPRESS | ZC_GZIP));
    fixscript_register_native_func(heap, "gzip_uncompress_create#0", native_zcompress_create, (void *)(ZC_GZIP));
    fixscript_register_native_func(heap, "zcompress_process#8", native_zcompress_process, NULL);
    fixscript_register_native_func(heap, "zcompress_get_read#1", native_zcompress_get_info, (void *)0);
@@ -14566,12 +19583,34 @@ void fixio_register_functions(Heap *heap)
    fixscript_register_native_func(heap, "file_unlock#1", native_file_unlock, NULL);
    fixscript_register_native_func(heap, "file_get_native_descriptor#1", native_file_get_native_descriptor, NULL);
    fixscript_register_native_func(heap, "file_get_native_handle#1", native_file_get_native_handle, NULL);
+   fixscript_register_native_func(heap, "file_map#5", native_file_map, NULL);
+   fixscript_register_native_func(heap, "file_unmap#1", native_file_unmap, NULL);
+   fixscript_register_native_func(heap, "file_map_advise#4", native_file_map_advise, NULL);
+   fixscript_register_native_func(heap, "file_map_sync#3", native_file_map_sync, NULL);
    fixscript_register_native_func(heap, "file_exists#1", native_file_exists, NULL);
 
    fixscript_register_native_func(heap, "tcp_connection_open#2", native_tcp_connection_open, NULL);
+   fixscript_register_native_func(heap, "dns_resolve#1", native_dns_resolve, NULL);
+   fixscript_register_native_func(heap, "dns_add_host#2", native_dns_add_host, NULL);
+   fixscript_register_native_func(heap, "dns_remove_host#1", native_dns_remove_host, NULL);
+   fixscript_register_native_func(heap, "dns_clear_hosts#0", native_dns_remove_host, NULL);
+   fixscript_register_native_func(heap, "dns_set_system_resolver#1", native_dns_set_system_resolver, NULL);
+   fixscript_register_native_func(heap, "dns_set_cache_ttl#2", native_dns_set_cache_ttl, NULL);
+   fixscript_register_native_func(heap, "dns_clear_cache#0", native_dns_clear_cache, NULL);
    fixscript_register_native_func(heap, "tcp_connection_close#1", native_tcp_connection_close, NULL);
    fixscript_register_native_func(heap, "tcp_connection_read#5", native_tcp_connection_read, NULL);
    fixscript_register_native_func(heap, "tcp_connection_write#5", native_tcp_connection_write, NULL);
+   fixscript_register_native_func(heap, "tcp_connection_send_file#6", native_tcp_connection_send_file, NULL);
+   fixscript_register_native_func(heap, "read_buffer_create#1", native_read_buffer_create, NULL);
+   fixscript_register_native_func(heap, "read_buffer_get_length#1", native_read_buffer_get_length, (void *)0);
+   fixscript_register_native_func(heap, "read_buffer_get_space#1", native_read_buffer_get_length, (void *)1);
+   fixscript_register_native_func(heap, "read_buffer_fill#3", native_read_buffer_fill, NULL);
+   fixscript_register_native_func(heap, "read_buffer_append#4", native_read_buffer_append, NULL);
+   fixscript_register_native_func(heap, "read_buffer_find#3", native_read_buffer_find, NULL);
+   fixscript_register_native_func(heap, "read_buffer_read#5", native_read_buffer_read, NULL);
+   fixscript_register_native_func(heap, "read_buffer_extract#3", native_read_buffer_extract, (void *)0);
+   fixscript_register_native_func(heap, "read_buffer_extract_string#3", native_read_buffer_extract, (void *)1);
+   fixscript_register_native_func(heap, "read_buffer_skip#2", native_read_buffer_skip, NULL);
 
    fixscript_register_native_func(heap, "tcp_server_create#1", native_tcp_server_create, (void *)0);
    fixscript_register_native_func(heap, "tcp_server_create_local#1", native_tcp_server_create, (void *)1);
@@ -14581,14 +19620,24 @@ void fixio_register_functions(Heap *heap)
    fixscript_register_native_func(heap, "async_tcp_connection_open#4", native_async_tcp_connection_open, NULL);
    fixscript_register_native_func(heap, "async_tcp_connection_read#6", native_async_tcp_connection_read, NULL);
    fixscript_register_native_func(heap, "async_tcp_connection_write#6", native_async_tcp_connection_write, NULL);
+   fixscript_register_native_func(heap, "async_tcp_connection_send_file#7", native_async_tcp_connection_send_file, NULL);
    fixscript_register_native_func(heap, "async_tcp_connection_close#1", native_async_tcp_connection_close, NULL);
    fixscript_register_native_func(heap, "async_tcp_server_create#1", native_async_tcp_server_create, (void *)0);
    fixscript_register_native_func(heap, "async_tcp_server_create_local#1", native_async_tcp_server_create, (void *)1);
    fixscript_register_native_func(heap, "async_tcp_server_close#1", native_async_tcp_server_close, NULL);
    fixscript_register_native_func(heap, "async_tcp_server_accept#3", native_async_tcp_server_accept, NULL);
+   fixscript_register_native_func(heap, "async_file_read#8", native_async_file_op, (void *)FILE_OP_READ);
+   fixscript_register_native_func(heap, "async_file_write#8", native_async_file_op, (void *)FILE_OP_WRITE);
+   fixscript_register_native_func(heap, "async_file_sync#3", native_async_file_op, (void *)FILE_OP_SYNC);
    fixscript_register_native_func(heap, "async_process#0", native_async_process, NULL);
    fixscript_register_native_func(heap, "async_process#1", native_async_process, NULL);
    fixscript_register_native_func(heap, "async_run_later#3", native_async_run_later, NULL);
+   fixscript_register_native_func(heap, "async_cancel_timer#1", native_async_cancel_timer, NULL);
+   fixscript_register_native_func(heap, "async_use_io_uring#1", native_async_use_io_uring, NULL);
+   fixscript_register_native_func(heap, "async_get_backend#0", native_async_get_backend, NULL);
+   fixscript_register_native_func(heap, "async_thread_pool_set_limits#3", native_async_thread_pool_set_limits, NULL);
+   fixscript_register_native_func(heap, "async_thread_pool_set_idle_timeout#1", native_async_thread_pool_set_idle_timeout, NULL);
+   fixscript_register_native_func(heap, "async_thread_pool_get_stats#0", native_async_thread_pool_get_stats, NULL);
    fixscript_register_native_func(heap, "async_quit#0", native_async_quit, NULL);
    fixscript_register_native_func(heap, "async_quit#1", native_async_quit, NULL);
 
@@ -14685,6 +19734,20 @@ void fixio_register_functions(Heap *heap)
    fixscript_register_native_func(heap, "sqlite_get_binary#2", native_sqlite_get_binary, NULL);
    fixscript_register_native_func(heap, "sqlite_last_insert_rowid#1", native_sqlite_last_insert_rowid, NULL);
 #endif
+
+#ifndef __wasm__
+   fixscript_register_native_func(heap, "kv_open#1", native_kv_open, NULL);
+   fixscript_register_native_func(heap, "kv_close#1", native_kv_close, NULL);
+   fixscript_register_native_func(heap, "kv_get#3", native_kv_get, (void *)0);
+   fixscript_register_native_func(heap, "kv_contains#2", native_kv_get, (void *)1);
+   fixscript_register_native_func(heap, "kv_put#3", native_kv_put, NULL);
+   fixscript_register_native_func(heap, "kv_remove#2", native_kv_put, NULL);
+   fixscript_register_native_func(heap, "kv_begin#1", native_kv_transaction, (void *)0);
+   fixscript_register_native_func(heap, "kv_commit#1", native_kv_transaction, (void *)1);
+   fixscript_register_native_func(heap, "kv_rollback#1", native_kv_transaction, (void *)2);
+   fixscript_register_native_func(heap, "kv_count#1", native_kv_count, NULL);
+   fixscript_register_native_func(heap, "kv_range#6", native_kv_range, NULL);
+#endif
 }
 
 
@@ -14747,6 +19810,16 @@ void fixio_integrate_event_loop(Heap *heap, IOEventNotifyFunc notify_func, void
       return;
    }
 
+#ifdef USE_IO_URING
+   // the sockets are changed from the script thread while the event thread waits:
+   if (!poll_use_epoll(proc->poll)) {
+      fprintf(stderr, "can't switch to epoll for foreign event loop integration!\n");
+      fflush(stderr);
+      abort();
+      return;
+   }
+#endif
+
    async_process_ref(proc);
    proc->foreign_notify_func = notify_func;
    proc->foreign_notify_data = notify_data;
@@ -14765,7 +19838,7 @@ void fixio_integrate_event_loop(Heap *heap, IOEventNotifyFunc notify_func, void
       return;
    }
 
-   if (!async_run_thread(event_thread, proc)) {
+   if (!start_thread(event_thread, proc)) {
       fprintf(stderr, "can't create thread for foreign event loop integration!\n");
       fflush(stderr);
       abort();
@@ -1844,8 +1844,10 @@ static int collect_heap(Heap *heap, int *hash_removal)
                if (arr->flags) {
                   sah = ARRAY_SHARED_HEADER(arr);
                   elem_size = arr->type == ARR_BYTE? 1 : arr->type == ARR_SHORT? 2 : 4;
-                  snprintf(buf, sizeof(buf), "%d,%p,%d,%d,%p", sah->type, arr->data, arr->len, elem_size, sah->free_data);
-                  string_hash_set(&heap->shared_arrays, strdup(buf), NULL);
+                  if (!arr->is_const) {
+                     snprintf(buf, sizeof(buf), "%d,%p,%d,%d,%p", sah->type, arr->data, arr->len, elem_size, sah->free_data);
+                     string_hash_set(&heap->shared_arrays, strdup(buf), NULL);
+                  }
                   if (sah->refcnt < SAH_REFCNT_LIMIT && __sync_sub_and_fetch(&sah->refcnt, 1) == 0) {
                      if (sah->free_func) {
                         sah->free_func(sah->free_data);
@@ -2345,7 +2347,7 @@ Value fixscript_create_shared_array(Heap *heap, int len, int elem_size)
 }
 
 
-static Value create_shared_array_from(Heap *heap, int type, void *ptr, int len, int elem_size, HandleFreeFunc free_func, void *data, int *created, SharedArrayHandle *sah)
+static Value create_shared_array_from(Heap *heap, int type, void *ptr, int len, int elem_size, HandleFreeFunc free_func, void *data, int *created, SharedArrayHandle *sah, int is_const)
 {
    Value value;
    Array *arr;
@@ -2379,7 +2381,7 @@ static Value create_shared_array_from(Heap *heap, int type, void *ptr, int len,
    }
 
    snprintf(buf, sizeof(buf), "%d,%p,%d,%d,%p", type, ptr, len, elem_size, data);
-   value.value = (intptr_t)string_hash_get(&heap->shared_arrays, buf);
+   value.value = is_const? 0 : (intptr_t)string_hash_get(&heap->shared_arrays, buf);
    if (value.value) {
       value.is_array = 1;
       add_root(heap, value);
@@ -2414,6 +2416,9 @@ static Value create_shared_array_from(Heap *heap, int type, void *ptr, int len,
    arr->size = len;
    arr->flags = (int *)(((char *)arr->flags) + sizeof(SharedArrayHandle));
    set_shared_array(heap, value.value);
+   if (is_const) {
+      set_const_string(heap, value.value);
+   }
 
    if (sah) {
       if (sah->refcnt < SAH_REFCNT_LIMIT) {
@@ -2431,7 +2436,9 @@ static Value create_shared_array_from(Heap *heap, int type, void *ptr, int len,
       sah->free_data = data;
    }
 
-   string_hash_set(&heap->shared_arrays, strdup(buf), (void *)(intptr_t)value.value);
+   if (!is_const) {
+      string_hash_set(&heap->shared_arrays, strdup(buf), (void *)(intptr_t)value.value);
+   }
    
    heap->total_size += (int64_t)FLAGS_SIZE(len) * sizeof(int) + (int64_t)len * elem_size;
 
@@ -2446,7 +2453,34 @@ static Value create_shared_array_from(Heap *heap, int type, void *ptr, int len,
 
 Value fixscript_create_or_get_shared_array(Heap *heap, int type, void *ptr, int len, int elem_size, HandleFreeFunc free_func, void *data, int *created)
 {
-   return create_shared_array_from(heap, type, ptr, len, elem_size, free_func, data, created, NULL);
+   return create_shared_array_from(heap, type, ptr, len, elem_size, free_func, data, created, NULL, 0);
+}
+
+
+// constant shared arrays are not deduplicated, can't be modified and are private to the heap (they
+// can't be cloned to other heaps and their handle and data are not available to the native code):
+Value fixscript_create_const_shared_array(Heap *heap, int type, void *ptr, int len, int elem_size, HandleFreeFunc free_func, void *data)
+{
+   return create_shared_array_from(heap, type, ptr, len, elem_size, free_func, data, NULL, NULL, 1);
+}
+
+
+// makes the constant shared array empty, the data is no longer accessed afterwards:
+int fixscript_detach_const_shared_array(Heap *heap, Value arr_val)
+{
+   Array *arr;
+
+   if (!arr_val.is_array || arr_val.value <= 0 || arr_val.value >= heap->size) {
+      return FIXSCRIPT_ERR_INVALID_ACCESS;
+   }
+
+   arr = &heap->data[arr_val.value];
+   if (arr->len == -1 || arr->hash_slots >= 0 || !arr->is_shared || !arr->is_const) {
+      return FIXSCRIPT_ERR_INVALID_ACCESS;
+   }
+
+   arr->len = 0;
+   return FIXSCRIPT_SUCCESS;
 }
 
 
@@ -3164,6 +3198,10 @@ int fixscript_lock_array(Heap *heap, Value arr_val, int off, int len, void **dat
       return FIXSCRIPT_ERR_INVALID_ACCESS;
    }
 
+   if (arr->is_const && arr->is_shared && access != ACCESS_READ_ONLY) {
+      return FIXSCRIPT_ERR_CONST_WRITE;
+   }
+
    add_root(heap, arr_val);
 
    arr_elem = arr->type == ARR_BYTE? 1 : arr->type == ARR_SHORT? 2 : 4;
@@ -3312,7 +3350,7 @@ SharedArrayHandle *fixscript_get_shared_array_handle(Heap *heap, Value arr_val,
    }
 
    arr = &heap->data[arr_val.value];
-   if (arr->len == -1 || arr->hash_slots >= 0 || !arr->is_shared) {
+   if (arr->len == -1 || arr->hash_slots >= 0 || !arr->is_shared || arr->is_const) {
       return NULL;
    }
 
@@ -3340,7 +3378,7 @@ void *fixscript_get_shared_array_handle_data(SharedArrayHandle *sah, int *len, i
 
 Value fixscript_get_shared_array_value(Heap *heap, SharedArrayHandle *sah)
 {
-   return create_shared_array_from(heap, sah->type, sah->ptr, sah->len, sah->elem_size, sah->free_func, sah->free_data, NULL, sah);
+   return create_shared_array_from(heap, sah->type, sah->ptr, sah->len, sah->elem_size, sah->free_func, sah->free_data, NULL, sah, 0);
 }
 
 
@@ -3370,7 +3408,7 @@ void *fixscript_get_shared_array_data(Heap *heap, Value arr_val, int *len, int *
    }
 
    arr = &heap->data[arr_val.value];
-   if (arr->len == -1 || arr->hash_slots >= 0 || !arr->is_shared) {
+   if (arr->len == -1 || arr->hash_slots >= 0 || !arr->is_shared || arr->is_const) {
       return NULL;
    }
 
@@ -5529,6 +5567,10 @@ static Value builtin_array_fill(Heap *heap, Value *error, int num_params, Value
       return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_BOUNDS);
    }
 
+   if (arr->is_const) {
+      return fixscript_error(heap, error, FIXSCRIPT_ERR_CONST_WRITE);
+   }
+
    if (arr->is_shared && value.is_array && !fixscript_is_float(value)) {
       return fixscript_error(heap, error, FIXSCRIPT_ERR_INVALID_SHARED_ARRAY_OPERATION);
    }
@@ -8523,6 +8565,9 @@ static int clone_value(Heap *dest, Heap *src, Value value, Value map, Value *clo
             *clone = value;
             return FIXSCRIPT_SUCCESS;
          }
+         if (arr->is_shared) {
+            return FIXSCRIPT_ERR_INVALID_SHARED_ARRAY_OPERATION;
+         }
 
          err = fixscript_get_const_string_between(dest, src, value, 0, -1, &arr_val);
          if (!err && map.value) {
@@ -26272,7 +26317,7 @@ static int jit_init(Heap *heap)
          heap->jit_array_append_funcs[i*2+0] = heap->jit_array_append_const_string;
          heap->jit_array_append_funcs[i*2+1] = heap->jit_array_append_const_string;
       }
-      if (arr->is_shared) {
+      if (arr->is_shared && !arr->is_const) {
          if (arr->type == ARR_BYTE) {
             heap->jit_array_set_funcs[i*2+0] = heap->jit_shared_set_byte_func[0];
             heap->jit_array_set_funcs[i*2+1] = heap->jit_shared_set_byte_func[1];
@@ -130,6 +130,8 @@ void fixscript_unlock_array(Heap *heap, Value arr_val, int off, int len, void **
 
 Value fixscript_create_shared_array(Heap *heap, int len, int elem_size);
 Value fixscript_create_or_get_shared_array(Heap *heap, int type, void *ptr, int len, int elem_size, HandleFreeFunc free_func, void *data, int *created);
+Value fixscript_create_const_shared_array(Heap *heap, int type, void *ptr, int len, int elem_size, HandleFreeFunc free_func, void *data);
+int fixscript_detach_const_shared_array(Heap *heap, Value arr_val);
 void fixscript_ref_shared_array(SharedArrayHandle *sah);
 void fixscript_unref_shared_array(SharedArrayHandle *sah);
 int fixscript_get_shared_array_reference_count(SharedArrayHandle *sah);
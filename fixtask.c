@@ -56,6 +56,26 @@ enum {
    CHANNEL_BOTH     = 3
 };
 
+enum {
+   TASK_STATS_cpu_time,
+   TASK_STATS_sent_messages,
+   TASK_STATS_received_messages,
+   TASK_STATS_send_blocked_time,
+   TASK_STATS_receive_blocked_time,
+   TASK_STATS_queue_length,
+   TASK_STATS_reply_queue_length,
+   TASK_STATS_SIZE
+};
+
+enum {
+   CHANNEL_STATS_sent_messages,
+   CHANNEL_STATS_received_messages,
+   CHANNEL_STATS_send_blocked_time,
+   CHANNEL_STATS_receive_blocked_time,
+   CHANNEL_STATS_queue_length,
+   CHANNEL_STATS_SIZE
+};
+
 enum {
    CHECK_ARRAY,
    CHECK_STRING,
@@ -102,7 +122,44 @@ typedef struct TaskReceiver {
 } TaskReceiver;
 #endif
 
+enum {
+   GLOBAL_KEY_INT,
+   GLOBAL_KEY_FLOAT,
+   GLOBAL_KEY_ARRAY,
+   GLOBAL_KEY_COMPLEX
+};
+
+typedef struct {
+   int type;
+   int value;
+   int *data;
+   int len;
+   uint32_t hash;
+} GlobalKey;
+
+typedef struct GlobalEntry {
+   GlobalKey key;
+   Value value;
+   SharedArrayHandle *sah;
+   struct GlobalEntry *next;
+} GlobalEntry;
+
+#define NUM_GLOBAL_SHARDS 16
+
 typedef struct {
+   pthread_mutex_t mutex;
+   Heap *heap;
+   Value hash;
+   GlobalEntry **entries;
+   int size, cnt;
+} GlobalShard;
+
+typedef struct {
+   uint64_t sent, received;
+   uint64_t send_blocked, receive_blocked;
+} MessageStats;
+
+typedef struct Task {
    volatile int refcnt;
    HeapCreateData hc;
    int load_scripts;
@@ -118,6 +175,9 @@ typedef struct {
    TaskSender *wasm_senders;
    TaskReceiver *wasm_receivers;
 #endif
+   MessageStats stats;
+   uint64_t cpu_time;
+   struct Task *stats_next, **stats_prev;
 } Task;
 
 typedef struct ComputeHeap {
@@ -154,9 +214,26 @@ typedef struct {
    int from, to, core_id;
 } ComputeTasks;
 
+typedef struct {
+   int max_threads;
+   int *cpus;
+   int num_cpus;
+} ComputeConfig;
+
+typedef struct {
+   Value arr;
+   Value view;
+   void *data;
+   int len;
+   int elem_size;
+} ParentView;
+
 typedef struct {
    Heap *heap;
    Value map;
+   pthread_mutex_t *mutex;
+   ParentView *views;
+   int views_cnt, views_cap;
 } ParentHeap;
 
 typedef struct ScriptHandle ScriptHandle;
@@ -255,6 +332,7 @@ typedef struct Channel {
    ChannelSender *wasm_senders;
    ChannelReceiver *wasm_receivers;
 #endif
+   MessageStats stats;
 } Channel;
 
 typedef struct ChannelEntry {
@@ -303,6 +381,7 @@ static volatile int handles_offset = 0;
 static volatile int heap_create_data_key;
 static volatile int cur_task_key;
 static volatile int compute_tasks_key;
+static volatile int compute_config_key;
 static volatile int is_queue_heap_key;
 static volatile int parent_heap_key;
 static volatile int async_integration_key;
@@ -314,8 +393,11 @@ static volatile int async_integration_key;
 static volatile pthread_mutex_t *global_mutex;
 static volatile int atomic_initialized = 0;
 static pthread_mutex_t atomic_mutex[16];
-static Heap *global_heap;
-static Value global_hash;
+static volatile int global_shards_initialized = 0;
+static Task *stats_tasks = NULL;
+static volatile int stats_dump_interval = 0;
+static volatile int stats_dump_running = 0;
+static GlobalShard global_shards[NUM_GLOBAL_SHARDS];
 #ifdef _WIN32
 #define RECURSIVE_MUTEX_ATTR NULL
 #else
@@ -441,6 +523,60 @@ static uint64_t get_time()
 }
 
 
+static pthread_mutex_t *get_global_mutex();
+
+
+static uint64_t get_micro_time()
+{
+#if defined(_WIN32)
+   uint64_t freq, cnt;
+   QueryPerformanceFrequency((LARGE_INTEGER *)&freq);
+   QueryPerformanceCounter((LARGE_INTEGER *)&cnt);
+   return cnt / freq * 1000000 + (cnt % freq) * 1000000 / freq;
+#elif defined(__linux__) || defined(__wasm__)
+   struct timespec ts;
+   
+   if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+      ts.tv_sec = 0;
+      ts.tv_nsec = 0;
+   }
+
+   return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+#else
+   struct timeval tv;
+
+   if (gettimeofday(&tv, NULL) != 0) {
+      tv.tv_sec = 0;
+      tv.tv_usec = 0;
+   }
+
+   return tv.tv_sec * 1000000LL + tv.tv_usec;
+#endif
+}
+
+
+static uint64_t get_thread_cpu_time()
+{
+#if defined(_WIN32)
+   FILETIME creation, exit, kernel, user;
+
+   if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user)) {
+      return 0;
+   }
+   return ((((uint64_t)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime) + (((uint64_t)user.dwHighDateTime << 32) | user.dwLowDateTime)) / 10;
+#elif defined(__wasm__)
+   return 0;
+#else
+   struct timespec ts;
+   
+   if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) {
+      return 0;
+   }
+   return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+#endif
+}
+
+
 static uint32_t rehash(uint32_t a)
 {
    a = (a+0x7ed55d16) + (a<<12);
@@ -475,6 +611,14 @@ static void *task_handle_func(Heap *heap, int op, void *p1, void *p2)
    switch (op) {
       case HANDLE_OP_FREE:
          if (__sync_sub_and_fetch(&task->refcnt, 1) == 0) {
+            if (task->stats_prev) {
+               pthread_mutex_lock(get_global_mutex());
+               *task->stats_prev = task->stats_next;
+               if (task->stats_next) {
+                  task->stats_next->stats_prev = task->stats_prev;
+               }
+               pthread_mutex_unlock(get_global_mutex());
+            }
             if (task->comm_heap) {
                fixscript_free_heap(task->comm_heap);
             }
@@ -634,6 +778,7 @@ static void *thread_main(void *data)
 
 error:
    free(values);
+   task->cpu_time = get_thread_cpu_time();
    fixscript_unref(task->comm_heap, task->task_val);
    fixscript_collect_heap(task->comm_heap);
    task_handle_func(NULL, HANDLE_OP_FREE, task, NULL);
@@ -653,6 +798,7 @@ static Value task_create(Heap *heap, Value *error, int num_params, Value *params
    char *fname = NULL, *func_name = NULL;
    Task *task = NULL;
    Value params_val, task_val, retval = fixscript_int(0);
+   pthread_mutex_t *mutex;
    int len;
 #if defined(_WIN32)
    HANDLE thread;
@@ -751,6 +897,19 @@ static Value task_create(Heap *heap, Value *error, int num_params, Value *params
 #else
    pthread_detach(thread);
 #endif
+
+   mutex = get_global_mutex();
+   if (mutex) {
+      pthread_mutex_lock(mutex);
+      task->stats_next = stats_tasks;
+      task->stats_prev = &stats_tasks;
+      if (stats_tasks) {
+         stats_tasks->stats_prev = &task->stats_next;
+      }
+      stats_tasks = task;
+      pthread_mutex_unlock(mutex);
+   }
+
    task = NULL;
    fname = NULL;
    func_name = NULL;
@@ -868,6 +1027,7 @@ static Value task_send(Heap *heap, Value *error, int num_params, Value *params,
    int in_task;
    Value arr, msg;
    int err, len;
+   uint64_t wait_start = 0;
 #ifdef __wasm__
    TaskSender *task_sender;
    TaskReceiver *r, **prev;
@@ -912,6 +1072,9 @@ static Value task_send(Heap *heap, Value *error, int num_params, Value *params,
       err = fixscript_get_array_length(task->comm_heap, arr, &len);
       if (err) break;
       if (len < task->max_messages) break;
+      if (in_task && !wait_start) {
+         wait_start = get_micro_time();
+      }
       pthread_cond_wait(&task->cond, &task->mutex);
       #ifdef __wasm__
          task_sender = malloc(sizeof(TaskSender));
@@ -941,6 +1104,14 @@ static Value task_send(Heap *heap, Value *error, int num_params, Value *params,
       return fixscript_error(heap, error, err);
    }
 
+   if (in_task) {
+      task->stats.sent++;
+      if (wait_start) {
+         task->stats.send_blocked += get_micro_time() - wait_start;
+      }
+      task->cpu_time = get_thread_cpu_time();
+   }
+
    pthread_cond_signal(&task->cond);
    pthread_mutex_unlock(&task->mutex);
 
@@ -1058,7 +1229,7 @@ static Value task_receive(Heap *heap, Value *error, int num_params, Value *param
    TaskReceiver *task_receiver;
    TaskSender *s, **prev;
 #else
-   uint64_t wait_until = 0;
+   uint64_t wait_until = 0, wait_start = 0;
 #endif
 
    if (wait) {
@@ -1156,6 +1327,10 @@ static Value task_receive(Heap *heap, Value *error, int num_params, Value *param
          }
          return fixscript_int(0);
       #else
+         if (in_task && !wait_start) {
+            wait_start = get_micro_time();
+            task->cpu_time = get_thread_cpu_time();
+         }
          if (timeout < 0) {
             pthread_cond_wait(&task->cond, &task->mutex);
          }
@@ -1164,6 +1339,9 @@ static Value task_receive(Heap *heap, Value *error, int num_params, Value *param
                timeout = wait_until - get_time();
             }
             if (timeout <= 0 || pthread_cond_timedwait_relative(&task->cond, &task->mutex, timeout*1000000LL) == ETIMEDOUT) {
+               if (wait_start) {
+                  task->stats.receive_blocked += get_micro_time() - wait_start;
+               }
                pthread_mutex_unlock(&task->mutex);
                return fixscript_int(0);
             }
@@ -1171,6 +1349,16 @@ static Value task_receive(Heap *heap, Value *error, int num_params, Value *param
       #endif
    }
 
+   if (in_task) {
+      task->stats.received++;
+      #ifndef __wasm__
+         if (wait_start) {
+            task->stats.receive_blocked += get_micro_time() - wait_start;
+         }
+      #endif
+      task->cpu_time = get_thread_cpu_time();
+   }
+
    err = fixscript_get_array_elem(task->comm_heap, arr, 0, &msg);
    if (!err) {
       err = fixscript_copy_array(task->comm_heap, arr, 0, arr, 1, len-1);
@@ -1197,6 +1385,184 @@ static Value task_receive(Heap *heap, Value *error, int num_params, Value *param
 }
 
 
+static int clamp_stats_value(uint64_t value)
+{
+   if (value > 0x7FFFFFFF) {
+      return 0x7FFFFFFF;
+   }
+   return (int)value;
+}
+
+
+static void get_task_stats(Task *task, Value *values)
+{
+   int len;
+
+   values[TASK_STATS_cpu_time] = fixscript_int(clamp_stats_value(task->cpu_time / 1000));
+   values[TASK_STATS_sent_messages] = fixscript_int(clamp_stats_value(task->stats.sent));
+   values[TASK_STATS_received_messages] = fixscript_int(clamp_stats_value(task->stats.received));
+   values[TASK_STATS_send_blocked_time] = fixscript_int(clamp_stats_value(task->stats.send_blocked / 1000));
+   values[TASK_STATS_receive_blocked_time] = fixscript_int(clamp_stats_value(task->stats.receive_blocked / 1000));
+   if (fixscript_get_array_length(task->comm_heap, task->comm_arr, &len) != FIXSCRIPT_SUCCESS) {
+      len = 0;
+   }
+   values[TASK_STATS_queue_length] = fixscript_int(len);
+   if (fixscript_get_array_length(task->comm_heap, task->reply_arr, &len) != FIXSCRIPT_SUCCESS) {
+      len = 0;
+   }
+   values[TASK_STATS_reply_queue_length] = fixscript_int(len);
+}
+
+
+static Value task_get_stats(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+   Task *task;
+   Value values[TASK_STATS_SIZE], ret;
+   int err;
+
+   if (num_params == 0) {
+      task = fixscript_get_heap_data(heap, cur_task_key);
+      if (!task) {
+         *error = fixscript_create_error_string(heap, "not in task thread");
+         return fixscript_int(0);
+      }
+   }
+   else {
+      task = fixscript_get_handle(heap, params[0], HANDLE_TYPE_TASK, NULL);
+      if (!task) {
+         *error = fixscript_create_error_string(heap, "invalid task");
+         return fixscript_int(0);
+      }
+   }
+
+   if (pthread_mutex_lock(&task->mutex) != 0) {
+      *error = fixscript_create_error_string(heap, "can't lock mutex");
+      return fixscript_int(0);
+   }
+   if (num_params == 0) {
+      task->cpu_time = get_thread_cpu_time();
+   }
+   get_task_stats(task, values);
+   pthread_mutex_unlock(&task->mutex);
+
+   ret = fixscript_create_array(heap, TASK_STATS_SIZE);
+   if (!ret.value) {
+      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+   }
+   err = fixscript_set_array_range(heap, ret, 0, TASK_STATS_SIZE, values);
+   if (err) {
+      return fixscript_error(heap, error, err);
+   }
+   return ret;
+}
+
+
+#ifndef __wasm__
+static void dump_task_stats()
+{
+   pthread_mutex_t *mutex;
+   Task *task;
+   Value values[TASK_STATS_SIZE];
+
+   mutex = get_global_mutex();
+   if (!mutex) {
+      return;
+   }
+
+   pthread_mutex_lock(mutex);
+   for (task = stats_tasks; task; task = task->stats_next) {
+      pthread_mutex_lock(&task->mutex);
+      get_task_stats(task, values);
+      pthread_mutex_unlock(&task->mutex);
+
+      fprintf(stderr, "task %s:%s cpu=%dms sent=%d received=%d send_blocked=%dms receive_blocked=%dms queue=%d reply_queue=%d\n",
+         task->fname, task->func_name,
+         values[TASK_STATS_cpu_time].value,
+         values[TASK_STATS_sent_messages].value,
+         values[TASK_STATS_received_messages].value,
+         values[TASK_STATS_send_blocked_time].value,
+         values[TASK_STATS_receive_blocked_time].value,
+         values[TASK_STATS_queue_length].value,
+         values[TASK_STATS_reply_queue_length].value
+      );
+   }
+   pthread_mutex_unlock(mutex);
+   fflush(stderr);
+}
+
+
+#if defined(_WIN32)
+static DWORD WINAPI stats_dump_main(void *data)
+#else
+static void *stats_dump_main(void *data)
+#endif
+{
+   int interval;
+
+   for (;;) {
+      interval = stats_dump_interval;
+      if (interval <= 0) {
+         break;
+      }
+      #if defined(_WIN32)
+         Sleep(interval);
+      #else
+         usleep(interval * 1000);
+      #endif
+      if (stats_dump_interval <= 0) {
+         break;
+      }
+      dump_task_stats();
+   }
+
+   stats_dump_running = 0;
+#if defined(_WIN32)
+   return 0;
+#else
+   return NULL;
+#endif
+}
+#endif
+
+
+static Value task_set_stats_dump_interval(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+#ifdef __wasm__
+   *error = fixscript_create_error_string(heap, "not supported");
+   return fixscript_int(0);
+#else
+#if defined(_WIN32)
+   HANDLE thread;
+#else
+   pthread_t thread;
+#endif
+
+   stats_dump_interval = params[0].value;
+   if (params[0].value <= 0 || __sync_val_compare_and_swap(&stats_dump_running, 0, 1) != 0) {
+      return fixscript_int(0);
+   }
+
+#if defined(_WIN32)
+   thread = CreateThread(NULL, 0, stats_dump_main, NULL, 0, NULL);
+   if (!thread)
+#else
+   if (pthread_create(&thread, NULL, stats_dump_main, NULL) != 0)
+#endif
+   {
+      stats_dump_running = 0;
+      *error = fixscript_create_error_string(heap, "can't create thread");
+      return fixscript_int(0);
+   }
+#if defined(_WIN32)
+   CloseHandle(thread);
+#else
+   pthread_detach(thread);
+#endif
+   return fixscript_int(0);
+#endif
+}
+
+
 static Value sleep_func(Heap *heap, Value *error, int num_params, Value *params, void *data)
 {
 #if defined(_WIN32)
@@ -1236,10 +1602,76 @@ static void unref_compute_tasks(ComputeTasks *tasks)
 #endif
 
 
+#ifndef __wasm__
+// the views are made empty so they can't access the parent arrays once they're unlocked:
+static void release_parent_views(Heap *heap, ParentHeap *parent_heap)
+{
+   ParentView *view;
+   int i;
+
+   if (parent_heap->views_cnt > 0) {
+      for (i=0; i<parent_heap->views_cnt; i++) {
+         view = &parent_heap->views[i];
+         fixscript_detach_const_shared_array(heap, view->view);
+         fixscript_unref(heap, view->view);
+      }
+      pthread_mutex_lock(parent_heap->mutex);
+      for (i=0; i<parent_heap->views_cnt; i++) {
+         view = &parent_heap->views[i];
+         fixscript_unlock_array(parent_heap->heap, view->arr, 0, view->len, &view->data, view->elem_size, ACCESS_READ_ONLY);
+      }
+      pthread_mutex_unlock(parent_heap->mutex);
+   }
+   free(parent_heap->views);
+   parent_heap->views = NULL;
+   parent_heap->views_cnt = 0;
+   parent_heap->views_cap = 0;
+}
+#endif
+
+
+#ifndef __wasm__
+static int set_thread_affinity(int *cpus, int num_cpus)
+{
+#if defined(_WIN32)
+   DWORD_PTR mask = 0;
+   int i;
+
+   for (i=0; i<num_cpus; i++) {
+      if (cpus[i] >= 0 && cpus[i] < (int)sizeof(DWORD_PTR)*8) {
+         mask |= (DWORD_PTR)1 << cpus[i];
+      }
+   }
+   if (!mask) {
+      return 0;
+   }
+   return SetThreadAffinityMask(GetCurrentThread(), mask) != 0;
+#elif defined(__linux__)
+   cpu_set_t set;
+   int i;
+
+   CPU_ZERO(&set);
+   for (i=0; i<num_cpus; i++) {
+      if (cpus[i] >= 0 && cpus[i] < CPU_SETSIZE) {
+         CPU_SET(cpus[i], &set);
+      }
+   }
+   if (CPU_COUNT(&set) == 0) {
+      return 0;
+   }
+   return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set) == 0;
+#else
+   return 0;
+#endif
+}
+#endif
+
+
 #ifndef __wasm__
 typedef struct {
    ComputeTasks *tasks;
    int id;
+   int cpu;
 } ComputeThreadData;
 
 #if defined(_WIN32)
@@ -1258,6 +1690,9 @@ static void *compute_thread_main(void *data)
    tasks = ctd->tasks;
    id = ctd->id;
    cond = &tasks->conds[id];
+   if (ctd->cpu >= 0) {
+      set_thread_affinity(&ctd->cpu, 1);
+   }
    free(ctd);
 
    pthread_mutex_lock(&tasks->mutex);
@@ -1280,6 +1715,10 @@ static void *compute_thread_main(void *data)
          if (heap->parent_heap) {
             parent_heap.heap = heap->parent_heap;
             parent_heap.map = fixscript_int(0);
+            parent_heap.mutex = &tasks->mutex;
+            parent_heap.views = NULL;
+            parent_heap.views_cnt = 0;
+            parent_heap.views_cap = 0;
 
             err = fixscript_set_heap_data(heap->heap, parent_heap_key, &parent_heap, NULL);
             if (err) {
@@ -1290,6 +1729,7 @@ static void *compute_thread_main(void *data)
                fixscript_unref(heap->heap, parent_heap.map);
                fixscript_set_heap_data(heap->heap, parent_heap_key, NULL, NULL);
             }
+            release_parent_views(heap->heap, &parent_heap);
          }
          else {
             heap->result = fixscript_call(heap->heap, heap->process_func, 1, &heap->error, heap->process_data);
@@ -1363,6 +1803,7 @@ static void free_compute_tasks(void *data)
 static ComputeTasks *get_compute_tasks(Heap *heap, HeapCreateData *hc)
 {
    ComputeTasks *tasks;
+   ComputeConfig *config;
    int i, err;
    ComputeThreadData *ctd;
 #if defined(_WIN32)
@@ -1380,6 +1821,8 @@ static ComputeTasks *get_compute_tasks(Heap *heap, HeapCreateData *hc)
       return NULL;
    }
 
+   config = fixscript_get_heap_data(heap, compute_config_key);
+
    tasks = calloc(1, sizeof(ComputeTasks));
    if (!tasks) {
       return NULL;
@@ -1387,6 +1830,9 @@ static ComputeTasks *get_compute_tasks(Heap *heap, HeapCreateData *hc)
 
    tasks->refcnt = 1;
    tasks->num_cores = get_number_of_cores();
+   if (config && config->max_threads > 0 && tasks->num_cores > config->max_threads) {
+      tasks->num_cores = config->max_threads;
+   }
    if (tasks->num_cores < 1) tasks->num_cores = 1;
    tasks->num_heaps = tasks->num_cores > 1? tasks->num_cores+1 : 1;
 
@@ -1459,6 +1905,7 @@ static ComputeTasks *get_compute_tasks(Heap *heap, HeapCreateData *hc)
       
       ctd->tasks = tasks;
       ctd->id = i;
+      ctd->cpu = config && config->num_cpus > 0? config->cpus[i % config->num_cpus] : -1;
       (void)__sync_add_and_fetch(&tasks->refcnt, 1);
 
       #if defined(_WIN32)
@@ -1772,6 +2219,164 @@ static Value compute_task_get_core_count(Heap *heap, Value *error, int num_param
 }
 
 
+#ifndef __wasm__
+static int get_cpu_list(Heap *heap, Value *error, Value arr, int **cpus_out, int *num_cpus_out)
+{
+   Value *values;
+   int *cpus;
+   int i, err, len;
+
+   *cpus_out = NULL;
+   *num_cpus_out = 0;
+
+   if (!arr.value && !arr.is_array) {
+      return 1;
+   }
+
+   err = fixscript_get_array_length(heap, arr, &len);
+   if (err) {
+      fixscript_error(heap, error, err);
+      return 0;
+   }
+   if (len == 0) {
+      return 1;
+   }
+
+   values = calloc(len, sizeof(Value));
+   cpus = calloc(len, sizeof(int));
+   if (!values || !cpus) {
+      free(values);
+      free(cpus);
+      fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      return 0;
+   }
+
+   err = fixscript_get_array_range(heap, arr, 0, len, values);
+   if (err) {
+      free(values);
+      free(cpus);
+      fixscript_error(heap, error, err);
+      return 0;
+   }
+
+   for (i=0; i<len; i++) {
+      if (!fixscript_is_int(values[i]) || values[i].value < 0) {
+         free(values);
+         free(cpus);
+         *error = fixscript_create_error_string(heap, "invalid CPU number");
+         return 0;
+      }
+      cpus[i] = values[i].value;
+   }
+
+   free(values);
+   *cpus_out = cpus;
+   *num_cpus_out = len;
+   return 1;
+}
+#endif
+
+
+#ifndef __wasm__
+static void free_compute_config(void *data)
+{
+   ComputeConfig *config = data;
+
+   free(config->cpus);
+   free(config);
+}
+#endif
+
+
+#ifndef __wasm__
+static ComputeConfig *get_compute_config(Heap *heap, Value *error)
+{
+   ComputeConfig *config;
+   int err;
+
+   if (fixscript_get_heap_data(heap, compute_tasks_key)) {
+      *error = fixscript_create_error_string(heap, "compute threads are already started");
+      return NULL;
+   }
+
+   config = fixscript_get_heap_data(heap, compute_config_key);
+   if (config) {
+      return config;
+   }
+
+   config = calloc(1, sizeof(ComputeConfig));
+   if (!config) {
+      fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      return NULL;
+   }
+
+   err = fixscript_set_heap_data(heap, compute_config_key, config, free_compute_config);
+   if (err) {
+      fixscript_error(heap, error, err);
+      return NULL;
+   }
+   return config;
+}
+#endif
+
+
+static Value compute_task_set_thread_limit(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+#ifndef __wasm__
+   ComputeConfig *config;
+
+   config = get_compute_config(heap, error);
+   if (!config) {
+      return fixscript_int(0);
+   }
+   config->max_threads = params[0].value > 0? params[0].value : 0;
+#endif
+   return fixscript_int(0);
+}
+
+
+static Value compute_task_set_affinity(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+#ifndef __wasm__
+   ComputeConfig *config;
+   int *cpus, num_cpus;
+
+   config = get_compute_config(heap, error);
+   if (!config) {
+      return fixscript_int(0);
+   }
+   if (!get_cpu_list(heap, error, params[0], &cpus, &num_cpus)) {
+      return fixscript_int(0);
+   }
+   free(config->cpus);
+   config->cpus = cpus;
+   config->num_cpus = num_cpus;
+#endif
+   return fixscript_int(0);
+}
+
+
+static Value task_set_affinity(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+#ifdef __wasm__
+   return fixscript_int(0);
+#else
+   int *cpus, num_cpus, ret;
+
+   if (!get_cpu_list(heap, error, params[0], &cpus, &num_cpus)) {
+      return fixscript_int(0);
+   }
+   if (num_cpus == 0) {
+      *error = fixscript_create_error_string(heap, "empty CPU list");
+      return fixscript_int(0);
+   }
+   ret = set_thread_affinity(cpus, num_cpus);
+   free(cpus);
+   return fixscript_int(ret);
+#endif
+}
+
+
 static Value compute_task_run_parallel(Heap *heap, Value *error, int num_params, Value *params, void *data)
 {
 #ifdef __wasm__
@@ -1784,8 +2389,9 @@ static Value compute_task_run_parallel(Heap *heap, Value *error, int num_params,
 #else
    HeapCreateData *hc = data;
    ComputeTasks *tasks;
+   ParentHeap parent_heap;
    Value params2[2], error2 = fixscript_int(0);
-   int i, from, to, min_iters, num_cores, iters_per_core;
+   int i, err, from, to, min_iters, num_cores, iters_per_core;
 
    tasks = get_compute_tasks(heap, hc);
    if (!tasks) {
@@ -1810,7 +2416,26 @@ static Value compute_task_run_parallel(Heap *heap, Value *error, int num_params,
    }
 
    if (((to - from) >> 1) < min_iters || num_cores == 1) {
+      if (fixscript_get_heap_data(heap, parent_heap_key)) {
+         fixscript_call(heap, params[num_params-2], 4, error, params[num_params-1], fixscript_int(from), fixscript_int(to), fixscript_int(0));
+         return fixscript_int(0);
+      }
+
+      // the heap is its own parent so the views have the same restrictions as in the compute heaps:
+      parent_heap.heap = heap;
+      parent_heap.map = fixscript_int(0);
+      parent_heap.mutex = &tasks->mutex;
+      parent_heap.views = NULL;
+      parent_heap.views_cnt = 0;
+      parent_heap.views_cap = 0;
+
+      err = fixscript_set_heap_data(heap, parent_heap_key, &parent_heap, NULL);
+      if (err) {
+         return fixscript_error(heap, error, err);
+      }
       fixscript_call(heap, params[num_params-2], 4, error, params[num_params-1], fixscript_int(from), fixscript_int(to), fixscript_int(0));
+      fixscript_set_heap_data(heap, parent_heap_key, NULL, NULL);
+      release_parent_views(heap, &parent_heap);
       return fixscript_int(0);
    }
 
@@ -1955,7 +2580,7 @@ static Value parent_ref_get(Heap *heap, Value *error, int num_params, Value *par
    int err;
 
    parent_heap = fixscript_get_heap_data(heap, parent_heap_key);
-   if (!parent_heap) {
+   if (!parent_heap || parent_heap->heap == heap) {
       value.is_array = 1;
       if (fixscript_is_protected(heap, value)) {
          return fixscript_error(heap, error, FIXSCRIPT_ERR_INVALID_ACCESS);
@@ -2076,6 +2701,7 @@ static Value parent_ref_copy_to(Heap *heap, Value *error, int num_params, Value
 
       if (parent_heap != heap) {
          for (i=0; i<cnt; i++) {
+            if (!values[i].is_array || fixscript_is_float(values[i])) continue;
             err = fixscript_clone_between(heap, parent_heap, values[i], &values[i], fixscript_resolve_existing, NULL, error);
             if (err) {
                if (!error->value) {
@@ -2112,30 +2738,89 @@ static Value parent_ref_extract(Heap *heap, Value *error, int num_params, Value
       return fixscript_int(0);
    }
 
-   if (fixscript_is_string(parent_heap, value)) {
-      new_arr = fixscript_create_string(heap, NULL, 0);
-      if (new_arr.value) {
-         err = fixscript_set_array_length(heap, new_arr, count);
-         if (err) {
-            return fixscript_error(heap, error, err);
-         }
-      }
+   if (fixscript_is_string(parent_heap, value)) {
+      new_arr = fixscript_create_string(heap, NULL, 0);
+      if (new_arr.value) {
+         err = fixscript_set_array_length(heap, new_arr, count);
+         if (err) {
+            return fixscript_error(heap, error, err);
+         }
+      }
+   }
+   else {
+      new_arr = fixscript_create_array(heap, count);
+   }
+   if (!new_arr.value) {
+      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+   }
+
+   params2[0] = params[0];
+   params2[1] = new_arr;
+   params2[2] = fixscript_int(0);
+   params2[3] = fixscript_int(off);
+   params2[4] = fixscript_int(count);
+   parent_ref_copy_to(heap, error, 5, params2, NULL);
+
+   return new_arr;
+}
+
+
+static Value parent_ref_view(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+   ParentHeap *parent_heap;
+   ParentView *new_views;
+   Value value = params[0], ret;
+   void *ptr = NULL;
+   int err, len, elem_size, new_cap;
+
+   parent_heap = fixscript_get_heap_data(heap, parent_heap_key);
+   if (!parent_heap) {
+      value.is_array = 1;
+      if (fixscript_is_protected(heap, value) || !fixscript_is_array(heap, value)) {
+         return fixscript_error(heap, error, FIXSCRIPT_ERR_INVALID_ACCESS);
+      }
+      return value;
+   }
+
+   if (!get_parent_ref(heap, error, NULL, &value)) {
+      return fixscript_int(0);
+   }
+
+   if (parent_heap->views_cnt == parent_heap->views_cap) {
+      new_cap = parent_heap->views_cap? parent_heap->views_cap*2 : 4;
+      new_views = realloc(parent_heap->views, new_cap*sizeof(ParentView));
+      if (!new_views) {
+         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      }
+      parent_heap->views = new_views;
+      parent_heap->views_cap = new_cap;
+   }
+
+   pthread_mutex_lock(parent_heap->mutex);
+   err = fixscript_get_array_length(parent_heap->heap, value, &len);
+   if (!err) {
+      err = fixscript_get_array_element_size(parent_heap->heap, value, &elem_size);
    }
-   else {
-      new_arr = fixscript_create_array(heap, count);
+   if (!err) {
+      err = fixscript_lock_array(parent_heap->heap, value, 0, len, &ptr, elem_size, ACCESS_READ_ONLY);
    }
-   if (!new_arr.value) {
-      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+   pthread_mutex_unlock(parent_heap->mutex);
+   if (err) {
+      return fixscript_error(heap, error, err);
    }
 
-   params2[0] = params[0];
-   params2[1] = new_arr;
-   params2[2] = fixscript_int(0);
-   params2[3] = fixscript_int(off);
-   params2[4] = fixscript_int(count);
-   parent_ref_copy_to(heap, error, 5, params2, NULL);
+   // the view is read-only and private to the heap, it's detached when the parallel run ends:
+   ret = fixscript_create_const_shared_array(heap, -1, ptr, len, elem_size, NULL, NULL);
+   if (!ret.value) {
+      pthread_mutex_lock(parent_heap->mutex);
+      fixscript_unlock_array(parent_heap->heap, value, 0, len, &ptr, elem_size, ACCESS_READ_ONLY);
+      pthread_mutex_unlock(parent_heap->mutex);
+      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+   }
+   fixscript_ref(heap, ret);
 
-   return new_arr;
+   parent_heap->views[parent_heap->views_cnt++] = (ParentView) { value, ret, ptr, len, elem_size };
+   return ret;
 }
 
 
@@ -4998,51 +5683,317 @@ static pthread_mutex_t *get_global_mutex()
 }
 
 
-static int ensure_global_heap()
+static GlobalShard *get_global_shard(uint32_t hash)
+{
+   pthread_mutex_t *global;
+   int i;
+
+   if (!global_shards_initialized) {
+      global = get_global_mutex();
+      if (!global) {
+         return NULL;
+      }
+
+      pthread_mutex_lock(global);
+      if (!global_shards_initialized) {
+         for (i=0; i<NUM_GLOBAL_SHARDS; i++) {
+            if (pthread_mutex_init(&global_shards[i].mutex, NULL) != 0) {
+               i--;
+               while (i >= 0) {
+                  pthread_mutex_destroy(&global_shards[i--].mutex);
+               }
+               pthread_mutex_unlock(global);
+               return NULL;
+            }
+         }
+         __sync_val_compare_and_swap(&global_shards_initialized, 0, 1);
+      }
+      pthread_mutex_unlock(global);
+   }
+
+   return &global_shards[hash & (NUM_GLOBAL_SHARDS-1)];
+}
+
+
+// keys follow the FixScript hash semantics: -0.0 is the same as 0.0 (the key is normalized in place)
+// and arrays (including strings) are compared by their contents:
+static int get_global_key(Heap *heap, Value *value_ptr, GlobalKey *key)
+{
+   Value value = *value_ptr, values[64];
+   uint32_t hash;
+   float f;
+   int i, j, len, num, err;
+
+   key->data = NULL;
+   key->len = 0;
+
+   if (fixscript_is_int(value)) {
+      key->type = GLOBAL_KEY_INT;
+      key->value = value.value;
+      key->hash = rehash(value.value);
+      return FIXSCRIPT_SUCCESS;
+   }
+
+   if (fixscript_is_float(value)) {
+      f = fixscript_get_float(value);
+      if (f == f) {
+         if (f == 0.0f) {
+            value = fixscript_float(0.0f);
+            *value_ptr = value;
+         }
+         key->type = GLOBAL_KEY_FLOAT;
+         key->value = value.value;
+         key->hash = rehash(value.value ^ 0x9e3779b9);
+         return FIXSCRIPT_SUCCESS;
+      }
+   }
+   else if (fixscript_is_array(heap, value) && !fixscript_is_handle(heap, value)) {
+      err = fixscript_get_array_length(heap, value, &len);
+      if (err) {
+         return err;
+      }
+      key->data = malloc((len+1) * sizeof(int));
+      if (!key->data) {
+         return FIXSCRIPT_ERR_OUT_OF_MEMORY;
+      }
+      hash = 0x811c9dc5;
+      for (i=0; i<len; i+=num) {
+         num = len - i;
+         if (num > sizeof(values)/sizeof(Value)) {
+            num = sizeof(values)/sizeof(Value);
+         }
+         err = fixscript_get_array_range(heap, value, i, num, values);
+         if (err) {
+            free(key->data);
+            key->data = NULL;
+            return err;
+         }
+         for (j=0; j<num; j++) {
+            if (values[j].is_array) {
+               // nested arrays and floats are handled by the shared heap:
+               free(key->data);
+               key->data = NULL;
+               goto complex;
+            }
+            key->data[i+j] = values[j].value;
+            hash = (hash ^ (uint32_t)values[j].value) * 0x01000193;
+         }
+      }
+      key->type = GLOBAL_KEY_ARRAY;
+      key->value = 0;
+      key->len = len;
+      key->hash = rehash(hash);
+      return FIXSCRIPT_SUCCESS;
+   }
+
+complex:
+   // other keys are compared by their contents and can't be stored directly:
+   key->type = GLOBAL_KEY_COMPLEX;
+   key->value = 0;
+   key->hash = 0;
+   return FIXSCRIPT_SUCCESS;
+}
+
+
+static GlobalEntry **find_global_entry(GlobalShard *shard, GlobalKey *key)
+{
+   GlobalEntry **prev, *entry;
+
+   if (!shard->entries) {
+      return NULL;
+   }
+
+   prev = &shard->entries[(key->hash >> 4) & (shard->size-1)];
+   for (entry = *prev; entry; entry = entry->next) {
+      if (entry->key.hash == key->hash && entry->key.type == key->type && entry->key.value == key->value && entry->key.len == key->len) {
+         if (key->type != GLOBAL_KEY_ARRAY || memcmp(entry->key.data, key->data, key->len * sizeof(int)) == 0) {
+            return prev;
+         }
+      }
+      prev = &entry->next;
+   }
+   return NULL;
+}
+
+
+static void set_global_entry_value(GlobalEntry *entry, Value value, SharedArrayHandle *sah)
+{
+   if (sah) {
+      fixscript_ref_shared_array(sah);
+   }
+   if (entry->sah) {
+      fixscript_unref_shared_array(entry->sah);
+   }
+   entry->value = value;
+   entry->sah = sah;
+}
+
+
+static GlobalEntry *add_global_entry(GlobalShard *shard, GlobalKey *key)
+{
+   GlobalEntry *entry, *next, **new_entries;
+   int i, idx, new_size;
+
+   if (shard->cnt >= shard->size) {
+      new_size = shard->size? shard->size * 2 : 16;
+      new_entries = calloc(new_size, sizeof(GlobalEntry *));
+      if (!new_entries) {
+         return NULL;
+      }
+      for (i=0; i<shard->size; i++) {
+         for (entry = shard->entries[i]; entry; entry = next) {
+            next = entry->next;
+            idx = (entry->key.hash >> 4) & (new_size-1);
+            entry->next = new_entries[idx];
+            new_entries[idx] = entry;
+         }
+      }
+      free(shard->entries);
+      shard->entries = new_entries;
+      shard->size = new_size;
+   }
+
+   entry = calloc(1, sizeof(GlobalEntry));
+   if (!entry) {
+      return NULL;
+   }
+   entry->key = *key;
+   if (key->type == GLOBAL_KEY_ARRAY) {
+      entry->key.data = malloc((key->len+1) * sizeof(int));
+      if (!entry->key.data) {
+         free(entry);
+         return NULL;
+      }
+      memcpy(entry->key.data, key->data, key->len * sizeof(int));
+   }
+
+   idx = (key->hash >> 4) & (shard->size-1);
+   entry->next = shard->entries[idx];
+   shard->entries[idx] = entry;
+   shard->cnt++;
+   return entry;
+}
+
+
+static void remove_global_entry(GlobalShard *shard, GlobalEntry **prev)
+{
+   GlobalEntry *entry = *prev;
+
+   *prev = entry->next;
+   if (entry->sah) {
+      fixscript_unref_shared_array(entry->sah);
+   }
+   free(entry->key.data);
+   free(entry);
+   shard->cnt--;
+}
+
+
+static int ensure_global_heap(GlobalShard *shard)
 {
-   if (!global_heap) {
-      global_heap = fixscript_create_heap();
-      if (!global_heap) {
+   if (!shard->heap) {
+      shard->heap = fixscript_create_heap();
+      if (!shard->heap) {
          return 0;
       }
-      global_hash = fixscript_create_hash(global_heap);
-      fixscript_ref(global_heap, global_hash);
+      shard->hash = fixscript_create_hash(shard->heap);
+      fixscript_ref(shard->heap, shard->hash);
    }
    return 1;
 }
 
 
+static int remove_global_heap_value(GlobalShard *shard, Heap *heap, Value key_val)
+{
+   Value key;
+   int err;
+
+   if (!shard->heap) {
+      return FIXSCRIPT_SUCCESS;
+   }
+
+   err = fixscript_clone_between(shard->heap, heap, key_val, &key, NULL, NULL, NULL);
+   if (!err) {
+      err = fixscript_remove_hash_elem(shard->heap, shard->hash, key, NULL);
+      if (err == FIXSCRIPT_ERR_KEY_NOT_FOUND) {
+         err = FIXSCRIPT_SUCCESS;
+      }
+   }
+   return err;
+}
+
+
 static Value global_set(Heap *heap, Value *error, int num_params, Value *params, void *data)
 {
-   pthread_mutex_t *mutex;
+   GlobalShard *shard;
+   GlobalKey gkey;
+   GlobalEntry **prev, *entry;
+   SharedArrayHandle *sah = NULL;
    Value key, value;
-   int err;
+   int err, is_plain;
    
-   mutex = get_global_mutex();
-   if (!mutex) {
-      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+   err = get_global_key(heap, &params[0], &gkey);
+   if (err) {
+      return fixscript_error(heap, error, err);
    }
 
-   pthread_mutex_lock(mutex);
-   if (!ensure_global_heap()) {
-      pthread_mutex_unlock(mutex);
+   shard = get_global_shard(gkey.hash);
+   if (!shard) {
+      free(gkey.data);
       return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
    }
 
-   err = fixscript_clone_between(global_heap, heap, params[0], &key, NULL, NULL, NULL);
-   if (!err) {
-      err = fixscript_clone_between(global_heap, heap, params[1], &value, NULL, NULL, NULL);
+   is_plain = fixscript_is_int(params[1]) || fixscript_is_float(params[1]);
+   if (!is_plain && fixscript_is_shared_array(heap, params[1])) {
+      sah = fixscript_get_shared_array_handle(heap, params[1], -1, NULL);
+      is_plain = (sah != NULL);
    }
-   if (!err) {
-      err = fixscript_set_hash_elem(global_heap, global_hash, key, value);
+   if (gkey.type == GLOBAL_KEY_COMPLEX) {
+      is_plain = 0;
    }
-   if (err) {
-      pthread_mutex_unlock(mutex);
-      return fixscript_error(heap, error, err);
+
+   pthread_mutex_lock(&shard->mutex);
+
+   if (is_plain) {
+      // plain values are kept outside of the heap so they can be read without cloning:
+      prev = find_global_entry(shard, &gkey);
+      entry = prev? *prev : add_global_entry(shard, &gkey);
+      err = entry? remove_global_heap_value(shard, heap, params[0]) : FIXSCRIPT_ERR_OUT_OF_MEMORY;
+      if (!err) {
+         set_global_entry_value(entry, sah? fixscript_int(0) : params[1], sah);
+      }
+      else if (entry && !prev) {
+         remove_global_entry(shard, find_global_entry(shard, &gkey));
+      }
    }
+   else {
+      if (!ensure_global_heap(shard)) {
+         pthread_mutex_unlock(&shard->mutex);
+         free(gkey.data);
+         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      }
 
-   pthread_mutex_unlock(mutex);
+      err = fixscript_clone_between(shard->heap, heap, params[0], &key, NULL, NULL, NULL);
+      if (!err) {
+         err = fixscript_clone_between(shard->heap, heap, params[1], &value, NULL, NULL, NULL);
+      }
+      if (!err) {
+         err = fixscript_set_hash_elem(shard->heap, shard->hash, key, value);
+      }
+      if (!err) {
+         prev = find_global_entry(shard, &gkey);
+         if (prev) {
+            remove_global_entry(shard, prev);
+         }
+      }
+   }
 
+   pthread_mutex_unlock(&shard->mutex);
+   free(gkey.data);
+
+   if (err) {
+      return fixscript_error(heap, error, err);
+   }
    return fixscript_int(0);
 }
 
@@ -5050,37 +6001,66 @@ static Value global_set(Heap *heap, Value *error, int num_params, Value *params,
 static Value global_get(Heap *heap, Value *error, int num_params, Value *params, void *data)
 {
    HeapCreateData *hc = data;
-   pthread_mutex_t *mutex;
+   GlobalShard *shard;
+   GlobalKey gkey;
+   GlobalEntry **prev;
+   SharedArrayHandle *sah = NULL;
    Value key, value;
    int err;
    
-   mutex = get_global_mutex();
-   if (!mutex) {
+   err = get_global_key(heap, &params[0], &gkey);
+   if (err) {
+      return fixscript_error(heap, error, err);
+   }
+
+   shard = get_global_shard(gkey.hash);
+   if (!shard) {
+      free(gkey.data);
       return fixscript_int(0);
    }
 
-   pthread_mutex_lock(mutex);
+   pthread_mutex_lock(&shard->mutex);
 
-   if (!global_heap) {
-      pthread_mutex_unlock(mutex);
+   prev = find_global_entry(shard, &gkey);
+   free(gkey.data);
+   if (prev) {
+      value = (*prev)->value;
+      sah = (*prev)->sah;
+      if (sah) {
+         fixscript_ref_shared_array(sah);
+      }
+      pthread_mutex_unlock(&shard->mutex);
+
+      if (sah) {
+         value = fixscript_get_shared_array_value(heap, sah);
+         fixscript_unref_shared_array(sah);
+         if (!value.value) {
+            return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+         }
+      }
+      return value;
+   }
+
+   if (!shard->heap) {
+      pthread_mutex_unlock(&shard->mutex);
       return fixscript_int(0);
    }
 
-   err = fixscript_clone_between(global_heap, heap, params[0], &key, NULL, NULL, NULL);
+   err = fixscript_clone_between(shard->heap, heap, params[0], &key, NULL, NULL, NULL);
    if (!err) {
-      err = fixscript_get_hash_elem(global_heap, global_hash, key, &value);
+      err = fixscript_get_hash_elem(shard->heap, shard->hash, key, &value);
       if (err == FIXSCRIPT_ERR_KEY_NOT_FOUND) {
          value = fixscript_int(0);
          err = FIXSCRIPT_SUCCESS;
       }
    }
    if (err) {
-      pthread_mutex_unlock(mutex);
+      pthread_mutex_unlock(&shard->mutex);
       return fixscript_error(heap, error, err);
    }
 
-   err = fixscript_clone_between(heap, global_heap, value, &value, hc->load_func, hc->load_data, error);
-   pthread_mutex_unlock(mutex);
+   err = fixscript_clone_between(heap, shard->heap, value, &value, hc->load_func, hc->load_data, error);
+   pthread_mutex_unlock(&shard->mutex);
 
    if (err) {
       if (error->value) {
@@ -5098,24 +6078,71 @@ static Value global_get(Heap *heap, Value *error, int num_params, Value *params,
 
 static Value global_add(Heap *heap, Value *error, int num_params, Value *params, void *data)
 {
-   pthread_mutex_t *mutex;
+   GlobalShard *shard;
+   GlobalKey gkey;
+   GlobalEntry **prev, *entry;
    Value key, value;
-   int err, prev_value=0;
+   int err, is_native, prev_value=0;
    
-   mutex = get_global_mutex();
-   if (!mutex) {
+   err = get_global_key(heap, &params[0], &gkey);
+   if (err) {
+      return fixscript_error(heap, error, err);
+   }
+
+   shard = get_global_shard(gkey.hash);
+   if (!shard) {
+      free(gkey.data);
       return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
    }
 
-   pthread_mutex_lock(mutex);
-   if (!ensure_global_heap()) {
-      pthread_mutex_unlock(mutex);
+   pthread_mutex_lock(&shard->mutex);
+
+   prev = find_global_entry(shard, &gkey);
+   is_native = (prev != NULL);
+   if (!prev && gkey.type != GLOBAL_KEY_COMPLEX) {
+      is_native = 1;
+      if (shard->heap) {
+         err = fixscript_clone_between(shard->heap, heap, params[0], &key, NULL, NULL, NULL);
+         if (!err) {
+            err = fixscript_get_hash_elem(shard->heap, shard->hash, key, &value);
+            if (err == FIXSCRIPT_ERR_KEY_NOT_FOUND) {
+               err = FIXSCRIPT_SUCCESS;
+            }
+            else {
+               is_native = 0;
+            }
+         }
+         if (err) {
+            pthread_mutex_unlock(&shard->mutex);
+            free(gkey.data);
+            return fixscript_error(heap, error, err);
+         }
+      }
+   }
+
+   if (is_native) {
+      entry = prev? *prev : add_global_entry(shard, &gkey);
+      if (entry) {
+         prev_value = entry->value.value;
+         set_global_entry_value(entry, fixscript_int((uint32_t)prev_value + (uint32_t)params[1].value), NULL);
+      }
+      pthread_mutex_unlock(&shard->mutex);
+      free(gkey.data);
+      if (!entry) {
+         return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+      }
+      return fixscript_int(prev_value);
+   }
+
+   if (!ensure_global_heap(shard)) {
+      pthread_mutex_unlock(&shard->mutex);
+      free(gkey.data);
       return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
    }
 
-   err = fixscript_clone_between(global_heap, heap, params[0], &key, NULL, NULL, NULL);
+   err = fixscript_clone_between(shard->heap, heap, params[0], &key, NULL, NULL, NULL);
    if (!err) {
-      err = fixscript_get_hash_elem(global_heap, global_hash, key, &value);
+      err = fixscript_get_hash_elem(shard->heap, shard->hash, key, &value);
       if (err == FIXSCRIPT_ERR_KEY_NOT_FOUND) {
          value = fixscript_int(0);
          err = FIXSCRIPT_SUCCESS;
@@ -5124,15 +6151,14 @@ static Value global_add(Heap *heap, Value *error, int num_params, Value *params,
    if (!err) {
       prev_value = value.value;
       value = fixscript_int((uint32_t)value.value + (uint32_t)params[1].value);
-      err = fixscript_set_hash_elem(global_heap, global_hash, key, value);
+      err = fixscript_set_hash_elem(shard->heap, shard->hash, key, value);
    }
+   pthread_mutex_unlock(&shard->mutex);
+   free(gkey.data);
+
    if (err) {
-      pthread_mutex_unlock(mutex);
       return fixscript_error(heap, error, err);
    }
-
-   pthread_mutex_unlock(mutex);
-
    return fixscript_int(prev_value);
 }
 
@@ -6068,7 +7094,7 @@ static Value channel_send(Heap *heap, Value *error, int num_params, Value *param
 #ifdef __wasm__
    ChannelSender *channel_sender;
 #endif
-   uint64_t wait_until = 0;
+   uint64_t wait_until = 0, wait_start = 0;
    
    ptr = fixscript_get_handle(heap, params[0], HANDLE_TYPE_CHANNEL, NULL);
    if (!ptr) {
@@ -6095,6 +7121,7 @@ static Value channel_send(Heap *heap, Value *error, int num_params, Value *param
    #endif
 
    if (channel->size == 0) {
+      wait_start = get_micro_time();
       while (channel->send_heap) {
          if (timeout < 0) {
             pthread_cond_wait(&channel->send_cond, &channel->mutex);
@@ -6104,6 +7131,7 @@ static Value channel_send(Heap *heap, Value *error, int num_params, Value *param
                timeout = wait_until - get_time();
             }
             if (timeout <= 0 || pthread_cond_timedwait_relative(&channel->send_cond, &channel->mutex, timeout*1000000LL) == ETIMEDOUT) {
+               channel->stats.send_blocked += get_micro_time() - wait_start;
                pthread_mutex_unlock(&channel->mutex);
                return fixscript_int(0);
             }
@@ -6142,12 +7170,15 @@ static Value channel_send(Heap *heap, Value *error, int num_params, Value *param
                   channel->send_heap = NULL;
                   unnotify_sets(channel);
                }
+               channel->stats.send_blocked += get_micro_time() - wait_start;
                pthread_mutex_unlock(&channel->mutex);
                return fixscript_int(0);
             }
          }
       }
 
+      channel->stats.sent++;
+      channel->stats.send_blocked += get_micro_time() - wait_start;
       pthread_cond_signal(&channel->send_cond);
       pthread_mutex_unlock(&channel->mutex);
       return fixscript_int(num_params == 3? 1:0);
@@ -6174,6 +7205,12 @@ static Value channel_send(Heap *heap, Value *error, int num_params, Value *param
                   err = FIXSCRIPT_ERR_OUT_OF_MEMORY;
                }
             }
+            if (!err) {
+               channel->stats.sent++;
+            }
+            if (wait_start) {
+               channel->stats.send_blocked += get_micro_time() - wait_start;
+            }
             pthread_mutex_unlock(&channel->mutex);
             if (err) {
                return fixscript_error(heap, error, err);
@@ -6206,6 +7243,9 @@ static Value channel_send(Heap *heap, Value *error, int num_params, Value *param
             channel_wake_receivers(channel);
             return fixscript_int(0);
          #else
+            if (!wait_start) {
+               wait_start = get_micro_time();
+            }
             if (timeout < 0) {
                pthread_cond_wait(&channel->send_cond, &channel->mutex);
             }
@@ -6214,6 +7254,7 @@ static Value channel_send(Heap *heap, Value *error, int num_params, Value *param
                   timeout = wait_until - get_time();
                }
                if (timeout <= 0 || pthread_cond_timedwait_relative(&channel->send_cond, &channel->mutex, timeout*1000000LL) == ETIMEDOUT) {
+                  channel->stats.send_blocked += get_micro_time() - wait_start;
                   pthread_mutex_unlock(&channel->mutex);
                   return fixscript_int(0);
                }
@@ -6328,7 +7369,7 @@ static Value channel_receive(Heap *heap, Value *error, int num_params, Value *pa
 #ifdef __wasm__
    ChannelReceiver *channel_receiver;
 #endif
-   uint64_t wait_until = 0;
+   uint64_t wait_until = 0, wait_start = 0;
    
    ptr = fixscript_get_handle(heap, params[0], HANDLE_TYPE_CHANNEL, NULL);
    if (!ptr) {
@@ -6357,6 +7398,9 @@ static Value channel_receive(Heap *heap, Value *error, int num_params, Value *pa
    if (channel->size == 0) {
       for (;;) {
          while (!channel->send_heap || channel->send_error) {
+            if (!wait_start) {
+               wait_start = get_micro_time();
+            }
             if (timeout < 0) {
                pthread_cond_wait(&channel->receive_cond, &channel->mutex);
             }
@@ -6365,6 +7409,7 @@ static Value channel_receive(Heap *heap, Value *error, int num_params, Value *pa
                   timeout = wait_until - get_time();
                }
                if (timeout <= 0 || pthread_cond_timedwait_relative(&channel->receive_cond, &channel->mutex, timeout*1000000LL) == ETIMEDOUT) {
+                  channel->stats.receive_blocked += get_micro_time() - wait_start;
                   pthread_mutex_unlock(&channel->mutex);
                   return params[2];
                }
@@ -6382,6 +7427,10 @@ static Value channel_receive(Heap *heap, Value *error, int num_params, Value *pa
 
       channel->send_heap = NULL;
       unnotify_sets(channel);
+      channel->stats.received++;
+      if (wait_start) {
+         channel->stats.receive_blocked += get_micro_time() - wait_start;
+      }
       pthread_cond_signal(&channel->send_cond2);
       pthread_mutex_unlock(&channel->mutex);
 
@@ -6427,6 +7476,10 @@ static Value channel_receive(Heap *heap, Value *error, int num_params, Value *pa
                }
                fixscript_collect_heap(channel->queue_heap);
             }
+            channel->stats.received++;
+            if (wait_start) {
+               channel->stats.receive_blocked += get_micro_time() - wait_start;
+            }
             pthread_cond_signal(&channel->send_cond);
             pthread_mutex_unlock(&channel->mutex);
             if (err) {
@@ -6468,6 +7521,9 @@ static Value channel_receive(Heap *heap, Value *error, int num_params, Value *pa
             }
             return fixscript_int(0);
          #else
+            if (!wait_start) {
+               wait_start = get_micro_time();
+            }
             if (timeout < 0) {
                pthread_cond_wait(&channel->receive_cond, &channel->mutex);
             }
@@ -6476,6 +7532,7 @@ static Value channel_receive(Heap *heap, Value *error, int num_params, Value *pa
                   timeout = wait_until - get_time();
                }
                if (timeout <= 0 || pthread_cond_timedwait_relative(&channel->receive_cond, &channel->mutex, timeout*1000000LL) == ETIMEDOUT) {
+                  channel->stats.receive_blocked += get_micro_time() - wait_start;
                   pthread_mutex_unlock(&channel->mutex);
                   return params[2];
                }
@@ -6649,6 +7706,48 @@ static Value channel_get_size(Heap *heap, Value *error, int num_params, Value *p
 }
 
 
+static Value channel_get_stats(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+   Channel *channel;
+   Value values[CHANNEL_STATS_SIZE], ret;
+   void *ptr;
+   int err, len = 0;
+   
+   ptr = fixscript_get_handle(heap, params[0], HANDLE_TYPE_CHANNEL, NULL);
+   if (!ptr) {
+      *error = fixscript_create_error_string(heap, "invalid channel handle");
+      return fixscript_int(0);
+   }
+   channel = GET_PTR(ptr);
+
+   pthread_mutex_lock(&channel->mutex);
+   values[CHANNEL_STATS_sent_messages] = fixscript_int(clamp_stats_value(channel->stats.sent));
+   values[CHANNEL_STATS_received_messages] = fixscript_int(clamp_stats_value(channel->stats.received));
+   values[CHANNEL_STATS_send_blocked_time] = fixscript_int(clamp_stats_value(channel->stats.send_blocked / 1000));
+   values[CHANNEL_STATS_receive_blocked_time] = fixscript_int(clamp_stats_value(channel->stats.receive_blocked / 1000));
+   if (channel->size > 0) {
+      if (channel->queue_heap && fixscript_get_array_length(channel->queue_heap, channel->queue, &len) != FIXSCRIPT_SUCCESS) {
+         len = 0;
+      }
+   }
+   else {
+      len = (channel->send_heap != NULL);
+   }
+   values[CHANNEL_STATS_queue_length] = fixscript_int(len);
+   pthread_mutex_unlock(&channel->mutex);
+
+   ret = fixscript_create_array(heap, CHANNEL_STATS_SIZE);
+   if (!ret.value) {
+      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+   }
+   err = fixscript_set_array_range(heap, ret, 0, CHANNEL_STATS_SIZE, values);
+   if (err) {
+      return fixscript_error(heap, error, err);
+   }
+   return ret;
+}
+
+
 static void *channel_set_handler(Heap *heap, int op, void *p1, void *p2)
 {
    ChannelSet *set = p1;
@@ -7274,6 +8373,7 @@ void fixtask_register_functions(Heap *heap, HeapCreateFunc create_func, void *cr
    fixscript_register_heap_key(&heap_create_data_key);
    fixscript_register_heap_key(&cur_task_key);
    fixscript_register_heap_key(&compute_tasks_key);
+   fixscript_register_heap_key(&compute_config_key);
    fixscript_register_heap_key(&is_queue_heap_key);
    fixscript_register_heap_key(&parent_heap_key);
    fixscript_register_heap_key(&async_integration_key);
@@ -7307,12 +8407,18 @@ void fixtask_register_functions(Heap *heap, HeapCreateFunc create_func, void *cr
    fixscript_register_native_func(heap, "task_receive_wait#1", task_receive, (void *)1);
    fixscript_register_native_func(heap, "task_receive_wait#2", task_receive, (void *)1);
    fixscript_register_native_func(heap, "task_sleep#1", sleep_func, NULL);
+   fixscript_register_native_func(heap, "task_get_stats#0", task_get_stats, NULL);
+   fixscript_register_native_func(heap, "task_get_stats#1", task_get_stats, NULL);
+   fixscript_register_native_func(heap, "task_set_stats_dump_interval#1", task_set_stats_dump_interval, NULL);
+   fixscript_register_native_func(heap, "task_set_affinity#1", task_set_affinity, NULL);
 
    fixscript_register_native_func(heap, "compute_task_run#2", compute_task_run, hc);
    fixscript_register_native_func(heap, "compute_task_run#4", compute_task_run, hc);
    fixscript_register_native_func(heap, "compute_task_check_finished#0", compute_task_check_finished, NULL);
    fixscript_register_native_func(heap, "compute_task_finish_all#0", compute_task_finish_all, NULL);
    fixscript_register_native_func(heap, "compute_task_get_core_count#0", compute_task_get_core_count, NULL);
+   fixscript_register_native_func(heap, "compute_task_set_thread_limit#1", compute_task_set_thread_limit, NULL);
+   fixscript_register_native_func(heap, "compute_task_set_affinity#1", compute_task_set_affinity, NULL);
    fixscript_register_native_func(heap, "compute_task_run_parallel#4", compute_task_run_parallel, hc);
    fixscript_register_native_func(heap, "compute_task_run_parallel#5", compute_task_run_parallel, hc);
 
@@ -7331,6 +8437,7 @@ void fixtask_register_functions(Heap *heap, HeapCreateFunc create_func, void *cr
    fixscript_register_native_func(heap, "parent_ref_get_element_size#1", parent_ref_get_element_size, NULL);
    fixscript_register_native_func(heap, "parent_ref_copy_to#5", parent_ref_copy_to, NULL);
    fixscript_register_native_func(heap, "parent_ref_extract#3", parent_ref_extract, NULL);
+   fixscript_register_native_func(heap, "parent_ref_view#1", parent_ref_view, NULL);
    fixscript_register_native_func(heap, "parent_ref_weakref_get#1", parent_ref_weakref_get, NULL);
    fixscript_register_native_func(heap, "parent_ref_hash_get#3", parent_ref_hash_get, NULL);
    fixscript_register_native_func(heap, "parent_ref_hash_contains#2", parent_ref_hash_contains, NULL);
@@ -7449,6 +8556,7 @@ void fixtask_register_functions(Heap *heap, HeapCreateFunc create_func, void *cr
    fixscript_register_native_func(heap, "channel_get_shared_count#1", channel_get_shared_count, NULL);
    fixscript_register_native_func(heap, "channel_set_size#2", channel_set_size, NULL);
    fixscript_register_native_func(heap, "channel_get_size#1", channel_get_size, NULL);
+   fixscript_register_native_func(heap, "channel_get_stats#1", channel_get_stats, NULL);
 
    fixscript_register_native_func(heap, "channel_set_create#0", channel_set_create, NULL);
    fixscript_register_native_func(heap, "channel_set_add#3", channel_set_add, NULL);
@@ -32,34 +32,70 @@
 #define STBI_ONLY_GIF
 #include "stb_image.h"
 
+typedef struct {
+   int end;
+   int x1, y1, x2, y2;
+   int dispose;
+   int delay;
+   Value img;
+} GIFFrame;
+
 typedef struct {
    SharedArrayHandle *sah;
    stbi__context s;
    stbi__gif g;
+   GIFFrame *frames;
+   int num_frames, frames_cap;
+   int complete;
+   int cur_frame;
+   int num_cached, cache_step;
+   int64_t cache_size, cache_limit;
    Value img;
 } GIF;
 
-#define NUM_HANDLE_TYPES 1
-#define HANDLE_TYPE_GIF (handles_offset+0)
+typedef struct {
+   volatile int refcnt;
+   volatile int done;
+   SharedArrayHandle *sah;
+   int max_width, max_height;
+   uint32_t *pixels;
+   int width, height;
+   char error[128];
+} ImageDecode;
+
+#define NUM_HANDLE_TYPES 2
+#define HANDLE_TYPE_GIF          (handles_offset+0)
+#define HANDLE_TYPE_IMAGE_DECODE (handles_offset+1)
+
+#define MAX_IMAGE_DIM 32768
+#define GIF_CACHE_LIMIT (16*1024*1024)
 
 static volatile int handles_offset = 0;
 
 
-static uint32_t div255(uint32_t a)
+static void gif_reset_decoder(GIF *gif)
 {
-   return ((a << 8) + a + 255) >> 16;
+   free(gif->g.out);
+   free(gif->g.history);
+   free(gif->g.background);
+   memset(&gif->g, 0, sizeof(gif->g));
+   gif->s.img_buffer = gif->s.img_buffer_original;
+   gif->cur_frame = -1;
 }
 
 
 static void *gif_handler(Heap *heap, int op, void *p1, void *p2)
 {
    GIF *gif = p1;
+   int i;
 
    switch (op) {
       case HANDLE_OP_FREE:
-         free(gif->g.out);
-         free(gif->g.history);
-         free(gif->g.background);
+         gif_reset_decoder(gif);
+         for (i=0; i<gif->num_frames; i++) {
+            fixscript_unref(heap, gif->frames[i].img);
+         }
+         free(gif->frames);
          fixscript_unref_shared_array(gif->sah);
          fixscript_unref(heap, gif->img);
          free(gif);
@@ -76,7 +112,7 @@ static Value gif_create(Heap *heap, Value *error, int num_params, Value *params,
    SharedArrayHandle *sah;
    Value ret;
    void *ptr;
-   int len, elem_size;
+   int len, elem_size, cache_limit = GIF_CACHE_LIMIT;
 
    sah = fixscript_get_shared_array_handle(heap, params[0], -1, NULL);
    if (!sah) {
@@ -90,6 +126,14 @@ static Value gif_create(Heap *heap, Value *error, int num_params, Value *params,
       return fixscript_int(0);
    }
 
+   if (num_params == 2) {
+      cache_limit = fixscript_get_int(params[1]);
+      if (cache_limit < 0) {
+         *error = fixscript_create_error_string(heap, "invalid cache limit");
+         return fixscript_int(0);
+      }
+   }
+
    gif = calloc(1, sizeof(GIF));
    if (!gif) {
       return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
@@ -104,6 +148,9 @@ static Value gif_create(Heap *heap, Value *error, int num_params, Value *params,
 
    gif->sah = sah;
    fixscript_ref_shared_array(gif->sah);
+   gif->cur_frame = -1;
+   gif->cache_step = 1;
+   gif->cache_limit = cache_limit;
 
    ret = fixscript_create_value_handle(heap, HANDLE_TYPE_GIF, gif, gif_handler);
    if (!ret.value) {
@@ -113,36 +160,155 @@ static Value gif_create(Heap *heap, Value *error, int num_params, Value *params,
 }
 
 
-static Value gif_reset(Heap *heap, Value *error, int num_params, Value *params, void *data)
+// decodes the frame following the current one, returns 0 at the end of the animation and -1 on error:
+static int gif_decode_next(GIF *gif)
 {
-   GIF *gif;
-   void *ptr;
-   int len;
+   stbi__gif *g = &gif->g;
+   GIFFrame *frame, *new_frames;
+   stbi_uc *u;
+   int i, y, idx, comp, new_cap, row_len;
+
+   // stb_image doesn't implement the disposal methods the way browsers do, handle them here:
+   if (gif->cur_frame >= 0) {
+      frame = &gif->frames[gif->cur_frame];
+      row_len = (frame->x2 - frame->x1) * 4;
+      if (frame->dispose == 2 || frame->dispose == 3) {
+         for (y=frame->y1; y<frame->y2; y++) {
+            idx = (y * g->w + frame->x1) * 4;
+            if (frame->dispose == 2) {
+               memset(g->out + idx, 0, row_len);
+            }
+            else {
+               memcpy(g->out + idx, g->background + idx, row_len);
+            }
+         }
+      }
+   }
 
-   gif = fixscript_get_handle(heap, params[0], HANDLE_TYPE_GIF, NULL);
-   if (!gif) {
-      *error = fixscript_create_error_string(heap, "invalid GIF handle");
-      return fixscript_int(0);
+   // the graphic control extension applies to a single frame only:
+   if (g->transparent >= 0) {
+      g->pal[g->transparent][3] = 255;
+      g->transparent = -1;
    }
+   g->eflags = 0;
+   g->delay = 0;
 
-   free(gif->g.out);
-   free(gif->g.history);
-   free(gif->g.background);
-   memset(&gif->g, 0, sizeof(gif->g));
-   ptr = fixscript_get_shared_array_handle_data(gif->sah, &len, NULL, NULL, -1, NULL);
-   stbi__start_mem(&gif->s, ptr, len);
-   stbi__gif_test(&gif->s);
-   return fixscript_int(0);
+   u = stbi__gif_load_next(&gif->s, g, &comp, 4, NULL);
+   if (u == (stbi_uc *)&gif->s) {
+      return 0;
+   }
+   if (!u) {
+      return -1;
+   }
+
+   idx = gif->cur_frame+1;
+   if (idx == 0 && g->bgindex > 0) {
+      // browsers ignore the background color, keep the pixels not drawn by the first frame transparent:
+      for (i=0; i<g->w*g->h; i++) {
+         if (!g->history[i]) {
+            memset(g->out + i*4, 0, 4);
+         }
+      }
+   }
+
+   if (idx == gif->num_frames) {
+      if (gif->num_frames == gif->frames_cap) {
+         new_cap = gif->frames_cap? gif->frames_cap*2 : 16;
+         new_frames = realloc(gif->frames, new_cap * sizeof(GIFFrame));
+         if (!new_frames) {
+            stbi__err("outofmem", "Out of memory");
+            return -1;
+         }
+         gif->frames = new_frames;
+         gif->frames_cap = new_cap;
+      }
+      frame = &gif->frames[gif->num_frames++];
+      memset(frame, 0, sizeof(GIFFrame));
+      frame->end = gif->s.img_buffer - gif->s.img_buffer_original;
+      frame->x1 = g->start_x / 4;
+      frame->y1 = g->start_y / g->line_size;
+      frame->x2 = g->max_x / 4;
+      frame->y2 = g->max_y / g->line_size;
+      frame->dispose = (g->eflags >> 2) & 7;
+      frame->delay = g->delay;
+   }
+
+   gif->cur_frame = idx;
+   return 1;
+}
+
+
+// continues decoding from the given cached frame (or from the start when negative):
+static void gif_restart(Heap *heap, GIF *gif, int frame_idx)
+{
+   stbi__gif *g = &gif->g;
+   uint32_t *pixels;
+   int pos;
+
+   if (frame_idx < 0) {
+      memset(g->out, 0, g->w * g->h * 4);
+      pos = 13;
+      if (g->flags & 0x80) {
+         pos += 3 * (2 << (g->flags & 7));
+      }
+   }
+   else {
+      // frames contain only fully opaque or fully transparent pixels, the conversion is lossless:
+      fiximage_get_data(heap, gif->frames[frame_idx].img, NULL, NULL, NULL, &pixels, NULL, NULL);
+      fiximage_swap_rb((uint32_t *)g->out, pixels, g->w * g->h);
+      pos = gif->frames[frame_idx].end;
+   }
+   gif->s.img_buffer = gif->s.img_buffer_original + pos;
+   gif->cur_frame = frame_idx;
+}
+
+
+// stores the current frame in the cache, when over the limit only every n-th frame is kept:
+static int gif_cache_frame(Heap *heap, GIF *gif)
+{
+   GIFFrame *frame;
+   uint32_t *pixels;
+   int i, frame_size = gif->g.w * gif->g.h * 4;
+
+   while (gif->cache_size + frame_size > gif->cache_limit && gif->cache_step <= gif->num_frames) {
+      gif->cache_step *= 2;
+      for (i=0; i<gif->num_frames; i++) {
+         frame = &gif->frames[i];
+         if (frame->img.value && i % gif->cache_step != 0) {
+            fixscript_unref(heap, frame->img);
+            frame->img = fixscript_int(0);
+            gif->cache_size -= frame_size;
+            gif->num_cached--;
+         }
+      }
+   }
+
+   if (gif->cur_frame % gif->cache_step != 0) {
+      return 1;
+   }
+
+   frame = &gif->frames[gif->cur_frame];
+   frame->img = fiximage_create(heap, gif->g.w, gif->g.h);
+   if (!frame->img.value) {
+      return 0;
+   }
+   fixscript_ref(heap, frame->img);
+   fiximage_get_data(heap, frame->img, NULL, NULL, NULL, &pixels, NULL, NULL);
+   fiximage_premultiply_rgba(pixels, gif->g.out, gif->g.w * gif->g.h);
+   gif->cache_size += frame_size;
+   gif->num_cached++;
+   return 1;
 }
 
 
-static Value gif_next(Heap *heap, Value *error, int num_params, Value *params, void *data)
+// returns the composited frame with the delay passed in the error value, the returned images must not be modified:
+static Value gif_get_frame(Heap *heap, Value *error, int num_params, Value *params, void *data)
 {
    GIF *gif;
-   stbi_uc *u = NULL;
+   GIFFrame *frame;
    uint32_t *pixels = NULL;
    char buf[128];
-   int i, comp, r, g, b, a;
+   int i, idx, start, ret;
 
    gif = fixscript_get_handle(heap, params[0], HANDLE_TYPE_GIF, NULL);
    if (!gif) {
@@ -150,35 +316,157 @@ static Value gif_next(Heap *heap, Value *error, int num_params, Value *params, v
       return fixscript_int(0);
    }
 
-   u = stbi__gif_load_next(&gif->s, &gif->g, &comp, 4, /*two_back*/NULL);
-   if (!gif->img.value && gif->g.out) {
+   idx = fixscript_get_int(params[1]);
+   if (idx < 0) {
+      *error = fixscript_create_error_string(heap, "invalid frame index");
+      return fixscript_int(0);
+   }
+
+   if (gif->complete && idx >= gif->num_frames) {
+      return fixscript_int(0);
+   }
+
+   if (idx >= gif->num_frames || !gif->frames[idx].img.value) {
+      if (gif->g.out) {
+         start = -1;
+         for (i=(idx < gif->num_frames? idx : gif->num_frames)-1; i>=0; i--) {
+            frame = &gif->frames[i];
+            if (frame->img.value && frame->dispose != 3) {
+               start = i;
+               break;
+            }
+         }
+         if (gif->cur_frame >= idx || start > gif->cur_frame) {
+            gif_restart(heap, gif, start);
+         }
+      }
+
+      while (gif->cur_frame < idx) {
+         ret = gif_decode_next(gif);
+         if (ret < 0 && gif->num_frames == 0) {
+            gif_reset_decoder(gif);
+            snprintf(buf, sizeof(buf), "decode error (%s)", stbi_failure_reason());
+            *error = fixscript_create_error_string(heap, buf);
+            return fixscript_int(0);
+         }
+         if (ret <= 0) {
+            // broken frames are treated as the end of the animation:
+            gif->complete = 1;
+            gif->cur_frame = gif->num_frames;
+            if (gif->num_cached == gif->num_frames) {
+               gif_reset_decoder(gif);
+            }
+            return fixscript_int(0);
+         }
+         if (!gif->frames[gif->cur_frame].img.value && !gif_cache_frame(heap, gif)) {
+            return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+         }
+      }
+   }
+
+   frame = &gif->frames[idx];
+   *error = fixscript_int(frame->delay);
+   if (frame->img.value) {
+      return frame->img;
+   }
+
+   if (!gif->img.value) {
       gif->img = fiximage_create(heap, gif->g.w, gif->g.h);
       if (!gif->img.value) {
          return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
       }
       fixscript_ref(heap, gif->img);
    }
-   if (u == (stbi_uc *)&gif->s) {
-      return fixscript_int(0);
-   }
-   
+   fiximage_get_data(heap, gif->img, NULL, NULL, NULL, &pixels, NULL, NULL);
+   fiximage_premultiply_rgba(pixels, gif->g.out, gif->g.w * gif->g.h);
+   return gif->img;
+}
+
+
+// decodes the image and reduces it by the biggest power of two that keeps it at least at the requested
+// size (when given), the result is premultiplied:
+static uint32_t *decode_image(const unsigned char *buf, int len, int max_width, int max_height, int *width_out, int *height_out, char *error, int error_len)
+{
+   stbi_uc *u;
+   uint32_t *pixels, *sums = NULL, *row = NULL, c;
+   int i, x, y, width, height, factor, dest_width, dest_height, cnt_x, cnt_y, cnt, r, g, b, a;
+
+   u = stbi_load_from_memory(buf, len, &width, &height, NULL, 4);
    if (!u) {
-      snprintf(buf, sizeof(buf), "decode error (%s)", stbi_failure_reason());
-      *error = fixscript_create_error_string(heap, buf);
-      return fixscript_int(0);
+      snprintf(error, error_len, "can't load image (%s)", stbi_failure_reason());
+      return NULL;
    }
 
-   fiximage_get_data(heap, gif->img, NULL, NULL, NULL, &pixels, NULL, NULL);
-   for (i=0; i<gif->g.w*gif->g.h; i++) {
-      r = gif->g.out[i*4+0];
-      g = gif->g.out[i*4+1];
-      b = gif->g.out[i*4+2];
-      a = gif->g.out[i*4+3];
-      pixels[i] = (a<<24) | (r<<16) | (g<<8) | b;
+   factor = 1;
+   if (max_width > 0 && max_height > 0) {
+      while (factor < 256 && width / (factor*2) >= max_width && height / (factor*2) >= max_height) {
+         factor *= 2;
+      }
+   }
+   while (factor < 256 && ((width + factor - 1) / factor > MAX_IMAGE_DIM || (height + factor - 1) / factor > MAX_IMAGE_DIM)) {
+      factor *= 2;
    }
+   dest_width = (width + factor - 1) / factor;
+   dest_height = (height + factor - 1) / factor;
 
-   *error = fixscript_int(gif->g.delay);
-   return gif->img;
+   if (dest_width > MAX_IMAGE_DIM || dest_height > MAX_IMAGE_DIM) {
+      free(u);
+      snprintf(error, error_len, "image dimensions are too big");
+      return NULL;
+   }
+
+   if (factor == 1) {
+      // the decoded buffer is premultiplied in place and used directly:
+      pixels = (uint32_t *)u;
+      fiximage_premultiply_rgba(pixels, u, width*height);
+      *width_out = width;
+      *height_out = height;
+      return pixels;
+   }
+
+   pixels = malloc(dest_width * dest_height * sizeof(uint32_t));
+   sums = malloc(dest_width * 4 * sizeof(uint32_t));
+   row = malloc(width * sizeof(uint32_t));
+   if (!pixels || !sums || !row) {
+      free(pixels);
+      free(sums);
+      free(row);
+      free(u);
+      snprintf(error, error_len, "out of memory");
+      return NULL;
+   }
+
+   // box filter of the premultiplied values:
+   for (y=0; y<dest_height; y++) {
+      memset(sums, 0, dest_width * 4 * sizeof(uint32_t));
+      cnt_y = height - y*factor < factor? height - y*factor : factor;
+      for (i=0; i<cnt_y; i++) {
+         fiximage_premultiply_rgba(row, u + (y*factor + i) * width * 4, width);
+         for (x=0; x<width; x++) {
+            c = row[x];
+            sums[(x/factor)*4+0] += (c >> 16) & 0xFF;
+            sums[(x/factor)*4+1] += (c >>  8) & 0xFF;
+            sums[(x/factor)*4+2] += (c >>  0) & 0xFF;
+            sums[(x/factor)*4+3] += (c >> 24) & 0xFF;
+         }
+      }
+      for (x=0; x<dest_width; x++) {
+         cnt_x = width - x*factor < factor? width - x*factor : factor;
+         cnt = cnt_x * cnt_y;
+         r = (sums[x*4+0] + cnt/2) / cnt;
+         g = (sums[x*4+1] + cnt/2) / cnt;
+         b = (sums[x*4+2] + cnt/2) / cnt;
+         a = (sums[x*4+3] + cnt/2) / cnt;
+         pixels[y*dest_width+x] = (a << 24) | (r << 16) | (g << 8) | b;
+      }
+   }
+
+   free(sums);
+   free(row);
+   free(u);
+   *width_out = dest_width;
+   *height_out = dest_height;
+   return pixels;
 }
 
 
@@ -186,10 +474,9 @@ static Value load_image(Heap *heap, Value *error, int num_params, Value *params,
 {
    Value ret;
    void *ptr;
-   stbi_uc *u;
    char buf[128];
-   uint32_t *pixels = NULL;
-   int i, len, elem_size, width, height, r, g, b, a;
+   uint32_t *pixels;
+   int len, elem_size, width, height, max_width = 0, max_height = 0;
 
    ptr = fixscript_get_shared_array_data(heap, params[0], &len, &elem_size, NULL, -1, NULL);
    if (!ptr || elem_size != 1) {
@@ -197,34 +484,137 @@ static Value load_image(Heap *heap, Value *error, int num_params, Value *params,
       return fixscript_int(0);
    }
 
-   u = stbi_load_from_memory(ptr, len, &width, &height, NULL, 4);
-   if (!u) {
-      snprintf(buf, sizeof(buf), "can't load image (%s)", stbi_failure_reason());
+   if (num_params == 3) {
+      max_width = fixscript_get_int(params[1]);
+      max_height = fixscript_get_int(params[2]);
+   }
+
+   pixels = decode_image(ptr, len, max_width, max_height, &width, &height, buf, sizeof(buf));
+   if (!pixels) {
       *error = fixscript_create_error_string(heap, buf);
       return fixscript_int(0);
    }
 
-   ret = fiximage_create(heap, width, height);
+   ret = fiximage_create_from_pixels(heap, width, height, width, pixels, free, pixels, -1);
    if (!ret.value) {
-      free(u);
       return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
    }
+   return ret;
+}
 
-   fiximage_get_data(heap, ret, NULL, NULL, NULL, &pixels, NULL, NULL);
 
-   for (i=0; i<width*height; i++) {
-      r = u[i*4+0];
-      g = u[i*4+1];
-      b = u[i*4+2];
-      a = u[i*4+3];
+static void image_decode_unref(ImageDecode *decode)
+{
+   if (__sync_sub_and_fetch(&decode->refcnt, 1) == 0) {
+      fixscript_unref_shared_array(decode->sah);
+      free(decode->pixels);
+      free(decode);
+   }
+}
+
+
+static void image_decode_run(void *data)
+{
+   ImageDecode *decode = data;
+   void *ptr;
+   int len;
+
+   ptr = fixscript_get_shared_array_handle_data(decode->sah, &len, NULL, NULL, -1, NULL);
+   decode->pixels = decode_image(ptr, len, decode->max_width, decode->max_height, &decode->width, &decode->height, decode->error, sizeof(decode->error));
+   __sync_synchronize();
+   decode->done = 1;
+   image_decode_unref(decode);
+}
+
 
-      r = div255(r * a);
-      g = div255(g * a);
-      b = div255(b * a);
-      pixels[i] = (a << 24) | (r << 16) | (g << 8) | b;
+static void *image_decode_handler(Heap *heap, int op, void *p1, void *p2)
+{
+   switch (op) {
+      case HANDLE_OP_FREE:
+         image_decode_unref(p1);
+         break;
    }
 
-   free(u);
+   return NULL;
+}
+
+
+static Value image_decode_start(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+   ImageDecode *decode;
+   SharedArrayHandle *sah;
+   Value ret;
+   int elem_size;
+
+   sah = fixscript_get_shared_array_handle(heap, params[0], -1, NULL);
+   if (!sah) {
+      *error = fixscript_create_error_string(heap, "invalid shared array");
+      return fixscript_int(0);
+   }
+
+   fixscript_get_shared_array_handle_data(sah, NULL, &elem_size, NULL, -1, NULL);
+   if (elem_size != 1) {
+      *error = fixscript_create_error_string(heap, "invalid shared array");
+      return fixscript_int(0);
+   }
+
+   decode = calloc(1, sizeof(ImageDecode));
+   if (!decode) {
+      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+   }
+
+   decode->refcnt = 1;
+   decode->sah = sah;
+   decode->max_width = fixscript_get_int(params[1]);
+   decode->max_height = fixscript_get_int(params[2]);
+   fixscript_ref_shared_array(sah);
+
+   // the handle function releases the only reference when the handle can't be created:
+   ret = fixscript_create_value_handle(heap, HANDLE_TYPE_IMAGE_DECODE, decode, image_decode_handler);
+   if (!ret.value) {
+      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+   }
+
+   // the decoding has its own reference:
+   __sync_add_and_fetch(&decode->refcnt, 1);
+   if (!fiximage_run_in_background(image_decode_run, decode)) {
+      image_decode_run(decode);
+   }
+   return ret;
+}
+
+
+static Value image_decode_get(Heap *heap, Value *error, int num_params, Value *params, void *data)
+{
+   ImageDecode *decode;
+   uint32_t *pixels;
+   Value ret;
+
+   decode = fixscript_get_handle(heap, params[0], HANDLE_TYPE_IMAGE_DECODE, NULL);
+   if (!decode) {
+      *error = fixscript_create_error_string(heap, "invalid image decode handle");
+      return fixscript_int(0);
+   }
+
+   if (!decode->done) {
+      return fixscript_int(0);
+   }
+   __sync_synchronize();
+
+   if (!decode->pixels) {
+      *error = fixscript_create_error_string(heap, decode->error);
+      return fixscript_int(0);
+   }
+
+   // the pixels are passed to the image, the decode must not free them afterwards:
+   pixels = decode->pixels;
+   decode->pixels = NULL;
+   snprintf(decode->error, sizeof(decode->error), "image already retrieved");
+
+   ret = fiximage_create_from_pixels(heap, decode->width, decode->height, decode->width, pixels, free, pixels, -1);
+   if (!ret.value) {
+      return fixscript_error(heap, error, FIXSCRIPT_ERR_OUT_OF_MEMORY);
+   }
    return ret;
 }
 
@@ -234,7 +624,10 @@ void register_image_functions(Heap *heap)
    fixscript_register_handle_types(&handles_offset, NUM_HANDLE_TYPES);
 
    fixscript_register_native_func(heap, "gif_create#1", gif_create, NULL);
-   fixscript_register_native_func(heap, "gif_reset#1", gif_reset, NULL);
-   fixscript_register_native_func(heap, "gif_next#1", gif_next, NULL);
+   fixscript_register_native_func(heap, "gif_create#2", gif_create, NULL);
+   fixscript_register_native_func(heap, "gif_get_frame#2", gif_get_frame, NULL);
    fixscript_register_native_func(heap, "load_image#1", load_image, NULL);
+   fixscript_register_native_func(heap, "load_image#3", load_image, NULL);
+   fixscript_register_native_func(heap, "image_decode_start#3", image_decode_start, NULL);
+   fixscript_register_native_func(heap, "image_decode_get#1", image_decode_get, NULL);
 }